@@ -1,7 +1,7 @@
 #!/bin/sh
 for file in include/libipset/*.h; do
     case $file in
-    */ui.h) continue ;;
+    */ui.h|*/services.h) continue ;;
     esac
     grep ^extern $file | sed -r -e 's/\(.*//' -e 's/.* \*?//' | egrep -v '\[|\;'
 done | while read symbol; do
@@ -58,6 +58,23 @@ enum ipset_keywords {
 	IPSET_ARG_SKBQUEUE,			/* skbqueue */
 	IPSET_ARG_BUCKETSIZE,			/* bucketsize */
 	IPSET_ARG_INITVAL,			/* initval */
+	IPSET_ARG_LPM,				/* lpm */
+	IPSET_ARG_PERCPU,			/* percpu */
+	IPSET_ARG_BLOOM,			/* bloom */
+	IPSET_ARG_HASHFN,			/* hashfn */
+	IPSET_ARG_PREALLOC,			/* prealloc */
+	IPSET_ARG_REGIONBITS,			/* regionbits */
+	IPSET_ARG_NUMA,				/* numa */
+	IPSET_ARG_INDEX,			/* index */
+	IPSET_ARG_SAMPLE,			/* sample */
+	IPSET_ARG_AGGREGATE,			/* aggregate */
+	IPSET_ARG_DISTINCT,			/* distinct */
+	IPSET_ARG_ADT_DISTINCT,			/* distinct */
+	IPSET_ARG_RATE,				/* rate */
+	IPSET_ARG_BURST,			/* burst */
+	IPSET_ARG_FAMILY_INET46,		/* family */
+	IPSET_ARG_CTEVENTS,			/* ctevents */
+	IPSET_ARG_CTDIR,			/* ctdir */
 	IPSET_ARG_MAX,
 };
 
@@ -9,6 +9,8 @@
 
 #include <stdbool.h>				/* bool */
 #include <libipset/nf_inet_addr.h>		/* union nf_inet_addr */
+#include <libipset/linux_ip_set.h>		/* IPSET_ERR_TYPE_SPECIFIC */
+#include <libipset/linux_ip_set_hash.h>		/* IPSET_LOOKUP_HIST */
 
 /* Data options */
 enum ipset_opt {
@@ -78,10 +80,71 @@ enum ipset_opt {
 	IPSET_OPT_REVISION,
 	IPSET_OPT_REVISION_MIN,
 	IPSET_OPT_INDEX,
+	/* Create-specific options, after the internal ones */
+	IPSET_OPT_LPM,
+	IPSET_OPT_PERCPU,
+	IPSET_OPT_BLOOM,
+	/* Create-specific options, after the internal ones, by the kernel */
+	IPSET_OPT_BLOOM_FPR,
+	/* Create-specific options, after the internal ones */
+	IPSET_OPT_HASHFN,
+	IPSET_OPT_PREALLOC,
+	IPSET_OPT_REGIONBITS,
+	/* Create-specific options, after the internal ones, by the kernel */
+	IPSET_OPT_LOCKSTAT,
+	/* Extended options, beyond the range of IPSET_FLAG(): these cannot
+	 * be used in the option masks of the set types.
+	 */
+	IPSET_OPT_EXT = 64,
+	IPSET_OPT_NUMA = IPSET_OPT_EXT,
+	IPSET_OPT_MERGED_INDEX,
+	IPSET_OPT_SAMPLE,
+	IPSET_OPT_EPOCH,
+	IPSET_OPT_LOOKUPSTAT,
+	IPSET_OPT_MEMSTAT,
+	IPSET_OPT_AGGREGATE,
+	IPSET_OPT_DISTINCT,
+	/* ADT-specific option, filled out by the kernel */
+	IPSET_OPT_ADT_DISTINCT,
+	/* Create and ADT options */
+	IPSET_OPT_RATE,
+	IPSET_OPT_BURST,
+	/* Create-specific options, continued */
+	IPSET_OPT_CTEVENTS,
+	IPSET_OPT_CTDIR,
+	/* Create-specific option, filled out by the kernel */
+	IPSET_OPT_TABLEPAGES,
 	IPSET_OPT_MAX,
 };
 
+/* Region lock statistics of hash sets, filled out by the kernel */
+struct ipset_lockstat {
+	uint64_t acquired;			/* lock acquisitions */
+	uint64_t contended;			/* contended acquisitions */
+	uint64_t wait;				/* wait time in ns */
+	uint64_t hold;				/* hold time in ns */
+};
+
+/* Lookup statistics of hash sets, filled out by the kernel */
+struct ipset_lookupstat {
+	uint64_t tests;				/* lookups */
+	uint64_t hits;				/* matching lookups */
+	uint64_t misses;			/* not matching lookups */
+	uint64_t probes[IPSET_LOOKUP_HIST];	/* by the buckets probed */
+	uint64_t compares[IPSET_LOOKUP_HIST];	/* by the compared elements */
+};
+
+/* Memory usage of hash sets by components, filled out by the kernel */
+struct ipset_memstat {
+	uint64_t table;				/* bucket pointers, locks */
+	uint64_t buckets;			/* buckets */
+	uint64_t extensions;			/* extensions of the elements */
+	uint64_t comments;			/* comment strings */
+	uint64_t pending;			/* waiting for a grace period */
+};
+
 #define IPSET_FLAG(opt)		(1ULL << (opt))
+#define IPSET_EXT_FLAG(opt)	(1ULL << ((opt) - IPSET_OPT_EXT))
 #define IPSET_FLAGS_ALL		(~0ULL)
 
 #define IPSET_CREATE_FLAGS		\
@@ -105,7 +168,15 @@ enum ipset_opt {
 	| IPSET_FLAG(IPSET_OPT_COUNTERS)\
 	| IPSET_FLAG(IPSET_OPT_CREATE_COMMENT)\
 	| IPSET_FLAG(IPSET_OPT_FORCEADD)\
-	| IPSET_FLAG(IPSET_OPT_SKBINFO))
+	| IPSET_FLAG(IPSET_OPT_SKBINFO)	\
+	| IPSET_FLAG(IPSET_OPT_LPM)	\
+	| IPSET_FLAG(IPSET_OPT_PERCPU)	\
+	| IPSET_FLAG(IPSET_OPT_BLOOM)	\
+	| IPSET_FLAG(IPSET_OPT_HASHFN)	\
+	| IPSET_FLAG(IPSET_OPT_PREALLOC)\
+	| IPSET_FLAG(IPSET_OPT_REGIONBITS)\
+	| IPSET_FLAG(IPSET_OPT_BLOOM_FPR)\
+	| IPSET_FLAG(IPSET_OPT_LOCKSTAT))
 
 #define IPSET_ADT_FLAGS			\
 	(IPSET_FLAG(IPSET_OPT_IP)	\
@@ -146,6 +217,12 @@ extern bool ipset_data_flags_test(const struct ipset_data *data,
 				  uint64_t flags);
 extern void ipset_data_flags_set(struct ipset_data *data, uint64_t flags);
 extern void ipset_data_flags_unset(struct ipset_data *data, uint64_t flags);
+extern bool ipset_data_ext_flags_test(const struct ipset_data *data,
+				      uint64_t flags);
+extern void ipset_data_ext_flags_set(struct ipset_data *data,
+				     uint64_t flags);
+extern void ipset_data_ext_flags_unset(struct ipset_data *data,
+				       uint64_t flags);
 extern bool ipset_data_ignored(struct ipset_data *data, enum ipset_opt opt);
 extern bool ipset_data_test_ignored(struct ipset_data *data,
 				    enum ipset_opt opt);
@@ -158,6 +235,8 @@ extern const void *ipset_data_get(const struct ipset_data *data,
 static inline bool
 ipset_data_test(const struct ipset_data *data, enum ipset_opt opt)
 {
+	if (opt >= IPSET_OPT_EXT)
+		return ipset_data_ext_flags_test(data, IPSET_EXT_FLAG(opt));
 	return ipset_data_flags_test(data, IPSET_FLAG(opt));
 }
 
@@ -51,6 +51,15 @@ extern bool ipset_match_option(const char *arg, const char * const name[]);
 extern bool ipset_match_envopt(const char *arg, const char * const name[]);
 extern void ipset_port_usage(void);
 extern int ipset_parse_filename(struct ipset *ipset, int opt, const char *str);
+extern int ipset_parse_jobs(struct ipset *ipset, int opt, const char *str);
+extern int ipset_parse_changed(struct ipset *ipset, int opt, const char *str);
+extern int ipset_parse_top(struct ipset *ipset, int opt, const char *str);
+extern int ipset_parse_match(struct ipset *ipset, int opt, const char *str);
+extern int ipset_parse_regex(struct ipset *ipset, int opt, const char *str);
+extern int ipset_parse_header(struct ipset *ipset, int opt, const char *str);
+extern int ipset_parse_aggregate(struct ipset *ipset, int opt, const char *str);
+extern int ipset_parse_flower(struct ipset *ipset, int opt, const char *str);
+extern int ipset_parse_server(struct ipset *ipset, int opt, const char *str);
 extern int ipset_parse_output(struct ipset *ipset,
 			      int opt, const char *str);
 extern int ipset_envopt_parse(struct ipset *ipset,
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef __IP_SET_RANGE_H
+#define __IP_SET_RANGE_H
+
+
+
+/* Range type specific error codes */
+enum {
+	/* Set is full */
+	IPSET_ERR_RANGE_FULL = IPSET_ERR_TYPE_SPECIFIC,
+};
+
+
+#endif /* __IP_SET_RANGE_H */
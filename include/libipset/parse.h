@@ -54,6 +54,14 @@ extern int ipset_parse_tcp_udp_port(struct ipset_session *session,
 				    enum ipset_opt opt, const char *str);
 extern int ipset_parse_family(struct ipset_session *session,
 			      enum ipset_opt opt, const char *str);
+extern int ipset_parse_hashfn(struct ipset_session *session,
+			      enum ipset_opt opt, const char *str);
+extern int ipset_parse_numa(struct ipset_session *session,
+			    enum ipset_opt opt, const char *str);
+extern int ipset_parse_ctevents(struct ipset_session *session,
+				enum ipset_opt opt, const char *str);
+extern int ipset_parse_ctdir(struct ipset_session *session,
+			     enum ipset_opt opt, const char *str);
 extern int ipset_parse_ip(struct ipset_session *session,
 			  enum ipset_opt opt, const char *str);
 extern int ipset_parse_single_ip(struct ipset_session *session,
@@ -106,6 +114,8 @@ extern int ipset_parse_skbprio(struct ipset_session *session,
 			       enum ipset_opt opt, const char *str);
 extern int ipset_parse_ignored(struct ipset_session *session,
 			       enum ipset_opt opt, const char *str);
+extern int ipset_parse_listed(struct ipset_session *session,
+			      enum ipset_opt opt, const char *str);
 extern int ipset_parse_elem(struct ipset_session *session,
 			    bool optional, const char *str);
 extern int ipset_call_parser(struct ipset_session *session,
@@ -118,6 +128,8 @@ extern int ipset_parse_iptimeout(struct ipset_session *session,
 extern int ipset_parse_name_compat(struct ipset_session *session,
 				   enum ipset_opt opt, const char *str);
 
+extern void ipset_resolved_fini(void);
+
 #ifdef __cplusplus
 }
 #endif
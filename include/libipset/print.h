@@ -23,6 +23,18 @@ extern int ipset_print_ether(char *buf, unsigned int len,
 extern int ipset_print_family(char *buf, unsigned int len,
 			      const struct ipset_data *data,
 			      enum ipset_opt opt, uint8_t env);
+extern int ipset_print_hashfn(char *buf, unsigned int len,
+			      const struct ipset_data *data,
+			      enum ipset_opt opt, uint8_t env);
+extern int ipset_print_numa(char *buf, unsigned int len,
+			    const struct ipset_data *data,
+			    enum ipset_opt opt, uint8_t env);
+extern int ipset_print_ctevents(char *buf, unsigned int len,
+				const struct ipset_data *data,
+				enum ipset_opt opt, uint8_t env);
+extern int ipset_print_ctdir(char *buf, unsigned int len,
+			     const struct ipset_data *data,
+			     enum ipset_opt opt, uint8_t env);
 extern int ipset_print_type(char *buf, unsigned int len,
 			    const struct ipset_data *data,
 			    enum ipset_opt opt, uint8_t env);
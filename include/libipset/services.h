@@ -0,0 +1,26 @@
+/* Copyright 2007-2010 Jozsef Kadlecsik (kadlec@netfilter.org)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef LIBIPSET_SERVICES_H
+#define LIBIPSET_SERVICES_H
+
+#include <stdint.h>				/* uintxx_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const char *ipset_proto_name(uint8_t proto);
+extern int ipset_proto_number(const char *name, uint8_t *proto);
+extern int ipset_service_port(const char *name, const char *proto,
+			      uint16_t *port);
+extern void ipset_services_fini(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBIPSET_SERVICES_H */
@@ -16,10 +16,21 @@
 /* Report and output buffer sizes */
 #define IPSET_ERRORBUFLEN		1024
 #define IPSET_OUTBUFLEN			8192
+/* Max kernel message buffer size: nested attribute lengths are 16 bits */
+#define IPSET_BUFSIZE_MAX		65536
 
 struct ipset_session;
 struct ipset_data;
 
+/* Threading rules: a session must be used by one thread at a time.
+ * Sessions on different threads, each with its own netlink socket,
+ * may run in parallel when the set types are loaded by
+ * ipset_load_types() before the threads are started: the registry of
+ * the types is only sorted, under a lock, at the first lookup
+ * afterwards. The set cache, the resolved
+ * hostnames and the protocol and service tables are kept per thread
+ * and are released by ipset_session_fini() in the thread. */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,6 +43,8 @@ extern const struct ipset_type *
 	ipset_saved_type(const struct ipset_session *session);
 extern void ipset_session_lineno(struct ipset_session *session,
 				 uint32_t lineno);
+extern uint32_t ipset_session_report_lineno(
+	const struct ipset_session *session);
 extern void * ipset_session_printf_private(struct ipset_session *session);
 
 enum ipset_err_type {
@@ -84,6 +97,24 @@ enum ipset_envopt {
 	IPSET_ENV_LIST_SETNAME	= (1 << IPSET_ENV_BIT_LIST_SETNAME),
 	IPSET_ENV_BIT_LIST_HEADER = 5,
 	IPSET_ENV_LIST_HEADER	= (1 << IPSET_ENV_BIT_LIST_HEADER),
+	IPSET_ENV_BIT_TEST_STREAM = 6,
+	IPSET_ENV_TEST_STREAM	= (1 << IPSET_ENV_BIT_TEST_STREAM),
+	IPSET_ENV_BIT_PIPELINE	= 7,
+	IPSET_ENV_PIPELINE	= (1 << IPSET_ENV_BIT_PIPELINE),
+	IPSET_ENV_BIT_LIST_CHANGED = 8,
+	IPSET_ENV_LIST_CHANGED	= (1 << IPSET_ENV_BIT_LIST_CHANGED),
+	IPSET_ENV_BIT_LIST_RESET = 9,
+	IPSET_ENV_LIST_RESET	= (1 << IPSET_ENV_BIT_LIST_RESET),
+	IPSET_ENV_BIT_LIST_SNAPSHOT = 10,
+	IPSET_ENV_LIST_SNAPSHOT	= (1 << IPSET_ENV_BIT_LIST_SNAPSHOT),
+	IPSET_ENV_BIT_LIST_TOTAL = 11,
+	IPSET_ENV_LIST_TOTAL	= (1 << IPSET_ENV_BIT_LIST_TOTAL),
+	IPSET_ENV_BIT_OPTIMISTIC = 12,
+	IPSET_ENV_OPTIMISTIC	= (1 << IPSET_ENV_BIT_OPTIMISTIC),
+	IPSET_ENV_BIT_ATOMIC	= 13,
+	IPSET_ENV_ATOMIC	= (1 << IPSET_ENV_BIT_ATOMIC),
+	IPSET_ENV_BIT_LIST_STATS = 14,
+	IPSET_ENV_LIST_STATS	= (1 << IPSET_ENV_BIT_LIST_STATS),
 };
 
 extern bool ipset_envopt_test(struct ipset_session *session,
@@ -98,14 +129,56 @@ enum ipset_output_mode {
 	IPSET_LIST_PLAIN,
 	IPSET_LIST_SAVE,
 	IPSET_LIST_XML,
+	IPSET_LIST_BINARY,
+	IPSET_LIST_ELEM,
+};
+
+/* Binary save format, numbers in network byte order: the file header,
+ * then for every set the set header, the create line, element blocks
+ * (a count and the elements like in IPSET_ATTR_ADT_PACKED) and an
+ * empty block followed by the CRC32 of the set records. */
+#define IPSET_BINARY_MAGIC		"IPSETBIN"
+#define IPSET_BINARY_VERSION		1
+
+struct ipset_binary_header {
+	char magic[8];
+	uint32_t version;
+};
+
+struct ipset_binary_set {
+	char setname[IPSET_MAXNAMELEN];
+	uint16_t createlen;			/* Length of create line */
+	uint8_t family;				/* Family of the elements */
+	uint8_t flags;				/* IPSET_PACKED_* flags */
 };
 
 extern int ipset_session_output(struct ipset_session *session,
 				enum ipset_output_mode mode);
+extern int ipset_session_list_since(struct ipset_session *session,
+				    uint32_t epoch);
+extern int ipset_session_list_top(struct ipset_session *session,
+				  uint32_t top, uint8_t top_by);
+extern int ipset_session_list_match(struct ipset_session *session,
+				    const char *pattern, bool regex);
+extern int ipset_session_list_header(struct ipset_session *session,
+				     const char *cond);
+extern void ipset_session_list_reset(struct ipset_session *session);
+extern bool ipset_session_guessed(const struct ipset_session *session);
+extern bool ipset_session_guess_failed(const struct ipset_session *session);
+extern void ipset_session_guess_reset(struct ipset_session *session);
 
 extern int ipset_commit(struct ipset_session *session);
 extern int ipset_cmd(struct ipset_session *session, enum ipset_cmd cmd,
 		     uint32_t lineno);
+extern int ipset_session_add_packed(struct ipset_session *session,
+				    const char *setname, uint8_t family,
+				    uint8_t flags, const void *elems,
+				    uint32_t count, uint32_t lineno);
+extern int ipset_session_add_bulk(struct ipset_session *session,
+				  const char *setname, uint8_t family,
+				  const void *keys, size_t n, size_t stride,
+				  const uint32_t *timeout);
+extern uint32_t ipset_crc32(uint32_t crc, const void *buf, size_t len);
 
 typedef int (*ipset_print_outfn)(struct ipset_session *session,
 	void *p, const char *fmt, ...)
@@ -115,6 +188,12 @@ extern int ipset_session_print_outfn(struct ipset_session *session,
 				     ipset_print_outfn outfn,
 				     void *p);
 
+typedef int (*ipset_elem_fn)(struct ipset_session *session,
+	void *p, const struct ipset_data *data);
+
+extern int ipset_session_elem_fn(struct ipset_session *session,
+				 ipset_elem_fn fn, void *p);
+
 enum ipset_io_type {
 	IPSET_IO_INPUT,
 	IPSET_IO_OUTPUT,
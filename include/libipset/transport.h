@@ -22,6 +22,8 @@ struct ipset_transport {
 	void (*fill_hdr)(struct ipset_handle *handle, enum ipset_cmd cmd,
 			 void *buffer, size_t len, uint8_t envflags);
 	int (*query)(struct ipset_handle *handle, void *buffer, size_t len);
+	int (*send)(struct ipset_handle *handle, void *buffer, size_t len);
+	int (*recv)(struct ipset_handle *handle, void *buffer, size_t len);
 };
 
 #endif /* LIBIPSET_TRANSPORT_H */
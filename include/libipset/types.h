@@ -65,7 +65,7 @@ struct ipset_elem {
 	enum ipset_opt opt;			/* elem option */
 };
 
-#define IPSET_OPTARG_MAX	24
+#define IPSET_OPTARG_MAX	32
 
 /* How other CADT args are parsed */
 struct ipset_optarg {
@@ -92,6 +92,7 @@ struct ipset_type {
 	const char *usage;			/* terse usage */
 	void (*usagefn)(void);			/* additional usage */
 	const char *description;		/* short revision description */
+	bool packed_adt;			/* packed add/del supported */
 	struct ipset_type *next;
 	const char *alias[];			/* name alias(es) */
 };
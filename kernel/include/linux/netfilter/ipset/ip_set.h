@@ -7,13 +7,18 @@
 #ifndef _IP_SET_H
 #define _IP_SET_H
 
+#include <linux/if_ether.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 #include <linux/netlink.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter/x_tables.h>
+#include <linux/rbtree.h>
 #include <linux/stringify.h>
+#include <linux/timekeeping.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <net/netlink.h>
 #include <linux/netfilter/ipset/ip_set_compat.h>
 #include <uapi/linux/netfilter/ipset/ip_set.h>
@@ -57,6 +62,10 @@ enum ip_set_extension {
 	IPSET_EXT_COMMENT = (1 << IPSET_EXT_BIT_COMMENT),
 	IPSET_EXT_BIT_SKBINFO = 3,
 	IPSET_EXT_SKBINFO = (1 << IPSET_EXT_BIT_SKBINFO),
+	IPSET_EXT_BIT_DISTINCT = 4,
+	IPSET_EXT_DISTINCT = (1 << IPSET_EXT_BIT_DISTINCT),
+	IPSET_EXT_BIT_RATELIMIT = 5,
+	IPSET_EXT_RATELIMIT = (1 << IPSET_EXT_BIT_RATELIMIT),
 	/* Mark set with an extension which needs to call destroy */
 	IPSET_EXT_BIT_DESTROY = 7,
 	IPSET_EXT_DESTROY = (1 << IPSET_EXT_BIT_DESTROY),
@@ -66,7 +75,19 @@ enum ip_set_extension {
 #define SET_WITH_COUNTER(s)	((s)->extensions & IPSET_EXT_COUNTER)
 #define SET_WITH_COMMENT(s)	((s)->extensions & IPSET_EXT_COMMENT)
 #define SET_WITH_SKBINFO(s)	((s)->extensions & IPSET_EXT_SKBINFO)
+#define SET_WITH_DISTINCT(s)	((s)->extensions & IPSET_EXT_DISTINCT)
+#define SET_WITH_RATELIMIT(s)	((s)->extensions & IPSET_EXT_RATELIMIT)
 #define SET_WITH_FORCEADD(s)	((s)->flags & IPSET_CREATE_FLAG_FORCEADD)
+#define SET_WITH_LPM(s)		((s)->flags & IPSET_CREATE_FLAG_LPM)
+#define SET_WITH_PERCPU(s)	((s)->flags & IPSET_CREATE_FLAG_PERCPU)
+#define SET_WITH_BLOOM(s)	((s)->flags & IPSET_CREATE_FLAG_BLOOM)
+#define SET_WITH_PREALLOC(s)	((s)->flags & IPSET_CREATE_FLAG_PREALLOC)
+#define SET_WITH_INDEX(s)	((s)->flags & IPSET_CREATE_FLAG_INDEX)
+#define SET_WITH_AGGREGATE(s)	((s)->flags & IPSET_CREATE_FLAG_AGGREGATE)
+#define SET_WITH_SAMPLE(s)	((s)->sample > 1)
+
+/* Max counter sampling rate */
+#define IPSET_COUNTER_SAMPLE_MAX	65536
 
 /* Extension id, in size order */
 enum ip_set_ext_id {
@@ -74,6 +95,8 @@ enum ip_set_ext_id {
 	IPSET_EXT_ID_TIMEOUT,
 	IPSET_EXT_ID_SKBINFO,
 	IPSET_EXT_ID_COMMENT,
+	IPSET_EXT_ID_DISTINCT,
+	IPSET_EXT_ID_RATELIMIT,
 	IPSET_EXT_ID_MAX,
 };
 
@@ -85,6 +108,8 @@ struct ip_set_ext_type {
 	void (*destroy)(struct ip_set *set, void *ext);
 	enum ip_set_extension type;
 	enum ipset_cadt_flags flag;
+	/* Create attribute enabling the extension without a flag */
+	u8 attr;
 	/* Size and minimal alignment */
 	u8 len;
 	u8 align;
@@ -97,8 +122,35 @@ struct ip_set_counter {
 	atomic64_t packets;
 };
 
+/* Per-cpu counters: the values set from userspace are stored in the
+ * shared part as an offset to the sum of the per-cpu values. Updates go
+ * to the shared part too if the per-cpu part could not be allocated.
+ */
+struct ip_set_counter_cpu {
+	u64 bytes;
+	u64 packets;
+	struct u64_stats_sync syncp;
+};
+
+struct ip_set_counter_pcpu_rcu {
+	struct rcu_head rcu;
+	struct ip_set_counter_cpu __percpu *cpu;
+};
+
+struct ip_set_counter_pcpu {
+	struct ip_set_counter base;
+	struct ip_set_counter_pcpu_rcu __rcu *pcpu;
+};
+
+/* The comments are interned: the elements of a set with the same comment
+ * share the string, which is hashed in the comment table of the netns
+ */
 struct ip_set_comment_rcu {
 	struct rcu_head rcu;
+	struct hlist_node node;		/* in the comment table */
+	const struct ip_set *set;	/* the set of the elements */
+	u32 ref;			/* number of the sharing elements */
+	u32 hash;			/* hash of the set and the string */
 	char str[];
 };
 
@@ -114,27 +166,57 @@ struct ip_set_skbinfo {
 	u16 __pad;
 };
 
+/* HyperLogLog sketch of the distinct source addresses of the packets
+ * matching an element: a register keeps the max rank of the hashes
+ * falling into it.
+ */
+#define IPSET_DISTINCT_BITS	6
+#define IPSET_DISTINCT_REGS	(1 << IPSET_DISTINCT_BITS)
+
+struct ip_set_distinct {
+	u8 reg[IPSET_DISTINCT_REGS];
+};
+
+/* Token bucket of an element as a generic cell rate algorithm: tat is
+ * the theoretical arrival time of the next packet at the rate in ns.
+ */
+struct ip_set_ratelimit {
+	atomic64_t tat;
+	u32 rate;		/* packets per second */
+	u32 burst;		/* packets */
+};
+
 struct ip_set_ext {
 	struct ip_set_skbinfo skbinfo;
 	u64 packets;
 	u64 bytes;
 	char *comment;
 	u32 timeout;
+	u32 rate;
+	u32 burst;
+	u32 source;		/* Hash of the source address, for distinct */
 	u8 packets_op;
 	u8 bytes_op;
 	bool target;
+	u32 hash;		/* Hash of the element, for the tracepoints */
 };
 
 struct ip_set;
+struct ip_set_lookupstat;
+struct ip_set_txn;
 
 #define ext_timeout(e, s)	\
-((unsigned long *)(((void *)(e)) + (s)->offset[IPSET_EXT_ID_TIMEOUT]))
+((u32 *)(((void *)(e)) + (s)->offset[IPSET_EXT_ID_TIMEOUT]))
 #define ext_counter(e, s)	\
 ((struct ip_set_counter *)(((void *)(e)) + (s)->offset[IPSET_EXT_ID_COUNTER]))
 #define ext_comment(e, s)	\
 ((struct ip_set_comment *)(((void *)(e)) + (s)->offset[IPSET_EXT_ID_COMMENT]))
 #define ext_skbinfo(e, s)	\
 ((struct ip_set_skbinfo *)(((void *)(e)) + (s)->offset[IPSET_EXT_ID_SKBINFO]))
+#define ext_distinct(e, s)	\
+((struct ip_set_distinct *)(((void *)(e)) + (s)->offset[IPSET_EXT_ID_DISTINCT]))
+#define ext_ratelimit(e, s)	\
+((struct ip_set_ratelimit *)(((void *)(e)) + (s)->offset[IPSET_EXT_ID_RATELIMIT]))
 
 typedef int (*ipset_adtfn)(struct ip_set *set, void *value,
 			   const struct ip_set_ext *ext,
@@ -149,6 +231,39 @@ struct ip_set_adt_opt {
 	struct ip_set_ext ext;	/* Extensions */
 };
 
+/* Max number of packets tested by one ip_set_test_bulk() call */
+#define IPSET_BULK_MAX		BITS_PER_LONG
+
+/* Internal command flag of the bulk test: the kadt functions pass the keys
+ * of the packets to the low level test function, which just collects them
+ * into the ip_set_bulk embedding the options.
+ */
+#define IPSET_FLAG_BULK_COLLECT	(1U << 31)
+
+/* Internal command flag of the rollback of a transaction: the elements
+ * removed by the batch are re-added over maxelem and the memory budget.
+ */
+#define IPSET_FLAG_TXN_ROLLBACK	(1U << 30)
+
+struct ip_set_bulk {
+	struct ip_set_adt_opt opt; /* Options with IPSET_FLAG_BULK_COLLECT */
+	void *keys;		/* Type specific store of the keys */
+	unsigned int n;		/* Number of the collected keys */
+};
+
+/* Condition of the elements deleted by the purge command: the parts
+ * given must all hold. The counters and the remaining timeout are
+ * compared as upper bounds.
+ */
+struct ip_set_purge {
+	const char *comment;	/* comment prefix, NULL for any */
+	size_t comment_len;
+	u64 bytes;		/* below the byte counter, ULLONG_MAX for any */
+	u64 packets;		/* below the packet counter, ULLONG_MAX for any */
+	u32 timeout;		/* below the remaining timeout in seconds,
+				 * IPSET_NO_TIMEOUT for any */
+};
+
 /* Set type, variant-specific part */
 struct ip_set_type_variant {
 	/* Kernelspace: test/add/del entries
@@ -158,6 +273,12 @@ struct ip_set_type_variant {
 	int (*kadt)(struct ip_set *set, const struct sk_buff *skb,
 		    const struct xt_action_param *par,
 		    enum ipset_adt adt, struct ip_set_adt_opt *opt);
+	/* Kernelspace: test a burst of packets, called under
+	 * rcu_read_lock_bh, sets the bits of the matching ones in result
+	 */
+	void (*test_bulk)(struct ip_set *set, struct sk_buff **skbs,
+			  unsigned int n, const struct xt_action_param *par,
+			  struct ip_set_adt_opt *opt, unsigned long *result);
 
 	/* Userspace: test/add/del entries
 	 *		returns negative error code,
@@ -165,6 +286,11 @@ struct ip_set_type_variant {
 	 *			positive for matching element */
 	int (*uadt)(struct ip_set *set, struct nlattr *tb[],
 		    enum ipset_adt adt, u32 *lineno, u32 flags, bool retried);
+	/* Userspace: add/del the packed elements from *index on,
+	 * *index is left at the failed element */
+	int (*uadt_packed)(struct ip_set *set,
+			   const struct ip_set_adt_packed *p,
+			   enum ipset_adt adt, u32 *index, u32 flags);
 
 	/* Low level add/del/test functions */
 	ipset_adtfn adt[IPSET_ADT_MAX];
@@ -177,33 +303,58 @@ struct ip_set_type_variant {
 	void (*flush)(struct ip_set *set);
 	/* Expire entries before listing */
 	void (*expire)(struct ip_set *set);
-	/* List set header data */
-	int (*head)(struct ip_set *set, struct sk_buff *skb);
+	/* List set header data, cb is NULL out of a LIST/SAVE request */
+	int (*head)(struct ip_set *set, struct sk_buff *skb,
+		    const struct netlink_callback *cb);
 	/* List elements */
 	int (*list)(const struct ip_set *set, struct sk_buff *skb,
 		    struct netlink_callback *cb);
 	/* Keep listing private when resizing runs parallel */
 	void (*uref)(struct ip_set *set, struct netlink_callback *cb,
 		     bool start);
+	/* Start/finish a userspace add/del message */
+	void (*batch)(struct ip_set *set, bool start);
+	/* Report the first dimension prefixes of the elements */
+	int (*prefixes)(struct ip_set *set, void *priv,
+			int (*fn)(void *priv, const __be32 *ip, u8 cidr));
+	/* Copy the elements into the empty clone of the set */
+	int (*clone)(struct ip_set *set, struct ip_set *clone);
+	/* Make the set read-only in a compact form or writable again */
+	int (*freeze)(struct ip_set *set, bool freeze);
+	/* Delete the elements matching the condition */
+	int (*purge)(struct ip_set *set, const struct ip_set_purge *p);
+	/* Sum up the lookup statistics of the set */
+	void (*lookupstat)(const struct ip_set *set,
+			   struct ip_set_lookupstat *stat);
 
 	/* Return true if "b" set is the same as "a"
 	 * according to the create set parameters */
 	bool (*same_set)(const struct ip_set *a, const struct ip_set *b);
 	/* Region-locking is used */
 	bool region_lock;
+	/* The add/del functions record the changes of a transaction */
+	bool txn;
 };
 
 struct ip_set_region {
 	spinlock_t lock;	/* Region lock */
 	size_t ext_size;	/* Size of the dynamic extensions */
 	u32 elements;		/* Number of elements vs timeout */
+	u32 holes;		/* Free slots left by deletions in buckets */
+	/* Lock statistics, updated with the lock held while enabled */
+	struct u64_stats_sync syncp;
+	u64 acquired;		/* Number of lock acquisitions */
+	u64 contended;		/* Number of contended acquisitions */
+	u64 wait;		/* Time spent waiting for the lock, in ns */
+	u64 hold;		/* Time the lock was held, in ns */
+	u64 locked_at;		/* Time of the last acquisition */
 };
 
 /* Max range where every element is added/deleted in one step */
 #define IPSET_MAX_RANGE		(1<<20)
 
 /* The max revision number supported by any set type + 1 */
-#define IPSET_REVISION_MAX	9
+#define IPSET_REVISION_MAX	31
 
 /* The core set type structure */
 struct ip_set_type {
@@ -243,6 +394,17 @@ struct ip_set_type {
 extern int ip_set_type_register(struct ip_set_type *set_type);
 extern void ip_set_type_unregister(struct ip_set_type *set_type);
 
+/* The module populating the sets from the conntrack events */
+struct ip_set_ctevent_ops {
+	/* Start and stop populating the set, under the nfnl mutex */
+	int (*attach)(struct ip_set *set);
+	void (*detach)(struct ip_set *set);
+	struct module *me;
+};
+
+extern int ip_set_ctevent_register(const struct ip_set_ctevent_ops *ops);
+extern void ip_set_ctevent_unregister(const struct ip_set_ctevent_ops *ops);
+
 /* A generic IP set */
 struct ip_set {
 	/* The name of the set */
@@ -269,8 +431,19 @@ struct ip_set {
 	u8 flags;
 	/* Default timeout value, if enabled */
 	u32 timeout;
+	/* Counters are updated for one in sample packets, if enabled */
+	u32 sample;
+	/* Default rate limit of the elements, if enabled */
+	u32 rate;
+	u32 burst;
+	/* Conntrack events and tuple directions populating the set, if any */
+	u8 ctevents;
+	u32 ctdir;
+	struct list_head ctevent_list;
 	/* Number of elements (vs timeout) */
 	u32 elements;
+	/* Changed when elements may have been added or removed */
+	atomic_t gen;
 	/* Size of the dynamic extensions (vs timeout) */
 	size_t ext_size;
 	/* Element data size */
@@ -279,6 +452,15 @@ struct ip_set {
 	size_t offset[IPSET_EXT_ID_MAX];
 	/* The type specific data */
 	void *data;
+	/* The network namespace of the set */
+	struct net *net;
+	/* Memory charged to the budget of the namespace */
+	atomic_long_t mem;
+	/* Undo log of the transactional add/del batch run by txn_owner,
+	 * the kernel side adds fail while it is set
+	 */
+	struct ip_set_txn *txn;
+	struct task_struct *txn_owner;
 };
 
 static inline void
@@ -292,6 +474,11 @@ ip_set_ext_destroy(struct ip_set *set, void *data)
 
 		ip_set_extensions[IPSET_EXT_ID_COMMENT].destroy(set, c);
 	}
+	if (SET_WITH_COUNTER(set) && SET_WITH_PERCPU(set)) {
+		struct ip_set_counter *c = ext_counter(data, set);
+
+		ip_set_extensions[IPSET_EXT_ID_COUNTER].destroy(set, c);
+	}
 }
 
 int ip_set_put_flags(struct sk_buff *skb, struct ip_set *set);
@@ -306,10 +493,73 @@ enum {
 	IPSET_CB_ARG0,		/* type specific */
 };
 
+/* Options of a LIST/SAVE request, stored as the netlink callback data */
+struct ip_set_dump_opt {
+	u32 since;		/* list the elements changed in the epoch */
+	bool changed;		/* since is given, the epoch is advanced */
+	u32 top;		/* list the top elements by the counter only */
+	u8 top_by;		/* IPSET_TOP_BYTES or IPSET_TOP_PACKETS */
+	u64 threshold;		/* counter value of the top elements */
+	bool snapshot;		/* list a point-in-time copy of the set */
+};
+
+static inline struct ip_set_dump_opt *
+ip_set_dump_opt(const struct netlink_callback *cb)
+{
+	return cb ? cb->data : NULL;
+}
+
+/* LIST/SAVE: the epoch of the changed elements to dump, zero for all */
+static inline u32
+ip_set_dump_since(const struct netlink_callback *cb)
+{
+	const struct ip_set_dump_opt *opt = ip_set_dump_opt(cb);
+
+	return opt ? opt->since : 0;
+}
+
+/* LIST/SAVE: whether the changed elements are listed */
+static inline bool
+ip_set_dump_changed(const struct netlink_callback *cb)
+{
+	const struct ip_set_dump_opt *opt = ip_set_dump_opt(cb);
+
+	return opt && opt->changed;
+}
+
+/* LIST/SAVE: whether a frozen copy of the set is listed */
+static inline bool
+ip_set_dump_snapshot(const struct netlink_callback *cb)
+{
+	const struct ip_set_dump_opt *opt = ip_set_dump_opt(cb);
+
+	return opt && opt->snapshot;
+}
+
+/* LIST/SAVE: whether the counters are reset on read */
+static inline bool
+ip_set_dump_reset(const struct netlink_callback *cb)
+{
+	return cb && ((u32)cb->args[IPSET_CB_DUMP] >> 16) &
+		     IPSET_FLAG_LIST_RESET;
+}
+
+/* LIST/SAVE: whether the statistics are listed in the header */
+static inline bool
+ip_set_dump_stats(const struct netlink_callback *cb)
+{
+	return cb && ((u32)cb->args[IPSET_CB_DUMP] >> 16) &
+		     IPSET_FLAG_LIST_STATS;
+}
+
 /* register and unregister set references */
 extern ip_set_id_t ip_set_get_byname(struct net *net,
 				     const char *name, struct ip_set **set);
 extern void ip_set_put_byindex(struct net *net, ip_set_id_t index);
+extern struct ip_set *ip_set_ref_byindex(struct net *net,
+					 ip_set_id_t index);
+extern struct ip_set *ip_set_lookup_byindex(struct net *net,
+					    ip_set_id_t index);
 extern void ip_set_name_byindex(struct net *net, ip_set_id_t index, char *name);
 extern ip_set_id_t ip_set_nfnl_get_byindex(struct net *net, ip_set_id_t index);
 extern void ip_set_nfnl_put(struct net *net, ip_set_id_t index);
@@ -325,10 +575,21 @@ extern int ip_set_del(ip_set_id_t id, const struct sk_buff *skb,
 extern int ip_set_test(ip_set_id_t id, const struct sk_buff *skb,
 		       const struct xt_action_param *par,
 		       struct ip_set_adt_opt *opt);
+extern int ip_set_test_bulk(ip_set_id_t id, struct sk_buff **skbs,
+			    unsigned int n, const struct xt_action_param *par,
+			    struct ip_set_adt_opt *opt, unsigned long *result);
+/* Kernel side add/del by the set itself, for the conntrack events */
+extern int ip_set_kadt(struct ip_set *set, const struct sk_buff *skb,
+		       const struct xt_action_param *par,
+		       enum ipset_adt adt, struct ip_set_adt_opt *opt);
 
 /* Utility functions */
 extern void *ip_set_alloc(size_t size);
+extern void *ip_set_alloc_node(size_t size, int node);
+extern void *ip_set_alloc_huge(size_t size, int node, u8 *pages);
 extern void ip_set_free(void *members);
+extern bool ip_set_mem_charge(struct ip_set *set, long size, bool force);
+extern bool ip_set_mem_full(const struct ip_set *set);
 extern int ip_set_get_ipaddr4(struct nlattr *nla,  __be32 *ipaddr);
 extern int ip_set_get_ipaddr6(struct nlattr *nla, union nf_inet_addr *ipaddr);
 extern size_t ip_set_elem_len(struct ip_set *set, struct nlattr *tb[],
@@ -337,10 +598,53 @@ extern int ip_set_get_extensions(struct ip_set *set, struct nlattr *tb[],
 				 struct ip_set_ext *ext);
 extern int ip_set_put_extensions(struct sk_buff *skb, const struct ip_set *set,
 				 const void *e, bool active);
-extern bool ip_set_match_extensions(struct ip_set *set,
-				    const struct ip_set_ext *ext,
-				    struct ip_set_ext *mext,
-				    u32 flags, void *data);
+extern void ip_set_reset_counter(const struct ip_set *set, void *data,
+				 const struct nlattr *nla);
+extern u64 ip_set_top_value(const struct ip_set *set, const void *data,
+			    u8 top_by);
+extern bool ip_set_purge_match(const struct ip_set *set, const void *data,
+			       const struct ip_set_purge *p);
+extern void ip_set_top_add(u64 *heap, u32 *size, u32 max, u64 value);
+extern bool __ip_set_match_extensions(struct ip_set *set,
+				      const struct ip_set_ext *ext,
+				      struct ip_set_ext *mext,
+				      u32 flags, void *data);
+
+/* Element change notifications */
+extern struct sk_buff *ip_set_notify_start(const struct ip_set *set,
+					   enum ipset_cmd cmd, u32 flags);
+extern void ip_set_notify_end(const struct ip_set *set, struct sk_buff *skb);
+
+/* Extensions checked or updated when an element is matched */
+#define IPSET_EXT_MATCH	\
+	(IPSET_EXT_TIMEOUT | IPSET_EXT_COUNTER | IPSET_EXT_SKBINFO |	\
+	 IPSET_EXT_DISTINCT | IPSET_EXT_RATELIMIT)
+
+/* Enabled while any set has got extensions in IPSET_EXT_MATCH */
+DECLARE_STATIC_KEY_FALSE(ip_set_match_ext_key);
+
+/* Enabled by the stats module parameter: the lookup and the region lock
+ * statistics of the hash types are collected
+ */
+DECLARE_STATIC_KEY_FALSE(ip_set_stats_key);
+
+static inline bool
+ip_set_match_extensions(struct ip_set *set, const struct ip_set_ext *ext,
+			struct ip_set_ext *mext, u32 flags, void *data)
+{
+	if (!static_branch_unlikely(&ip_set_match_ext_key) ||
+	    !(set->extensions & IPSET_EXT_MATCH))
+		return true;
+	return __ip_set_match_extensions(set, ext, mext, flags, data);
+}
+
+/* Elements must be visible before the new generation */
+static inline void
+ip_set_gen_bump(struct ip_set *set)
+{
+	smp_mb__before_atomic();
+	atomic_inc(&set->gen);
+}
 
 static inline int
 ip_set_get_hostipaddr4(struct nlattr *nla, u32 *ipaddr)
@@ -454,6 +758,29 @@ ip6addrptr(const struct sk_buff *skb, bool src, struct in6_addr *addr)
 	       sizeof(*addr));
 }
 
+/* The dual-stack sets store IPv4 addresses as IPv4-mapped IPv6 ones */
+static inline void
+inetaddrptr(const struct sk_buff *skb, u8 family, bool src,
+	    struct in6_addr *addr)
+{
+	if (family == NFPROTO_IPV4)
+		ipv6_addr_set_v4mapped(ip4addr(skb, src), addr);
+	else
+		ip6addrptr(skb, src, addr);
+}
+
+/* The ethernet address as a single 64 bits word with the spare bytes
+ * zeroed: the MAC keys are compared and hashed as one word
+ */
+static inline u64
+ip_set_ether_key(const unsigned char *addr)
+{
+	u64 key = 0;
+
+	memcpy(&key, addr, ETH_ALEN);
+	return key;
+}
+
 /* How often should the gc be run by default */
 #define IPSET_GC_TIME			(3 * 60)
 
@@ -461,6 +788,67 @@ ip6addrptr(const struct sk_buff *skb, bool src, struct in6_addr *addr)
 #define IPSET_GC_PERIOD(timeout) \
 	((timeout/3) ? min_t(u32, (timeout)/3, IPSET_GC_TIME) : 1)
 
+/* Garbage collection of the timed out elements of a set, run by the gc
+ * scheduler of the namespace: the sets are ordered by their next run
+ * and collected by a bounded pool of workers, within a CPU budget per
+ * tick. The run callback returns the jiffies of its next run.
+ */
+enum {
+	IP_SET_GC_IDLE,		/* not scheduled */
+	IP_SET_GC_PENDING,	/* waiting for its run in the due order */
+	IP_SET_GC_RUNNING,	/* queued to or run by a worker */
+	IP_SET_GC_STOPPED,	/* cancelled, the set is destroyed */
+};
+
+struct ip_set_gc {
+	struct list_head list;		/* gc runs of the namespace */
+	struct rb_node node;		/* in the due order, when pending */
+	struct work_struct work;	/* run by the gc workers */
+	struct ip_set *set;		/* the set collected */
+	unsigned long (*run)(struct ip_set_gc *gc);
+	unsigned long due;		/* jiffies of the next run */
+	unsigned long kick;		/* run requested while running */
+	bool kicked;			/* kick is valid */
+	u8 state;			/* IP_SET_GC_* */
+	u64 start;			/* start of the current run in ns */
+	/* Statistics, under the lock of the scheduler */
+	u64 runs;			/* number of runs */
+	u64 lag;			/* total delay of the runs in ms */
+	u32 lag_max;			/* maximal delay of a run in ms */
+	u64 time;			/* time spent collecting in ns */
+};
+
+extern void ip_set_gc_init(struct ip_set *set, struct ip_set_gc *gc,
+			   unsigned long (*run)(struct ip_set_gc *gc));
+extern void ip_set_gc_schedule(struct ip_set_gc *gc, unsigned long due);
+extern void ip_set_gc_cancel(struct ip_set_gc *gc);
+extern bool ip_set_gc_yield(const struct ip_set_gc *gc);
+
+/* All or nothing add/del batches: the add/del functions record the
+ * element they add and the one they remove or overwrite, under the locks
+ * of the set, and the core reverts the batch in reverse order when a
+ * later element fails.
+ */
+extern int __ip_set_txn_record(struct ip_set *set, const void *added,
+			       const void *removed, size_t len, u32 flags);
+extern void ip_set_txn_forget(struct ip_set *set);
+
+/* Returns 1 when the change is recorded, 0 when there is nothing to
+ * record and -ENOMEM. The flags are the ones to re-add "removed" with.
+ * The kernel side changes and the replays of a background resize are
+ * not part of the batch, the kernel side adds fail while it runs.
+ */
+static inline int
+ip_set_txn_record(struct ip_set *set, const struct ip_set_ext *ext,
+		  const void *added, const void *removed, size_t len,
+		  u32 flags)
+{
+	if (likely(READ_ONCE(set->txn_owner) != current) ||
+	    !ext || ext->target)
+		return 0;
+	return __ip_set_txn_record(set, added, removed, len, flags);
+}
+
 /* Entry is set with no timeout value */
 #define IPSET_ELEM_PERMANENT	0
 
@@ -485,36 +873,151 @@ ip_set_timeout_uget(struct nlattr *tb)
 	return timeout;
 }
 
+/* Size of an element of IPSET_ATTR_ADT_PACKED */
+static inline u32
+ip_set_packed_stride(const struct ip_set_adt_packed *p)
+{
+	return (p->family == NFPROTO_IPV4 ? sizeof(__be32)
+					  : sizeof(struct in6_addr)) +
+	       (p->flags & IPSET_PACKED_TIMEOUT ? sizeof(__be32) : 0);
+}
+
+/* The n-th element of IPSET_ATTR_ADT_PACKED */
+static inline const void *
+ip_set_packed_elem(const struct ip_set_adt_packed *p, u32 n)
+{
+	return (const u8 *)(p + 1) + n * ip_set_packed_stride(p);
+}
+
+static inline unsigned int
+ip_set_packed_timeout(const struct ip_set_adt_packed *p, const void *elem)
+{
+	unsigned int timeout =
+		ntohl(*(const __be32 *)(elem + ip_set_packed_stride(p) -
+					sizeof(__be32)));
+
+	/* Normalize to fit into jiffies */
+	if (timeout > IPSET_MAX_TIMEOUT)
+		timeout = IPSET_MAX_TIMEOUT;
+
+	return timeout;
+}
+
+/* The timeout extension is a 32-bit timestamp in seconds of the monotonic
+ * clock: the values from userspace have second granularity anyway and it is
+ * half the size of a jiffies value on 64-bit.
+ */
+static inline u32
+ip_set_timeout_now(void)
+{
+	return (u32)ktime_get_seconds();
+}
+
 static inline bool
-ip_set_timeout_expired(const unsigned long *t)
+ip_set_timeout_expired(const u32 *t)
 {
-	return *t != IPSET_ELEM_PERMANENT && time_is_before_jiffies(*t);
+	return *t != IPSET_ELEM_PERMANENT &&
+	       (s32)(ip_set_timeout_now() - *t) > 0;
 }
 
 static inline void
-ip_set_timeout_set(unsigned long *timeout, u32 value)
+ip_set_timeout_set(u32 *timeout, u32 value)
 {
-	unsigned long t;
+	u32 t;
 
 	if (!value) {
 		*timeout = IPSET_ELEM_PERMANENT;
 		return;
 	}
 
-	t = msecs_to_jiffies(value * MSEC_PER_SEC) + jiffies;
+	t = ip_set_timeout_now() + value;
 	if (t == IPSET_ELEM_PERMANENT)
 		/* Bingo! :-) */
 		t--;
 	*timeout = t;
 }
 
+/* Refresh the timeout of an element found by a match, without locking:
+ * the permanent elements stay so and a timeout of second granularity is
+ * stored at most once a second.
+ */
+static inline void
+ip_set_timeout_refresh(u32 *timeout, u32 value)
+{
+	u32 t, cur = READ_ONCE(*timeout);
+
+	if (!value || cur == IPSET_ELEM_PERMANENT)
+		return;
+
+	t = ip_set_timeout_now() + value;
+	if (t == IPSET_ELEM_PERMANENT)
+		t--;
+	if (t != cur)
+		WRITE_ONCE(*timeout, t);
+}
+
+/* Expiry time of a stored timeout in jiffies */
+static inline unsigned long
+ip_set_timeout_jiffies(const u32 *timeout)
+{
+	u32 t = READ_ONCE(*timeout);
+	unsigned long expires;
+
+	if (t == IPSET_ELEM_PERMANENT)
+		return IPSET_ELEM_PERMANENT;
+
+	expires = jiffies + (long)(s32)(t - ip_set_timeout_now()) * HZ;
+	return expires == IPSET_ELEM_PERMANENT ? expires - 1 : expires;
+}
+
+/* With coarse refresh a timeout is stored again only when it moves by more
+ * than 1/2^IPSET_TIMEOUT_COARSE_SHIFT of its value, but one second at least
+ */
+#define IPSET_TIMEOUT_COARSE_SHIFT	4
+
+static inline bool
+ip_set_timeout_coarse(const u32 *timeout, u32 value)
+{
+	u32 slack, cur = READ_ONCE(*timeout);
+	s32 diff;
+
+	if (!value || cur == IPSET_ELEM_PERMANENT)
+		return false;
+
+	slack = max_t(u32, value >> IPSET_TIMEOUT_COARSE_SHIFT, 1);
+	diff = (s32)(ip_set_timeout_now() + value - cur);
+	return diff >= -(s32)slack && diff <= (s32)slack;
+}
+
+/* Whether the kernel side re-add of a stored element can leave it alone,
+ * so that hot elements are not written on every packet
+ */
+static inline bool
+ip_set_refresh_skip(const struct ip_set *set, void *data,
+		    const struct ip_set_ext *ext, u32 flags)
+{
+	if (!ext->target || !(flags & IPSET_FLAG_COARSE_REFRESH))
+		return false;
+	return !SET_WITH_TIMEOUT(set) ||
+	       ip_set_timeout_coarse(ext_timeout(data, set), ext->timeout);
+}
+
 void ip_set_init_comment(struct ip_set *set, struct ip_set_comment *comment,
 			 const struct ip_set_ext *ext);
 
+void ip_set_init_pcpu_counter(struct ip_set_counter *counter,
+			      const struct ip_set_ext *ext);
+
+void ip_set_ext_clone(struct ip_set *set, void *data);
+
 static inline void
-ip_set_init_counter(struct ip_set_counter *counter,
+ip_set_init_counter(struct ip_set *set, struct ip_set_counter *counter,
 		    const struct ip_set_ext *ext)
 {
+	if (SET_WITH_PERCPU(set)) {
+		ip_set_init_pcpu_counter(counter, ext);
+		return;
+	}
 	if (ext->bytes != ULLONG_MAX)
 		atomic64_set(&(counter)->bytes, (long long)(ext->bytes));
 	if (ext->packets != ULLONG_MAX)
@@ -528,13 +1031,42 @@ ip_set_init_skbinfo(struct ip_set_skbinfo *skbinfo,
 	*skbinfo = ext->skbinfo;
 }
 
+/* An element starts with an empty sketch when added or re-added */
+static inline void
+ip_set_init_distinct(struct ip_set_distinct *distinct)
+{
+	memset(distinct, 0, sizeof(*distinct));
+}
+
+/* The rate and burst are updated on re-add, the bucket is kept */
+static inline void
+ip_set_init_ratelimit(struct ip_set_ratelimit *ratelimit,
+		      const struct ip_set_ext *ext)
+{
+	WRITE_ONCE(ratelimit->rate, ext->rate);
+	WRITE_ONCE(ratelimit->burst, ext->burst);
+}
+
+extern u32 __ip_set_source_hash(const struct sk_buff *skb, u8 family);
+
+static inline u32
+ip_set_source_hash(const struct sk_buff *skb,
+		   const struct ip_set_adt_opt *opt, const struct ip_set *set)
+{
+	return SET_WITH_DISTINCT(set) ?
+		__ip_set_source_hash(skb, opt->family) : 0;
+}
+
 #define IP_SET_INIT_KEXT(skb, opt, set)			\
 	{ .bytes = (skb)->len, .packets = 1, .target = true,\
-	  .timeout = ip_set_adt_opt_timeout(opt, set) }
+	  .timeout = ip_set_adt_opt_timeout(opt, set),	\
+	  .rate = (set)->rate, .burst = (set)->burst,	\
+	  .source = ip_set_source_hash(skb, opt, set) }
 
 #define IP_SET_INIT_UEXT(set)				\
 	{ .bytes = ULLONG_MAX, .packets = ULLONG_MAX,	\
-	  .timeout = (set)->timeout }
+	  .timeout = (set)->timeout,			\
+	  .rate = (set)->rate, .burst = (set)->burst }
 
 #define IPSET_CONCAT(a, b)		a##b
 #define IPSET_TOKEN(a, b)		IPSET_CONCAT(a, b)
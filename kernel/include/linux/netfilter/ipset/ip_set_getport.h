@@ -6,6 +6,9 @@
 #include <linux/types.h>
 #include <linux/in.h>
 
+extern void ip_set_l4_scope_enter(void);
+extern void ip_set_l4_scope_leave(void);
+
 extern bool ip_set_get_ip4_port(const struct sk_buff *skb, bool src,
 				__be16 *port, u8 *proto);
 
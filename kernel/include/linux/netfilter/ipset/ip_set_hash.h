@@ -11,4 +11,35 @@
 #define IPSET_DEFAULT_PROBES		4
 #define IPSET_DEFAULT_RESIZE		100
 
+/* Per-cpu lookup statistics of a hash set */
+struct ip_set_lookupstat {
+	u64 tests;
+	u64 hits;
+	u64 misses;
+	u64 probes[IPSET_LOOKUP_HIST];
+	u64 compares[IPSET_LOOKUP_HIST];
+};
+
+/* Account a lookup while the statistics are enabled, called with
+ * bottom halves disabled
+ */
+static inline void
+ip_set_lookupstat_add(struct ip_set_lookupstat __percpu *lstat, int ret,
+		      u32 probes, u32 compares)
+{
+	struct ip_set_lookupstat *s;
+
+	if (!static_branch_unlikely(&ip_set_stats_key))
+		return;
+	s = this_cpu_ptr(lstat);
+
+	s->tests++;
+	if (ret > 0)
+		s->hits++;
+	else
+		s->misses++;
+	s->probes[min_t(u32, fls(probes), IPSET_LOOKUP_HIST - 1)]++;
+	s->compares[min_t(u32, fls(compares), IPSET_LOOKUP_HIST - 1)]++;
+}
+
 #endif /* __IP_SET_HASH_H */
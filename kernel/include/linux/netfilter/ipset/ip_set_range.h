@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __IP_SET_RANGE_H
+#define __IP_SET_RANGE_H
+
+#include <uapi/linux/netfilter/ipset/ip_set_range.h>
+
+
+#define IPSET_DEFAULT_RANGE_MAXELEM	65536
+
+#endif /* __IP_SET_RANGE_H */
@@ -42,13 +42,25 @@ do {						\
 	to = from | ~ip_set_hostmask(cidr);	\
 } while (0)
 
+/* The masks are aligned: two words on 64-bit, as ipv6_masked_addr_cmp() */
 static inline void
 ip6_netmask(union nf_inet_addr *ip, u8 prefix)
 {
-	ip->ip6[0] &= ip_set_netmask6(prefix)[0];
-	ip->ip6[1] &= ip_set_netmask6(prefix)[1];
-	ip->ip6[2] &= ip_set_netmask6(prefix)[2];
-	ip->ip6[3] &= ip_set_netmask6(prefix)[3];
+#if defined(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS) && BITS_PER_LONG == 64
+	const unsigned long *mask =
+		(const unsigned long *)ip_set_netmask6(prefix);
+	unsigned long *ul = (unsigned long *)ip->ip6;
+
+	ul[0] &= mask[0];
+	ul[1] &= mask[1];
+#else
+	const __be32 *mask = ip_set_netmask6(prefix);
+
+	ip->ip6[0] &= mask[0];
+	ip->ip6[1] &= mask[1];
+	ip->ip6[2] &= mask[2];
+	ip->ip6[3] &= mask[3];
+#endif
 }
 
 #endif /*_PFXLEN_H */
@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Tracepoints of the hot paths of ipset */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ipset
+
+#if !defined(_TRACE_IPSET_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_IPSET_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+/* Kernel side test/add/del of an element: the hash of the element is
+ * reported by the hash types only, the duration is in ns
+ */
+DECLARE_EVENT_CLASS(ipset_adt,
+
+	TP_PROTO(const struct ip_set *set, u32 hash, int ret, u64 start),
+
+	TP_ARGS(set, hash, ret, start),
+
+	TP_STRUCT__entry(
+		__array(char,	name,	IPSET_MAXNAMELEN)
+		__field(u32,	hash)
+		__field(int,	ret)
+		__field(u64,	duration)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->name, set->name, IPSET_MAXNAMELEN);
+		__entry->hash = hash;
+		__entry->ret = ret;
+		__entry->duration = ktime_get_ns() - start;
+	),
+
+	TP_printk("set=%s hash=0x%08x ret=%d duration=%llu",
+		  __entry->name, __entry->hash, __entry->ret,
+		  __entry->duration)
+);
+
+DEFINE_EVENT(ipset_adt, ipset_test,
+	TP_PROTO(const struct ip_set *set, u32 hash, int ret, u64 start),
+	TP_ARGS(set, hash, ret, start)
+);
+
+DEFINE_EVENT(ipset_adt, ipset_add,
+	TP_PROTO(const struct ip_set *set, u32 hash, int ret, u64 start),
+	TP_ARGS(set, hash, ret, start)
+);
+
+DEFINE_EVENT(ipset_adt, ipset_del,
+	TP_PROTO(const struct ip_set *set, u32 hash, int ret, u64 start),
+	TP_ARGS(set, hash, ret, start)
+);
+
+/* Resize of a hash from old_bits to new_bits */
+TRACE_EVENT(ipset_resize,
+
+	TP_PROTO(const struct ip_set *set, u8 old_bits, u8 new_bits, int ret,
+		 u64 start),
+
+	TP_ARGS(set, old_bits, new_bits, ret, start),
+
+	TP_STRUCT__entry(
+		__array(char,	name,	IPSET_MAXNAMELEN)
+		__field(u8,	old_bits)
+		__field(u8,	new_bits)
+		__field(int,	ret)
+		__field(u64,	duration)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->name, set->name, IPSET_MAXNAMELEN);
+		__entry->old_bits = old_bits;
+		__entry->new_bits = new_bits;
+		__entry->ret = ret;
+		__entry->duration = ktime_get_ns() - start;
+	),
+
+	TP_printk("set=%s old_bits=%u new_bits=%u ret=%d duration=%llu",
+		  __entry->name, __entry->old_bits, __entry->new_bits,
+		  __entry->ret, __entry->duration)
+);
+
+/* Garbage collection of a region of a hash */
+TRACE_EVENT(ipset_gc,
+
+	TP_PROTO(const struct ip_set *set, u32 region, u32 expired,
+		 u64 start),
+
+	TP_ARGS(set, region, expired, start),
+
+	TP_STRUCT__entry(
+		__array(char,	name,	IPSET_MAXNAMELEN)
+		__field(u32,	region)
+		__field(u32,	expired)
+		__field(u64,	duration)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->name, set->name, IPSET_MAXNAMELEN);
+		__entry->region = region;
+		__entry->expired = expired;
+		__entry->duration = ktime_get_ns() - start;
+	),
+
+	TP_printk("set=%s region=%u expired=%u duration=%llu",
+		  __entry->name, __entry->region, __entry->expired,
+		  __entry->duration)
+);
+
+#endif /* _TRACE_IPSET_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
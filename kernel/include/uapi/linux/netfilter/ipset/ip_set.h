@@ -41,17 +41,23 @@ enum ipset_cmd {
 	IPSET_CMD_TYPE,		/* 13: Get set type */
 	IPSET_CMD_GET_BYNAME,	/* 14: Get set index by name */
 	IPSET_CMD_GET_BYINDEX,	/* 15: Get set name by index */
+	IPSET_CMD_CLONE,	/* 16: Copy a set into a new one */
+	IPSET_CMD_MONITOR,	/* 17: Subscribe to change notifications */
+	IPSET_CMD_FREEZE,	/* 18: Make a set read-only */
+	IPSET_CMD_THAW,		/* 19: Make a frozen set writable again */
+	IPSET_CMD_PURGE,	/* 20: Delete the elements matching a condition */
 	IPSET_MSG_MAX,		/* Netlink message commands */
 
 	/* Commands in userspace: */
-	IPSET_CMD_RESTORE = IPSET_MSG_MAX, /* 16: Enter restore mode */
-	IPSET_CMD_HELP,		/* 17: Get help */
-	IPSET_CMD_VERSION,	/* 18: Get program version */
-	IPSET_CMD_QUIT,		/* 19: Quit from interactive mode */
+	IPSET_CMD_RESTORE = IPSET_MSG_MAX, /* 21: Enter restore mode */
+	IPSET_CMD_HELP,		/* 22: Get help */
+	IPSET_CMD_VERSION,	/* 23: Get program version */
+	IPSET_CMD_QUIT,		/* 24: Quit from interactive mode */
+	IPSET_CMD_SYNC,		/* 25: Sync a set to the given elements */
 
 	IPSET_CMD_MAX,
 
-	IPSET_CMD_COMMIT = IPSET_CMD_MAX, /* 20: Commit buffered commands */
+	IPSET_CMD_COMMIT = IPSET_CMD_MAX, /* 26: Commit buffered commands */
 };
 
 /* Attributes at command level */
@@ -70,6 +76,14 @@ enum {
 	IPSET_ATTR_PROTOCOL_MIN, /* 10: Minimal supported version number */
 	IPSET_ATTR_REVISION_MIN	= IPSET_ATTR_PROTOCOL_MIN, /* type rev min */
 	IPSET_ATTR_INDEX,	/* 11: Kernel index of set */
+	IPSET_ATTR_ADT_PACKED,	/* 12: Packed array of elements */
+	IPSET_ATTR_LOST,	/* 13: Notifications lost before this one */
+	IPSET_ATTR_SINCE,	/* 14: List the elements changed since the epoch */
+	IPSET_ATTR_TOP,		/* 15: List the top elements by the counters */
+	IPSET_ATTR_TOP_BY,	/* 16: Counter of the top elements */
+	IPSET_ATTR_SNAPSHOT,	/* 17: List a point-in-time copy of the sets */
+	IPSET_ATTR_BUFSIZE,	/* 18: Receive buffer size of the dump */
+	IPSET_ATTR_TRANSACTION,	/* 19: Add/del all the elements or none */
 	__IPSET_ATTR_CMD_MAX,
 };
 #define IPSET_ATTR_CMD_MAX	(__IPSET_ATTR_CMD_MAX - 1)
@@ -89,6 +103,8 @@ enum {
 	IPSET_ATTR_CADT_LINENO = IPSET_ATTR_LINENO,	/* 9 */
 	IPSET_ATTR_MARK,	/* 10 */
 	IPSET_ATTR_MARKMASK,	/* 11 */
+	IPSET_ATTR_RATE,	/* 12 */
+	IPSET_ATTR_BURST,	/* 13 */
 	/* Reserve empty slots */
 	IPSET_ATTR_CADT_MAX = 16,
 	/* Create-only specific attributes */
@@ -103,6 +119,24 @@ enum {
 	IPSET_ATTR_ELEMENTS,
 	IPSET_ATTR_REFERENCES,
 	IPSET_ATTR_MEMSIZE,
+	IPSET_ATTR_BLOOM_FPR,
+	/* Create-only specific attributes, continued */
+	IPSET_ATTR_HASHFN,
+	IPSET_ATTR_REGIONBITS,
+	/* Kernel-only, continued */
+	IPSET_ATTR_LOCKSTAT,
+	/* Create-only specific attributes, continued */
+	IPSET_ATTR_NUMA,
+	IPSET_ATTR_SAMPLE,
+	/* Kernel-only, continued */
+	IPSET_ATTR_EPOCH,
+	IPSET_ATTR_LOOKUPSTAT,
+	IPSET_ATTR_MEMSTAT,
+	/* Create-only specific attributes, continued */
+	IPSET_ATTR_CTEVENTS,
+	IPSET_ATTR_CTDIR,
+	/* Kernel-only, continued */
+	IPSET_ATTR_TABLEPAGES,
 
 	__IPSET_ATTR_CREATE_MAX,
 };
@@ -124,6 +158,7 @@ enum {
 	IPSET_ATTR_SKBPRIO,
 	IPSET_ATTR_SKBQUEUE,
 	IPSET_ATTR_PAD,
+	IPSET_ATTR_DISTINCT,
 	__IPSET_ATTR_ADT_MAX,
 };
 #define IPSET_ATTR_ADT_MAX	(__IPSET_ATTR_ADT_MAX - 1)
@@ -157,6 +192,14 @@ enum ipset_errno {
 	IPSET_ERR_COMMENT,
 	IPSET_ERR_INVALID_MARKMASK,
 	IPSET_ERR_SKBINFO,
+	IPSET_ERR_COUNTER_SAMPLE,
+	IPSET_ERR_MEM_BUDGET,
+	IPSET_ERR_TRANSACTION,
+	IPSET_ERR_RATELIMIT,
+	IPSET_ERR_CTEVENT,
+	IPSET_ERR_CTEVENT_BUSY,
+	IPSET_ERR_FROZEN,
+	IPSET_ERR_TXN_ROLLBACK,
 
 	/* Type specific error codes */
 	IPSET_ERR_TYPE_SPECIFIC = 4352,
@@ -178,6 +221,8 @@ enum ipset_cmd_flags {
 		(1 << IPSET_FLAG_BIT_SKIP_SUBCOUNTER_UPDATE),
 	IPSET_FLAG_BIT_MATCH_COUNTERS = 5,
 	IPSET_FLAG_MATCH_COUNTERS = (1 << IPSET_FLAG_BIT_MATCH_COUNTERS),
+	IPSET_FLAG_BIT_LIST_STATS = 6,
+	IPSET_FLAG_LIST_STATS	= (1 << IPSET_FLAG_BIT_LIST_STATS),
 	IPSET_FLAG_BIT_RETURN_NOMATCH = 7,
 	IPSET_FLAG_RETURN_NOMATCH = (1 << IPSET_FLAG_BIT_RETURN_NOMATCH),
 	IPSET_FLAG_BIT_MAP_SKBMARK = 8,
@@ -186,7 +231,19 @@ enum ipset_cmd_flags {
 	IPSET_FLAG_MAP_SKBPRIO = (1 << IPSET_FLAG_BIT_MAP_SKBPRIO),
 	IPSET_FLAG_BIT_MAP_SKBQUEUE = 10,
 	IPSET_FLAG_MAP_SKBQUEUE = (1 << IPSET_FLAG_BIT_MAP_SKBQUEUE),
-	IPSET_FLAG_CMD_MAX = 15,
+	IPSET_FLAG_BIT_ADD_ASYNC = 11,
+	IPSET_FLAG_ADD_ASYNC = (1 << IPSET_FLAG_BIT_ADD_ASYNC),
+	IPSET_FLAG_BIT_COARSE_REFRESH = 12,
+	IPSET_FLAG_COARSE_REFRESH = (1 << IPSET_FLAG_BIT_COARSE_REFRESH),
+	IPSET_FLAG_BIT_MONITOR_ELEM = 13,
+	IPSET_FLAG_MONITOR_ELEM = (1 << IPSET_FLAG_BIT_MONITOR_ELEM),
+	IPSET_FLAG_BIT_EXPIRED = 14,
+	IPSET_FLAG_EXPIRED = (1 << IPSET_FLAG_BIT_EXPIRED),
+	IPSET_FLAG_BIT_LIST_RESET = 15,
+	IPSET_FLAG_LIST_RESET = (1 << IPSET_FLAG_BIT_LIST_RESET),
+	IPSET_FLAG_BIT_MATCH_REFRESH = 16,
+	IPSET_FLAG_MATCH_REFRESH = (1 << IPSET_FLAG_BIT_MATCH_REFRESH),
+	IPSET_FLAG_CMD_MAX = 17,
 };
 
 /* Flags at CADT attribute level, upper half of cmdattrs */
@@ -207,6 +264,20 @@ enum ipset_cadt_flags {
 	IPSET_FLAG_WITH_SKBINFO = (1 << IPSET_FLAG_BIT_WITH_SKBINFO),
 	IPSET_FLAG_BIT_IFACE_WILDCARD = 7,
 	IPSET_FLAG_IFACE_WILDCARD = (1 << IPSET_FLAG_BIT_IFACE_WILDCARD),
+	IPSET_FLAG_BIT_WITH_LPM = 8,
+	IPSET_FLAG_WITH_LPM = (1 << IPSET_FLAG_BIT_WITH_LPM),
+	IPSET_FLAG_BIT_WITH_PERCPU = 9,
+	IPSET_FLAG_WITH_PERCPU = (1 << IPSET_FLAG_BIT_WITH_PERCPU),
+	IPSET_FLAG_BIT_WITH_BLOOM = 10,
+	IPSET_FLAG_WITH_BLOOM = (1 << IPSET_FLAG_BIT_WITH_BLOOM),
+	IPSET_FLAG_BIT_WITH_PREALLOC = 11,
+	IPSET_FLAG_WITH_PREALLOC = (1 << IPSET_FLAG_BIT_WITH_PREALLOC),
+	IPSET_FLAG_BIT_WITH_INDEX = 12,
+	IPSET_FLAG_WITH_INDEX = (1 << IPSET_FLAG_BIT_WITH_INDEX),
+	IPSET_FLAG_BIT_WITH_AGGREGATE = 13,
+	IPSET_FLAG_WITH_AGGREGATE = (1 << IPSET_FLAG_BIT_WITH_AGGREGATE),
+	IPSET_FLAG_BIT_WITH_DISTINCT = 14,
+	IPSET_FLAG_WITH_DISTINCT = (1 << IPSET_FLAG_BIT_WITH_DISTINCT),
 	IPSET_FLAG_CADT_MAX	= 15,
 };
 
@@ -216,7 +287,19 @@ enum ipset_create_flags {
 	IPSET_CREATE_FLAG_FORCEADD = (1 << IPSET_CREATE_FLAG_BIT_FORCEADD),
 	IPSET_CREATE_FLAG_BIT_BUCKETSIZE = 1,
 	IPSET_CREATE_FLAG_BUCKETSIZE = (1 << IPSET_CREATE_FLAG_BIT_BUCKETSIZE),
-	IPSET_CREATE_FLAG_BIT_MAX = 7,
+	IPSET_CREATE_FLAG_BIT_LPM = 2,
+	IPSET_CREATE_FLAG_LPM = (1 << IPSET_CREATE_FLAG_BIT_LPM),
+	IPSET_CREATE_FLAG_BIT_PERCPU = 3,
+	IPSET_CREATE_FLAG_PERCPU = (1 << IPSET_CREATE_FLAG_BIT_PERCPU),
+	IPSET_CREATE_FLAG_BIT_BLOOM = 4,
+	IPSET_CREATE_FLAG_BLOOM = (1 << IPSET_CREATE_FLAG_BIT_BLOOM),
+	IPSET_CREATE_FLAG_BIT_PREALLOC = 5,
+	IPSET_CREATE_FLAG_PREALLOC = (1 << IPSET_CREATE_FLAG_BIT_PREALLOC),
+	IPSET_CREATE_FLAG_BIT_INDEX = 6,
+	IPSET_CREATE_FLAG_INDEX = (1 << IPSET_CREATE_FLAG_BIT_INDEX),
+	IPSET_CREATE_FLAG_BIT_AGGREGATE = 7,
+	IPSET_CREATE_FLAG_AGGREGATE = (1 << IPSET_CREATE_FLAG_BIT_AGGREGATE),
+	IPSET_CREATE_FLAG_BIT_MAX = 8,
 };
 
 /* Commands with settype-specific attributes */
@@ -267,6 +350,34 @@ enum {
 	IPSET_COUNTER_GT,
 };
 
+/* Counter of the top elements listing */
+enum {
+	IPSET_TOP_BYTES = 0,
+	IPSET_TOP_PACKETS,
+};
+
+/* Conntrack events populating the set: IPSET_ATTR_CTEVENTS */
+enum {
+	IPSET_CTEVENT_NEW	= (1 << 0),	/* add at new */
+	IPSET_CTEVENT_ASSURED	= (1 << 1),	/* add at assured */
+	IPSET_CTEVENT_DESTROY	= (1 << 2),	/* delete at destroy */
+};
+
+/* The dimensions matching the source in IPSET_ATTR_CTDIR are flagged by
+ * IPSET_DIM_*_SRC, the tuple of the reply direction by IPSET_CTDIR_REPLY.
+ */
+#define IPSET_CTDIR_REPLY	(1 << 8)
+
+/* Pages backing the hash table of a set: IPSET_ATTR_TABLEPAGES */
+enum {
+	IPSET_PAGES_SMALL = 0,	/* vmalloc area of base pages */
+	IPSET_PAGES_CONTIG,	/* physically contiguous, direct mapped */
+	IPSET_PAGES_HUGE,	/* vmalloc area of huge pages */
+};
+
+/* Max number of the top elements */
+#define IPSET_TOP_MAX	10000
+
 /* Backward compatibility for set match v3 */
 struct ip_set_counter_match0 {
 	__u8 op;
@@ -278,6 +389,20 @@ struct ip_set_counter_match {
 	__u8 op;
 };
 
+/* Header of IPSET_ATTR_ADT_PACKED: it is followed by count elements,
+ * each one the address of the family in network order and, when
+ * IPSET_PACKED_TIMEOUT is set, the timeout as a __be32.
+ */
+struct ip_set_adt_packed {
+	__u8 family;
+	__u8 flags;
+	__u16 count;
+};
+
+enum {
+	IPSET_PACKED_TIMEOUT = (1 << 0),
+};
+
 /* Interface to iptables/ip6tables */
 
 #define SO_IP_SET		83
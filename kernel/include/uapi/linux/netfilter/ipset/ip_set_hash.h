@@ -18,6 +18,50 @@ enum {
 	IPSET_ERR_HASH_RANGE_UNSUPPORTED,
 	/* Invalid range */
 	IPSET_ERR_HASH_RANGE,
+	/* Invalid or offline NUMA node */
+	IPSET_ERR_HASH_NUMA_NODE,
+};
+
+/* Hash functions of the keys */
+enum ipset_hashfn {
+	IPSET_HASHFN_JHASH,	/* default */
+	IPSET_HASHFN_HSIPHASH,
+	IPSET_HASHFN_MULSHIFT,	/* vector multiply-add-shift */
+	__IPSET_HASHFN_MAX,
+};
+
+/* IPSET_ATTR_NUMA value of the sets interleaved over the NUMA nodes */
+#define IPSET_NUMA_INTERLEAVE	0xffffffff
+
+/* Region lock statistics of a hash set, in IPSET_ATTR_LOCKSTAT */
+struct ip_set_hash_lockstat {
+	__be64 acquired;	/* number of lock acquisitions */
+	__be64 contended;	/* number of contended acquisitions */
+	__be64 wait;		/* time spent waiting for the locks, in ns */
+	__be64 hold;		/* time the locks were held, in ns */
+};
+
+/* Bins of the lookup histograms: zero, one, then the powers of two up to
+ * the last bin, which counts the larger values too
+ */
+#define IPSET_LOOKUP_HIST	8
+
+/* Lookup statistics of a hash set, in IPSET_ATTR_LOOKUPSTAT */
+struct ip_set_hash_lookupstat {
+	__be64 tests;		/* number of lookups */
+	__be64 hits;		/* lookups matching an element */
+	__be64 misses;		/* lookups matching no element */
+	__be64 probes[IPSET_LOOKUP_HIST];	/* by the buckets probed */
+	__be64 compares[IPSET_LOOKUP_HIST];	/* by the elements compared */
+};
+
+/* Memory usage of a hash set by components, in IPSET_ATTR_MEMSTAT */
+struct ip_set_hash_memstat {
+	__be64 table;		/* bucket pointer array, locks and indices */
+	__be64 buckets;		/* buckets without the extensions */
+	__be64 extensions;	/* extensions of the stored elements */
+	__be64 comments;	/* comment strings */
+	__be64 pending;		/* freed buckets waiting for a grace period */
 };
 
 
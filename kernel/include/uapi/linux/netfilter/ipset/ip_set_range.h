@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI__IP_SET_RANGE_H
+#define _UAPI__IP_SET_RANGE_H
+
+#include <linux/netfilter/ipset/ip_set.h>
+
+/* Range type specific error codes */
+enum {
+	/* Set is full */
+	IPSET_ERR_RANGE_FULL = IPSET_ERR_TYPE_SPECIFIC,
+};
+
+
+#endif /* _UAPI__IP_SET_RANGE_H */
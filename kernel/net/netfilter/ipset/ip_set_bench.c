@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ */
+
+/* Kernel module measuring the cost of the kernel side set operations.
+ *
+ * The sets are created and filled by the ipset command, then the
+ * operations are run on every online CPU with synthetic packets:
+ *
+ *	echo "SETNAME OP COUNT DIST ADDR [PORT]" \
+ *		> /sys/kernel/debug/ip_set_bench/run
+ *	cat /sys/kernel/debug/ip_set_bench/run
+ *
+ * OP is test, add, del or resize. COUNT packets are built with the
+ * addresses from ADDR on, sequentially (DIST seq) or at random (DIST
+ * random) in the range of COUNT addresses, and with PORT (default 80)
+ * as TCP ports. The source and destination addresses and ports of
+ * the packets are the same, so that every dimension of the set matches
+ * whatever its direction. resize times a single rehash of hash sets.
+ * The time of the garbage collection is reported by the ipset_gc
+ * tracepoint.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/inet.h>
+#include <linux/cpu.h>
+#include <linux/random.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <net/net_namespace.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
+MODULE_DESCRIPTION("ip_set: benchmark of the kernel side set operations");
+
+#define BENCH_MAX_KEYS		(1 << 22)
+#define BENCH_RESULT_SIZE	4096
+
+enum bench_op {
+	BENCH_TEST,
+	BENCH_ADD,
+	BENCH_DEL,
+	BENCH_RESIZE,
+};
+
+static const char * const bench_ops[] = {
+	[BENCH_TEST]	= "test",
+	[BENCH_ADD]	= "add",
+	[BENCH_DEL]	= "del",
+	[BENCH_RESIZE]	= "resize",
+};
+
+struct bench_run {
+	ip_set_id_t index;	/* the set referenced for the run */
+	struct ip_set *set;
+	enum bench_op op;
+	u8 family;
+	u32 count;		/* number of the keys */
+	union nf_inet_addr *keys; /* addresses of the packets */
+	__be16 port;
+};
+
+/* A run at a time, the results of the last one are kept */
+static DEFINE_MUTEX(bench_mutex);
+static char bench_result[BENCH_RESULT_SIZE];
+static size_t bench_result_len;
+static struct dentry *bench_dir;
+
+static struct sk_buff *
+bench_skb(u8 family)
+{
+	size_t len = (family == NFPROTO_IPV4 ? sizeof(struct iphdr)
+					     : sizeof(struct ipv6hdr)) +
+		     sizeof(struct tcphdr);
+	struct sk_buff *skb = alloc_skb(len, GFP_KERNEL);
+
+	if (!skb)
+		return NULL;
+	skb_put(skb, len);
+	memset(skb->data, 0, len);
+	skb_reset_network_header(skb);
+	if (family == NFPROTO_IPV4) {
+		struct iphdr *iph = ip_hdr(skb);
+
+		iph->version = 4;
+		iph->ihl = sizeof(struct iphdr) / 4;
+		iph->ttl = 64;
+		iph->protocol = IPPROTO_TCP;
+		iph->tot_len = htons(len);
+		skb->protocol = htons(ETH_P_IP);
+		skb_set_transport_header(skb, sizeof(struct iphdr));
+	} else {
+		struct ipv6hdr *ip6h = ipv6_hdr(skb);
+
+		ip6h->version = 6;
+		ip6h->hop_limit = 64;
+		ip6h->nexthdr = IPPROTO_TCP;
+		ip6h->payload_len = htons(sizeof(struct tcphdr));
+		skb->protocol = htons(ETH_P_IPV6);
+		skb_set_transport_header(skb, sizeof(struct ipv6hdr));
+	}
+	tcp_hdr(skb)->doff = sizeof(struct tcphdr) / 4;
+	return skb;
+}
+
+static void
+bench_skb_key(struct sk_buff *skb, u8 family, const union nf_inet_addr *ip)
+{
+	if (family == NFPROTO_IPV4) {
+		ip_hdr(skb)->saddr = ip->ip;
+		ip_hdr(skb)->daddr = ip->ip;
+	} else {
+		ipv6_hdr(skb)->saddr = ip->in6;
+		ipv6_hdr(skb)->daddr = ip->in6;
+	}
+}
+
+/* Run on the measured CPU: the nanoseconds per operation are returned */
+static long
+bench_cpu(void *data)
+{
+	const struct bench_run *run = data;
+	struct ip_set_adt_opt opt = {
+		.family = run->family,
+		.dim = IPSET_DIM_MAX,
+		.flags = (1 << IPSET_DIM_MAX) - 1, /* source everywhere */
+		.ext.timeout = UINT_MAX,
+	};
+	struct xt_action_param par = {};
+#ifdef HAVE_STATE_IN_XT_ACTION_PARAM
+	struct nf_hook_state state = {
+		.net	= &init_net,
+		.pf	= run->family,
+	};
+#endif
+	struct sk_buff *skb;
+	u64 start, elapsed;
+	u32 i;
+
+#ifdef HAVE_STATE_IN_XT_ACTION_PARAM
+	par.state = &state;
+#else
+#ifdef HAVE_NET_IN_XT_ACTION_PARAM
+	par.net = &init_net;
+#endif
+	par.in = init_net.loopback_dev;
+	par.family = run->family;
+#endif
+	skb = bench_skb(run->family);
+	if (!skb)
+		return -ENOMEM;
+	tcp_hdr(skb)->source = run->port;
+	tcp_hdr(skb)->dest = run->port;
+
+	start = ktime_get_ns();
+	for (i = 0; i < run->count; i++) {
+		bench_skb_key(skb, run->family, &run->keys[i]);
+		switch (run->op) {
+		case BENCH_TEST:
+			ip_set_test(run->index, skb, &par, &opt);
+			break;
+		case BENCH_ADD:
+			ip_set_add(run->index, skb, &par, &opt);
+			break;
+		default:
+			ip_set_del(run->index, skb, &par, &opt);
+			break;
+		}
+	}
+	elapsed = ktime_get_ns() - start;
+	kfree_skb(skb);
+
+	return div_u64(elapsed, run->count);
+}
+
+static void
+bench_keys(struct bench_run *run, const union nf_inet_addr *first,
+	   bool random)
+{
+	union nf_inet_addr *ip;
+	u32 i, n;
+
+	for (i = 0; i < run->count; i++) {
+		ip = &run->keys[i];
+		*ip = *first;
+		n = random ? get_random_u32() % run->count : i;
+		if (run->family == NFPROTO_IPV4)
+			ip->ip = htonl(ntohl(ip->ip) + n);
+		else
+			ip->ip6[3] = htonl(ntohl(ip->ip6[3]) + n);
+	}
+}
+
+#define bench_printf(fmt, args...)					\
+	(bench_result_len += scnprintf(bench_result + bench_result_len,	\
+				       BENCH_RESULT_SIZE - bench_result_len, \
+				       fmt, ## args))
+
+static int
+bench_do(struct bench_run *run, const char *name)
+{
+	u64 start;
+	long ret;
+	int cpu;
+
+	bench_result_len = 0;
+	bench_printf("set %s type %s op %s count %u\n", name,
+		     run->set->type->name, bench_ops[run->op], run->count);
+	if (run->op == BENCH_RESIZE) {
+		if (!run->set->variant->resize)
+			return -EOPNOTSUPP;
+		start = ktime_get_ns();
+		ret = run->set->variant->resize(run->set, false);
+		bench_printf("resize %llu ns ret %ld\n",
+			     ktime_get_ns() - start, ret);
+		return 0;
+	}
+	cpus_read_lock();
+	for_each_online_cpu(cpu) {
+		ret = work_on_cpu(cpu, bench_cpu, run);
+		if (ret < 0)
+			break;
+		bench_printf("cpu %d %ld ns/op\n", cpu, ret);
+	}
+	cpus_read_unlock();
+
+	return ret < 0 ? ret : 0;
+}
+
+static ssize_t
+bench_write(struct file *file, const char __user *ubuf, size_t len,
+	    loff_t *ppos)
+{
+	char buf[IPSET_MAXNAMELEN + 128], name[IPSET_MAXNAMELEN];
+	char op[8], dist[8], addr[INET6_ADDRSTRLEN];
+	struct bench_run run = {};
+	union nf_inet_addr first = {};
+	unsigned int port = 80;
+	int ret;
+
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+	ret = sscanf(buf, "%31s %7s %u %7s %45s %u", name, op, &run.count,
+		     dist, addr, &port);
+	if (ret < 5 || !run.count || run.count > BENCH_MAX_KEYS ||
+	    port > 0xffff)
+		return -EINVAL;
+	ret = match_string(bench_ops, ARRAY_SIZE(bench_ops), op);
+	if (ret < 0)
+		return ret;
+	run.op = ret;
+	if (in4_pton(addr, -1, (u8 *)&first.ip, -1, NULL))
+		run.family = NFPROTO_IPV4;
+	else if (in6_pton(addr, -1, (u8 *)&first.in6, -1, NULL))
+		run.family = NFPROTO_IPV6;
+	else
+		return -EINVAL;
+	if (strcmp(dist, "seq") && strcmp(dist, "random"))
+		return -EINVAL;
+	run.port = htons(port);
+
+	run.index = ip_set_get_byname(&init_net, name, &run.set);
+	if (run.index == IPSET_INVALID_ID)
+		return -ENOENT;
+	run.keys = kvmalloc_array(run.count, sizeof(run.keys[0]), GFP_KERNEL);
+	if (!run.keys) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	bench_keys(&run, &first, !strcmp(dist, "random"));
+
+	mutex_lock(&bench_mutex);
+	ret = bench_do(&run, name);
+	mutex_unlock(&bench_mutex);
+	kvfree(run.keys);
+out:
+	ip_set_put_byindex(&init_net, run.index);
+	return ret < 0 ? ret : len;
+}
+
+static ssize_t
+bench_read(struct file *file, char __user *ubuf, size_t len, loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&bench_mutex);
+	ret = simple_read_from_buffer(ubuf, len, ppos, bench_result,
+				      bench_result_len);
+	mutex_unlock(&bench_mutex);
+	return ret;
+}
+
+static const struct file_operations bench_fops = {
+	.owner	= THIS_MODULE,
+	.read	= bench_read,
+	.write	= bench_write,
+	.llseek	= default_llseek,
+};
+
+static int __init
+ip_set_bench_init(void)
+{
+	bench_dir = debugfs_create_dir("ip_set_bench", NULL);
+	debugfs_create_file("run", 0600, bench_dir, NULL, &bench_fops);
+	return 0;
+}
+
+static void __exit
+ip_set_bench_fini(void)
+{
+	debugfs_remove_recursive(bench_dir);
+}
+
+module_init(ip_set_bench_init);
+module_exit(ip_set_bench_fini);
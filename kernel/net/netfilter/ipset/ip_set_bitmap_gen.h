@@ -14,8 +14,11 @@
 #define mtype_do_list		IPSET_TOKEN(MTYPE, _do_list)
 #define mtype_do_head		IPSET_TOKEN(MTYPE, _do_head)
 #define mtype_adt_elem		IPSET_TOKEN(MTYPE, _adt_elem)
+#define mtype_adt_range		IPSET_TOKEN(MTYPE, _adt_range)
 #define mtype_add_timeout	IPSET_TOKEN(MTYPE, _add_timeout)
 #define mtype_gc_init		IPSET_TOKEN(MTYPE, _gc_init)
+#define mtype_notify_expired	IPSET_TOKEN(MTYPE, _notify_expired)
+#define mtype_members_alloc	IPSET_TOKEN(MTYPE, _members_alloc)
 #define mtype_kadt		IPSET_TOKEN(MTYPE, _kadt)
 #define mtype_uadt		IPSET_TOKEN(MTYPE, _uadt)
 #define mtype_destroy		IPSET_TOKEN(MTYPE, _destroy)
@@ -33,13 +36,32 @@
 
 #define get_ext(set, map, id)	((map)->extensions + ((set)->dsize * (id)))
 
+/* The members bitmap is followed by a summary of its words: the bit of
+ * a word is set when it may hold elements with timeout.
+ */
+static bool
+mtype_members_alloc(struct mtype *map, u32 elements)
+{
+	u32 words = BITS_TO_LONGS(elements);
+
+	map->members = bitmap_zalloc(words * BITS_PER_LONG + words,
+				     GFP_KERNEL | __GFP_NOWARN);
+	if (!map->members)
+		return false;
+	map->timed = map->members + words;
+	map->memsize = (words + BITS_TO_LONGS(words)) * sizeof(unsigned long);
+
+	return true;
+}
+
 static void
-mtype_gc_init(struct ip_set *set, void (*gc)(GC_ARG))
+mtype_gc_init(struct ip_set *set, unsigned long (*gc)(struct ip_set_gc *gc))
 {
 	struct mtype *map = set->data;
 
-	TIMER_SETUP(&map->gc, gc);
-	mod_timer(&map->gc, jiffies + IPSET_GC_PERIOD(set->timeout) * HZ);
+	ip_set_gc_init(set, &map->gc, gc);
+	ip_set_gc_schedule(&map->gc,
+			   jiffies + IPSET_GC_PERIOD(set->timeout) * HZ);
 }
 
 static void
@@ -59,7 +81,7 @@ mtype_destroy(struct ip_set *set)
 	struct mtype *map = set->data;
 
 	if (SET_WITH_TIMEOUT(set))
-		del_timer_sync(&map->gc);
+		ip_set_gc_cancel(&map->gc);
 
 	if (set->dsize && set->extensions & IPSET_EXT_DESTROY)
 		mtype_ext_cleanup(set);
@@ -77,6 +99,7 @@ mtype_flush(struct ip_set *set)
 	if (set->extensions & IPSET_EXT_DESTROY)
 		mtype_ext_cleanup(set);
 	bitmap_zero(map->members, map->elements);
+	bitmap_zero(map->timed, BITS_TO_LONGS(map->elements));
 	set->elements = 0;
 	set->ext_size = 0;
 }
@@ -92,7 +115,8 @@ mtype_memsize(const struct mtype *map, size_t dsize)
 }
 
 static int
-mtype_head(struct ip_set *set, struct sk_buff *skb)
+mtype_head(struct ip_set *set, struct sk_buff *skb,
+	   const struct netlink_callback *cb)
 {
 	const struct mtype *map = set->data;
 	struct nlattr *nested;
@@ -147,25 +171,40 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 			set_bit(e->id, map->members);
 			return -IPSET_ERR_EXIST;
 		}
+#ifndef IP_SET_BITMAP_STORED_TIMEOUT
+		/* Stored timeouts may be plain values, not deadlines */
+		else if (ip_set_refresh_skip(set, x, ext, flags))
+			return 0;
+#endif
 		/* Element is re-added, cleanup extensions */
 		ip_set_ext_destroy(set, x);
 	}
 	if (ret > 0)
 		set->elements--;
 
-	if (SET_WITH_TIMEOUT(set))
+	if (SET_WITH_TIMEOUT(set)) {
 #ifdef IP_SET_BITMAP_STORED_TIMEOUT
 		mtype_add_timeout(ext_timeout(x, set), e, ext, set, map, ret);
 #else
 		ip_set_timeout_set(ext_timeout(x, set), ext->timeout);
 #endif
+		set_bit(BIT_WORD(e->id), map->timed);
+	}
 
 	if (SET_WITH_COUNTER(set))
-		ip_set_init_counter(ext_counter(x, set), ext);
+		ip_set_init_counter(set, ext_counter(x, set), ext);
 	if (SET_WITH_COMMENT(set))
 		ip_set_init_comment(set, ext_comment(x, set), ext);
 	if (SET_WITH_SKBINFO(set))
 		ip_set_init_skbinfo(ext_skbinfo(x, set), ext);
+	/* A re-added element keeps its sketch */
+	if (SET_WITH_DISTINCT(set) && ret != IPSET_ADD_FAILED)
+		ip_set_init_distinct(ext_distinct(x, set));
+	if (SET_WITH_RATELIMIT(set)) {
+		if (ret != IPSET_ADD_FAILED)
+			atomic64_set(&ext_ratelimit(x, set)->tat, 0);
+		ip_set_init_ratelimit(ext_ratelimit(x, set), ext);
+	}
 
 	/* Activate element */
 	set_bit(e->id, map->members);
@@ -195,6 +234,37 @@ mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 }
 
 #ifndef IP_SET_BITMAP_STORED_TIMEOUT
+/* Add/delete the ids of a range by whole words when there are no
+ * extensions. Stops at the first existing/missing element like the
+ * element by element loop unless IPSET_FLAG_EXIST is set.
+ */
+static int
+mtype_adt_range(struct ip_set *set, enum ipset_adt adt, u32 first, u32 last,
+		u32 flags)
+{
+	struct mtype *map = set->data;
+	bool eexist = flags & IPSET_FLAG_EXIST;
+	u32 end, weight;
+
+	if (adt == IPSET_ADD)
+		end = eexist ? last + 1 :
+		      find_next_bit(map->members, last + 1, first);
+	else
+		end = eexist ? last + 1 :
+		      find_next_zero_bit(map->members, last + 1, first);
+	weight = bitmap_weight(map->members, end) -
+		 bitmap_weight(map->members, first);
+	if (adt == IPSET_ADD) {
+		bitmap_set(map->members, first, end - first);
+		set->elements += end - first - weight;
+	} else {
+		bitmap_clear(map->members, first, end - first);
+		set->elements -= weight;
+	}
+
+	return end <= last ? -IPSET_ERR_EXIST : 0;
+}
+
 static bool
 mtype_is_filled(const struct mtype_elem *x)
 {
@@ -209,7 +279,7 @@ mtype_list(const struct ip_set *set,
 	struct mtype *map = set->data;
 	struct nlattr *adt, *nested;
 	void *x;
-	u32 id, first = cb->args[IPSET_CB_ARG0];
+	u32 id, first;
 	int ret = 0;
 
 	adt = ipset_nest_start(skb, IPSET_ATTR_ADT);
@@ -217,10 +287,12 @@ mtype_list(const struct ip_set *set,
 		return -EMSGSIZE;
 	/* Extensions may be replaced */
 	rcu_read_lock();
-	for (; cb->args[IPSET_CB_ARG0] < map->elements;
-	     cb->args[IPSET_CB_ARG0]++) {
+	first = find_next_bit(map->members, map->elements,
+			      cb->args[IPSET_CB_ARG0]);
+	for (id = first; id < map->elements;
+	     id = find_next_bit(map->members, map->elements, id + 1)) {
 		cond_resched_rcu();
-		id = cb->args[IPSET_CB_ARG0];
+		cb->args[IPSET_CB_ARG0] = id;
 		x = get_ext(set, map, id);
 		if (!test_bit(id, map->members) ||
 		    (SET_WITH_TIMEOUT(set) &&
@@ -264,30 +336,65 @@ out:
 	return ret;
 }
 
+/* Report an expired element to the listeners */
 static void
-mtype_gc(GC_ARG)
+mtype_notify_expired(struct ip_set *set, const struct mtype *map, u32 id)
 {
-	INIT_GC_VARS(mtype, map);
+	struct sk_buff *skb;
+	struct nlattr *nested;
+
+	skb = ip_set_notify_start(set, IPSET_CMD_DEL, IPSET_FLAG_EXPIRED);
+	if (!skb)
+		return;
+	nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
+	if (!nested || mtype_do_list(skb, map, id, set->dsize)) {
+		kfree_skb(skb);
+		return;
+	}
+	ipset_nest_end(skb, nested);
+	ip_set_notify_end(set, skb);
+}
+
+static unsigned long
+mtype_gc(struct ip_set_gc *gc)
+{
+	struct ip_set *set = gc->set;
+	struct mtype *map = set->data;
 	void *x;
-	u32 id;
+	u32 w, id, end;
+	bool timed;
 
 	/* We run parallel with other readers (test element)
 	 * but adding/deleting new entries is locked out
 	 */
 	spin_lock_bh(&set->lock);
-	for (id = 0; id < map->elements; id++)
-		if (mtype_gc_test(id, map, set->dsize)) {
+	for_each_set_bit(w, map->timed, BITS_TO_LONGS(map->elements)) {
+		end = min_t(u32, (w + 1) * BITS_PER_LONG, map->elements);
+		timed = false;
+		for (id = find_next_bit(map->members, end, w * BITS_PER_LONG);
+		     id < end; id = find_next_bit(map->members, end, id + 1)) {
+			if (!mtype_gc_test(id, map, set->dsize)) {
+				/* Timeout not started yet */
+				timed = true;
+				continue;
+			}
 			x = get_ext(set, map, id);
 			if (ip_set_timeout_expired(ext_timeout(x, set))) {
+				mtype_notify_expired(set, map, id);
 				clear_bit(id, map->members);
 				ip_set_ext_destroy(set, x);
 				set->elements--;
+			} else if (*ext_timeout(x, set) != IPSET_ELEM_PERMANENT) {
+				timed = true;
 			}
 		}
+		/* Only permanent elements are left in the word */
+		if (!timed)
+			clear_bit(w, map->timed);
+	}
 	spin_unlock_bh(&set->lock);
 
-	map->gc.expires = jiffies + IPSET_GC_PERIOD(set->timeout) * HZ;
-	add_timer(&map->gc);
+	return jiffies + IPSET_GC_PERIOD(set->timeout) * HZ;
 }
 
 static const struct ip_set_type_variant mtype = {
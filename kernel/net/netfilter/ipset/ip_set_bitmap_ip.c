@@ -15,6 +15,7 @@
 #include <linux/netlink.h>
 #include <linux/jiffies.h>
 #include <linux/timer.h>
+#include <linux/seqlock.h>
 #include <net/netlink.h>
 #include <net/tcp.h>
 
@@ -25,7 +26,10 @@
 #define IPSET_TYPE_REV_MIN	0
 /*				1	   Counter support added */
 /*				2	   Comment support added */
-#define IPSET_TYPE_REV_MAX	3	/* skbinfo support added */
+/*				3	   skbinfo support added */
+/*				4	   percpu counters support added */
+/*				5	   large range support added */
+#define IPSET_TYPE_REV_MAX	6	/* counter sampling support added */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -35,26 +39,59 @@ MODULE_ALIAS("ip_set_bitmap:ip");
 #define MTYPE		bitmap_ip
 #define HOST_MASK	32
 
+/* Large ranges are stored in chunks of 2^16 elements. A chunk is a sorted
+ * array, a bitmap or a sorted list of runs, whichever is the smallest.
+ */
+#define CHUNK_BITS	16
+#define CHUNK_SIZE	(1 << CHUNK_BITS)
+#define CHUNK_MASK	(CHUNK_SIZE - 1)
+/* The array and the bitmap chunks are of the same size at these limits */
+#define CHUNK_ARRAY_MAX	4096
+#define CHUNK_RUN_MAX	2048
+
+enum {
+	CHUNK_ARRAY,
+	CHUNK_BITMAP,
+	CHUNK_RUN,
+};
+
+struct bitmap_ip_chunk {
+	struct rcu_head rcu;
+	u8 type;		/* array, bitmap or run chunk */
+	bool dirty;		/* representation must be checked */
+	u16 cap;		/* allocated array entries or runs */
+	u16 len;		/* used array entries or runs */
+	u32 card;		/* number of elements in the chunk */
+	u16 data[]		/* values, bits or first/last pairs of the runs */
+		__aligned(__alignof__(u64));
+};
+
+#define chunk_bits(c)		((unsigned long *)(c)->data)
+#define chunk_run_first(c, i)	((c)->data[2 * (i)])
+#define chunk_run_last(c, i)	((c)->data[2 * (i) + 1])
+
 /* Type structure */
 struct bitmap_ip {
 	unsigned long *members;	/* the set members */
+	unsigned long *timed;	/* words with timeout, part of members */
+	struct bitmap_ip_chunk __rcu **chunks; /* the chunks of large ranges */
+	u32 nchunks;		/* number of chunks */
+	seqcount_t seq;		/* array and run chunks are changed in place */
+	bool dirty;		/* some chunks must be checked */
 	u32 first_ip;		/* host byte order, included in range */
 	u32 last_ip;		/* host byte order, included in range */
 	u32 elements;		/* number of max elements in the set */
 	u32 hosts;		/* number of hosts in a subnet */
-	size_t memsize;		/* members size */
+	size_t memsize;		/* members or chunks size */
 	u8 netmask;		/* subnet netmask */
-	struct timer_list gc;	/* garbage collection */
-#ifdef HAVE_TIMER_SETUP
-	struct ip_set *set;	/* attached to this ip_set */
-#endif
+	struct ip_set_gc gc;	/* garbage collection */
 	unsigned char extensions[]	/* data extensions */
 		__aligned(__alignof__(u64));
 };
 
 /* ADT structure for generic function args */
 struct bitmap_ip_adt_elem {
-	u16 id;
+	u32 id;
 };
 
 static u32
@@ -63,6 +100,375 @@ ip_to_id(const struct bitmap_ip *m, u32 ip)
 	return ((ip & ip_set_hostmask(m->netmask)) - m->first_ip) / m->hosts;
 }
 
+/* Chunk storage of large ranges */
+
+static size_t
+chunk_size(u8 type, u16 cap)
+{
+	switch (type) {
+	case CHUNK_BITMAP:
+		return sizeof(struct bitmap_ip_chunk) + CHUNK_SIZE / 8;
+	case CHUNK_RUN:
+		return sizeof(struct bitmap_ip_chunk) + cap * 2 * sizeof(u16);
+	default:
+		return sizeof(struct bitmap_ip_chunk) + cap * sizeof(u16);
+	}
+}
+
+static struct bitmap_ip_chunk *
+chunk_alloc(struct bitmap_ip *map, u8 type, u16 cap)
+{
+	struct bitmap_ip_chunk *c = kzalloc(chunk_size(type, cap), GFP_ATOMIC);
+
+	if (!c)
+		return NULL;
+	c->type = type;
+	c->cap = cap;
+	map->memsize += chunk_size(type, cap);
+	return c;
+}
+
+static void
+chunk_free(struct bitmap_ip *map, struct bitmap_ip_chunk *c)
+{
+	map->memsize -= chunk_size(c->type, c->cap);
+	kfree_rcu(c, rcu);
+}
+
+/* Position of the first array entry not smaller than low */
+static u32
+chunk_array_pos(const struct bitmap_ip_chunk *c, u32 len, u32 low)
+{
+	u32 l = 0, r = len, m;
+
+	while (l < r) {
+		m = (l + r) / 2;
+		if (READ_ONCE(c->data[m]) < low)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l;
+}
+
+/* Position of the first run not ending before low */
+static u32
+chunk_run_pos(const struct bitmap_ip_chunk *c, u32 len, u32 low)
+{
+	u32 l = 0, r = len, m;
+
+	while (l < r) {
+		m = (l + r) / 2;
+		if (READ_ONCE(chunk_run_last(c, m)) < low)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l;
+}
+
+/* The first element of the chunk not smaller than low or -1 */
+static int
+chunk_next(const struct bitmap_ip_chunk *c, u32 low)
+{
+	u32 len = min_t(u32, READ_ONCE(c->len), c->cap), i;
+
+	switch (c->type) {
+	case CHUNK_BITMAP:
+		i = find_next_bit(chunk_bits(c), CHUNK_SIZE, low);
+		return i < CHUNK_SIZE ? i : -1;
+	case CHUNK_RUN:
+		i = chunk_run_pos(c, len, low);
+		if (i == len)
+			return -1;
+		return max_t(u32, low, READ_ONCE(chunk_run_first(c, i)));
+	default:
+		i = chunk_array_pos(c, len, low);
+		return i < len ? READ_ONCE(c->data[i]) : -1;
+	}
+}
+
+/* Readers run parallel with the in place changes of the chunks */
+static int
+bitmap_ip_chunk_next(struct bitmap_ip *map, const struct bitmap_ip_chunk *c,
+		     u32 low)
+{
+	unsigned int seq;
+	int ret;
+
+	do {
+		seq = read_seqcount_begin(&map->seq);
+		ret = chunk_next(c, low);
+	} while (read_seqcount_retry(&map->seq, seq));
+
+	return ret;
+}
+
+/* Number of runs in the chunk */
+static u32
+chunk_runs(const struct bitmap_ip_chunk *c)
+{
+	const unsigned long *bits = chunk_bits(c);
+	u32 i, runs = 0;
+
+	switch (c->type) {
+	case CHUNK_BITMAP:
+		for (i = find_next_bit(bits, CHUNK_SIZE, 0); i < CHUNK_SIZE;
+		     i = find_next_bit(bits, CHUNK_SIZE,
+				       find_next_zero_bit(bits, CHUNK_SIZE, i)))
+			runs++;
+		return runs;
+	case CHUNK_RUN:
+		return c->len;
+	default:
+		for (i = 0; i < c->len; i++)
+			if (!i || c->data[i] != c->data[i - 1] + 1)
+				runs++;
+		return runs;
+	}
+}
+
+/* Append the first-last range to a new chunk */
+static void
+chunk_append(struct bitmap_ip_chunk *c, u32 first, u32 last)
+{
+	u32 i;
+
+	switch (c->type) {
+	case CHUNK_BITMAP:
+		bitmap_set(chunk_bits(c), first, last - first + 1);
+		break;
+	case CHUNK_RUN:
+		if (c->len && chunk_run_last(c, c->len - 1) + 1 == first) {
+			chunk_run_last(c, c->len - 1) = last;
+		} else {
+			chunk_run_first(c, c->len) = first;
+			chunk_run_last(c, c->len) = last;
+			c->len++;
+		}
+		break;
+	default:
+		for (i = first; i <= last; i++)
+			c->data[c->len++] = i;
+		break;
+	}
+	c->card += last - first + 1;
+}
+
+static void
+chunk_copy(struct bitmap_ip_chunk *dst, const struct bitmap_ip_chunk *src)
+{
+	const unsigned long *bits = chunk_bits(src);
+	u32 i, last;
+
+	switch (src->type) {
+	case CHUNK_BITMAP:
+		for (i = find_next_bit(bits, CHUNK_SIZE, 0); i < CHUNK_SIZE;
+		     i = find_next_bit(bits, CHUNK_SIZE, last)) {
+			last = find_next_zero_bit(bits, CHUNK_SIZE, i);
+			chunk_append(dst, i, last - 1);
+		}
+		break;
+	case CHUNK_RUN:
+		for (i = 0; i < src->len; i++)
+			chunk_append(dst, chunk_run_first(src, i),
+				     chunk_run_last(src, i));
+		break;
+	default:
+		for (i = 0; i < src->len; i++)
+			chunk_append(dst, src->data[i], src->data[i]);
+		break;
+	}
+}
+
+/* Replace the chunk by a copy in the given representation */
+static struct bitmap_ip_chunk *
+chunk_rebuild(struct bitmap_ip *map, u32 n, struct bitmap_ip_chunk *c,
+	      u8 type, u16 cap)
+{
+	struct bitmap_ip_chunk *tmp = chunk_alloc(map, type, cap);
+
+	if (!tmp)
+		return NULL;
+	chunk_copy(tmp, c);
+	tmp->dirty = c->dirty;
+	rcu_assign_pointer(map->chunks[n], tmp);
+	chunk_free(map, c);
+
+	return tmp;
+}
+
+/* Array or bitmap chunk which can store card elements */
+static struct bitmap_ip_chunk *
+chunk_expand(struct bitmap_ip *map, u32 n, struct bitmap_ip_chunk *c,
+	     u32 card)
+{
+	if (card <= CHUNK_ARRAY_MAX)
+		return chunk_rebuild(map, n, c, CHUNK_ARRAY, card);
+	return chunk_rebuild(map, n, c, CHUNK_BITMAP, 0);
+}
+
+#define chunk_dereference(set, map, n)		\
+	rcu_dereference_protected((map)->chunks[n],	\
+		lockdep_is_held(&(set)->lock))
+
+static int
+bitmap_ip_chunk_add_id(struct ip_set *set, struct bitmap_ip *map, u32 id)
+{
+	u32 n = id >> CHUNK_BITS, low = id & CHUNK_MASK, pos;
+	struct bitmap_ip_chunk *c = chunk_dereference(set, map, n);
+
+	if (!c) {
+		c = chunk_alloc(map, CHUNK_ARRAY, 4);
+		if (!c)
+			return -ENOMEM;
+		chunk_append(c, low, low);
+		rcu_assign_pointer(map->chunks[n], c);
+		return 0;
+	}
+retry:
+	switch (c->type) {
+	case CHUNK_BITMAP:
+		if (test_and_set_bit(low, chunk_bits(c)))
+			return -IPSET_ERR_EXIST;
+		c->card++;
+		break;
+	case CHUNK_RUN:
+		if (chunk_next(c, low) == low)
+			return -IPSET_ERR_EXIST;
+		c = chunk_expand(map, n, c, c->card + 1);
+		if (!c)
+			return -ENOMEM;
+		goto retry;
+	default:
+		pos = chunk_array_pos(c, c->len, low);
+		if (pos < c->len && c->data[pos] == low)
+			return -IPSET_ERR_EXIST;
+		if (c->len == c->cap) {
+			/* Grow the array or convert it to a bitmap */
+			c = chunk_expand(map, n, c,
+					 c->cap == CHUNK_ARRAY_MAX ?
+					 CHUNK_ARRAY_MAX + 1 :
+					 min(2 * c->cap, CHUNK_ARRAY_MAX));
+			if (!c)
+				return -ENOMEM;
+			goto retry;
+		}
+		write_seqcount_begin(&map->seq);
+		memmove(&c->data[pos + 1], &c->data[pos],
+			(c->len - pos) * sizeof(u16));
+		c->data[pos] = low;
+		c->len++;
+		write_seqcount_end(&map->seq);
+		c->card++;
+		break;
+	}
+	c->dirty = map->dirty = true;
+	return 0;
+}
+
+static int
+bitmap_ip_chunk_del_id(struct ip_set *set, struct bitmap_ip *map, u32 id)
+{
+	u32 n = id >> CHUNK_BITS, low = id & CHUNK_MASK, pos;
+	struct bitmap_ip_chunk *c = chunk_dereference(set, map, n);
+
+	if (!c)
+		return -IPSET_ERR_EXIST;
+retry:
+	switch (c->type) {
+	case CHUNK_BITMAP:
+		if (!test_and_clear_bit(low, chunk_bits(c)))
+			return -IPSET_ERR_EXIST;
+		c->card--;
+		break;
+	case CHUNK_RUN:
+		if (chunk_next(c, low) != low)
+			return -IPSET_ERR_EXIST;
+		c = chunk_expand(map, n, c, c->card);
+		if (!c)
+			return -ENOMEM;
+		goto retry;
+	default:
+		pos = chunk_array_pos(c, c->len, low);
+		if (pos == c->len || c->data[pos] != low)
+			return -IPSET_ERR_EXIST;
+		write_seqcount_begin(&map->seq);
+		memmove(&c->data[pos], &c->data[pos + 1],
+			(c->len - pos - 1) * sizeof(u16));
+		c->len--;
+		write_seqcount_end(&map->seq);
+		c->card--;
+		break;
+	}
+	if (!c->card) {
+		RCU_INIT_POINTER(map->chunks[n], NULL);
+		chunk_free(map, c);
+		return 0;
+	}
+	c->dirty = map->dirty = true;
+	return 0;
+}
+
+/* Add an empty or delete a full chunk of a range at once */
+static bool
+bitmap_ip_chunk_whole(struct ip_set *set, struct bitmap_ip *map,
+		      enum ipset_adt adt, u32 id, u32 id_to)
+{
+	u32 n = id >> CHUNK_BITS;
+	struct bitmap_ip_chunk *c;
+
+	if ((id & CHUNK_MASK) || id_to - id < CHUNK_MASK)
+		return false;
+	c = chunk_dereference(set, map, n);
+	if (adt == IPSET_ADD && !c) {
+		c = chunk_alloc(map, CHUNK_RUN, 1);
+		if (!c)
+			return false;
+		chunk_append(c, 0, CHUNK_MASK);
+		rcu_assign_pointer(map->chunks[n], c);
+		set->elements += CHUNK_SIZE;
+		return true;
+	}
+	if (adt == IPSET_DEL && c && c->card == CHUNK_SIZE) {
+		RCU_INIT_POINTER(map->chunks[n], NULL);
+		chunk_free(map, c);
+		set->elements -= CHUNK_SIZE;
+		return true;
+	}
+	return false;
+}
+
+/* Convert the changed chunks to the smallest representation */
+static void
+bitmap_ip_chunk_optimize(struct ip_set *set, struct bitmap_ip *map)
+{
+	struct bitmap_ip_chunk *c;
+	u32 n, runs;
+	u8 type;
+
+	for (n = 0; n < map->nchunks; n++) {
+		c = chunk_dereference(set, map, n);
+		if (!c || !c->dirty)
+			continue;
+		c->dirty = false;
+		runs = chunk_runs(c);
+		if (runs < CHUNK_RUN_MAX && 2 * runs < c->card)
+			type = CHUNK_RUN;
+		else if (c->card <= CHUNK_ARRAY_MAX)
+			type = CHUNK_ARRAY;
+		else
+			type = CHUNK_BITMAP;
+		/* Shrink arrays left mostly empty after deletions too */
+		if (type == c->type &&
+		    (type != CHUNK_ARRAY || c->cap <= 2 * c->len))
+			continue;
+		chunk_rebuild(map, n, c, type,
+			      type == CHUNK_RUN ? runs : c->card);
+	}
+	map->dirty = false;
+}
+
 /* Common functions */
 
 static int
@@ -128,6 +534,10 @@ bitmap_ip_kadt(struct ip_set *set, const struct sk_buff *skb,
 	return adtfn(set, &e, &ext, &opt->ext, opt->cmdflags);
 }
 
+static int
+bitmap_ip_adt_range(struct ip_set *set, enum ipset_adt adt,
+		    u32 first, u32 last, u32 flags);
+
 static int
 bitmap_ip_uadt(struct ip_set *set, struct nlattr *tb[],
 	       enum ipset_adt adt, u32 *lineno, u32 flags, bool retried)
@@ -137,6 +547,7 @@ bitmap_ip_uadt(struct ip_set *set, struct nlattr *tb[],
 	u32 ip = 0, ip_to = 0;
 	struct bitmap_ip_adt_elem e = { .id = 0 };
 	struct ip_set_ext ext = IP_SET_INIT_UEXT(set);
+	u64 next;
 	int ret = 0;
 
 	if (tb[IPSET_ATTR_LINENO])
@@ -183,8 +594,19 @@ bitmap_ip_uadt(struct ip_set *set, struct nlattr *tb[],
 	if (ip_to > map->last_ip)
 		return -IPSET_ERR_BITMAP_RANGE;
 
-	for (; !before(ip_to, ip); ip += map->hosts) {
-		e.id = ip_to_id(map, ip);
+	if (!map->chunks && !set->dsize)
+		return bitmap_ip_adt_range(set, adt, ip_to_id(map, ip),
+					   ip_to_id(map, ip) +
+					   (ip_to - ip) / map->hosts, flags);
+
+	for (next = ip; next <= ip_to; next += map->hosts) {
+		e.id = ip_to_id(map, next);
+		if (map->chunks &&
+		    bitmap_ip_chunk_whole(set, map, adt, e.id,
+					  ip_to_id(map, ip_to))) {
+			next += (u64)CHUNK_MASK * map->hosts;
+			continue;
+		}
 		ret = adtfn(set, &e, &ext, &ext, flags);
 
 		if (ret && !ip_set_eexist(ret, flags))
@@ -215,6 +637,182 @@ struct bitmap_ip_elem {
 
 #include "ip_set_bitmap_gen.h"
 
+/* Large range variant */
+
+static int
+bitmap_ip_chunk_test(struct ip_set *set, void *value,
+		     const struct ip_set_ext *ext,
+		     struct ip_set_ext *mext, u32 flags)
+{
+	struct bitmap_ip *map = set->data;
+	const struct bitmap_ip_adt_elem *e = value;
+	struct bitmap_ip_chunk *c;
+
+	c = rcu_dereference_bh(map->chunks[e->id >> CHUNK_BITS]);
+	if (!c)
+		return 0;
+	if (c->type == CHUNK_BITMAP)
+		return !!test_bit(e->id & CHUNK_MASK, chunk_bits(c));
+	return bitmap_ip_chunk_next(map, c, e->id & CHUNK_MASK) ==
+	       (e->id & CHUNK_MASK);
+}
+
+static int
+bitmap_ip_chunk_add(struct ip_set *set, void *value,
+		    const struct ip_set_ext *ext,
+		    struct ip_set_ext *mext, u32 flags)
+{
+	const struct bitmap_ip_adt_elem *e = value;
+	int ret = bitmap_ip_chunk_add_id(set, set->data, e->id);
+
+	if (ret == -IPSET_ERR_EXIST && (flags & IPSET_FLAG_EXIST))
+		return 0;
+	if (ret)
+		return ret;
+	set->elements++;
+
+	return 0;
+}
+
+static int
+bitmap_ip_chunk_del(struct ip_set *set, void *value,
+		    const struct ip_set_ext *ext,
+		    struct ip_set_ext *mext, u32 flags)
+{
+	const struct bitmap_ip_adt_elem *e = value;
+	int ret = bitmap_ip_chunk_del_id(set, set->data, e->id);
+
+	if (ret)
+		return ret;
+	set->elements--;
+
+	return 0;
+}
+
+static void
+bitmap_ip_chunk_flush(struct ip_set *set)
+{
+	struct bitmap_ip *map = set->data;
+	struct bitmap_ip_chunk *c;
+	u32 n;
+
+	for (n = 0; n < map->nchunks; n++) {
+		c = chunk_dereference(set, map, n);
+		if (!c)
+			continue;
+		RCU_INIT_POINTER(map->chunks[n], NULL);
+		chunk_free(map, c);
+	}
+	set->elements = 0;
+}
+
+static void
+bitmap_ip_chunk_destroy(struct ip_set *set)
+{
+	struct bitmap_ip *map = set->data;
+	u32 n;
+
+	for (n = 0; n < map->nchunks; n++)
+		kfree(rcu_dereference_protected(map->chunks[n], 1));
+	ip_set_free(map->chunks);
+	ip_set_free(map);
+
+	set->data = NULL;
+}
+
+/* Check the representation of the chunks changed by a batch */
+static void
+bitmap_ip_chunk_batch(struct ip_set *set, bool start)
+{
+	struct bitmap_ip *map = set->data;
+
+	if (start)
+		return;
+	spin_lock_bh(&set->lock);
+	if (map->dirty)
+		bitmap_ip_chunk_optimize(set, map);
+	spin_unlock_bh(&set->lock);
+}
+
+static int
+bitmap_ip_chunk_list(const struct ip_set *set,
+		     struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct bitmap_ip *map = set->data;
+	struct bitmap_ip_chunk *c;
+	struct nlattr *adt, *nested;
+	bool listed = false;
+	int low, ret = 0;
+	u32 id, n;
+
+	adt = ipset_nest_start(skb, IPSET_ATTR_ADT);
+	if (!adt)
+		return -EMSGSIZE;
+	rcu_read_lock();
+	for (; cb->args[IPSET_CB_ARG0] < map->elements;
+	     cb->args[IPSET_CB_ARG0] = id + 1) {
+		cond_resched_rcu();
+		id = cb->args[IPSET_CB_ARG0];
+		n = id >> CHUNK_BITS;
+		c = rcu_dereference(map->chunks[n]);
+		low = c ? bitmap_ip_chunk_next(map, c, id & CHUNK_MASK) : -1;
+		if (low < 0) {
+			/* Skip the rest of the chunk */
+			if (n + 1 == map->nchunks)
+				break;
+			id = ((n + 1) << CHUNK_BITS) - 1;
+			continue;
+		}
+		id = (n << CHUNK_BITS) + low;
+		nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
+		if (!nested) {
+			if (!listed) {
+				nla_nest_cancel(skb, adt);
+				ret = -EMSGSIZE;
+				goto out;
+			}
+			goto nla_put_failure;
+		}
+		if (bitmap_ip_do_list(skb, map, id, 0))
+			goto nla_put_failure;
+		ipset_nest_end(skb, nested);
+		listed = true;
+	}
+	ipset_nest_end(skb, adt);
+
+	/* Set listing finished */
+	cb->args[IPSET_CB_ARG0] = 0;
+
+	goto out;
+
+nla_put_failure:
+	nla_nest_cancel(skb, nested);
+	if (unlikely(!listed)) {
+		cb->args[IPSET_CB_ARG0] = 0;
+		ret = -EMSGSIZE;
+	}
+	ipset_nest_end(skb, adt);
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+static const struct ip_set_type_variant bitmap_ip_chunked = {
+	.kadt	= bitmap_ip_kadt,
+	.uadt	= bitmap_ip_uadt,
+	.adt	= {
+		[IPSET_ADD] = bitmap_ip_chunk_add,
+		[IPSET_DEL] = bitmap_ip_chunk_del,
+		[IPSET_TEST] = bitmap_ip_chunk_test,
+	},
+	.destroy = bitmap_ip_chunk_destroy,
+	.flush	= bitmap_ip_chunk_flush,
+	.head	= bitmap_ip_head,
+	.list	= bitmap_ip_chunk_list,
+	.batch	= bitmap_ip_chunk_batch,
+	.same_set = bitmap_ip_same_set,
+};
+
 /* Create bitmap:ip type of sets */
 
 static bool
@@ -222,9 +820,17 @@ init_map_ip(struct ip_set *set, struct bitmap_ip *map,
 	    u32 first_ip, u32 last_ip,
 	    u32 elements, u32 hosts, u8 netmask)
 {
-	map->members = bitmap_zalloc(elements, GFP_KERNEL | __GFP_NOWARN);
-	if (!map->members)
-		return false;
+	if (elements > IPSET_BITMAP_MAX_RANGE + 1) {
+		map->nchunks = (elements - 1) / CHUNK_SIZE + 1;
+		map->chunks = ip_set_alloc(map->nchunks * sizeof(*map->chunks));
+		if (!map->chunks)
+			return false;
+		map->memsize = map->nchunks * sizeof(*map->chunks);
+		seqcount_init(&map->seq);
+	} else {
+		if (!bitmap_ip_members_alloc(map, elements))
+			return false;
+	}
 	map->first_ip = first_ip;
 	map->last_ip = last_ip;
 	map->elements = elements;
@@ -232,9 +838,6 @@ init_map_ip(struct ip_set *set, struct bitmap_ip *map,
 	map->netmask = netmask;
 	set->timeout = IPSET_NO_TIMEOUT;
 
-#ifdef HAVE_TIMER_SETUP
-	map->set = set;
-#endif
 	set->data = map;
 	set->family = NFPROTO_IPV4;
 
@@ -315,24 +918,25 @@ bitmap_ip_create(struct net *net, struct ip_set *set, struct nlattr *tb[],
 		hosts = 2 << (32 - netmask - 1);
 		elements = 2 << (netmask - mask_bits - 1);
 	}
-	if (elements > IPSET_BITMAP_MAX_RANGE + 1)
+	set->dsize = ip_set_elem_len(set, tb, 0, 0);
+	/* Large ranges are supported without extensions only */
+	if (elements > IPSET_BITMAP_MAX_RANGE + 1 &&
+	    (set->revision < 5 || set->dsize || elements > U32_MAX))
 		return -IPSET_ERR_BITMAP_RANGE_SIZE;
 
 	pr_debug("hosts %u, elements %llu\n",
 		 hosts, (unsigned long long)elements);
 
-	set->dsize = ip_set_elem_len(set, tb, 0, 0);
 	map = ip_set_alloc(sizeof(*map) + elements * set->dsize);
 	if (!map)
 		return -ENOMEM;
 
-	map->memsize = BITS_TO_LONGS(elements) * sizeof(unsigned long);
-	set->variant = &bitmap_ip;
 	if (!init_map_ip(set, map, first_ip, last_ip,
 			 elements, hosts, netmask)) {
 		ip_set_free(map);
 		return -ENOMEM;
 	}
+	set->variant = map->chunks ? &bitmap_ip_chunked : &bitmap_ip;
 	if (tb[IPSET_ATTR_TIMEOUT]) {
 		set->timeout = ip_set_timeout_uget(tb[IPSET_ATTR_TIMEOUT]);
 		bitmap_ip_gc_init(set, bitmap_ip_gc);
@@ -356,6 +960,7 @@ static struct ip_set_type bitmap_ip_type __read_mostly = {
 		[IPSET_ATTR_NETMASK]	= { .type = NLA_U8  },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
 		[IPSET_ATTR_CADT_FLAGS]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 	},
 	.adt_policy	= {
 		[IPSET_ATTR_IP]		= { .type = NLA_NESTED },
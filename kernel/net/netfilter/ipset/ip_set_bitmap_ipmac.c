@@ -25,7 +25,9 @@
 #define IPSET_TYPE_REV_MIN	0
 /*				1	   Counter support added */
 /*				2	   Comment support added */
-#define IPSET_TYPE_REV_MAX	3	/* skbinfo support added */
+/*				3	   skbinfo support added */
+/*				4	   percpu counters support added */
+#define IPSET_TYPE_REV_MAX	5	/* counter sampling support added */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -44,21 +46,22 @@ enum {
 /* Type structure */
 struct bitmap_ipmac {
 	unsigned long *members;	/* the set members */
+	unsigned long *timed;	/* words with timeout, part of members */
 	u32 first_ip;		/* host byte order, included in range */
 	u32 last_ip;		/* host byte order, included in range */
 	u32 elements;		/* number of max elements in the set */
 	size_t memsize;		/* members size */
-	struct timer_list gc;	/* garbage collector */
-#ifdef HAVE_TIMER_SETUP
-	struct ip_set *set;	/* attached to this ip_set */
-#endif
+	struct ip_set_gc gc;	/* garbage collector */
 	unsigned char extensions[]	/* MAC + data extensions */
 		__aligned(__alignof__(u64));
 };
 
 /* ADT structure for generic function args */
 struct bitmap_ipmac_adt_elem {
-	unsigned char ether[ETH_ALEN] __aligned(2);
+	union {
+		unsigned char ether[ETH_ALEN];
+		u64 key;	/* the address, the spare bytes zeroed */
+	};
 	u16 id;
 	u16 add_mac;
 };
@@ -92,7 +95,7 @@ bitmap_ipmac_do_test(const struct bitmap_ipmac_adt_elem *e,
 		return 0;
 	elem = get_const_elem(map->extensions, e->id, dsize);
 	if (e->add_mac && elem->filled == MAC_FILLED)
-		return ether_addr_equal(e->ether, elem->ether);
+		return e->key == ip_set_ether_key(elem->ether);
 	/* Trigger kernel to fill out the ethernet address */
 	return -EAGAIN;
 }
@@ -116,7 +119,7 @@ bitmap_ipmac_is_filled(const struct bitmap_ipmac_elem *elem)
 }
 
 static int
-bitmap_ipmac_add_timeout(unsigned long *timeout,
+bitmap_ipmac_add_timeout(u32 *timeout,
 			 const struct bitmap_ipmac_adt_elem *e,
 			 const struct ip_set_ext *ext, struct ip_set *set,
 			 struct bitmap_ipmac *map, int mode)
@@ -153,7 +156,7 @@ bitmap_ipmac_do_add(const struct bitmap_ipmac_adt_elem *e,
 		if (elem->filled == MAC_FILLED) {
 			if (e->add_mac &&
 			    (flags & IPSET_FLAG_EXIST) &&
-			    !ether_addr_equal(e->ether, elem->ether)) {
+			    e->key != ip_set_ether_key(elem->ether)) {
 				/* memcpy isn't atomic */
 				clear_bit(e->id, map->members);
 				smp_mb__after_atomic();
@@ -180,6 +183,31 @@ bitmap_ipmac_do_add(const struct bitmap_ipmac_adt_elem *e,
 	return IPSET_ADD_STORE_PLAIN_TIMEOUT;
 }
 
+/* Fill the address of an element added without it and start its timer,
+ * called under the set lock
+ */
+static int
+bitmap_ipmac_fill(struct ip_set *set, struct bitmap_ipmac *map,
+		  const struct bitmap_ipmac_adt_elem *e,
+		  const struct ip_set_ext *ext)
+{
+	struct bitmap_ipmac_elem *elem =
+		get_elem(map->extensions, e->id, set->dsize);
+
+	/* memcpy isn't atomic */
+	clear_bit(e->id, map->members);
+	smp_mb__after_atomic();
+	ether_addr_copy(elem->ether, e->ether);
+	elem->filled = MAC_FILLED;
+	if (SET_WITH_TIMEOUT(set)) {
+		bitmap_ipmac_add_timeout(ext_timeout(elem, set), e, ext, set,
+					 map, IPSET_ADD_START_STORED_TIMEOUT);
+		set_bit(BIT_WORD(e->id), map->timed);
+	}
+	set_bit(e->id, map->members);
+	return 0;
+}
+
 static int
 bitmap_ipmac_do_del(const struct bitmap_ipmac_adt_elem *e,
 		    struct bitmap_ipmac *map)
@@ -228,15 +256,20 @@ bitmap_ipmac_kadt(struct ip_set *set, const struct sk_buff *skb,
 		return -EINVAL;
 
 	e.id = ip_to_id(map, ip);
-
-	if (opt->flags & IPSET_DIM_TWO_SRC)
-		ether_addr_copy(e.ether, eth_hdr(skb)->h_source);
-	else
-		ether_addr_copy(e.ether, eth_hdr(skb)->h_dest);
-
-	if (is_zero_ether_addr(e.ether))
+	e.key = ip_set_ether_key(opt->flags & IPSET_DIM_TWO_SRC ?
+				 eth_hdr(skb)->h_source :
+				 eth_hdr(skb)->h_dest);
+	if (!e.key)
 		return -EINVAL;
 
+	/* Learning the address of an element added without it, after a
+	 * test or by the SET target: the extensions are kept in place
+	 */
+	if (adt == IPSET_ADD && test_bit(e.id, map->members) &&
+	    !bitmap_ipmac_is_filled(get_const_elem(map->extensions, e.id,
+						   set->dsize)))
+		return bitmap_ipmac_fill(set, map, &e, &ext);
+
 	return adtfn(set, &e, &ext, &opt->ext, opt->cmdflags);
 }
 
@@ -272,7 +305,7 @@ bitmap_ipmac_uadt(struct ip_set *set, struct nlattr *tb[],
 	if (tb[IPSET_ATTR_ETHER]) {
 		if (nla_len(tb[IPSET_ATTR_ETHER]) != ETH_ALEN)
 			return -IPSET_ERR_PROTOCOL;
-		memcpy(e.ether, nla_data(tb[IPSET_ATTR_ETHER]), ETH_ALEN);
+		e.key = ip_set_ether_key(nla_data(tb[IPSET_ATTR_ETHER]));
 		e.add_mac = 1;
 	}
 	ret = adtfn(set, &e, &ext, &ext, flags);
@@ -302,17 +335,13 @@ static bool
 init_map_ipmac(struct ip_set *set, struct bitmap_ipmac *map,
 	       u32 first_ip, u32 last_ip, u32 elements)
 {
-	map->members = bitmap_zalloc(elements, GFP_KERNEL | __GFP_NOWARN);
-	if (!map->members)
+	if (!bitmap_ipmac_members_alloc(map, elements))
 		return false;
 	map->first_ip = first_ip;
 	map->last_ip = last_ip;
 	map->elements = elements;
 	set->timeout = IPSET_NO_TIMEOUT;
 
-#ifdef HAVE_TIMER_SETUP
-	map->set = set;
-#endif
 	set->data = map;
 	set->family = NFPROTO_IPV4;
 
@@ -365,7 +394,6 @@ bitmap_ipmac_create(struct net *net, struct ip_set *set, struct nlattr *tb[],
 	if (!map)
 		return -ENOMEM;
 
-	map->memsize = BITS_TO_LONGS(elements) * sizeof(unsigned long);
 	set->variant = &bitmap_ipmac;
 	if (!init_map_ipmac(set, map, first_ip, last_ip, elements)) {
 		ip_set_free(map);
@@ -393,6 +421,7 @@ static struct ip_set_type bitmap_ipmac_type = {
 		[IPSET_ATTR_CIDR]	= { .type = NLA_U8 },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
 		[IPSET_ATTR_CADT_FLAGS]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 	},
 	.adt_policy	= {
 		[IPSET_ATTR_IP]		= { .type = NLA_NESTED },
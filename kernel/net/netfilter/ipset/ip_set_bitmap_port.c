@@ -20,7 +20,9 @@
 #define IPSET_TYPE_REV_MIN	0
 /*				1	   Counter support added */
 /*				2	   Comment support added */
-#define IPSET_TYPE_REV_MAX	3	/* skbinfo support added */
+/*				3	   skbinfo support added */
+/*				4	   percpu counters support added */
+#define IPSET_TYPE_REV_MAX	5	/* counter sampling support added */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -32,14 +34,12 @@ MODULE_ALIAS("ip_set_bitmap:port");
 /* Type structure */
 struct bitmap_port {
 	unsigned long *members;	/* the set members */
+	unsigned long *timed;	/* words with timeout, part of members */
 	u16 first_port;		/* host byte order, included in range */
 	u16 last_port;		/* host byte order, included in range */
 	u32 elements;		/* number of max elements in the set */
 	size_t memsize;		/* members size */
-	struct timer_list gc;	/* garbage collection */
-#ifdef HAVE_TIMER_SETUP
-	struct ip_set *set;	/* attached to this ip_set */
-#endif
+	struct ip_set_gc gc;	/* garbage collection */
 	unsigned char extensions[]	/* data extensions */
 		__aligned(__alignof__(u64));
 };
@@ -152,6 +152,10 @@ bitmap_port_kadt(struct ip_set *set, const struct sk_buff *skb,
 	return adtfn(set, &e, &ext, &opt->ext, opt->cmdflags);
 }
 
+static int
+bitmap_port_adt_range(struct ip_set *set, enum ipset_adt adt,
+		      u32 first, u32 last, u32 flags);
+
 static int
 bitmap_port_uadt(struct ip_set *set, struct nlattr *tb[],
 		 enum ipset_adt adt, u32 *lineno, u32 flags, bool retried)
@@ -197,6 +201,10 @@ bitmap_port_uadt(struct ip_set *set, struct nlattr *tb[],
 	if (port_to > map->last_port)
 		return -IPSET_ERR_BITMAP_RANGE;
 
+	if (!set->dsize)
+		return bitmap_port_adt_range(set, adt, port_to_id(map, port),
+					     port_to_id(map, port_to), flags);
+
 	for (; port <= port_to; port++) {
 		e.id = port_to_id(map, port);
 		ret = adtfn(set, &e, &ext, &ext, flags);
@@ -234,16 +242,12 @@ static bool
 init_map_port(struct ip_set *set, struct bitmap_port *map,
 	      u16 first_port, u16 last_port)
 {
-	map->members = bitmap_zalloc(map->elements, GFP_KERNEL | __GFP_NOWARN);
-	if (!map->members)
+	if (!bitmap_port_members_alloc(map, map->elements))
 		return false;
 	map->first_port = first_port;
 	map->last_port = last_port;
 	set->timeout = IPSET_NO_TIMEOUT;
 
-#ifdef HAVE_TIMER_SETUP
-	map->set = set;
-#endif
 	set->data = map;
 	set->family = NFPROTO_UNSPEC;
 
@@ -276,7 +280,6 @@ bitmap_port_create(struct net *net, struct ip_set *set, struct nlattr *tb[],
 		return -ENOMEM;
 
 	map->elements = elements;
-	map->memsize = BITS_TO_LONGS(elements) * sizeof(unsigned long);
 	set->variant = &bitmap_port;
 	if (!init_map_port(set, map, first_port, last_port)) {
 		ip_set_free(map);
@@ -303,6 +306,7 @@ static struct ip_set_type bitmap_port_type = {
 		[IPSET_ATTR_PORT_TO]	= { .type = NLA_U16 },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
 		[IPSET_ATTR_CADT_FLAGS]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 	},
 	.adt_policy	= {
 		[IPSET_ATTR_PORT]	= { .type = NLA_U16 },
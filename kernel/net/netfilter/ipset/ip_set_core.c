@@ -13,6 +13,11 @@
 #include <linux/skbuff.h>
 #include <linux/spinlock.h>
 #include <linux/rculist.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/random.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <net/netlink.h>
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
@@ -21,6 +26,16 @@
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/ipset/ip_set.h>
+#include <linux/netfilter/ipset/ip_set_hash.h>
+#include <linux/netfilter/ipset/ip_set_getport.h>
+#ifdef HAVE_BTF_KFUNCS_START
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/nsproxy.h>
+#endif
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/ipset.h>
 #include <linux/netfilter/ipset/ip_set_compiler.h>
 
 static LIST_HEAD(ip_set_type_list);		/* all registered set types */
@@ -29,9 +44,37 @@ static DEFINE_RWLOCK(ip_set_ref_lock);		/* protects the set refs */
 
 struct ip_set_net {
 	struct ip_set * __rcu *ip_set_list;	/* all individual sets */
+	struct hlist_node *ip_set_hnode;	/* name hash nodes of the slots */
+	struct hlist_head *ip_set_hname;	/* slots hashed by set name */
 	ip_set_id_t	ip_set_max;	/* max number of sets */
+	ip_set_id_t	ip_set_free;	/* no free slot below */
+	u8		hname_bits;	/* size of the name hash in bits */
 	bool		is_deleted;	/* deleted by ip_set_net_exit */
 	bool		is_destroyed;	/* all sets are destroyed */
+	struct list_head monitors;	/* change notification listeners */
+	spinlock_t	monitor_lock;	/* protects the listeners */
+	unsigned int	monitor_elem;	/* listeners of element changes */
+	struct proc_dir_entry *proc_dir; /* /proc/net/ip_set */
+	spinlock_t	comment_lock;	/* protects the comment table */
+	struct hlist_head *comment_hash; /* interned comments */
+	u8		comment_bits;	/* size of the comment table in bits */
+	u32		comments;	/* number of interned comments */
+	atomic_long_t	mem;		/* memory charged by the sets */
+	unsigned long	mem_max;	/* memory budget, zero for none */
+	atomic_long_t	mem_rejected;	/* adds rejected by the budget */
+	spinlock_t	gc_lock;	/* protects the gc scheduler */
+	struct list_head gcs;		/* gc runs of the sets */
+	struct rb_root	gc_due;		/* pending gc runs by due time */
+	struct delayed_work gc_tick;	/* dispatches the due gc runs */
+	unsigned long	gc_next;	/* when gc_tick is armed for */
+	bool		gc_armed;	/* gc_tick is armed */
+	unsigned long	gc_window;	/* start of the current budget tick */
+	atomic64_t	gc_spent;	/* ns spent collecting in the tick */
+	u64		gc_runs;	/* number of gc runs */
+	u64		gc_lag;		/* total delay of the runs in ms */
+	u32		gc_lag_max;	/* maximal delay of a run in ms */
+	u64		gc_time;	/* time spent collecting in ns */
+	u64		gc_throttled;	/* ticks which ran out of the budget */
 };
 
 static unsigned int ip_set_net_id __read_mostly;
@@ -48,11 +91,72 @@ static unsigned int max_sets;
 
 module_param(max_sets, int, 0600);
 MODULE_PARM_DESC(max_sets, "maximal number of sets");
+
+static unsigned int monitor_rate = 10000;
+
+module_param(monitor_rate, uint, 0600);
+MODULE_PARM_DESC(monitor_rate,
+		 "maximal number of element notifications per second to a listener");
+
+static bool flow_cache;
+
+module_param(flow_cache, bool, 0600);
+MODULE_PARM_DESC(flow_cache, "cache the match results of the sets per CPU");
+
+DEFINE_STATIC_KEY_FALSE(ip_set_stats_key);
+EXPORT_SYMBOL_GPL(ip_set_stats_key);
+
+static bool stats;
+
+static int
+ip_set_stats_set(const char *val, const struct kernel_param *kp)
+{
+	bool old = stats;
+	int ret = param_set_bool(val, kp);
+
+	if (ret || stats == old)
+		return ret;
+	if (stats)
+		static_branch_inc(&ip_set_stats_key);
+	else
+		static_branch_dec(&ip_set_stats_key);
+	return 0;
+}
+
+static const struct kernel_param_ops ip_set_stats_ops = {
+	.set	= ip_set_stats_set,
+	.get	= param_get_bool,
+};
+
+module_param_cb(stats, &ip_set_stats_ops, &stats, 0600);
+MODULE_PARM_DESC(stats,
+		 "collect the lookup and region lock statistics of the hash sets");
+
+static unsigned long mem_max;
+
+module_param(mem_max, ulong, 0600);
+MODULE_PARM_DESC(mem_max,
+		 "default memory budget of the sets of a namespace in bytes, zero for none");
+
+static unsigned int gc_workers = 4;
+
+module_param(gc_workers, uint, 0444);
+MODULE_PARM_DESC(gc_workers, "maximal number of sets garbage collected in parallel");
+
+static unsigned int gc_budget = 10000;
+
+module_param(gc_budget, uint, 0600);
+MODULE_PARM_DESC(gc_budget,
+		 "CPU time of the garbage collection per 100ms in a namespace in microseconds, zero for unlimited");
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
 MODULE_DESCRIPTION("ip_set: protocol " __stringify(IPSET_PROTOCOL));
 MODULE_ALIAS_NFNL_SUBSYS(NFNL_SUBSYS_IPSET);
 
+/* Fired by the hash types */
+EXPORT_TRACEPOINT_SYMBOL_GPL(ipset_resize);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ipset_gc);
+
 /* When the nfnl mutex or ip_set_ref_lock is held: */
 #define ip_set_dereference(p)		\
 	rcu_dereference_protected(p,	\
@@ -63,6 +167,64 @@ MODULE_ALIAS_NFNL_SUBSYS(NFNL_SUBSYS_IPSET);
 #define ip_set_ref_netlink(inst,id)	\
 	rcu_dereference_raw((inst)->ip_set_list)[id]
 
+/* The set slots are hashed by the set names. The name hash is modified
+ * with the nfnl mutex and the ip_set_ref_lock held, so it can be looked
+ * up with any of them. Swapping keeps the names at the same slots.
+ */
+static inline struct hlist_head *
+ip_set_hname_head(struct ip_set_net *inst, const char *name)
+{
+	u32 h = jhash(name, strnlen(name, IPSET_MAXNAMELEN), 0);
+
+	return &inst->ip_set_hname[h & ((1U << inst->hname_bits) - 1)];
+}
+
+static inline void
+ip_set_hname_add(struct ip_set_net *inst, ip_set_id_t index)
+{
+	hlist_add_head(&inst->ip_set_hnode[index],
+		       ip_set_hname_head(inst, ip_set(inst, index)->name));
+}
+
+static inline void
+ip_set_hname_del(struct ip_set_net *inst, ip_set_id_t index)
+{
+	hlist_del_init(&inst->ip_set_hnode[index]);
+}
+
+/* Allocate the name hash for max slots and rehash the sets into it */
+static int
+ip_set_hname_resize(struct ip_set_net *inst, ip_set_id_t max)
+{
+	struct hlist_node *hnode, *old_hnode = inst->ip_set_hnode;
+	struct hlist_head *hname, *old_hname = inst->ip_set_hname;
+	u8 bits = order_base_2(max);
+	ip_set_id_t i;
+
+	hnode = kvcalloc(max, sizeof(*hnode), GFP_KERNEL);
+	hname = kvcalloc(1U << bits, sizeof(*hname), GFP_KERNEL);
+	if (!hnode || !hname) {
+		kvfree(hnode);
+		kvfree(hname);
+		return -ENOMEM;
+	}
+	write_lock_bh(&ip_set_ref_lock);
+	inst->ip_set_hnode = hnode;
+	inst->ip_set_hname = hname;
+	inst->hname_bits = bits;
+	for (i = 0; i < inst->ip_set_max; i++)
+		if (ip_set(inst, i))
+			ip_set_hname_add(inst, i);
+	write_unlock_bh(&ip_set_ref_lock);
+	kvfree(old_hnode);
+	kvfree(old_hname);
+
+	return 0;
+}
+
+static struct ip_set *
+find_set_and_id(struct ip_set_net *inst, const char *name, ip_set_id_t *id);
+
 /* The set types are implemented in modules and registered set types
  * can be found in ip_set_type_list. Adding/deleting types is
  * serialized by ip_set_type_mutex.
@@ -189,7 +351,8 @@ __find_set_type_minmax(const char *name, u8 family, u8 *min, u8 *max,
 }
 
 #define family_name(f)	((f) == NFPROTO_IPV4 ? "inet" : \
-			 (f) == NFPROTO_IPV6 ? "inet6" : "any")
+			 (f) == NFPROTO_IPV6 ? "inet6" : \
+			 (f) == NFPROTO_INET ? "inet46" : "any")
 
 /* Register a set type structure. The type is identified by
  * the unique triple of name, family and revision.
@@ -247,6 +410,74 @@ ip_set_type_unregister(struct ip_set_type *type)
 }
 EXPORT_SYMBOL_GPL(ip_set_type_unregister);
 
+/* The module populating the sets from the conntrack events. The sets are
+ * attached and detached under the nfnl mutex, which protects the pointer.
+ */
+static const struct ip_set_ctevent_ops *ip_set_ctevent_ops;
+
+int
+ip_set_ctevent_register(const struct ip_set_ctevent_ops *ops)
+{
+	int ret = 0;
+
+	nfnl_lock(NFNL_SUBSYS_IPSET);
+	if (ip_set_ctevent_ops)
+		ret = -EBUSY;
+	else
+		ip_set_ctevent_ops = ops;
+	nfnl_unlock(NFNL_SUBSYS_IPSET);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ip_set_ctevent_register);
+
+void
+ip_set_ctevent_unregister(const struct ip_set_ctevent_ops *ops)
+{
+	nfnl_lock(NFNL_SUBSYS_IPSET);
+	if (ip_set_ctevent_ops == ops)
+		ip_set_ctevent_ops = NULL;
+	nfnl_unlock(NFNL_SUBSYS_IPSET);
+}
+EXPORT_SYMBOL_GPL(ip_set_ctevent_unregister);
+
+/* Load the conntrack event module, the nfnl mutex is released meanwhile */
+static void
+ip_set_ctevent_load(void)
+{
+	if (ip_set_ctevent_ops)
+		return;
+	nfnl_unlock(NFNL_SUBSYS_IPSET);
+	pr_debug("try to load ip_set_ctevent\n");
+	if (request_module("ip_set_ctevent") < 0)
+		pr_warn("Can't find ip_set_ctevent\n");
+	nfnl_lock(NFNL_SUBSYS_IPSET);
+}
+
+static int
+ip_set_ctevent_attach(struct ip_set *set)
+{
+	const struct ip_set_ctevent_ops *ops = ip_set_ctevent_ops;
+	int ret;
+
+	if (!ops || !try_module_get(ops->me))
+		return -IPSET_ERR_CTEVENT;
+	ret = ops->attach(set);
+	if (ret)
+		module_put(ops->me);
+	return ret;
+}
+
+static void
+ip_set_ctevent_detach(struct ip_set *set)
+{
+	const struct ip_set_ctevent_ops *ops = ip_set_ctevent_ops;
+
+	/* The module is referenced by the attached sets */
+	ops->detach(set);
+	module_put(ops->me);
+}
+
 /* Utility functions */
 void *
 ip_set_alloc(size_t size)
@@ -255,6 +486,285 @@ ip_set_alloc(size_t size)
 }
 EXPORT_SYMBOL_GPL(ip_set_alloc);
 
+void *
+ip_set_alloc_node(size_t size, int node)
+{
+	return kvzalloc_node(size, GFP_KERNEL_ACCOUNT, node);
+}
+EXPORT_SYMBOL_GPL(ip_set_alloc_node);
+
+/* Allocate a large, randomly accessed array. From the size of a huge page
+ * the area is mapped by huge pages where the architecture supports it,
+ * which saves the TLB misses of the base pages of vmalloc. There is no
+ * node variant, so the node placed arrays are allocated as before. The
+ * kind of the backing pages is stored in pages.
+ */
+void *
+ip_set_alloc_huge(size_t size, int node, u8 *pages)
+{
+	void *members;
+
+#if defined(HAVE_VMALLOC_HUGE) && defined(CONFIG_HAVE_ARCH_HUGE_VMALLOC)
+	if (size >= PMD_SIZE && node == NUMA_NO_NODE) {
+		members = vmalloc_huge(size, GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+		if (members) {
+			*pages = IPSET_PAGES_HUGE;
+			return members;
+		}
+	}
+#endif
+	members = ip_set_alloc_node(size, node);
+	if (members)
+		*pages = is_vmalloc_addr(members) ? IPSET_PAGES_SMALL
+						  : IPSET_PAGES_CONTIG;
+	return members;
+}
+EXPORT_SYMBOL_GPL(ip_set_alloc_huge);
+
+/* Memory budget of the sets of a network namespace */
+
+/* Charge the memory allocated for a set, negative size to uncharge.
+ * Unless forced, the charge fails and is counted as a rejected add
+ * when the budget would be exceeded.
+ */
+bool
+ip_set_mem_charge(struct ip_set *set, long size, bool force)
+{
+	struct ip_set_net *inst = ip_set_pernet(set->net);
+	unsigned long max = READ_ONCE(inst->mem_max);
+
+	if (force || !max || size <= 0) {
+		atomic_long_add(size, &inst->mem);
+	} else if (atomic_long_add_return(size, &inst->mem) > max) {
+		atomic_long_sub(size, &inst->mem);
+		atomic_long_inc(&inst->mem_rejected);
+		return false;
+	}
+	atomic_long_add(size, &set->mem);
+	return true;
+}
+EXPORT_SYMBOL_GPL(ip_set_mem_charge);
+
+/* Whether the budget is used up: the adds should evict or give up */
+bool
+ip_set_mem_full(const struct ip_set *set)
+{
+	struct ip_set_net *inst = ip_set_pernet(set->net);
+	unsigned long max = READ_ONCE(inst->mem_max);
+
+	return max && atomic_long_read(&inst->mem) >= max;
+}
+EXPORT_SYMBOL_GPL(ip_set_mem_full);
+
+/* Uncharge what is left of a destroyed set */
+static void
+ip_set_mem_release(struct ip_set *set)
+{
+	struct ip_set_net *inst = ip_set_pernet(set->net);
+
+	atomic_long_sub(atomic_long_read(&set->mem), &inst->mem);
+}
+
+/* Garbage collection scheduler of the sets of a network namespace.
+ *
+ * The pending runs are ordered by their due time in a tree and a single
+ * deferrable work dispatches the due ones to the bounded workqueue of
+ * the gc workers. The time spent by the runs is accounted in ticks of
+ * IP_SET_GC_TICK: when the budget of the tick is used up, the remaining
+ * due runs wait for the next tick and the running ones are asked to
+ * yield by ip_set_gc_yield().
+ */
+
+#define IP_SET_GC_TICK		(HZ / 10)
+
+static struct workqueue_struct *ip_set_gc_wq;
+
+/* Whether the budget of the tick is used up, counting the time of the
+ * run in progress as well
+ */
+static bool
+ip_set_gc_spent(struct ip_set_net *inst, u64 running)
+{
+	u64 budget = (u64)READ_ONCE(gc_budget) * NSEC_PER_USEC;
+
+	return budget && atomic64_read(&inst->gc_spent) + running >= budget;
+}
+
+/* Dispatch at the given time at the latest, gc_lock must be held */
+static void
+ip_set_gc_arm(struct ip_set_net *inst, unsigned long when)
+{
+	if (inst->gc_armed && !time_before(when, inst->gc_next))
+		return;
+	inst->gc_next = when;
+	inst->gc_armed = true;
+	mod_delayed_work(system_power_efficient_wq, &inst->gc_tick,
+			 time_after(when, jiffies) ? when - jiffies : 0);
+}
+
+/* Add a run to the due order, gc_lock must be held */
+static void
+ip_set_gc_insert(struct ip_set_net *inst, struct ip_set_gc *gc,
+		 unsigned long due)
+{
+	struct rb_node **p = &inst->gc_due.rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (time_before(due,
+				rb_entry(parent, struct ip_set_gc, node)->due))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	gc->due = due;
+	gc->state = IP_SET_GC_PENDING;
+	rb_link_node(&gc->node, parent, p);
+	rb_insert_color(&gc->node, &inst->gc_due);
+	ip_set_gc_arm(inst, due);
+}
+
+static void
+ip_set_gc_tick(struct work_struct *work)
+{
+	struct ip_set_net *inst = container_of(to_delayed_work(work),
+					       struct ip_set_net, gc_tick);
+	unsigned long now = jiffies;
+	struct ip_set_gc *gc;
+	struct rb_node *node;
+	u32 lag;
+
+	spin_lock_bh(&inst->gc_lock);
+	inst->gc_armed = false;
+	if (time_after_eq(now, inst->gc_window + IP_SET_GC_TICK)) {
+		inst->gc_window = now;
+		atomic64_set(&inst->gc_spent, 0);
+	}
+	while ((node = rb_first(&inst->gc_due))) {
+		gc = rb_entry(node, struct ip_set_gc, node);
+		if (time_after(gc->due, now)) {
+			ip_set_gc_arm(inst, gc->due);
+			break;
+		}
+		if (ip_set_gc_spent(inst, 0)) {
+			inst->gc_throttled++;
+			ip_set_gc_arm(inst, inst->gc_window + IP_SET_GC_TICK);
+			break;
+		}
+		rb_erase(node, &inst->gc_due);
+		RB_CLEAR_NODE(node);
+		gc->state = IP_SET_GC_RUNNING;
+		gc->kicked = false;
+		lag = jiffies_to_msecs(now - gc->due);
+		gc->runs++;
+		gc->lag += lag;
+		gc->lag_max = max(gc->lag_max, lag);
+		inst->gc_runs++;
+		inst->gc_lag += lag;
+		inst->gc_lag_max = max(inst->gc_lag_max, lag);
+		queue_work(ip_set_gc_wq, &gc->work);
+	}
+	spin_unlock_bh(&inst->gc_lock);
+}
+
+static void
+ip_set_gc_work(struct work_struct *work)
+{
+	struct ip_set_gc *gc = container_of(work, struct ip_set_gc, work);
+	struct ip_set_net *inst = ip_set_pernet(gc->set->net);
+	unsigned long due;
+	u64 time;
+
+	gc->start = ktime_get_ns();
+	due = gc->run(gc);
+	time = ktime_get_ns() - gc->start;
+	atomic64_add(time, &inst->gc_spent);
+
+	spin_lock_bh(&inst->gc_lock);
+	gc->time += time;
+	inst->gc_time += time;
+	if (gc->state == IP_SET_GC_RUNNING) {
+		if (gc->kicked && time_before(gc->kick, due))
+			due = gc->kick;
+		ip_set_gc_insert(inst, gc, due);
+	}
+	spin_unlock_bh(&inst->gc_lock);
+}
+
+/* Attach the gc of a set to the scheduler, without scheduling it */
+void
+ip_set_gc_init(struct ip_set *set, struct ip_set_gc *gc,
+	       unsigned long (*run)(struct ip_set_gc *gc))
+{
+	struct ip_set_net *inst = ip_set_pernet(set->net);
+
+	memset(gc, 0, sizeof(*gc));
+	RB_CLEAR_NODE(&gc->node);
+	INIT_WORK(&gc->work, ip_set_gc_work);
+	gc->set = set;
+	gc->run = run;
+	spin_lock_bh(&inst->gc_lock);
+	list_add_tail(&gc->list, &inst->gcs);
+	spin_unlock_bh(&inst->gc_lock);
+}
+EXPORT_SYMBOL_GPL(ip_set_gc_init);
+
+/* Run the gc at the given time at the latest. A running gc is scheduled
+ * again when its run returns.
+ */
+void
+ip_set_gc_schedule(struct ip_set_gc *gc, unsigned long due)
+{
+	struct ip_set_net *inst = ip_set_pernet(gc->set->net);
+
+	spin_lock_bh(&inst->gc_lock);
+	switch (gc->state) {
+	case IP_SET_GC_PENDING:
+		if (!time_before(due, gc->due))
+			break;
+		rb_erase(&gc->node, &inst->gc_due);
+		fallthrough;
+	case IP_SET_GC_IDLE:
+		ip_set_gc_insert(inst, gc, due);
+		break;
+	case IP_SET_GC_RUNNING:
+		if (!gc->kicked || time_before(due, gc->kick)) {
+			gc->kick = due;
+			gc->kicked = true;
+		}
+		break;
+	}
+	spin_unlock_bh(&inst->gc_lock);
+}
+EXPORT_SYMBOL_GPL(ip_set_gc_schedule);
+
+/* Detach the gc of a set and wait for its run in progress */
+void
+ip_set_gc_cancel(struct ip_set_gc *gc)
+{
+	struct ip_set_net *inst = ip_set_pernet(gc->set->net);
+
+	spin_lock_bh(&inst->gc_lock);
+	if (gc->state == IP_SET_GC_PENDING)
+		rb_erase(&gc->node, &inst->gc_due);
+	gc->state = IP_SET_GC_STOPPED;
+	list_del(&gc->list);
+	spin_unlock_bh(&inst->gc_lock);
+	cancel_work_sync(&gc->work);
+}
+EXPORT_SYMBOL_GPL(ip_set_gc_cancel);
+
+/* Whether a run should stop and be continued later: the budget of the
+ * tick is used up. The run must make progress before asking.
+ */
+bool
+ip_set_gc_yield(const struct ip_set_gc *gc)
+{
+	return ip_set_gc_spent(ip_set_pernet(gc->set->net),
+			       ktime_get_ns() - gc->start);
+}
+EXPORT_SYMBOL_GPL(ip_set_gc_yield);
+
 void
 ip_set_free(void *members)
 {
@@ -314,16 +824,16 @@ ip_set_get_ipaddr6(struct nlattr *nla, union nf_inet_addr *ipaddr)
 EXPORT_SYMBOL_GPL(ip_set_get_ipaddr6);
 
 static u32
-ip_set_timeout_get(const unsigned long *timeout)
+ip_set_timeout_get(const u32 *timeout)
 {
-	u32 t;
+	s32 t;
 
 	if (*timeout == IPSET_ELEM_PERMANENT)
 		return 0;
 
-	t = jiffies_to_msecs(*timeout - jiffies) / MSEC_PER_SEC;
+	t = (s32)(*timeout - ip_set_timeout_now());
 	/* Zero value in userspace means no timeout */
-	return t == 0 ? 1 : t;
+	return t <= 0 ? 1 : t;
 }
 
 static char *
@@ -332,6 +842,91 @@ ip_set_comment_uget(struct nlattr *tb)
 	return nla_data(tb);
 }
 
+/* The comment table starts small and grows with the interned comments,
+ * it is accessed with the comment lock held only.
+ */
+#define IP_SET_COMMENT_BITS	6
+#define IP_SET_COMMENT_BITS_MAX	20
+
+static void
+ip_set_comment_grow(struct ip_set_net *inst)
+{
+	u8 bits = inst->comment_bits + 1;
+	struct hlist_head *hash;
+	struct ip_set_comment_rcu *c;
+	struct hlist_node *tmp;
+	u32 i;
+
+	/* Lookups stay correct with longer chains when it fails */
+	hash = kcalloc(jhash_size(bits), sizeof(*hash), GFP_ATOMIC);
+	if (!hash)
+		return;
+	for (i = 0; i < jhash_size(inst->comment_bits); i++)
+		hlist_for_each_entry_safe(c, tmp, &inst->comment_hash[i],
+					  node) {
+			hlist_del(&c->node);
+			hlist_add_head(&c->node,
+				       &hash[c->hash & jhash_mask(bits)]);
+		}
+	kfree(inst->comment_hash);
+	inst->comment_hash = hash;
+	inst->comment_bits = bits;
+}
+
+/* Get a reference to the interned comment of the set */
+static struct ip_set_comment_rcu *
+ip_set_comment_get(struct ip_set *set, const char *str, size_t len)
+{
+	struct ip_set_net *inst = ip_set_pernet(set->net);
+	struct ip_set_comment_rcu *c;
+	struct hlist_head *head;
+	u32 hash = jhash(str, len, (u32)(unsigned long)set);
+
+	spin_lock_bh(&inst->comment_lock);
+	head = &inst->comment_hash[hash & jhash_mask(inst->comment_bits)];
+	hlist_for_each_entry(c, head, node) {
+		if (c->set == set && c->hash == hash &&
+		    !strncmp(c->str, str, len) && !c->str[len]) {
+			c->ref++;
+			goto out;
+		}
+	}
+	c = kmalloc(sizeof(*c) + len + 1, GFP_ATOMIC);
+	if (unlikely(!c))
+		goto out;
+	memcpy(c->str, str, len);
+	c->str[len] = '\0';
+	c->set = set;
+	c->ref = 1;
+	c->hash = hash;
+	hlist_add_head(&c->node, head);
+	set->ext_size += ksize(c);
+	if (++inst->comments > jhash_size(inst->comment_bits) &&
+	    inst->comment_bits < IP_SET_COMMENT_BITS_MAX)
+		ip_set_comment_grow(inst);
+out:
+	spin_unlock_bh(&inst->comment_lock);
+	return c;
+}
+
+/* Release a reference, the last one frees the comment after a grace period
+ * because dumps may still read the string
+ */
+static void
+ip_set_comment_put(struct ip_set *set, struct ip_set_comment_rcu *c)
+{
+	struct ip_set_net *inst = ip_set_pernet(set->net);
+
+	spin_lock_bh(&inst->comment_lock);
+	if (--c->ref == 0) {
+		hlist_del(&c->node);
+		inst->comments--;
+		set->ext_size -= ksize(c);
+		kfree_rcu(c, rcu);
+	}
+	spin_unlock_bh(&inst->comment_lock);
+}
+
 /* Called from uadd only, protected by the set spinlock.
  * The kadt functions don't use the comment extensions in any way.
  */
@@ -339,24 +934,18 @@ void
 ip_set_init_comment(struct ip_set *set, struct ip_set_comment *comment,
 		    const struct ip_set_ext *ext)
 {
-	struct ip_set_comment_rcu *c = rcu_dereference_protected(comment->c, 1);
+	struct ip_set_comment_rcu *old = rcu_dereference_protected(comment->c, 1);
+	struct ip_set_comment_rcu *c = NULL;
 	size_t len = ext->comment ? strlen(ext->comment) : 0;
 
-	if (unlikely(c)) {
-		set->ext_size -= sizeof(*c) + strlen(c->str) + 1;
-		kfree_rcu(c, rcu);
-		rcu_assign_pointer(comment->c, NULL);
-	}
-	if (!len)
-		return;
 	if (unlikely(len > IPSET_MAX_COMMENT_SIZE))
 		len = IPSET_MAX_COMMENT_SIZE;
-	c = kmalloc(sizeof(*c) + len + 1, GFP_ATOMIC);
-	if (unlikely(!c))
-		return;
-	strlcpy(c->str, ext->comment, len + 1);
-	set->ext_size += sizeof(*c) + strlen(c->str) + 1;
+	/* A refreshed element usually keeps its comment: get it first */
+	if (len)
+		c = ip_set_comment_get(set, ext->comment, len);
 	rcu_assign_pointer(comment->c, c);
+	if (unlikely(old))
+		ip_set_comment_put(set, old);
 }
 EXPORT_SYMBOL_GPL(ip_set_init_comment);
 
@@ -385,9 +974,87 @@ ip_set_comment_free(struct ip_set *set, void *ptr)
 	c = rcu_dereference_protected(comment->c, 1);
 	if (unlikely(!c))
 		return;
-	set->ext_size -= sizeof(*c) + strlen(c->str) + 1;
-	kfree_rcu(c, rcu);
 	rcu_assign_pointer(comment->c, NULL);
+	ip_set_comment_put(set, c);
+}
+
+/* Per-cpu counters */
+
+/* Called in add context: under the set or region lock */
+void
+ip_set_init_pcpu_counter(struct ip_set_counter *counter,
+			 const struct ip_set_ext *ext)
+{
+	struct ip_set_counter_pcpu *c =
+		container_of(counter, struct ip_set_counter_pcpu, base);
+	struct ip_set_counter_pcpu_rcu *p;
+	struct ip_set_counter_cpu *cpu_c;
+	u64 bytes = 0, packets = 0;
+	unsigned int start;
+	int cpu;
+
+	p = rcu_dereference_protected(c->pcpu, 1);
+	if (!p) {
+		p = kmalloc(sizeof(*p), GFP_ATOMIC);
+		if (!p)
+			goto init;
+		p->cpu = alloc_percpu_gfp(struct ip_set_counter_cpu,
+					  GFP_ATOMIC);
+		if (!p->cpu) {
+			kfree(p);
+			goto init;
+		}
+		for_each_possible_cpu(cpu)
+			u64_stats_init(&per_cpu_ptr(p->cpu, cpu)->syncp);
+		rcu_assign_pointer(c->pcpu, p);
+		goto init;
+	}
+	/* Element is re-added: keep the per-cpu values and store the
+	 * new ones as an offset to them
+	 */
+	for_each_possible_cpu(cpu) {
+		u64 b, pk;
+
+		cpu_c = per_cpu_ptr(p->cpu, cpu);
+		do {
+			start = u64_stats_fetch_begin(&cpu_c->syncp);
+			b = cpu_c->bytes;
+			pk = cpu_c->packets;
+		} while (u64_stats_fetch_retry(&cpu_c->syncp, start));
+		bytes += b;
+		packets += pk;
+	}
+init:
+	if (ext->bytes != ULLONG_MAX)
+		atomic64_set(&counter->bytes, (long long)(ext->bytes - bytes));
+	if (ext->packets != ULLONG_MAX)
+		atomic64_set(&counter->packets,
+			     (long long)(ext->packets - packets));
+}
+EXPORT_SYMBOL_GPL(ip_set_init_pcpu_counter);
+
+static void
+ip_set_counter_pcpu_free_rcu(struct rcu_head *head)
+{
+	struct ip_set_counter_pcpu_rcu *p =
+		container_of(head, struct ip_set_counter_pcpu_rcu, rcu);
+
+	free_percpu(p->cpu);
+	kfree(p);
+}
+
+static void
+ip_set_counter_pcpu_free(struct ip_set *set, void *ptr)
+{
+	struct ip_set_counter_pcpu *c =
+		container_of(ptr, struct ip_set_counter_pcpu, base);
+	struct ip_set_counter_pcpu_rcu *p;
+
+	p = rcu_dereference_protected(c->pcpu, 1);
+	if (!p)
+		return;
+	RCU_INIT_POINTER(c->pcpu, NULL);
+	call_rcu(&p->rcu, ip_set_counter_pcpu_free_rcu);
 }
 
 typedef void (*destroyer)(struct ip_set *, void *);
@@ -399,11 +1066,14 @@ const struct ip_set_ext_type ip_set_extensions[] = {
 		.flag	= IPSET_FLAG_WITH_COUNTERS,
 		.len	= sizeof(struct ip_set_counter),
 		.align	= __alignof__(struct ip_set_counter),
+		/* Called for per-cpu counters only */
+		.destroy = ip_set_counter_pcpu_free,
 	},
 	[IPSET_EXT_ID_TIMEOUT] = {
 		.type	= IPSET_EXT_TIMEOUT,
-		.len	= sizeof(unsigned long),
-		.align	= __alignof__(unsigned long),
+		.attr	= IPSET_ATTR_TIMEOUT,
+		.len	= sizeof(u32),
+		.align	= __alignof__(u32),
 	},
 	[IPSET_EXT_ID_SKBINFO] = {
 		.type	= IPSET_EXT_SKBINFO,
@@ -418,6 +1088,18 @@ const struct ip_set_ext_type ip_set_extensions[] = {
 		.align	 = __alignof__(struct ip_set_comment),
 		.destroy = ip_set_comment_free,
 	},
+	[IPSET_EXT_ID_DISTINCT] = {
+		.type	= IPSET_EXT_DISTINCT,
+		.flag	= IPSET_FLAG_WITH_DISTINCT,
+		.len	= sizeof(struct ip_set_distinct),
+		.align	= __alignof__(struct ip_set_distinct),
+	},
+	[IPSET_EXT_ID_RATELIMIT] = {
+		.type	= IPSET_EXT_RATELIMIT,
+		.attr	= IPSET_ATTR_RATE,
+		.len	= sizeof(struct ip_set_ratelimit),
+		.align	= __alignof__(struct ip_set_ratelimit),
+	},
 };
 EXPORT_SYMBOL_GPL(ip_set_extensions);
 
@@ -426,31 +1108,58 @@ add_extension(enum ip_set_ext_id id, u32 flags, struct nlattr *tb[])
 {
 	return ip_set_extensions[id].flag ?
 		(flags & ip_set_extensions[id].flag) :
-		!!tb[IPSET_ATTR_TIMEOUT];
+		!!tb[ip_set_extensions[id].attr];
 }
 
 size_t
 ip_set_elem_len(struct ip_set *set, struct nlattr *tb[], size_t len,
 		size_t align)
 {
-	enum ip_set_ext_id id;
-	u32 cadt_flags = 0;
+	enum ip_set_ext_id id, next;
+	size_t pad, min_pad;
+	u32 cadt_flags = 0, placed = 0;
 
 	if (tb[IPSET_ATTR_CADT_FLAGS])
 		cadt_flags = ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]);
 	if (cadt_flags & IPSET_FLAG_WITH_FORCEADD)
 		set->flags |= IPSET_CREATE_FLAG_FORCEADD;
+	if ((cadt_flags & IPSET_FLAG_WITH_COUNTERS) &&
+	    (cadt_flags & IPSET_FLAG_WITH_PERCPU))
+		set->flags |= IPSET_CREATE_FLAG_PERCPU;
 	if (!align)
 		align = 1;
-	for (id = 0; id < IPSET_EXT_ID_MAX; id++) {
-		if (!add_extension(id, cadt_flags, tb))
-			continue;
+	/* Pack the extensions: always place the one which needs the least
+	 * padding next, so that the small ones fill the holes
+	 */
+	for (;;) {
+		next = IPSET_EXT_ID_MAX;
+		min_pad = SIZE_MAX;
+		for (id = 0; id < IPSET_EXT_ID_MAX; id++) {
+			if ((placed & (1 << id)) ||
+			    !add_extension(id, cadt_flags, tb))
+				continue;
+			pad = ALIGN(len, ip_set_extensions[id].align) - len;
+			if (pad < min_pad) {
+				next = id;
+				min_pad = pad;
+			}
+		}
+		if (next == IPSET_EXT_ID_MAX)
+			break;
+		id = next;
+		placed |= 1 << id;
 		if (align < ip_set_extensions[id].align)
 			align = ip_set_extensions[id].align;
 		len = ALIGN(len, ip_set_extensions[id].align);
 		set->offset[id] = len;
 		set->extensions |= ip_set_extensions[id].type;
 		len += ip_set_extensions[id].len;
+		if (id == IPSET_EXT_ID_COUNTER && SET_WITH_PERCPU(set)) {
+			/* Room for the per-cpu part, freed at destroy */
+			len += sizeof(struct ip_set_counter_pcpu) -
+			       sizeof(struct ip_set_counter);
+			set->extensions |= IPSET_EXT_DESTROY;
+		}
 	}
 	return ALIGN(len, align);
 }
@@ -467,7 +1176,9 @@ ip_set_get_extensions(struct ip_set *set, struct nlattr *tb[],
 		     !ip_set_optattr_netorder(tb, IPSET_ATTR_BYTES) ||
 		     !ip_set_optattr_netorder(tb, IPSET_ATTR_SKBMARK) ||
 		     !ip_set_optattr_netorder(tb, IPSET_ATTR_SKBPRIO) ||
-		     !ip_set_optattr_netorder(tb, IPSET_ATTR_SKBQUEUE)))
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_SKBQUEUE) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_RATE) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_BURST)))
 		return -IPSET_ERR_PROTOCOL;
 
 	if (tb[IPSET_ATTR_TIMEOUT]) {
@@ -475,6 +1186,16 @@ ip_set_get_extensions(struct ip_set *set, struct nlattr *tb[],
 			return -IPSET_ERR_TIMEOUT;
 		ext->timeout = ip_set_timeout_uget(tb[IPSET_ATTR_TIMEOUT]);
 	}
+	if (tb[IPSET_ATTR_RATE] || tb[IPSET_ATTR_BURST]) {
+		if (!SET_WITH_RATELIMIT(set))
+			return -IPSET_ERR_RATELIMIT;
+		if (tb[IPSET_ATTR_RATE])
+			ext->rate = ip_set_get_h32(tb[IPSET_ATTR_RATE]);
+		if (tb[IPSET_ATTR_BURST])
+			ext->burst = ip_set_get_h32(tb[IPSET_ATTR_BURST]);
+		if (!ext->rate || !ext->burst)
+			return -IPSET_ERR_RATELIMIT;
+	}
 	if (tb[IPSET_ATTR_BYTES] || tb[IPSET_ATTR_PACKETS]) {
 		if (!SET_WITH_COUNTER(set))
 			return -IPSET_ERR_COUNTER;
@@ -513,26 +1234,125 @@ ip_set_get_extensions(struct ip_set *set, struct nlattr *tb[],
 }
 EXPORT_SYMBOL_GPL(ip_set_get_extensions);
 
-static u64
-ip_set_get_bytes(const struct ip_set_counter *counter)
+/* Fold the per-cpu values of the counter, under rcu_read_lock(_bh) */
+static void
+ip_set_get_pcpu_counter(const struct ip_set_counter *counter,
+			u64 *bytes, u64 *packets)
 {
-	return (u64)atomic64_read(&(counter)->bytes);
+	const struct ip_set_counter_pcpu *c =
+		container_of(counter, struct ip_set_counter_pcpu, base);
+	const struct ip_set_counter_pcpu_rcu *p;
+	const struct ip_set_counter_cpu *cpu_c;
+	unsigned int start;
+	u64 b, pk;
+	int cpu;
+
+	*bytes = (u64)atomic64_read(&counter->bytes);
+	*packets = (u64)atomic64_read(&counter->packets);
+	p = rcu_dereference_check(c->pcpu, rcu_read_lock_bh_held());
+	if (!p)
+		return;
+	for_each_possible_cpu(cpu) {
+		cpu_c = per_cpu_ptr(p->cpu, cpu);
+		do {
+			start = u64_stats_fetch_begin(&cpu_c->syncp);
+			b = cpu_c->bytes;
+			pk = cpu_c->packets;
+		} while (u64_stats_fetch_retry(&cpu_c->syncp, start));
+		*bytes += b;
+		*packets += pk;
+	}
 }
 
-static u64
-ip_set_get_packets(const struct ip_set_counter *counter)
+static void
+ip_set_get_counter(const struct ip_set *set,
+		   const struct ip_set_counter *counter,
+		   u64 *bytes, u64 *packets)
 {
-	return (u64)atomic64_read(&(counter)->packets);
+	if (SET_WITH_PERCPU(set)) {
+		ip_set_get_pcpu_counter(counter, bytes, packets);
+		return;
+	}
+	*bytes = (u64)atomic64_read(&(counter)->bytes);
+	*packets = (u64)atomic64_read(&(counter)->packets);
 }
 
-static bool
-ip_set_put_counter(struct sk_buff *skb, const struct ip_set_counter *counter)
+/* Called when a set is cloned, under rcu_read_lock_bh: the element is
+ * copied already, the data referenced by its extensions is duplicated.
+ */
+void
+ip_set_ext_clone(struct ip_set *set, void *data)
 {
-	return IPSET_NLA_PUT_NET64(skb, IPSET_ATTR_BYTES,
-				   cpu_to_be64(ip_set_get_bytes(counter)),
+	struct ip_set_ext ext = {};
+
+	if (SET_WITH_COMMENT(set)) {
+		struct ip_set_comment *comment = ext_comment(data, set);
+		struct ip_set_comment_rcu *c = rcu_dereference_bh(comment->c);
+
+		RCU_INIT_POINTER(comment->c, NULL);
+		if (c) {
+			ext.comment = c->str;
+			ip_set_init_comment(set, comment, &ext);
+		}
+	}
+	if (SET_WITH_COUNTER(set) && SET_WITH_PERCPU(set)) {
+		struct ip_set_counter *counter = ext_counter(data, set);
+		struct ip_set_counter_pcpu *c =
+			container_of(counter, struct ip_set_counter_pcpu, base);
+
+		/* The totals are stored as the base of the new counter */
+		ip_set_get_pcpu_counter(counter, &ext.bytes, &ext.packets);
+		RCU_INIT_POINTER(c->pcpu, NULL);
+		ip_set_init_pcpu_counter(counter, &ext);
+	}
+}
+EXPORT_SYMBOL_GPL(ip_set_ext_clone);
+
+/* round(m * ln(m / V)) for V empty registers: the linear counting of the
+ * small cardinalities
+ */
+static const u16 ip_set_distinct_small[IPSET_DISTINCT_REGS] = {
+	266, 222, 196, 177, 163, 151, 142, 133, 126, 119, 113, 107, 102,
+	97, 93, 89, 85, 81, 78, 74, 71, 68, 65, 63, 60, 58, 55, 53, 51, 48,
+	46, 44, 42, 40, 39, 37, 35, 33, 32, 30, 28, 27, 25, 24, 23, 21, 20,
+	18, 17, 16, 15, 13, 12, 11, 10, 9, 7, 6, 5, 4, 3, 2, 1, 0,
+};
+
+/* The HyperLogLog estimate alpha * m^2 / sum(2^-reg) in fixed point,
+ * with alpha * m^2 = 2904 for the 64 registers. The standard error is
+ * about 13%.
+ */
+static u32
+ip_set_distinct_estimate(const struct ip_set_distinct *distinct)
+{
+	u64 sum = 0, e;
+	u32 zeros = 0;
+	int i;
+
+	for (i = 0; i < IPSET_DISTINCT_REGS; i++) {
+		u8 reg = READ_ONCE(distinct->reg[i]);
+
+		sum += 1ULL << (32 - reg);
+		zeros += !reg;
+	}
+	e = div64_u64(2904ULL << 32, sum);
+	if (e <= 5 * IPSET_DISTINCT_REGS / 2 && zeros)
+		return ip_set_distinct_small[zeros - 1];
+	return e;
+}
+
+static bool
+ip_set_put_counter(struct sk_buff *skb, const struct ip_set *set,
+		   const struct ip_set_counter *counter)
+{
+	u64 bytes, packets;
+
+	ip_set_get_counter(set, counter, &bytes, &packets);
+	return IPSET_NLA_PUT_NET64(skb, IPSET_ATTR_BYTES,
+				   cpu_to_be64(bytes),
 				   IPSET_ATTR_PAD) ||
 	       IPSET_NLA_PUT_NET64(skb, IPSET_ATTR_PACKETS,
-				   cpu_to_be64(ip_set_get_packets(counter)),
+				   cpu_to_be64(packets),
 				   IPSET_ATTR_PAD);
 }
 
@@ -553,12 +1373,22 @@ ip_set_put_skbinfo(struct sk_buff *skb, const struct ip_set_skbinfo *skbinfo)
 			      cpu_to_be16(skbinfo->skbqueue)));
 }
 
+static bool
+ip_set_put_ratelimit(struct sk_buff *skb,
+		     const struct ip_set_ratelimit *ratelimit)
+{
+	return nla_put_net32(skb, IPSET_ATTR_RATE,
+			     htonl(READ_ONCE(ratelimit->rate))) ||
+	       nla_put_net32(skb, IPSET_ATTR_BURST,
+			     htonl(READ_ONCE(ratelimit->burst)));
+}
+
 int
 ip_set_put_extensions(struct sk_buff *skb, const struct ip_set *set,
 		      const void *e, bool active)
 {
 	if (SET_WITH_TIMEOUT(set)) {
-		unsigned long *timeout = ext_timeout(e, set);
+		u32 *timeout = ext_timeout(e, set);
 
 		if (nla_put_net32(skb, IPSET_ATTR_TIMEOUT,
 			htonl(active ? ip_set_timeout_get(timeout)
@@ -566,7 +1396,7 @@ ip_set_put_extensions(struct sk_buff *skb, const struct ip_set *set,
 			return -EMSGSIZE;
 	}
 	if (SET_WITH_COUNTER(set) &&
-	    ip_set_put_counter(skb, ext_counter(e, set)))
+	    ip_set_put_counter(skb, set, ext_counter(e, set)))
 		return -EMSGSIZE;
 	if (SET_WITH_COMMENT(set) &&
 	    ip_set_put_comment(skb, ext_comment(e, set)))
@@ -574,10 +1404,112 @@ ip_set_put_extensions(struct sk_buff *skb, const struct ip_set *set,
 	if (SET_WITH_SKBINFO(set) &&
 	    ip_set_put_skbinfo(skb, ext_skbinfo(e, set)))
 		return -EMSGSIZE;
+	if (SET_WITH_DISTINCT(set) &&
+	    nla_put_net32(skb, IPSET_ATTR_DISTINCT,
+			  htonl(ip_set_distinct_estimate(ext_distinct(e, set)))))
+		return -EMSGSIZE;
+	if (SET_WITH_RATELIMIT(set) &&
+	    ip_set_put_ratelimit(skb, ext_ratelimit(e, set)))
+		return -EMSGSIZE;
 	return 0;
 }
 EXPORT_SYMBOL_GPL(ip_set_put_extensions);
 
+/* Reset on read: the values put into the element attribute of the dump
+ * are subtracted, so the updates racing with the dump are kept.
+ */
+void
+ip_set_reset_counter(const struct ip_set *set, void *data,
+		     const struct nlattr *nla)
+{
+	struct ip_set_counter *counter = ext_counter(data, set);
+	const struct nlattr *attr;
+
+	attr = nla_find_nested(nla, IPSET_ATTR_BYTES);
+	if (attr)
+		atomic64_sub((long long)be64_to_cpu(nla_get_be64(attr)),
+			     &counter->bytes);
+	attr = nla_find_nested(nla, IPSET_ATTR_PACKETS);
+	if (attr)
+		atomic64_sub((long long)be64_to_cpu(nla_get_be64(attr)),
+			     &counter->packets);
+}
+EXPORT_SYMBOL_GPL(ip_set_reset_counter);
+
+/* The counter value of an element by which the top elements are listed */
+u64
+ip_set_top_value(const struct ip_set *set, const void *data, u8 top_by)
+{
+	u64 bytes, packets;
+
+	ip_set_get_counter(set, ext_counter(data, set), &bytes, &packets);
+	return top_by == IPSET_TOP_PACKETS ? packets : bytes;
+}
+EXPORT_SYMBOL_GPL(ip_set_top_value);
+
+/* Whether an element matches the condition of the purge command,
+ * called with the element locked
+ */
+bool
+ip_set_purge_match(const struct ip_set *set, const void *data,
+		   const struct ip_set_purge *p)
+{
+	if (p->comment) {
+		const struct ip_set_comment_rcu *c =
+			rcu_dereference_bh(ext_comment(data, set)->c);
+
+		if (!c || strncmp(c->str, p->comment, p->comment_len))
+			return false;
+	}
+	if (p->bytes != ULLONG_MAX || p->packets != ULLONG_MAX) {
+		u64 bytes, packets;
+
+		ip_set_get_counter(set, ext_counter(data, set),
+				   &bytes, &packets);
+		if (bytes >= p->bytes || packets >= p->packets)
+			return false;
+	}
+	if (p->timeout != IPSET_NO_TIMEOUT) {
+		u32 t = READ_ONCE(*ext_timeout(data, set));
+
+		if (t == IPSET_ELEM_PERMANENT ||
+		    (s32)(t - ip_set_timeout_now()) >= (s32)p->timeout)
+			return false;
+	}
+	return true;
+}
+EXPORT_SYMBOL_GPL(ip_set_purge_match);
+
+/* Keep the max largest values in a min-heap: the root is the smallest
+ * one, i.e. the threshold of the top elements when the heap is full.
+ */
+void
+ip_set_top_add(u64 *heap, u32 *size, u32 max, u64 value)
+{
+	u32 i, child;
+
+	if (*size < max) {
+		/* Sift up the new leaf */
+		for (i = (*size)++; i && heap[(i - 1) / 2] > value;
+		     i = (i - 1) / 2)
+			heap[i] = heap[(i - 1) / 2];
+		heap[i] = value;
+		return;
+	}
+	if (!max || value <= heap[0])
+		return;
+	/* Replace the root and sift it down */
+	for (i = 0; (child = 2 * i + 1) < max; i = child) {
+		if (child + 1 < max && heap[child + 1] < heap[child])
+			child++;
+		if (heap[child] >= value)
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = value;
+}
+EXPORT_SYMBOL_GPL(ip_set_top_add);
+
 static bool
 ip_set_match_counter(u64 counter, u64 match, u8 op)
 {
@@ -608,14 +1540,125 @@ ip_set_add_packets(u64 packets, struct ip_set_counter *counter)
 	atomic64_add((long long)packets, &(counter)->packets);
 }
 
+/* Called with bottom halves disabled */
+static bool
+ip_set_update_pcpu_counter(struct ip_set_counter *counter,
+			   u64 bytes, u64 packets)
+{
+	struct ip_set_counter_pcpu *c =
+		container_of(counter, struct ip_set_counter_pcpu, base);
+	struct ip_set_counter_pcpu_rcu *p = rcu_dereference_bh(c->pcpu);
+	struct ip_set_counter_cpu *cpu_c;
+
+	if (unlikely(!p))
+		return false;
+	cpu_c = this_cpu_ptr(p->cpu);
+	u64_stats_update_begin(&cpu_c->syncp);
+	cpu_c->bytes += bytes;
+	cpu_c->packets += packets;
+	u64_stats_update_end(&cpu_c->syncp);
+	return true;
+}
+
+/* Per-cpu xorshift state of the counter sampling */
+static DEFINE_PER_CPU(u32, ip_set_sample_state);
+
+/* Called with bottom halves disabled */
+static bool
+ip_set_sample_hit(const struct ip_set *set)
+{
+	u32 x = __this_cpu_read(ip_set_sample_state);
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	__this_cpu_write(ip_set_sample_state, x);
+	return reciprocal_scale(x, set->sample) == 0;
+}
+
 static void
-ip_set_update_counter(struct ip_set_counter *counter,
+ip_set_update_counter(struct ip_set *set, struct ip_set_counter *counter,
 		      const struct ip_set_ext *ext, u32 flags)
 {
+	u64 bytes = ext->bytes, packets = ext->packets;
+
 	if (ext->packets != ULLONG_MAX &&
 	    !(flags & IPSET_FLAG_SKIP_COUNTER_UPDATE)) {
-		ip_set_add_bytes(ext->bytes, counter);
-		ip_set_add_packets(ext->packets, counter);
+		/* The sampled packets stand for the skipped ones too */
+		if (SET_WITH_SAMPLE(set)) {
+			if (!ip_set_sample_hit(set))
+				return;
+			bytes *= set->sample;
+			packets *= set->sample;
+		}
+		if (SET_WITH_PERCPU(set) &&
+		    ip_set_update_pcpu_counter(counter, bytes, packets))
+			return;
+		ip_set_add_bytes(bytes, counter);
+		ip_set_add_packets(packets, counter);
+	}
+}
+
+static u32 ip_set_source_seed __read_mostly;
+
+u32
+__ip_set_source_hash(const struct sk_buff *skb, u8 family)
+{
+	get_random_once(&ip_set_source_seed, sizeof(ip_set_source_seed));
+	if (family == NFPROTO_IPV4)
+		return jhash_1word((__force u32)ip_hdr(skb)->saddr,
+				   ip_set_source_seed);
+	return jhash2((__force const u32 *)&ipv6_hdr(skb)->saddr,
+		      sizeof(struct in6_addr) / sizeof(u32),
+		      ip_set_source_seed);
+}
+EXPORT_SYMBOL_GPL(__ip_set_source_hash);
+
+/* The register is selected by the top bits of the hash, the rank is the
+ * position of the first set bit in the rest. The registers only grow, so
+ * racing updates may lose a rank but never corrupt the sketch.
+ */
+static void
+ip_set_update_distinct(struct ip_set_distinct *distinct,
+		       const struct ip_set_ext *ext, u32 flags)
+{
+	u32 h = ext->source;
+	u8 *reg, rank;
+
+	if (ext->packets == ULLONG_MAX ||
+	    (flags & IPSET_FLAG_SKIP_COUNTER_UPDATE))
+		return;
+	reg = &distinct->reg[h >> (32 - IPSET_DISTINCT_BITS)];
+	rank = min(33 - fls(h << IPSET_DISTINCT_BITS),
+		   33 - IPSET_DISTINCT_BITS);
+	if (rank > READ_ONCE(*reg))
+		WRITE_ONCE(*reg, rank);
+}
+
+/* A packet conforms while the theoretical arrival time is at most burst - 1
+ * intervals ahead, then the time moves on by an interval. The elements
+ * tested from userspace are not limited.
+ */
+static bool
+ip_set_ratelimit_conform(struct ip_set_ratelimit *ratelimit,
+			 const struct ip_set_ext *ext)
+{
+	u32 burst = READ_ONCE(ratelimit->burst);
+	u64 interval, now, tat, base, old;
+
+	if (ext->packets == ULLONG_MAX)
+		return true;
+	interval = NSEC_PER_SEC / READ_ONCE(ratelimit->rate);
+	now = ktime_get_ns();
+	tat = atomic64_read(&ratelimit->tat);
+	for (;;) {
+		base = max(tat, now);
+		if (base - now > interval * (burst - 1))
+			return false;
+		old = atomic64_cmpxchg(&ratelimit->tat, tat, base + interval);
+		if (old == tat)
+			return true;
+		tat = old;
 	}
 }
 
@@ -627,31 +1670,49 @@ ip_set_get_skbinfo(struct ip_set_skbinfo *skbinfo,
 	mext->skbinfo = *skbinfo;
 }
 
+DEFINE_STATIC_KEY_FALSE(ip_set_match_ext_key);
+EXPORT_SYMBOL_GPL(ip_set_match_ext_key);
+
 bool
-ip_set_match_extensions(struct ip_set *set, const struct ip_set_ext *ext,
-			struct ip_set_ext *mext, u32 flags, void *data)
+__ip_set_match_extensions(struct ip_set *set, const struct ip_set_ext *ext,
+			  struct ip_set_ext *mext, u32 flags, void *data)
 {
 	if (SET_WITH_TIMEOUT(set) &&
 	    ip_set_timeout_expired(ext_timeout(data, set)))
 		return false;
 	if (SET_WITH_COUNTER(set)) {
 		struct ip_set_counter *counter = ext_counter(data, set);
+		u64 bytes, packets;
 
-		ip_set_update_counter(counter, ext, flags);
+		ip_set_update_counter(set, counter, ext, flags);
 
-		if (flags & IPSET_FLAG_MATCH_COUNTERS &&
-		    !(ip_set_match_counter(ip_set_get_packets(counter),
-				mext->packets, mext->packets_op) &&
-		      ip_set_match_counter(ip_set_get_bytes(counter),
-				mext->bytes, mext->bytes_op)))
-			return false;
+		if (flags & IPSET_FLAG_MATCH_COUNTERS) {
+			ip_set_get_counter(set, counter, &bytes, &packets);
+			if (!(ip_set_match_counter(packets,
+					mext->packets, mext->packets_op) &&
+			      ip_set_match_counter(bytes,
+					mext->bytes, mext->bytes_op)))
+				return false;
+		}
 	}
 	if (SET_WITH_SKBINFO(set))
 		ip_set_get_skbinfo(ext_skbinfo(data, set),
 				   ext, mext, flags);
+	if (SET_WITH_DISTINCT(set))
+		ip_set_update_distinct(ext_distinct(data, set), ext, flags);
+	if (SET_WITH_RATELIMIT(set) &&
+	    !ip_set_ratelimit_conform(ext_ratelimit(data, set), ext))
+		return false;
+	/* The match and update of the set match in a single lookup: the
+	 * expiry index of the hash types needs no update, the gc records
+	 * again the elements which are not expired yet.
+	 */
+	if (SET_WITH_TIMEOUT(set) && (flags & IPSET_FLAG_MATCH_REFRESH) &&
+	    ext->target && !ip_set_refresh_skip(set, data, ext, flags))
+		ip_set_timeout_refresh(ext_timeout(data, set), ext->timeout);
 	return true;
 }
-EXPORT_SYMBOL_GPL(ip_set_match_extensions);
+EXPORT_SYMBOL_GPL(__ip_set_match_extensions);
 
 /* Creating/destroying/renaming/swapping affect the existence and
  * the properties of a set. All of these can be executed from userspace
@@ -726,22 +1787,157 @@ ip_set_unlock(struct ip_set *set)
 		spin_unlock_bh(&set->lock);
 }
 
+/* Per CPU cache of the match results in the packet path. The entries are
+ * direct mapped by the hash of the set and of the packet data the types
+ * may look at, and are valid while the generation of the set is unchanged.
+ * Sets with extensions checked or updated at matching and the types
+ * looking at the MAC address, the interfaces or other sets are not cached.
+ */
+#define IP_SET_FLOW_CACHE_SIZE	256
+
+struct ip_set_flow_key {
+	union nf_inet_addr saddr;
+	union nf_inet_addr daddr;
+	const struct ip_set *set;
+	u32 cmdflags;
+	u32 mark;
+	__be16 sport;
+	__be16 dport;
+	u8 proto;
+	u8 family;
+	u8 dim;
+	u8 flags;
+	bool l4;		/* layer 4 data available */
+};
+
+struct ip_set_flow_entry {
+	struct ip_set_flow_key key;
+	u32 epoch;
+	u32 gen;
+	int ret;
+};
+
+struct ip_set_flow_cache {
+	struct ip_set_flow_entry entry[IP_SET_FLOW_CACHE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct ip_set_flow_cache, ip_set_flow_cache);
+
+/* Changed when a set is destroyed, as its memory may be reused */
+static atomic_t ip_set_flow_epoch = ATOMIC_INIT(0);
+
+static bool
+ip_set_flow_cacheable(const struct ip_set *set,
+		      const struct ip_set_adt_opt *opt)
+{
+	return READ_ONCE(flow_cache) &&
+	       (opt->family == NFPROTO_IPV4 || opt->family == NFPROTO_IPV6) &&
+	       !(set->extensions & IPSET_EXT_MATCH) &&
+	       !(set->type->features &
+		 (IPSET_TYPE_MAC | IPSET_TYPE_IFACE | IPSET_TYPE_NAME));
+}
+
+static void
+ip_set_flow_key(struct ip_set_flow_key *key, const struct ip_set *set,
+		const struct sk_buff *skb, const struct ip_set_adt_opt *opt)
+{
+	memset(key, 0, sizeof(*key));
+	key->set = set;
+	key->cmdflags = opt->cmdflags;
+	key->mark = skb->mark;
+	key->family = opt->family;
+	key->dim = opt->dim;
+	key->flags = opt->flags;
+	if (opt->family == NFPROTO_IPV4) {
+		key->saddr.ip = ip_hdr(skb)->saddr;
+		key->daddr.ip = ip_hdr(skb)->daddr;
+		key->l4 = ip_set_get_ip4_port(skb, true, &key->sport,
+					      &key->proto) &&
+			  ip_set_get_ip4_port(skb, false, &key->dport,
+					      &key->proto);
+	} else {
+		key->saddr.in6 = ipv6_hdr(skb)->saddr;
+		key->daddr.in6 = ipv6_hdr(skb)->daddr;
+		key->l4 = ip_set_get_ip6_port(skb, true, &key->sport,
+					      &key->proto) &&
+			  ip_set_get_ip6_port(skb, false, &key->dport,
+					      &key->proto);
+	}
+}
+
+/* Called with bottom halves disabled */
+static int
+ip_set_flow_test(struct ip_set *set, const struct sk_buff *skb,
+		 const struct xt_action_param *par, struct ip_set_adt_opt *opt)
+{
+	struct ip_set_flow_entry *e;
+	struct ip_set_flow_key key;
+	u32 epoch, gen;
+	int ret;
+
+	ip_set_flow_key(&key, set, skb, opt);
+	e = &this_cpu_ptr(&ip_set_flow_cache)->entry[
+		jhash2((u32 *)&key, sizeof(key) / sizeof(u32), 0) &
+		(IP_SET_FLOW_CACHE_SIZE - 1)];
+	epoch = atomic_read(&ip_set_flow_epoch);
+	gen = atomic_read(&set->gen);
+	/* The elements are looked up after the generation */
+	smp_rmb();
+	if (e->epoch == epoch && e->gen == gen &&
+	    !memcmp(&e->key, &key, sizeof(key)))
+		return e->ret;
+
+	ret = set->variant->kadt(set, skb, par, IPSET_TEST, opt);
+	if (ret == -EAGAIN)
+		return ret;
+	memcpy(&e->key, &key, sizeof(key));
+	e->epoch = epoch;
+	e->gen = gen;
+	e->ret = ret;
+
+	return ret;
+}
+
+/* The family neutral and the dual-stack sets match both families */
+static inline bool
+ip_set_family_match(const struct ip_set *set, u8 family)
+{
+	return family == set->family || set->family == NFPROTO_UNSPEC ||
+	       set->family == NFPROTO_INET;
+}
+
 int
 ip_set_test(ip_set_id_t index, const struct sk_buff *skb,
 	    const struct xt_action_param *par, struct ip_set_adt_opt *opt)
 {
 	struct ip_set *set = ip_set_rcu_get(IPSET_DEV_NET(par), index);
+	u64 start = 0;
 	int ret = 0;
 
 	BUG_ON(!set);
 	pr_debug("set %s, index %u\n", set->name, index);
 
 	if (opt->dim < set->type->dimension ||
-	    !(opt->family == set->family || set->family == NFPROTO_UNSPEC))
+	    !ip_set_family_match(set, opt->family))
 		return 0;
 
+	/* Never from the caller */
+	opt->cmdflags &= ~IPSET_FLAG_BULK_COLLECT;
+
+	if (trace_ipset_test_enabled()) {
+		opt->ext.hash = 0;
+		start = ktime_get_ns();
+	}
 	rcu_read_lock_bh();
-	ret = set->variant->kadt(set, skb, par, IPSET_TEST, opt);
+	/* The flow key, the type and the members of list:set parse the
+	 * layer 4 data of the packet once
+	 */
+	ip_set_l4_scope_enter();
+	if (ip_set_flow_cacheable(set, opt))
+		ret = ip_set_flow_test(set, skb, par, opt);
+	else
+		ret = set->variant->kadt(set, skb, par, IPSET_TEST, opt);
+	ip_set_l4_scope_leave();
 	rcu_read_unlock_bh();
 
 	if (ret == -EAGAIN) {
@@ -758,31 +1954,86 @@ ip_set_test(ip_set_id_t index, const struct sk_buff *skb,
 		    (ret > 0 || ret == -ENOTEMPTY))
 			ret = -ret;
 	}
+	trace_ipset_test(set, opt->ext.hash, ret, start);
 
 	/* Convert error codes to nomatch */
 	return (ret < 0 ? 0 : ret);
 }
 EXPORT_SYMBOL_GPL(ip_set_test);
 
+/* Test a burst of packets sharing the hook state in par against a set,
+ * under a single RCU read side section. The types supporting it extract
+ * all the keys first then prefetch the buckets of the keys before the
+ * comparisons. The bits in result are set for the matching packets and
+ * the number of them is returned. The extensions reported by matching
+ * elements, like skbinfo, are not returned.
+ */
 int
-ip_set_add(ip_set_id_t index, const struct sk_buff *skb,
-	   const struct xt_action_param *par, struct ip_set_adt_opt *opt)
+ip_set_test_bulk(ip_set_id_t index, struct sk_buff **skbs, unsigned int n,
+		 const struct xt_action_param *par,
+		 struct ip_set_adt_opt *opt, unsigned long *result)
 {
 	struct ip_set *set = ip_set_rcu_get(IPSET_DEV_NET(par), index);
+	DECLARE_BITMAP(complete, IPSET_BULK_MAX);
+	unsigned int i;
 	int ret;
 
 	BUG_ON(!set);
-	pr_debug("set %s, index %u\n", set->name, index);
+	if (WARN_ON_ONCE(n > IPSET_BULK_MAX))
+		return -ERANGE;
 
+	bitmap_zero(result, n);
 	if (opt->dim < set->type->dimension ||
-	    !(opt->family == set->family || set->family == NFPROTO_UNSPEC))
-		return -IPSET_ERR_TYPE_MISMATCH;
+	    !ip_set_family_match(set, opt->family))
+		return 0;
 
-	ip_set_lock(set);
-	ret = set->variant->kadt(set, skb, par, IPSET_ADD, opt);
-	ip_set_unlock(set);
+	opt->cmdflags &= ~IPSET_FLAG_BULK_COLLECT;
 
-	return ret;
+	bitmap_zero(complete, n);
+	rcu_read_lock_bh();
+	if (set->variant->test_bulk) {
+		set->variant->test_bulk(set, skbs, n, par, opt, result);
+		goto unlock;
+	}
+	for (i = 0; i < n; i++) {
+		ret = set->variant->kadt(set, skbs[i], par, IPSET_TEST, opt);
+		if (ret == -EAGAIN) {
+			__set_bit(i, complete);
+			continue;
+		}
+		/* --return-nomatch: invert matched element */
+		if ((opt->cmdflags & IPSET_FLAG_RETURN_NOMATCH) &&
+		    (set->type->features & IPSET_TYPE_NOMATCH) &&
+		    (ret > 0 || ret == -ENOTEMPTY))
+			ret = -ret;
+		if (ret > 0)
+			__set_bit(i, result);
+	}
+unlock:
+	rcu_read_unlock_bh();
+
+	/* Type requests elements to be completed */
+	for_each_set_bit(i, complete, n) {
+		ip_set_lock(set);
+		set->variant->kadt(set, skbs[i], par, IPSET_ADD, opt);
+		ip_set_unlock(set);
+		__set_bit(i, result);
+	}
+
+	return bitmap_weight(result, n);
+}
+EXPORT_SYMBOL_GPL(ip_set_test_bulk);
+
+int
+ip_set_add(ip_set_id_t index, const struct sk_buff *skb,
+	   const struct xt_action_param *par, struct ip_set_adt_opt *opt)
+{
+	struct ip_set *set = ip_set_rcu_get(IPSET_DEV_NET(par), index);
+
+	BUG_ON(!set);
+	pr_debug("set %s, index %u\n", set->name, index);
+
+	return ip_set_kadt(set, skb, par, IPSET_ADD, opt);
 }
 EXPORT_SYMBOL_GPL(ip_set_add);
 
@@ -791,22 +2042,45 @@ ip_set_del(ip_set_id_t index, const struct sk_buff *skb,
 	   const struct xt_action_param *par, struct ip_set_adt_opt *opt)
 {
 	struct ip_set *set = ip_set_rcu_get(IPSET_DEV_NET(par), index);
-	int ret = 0;
 
 	BUG_ON(!set);
 	pr_debug("set %s, index %u\n", set->name, index);
 
+	return ip_set_kadt(set, skb, par, IPSET_DEL, opt);
+}
+EXPORT_SYMBOL_GPL(ip_set_del);
+
+/* Add or delete by the set itself: the caller makes sure it is alive */
+int
+ip_set_kadt(struct ip_set *set, const struct sk_buff *skb,
+	    const struct xt_action_param *par,
+	    enum ipset_adt adt, struct ip_set_adt_opt *opt)
+{
+	bool trace = adt == IPSET_ADD ? trace_ipset_add_enabled()
+				      : trace_ipset_del_enabled();
+	u64 start = 0;
+	int ret;
+
 	if (opt->dim < set->type->dimension ||
-	    !(opt->family == set->family || set->family == NFPROTO_UNSPEC))
+	    !ip_set_family_match(set, opt->family))
 		return -IPSET_ERR_TYPE_MISMATCH;
 
+	if (trace) {
+		opt->ext.hash = 0;
+		start = ktime_get_ns();
+	}
 	ip_set_lock(set);
-	ret = set->variant->kadt(set, skb, par, IPSET_DEL, opt);
+	ret = set->variant->kadt(set, skb, par, adt, opt);
 	ip_set_unlock(set);
+	ip_set_gen_bump(set);
+	if (adt == IPSET_ADD)
+		trace_ipset_add(set, opt->ext.hash, ret, start);
+	else
+		trace_ipset_del(set, opt->ext.hash, ret, start);
 
 	return ret;
 }
-EXPORT_SYMBOL_GPL(ip_set_del);
+EXPORT_SYMBOL_GPL(ip_set_kadt);
 
 /* Find set by name, reference it once. The reference makes sure the
  * thing pointed to, does not go away under our feet.
@@ -815,20 +2089,18 @@ EXPORT_SYMBOL_GPL(ip_set_del);
 ip_set_id_t
 ip_set_get_byname(struct net *net, const char *name, struct ip_set **set)
 {
-	ip_set_id_t i, index = IPSET_INVALID_ID;
+	ip_set_id_t index;
 	struct ip_set *s;
 	struct ip_set_net *inst = ip_set_pernet(net);
 
 	rcu_read_lock();
-	for (i = 0; i < inst->ip_set_max; i++) {
-		s = rcu_dereference(inst->ip_set_list)[i];
-		if (s && STRNCMP(s->name, name)) {
-			__ip_set_get(s);
-			index = i;
-			*set = s;
-			break;
-		}
+	write_lock_bh(&ip_set_ref_lock);
+	s = find_set_and_id(inst, name, &index);
+	if (s) {
+		s->ref++;
+		*set = s;
 	}
+	write_unlock_bh(&ip_set_ref_lock);
 	rcu_read_unlock();
 
 	return index;
@@ -862,6 +2134,30 @@ ip_set_put_byindex(struct net *net, ip_set_id_t index)
 }
 EXPORT_SYMBOL_GPL(ip_set_put_byindex);
 
+/* Get a reference to the set behind a set index, which the caller
+ * found in an RCU protected structure holding a reference to the set.
+ * Destroy waits for RCU callbacks before it checks the references, so
+ * the set cannot disappear under the reader.
+ */
+struct ip_set *
+ip_set_ref_byindex(struct net *net, ip_set_id_t index)
+{
+	struct ip_set *set = ip_set_rcu_get(net, index);
+
+	if (set)
+		__ip_set_get(set);
+	return set;
+}
+EXPORT_SYMBOL_GPL(ip_set_ref_byindex);
+
+/* The set behind a set index, to be used under RCU */
+struct ip_set *
+ip_set_lookup_byindex(struct net *net, ip_set_id_t index)
+{
+	return ip_set_rcu_get(net, index);
+}
+EXPORT_SYMBOL_GPL(ip_set_lookup_byindex);
+
 /* Get the name of a set behind a set index.
  * Set itself is protected by RCU, but its name isn't: to protect against
  * renaming, grab ip_set_ref_lock as reader (see ip_set_rename()) and copy the
@@ -932,6 +2228,170 @@ ip_set_nfnl_put(struct net *net, ip_set_id_t index)
 }
 EXPORT_SYMBOL_GPL(ip_set_nfnl_put);
 
+#if defined(CONFIG_DEBUG_INFO_BTF_MODULES) && defined(HAVE_BTF_KFUNCS_START)
+/* Interface to BPF programs.
+ *
+ * A syscall program references a set by index and stores the returned
+ * object in a map as kptr. XDP and tc programs can then test addresses
+ * against the set, if its type supports the packed element format, i.e.
+ * the elements are single addresses. The object keeps the set referenced
+ * by index, like the xt_set matches do, and the namespace alive.
+ */
+struct bpf_ip_set {
+	struct net *net;
+	ip_set_id_t index;
+	struct rcu_head rcu;
+};
+
+static void
+bpf_ip_set_free_rcu(struct rcu_head *head)
+{
+	struct bpf_ip_set *s = container_of(head, struct bpf_ip_set, rcu);
+
+	ip_set_put_byindex(s->net, s->index);
+	put_net(s->net);
+	kfree(s);
+}
+
+__bpf_kfunc_start_defs();
+
+/* Reference the set by index in the namespace of the caller */
+__bpf_kfunc struct bpf_ip_set *
+bpf_ip_set_acquire(u32 index)
+{
+	struct net *net = current->nsproxy->net_ns;
+	struct bpf_ip_set *s;
+
+	if (index >= IPSET_INVALID_ID)
+		return NULL;
+	s = kmalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+	s->index = ip_set_nfnl_get_byindex(net, index);
+	if (s->index == IPSET_INVALID_ID) {
+		kfree(s);
+		return NULL;
+	}
+	s->net = get_net(net);
+
+	return s;
+}
+
+__bpf_kfunc void
+bpf_ip_set_release(struct bpf_ip_set *s)
+{
+	/* Programs may test against the set till the grace period ends */
+	call_rcu(&s->rcu, bpf_ip_set_free_rcu);
+}
+
+__bpf_kfunc void
+bpf_ip_set_release_dtor(void *s)
+{
+	bpf_ip_set_release(s);
+}
+#ifdef CFI_NOSEAL
+CFI_NOSEAL(bpf_ip_set_release_dtor);
+#endif
+
+/* Test the IPv4 or IPv6 address in network order against the set:
+ * returns 1 if it matches, 0 if not or negative error code
+ */
+__bpf_kfunc int
+bpf_ip_set_test(struct bpf_ip_set *s, const void *addr, u32 addr__sz)
+{
+	struct ip_set *set = ip_set_rcu_get(s->net, s->index);
+	struct {
+		struct ip_set_adt_packed p;
+		u8 addr[sizeof(struct in6_addr)];
+	} e = {};
+	u32 index = 0;
+	int ret;
+
+	switch (addr__sz) {
+	case sizeof(struct in_addr):
+		e.p.family = NFPROTO_IPV4;
+		break;
+	case sizeof(struct in6_addr):
+		e.p.family = NFPROTO_IPV6;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (!set->variant->uadt_packed)
+		return -EOPNOTSUPP;
+	if (set->family == NFPROTO_INET) {
+		if (e.p.family == NFPROTO_IPV4)
+			ipv6_addr_set_v4mapped(*(const __be32 *)addr,
+					       (struct in6_addr *)e.addr);
+		else
+			memcpy(e.addr, addr, addr__sz);
+		e.p.family = NFPROTO_INET;
+	} else if (e.p.family != set->family) {
+		return 0;
+	} else {
+		memcpy(e.addr, addr, addr__sz);
+	}
+	e.p.count = 1;
+
+	rcu_read_lock_bh();
+	ret = set->variant->uadt_packed(set, &e.p, IPSET_TEST, &index, 0);
+	rcu_read_unlock_bh();
+
+	return ret;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(ip_set_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_ip_set_acquire, KF_ACQUIRE | KF_RET_NULL | KF_SLEEPABLE)
+BTF_ID_FLAGS(func, bpf_ip_set_release, KF_RELEASE)
+BTF_ID_FLAGS(func, bpf_ip_set_test, KF_RCU)
+BTF_KFUNCS_END(ip_set_kfunc_ids)
+
+static const struct btf_kfunc_id_set ip_set_kfunc_set = {
+	.owner	= THIS_MODULE,
+	.set	= &ip_set_kfunc_ids,
+};
+
+BTF_ID_LIST(ip_set_dtor_ids)
+BTF_ID(struct, bpf_ip_set)
+BTF_ID(func, bpf_ip_set_release_dtor)
+
+static int __init
+ip_set_bpf_init(void)
+{
+	const struct btf_id_dtor_kfunc dtors[] = {
+		{
+			.btf_id	      = ip_set_dtor_ids[0],
+			.kfunc_btf_id = ip_set_dtor_ids[1],
+		},
+	};
+	int ret;
+
+	ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_SYSCALL,
+					&ip_set_kfunc_set);
+	if (!ret)
+		ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_XDP,
+						&ip_set_kfunc_set);
+	if (!ret)
+		ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_SCHED_CLS,
+						&ip_set_kfunc_set);
+	if (!ret)
+		ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_SCHED_ACT,
+						&ip_set_kfunc_set);
+	if (!ret)
+		ret = register_btf_id_dtor_kfuncs(dtors, ARRAY_SIZE(dtors),
+						  THIS_MODULE);
+	return ret;
+}
+#else
+static inline int
+ip_set_bpf_init(void)
+{
+	return 0;
+}
+#endif
+
 /* Communication protocol with userspace over netlink.
  *
  * The commands are serialized by the nfnl mutex.
@@ -951,22 +2411,401 @@ protocol_failed(const struct nlattr * const tb[])
 static inline bool
 protocol_min_failed(const struct nlattr * const tb[])
 {
-	return !tb[IPSET_ATTR_PROTOCOL] || protocol(tb) < IPSET_PROTOCOL_MIN;
+	return !tb[IPSET_ATTR_PROTOCOL] || protocol(tb) < IPSET_PROTOCOL_MIN;
+}
+
+static inline u32
+flag_exist(const struct nlmsghdr *nlh)
+{
+	return nlh->nlmsg_flags & NLM_F_EXCL ? 0 : IPSET_FLAG_EXIST;
+}
+
+static struct nlmsghdr *
+start_msg(struct sk_buff *skb, u32 portid, u32 seq, unsigned int flags,
+	  enum ipset_cmd cmd)
+{
+	return nfnl_msg_put(skb, portid, seq,
+			    nfnl_msg_type(NFNL_SUBSYS_IPSET, cmd), flags,
+			    NFPROTO_IPV4, NFNETLINK_V0, 0);
+}
+
+/* Change notifications
+ *
+ * Modules cannot add nfnetlink multicast groups, so the listeners
+ * subscribe with IPSET_CMD_MONITOR and the events are unicast to their
+ * netlink port. Set level changes are reported to all listeners, the
+ * element changes by userspace and by timeout only on request and
+ * limited to monitor_rate per second.
+ */
+
+struct ip_set_monitor {
+	struct list_head list;
+	u32 portid;		/* netlink port of the listener */
+	u32 flags;		/* IPSET_FLAG_MONITOR_ELEM */
+	u32 lost;		/* events lost since the last sent one */
+	u32 count;		/* element events in the rate interval */
+	unsigned long stamp;	/* start of the rate interval */
+};
+
+/* Must be called with monitor_lock held */
+static void
+monitor_free(struct ip_set_net *inst, struct ip_set_monitor *m)
+{
+	if (m->flags & IPSET_FLAG_MONITOR_ELEM)
+		WRITE_ONCE(inst->monitor_elem, inst->monitor_elem - 1);
+	list_del(&m->list);
+	kfree(m);
+}
+
+static void
+monitor_del(struct ip_set_net *inst, u32 portid)
+{
+	struct ip_set_monitor *m, *n;
+
+	list_for_each_entry_safe(m, n, &inst->monitors, list)
+		if (m->portid == portid)
+			monitor_free(inst, m);
+}
+
+static bool
+monitor_ratelimit(struct ip_set_monitor *m)
+{
+	if (time_after(jiffies, m->stamp + HZ)) {
+		m->stamp = jiffies;
+		m->count = 0;
+	}
+	return m->count++ < monitor_rate;
+}
+
+static struct sk_buff *
+notify_msg(enum ipset_cmd cmd, const char *name, gfp_t gfp)
+{
+	struct sk_buff *skb;
+
+	skb = nlmsg_new(NLMSG_DEFAULT_SIZE, gfp);
+	if (!skb)
+		return NULL;
+	if (!start_msg(skb, 0, 0, 0, cmd) ||
+	    nla_put_u8(skb, IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL) ||
+	    (name && nla_put_string(skb, IPSET_ATTR_SETNAME, name))) {
+		kfree_skb(skb);
+		return NULL;
+	}
+	return skb;
+}
+
+static int
+notify_put_type(struct sk_buff *skb, const struct ip_set *set)
+{
+	return nla_put_string(skb, IPSET_ATTR_TYPENAME, set->type->name) ||
+	       nla_put_u8(skb, IPSET_ATTR_FAMILY, set->family) ||
+	       nla_put_u8(skb, IPSET_ATTR_REVISION, set->revision);
+}
+
+/* Tell the listener how many events it missed before the next one */
+static void
+notify_lost(struct net *net, struct ip_set_monitor *m)
+{
+	struct sk_buff *skb = notify_msg(IPSET_CMD_MONITOR, NULL, GFP_ATOMIC);
+
+	if (!skb)
+		return;
+	if (nla_put_net32(skb, IPSET_ATTR_LOST, htonl(m->lost))) {
+		kfree_skb(skb);
+		return;
+	}
+	nlmsg_end(skb, nlmsg_hdr(skb));
+	if (!NFNETLINK_UNICAST(net->nfnl, skb, net, m->portid))
+		m->lost = 0;
+}
+
+static void
+notify_send(struct net *net, struct sk_buff *skb, bool elem)
+{
+	struct ip_set_net *inst = ip_set_pernet(net);
+	struct ip_set_monitor *m, *n;
+	struct sk_buff *skb2;
+	int ret;
+
+	nlmsg_end(skb, nlmsg_hdr(skb));
+	spin_lock_bh(&inst->monitor_lock);
+	list_for_each_entry_safe(m, n, &inst->monitors, list) {
+		if (elem && !(m->flags & IPSET_FLAG_MONITOR_ELEM))
+			continue;
+		if (elem && !monitor_ratelimit(m)) {
+			m->lost++;
+			continue;
+		}
+		if (m->lost)
+			notify_lost(net, m);
+		skb2 = skb_clone(skb, GFP_ATOMIC);
+		if (!skb2) {
+			m->lost++;
+			continue;
+		}
+		ret = NFNETLINK_UNICAST(net->nfnl, skb2, net, m->portid);
+		if (ret == -ECONNREFUSED)
+			/* The listener is gone */
+			monitor_free(inst, m);
+		else if (ret)
+			m->lost++;
+	}
+	spin_unlock_bh(&inst->monitor_lock);
+	kfree_skb(skb);
+}
+
+/* Report a set level change. The name is the first set name of the
+ * command when that is not the one of the set anymore.
+ */
+static void
+ip_set_notify(const struct ip_set *set, enum ipset_cmd cmd, const char *name)
+{
+	struct sk_buff *skb;
+
+	if (list_empty(&ip_set_pernet(set->net)->monitors))
+		return;
+	skb = notify_msg(cmd, name ? name : set->name, GFP_KERNEL);
+	if (!skb)
+		return;
+	if ((cmd == IPSET_CMD_CREATE && notify_put_type(skb, set)) ||
+	    (name && nla_put_string(skb, IPSET_ATTR_SETNAME2, set->name))) {
+		kfree_skb(skb);
+		return;
+	}
+	notify_send(set->net, skb, false);
+}
+
+/* Start an element change report: the caller adds the element and
+ * sends it by ip_set_notify_end(). NULL is returned when nobody listens.
+ */
+struct sk_buff *
+ip_set_notify_start(const struct ip_set *set, enum ipset_cmd cmd, u32 flags)
+{
+	struct sk_buff *skb;
+
+	if (!READ_ONCE(ip_set_pernet(set->net)->monitor_elem))
+		return NULL;
+	skb = notify_msg(cmd, set->name, GFP_ATOMIC);
+	if (skb &&
+	    (notify_put_type(skb, set) ||
+	     (flags && nla_put_net32(skb, IPSET_ATTR_FLAGS, htonl(flags))))) {
+		kfree_skb(skb);
+		return NULL;
+	}
+	return skb;
+}
+EXPORT_SYMBOL_GPL(ip_set_notify_start);
+
+void
+ip_set_notify_end(const struct ip_set *set, struct sk_buff *skb)
+{
+	notify_send(set->net, skb, true);
+}
+EXPORT_SYMBOL_GPL(ip_set_notify_end);
+
+/* Transactional add/del batches: an undo log of the changes */
+
+struct ip_set_txn_entry {
+	struct list_head list;
+	struct ip_set_ext ext;		/* extensions of the removed element */
+	struct ip_set_comment_rcu *comment; /* referenced by ext.comment */
+	size_t len;			/* size of the elements */
+	u32 flags;			/* to re-add the removed element with */
+	bool added;
+	bool removed;
+	u8 data[];			/* added, then removed element */
+};
+
+struct ip_set_txn {
+	struct list_head entries;	/* in the order of the changes */
+	struct sk_buff_head notify;	/* notifications sent at commit */
+};
+
+/* Called by the add/del functions with the locks of the set held */
+int
+__ip_set_txn_record(struct ip_set *set, const void *added,
+		    const void *removed, size_t len, u32 flags)
+{
+	struct ip_set_net *inst = ip_set_pernet(set->net);
+	struct ip_set_comment_rcu *c;
+	struct ip_set_txn_entry *e;
+
+	e = kzalloc(sizeof(*e) + 2 * len, GFP_ATOMIC);
+	if (unlikely(!e))
+		return -ENOMEM;
+	e->len = len;
+	e->flags = flags;
+	e->ext.timeout = set->timeout;
+	e->ext.bytes = ULLONG_MAX;
+	e->ext.packets = ULLONG_MAX;
+	if (added) {
+		memcpy(e->data, added, len);
+		e->added = true;
+	}
+	if (removed) {
+		memcpy(e->data + len, removed, len);
+		e->removed = true;
+		if (SET_WITH_TIMEOUT(set))
+			e->ext.timeout =
+				ip_set_timeout_get(ext_timeout(removed, set));
+		if (SET_WITH_COUNTER(set)) {
+			e->ext.bytes = 0;
+			e->ext.packets = 0;
+			ip_set_get_counter(set, ext_counter(removed, set),
+					   &e->ext.bytes, &e->ext.packets);
+		}
+		if (SET_WITH_SKBINFO(set))
+			e->ext.skbinfo = *ext_skbinfo(removed, set);
+		if (SET_WITH_RATELIMIT(set)) {
+			e->ext.rate = ext_ratelimit(removed, set)->rate;
+			e->ext.burst = ext_ratelimit(removed, set)->burst;
+		}
+		if (SET_WITH_COMMENT(set)) {
+			c = rcu_dereference_protected(
+				ext_comment(removed, set)->c, 1);
+			if (c) {
+				spin_lock_bh(&inst->comment_lock);
+				c->ref++;
+				spin_unlock_bh(&inst->comment_lock);
+				e->comment = c;
+				e->ext.comment = c->str;
+			}
+		}
+	}
+	list_add_tail(&e->list, &set->txn->entries);
+	return 1;
+}
+EXPORT_SYMBOL_GPL(__ip_set_txn_record);
+
+static void
+ip_set_txn_free_entry(struct ip_set *set, struct ip_set_txn_entry *e)
+{
+	list_del(&e->list);
+	if (e->comment)
+		ip_set_comment_put(set, e->comment);
+	kfree(e);
+}
+
+/* The recorded change failed after all */
+void
+ip_set_txn_forget(struct ip_set *set)
+{
+	ip_set_txn_free_entry(set, list_last_entry(&set->txn->entries,
+						   struct ip_set_txn_entry,
+						   list));
+}
+EXPORT_SYMBOL_GPL(ip_set_txn_forget);
+
+static struct ip_set_txn *
+ip_set_txn_begin(struct ip_set *set)
+{
+	struct ip_set_txn *txn = kmalloc(sizeof(*txn), GFP_KERNEL);
+
+	if (!txn)
+		return NULL;
+	INIT_LIST_HEAD(&txn->entries);
+	__skb_queue_head_init(&txn->notify);
+	WRITE_ONCE(set->txn, txn);
+	WRITE_ONCE(set->txn_owner, current);
+	return txn;
+}
+
+static int
+ip_set_txn_adt(struct ip_set *set, enum ipset_adt adt, void *value,
+	       const struct ip_set_ext *ext, u32 flags)
+{
+	struct ip_set_ext mext = {};
+	bool retried = false;
+	int ret;
+
+	do {
+		ip_set_lock(set);
+		ret = set->variant->adt[adt](set, value, ext, &mext, flags);
+		ip_set_unlock(set);
+		retried = true;
+	} while (ret == -EAGAIN &&
+		 set->variant->resize &&
+		 (ret = set->variant->resize(set, retried)) == 0);
+	return ret;
+}
+
+/* Revert the changes in reverse order and drop the notifications.
+ * The kernel side adds fail during the batch, so the removed elements
+ * fit back, and they are re-added over maxelem and the memory budget.
+ * Reverting can still fail on memory shortage, which is returned.
+ */
+static int
+ip_set_txn_rollback(struct ip_set *set, struct ip_set_txn *txn)
+{
+	struct ip_set_txn_entry *e, *n;
+	u32 failed = 0;
+	int ret;
+
+	/* The rollback is not recorded, the kernel side adds still fail */
+	WRITE_ONCE(set->txn_owner, NULL);
+	list_for_each_entry_safe_reverse(e, n, &txn->entries, list) {
+		/* An added element deleted by the kernel side is gone */
+		if (e->added) {
+			ret = ip_set_txn_adt(set, IPSET_DEL, e->data, &e->ext, 0);
+			if (ret && ret != -IPSET_ERR_EXIST && !e->removed)
+				failed++;
+		}
+		if (e->removed &&
+		    ip_set_txn_adt(set, IPSET_ADD, e->data + e->len, &e->ext,
+				   e->flags | IPSET_FLAG_EXIST |
+				   IPSET_FLAG_TXN_ROLLBACK))
+			failed++;
+		ip_set_txn_free_entry(set, e);
+	}
+	WRITE_ONCE(set->txn, NULL);
+	ip_set_gen_bump(set);
+	__skb_queue_purge(&txn->notify);
+	kfree(txn);
+	if (!failed)
+		return 0;
+	if (net_ratelimit())
+		pr_warn("Set %s: %u changes of a failed transaction are not reverted\n",
+			set->name, failed);
+	return -IPSET_ERR_TXN_ROLLBACK;
 }
 
-static inline u32
-flag_exist(const struct nlmsghdr *nlh)
+static void
+ip_set_txn_commit(struct ip_set *set, struct ip_set_txn *txn)
 {
-	return nlh->nlmsg_flags & NLM_F_EXCL ? 0 : IPSET_FLAG_EXIST;
+	struct ip_set_txn_entry *e, *n;
+	struct sk_buff *skb;
+
+	WRITE_ONCE(set->txn_owner, NULL);
+	WRITE_ONCE(set->txn, NULL);
+	list_for_each_entry_safe(e, n, &txn->entries, list)
+		ip_set_txn_free_entry(set, e);
+	while ((skb = __skb_dequeue(&txn->notify)))
+		ip_set_notify_end(set, skb);
+	kfree(txn);
 }
 
-static struct nlmsghdr *
-start_msg(struct sk_buff *skb, u32 portid, u32 seq, unsigned int flags,
-	  enum ipset_cmd cmd)
+/* Report an element added or deleted by userspace, at the commit
+ * of the transaction if one is in progress
+ */
+static void
+ip_set_notify_adt(const struct ip_set *set, enum ipset_adt adt,
+		  const struct nlattr *nla)
 {
-	return nfnl_msg_put(skb, portid, seq,
-			    nfnl_msg_type(NFNL_SUBSYS_IPSET, cmd), flags,
-			    NFPROTO_IPV4, NFNETLINK_V0, 0);
+	struct sk_buff *skb;
+
+	skb = ip_set_notify_start(set, adt == IPSET_ADD ? IPSET_CMD_ADD
+							: IPSET_CMD_DEL, 0);
+	if (!skb)
+		return;
+	if (nla_put(skb, nla->nla_type, nla_len(nla), nla_data(nla))) {
+		kfree_skb(skb);
+		return;
+	}
+	if (set->txn) {
+		__skb_queue_tail(&set->txn->notify, skb);
+		return;
+	}
+	ip_set_notify_end(set, skb);
 }
 
 /* Create a set */
@@ -985,18 +2824,18 @@ static const struct nla_policy ip_set_create_policy[IPSET_ATTR_CMD_MAX + 1] = {
 static struct ip_set *
 find_set_and_id(struct ip_set_net *inst, const char *name, ip_set_id_t *id)
 {
-	struct ip_set *set = NULL;
-	ip_set_id_t i;
+	struct ip_set *set;
+	struct hlist_node *n;
 
-	*id = IPSET_INVALID_ID;
-	for (i = 0; i < inst->ip_set_max; i++) {
-		set = ip_set(inst, i);
-		if (set && STRNCMP(set->name, name)) {
-			*id = i;
-			break;
+	hlist_for_each(n, ip_set_hname_head(inst, name)) {
+		set = ip_set(inst, n - inst->ip_set_hnode);
+		if (STRNCMP(set->name, name)) {
+			*id = n - inst->ip_set_hnode;
+			return set;
 		}
 	}
-	return (*id == IPSET_INVALID_ID ? NULL : set);
+	*id = IPSET_INVALID_ID;
+	return NULL;
 }
 
 static inline struct ip_set *
@@ -1015,23 +2854,69 @@ find_free_id(struct ip_set_net *inst, const char *name, ip_set_id_t *index,
 	ip_set_id_t i;
 
 	*index = IPSET_INVALID_ID;
-	for (i = 0;  i < inst->ip_set_max; i++) {
-		s = ip_set(inst, i);
-		if (!s) {
-			if (*index == IPSET_INVALID_ID)
-				*index = i;
-		} else if (STRNCMP(name, s->name)) {
-			/* Name clash */
-			*set = s;
-			return -EEXIST;
+	s = find_set(inst, name);
+	if (s) {
+		/* Name clash */
+		*set = s;
+		return -EEXIST;
+	}
+	for (i = inst->ip_set_free; i < inst->ip_set_max; i++) {
+		if (!ip_set(inst, i)) {
+			*index = i;
+			break;
 		}
 	}
+	inst->ip_set_free = i;
 	if (*index == IPSET_INVALID_ID)
 		/* No free slot remained */
 		return -IPSET_ERR_MAX_SETS;
 	return 0;
 }
 
+/* No free slot remained: grow the list of the sets, the first new
+ * slot is returned in index.
+ */
+static int
+grow_set_list(struct ip_set_net *inst, ip_set_id_t *index)
+{
+	struct ip_set **list, **tmp;
+	ip_set_id_t i = inst->ip_set_max + IP_SET_INC;
+
+	if (i < inst->ip_set_max || i == IPSET_INVALID_ID)
+		/* Wraparound */
+		return -IPSET_ERR_MAX_SETS;
+
+	list = kvcalloc(i, sizeof(struct ip_set *), GFP_KERNEL);
+	if (!list)
+		return -IPSET_ERR_MAX_SETS;
+	if (ip_set_hname_resize(inst, i)) {
+		kvfree(list);
+		return -IPSET_ERR_MAX_SETS;
+	}
+	/* nfnl mutex is held, both lists are valid */
+	tmp = ip_set_dereference(inst->ip_set_list);
+	memcpy(list, tmp, sizeof(struct ip_set *) * inst->ip_set_max);
+	rcu_assign_pointer(inst->ip_set_list, list);
+	/* Make sure all current packets have passed through */
+	synchronize_net();
+	/* Use new list */
+	*index = inst->ip_set_max;
+	inst->ip_set_max = i;
+	kvfree(tmp);
+	return 0;
+}
+
+static void
+add_set(struct ip_set_net *inst, struct ip_set *set, ip_set_id_t index)
+{
+	if (set->extensions & IPSET_EXT_MATCH)
+		static_branch_inc(&ip_set_match_ext_key);
+	write_lock_bh(&ip_set_ref_lock);
+	ip_set(inst, index) = set;
+	ip_set_hname_add(inst, index);
+	write_unlock_bh(&ip_set_ref_lock);
+}
+
 static int
 IPSET_CBFN(ip_set_none, struct net *net, struct sock *ctnl,
 	   struct sk_buff *skb, const struct nlmsghdr *nlh,
@@ -1082,7 +2967,9 @@ IPSET_CBFN(ip_set_create, struct net *n, struct sock *ctnl,
 	if (!set)
 		return -ENOMEM;
 	spin_lock_init(&set->lock);
+	INIT_LIST_HEAD(&set->ctevent_list);
 	strlcpy(set->name, name, IPSET_MAXNAMELEN);
+	set->net = net;
 	set->family = family;
 	set->revision = revision;
 
@@ -1107,6 +2994,67 @@ IPSET_CBFN(ip_set_create, struct net *n, struct sock *ctnl,
 	/* Set create flags depending on the type revision */
 	set->flags |= set->type->create_flags[revision];
 
+	/* Counter sampling is common to all set types */
+	if (tb[IPSET_ATTR_SAMPLE]) {
+		u32 cadt_flags = 0;
+
+		if (!ip_set_attr_netorder(tb, IPSET_ATTR_SAMPLE)) {
+			ret = -IPSET_ERR_PROTOCOL;
+			goto put_out;
+		}
+		if (tb[IPSET_ATTR_CADT_FLAGS])
+			cadt_flags = ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]);
+		set->sample = ip_set_get_h32(tb[IPSET_ATTR_SAMPLE]);
+		if (!(cadt_flags & IPSET_FLAG_WITH_COUNTERS) ||
+		    !set->sample || set->sample > IPSET_COUNTER_SAMPLE_MAX) {
+			ret = -IPSET_ERR_COUNTER_SAMPLE;
+			goto put_out;
+		}
+	}
+	/* So is the rate limit, the burst is a second at the rate by default */
+	if (tb[IPSET_ATTR_RATE] || tb[IPSET_ATTR_BURST]) {
+		if (!ip_set_optattr_netorder(tb, IPSET_ATTR_RATE) ||
+		    !ip_set_optattr_netorder(tb, IPSET_ATTR_BURST)) {
+			ret = -IPSET_ERR_PROTOCOL;
+			goto put_out;
+		}
+		if (tb[IPSET_ATTR_RATE])
+			set->rate = ip_set_get_h32(tb[IPSET_ATTR_RATE]);
+		set->burst = tb[IPSET_ATTR_BURST] ?
+			     ip_set_get_h32(tb[IPSET_ATTR_BURST]) : set->rate;
+		if (!set->rate || !set->burst) {
+			ret = -IPSET_ERR_RATELIMIT;
+			goto put_out;
+		}
+	}
+	/* And the population from the conntrack events. By default the
+	 * first dimension is the source, the others the destination of
+	 * the original direction tuple.
+	 */
+	if (tb[IPSET_ATTR_CTEVENTS] || tb[IPSET_ATTR_CTDIR]) {
+		if (!ip_set_optattr_netorder(tb, IPSET_ATTR_CTEVENTS) ||
+		    !ip_set_optattr_netorder(tb, IPSET_ATTR_CTDIR)) {
+			ret = -IPSET_ERR_PROTOCOL;
+			goto put_out;
+		}
+		if (tb[IPSET_ATTR_CTEVENTS])
+			set->ctevents = ip_set_get_h32(tb[IPSET_ATTR_CTEVENTS]);
+		set->ctdir = tb[IPSET_ATTR_CTDIR] ?
+			     ip_set_get_h32(tb[IPSET_ATTR_CTDIR]) :
+			     IPSET_DIM_ONE_SRC;
+		if (!(set->ctevents & (IPSET_CTEVENT_NEW |
+				       IPSET_CTEVENT_ASSURED)) ||
+		    (set->ctevents & ~(IPSET_CTEVENT_NEW |
+				       IPSET_CTEVENT_ASSURED |
+				       IPSET_CTEVENT_DESTROY)) ||
+		    (set->ctdir & ~(IPSET_CTDIR_REPLY | IPSET_DIM_ONE_SRC |
+				    IPSET_DIM_TWO_SRC | IPSET_DIM_THREE_SRC))) {
+			ret = -IPSET_ERR_CTEVENT;
+			goto put_out;
+		}
+		ip_set_ctevent_load();
+	}
+
 	ret = set->type->create(INFO_NET(info, net), set, tb, flags);
 	if (ret != 0)
 		goto put_out;
@@ -1125,43 +3073,35 @@ IPSET_CBFN(ip_set_create, struct net *n, struct sock *ctnl,
 		    set->type->family == clash->type->family &&
 		    set->type->revision_min == clash->type->revision_min &&
 		    set->type->revision_max == clash->type->revision_max &&
+		    set->sample == clash->sample &&
+		    set->ctevents == clash->ctevents &&
+		    set->ctdir == clash->ctdir &&
 		    set->variant->same_set(set, clash))
 			ret = 0;
 		goto cleanup;
 	} else if (ret == -IPSET_ERR_MAX_SETS) {
-		struct ip_set **list, **tmp;
-		ip_set_id_t i = inst->ip_set_max + IP_SET_INC;
-
-		if (i < inst->ip_set_max || i == IPSET_INVALID_ID)
-			/* Wraparound */
+		if (grow_set_list(inst, &index))
 			goto cleanup;
-
-		list = kvcalloc(i, sizeof(struct ip_set *), GFP_KERNEL);
-		if (!list)
-			goto cleanup;
-		/* nfnl mutex is held, both lists are valid */
-		tmp = ip_set_dereference(inst->ip_set_list);
-		memcpy(list, tmp, sizeof(struct ip_set *) * inst->ip_set_max);
-		rcu_assign_pointer(inst->ip_set_list, list);
-		/* Make sure all current packets have passed through */
-		synchronize_net();
-		/* Use new list */
-		index = inst->ip_set_max;
-		inst->ip_set_max = i;
-		kvfree(tmp);
 		ret = 0;
 	} else if (ret) {
 		goto cleanup;
 	}
+	if (set->ctevents) {
+		ret = ip_set_ctevent_attach(set);
+		if (ret)
+			goto cleanup;
+	}
 
 	/* Finally! Add our shiny new set to the list, and be done. */
 	pr_debug("create: '%s' created with index %u!\n", set->name, index);
-	ip_set(inst, index) = set;
+	add_set(inst, set, index);
+	ip_set_notify(set, IPSET_CMD_CREATE, NULL);
 
 	return ret;
 
 cleanup:
 	set->variant->destroy(set);
+	ip_set_mem_release(set);
 put_out:
 	module_put(set->type->me);
 out:
@@ -1183,8 +3123,14 @@ ip_set_destroy_set(struct ip_set *set)
 {
 	pr_debug("set: %s\n",  set->name);
 
+	if (set->ctevents)
+		ip_set_ctevent_detach(set);
 	/* Must call it without holding any lock */
 	set->variant->destroy(set);
+	ip_set_mem_release(set);
+	atomic_inc(&ip_set_flow_epoch);
+	if (set->extensions & IPSET_EXT_MATCH)
+		static_branch_dec(&ip_set_match_ext_key);
 	module_put(set->type->me);
 	kfree(set);
 }
@@ -1231,10 +3177,15 @@ IPSET_CBFN(ip_set_destroy, struct net *net, struct sock *ctnl,
 		for (i = 0; i < inst->ip_set_max; i++) {
 			s = ip_set(inst, i);
 			if (s) {
+				write_lock_bh(&ip_set_ref_lock);
 				ip_set(inst, i) = NULL;
+				ip_set_hname_del(inst, i);
+				write_unlock_bh(&ip_set_ref_lock);
+				ip_set_notify(s, IPSET_CMD_DESTROY, NULL);
 				ip_set_destroy_set(s);
 			}
 		}
+		inst->ip_set_free = 0;
 		/* Modified by ip_set_destroy() only, which is serialized */
 		inst->is_destroyed = false;
 	} else {
@@ -1250,8 +3201,13 @@ IPSET_CBFN(ip_set_destroy, struct net *net, struct sock *ctnl,
 			goto out;
 		}
 		ip_set(inst, i) = NULL;
+		/* Holding the lock as reader excludes ip_set_get_byname() */
+		ip_set_hname_del(inst, i);
+		if (i < inst->ip_set_free)
+			inst->ip_set_free = i;
 		read_unlock_bh(&ip_set_ref_lock);
 
+		ip_set_notify(s, IPSET_CMD_DESTROY, NULL);
 		ip_set_destroy_set(s);
 	}
 	return 0;
@@ -1270,6 +3226,8 @@ ip_set_flush_set(struct ip_set *set)
 	ip_set_lock(set);
 	set->variant->flush(set);
 	ip_set_unlock(set);
+	ip_set_gen_bump(set);
+	ip_set_notify(set, IPSET_CMD_FLUSH, NULL);
 }
 
 static int
@@ -1322,7 +3280,8 @@ IPSET_CBFN(ip_set_rename, struct net *net, struct sock *ctnl,
 	   const struct nfnl_info *info)
 {
 	struct ip_set_net *inst = ip_set_pernet(IPSET_SOCK_NET(net, ctnl, info));
-	struct ip_set *set, *s;
+	struct ip_set *set;
+	char from_name[IPSET_MAXNAMELEN];
 	const char *name2;
 	ip_set_id_t i;
 	int ret = 0;
@@ -1332,7 +3291,7 @@ IPSET_CBFN(ip_set_rename, struct net *net, struct sock *ctnl,
 		     !attr[IPSET_ATTR_SETNAME2]))
 		return -IPSET_ERR_PROTOCOL;
 
-	set = find_set(inst, nla_data(attr[IPSET_ATTR_SETNAME]));
+	set = find_set_and_id(inst, nla_data(attr[IPSET_ATTR_SETNAME]), &i);
 	if (!set)
 		return -ENOENT;
 
@@ -1343,18 +3302,21 @@ IPSET_CBFN(ip_set_rename, struct net *net, struct sock *ctnl,
 	}
 
 	name2 = nla_data(attr[IPSET_ATTR_SETNAME2]);
-	for (i = 0; i < inst->ip_set_max; i++) {
-		s = ip_set(inst, i);
-		if (s && STRNCMP(s->name, name2)) {
-			ret = -IPSET_ERR_EXIST_SETNAME2;
-			goto out;
-		}
+	if (find_set(inst, name2)) {
+		ret = -IPSET_ERR_EXIST_SETNAME2;
+		goto out;
 	}
+	strscpy(from_name, set->name, IPSET_MAXNAMELEN);
 	ret = strscpy(set->name, name2, IPSET_MAXNAMELEN);
+	ip_set_hname_del(inst, i);
+	ip_set_hname_add(inst, i);
 
 out:
 	write_unlock_bh(&ip_set_ref_lock);
-	return ret < 0 ? ret : 0;
+	if (ret < 0)
+		return ret;
+	ip_set_notify(set, IPSET_CMD_RENAME, from_name);
+	return 0;
 }
 
 /* Swap two sets so that name/index points to the other.
@@ -1403,23 +3365,318 @@ IPSET_CBFN(ip_set_swap, struct net *net, struct sock *ctnl,
 
 	write_lock_bh(&ip_set_ref_lock);
 
-	if (from->ref_netlink || to->ref_netlink) {
-		write_unlock_bh(&ip_set_ref_lock);
-		return -EBUSY;
-	}
+	if (from->ref_netlink || to->ref_netlink) {
+		write_unlock_bh(&ip_set_ref_lock);
+		return -EBUSY;
+	}
+
+	strncpy(from_name, from->name, IPSET_MAXNAMELEN);
+	strncpy(from->name, to->name, IPSET_MAXNAMELEN);
+	strncpy(to->name, from_name, IPSET_MAXNAMELEN);
+
+	swap(from->ref, to->ref);
+	ip_set(inst, from_id) = to;
+	ip_set(inst, to_id) = from;
+	write_unlock_bh(&ip_set_ref_lock);
+	ip_set_gen_bump(from);
+	ip_set_gen_bump(to);
+	ip_set_notify(from, IPSET_CMD_SWAP, to->name);
+
+	return 0;
+}
+
+/* Clone a set: a new set is created with the header data of the set
+ * and the elements are copied by the type. The parameters handled by the
+ * core, like the rate limit defaults and the conntrack events, are copied
+ * here and the clone gets its own conntrack event attachment.
+ *
+ * The commands are serialized by the nfnl mutex, so the set cannot be
+ * destroyed meanwhile. The packet path may still change the elements.
+ */
+
+static int
+IPSET_CBFN(ip_set_clone, struct net *n, struct sock *ctnl,
+	   struct sk_buff *skb, const struct nlmsghdr *nlh,
+	   const struct nlattr * const attr[],
+	   struct netlink_ext_ack *extack,
+	   const struct nfnl_info *info)
+{
+	struct net *net = IPSET_SOCK_NET(n, ctnl, info);
+	struct ip_set_net *inst = ip_set_pernet(net);
+	struct nlattr *tb[IPSET_ATTR_CREATE_MAX + 1] = {};
+	struct ip_set *from, *set, *clash = NULL;
+	ip_set_id_t index = IPSET_INVALID_ID;
+	struct sk_buff *head;
+	const char *name2;
+	int ret;
+
+	if (unlikely(protocol_min_failed(attr) ||
+		     !attr[IPSET_ATTR_SETNAME] ||
+		     !attr[IPSET_ATTR_SETNAME2]))
+		return -IPSET_ERR_PROTOCOL;
+
+	from = find_set(inst, nla_data(attr[IPSET_ATTR_SETNAME]));
+	if (!from)
+		return -ENOENT;
+	if (!from->variant->clone)
+		return -EOPNOTSUPP;
+	name2 = nla_data(attr[IPSET_ATTR_SETNAME2]);
+	if (find_set(inst, name2))
+		return -IPSET_ERR_EXIST_SETNAME2;
+
+	set = kzalloc(sizeof(*set), GFP_KERNEL);
+	if (!set)
+		return -ENOMEM;
+	spin_lock_init(&set->lock);
+	INIT_LIST_HEAD(&set->ctevent_list);
+	strlcpy(set->name, name2, IPSET_MAXNAMELEN);
+	set->net = net;
+	set->family = from->family;
+	set->revision = from->revision;
+	set->type = from->type;
+	set->flags |= set->type->create_flags[set->revision];
+	set->sample = from->sample;
+	set->rate = from->rate;
+	set->burst = from->burst;
+	set->ctevents = from->ctevents;
+	set->ctdir = from->ctdir;
+	__module_get(set->type->me);
+
+	/* The header data is parsed as create parameters, the kernel-only
+	 * attributes are not in the create policy and ignored.
+	 */
+	head = alloc_skb(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!head) {
+		ret = -ENOMEM;
+		goto put_out;
+	}
+	ret = from->variant->head(from, head, NULL);
+	if (!ret &&
+	    NLA_PARSE_NESTED(tb, IPSET_ATTR_CREATE_MAX,
+			     (struct nlattr *)head->data,
+			     set->type->create_policy, NULL))
+		ret = -IPSET_ERR_PROTOCOL;
+	if (!ret)
+		ret = set->type->create(net, set, tb, 0);
+	kfree_skb(head);
+	if (ret)
+		goto put_out;
+
+	ret = from->variant->clone(from, set);
+	if (ret)
+		goto cleanup;
+
+	ret = find_free_id(inst, set->name, &index, &clash);
+	if (ret == -IPSET_ERR_MAX_SETS)
+		ret = grow_set_list(inst, &index);
+	if (ret)
+		goto cleanup;
+	if (set->ctevents) {
+		ret = ip_set_ctevent_attach(set);
+		if (ret)
+			goto cleanup;
+	}
+
+	pr_debug("clone: '%s' cloned from '%s' with index %u!\n",
+		 set->name, from->name, index);
+	add_set(inst, set, index);
+	ip_set_notify(set, IPSET_CMD_CLONE, from->name);
+
+	return 0;
+
+cleanup:
+	set->variant->destroy(set);
+	ip_set_mem_release(set);
+put_out:
+	module_put(set->type->me);
+	kfree(set);
+	return ret;
+}
+
+/* Freeze a set: the type makes the set read-only, with the elements
+ * stored in a compact form for the lookups, or thaws it.
+ *
+ * The commands are serialized by the nfnl mutex, so the set cannot be
+ * destroyed meanwhile.
+ */
+
+static int
+ip_set_freeze_set(struct net *net, const struct nlattr * const attr[],
+		  bool freeze)
+{
+	struct ip_set_net *inst = ip_set_pernet(net);
+	struct ip_set *set;
+
+	if (unlikely(protocol_min_failed(attr) ||
+		     !attr[IPSET_ATTR_SETNAME]))
+		return -IPSET_ERR_PROTOCOL;
+
+	set = find_set(inst, nla_data(attr[IPSET_ATTR_SETNAME]));
+	if (!set)
+		return -ENOENT;
+	if (!set->variant->freeze)
+		return -EOPNOTSUPP;
+
+	return set->variant->freeze(set, freeze);
+}
+
+static int
+IPSET_CBFN(ip_set_freeze, struct net *n, struct sock *ctnl,
+	   struct sk_buff *skb, const struct nlmsghdr *nlh,
+	   const struct nlattr * const attr[],
+	   struct netlink_ext_ack *extack,
+	   const struct nfnl_info *info)
+{
+	return ip_set_freeze_set(IPSET_SOCK_NET(n, ctnl, info), attr, true);
+}
+
+static int
+IPSET_CBFN(ip_set_thaw, struct net *n, struct sock *ctnl,
+	   struct sk_buff *skb, const struct nlmsghdr *nlh,
+	   const struct nlattr * const attr[],
+	   struct netlink_ext_ack *extack,
+	   const struct nfnl_info *info)
+{
+	return ip_set_freeze_set(IPSET_SOCK_NET(n, ctnl, info), attr, false);
+}
+
+/* Delete the elements matching a condition over the extensions */
+
+static const struct nla_policy
+ip_set_purge_policy[IPSET_ATTR_ADT_MAX + 1] = {
+	[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
+	[IPSET_ATTR_BYTES]	= { .type = NLA_U64 },
+	[IPSET_ATTR_PACKETS]	= { .type = NLA_U64 },
+	[IPSET_ATTR_COMMENT]	= { .type = NLA_NUL_STRING,
+				    .len  = IPSET_MAX_COMMENT_SIZE },
+};
+
+static int
+IPSET_CBFN(ip_set_purge, struct net *n, struct sock *ctnl,
+	   struct sk_buff *skb, const struct nlmsghdr *nlh,
+	   const struct nlattr * const attr[],
+	   struct netlink_ext_ack *extack,
+	   const struct nfnl_info *info)
+{
+	struct ip_set_net *inst = ip_set_pernet(IPSET_SOCK_NET(n, ctnl, info));
+	struct nlattr *tb[IPSET_ATTR_ADT_MAX + 1] = {};
+	struct ip_set_purge p = {
+		.bytes = ULLONG_MAX,
+		.packets = ULLONG_MAX,
+		.timeout = IPSET_NO_TIMEOUT,
+	};
+	struct ip_set *set;
+	int ret;
+
+	if (unlikely(protocol_min_failed(attr) ||
+		     !attr[IPSET_ATTR_SETNAME] ||
+		     !attr[IPSET_ATTR_DATA] ||
+		     NLA_PARSE_NESTED(tb, IPSET_ATTR_ADT_MAX,
+				      attr[IPSET_ATTR_DATA],
+				      ip_set_purge_policy, NULL)))
+		return -IPSET_ERR_PROTOCOL;
+	/* An empty condition would be a flush */
+	if (!tb[IPSET_ATTR_TIMEOUT] && !tb[IPSET_ATTR_BYTES] &&
+	    !tb[IPSET_ATTR_PACKETS] && !tb[IPSET_ATTR_COMMENT])
+		return -IPSET_ERR_PROTOCOL;
+
+	set = find_set(inst, nla_data(attr[IPSET_ATTR_SETNAME]));
+	if (!set)
+		return -ENOENT;
+	if (!set->variant->purge)
+		return -EOPNOTSUPP;
+
+	if (tb[IPSET_ATTR_TIMEOUT]) {
+		if (!SET_WITH_TIMEOUT(set))
+			return -IPSET_ERR_TIMEOUT;
+		p.timeout = ip_set_timeout_uget(tb[IPSET_ATTR_TIMEOUT]);
+	}
+	if (tb[IPSET_ATTR_BYTES] || tb[IPSET_ATTR_PACKETS]) {
+		if (!SET_WITH_COUNTER(set))
+			return -IPSET_ERR_COUNTER;
+		if (tb[IPSET_ATTR_BYTES])
+			p.bytes = be64_to_cpu(nla_get_be64(
+					      tb[IPSET_ATTR_BYTES]));
+		if (tb[IPSET_ATTR_PACKETS])
+			p.packets = be64_to_cpu(nla_get_be64(
+						tb[IPSET_ATTR_PACKETS]));
+	}
+	if (tb[IPSET_ATTR_COMMENT]) {
+		if (!SET_WITH_COMMENT(set))
+			return -IPSET_ERR_COMMENT;
+		p.comment = nla_data(tb[IPSET_ATTR_COMMENT]);
+		p.comment_len = strlen(p.comment);
+	}
+
+	ret = set->variant->purge(set, &p);
+	ip_set_gen_bump(set);
+	return ret;
+}
+
+/* Subscribe to change notifications */
+
+static const struct nla_policy
+ip_set_monitor_policy[IPSET_ATTR_CMD_MAX + 1] = {
+	[IPSET_ATTR_PROTOCOL]	= { .type = NLA_U8 },
+	[IPSET_ATTR_FLAGS]	= { .type = NLA_U32 },
+};
+
+static int
+IPSET_CBFN(ip_set_monitor, struct net *net, struct sock *ctnl,
+	   struct sk_buff *skb, const struct nlmsghdr *nlh,
+	   const struct nlattr * const attr[],
+	   struct netlink_ext_ack *extack,
+	   const struct nfnl_info *info)
+{
+	struct ip_set_net *inst = ip_set_pernet(IPSET_SOCK_NET(net, ctnl, info));
+	struct ip_set_monitor *m;
+
+	if (unlikely(protocol_min_failed(attr)))
+		return -IPSET_ERR_PROTOCOL;
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+	m->portid = NETLINK_PORTID(skb);
+	if (attr[IPSET_ATTR_FLAGS])
+		m->flags = ip_set_get_h32(attr[IPSET_ATTR_FLAGS]) &
+			   IPSET_FLAG_MONITOR_ELEM;
+	m->stamp = jiffies;
+
+	/* A new subscription from the same port replaces the old one */
+	spin_lock_bh(&inst->monitor_lock);
+	monitor_del(inst, m->portid);
+	list_add_tail(&m->list, &inst->monitors);
+	if (m->flags & IPSET_FLAG_MONITOR_ELEM)
+		WRITE_ONCE(inst->monitor_elem, inst->monitor_elem + 1);
+	spin_unlock_bh(&inst->monitor_lock);
+
+	return 0;
+}
+
+/* Drop the subscription of released netlink sockets */
+static int
+ip_set_netlink_event(struct notifier_block *this, unsigned long event,
+		     void *ptr)
+{
+	struct netlink_notify *n = ptr;
+	struct ip_set_net *inst;
 
-	strncpy(from_name, from->name, IPSET_MAXNAMELEN);
-	strncpy(from->name, to->name, IPSET_MAXNAMELEN);
-	strncpy(to->name, from_name, IPSET_MAXNAMELEN);
+	if (event != NETLINK_URELEASE || n->protocol != NETLINK_NETFILTER)
+		return NOTIFY_DONE;
 
-	swap(from->ref, to->ref);
-	ip_set(inst, from_id) = to;
-	ip_set(inst, to_id) = from;
-	write_unlock_bh(&ip_set_ref_lock);
+	inst = ip_set_pernet(n->net);
+	spin_lock_bh(&inst->monitor_lock);
+	monitor_del(inst, n->portid);
+	spin_unlock_bh(&inst->monitor_lock);
 
-	return 0;
+	return NOTIFY_DONE;
 }
 
+static struct notifier_block ip_set_netlink_notifier = {
+	.notifier_call	= ip_set_netlink_event,
+};
+
 /* List/save set data */
 
 #define DUMP_INIT	0
@@ -1447,6 +3704,30 @@ ip_set_put_flags(struct sk_buff *skb, struct ip_set *set)
 		cadt_flags |= IPSET_FLAG_WITH_SKBINFO;
 	if (SET_WITH_FORCEADD(set))
 		cadt_flags |= IPSET_FLAG_WITH_FORCEADD;
+	if (SET_WITH_LPM(set))
+		cadt_flags |= IPSET_FLAG_WITH_LPM;
+	if (SET_WITH_PERCPU(set))
+		cadt_flags |= IPSET_FLAG_WITH_PERCPU;
+	if (SET_WITH_BLOOM(set))
+		cadt_flags |= IPSET_FLAG_WITH_BLOOM;
+	if (SET_WITH_PREALLOC(set))
+		cadt_flags |= IPSET_FLAG_WITH_PREALLOC;
+	if (SET_WITH_INDEX(set))
+		cadt_flags |= IPSET_FLAG_WITH_INDEX;
+	if (SET_WITH_AGGREGATE(set))
+		cadt_flags |= IPSET_FLAG_WITH_AGGREGATE;
+
+	if (set->sample &&
+	    nla_put_net32(skb, IPSET_ATTR_SAMPLE, htonl(set->sample)))
+		return -EMSGSIZE;
+	if (SET_WITH_RATELIMIT(set) &&
+	    (nla_put_net32(skb, IPSET_ATTR_RATE, htonl(set->rate)) ||
+	     nla_put_net32(skb, IPSET_ATTR_BURST, htonl(set->burst))))
+		return -EMSGSIZE;
+	if (set->ctevents &&
+	    (nla_put_net32(skb, IPSET_ATTR_CTEVENTS, htonl(set->ctevents)) ||
+	     nla_put_net32(skb, IPSET_ATTR_CTDIR, htonl(set->ctdir))))
+		return -EMSGSIZE;
 
 	if (!cadt_flags)
 		return 0;
@@ -1468,6 +3749,8 @@ ip_set_dump_done(struct netlink_callback *cb)
 		pr_debug("release set %s\n", set->name);
 		__ip_set_put_netlink(set);
 	}
+	kfree(cb->data);
+	cb->data = NULL;
 	return 0;
 }
 
@@ -1489,8 +3772,16 @@ ip_set_dump_policy[IPSET_ATTR_CMD_MAX + 1] = {
 	[IPSET_ATTR_SETNAME]	= { .type = NLA_NUL_STRING,
 				    .len = IPSET_MAXNAMELEN - 1 },
 	[IPSET_ATTR_FLAGS]	= { .type = NLA_U32 },
+	[IPSET_ATTR_SINCE]	= { .type = NLA_U32 },
+	[IPSET_ATTR_TOP]	= { .type = NLA_U32 },
+	[IPSET_ATTR_TOP_BY]	= { .type = NLA_U8 },
+	[IPSET_ATTR_SNAPSHOT]	= { .type = NLA_FLAG },
+	[IPSET_ATTR_BUFSIZE]	= { .type = NLA_U32 },
 };
 
+/* Max size of the dump messages requested by userspace */
+#define IPSET_DUMP_ALLOC_MAX	SKB_WITH_OVERHEAD(65536)
+
 static int
 ip_set_dump_start(struct netlink_callback *cb)
 {
@@ -1500,6 +3791,7 @@ ip_set_dump_start(struct netlink_callback *cb)
 	struct nlattr *attr = (void *)nlh + min_len;
 	struct sk_buff *skb = cb->skb;
 	struct ip_set_net *inst = ip_set_pernet(sock_net(skb->sk));
+	struct ip_set_dump_opt *opt = NULL;
 	u32 dump_type;
 	int ret;
 
@@ -1537,6 +3829,41 @@ ip_set_dump_start(struct netlink_callback *cb)
 
 		dump_type |= (f << 16);
 	}
+#if HAVE_NETLINK_DUMP_START_ARGS != 5
+	/* Fill larger messages when the receive buffer of userspace
+	 * can hold them: fewer of the messages for many sets.
+	 */
+	if (cda[IPSET_ATTR_BUFSIZE])
+		cb->min_dump_alloc =
+			min_t(u32, ip_set_get_h32(cda[IPSET_ATTR_BUFSIZE]),
+			      IPSET_DUMP_ALLOC_MAX);
+#endif
+	if (cda[IPSET_ATTR_TOP] &&
+	    (ip_set_get_h32(cda[IPSET_ATTR_TOP]) > IPSET_TOP_MAX ||
+	     (cda[IPSET_ATTR_TOP_BY] &&
+	      nla_get_u8(cda[IPSET_ATTR_TOP_BY]) > IPSET_TOP_PACKETS))) {
+		ret = -IPSET_ERR_PROTOCOL;
+		goto error;
+	}
+	/* All args are used up, the options are the callback data */
+	if (cda[IPSET_ATTR_SINCE] || cda[IPSET_ATTR_TOP] ||
+	    cda[IPSET_ATTR_SNAPSHOT]) {
+		opt = kzalloc(sizeof(*opt), GFP_KERNEL);
+		if (!opt) {
+			ret = -ENOMEM;
+			goto error;
+		}
+		if (cda[IPSET_ATTR_SINCE]) {
+			opt->since = ip_set_get_h32(cda[IPSET_ATTR_SINCE]);
+			opt->changed = true;
+		}
+		if (cda[IPSET_ATTR_TOP])
+			opt->top = ip_set_get_h32(cda[IPSET_ATTR_TOP]);
+		if (cda[IPSET_ATTR_TOP_BY])
+			opt->top_by = nla_get_u8(cda[IPSET_ATTR_TOP_BY]);
+		opt->snapshot = !!cda[IPSET_ATTR_SNAPSHOT];
+	}
+	cb->data = opt;
 	cb->args[IPSET_CB_NET] = (unsigned long)inst;
 	cb->args[IPSET_CB_DUMP] = dump_type;
 
@@ -1559,7 +3886,7 @@ ip_set_dump_do(struct sk_buff *skb, struct netlink_callback *cb)
 	unsigned int flags = NETLINK_PORTID(cb->skb) ? NLM_F_MULTI : 0;
 	struct ip_set_net *inst = ip_set_pernet(sock_net(skb->sk));
 	u32 dump_type, dump_flags;
-	bool is_destroyed;
+	bool is_destroyed, packed = false;
 	int ret = 0;
 
 	if (!cb->args[IPSET_CB_DUMP]) {
@@ -1629,7 +3956,7 @@ dump_last:
 		    nla_put_string(skb, IPSET_ATTR_SETNAME, set->name))
 			goto nla_put_failure;
 		if (dump_flags & IPSET_FLAG_LIST_SETNAME)
-			goto next_set;
+			goto header_done;
 		switch (cb->args[IPSET_CB_ARG0]) {
 		case 0:
 			/* Core header data */
@@ -1643,20 +3970,43 @@ dump_last:
 			if (cb->args[IPSET_CB_PROTO] > IPSET_PROTOCOL_MIN &&
 			    nla_put_net16(skb, IPSET_ATTR_INDEX, htons(index)))
 				goto nla_put_failure;
-			ret = set->variant->head(set, skb);
+			ret = set->variant->head(set, skb, cb);
 			if (ret < 0)
 				goto release_refcount;
 			if (dump_flags & IPSET_FLAG_LIST_HEADER)
-				goto next_set;
+				goto header_done;
 			if (set->variant->uref)
 				set->variant->uref(set, cb, true);
 			fallthrough;
 		default:
 			ret = set->variant->list(set, skb, cb);
-			if (!cb->args[IPSET_CB_ARG0])
-				/* Set is done, proceed with next one */
-				goto next_set;
-			goto release_refcount;
+			if (ret < 0) {
+				/* Retried in an empty buffer when packed */
+				if (ret == -EMSGSIZE && !packed)
+					pr_warn("Can't list set %s: one bucket does not fit into a message. Please report it!\n",
+						set->name);
+				goto release_refcount;
+			}
+			if (cb->args[IPSET_CB_ARG0])
+				/* Set is continued in the next message */
+				goto release_refcount;
+			/* Set is done, proceed with next one */
+			if (set->variant->uref)
+				set->variant->uref(set, cb, false);
+		}
+header_done:
+		/* The set is dumped as a whole: pack the next sets into
+		 * the same buffer instead of a message per set.
+		 */
+		nlmsg_end(skb, nlh);
+		nlh = NULL;
+		packed = true;
+		pr_debug("release set %s\n", set->name);
+		__ip_set_put_netlink(set);
+		set = NULL;
+		if (dump_type == DUMP_ONE) {
+			cb->args[IPSET_CB_INDEX] = IPSET_INVALID_ID;
+			goto out;
 		}
 	}
 	/* If we dump all sets, continue with dumping last ones */
@@ -1672,7 +4022,9 @@ dump_last:
 
 nla_put_failure:
 	ret = -EFAULT;
-next_set:
+	if (packed)
+		/* The set is sent in the next buffer */
+		goto release_refcount;
 	if (dump_type == DUMP_ONE)
 		cb->args[IPSET_CB_INDEX] = IPSET_INVALID_ID;
 	else
@@ -1687,6 +4039,13 @@ release_refcount:
 		__ip_set_put_netlink(set);
 		cb->args[IPSET_CB_ARG0] = 0;
 	}
+	if (ret < 0 && packed) {
+		/* The buffer is full with the sets before */
+		if (nlh)
+			nlmsg_cancel(skb, nlh);
+		nlh = NULL;
+		ret = 0;
+	}
 out:
 	if (nlh) {
 		nlmsg_end(skb, nlh);
@@ -1738,12 +4097,56 @@ static const struct nla_policy ip_set_adt_policy[IPSET_ATTR_CMD_MAX + 1] = {
 	[IPSET_ATTR_LINENO]	= { .type = NLA_U32 },
 	[IPSET_ATTR_DATA]	= { .type = NLA_NESTED },
 	[IPSET_ATTR_ADT]	= { .type = NLA_NESTED },
+	[IPSET_ATTR_ADT_PACKED]	= { .type = NLA_BINARY },
+	[IPSET_ATTR_TRANSACTION] = { .type = NLA_FLAG },
 };
 
+static int
+ad_lineno_error(struct net *net, struct sock *ctnl, struct sk_buff *skb,
+		int ret, u32 lineno)
+{
+	/* Error in restore/batch mode: send back lineno */
+	struct nlmsghdr *rep, *nlh = nlmsg_hdr(skb);
+	struct sk_buff *skb2;
+	struct nlmsgerr *errmsg;
+	size_t payload = min(SIZE_MAX,
+			     sizeof(*errmsg) + nlmsg_len(nlh));
+	int min_len = nlmsg_total_size(sizeof(struct nfgenmsg));
+	struct nlattr *cda[IPSET_ATTR_CMD_MAX + 1];
+	struct nlattr *cmdattr;
+	u32 *errline;
+
+	skb2 = nlmsg_new(payload, GFP_KERNEL);
+	if (!skb2)
+		return -ENOMEM;
+	rep = __nlmsg_put(skb2, NETLINK_PORTID(skb),
+			  nlh->nlmsg_seq, NLMSG_ERROR, payload, 0);
+	errmsg = nlmsg_data(rep);
+	errmsg->error = ret;
+	memcpy(&errmsg->msg, nlh, nlh->nlmsg_len);
+	cmdattr = (void *)&errmsg->msg + min_len;
+
+	ret = NLA_PARSE(cda, IPSET_ATTR_CMD_MAX, cmdattr,
+			nlh->nlmsg_len - min_len, ip_set_adt_policy,
+			NULL);
+
+	if (ret) {
+		nlmsg_free(skb2);
+		return ret;
+	}
+	errline = nla_data(cda[IPSET_ATTR_LINENO]);
+
+	*errline = lineno;
+
+	NFNETLINK_UNICAST(ctnl, skb2, net, NETLINK_PORTID(skb));
+	/* Signal netlink not to send its ACK/errmsg.  */
+	return -EINTR;
+}
+
 static int
 CALL_AD(struct net *net, struct sock *ctnl, struct sk_buff *skb,
-	struct ip_set *set, struct nlattr *tb[], enum ipset_adt adt,
-	u32 flags, bool use_lineno)
+	struct ip_set *set, const struct nlattr *nla, struct nlattr *tb[],
+	enum ipset_adt adt, u32 flags, bool use_lineno)
 {
 	int ret;
 	u32 lineno = 0;
@@ -1757,49 +4160,51 @@ CALL_AD(struct net *net, struct sock *ctnl, struct sk_buff *skb,
 	} while (ret == -EAGAIN &&
 		 set->variant->resize &&
 		 (ret = set->variant->resize(set, retried)) == 0);
+	ip_set_gen_bump(set);
 
+	if (!ret)
+		ip_set_notify_adt(set, adt, nla);
 	if (!ret || (ret == -IPSET_ERR_EXIST && eexist))
 		return 0;
-	if (lineno && use_lineno) {
-		/* Error in restore/batch mode: send back lineno */
-		struct nlmsghdr *rep, *nlh = nlmsg_hdr(skb);
-		struct sk_buff *skb2;
-		struct nlmsgerr *errmsg;
-		size_t payload = min(SIZE_MAX,
-				     sizeof(*errmsg) + nlmsg_len(nlh));
-		int min_len = nlmsg_total_size(sizeof(struct nfgenmsg));
-		struct nlattr *cda[IPSET_ATTR_CMD_MAX + 1];
-		struct nlattr *cmdattr;
-		u32 *errline;
-
-		skb2 = nlmsg_new(payload, GFP_KERNEL);
-		if (!skb2)
-			return -ENOMEM;
-		rep = __nlmsg_put(skb2, NETLINK_PORTID(skb),
-				  nlh->nlmsg_seq, NLMSG_ERROR, payload, 0);
-		errmsg = nlmsg_data(rep);
-		errmsg->error = ret;
-		memcpy(&errmsg->msg, nlh, nlh->nlmsg_len);
-		cmdattr = (void *)&errmsg->msg + min_len;
-
-		ret = NLA_PARSE(cda, IPSET_ATTR_CMD_MAX, cmdattr,
-				nlh->nlmsg_len - min_len, ip_set_adt_policy,
-				NULL);
-
-		if (ret) {
-			nlmsg_free(skb2);
-			return ret;
-		}
-		errline = nla_data(cda[IPSET_ATTR_LINENO]);
+	if (lineno && use_lineno)
+		return ad_lineno_error(net, ctnl, skb, ret, lineno);
 
-		*errline = lineno;
+	return ret;
+}
 
-		NFNETLINK_UNICAST(ctnl, skb2, net, NETLINK_PORTID(skb));
-		/* Signal netlink not to send its ACK/errmsg.  */
-		return -EINTR;
-	}
+static int
+call_ad_packed(struct net *net, struct sock *ctnl, struct sk_buff *skb,
+	       struct ip_set *set, const struct nlattr *nla,
+	       const struct nlattr *attr_lineno, enum ipset_adt adt, u32 flags)
+{
+	const struct ip_set_adt_packed *p = nla_data(nla);
+	bool eexist = flags & IPSET_FLAG_EXIST, retried = false;
+	u32 index = 0;
+	int ret;
 
-	return ret;
+	if (nla_len(nla) < sizeof(*p) ||
+	    p->family != set->family ||
+	    (p->flags & ~IPSET_PACKED_TIMEOUT) ||
+	    nla_len(nla) != sizeof(*p) + p->count * ip_set_packed_stride(p))
+		return -IPSET_ERR_PROTOCOL;
+
+	do {
+		ip_set_lock(set);
+		ret = set->variant->uadt_packed(set, p, adt, &index, flags);
+		ip_set_unlock(set);
+		retried = true;
+	} while (ret == -EAGAIN &&
+		 set->variant->resize &&
+		 (ret = set->variant->resize(set, retried)) == 0);
+	ip_set_gen_bump(set);
+
+	if (!ret)
+		ip_set_notify_adt(set, adt, nla);
+	if (!ret || (ret == -IPSET_ERR_EXIST && eexist))
+		return 0;
+	/* The elements come from consecutive restore lines */
+	return ad_lineno_error(net, ctnl, skb, ret,
+			       htonl(ip_set_get_h32(attr_lineno) + index));
 }
 
 static int IPSET_CBFN_AD(ip_set_ad, struct net *net, struct sock *ctnl,
@@ -1813,33 +4218,53 @@ static int IPSET_CBFN_AD(ip_set_ad, struct net *net, struct sock *ctnl,
 	struct ip_set *set;
 	struct nlattr *tb[IPSET_ATTR_ADT_MAX + 1] = {};
 	const struct nlattr *nla;
+	struct ip_set_txn *txn = NULL;
 	u32 flags = flag_exist(INFO_NLH(info, nlh));
 	bool use_lineno;
 	int ret = 0;
 
 	if (unlikely(protocol_min_failed(attr) ||
 		     !attr[IPSET_ATTR_SETNAME] ||
-		     !((attr[IPSET_ATTR_DATA] != NULL) ^
-		       (attr[IPSET_ATTR_ADT] != NULL)) ||
+		     (!!attr[IPSET_ATTR_DATA] + !!attr[IPSET_ATTR_ADT] +
+		      !!attr[IPSET_ATTR_ADT_PACKED]) != 1 ||
 		     (attr[IPSET_ATTR_DATA] &&
 		      !flag_nested(attr[IPSET_ATTR_DATA])) ||
 		     (attr[IPSET_ATTR_ADT] &&
 		      (!flag_nested(attr[IPSET_ATTR_ADT]) ||
-		       !attr[IPSET_ATTR_LINENO]))))
+		       !attr[IPSET_ATTR_LINENO])) ||
+		     (attr[IPSET_ATTR_ADT_PACKED] &&
+		      !attr[IPSET_ATTR_LINENO])))
 		return -IPSET_ERR_PROTOCOL;
 
 	set = find_set(inst, nla_data(attr[IPSET_ATTR_SETNAME]));
 	if (!set)
 		return -ENOENT;
+	if (attr[IPSET_ATTR_ADT_PACKED] && !set->variant->uadt_packed)
+		return -IPSET_ERR_PROTOCOL;
+	if (attr[IPSET_ATTR_TRANSACTION]) {
+		if (!set->variant->txn)
+			return -IPSET_ERR_TRANSACTION;
+		txn = ip_set_txn_begin(set);
+		if (!txn)
+			return -ENOMEM;
+	}
 
 	use_lineno = !!attr[IPSET_ATTR_LINENO];
+	if (set->variant->batch)
+		set->variant->batch(set, true);
 	if (attr[IPSET_ATTR_DATA]) {
 		if (NLA_PARSE_NESTED(tb, IPSET_ATTR_ADT_MAX,
 				     attr[IPSET_ATTR_DATA],
 				     set->type->adt_policy, NULL))
-			return -IPSET_ERR_PROTOCOL;
-		ret = CALL_AD(net, ctnl, skb, set, tb, adt, flags,
-			      use_lineno);
+			ret = -IPSET_ERR_PROTOCOL;
+		else
+			ret = CALL_AD(net, ctnl, skb, set,
+				      attr[IPSET_ATTR_DATA], tb, adt, flags,
+				      use_lineno);
+	} else if (attr[IPSET_ATTR_ADT_PACKED]) {
+		ret = call_ad_packed(net, ctnl, skb, set,
+				     attr[IPSET_ATTR_ADT_PACKED],
+				     attr[IPSET_ATTR_LINENO], adt, flags);
 	} else {
 		int nla_rem;
 
@@ -1847,14 +4272,27 @@ static int IPSET_CBFN_AD(ip_set_ad, struct net *net, struct sock *ctnl,
 			if (nla_type(nla) != IPSET_ATTR_DATA ||
 			    !flag_nested(nla) ||
 			    NLA_PARSE_NESTED(tb, IPSET_ATTR_ADT_MAX, nla,
-					     set->type->adt_policy, NULL))
-				return -IPSET_ERR_PROTOCOL;
-			ret = CALL_AD(net, ctnl, skb, set, tb, adt,
+					     set->type->adt_policy, NULL)) {
+				ret = -IPSET_ERR_PROTOCOL;
+				break;
+			}
+			ret = CALL_AD(net, ctnl, skb, set, nla, tb, adt,
 				      flags, use_lineno);
 			if (ret < 0)
-				return ret;
+				break;
 		}
 	}
+	if (txn) {
+		if (ret < 0 && ip_set_txn_rollback(set, txn))
+			ret = -IPSET_ERR_TXN_ROLLBACK;
+		else if (ret >= 0)
+			ip_set_txn_commit(set, txn);
+	}
+	if (set->variant->batch) {
+		set->variant->batch(set, false);
+		/* The changes are published at the end of the batch */
+		ip_set_gen_bump(set);
+	}
 	return ret;
 }
 
@@ -1880,6 +4318,79 @@ IPSET_CBFN(ip_set_udel, struct net *net, struct sock *ctnl,
 			     IPSET_DEL, INFO_NLH(info, nlh), attr, extack, info);
 }
 
+static bool
+utest_elem(struct ip_set *set, struct nlattr *tb[])
+{
+	u32 lineno;
+	int ret;
+
+	rcu_read_lock_bh();
+	ret = set->variant->uadt(set, tb, IPSET_TEST, &lineno, 0, 0);
+	rcu_read_unlock_bh();
+	/* Userspace can't trigger element to be re-added */
+	if (ret == -EAGAIN)
+		ret = 1;
+
+	return ret > 0;
+}
+
+/* Test multiple elements and send back the ones not in the set */
+static int
+utest_adt(struct net *net, struct sock *ctnl, struct sk_buff *skb,
+	  const struct nlmsghdr *nlh, const struct nlattr * const attr[],
+	  struct ip_set *set)
+{
+	struct nlattr *tb[IPSET_ATTR_ADT_MAX + 1];
+	const struct nlattr *nla;
+	struct sk_buff *skb2;
+	struct nlmsghdr *nlh2;
+	struct nlattr *atd;
+	int nla_rem, ret = -EMSGSIZE;
+
+	skb2 = nlmsg_new(NLMSG_DEFAULT_SIZE + nla_len(attr[IPSET_ATTR_ADT]),
+			 GFP_KERNEL);
+	if (!skb2)
+		return -ENOMEM;
+
+	nlh2 = start_msg(skb2, NETLINK_PORTID(skb), nlh->nlmsg_seq, 0,
+			 IPSET_CMD_TEST);
+	if (!nlh2)
+		goto nlmsg_failure;
+	if (nla_put_u8(skb2, IPSET_ATTR_PROTOCOL, protocol(attr)) ||
+	    nla_put_string(skb2, IPSET_ATTR_SETNAME, set->name) ||
+	    nla_put_u8(skb2, IPSET_ATTR_FAMILY, set->family))
+		goto nla_put_failure;
+	atd = nla_nest_start(skb2, IPSET_ATTR_ADT);
+	if (!atd)
+		goto nla_put_failure;
+
+	nla_for_each_nested(nla, attr[IPSET_ATTR_ADT], nla_rem) {
+		memset(tb, 0, sizeof(tb));
+		if (nla_type(nla) != IPSET_ATTR_DATA ||
+		    !flag_nested(nla) ||
+		    NLA_PARSE_NESTED(tb, IPSET_ATTR_ADT_MAX, nla,
+				     set->type->adt_policy, NULL)) {
+			ret = -IPSET_ERR_PROTOCOL;
+			goto nla_put_failure;
+		}
+		if (utest_elem(set, tb))
+			continue;
+		if (nla_put(skb2, IPSET_ATTR_DATA | NLA_F_NESTED,
+			    nla_len(nla), nla_data(nla)))
+			goto nla_put_failure;
+	}
+	nla_nest_end(skb2, atd);
+	nlmsg_end(skb2, nlh2);
+
+	return NFNETLINK_UNICAST(ctnl, skb2, net, NETLINK_PORTID(skb));
+
+nla_put_failure:
+	nlmsg_cancel(skb2, nlh2);
+nlmsg_failure:
+	kfree_skb(skb2);
+	return ret;
+}
+
 static int
 IPSET_CBFN(ip_set_utest, struct net *net, struct sock *ctnl,
 	   struct sk_buff *skb,
@@ -1891,31 +4402,30 @@ IPSET_CBFN(ip_set_utest, struct net *net, struct sock *ctnl,
 	struct ip_set_net *inst = ip_set_pernet(IPSET_SOCK_NET(net, ctnl, info));
 	struct ip_set *set;
 	struct nlattr *tb[IPSET_ATTR_ADT_MAX + 1] = {};
-	int ret = 0;
-	u32 lineno;
 
 	if (unlikely(protocol_min_failed(attr) ||
 		     !attr[IPSET_ATTR_SETNAME] ||
-		     !attr[IPSET_ATTR_DATA] ||
-		     !flag_nested(attr[IPSET_ATTR_DATA])))
+		     !((attr[IPSET_ATTR_DATA] != NULL) ^
+		       (attr[IPSET_ATTR_ADT] != NULL)) ||
+		     (attr[IPSET_ATTR_DATA] &&
+		      !flag_nested(attr[IPSET_ATTR_DATA])) ||
+		     (attr[IPSET_ATTR_ADT] &&
+		      !flag_nested(attr[IPSET_ATTR_ADT]))))
 		return -IPSET_ERR_PROTOCOL;
 
 	set = find_set(inst, nla_data(attr[IPSET_ATTR_SETNAME]));
 	if (!set)
 		return -ENOENT;
 
+	if (attr[IPSET_ATTR_ADT])
+		return utest_adt(INFO_NET(info, net), INFO_SK(info, ctnl), skb,
+				 INFO_NLH(info, nlh), attr, set);
+
 	if (NLA_PARSE_NESTED(tb, IPSET_ATTR_ADT_MAX, attr[IPSET_ATTR_DATA],
 			     set->type->adt_policy, NULL))
 		return -IPSET_ERR_PROTOCOL;
 
-	rcu_read_lock_bh();
-	ret = set->variant->uadt(set, tb, IPSET_TEST, &lineno, 0, 0);
-	rcu_read_unlock_bh();
-	/* Userspace can't trigger element to be re-added */
-	if (ret == -EAGAIN)
-		ret = 1;
-
-	return ret > 0 ? 0 : -IPSET_ERR_EXIST;
+	return utest_elem(set, tb) ? 0 : -IPSET_ERR_EXIST;
 }
 
 /* Get headed data of a set */
@@ -2029,6 +4539,7 @@ nlmsg_failure:
 static const struct nla_policy
 ip_set_protocol_policy[IPSET_ATTR_CMD_MAX + 1] = {
 	[IPSET_ATTR_PROTOCOL]	= { .type = NLA_U8 },
+	[IPSET_ATTR_BUFSIZE]	= { .type = NLA_U32 },
 };
 
 static int
@@ -2056,6 +4567,11 @@ IPSET_CBFN(ip_set_protocol, struct net *net, struct sock *ctnl,
 		goto nla_put_failure;
 	if (nla_put_u8(skb2, IPSET_ATTR_PROTOCOL_MIN, IPSET_PROTOCOL_MIN))
 		goto nla_put_failure;
+	/* Just to the userspace asking: the older one rejects the attribute */
+	if (attr[IPSET_ATTR_BUFSIZE] &&
+	    nla_put_net32(skb2, IPSET_ATTR_BUFSIZE,
+			  htonl(IPSET_DUMP_ALLOC_MAX)))
+		goto nla_put_failure;
 	nlmsg_end(skb2, nlh2);
 
 	return NFNETLINK_UNICAST(INFO_SK(info, ctnl), skb2, INFO_NET(info, net), NETLINK_PORTID(skb));
@@ -2260,6 +4776,36 @@ static const struct nfnl_callback ip_set_netlink_subsys_cb[IPSET_MSG_MAX] = {
 		.attr_count	= IPSET_ATTR_CMD_MAX,
 		.policy		= ip_set_index_policy,
 	},
+	[IPSET_CMD_CLONE]	= {
+		.call		= ip_set_clone,
+		SET_NFNL_CALLBACK_TYPE(NFNL_CB_MUTEX)
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_setname2_policy,
+	},
+	[IPSET_CMD_MONITOR]	= {
+		.call		= ip_set_monitor,
+		SET_NFNL_CALLBACK_TYPE(NFNL_CB_MUTEX)
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_monitor_policy,
+	},
+	[IPSET_CMD_FREEZE]	= {
+		.call		= ip_set_freeze,
+		SET_NFNL_CALLBACK_TYPE(NFNL_CB_MUTEX)
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_setname_policy,
+	},
+	[IPSET_CMD_THAW]	= {
+		.call		= ip_set_thaw,
+		SET_NFNL_CALLBACK_TYPE(NFNL_CB_MUTEX)
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_setname_policy,
+	},
+	[IPSET_CMD_PURGE]	= {
+		.call		= ip_set_purge,
+		SET_NFNL_CALLBACK_TYPE(NFNL_CB_MUTEX)
+		.attr_count	= IPSET_ATTR_CMD_MAX,
+		.policy		= ip_set_adt_policy,
+	},
 };
 
 static struct nfnetlink_subsystem ip_set_netlink_subsys __read_mostly = {
@@ -2353,8 +4899,11 @@ ip_set_sockfn_get(struct sock *sk, int optval, void __user *user, int *len)
 		nfnl_lock(NFNL_SUBSYS_IPSET);
 		find_set_and_id(inst, req_get->set.name, &id);
 		req_get->set.index = id;
+		/* The dual-stack sets can be used in the rules of both families */
 		if (id != IPSET_INVALID_ID)
-			req_get->family = ip_set(inst, id)->family;
+			req_get->family = ip_set(inst, id)->family ==
+					  NFPROTO_INET ? NFPROTO_UNSPEC :
+					  ip_set(inst, id)->family;
 		nfnl_unlock(NFNL_SUBSYS_IPSET);
 		goto copy;
 	}
@@ -2400,6 +4949,136 @@ static struct nf_sockopt_ops so_set __read_mostly = {
 	.owner		= THIS_MODULE,
 };
 
+#if defined(CONFIG_PROC_FS) && defined(HAVE_PROC_CREATE_NET_SINGLE)
+/* /proc/net/ip_set/stats: the lookup statistics of the sets, one line
+ * per set with the number of the tests, hits and misses, then the
+ * histograms of the buckets probed and of the elements compared
+ */
+static int
+ip_set_stats_show(struct seq_file *seq, void *v)
+{
+	struct ip_set_net *inst = ip_set_pernet(seq_file_single_net(seq));
+	struct ip_set_lookupstat stat;
+	struct ip_set *set;
+	ip_set_id_t i;
+	int b;
+
+	seq_puts(seq, "# name tests hits misses probes[] compares[]\n");
+	nfnl_lock(NFNL_SUBSYS_IPSET);
+	for (i = 0; i < inst->ip_set_max; i++) {
+		set = ip_set(inst, i);
+		if (!set || !set->variant->lookupstat)
+			continue;
+		set->variant->lookupstat(set, &stat);
+		seq_printf(seq, "%s %llu %llu %llu", set->name,
+			   stat.tests, stat.hits, stat.misses);
+		for (b = 0; b < IPSET_LOOKUP_HIST; b++)
+			seq_printf(seq, " %llu", stat.probes[b]);
+		for (b = 0; b < IPSET_LOOKUP_HIST; b++)
+			seq_printf(seq, " %llu", stat.compares[b]);
+		seq_putc(seq, '\n');
+	}
+	nfnl_unlock(NFNL_SUBSYS_IPSET);
+	return 0;
+}
+
+/* /proc/net/ip_set/memory: the memory charged by the sets, the budget
+ * and the adds rejected by it. The budget is changed by writing it.
+ */
+static int
+ip_set_memory_show(struct seq_file *seq, void *v)
+{
+	struct ip_set_net *inst = ip_set_pernet(seq_file_single_net(seq));
+
+	seq_printf(seq, "used %ld\nmax %lu\nrejected %ld\n",
+		   atomic_long_read(&inst->mem), READ_ONCE(inst->mem_max),
+		   atomic_long_read(&inst->mem_rejected));
+	return 0;
+}
+
+/* /proc/net/ip_set/gc: the runs of the gc scheduler, their total and
+ * maximal delay in milliseconds, the time spent in microseconds and the
+ * ticks which ran out of the budget, then the same per set with the
+ * time to its next run.
+ */
+static int
+ip_set_gc_show(struct seq_file *seq, void *v)
+{
+	struct ip_set_net *inst = ip_set_pernet(seq_file_single_net(seq));
+	unsigned long now = jiffies;
+	struct ip_set_gc *gc;
+
+	spin_lock_bh(&inst->gc_lock);
+	seq_printf(seq, "runs %llu\nlag %llu\nlag_max %u\ntime %llu\n"
+		   "throttled %llu\n",
+		   inst->gc_runs, inst->gc_lag, inst->gc_lag_max,
+		   div_u64(inst->gc_time, NSEC_PER_USEC), inst->gc_throttled);
+	seq_puts(seq, "# name due runs lag lag_max time\n");
+	list_for_each_entry(gc, &inst->gcs, list)
+		seq_printf(seq, "%s %u %llu %llu %u %llu\n", gc->set->name,
+			   gc->state == IP_SET_GC_PENDING &&
+			   time_after(gc->due, now) ?
+			   jiffies_to_msecs(gc->due - now) : 0,
+			   gc->runs, gc->lag, gc->lag_max,
+			   div_u64(gc->time, NSEC_PER_USEC));
+	spin_unlock_bh(&inst->gc_lock);
+	return 0;
+}
+
+static int
+ip_set_memory_write(struct file *file, char *buf, size_t size)
+{
+	struct net *net = seq_file_single_net(file->private_data);
+	struct ip_set_net *inst = ip_set_pernet(net);
+	unsigned long max;
+	char *end;
+
+	if (!ns_capable(net->user_ns, CAP_NET_ADMIN))
+		return -EPERM;
+	max = memparse(buf, &end);
+	if (end == buf || (*end && *end != '\n'))
+		return -EINVAL;
+	WRITE_ONCE(inst->mem_max, max);
+	return 0;
+}
+
+static int __net_init
+ip_set_proc_init(struct net *net, struct ip_set_net *inst)
+{
+	inst->proc_dir = proc_mkdir("ip_set", net->proc_net);
+	if (!inst->proc_dir)
+		return -ENOMEM;
+	if (!proc_create_net_single("stats", 0444, inst->proc_dir,
+				    ip_set_stats_show, NULL) ||
+	    !proc_create_net_single_write("memory", 0644, inst->proc_dir,
+					  ip_set_memory_show,
+					  ip_set_memory_write, NULL) ||
+	    !proc_create_net_single("gc", 0444, inst->proc_dir,
+				    ip_set_gc_show, NULL)) {
+		proc_remove(inst->proc_dir);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void __net_exit
+ip_set_proc_exit(struct ip_set_net *inst)
+{
+	proc_remove(inst->proc_dir);
+}
+#else
+static inline int
+ip_set_proc_init(struct net *net, struct ip_set_net *inst)
+{
+	return 0;
+}
+
+static inline void
+ip_set_proc_exit(struct ip_set_net *inst)
+{
+}
+#endif
+
 static int __net_init
 ip_set_net_init(struct net *net)
 {
@@ -2431,10 +5110,48 @@ ip_set_net_init(struct net *net)
 #endif
 	inst->is_deleted = false;
 	inst->is_destroyed = false;
+	INIT_LIST_HEAD(&inst->monitors);
+	spin_lock_init(&inst->monitor_lock);
+	spin_lock_init(&inst->comment_lock);
+	inst->comment_bits = IP_SET_COMMENT_BITS;
+	inst->comments = 0;
+	atomic_long_set(&inst->mem, 0);
+	inst->mem_max = mem_max;
+	atomic_long_set(&inst->mem_rejected, 0);
+	spin_lock_init(&inst->gc_lock);
+	INIT_LIST_HEAD(&inst->gcs);
+	inst->gc_due = RB_ROOT;
+	INIT_DEFERRABLE_WORK(&inst->gc_tick, ip_set_gc_tick);
+	inst->gc_armed = false;
+	inst->gc_window = jiffies;
+	atomic64_set(&inst->gc_spent, 0);
+	inst->gc_runs = 0;
+	inst->gc_lag = 0;
+	inst->gc_lag_max = 0;
+	inst->gc_time = 0;
+	inst->gc_throttled = 0;
+	inst->comment_hash = kcalloc(jhash_size(IP_SET_COMMENT_BITS),
+				     sizeof(struct hlist_head), GFP_KERNEL);
+	if (!inst->comment_hash)
+		goto err_list;
 	rcu_assign_pointer(inst->ip_set_list, list);
+	if (ip_set_hname_resize(inst, inst->ip_set_max))
+		goto err_comment;
+	if (ip_set_proc_init(net, inst)) {
+		kvfree(inst->ip_set_hnode);
+		kvfree(inst->ip_set_hname);
+		goto err_comment;
+	}
 	return 0;
 
-#ifndef HAVE_NET_OPS_ID
+err_comment:
+	kfree(inst->comment_hash);
+err_list:
+	kvfree(list);
+#ifdef HAVE_NET_OPS_ID
+	return -ENOMEM;
+#else
+	err = -ENOMEM;
 err_alloc:
 	kfree(inst);
 	return err;
@@ -2451,6 +5168,7 @@ ip_set_net_exit(struct net *net)
 
 	inst->is_deleted = true; /* flag for ip_set_nfnl_put */
 
+	ip_set_proc_exit(inst);
 	nfnl_lock(NFNL_SUBSYS_IPSET);
 	for (i = 0; i < inst->ip_set_max; i++) {
 		set = ip_set(inst, i);
@@ -2460,7 +5178,21 @@ ip_set_net_exit(struct net *net)
 		}
 	}
 	nfnl_unlock(NFNL_SUBSYS_IPSET);
+	/* The gc runs are cancelled with the sets */
+	WARN_ON(!list_empty(&inst->gcs));
+	cancel_delayed_work_sync(&inst->gc_tick);
+	spin_lock_bh(&inst->monitor_lock);
+	while (!list_empty(&inst->monitors))
+		monitor_free(inst, list_first_entry(&inst->monitors,
+						    struct ip_set_monitor,
+						    list));
+	spin_unlock_bh(&inst->monitor_lock);
 	kvfree(rcu_dereference_protected(inst->ip_set_list, 1));
+	kvfree(inst->ip_set_hnode);
+	kvfree(inst->ip_set_hname);
+	/* The comments are released with the elements of the sets */
+	WARN_ON(inst->comments);
+	kfree(inst->comment_hash);
 #ifndef HAVE_NET_OPS_ID
 	kvfree(inst);
 #endif
@@ -2494,10 +5226,25 @@ static struct pernet_operations ip_set_net_ops = {
 static int __init
 ip_set_init(void)
 {
-	int ret = REGISTER_PERNET_SUBSYS(&ip_set_net_ops);
+	int ret, cpu;
+
+	/* The xorshift state must not be zero */
+	for_each_possible_cpu(cpu) {
+		u32 *state = per_cpu_ptr(&ip_set_sample_state, cpu);
+
+		get_random_bytes(state, sizeof(*state));
+		*state |= 1;
+	}
+
+	ip_set_gc_wq = alloc_workqueue("ipset_gc", WQ_UNBOUND, gc_workers);
+	if (!ip_set_gc_wq)
+		return -ENOMEM;
+
+	ret = REGISTER_PERNET_SUBSYS(&ip_set_net_ops);
 
 	if (ret) {
 		pr_err("ip_set: cannot register pernet_subsys.\n");
+		destroy_workqueue(ip_set_gc_wq);
 		return ret;
 	}
 
@@ -2505,6 +5252,7 @@ ip_set_init(void)
 	if (ret != 0) {
 		pr_err("ip_set: cannot register with nfnetlink.\n");
 		UNREGISTER_PERNET_SUBSYS(&ip_set_net_ops);
+		destroy_workqueue(ip_set_gc_wq);
 		return ret;
 	}
 
@@ -2513,6 +5261,29 @@ ip_set_init(void)
 		pr_err("SO_SET registry failed: %d\n", ret);
 		nfnetlink_subsys_unregister(&ip_set_netlink_subsys);
 		UNREGISTER_PERNET_SUBSYS(&ip_set_net_ops);
+		destroy_workqueue(ip_set_gc_wq);
+		return ret;
+	}
+
+	ret = netlink_register_notifier(&ip_set_netlink_notifier);
+	if (ret != 0) {
+		pr_err("ip_set: cannot register netlink notifier.\n");
+		nf_unregister_sockopt(&so_set);
+		nfnetlink_subsys_unregister(&ip_set_netlink_subsys);
+		UNREGISTER_PERNET_SUBSYS(&ip_set_net_ops);
+		destroy_workqueue(ip_set_gc_wq);
+		return ret;
+	}
+
+	/* The kfuncs are unregistered with the BTF of the module */
+	ret = ip_set_bpf_init();
+	if (ret != 0) {
+		pr_err("ip_set: cannot register BPF kfuncs.\n");
+		netlink_unregister_notifier(&ip_set_netlink_notifier);
+		nf_unregister_sockopt(&so_set);
+		nfnetlink_subsys_unregister(&ip_set_netlink_subsys);
+		UNREGISTER_PERNET_SUBSYS(&ip_set_net_ops);
+		destroy_workqueue(ip_set_gc_wq);
 		return ret;
 	}
 
@@ -2522,10 +5293,14 @@ ip_set_init(void)
 static void __exit
 ip_set_fini(void)
 {
+	netlink_unregister_notifier(&ip_set_netlink_notifier);
 	nf_unregister_sockopt(&so_set);
 	nfnetlink_subsys_unregister(&ip_set_netlink_subsys);
 
 	UNREGISTER_PERNET_SUBSYS(&ip_set_net_ops);
+	destroy_workqueue(ip_set_gc_wq);
+	/* Wait for the pending per-cpu counter releases */
+	rcu_barrier();
 	pr_debug("these are the famous last words\n");
 }
 
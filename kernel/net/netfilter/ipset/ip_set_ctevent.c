@@ -0,0 +1,324 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ */
+
+/* Kernel module populating the sets from the conntrack events.
+ *
+ * The sets created with the ctevents option are attached here by the core:
+ * the elements are added when a flow is new or becomes assured and deleted
+ * when it is destroyed, once per flow instead of by the SET target at every
+ * packet. The element is built from the tuple of the original or the reply
+ * direction, with the source or the destination in every dimension as set
+ * by the ctdir option.
+ *
+ * The conntrack events of a network namespace are delivered to a single
+ * listener, therefore the sets cannot be attached while ctnetlink or
+ * another module is registered for them.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_ecache.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <linux/netfilter/ipset/ip_set_getport.h>
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
+MODULE_DESCRIPTION("ip_set: population of the sets from conntrack events");
+
+struct ip_set_ctevent_net {
+	struct list_head sets;	/* attached sets, under RCU */
+	bool registered;	/* the notifier is registered */
+};
+
+static unsigned int ip_set_ctevent_net_id __read_mostly;
+
+static struct ip_set_ctevent_net *
+ctevent_pernet(struct net *net)
+{
+	return net_generic(net, ip_set_ctevent_net_id);
+}
+
+/* A packet carrying the addresses, the protocol and the ports of the
+ * tuple, as the kadt functions of the set types expect it
+ */
+static struct sk_buff *
+ctevent_skb(const struct nf_conntrack_tuple *tuple)
+{
+	u8 family = tuple->src.l3num;
+	size_t l3len = family == NFPROTO_IPV4 ? sizeof(struct iphdr)
+					      : sizeof(struct ipv6hdr);
+	size_t len = l3len + sizeof(struct tcphdr);
+	struct sk_buff *skb = alloc_skb(len, GFP_ATOMIC);
+
+	if (!skb)
+		return NULL;
+	skb_put(skb, len);
+	memset(skb->data, 0, len);
+	skb_reset_network_header(skb);
+	skb_set_transport_header(skb, l3len);
+	if (family == NFPROTO_IPV4) {
+		struct iphdr *iph = ip_hdr(skb);
+
+		iph->version = 4;
+		iph->ihl = sizeof(struct iphdr) / 4;
+		iph->ttl = 64;
+		iph->protocol = tuple->dst.protonum;
+		iph->tot_len = htons(len);
+		iph->saddr = tuple->src.u3.ip;
+		iph->daddr = tuple->dst.u3.ip;
+		skb->protocol = htons(ETH_P_IP);
+	} else {
+		struct ipv6hdr *ip6h = ipv6_hdr(skb);
+
+		ip6h->version = 6;
+		ip6h->hop_limit = 64;
+		ip6h->nexthdr = tuple->dst.protonum;
+		ip6h->payload_len = htons(sizeof(struct tcphdr));
+		ip6h->saddr = tuple->src.u3.in6;
+		ip6h->daddr = tuple->dst.u3.in6;
+		skb->protocol = htons(ETH_P_IPV6);
+	}
+	switch (tuple->dst.protonum) {
+	case IPPROTO_ICMP:
+		icmp_hdr(skb)->type = tuple->dst.u.icmp.type;
+		icmp_hdr(skb)->code = tuple->dst.u.icmp.code;
+		break;
+	case IPPROTO_ICMPV6:
+		icmp6_hdr(skb)->icmp6_type = tuple->dst.u.icmp.type;
+		icmp6_hdr(skb)->icmp6_code = tuple->dst.u.icmp.code;
+		break;
+	default:
+		/* The ports of UDP, UDPLITE, SCTP and DCCP are at the
+		 * same place as of TCP
+		 */
+		tcp_hdr(skb)->source = tuple->src.u.all;
+		tcp_hdr(skb)->dest = tuple->dst.u.all;
+		tcp_hdr(skb)->doff = sizeof(struct tcphdr) / 4;
+		break;
+	}
+	return skb;
+}
+
+static void
+ctevent_adt(struct net *net, struct ip_set *set, const struct sk_buff *skb,
+	    enum ipset_adt adt)
+{
+	struct ip_set_adt_opt opt = {
+		.family = skb->protocol == htons(ETH_P_IP) ? NFPROTO_IPV4
+							   : NFPROTO_IPV6,
+		.dim = IPSET_DIM_MAX,
+		.flags = set->ctdir & ~IPSET_CTDIR_REPLY,
+		.cmdflags = IPSET_FLAG_EXIST,
+		.ext.timeout = UINT_MAX,
+	};
+	struct xt_action_param par = {};
+#ifdef HAVE_STATE_IN_XT_ACTION_PARAM
+	struct nf_hook_state state = {
+		.net	= net,
+		.pf	= opt.family,
+	};
+
+	par.state = &state;
+#else
+#ifdef HAVE_NET_IN_XT_ACTION_PARAM
+	par.net = net;
+#endif
+	par.in = net->loopback_dev;
+	par.family = opt.family;
+#endif
+	par.thoff = skb_transport_offset(skb);
+
+	ip_set_kadt(set, skb, &par, adt, &opt);
+}
+
+#ifdef HAVE_NF_CT_EVENT_NOTIFIER_CT_EVENT
+#define CTEVENT_CONST	const
+#else
+#define CTEVENT_CONST
+#endif
+
+static int
+ip_set_ctevent(unsigned int events, CTEVENT_CONST struct nf_ct_event *item)
+{
+	struct nf_conn *ct = item->ct;
+	struct net *net = nf_ct_net(ct);
+	struct ip_set_ctevent_net *cn = ctevent_pernet(net);
+	struct sk_buff *skb[IP_CT_DIR_MAX] = {};
+	enum ip_conntrack_dir dir;
+	struct ip_set *set;
+	u8 mask = 0;
+
+	if (events & (1 << IPCT_NEW))
+		mask |= IPSET_CTEVENT_NEW;
+	if (events & (1 << IPCT_ASSURED))
+		mask |= IPSET_CTEVENT_ASSURED;
+	if (events & (1 << IPCT_DESTROY))
+		mask |= IPSET_CTEVENT_DESTROY;
+	if (!mask)
+		return 0;
+
+	rcu_read_lock();
+	/* The tuple packet is parsed once for all the sets */
+	local_bh_disable();
+	ip_set_l4_scope_enter();
+	list_for_each_entry_rcu(set, &cn->sets, ctevent_list) {
+		if (!(set->ctevents & mask))
+			continue;
+		dir = set->ctdir & IPSET_CTDIR_REPLY ? IP_CT_DIR_REPLY
+						     : IP_CT_DIR_ORIGINAL;
+		if (!skb[dir]) {
+			skb[dir] = ctevent_skb(&ct->tuplehash[dir].tuple);
+			if (!skb[dir])
+				break;
+		}
+		/* Errors like a full set or a missing element are ignored */
+		ctevent_adt(net, set, skb[dir],
+			    mask & IPSET_CTEVENT_DESTROY ? IPSET_DEL
+							 : IPSET_ADD);
+	}
+	ip_set_l4_scope_leave();
+	local_bh_enable();
+	rcu_read_unlock();
+
+	kfree_skb(skb[IP_CT_DIR_ORIGINAL]);
+	kfree_skb(skb[IP_CT_DIR_REPLY]);
+	return 0;
+}
+
+static struct nf_ct_event_notifier ip_set_ctevent_notifier = {
+#ifdef HAVE_NF_CT_EVENT_NOTIFIER_CT_EVENT
+	.ct_event	= ip_set_ctevent,
+#else
+	.fcn		= ip_set_ctevent,
+#endif
+};
+
+static int
+ctevent_register(struct net *net)
+{
+#ifdef HAVE_NF_CT_EVENT_NOTIFIER_CT_EVENT
+	/* The registration does not fail but warns when the slot is taken */
+	if (rcu_access_pointer(net->ct.nf_conntrack_event_cb))
+		return -EBUSY;
+	nf_conntrack_register_notifier(net, &ip_set_ctevent_notifier);
+	return 0;
+#else
+	return nf_conntrack_register_notifier(net, &ip_set_ctevent_notifier);
+#endif
+}
+
+static void
+ctevent_unregister(struct net *net)
+{
+#ifdef HAVE_NF_CT_EVENT_NOTIFIER_CT_EVENT
+	nf_conntrack_unregister_notifier(net);
+#else
+	nf_conntrack_unregister_notifier(net, &ip_set_ctevent_notifier);
+#endif
+}
+
+/* Called under the nfnl mutex */
+static int
+ip_set_ctevent_attach(struct ip_set *set)
+{
+	struct ip_set_ctevent_net *cn = ctevent_pernet(set->net);
+
+	if (!cn->registered) {
+		if (ctevent_register(set->net))
+			return -IPSET_ERR_CTEVENT_BUSY;
+		cn->registered = true;
+	}
+	list_add_tail_rcu(&set->ctevent_list, &cn->sets);
+	pr_debug("set %s attached\n", set->name);
+	return 0;
+}
+
+static void
+ip_set_ctevent_detach(struct ip_set *set)
+{
+	struct ip_set_ctevent_net *cn = ctevent_pernet(set->net);
+
+	list_del_rcu(&set->ctevent_list);
+	if (list_empty(&cn->sets) && cn->registered) {
+		ctevent_unregister(set->net);
+		cn->registered = false;
+	}
+	/* The running event handlers must be done with the set */
+	synchronize_rcu();
+	pr_debug("set %s detached\n", set->name);
+}
+
+static const struct ip_set_ctevent_ops ip_set_ctevent_ops = {
+	.attach	= ip_set_ctevent_attach,
+	.detach	= ip_set_ctevent_detach,
+	.me	= THIS_MODULE,
+};
+
+static int __net_init
+ip_set_ctevent_net_init(struct net *net)
+{
+	struct ip_set_ctevent_net *cn = ctevent_pernet(net);
+
+	INIT_LIST_HEAD(&cn->sets);
+	cn->registered = false;
+	return 0;
+}
+
+/* The sets still attached are detached later, when ip_set destroys them */
+static void __net_exit
+ip_set_ctevent_net_exit(struct net *net)
+{
+	struct ip_set_ctevent_net *cn = ctevent_pernet(net);
+
+	nfnl_lock(NFNL_SUBSYS_IPSET);
+	if (cn->registered) {
+		ctevent_unregister(net);
+		cn->registered = false;
+	}
+	nfnl_unlock(NFNL_SUBSYS_IPSET);
+}
+
+static struct pernet_operations ip_set_ctevent_net_ops = {
+	.init	= ip_set_ctevent_net_init,
+	.exit	= ip_set_ctevent_net_exit,
+	.id	= &ip_set_ctevent_net_id,
+	.size	= sizeof(struct ip_set_ctevent_net),
+};
+
+static int __init
+ip_set_ctevent_init(void)
+{
+	int ret = register_pernet_subsys(&ip_set_ctevent_net_ops);
+
+	if (ret)
+		return ret;
+	ret = ip_set_ctevent_register(&ip_set_ctevent_ops);
+	if (ret)
+		unregister_pernet_subsys(&ip_set_ctevent_net_ops);
+	return ret;
+}
+
+static void __exit
+ip_set_ctevent_fini(void)
+{
+	/* No set is attached: they reference the module */
+	ip_set_ctevent_unregister(&ip_set_ctevent_ops);
+	unregister_pernet_subsys(&ip_set_ctevent_net_ops);
+}
+
+module_init(ip_set_ctevent_init);
+module_exit(ip_set_ctevent_fini);
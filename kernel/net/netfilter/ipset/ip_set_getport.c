@@ -10,6 +10,7 @@
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
 #include <linux/sctp.h>
+#include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_ipv6/ip6_tables.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
@@ -17,11 +18,67 @@
 #include <linux/netfilter/ipset/ip_set_getport.h>
 #include <linux/netfilter/ipset/ip_set_compat.h>
 
+/* Layer 4 data of a packet */
+struct ip_set_l4 {
+	__be16 port[2];		/* source and destination port */
+	u8 proto;		/* protocol */
+	bool has_port;		/* protocol with port-like data */
+	bool ok;		/* data available */
+};
+
+/* The rules of a table may call many set matches for the same packet:
+ * the layer 4 data is parsed once per table traversal and CPU. The
+ * traversal is identified by the xt_recseq sequence, which is odd
+ * while the table is traversed with bottom halves disabled. Outside of
+ * the tables, the callers testing or adding a packet to several sets
+ * open a scope instead, see ip_set_l4_scope_enter().
+ */
+struct ip_set_l4_cache {
+	const struct sk_buff *skb;
+	unsigned int seq;
+	u8 family;
+	bool xt;		/* seq is of xt_recseq or of the scope */
+	struct ip_set_l4 l4;
+};
+
+static DEFINE_PER_CPU(struct ip_set_l4_cache, ip_set_l4_cache);
+
+struct ip_set_l4_scope {
+	unsigned int depth;	/* nested scopes */
+	unsigned int seq;	/* identifies the outermost scope */
+};
+
+static DEFINE_PER_CPU(struct ip_set_l4_scope, ip_set_l4_scope);
+
+/* The packets passed to the sets between the enter and the leave calls
+ * are not modified: their layer 4 data, most notably the result of the
+ * IPv6 extension header walk, is parsed once. Must be called with bottom
+ * halves disabled, the scopes may be nested.
+ */
+void
+ip_set_l4_scope_enter(void)
+{
+	struct ip_set_l4_scope *s = this_cpu_ptr(&ip_set_l4_scope);
+
+	if (!s->depth++)
+		s->seq++;
+}
+EXPORT_SYMBOL_GPL(ip_set_l4_scope_enter);
+
+void
+ip_set_l4_scope_leave(void)
+{
+	__this_cpu_dec(ip_set_l4_scope.depth);
+}
+EXPORT_SYMBOL_GPL(ip_set_l4_scope_leave);
+
 /* We must handle non-linear skbs */
-static bool
+static void
 get_port(const struct sk_buff *skb, int protocol, unsigned int protooff,
-	 bool src, __be16 *port, u8 *proto)
+	 struct ip_set_l4 *l4)
 {
+	l4->ok = false;
+	l4->has_port = true;
 	switch (protocol) {
 	case IPPROTO_TCP: {
 		struct tcphdr _tcph;
@@ -30,9 +87,10 @@ get_port(const struct sk_buff *skb, int protocol, unsigned int protooff,
 		th = skb_header_pointer(skb, protooff, sizeof(_tcph), &_tcph);
 		if (!th)
 			/* No choice either */
-			return false;
+			return;
 
-		*port = src ? th->source : th->dest;
+		l4->port[0] = th->source;
+		l4->port[1] = th->dest;
 		break;
 	}
 	case IPPROTO_SCTP: {
@@ -47,9 +105,10 @@ get_port(const struct sk_buff *skb, int protocol, unsigned int protooff,
 		sh = skb_header_pointer(skb, protooff, sizeof(_sh), &_sh);
 		if (!sh)
 			/* No choice either */
-			return false;
+			return;
 
-		*port = src ? sh->source : sh->dest;
+		l4->port[0] = sh->source;
+		l4->port[1] = sh->dest;
 		break;
 	}
 	case IPPROTO_UDP:
@@ -60,9 +119,10 @@ get_port(const struct sk_buff *skb, int protocol, unsigned int protooff,
 		uh = skb_header_pointer(skb, protooff, sizeof(_udph), &_udph);
 		if (!uh)
 			/* No choice either */
-			return false;
+			return;
 
-		*port = src ? uh->source : uh->dest;
+		l4->port[0] = uh->source;
+		l4->port[1] = uh->dest;
 		break;
 	}
 	case IPPROTO_ICMP: {
@@ -71,9 +131,10 @@ get_port(const struct sk_buff *skb, int protocol, unsigned int protooff,
 
 		ic = skb_header_pointer(skb, protooff, sizeof(_ich), &_ich);
 		if (!ic)
-			return false;
+			return;
 
-		*port = (__force __be16)htons((ic->type << 8) | ic->code);
+		l4->port[0] = l4->port[1] =
+			(__force __be16)htons((ic->type << 8) | ic->code);
 		break;
 	}
 	case IPPROTO_ICMPV6: {
@@ -82,31 +143,77 @@ get_port(const struct sk_buff *skb, int protocol, unsigned int protooff,
 
 		ic = skb_header_pointer(skb, protooff, sizeof(_ich), &_ich);
 		if (!ic)
-			return false;
+			return;
 
-		*port = (__force __be16)
+		l4->port[0] = l4->port[1] = (__force __be16)
 			htons((ic->icmp6_type << 8) | ic->icmp6_code);
 		break;
 	}
 	default:
+		l4->has_port = false;
 		break;
 	}
-	*proto = protocol;
+	l4->proto = protocol;
+	l4->ok = true;
+}
 
+static bool
+l4_result(const struct ip_set_l4 *l4, bool src, __be16 *port, u8 *proto)
+{
+	if (!l4->ok)
+		return false;
+	if (l4->has_port)
+		*port = l4->port[src ? 0 : 1];
+	*proto = l4->proto;
 	return true;
 }
 
-bool
-ip_set_get_ip4_port(const struct sk_buff *skb, bool src,
-		    __be16 *port, u8 *proto)
+static const struct ip_set_l4 *
+get_l4(const struct sk_buff *skb, u8 family, struct ip_set_l4 *l4,
+       void (*parse)(const struct sk_buff *skb, struct ip_set_l4 *l4))
+{
+	struct ip_set_l4_cache *c;
+	unsigned int seq;
+	bool xt;
+
+	if (!in_softirq())
+		goto nocache;
+	seq = __this_cpu_read(xt_recseq.sequence);
+	xt = seq & 1;
+	if (!xt) {
+		/* Not called from an x_tables table traversal */
+		if (!__this_cpu_read(ip_set_l4_scope.depth))
+			goto nocache;
+		seq = __this_cpu_read(ip_set_l4_scope.seq);
+	}
+
+	c = this_cpu_ptr(&ip_set_l4_cache);
+	if (c->skb != skb || c->seq != seq || c->xt != xt ||
+	    c->family != family) {
+		parse(skb, &c->l4);
+		c->skb = skb;
+		c->seq = seq;
+		c->xt = xt;
+		c->family = family;
+	}
+	return &c->l4;
+
+nocache:
+	parse(skb, l4);
+	return l4;
+}
+
+static void
+ip4_l4(const struct sk_buff *skb, struct ip_set_l4 *l4)
 {
 	const struct iphdr *iph = ip_hdr(skb);
 	unsigned int protooff = skb_network_offset(skb) + ip_hdrlen(skb);
 	int protocol = iph->protocol;
 
+	l4->ok = false;
 	/* See comments at tcp_match in ip_tables.c */
 	if (protocol <= 0)
-		return false;
+		return;
 
 	if (ntohs(iph->frag_off) & IP_OFFSET)
 		switch (protocol) {
@@ -116,37 +223,59 @@ ip_set_get_ip4_port(const struct sk_buff *skb, bool src,
 		case IPPROTO_UDPLITE:
 		case IPPROTO_ICMP:
 			/* Port info not available for fragment offset > 0 */
-			return false;
+			return;
 		default:
 			/* Other protocols doesn't have ports,
 			 * so we can match fragments.
 			 */
-			*proto = protocol;
-			return true;
+			l4->proto = protocol;
+			l4->has_port = false;
+			l4->ok = true;
+			return;
 		}
 
-	return get_port(skb, protocol, protooff, src, port, proto);
+	get_port(skb, protocol, protooff, l4);
 }
-EXPORT_SYMBOL_GPL(ip_set_get_ip4_port);
 
-#if IS_ENABLED(CONFIG_IP6_NF_IPTABLES)
 bool
-ip_set_get_ip6_port(const struct sk_buff *skb, bool src,
+ip_set_get_ip4_port(const struct sk_buff *skb, bool src,
 		    __be16 *port, u8 *proto)
+{
+	struct ip_set_l4 l4;
+
+	return l4_result(get_l4(skb, NFPROTO_IPV4, &l4, ip4_l4),
+			 src, port, proto);
+}
+EXPORT_SYMBOL_GPL(ip_set_get_ip4_port);
+
+#if IS_ENABLED(CONFIG_IP6_NF_IPTABLES)
+static void
+ip6_l4(const struct sk_buff *skb, struct ip_set_l4 *l4)
 {
 	int protoff;
 	u8 nexthdr;
 	__be16 frag_off = 0;
 
+	l4->ok = false;
 	nexthdr = ipv6_hdr(skb)->nexthdr;
 	protoff = ipv6_skip_exthdr(skb,
 				   skb_network_offset(skb) +
 					sizeof(struct ipv6hdr), &nexthdr,
 				   &frag_off);
 	if (protoff < 0 || (frag_off & htons(~0x7)) != 0)
-		return false;
+		return;
+
+	get_port(skb, nexthdr, protoff, l4);
+}
+
+bool
+ip_set_get_ip6_port(const struct sk_buff *skb, bool src,
+		    __be16 *port, u8 *proto)
+{
+	struct ip_set_l4 l4;
 
-	return get_port(skb, nexthdr, protoff, src, port, proto);
+	return l4_result(get_l4(skb, NFPROTO_IPV6, &l4, ip6_l4),
+			 src, port, proto);
 }
 EXPORT_SYMBOL_GPL(ip_set_get_ip6_port);
 #endif
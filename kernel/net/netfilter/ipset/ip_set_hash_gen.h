@@ -7,9 +7,12 @@
 
 #include <linux/rcupdate.h>
 #include <linux/jhash.h>
+#include <linux/llist.h>
+#include <linux/siphash.h>
 #include <linux/types.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/ipset/ip_set.h>
+#include <trace/events/ipset.h>
 
 #define __ipset_dereference(p)		\
 	rcu_dereference_protected(p, 1)
@@ -23,6 +26,9 @@
 #define ipset_dereference_bh_nfnl(p)	\
 	rcu_dereference_bh_check(p, 	\
 		lockdep_nfnl_is_held(NFNL_SUBSYS_IPSET))
+#define ipset_dereference_resize(p, h)	\
+	rcu_dereference_protected(p,	\
+		lockdep_is_held(&(h)->resize.lock))
 
 /* Hashing which uses arrays to resolve clashing. The hash table is resized
  * (doubled) when searching becomes too long.
@@ -35,6 +41,15 @@
  * are serialized by the nfnl mutex. During resizing the set is
  * read-locked, so the only possible concurrent operations are
  * the kernel side readers. Those must be protected by proper RCU locking.
+ *
+ * When a bucket becomes full, it is allowed to grow over the limit
+ * (up to AHASH_MAX_TUNED) and the resizing is performed by a work item,
+ * so that a single add does not stall on rehashing the whole set.
+ * The background resize is serialized with the command triggered one
+ * and with flushing by the resize mutex, and the add/del operations
+ * running parallel with it are saved and replayed on the new table.
+ * The same work item shrinks the table when deletion or expiry leaves
+ * it sparsely populated, but never below the size it was created with.
  */
 
 /* Number of elements to store in an initial array block */
@@ -46,6 +61,12 @@
 
 #define AHASH_MAX(h)			((h)->bucketsize)
 
+/* Max number of queued asynchronous adds of a set */
+#define AHASH_ASYNC_MAX			4096
+
+/* Number of keys of a bulk test compared after prefetching their buckets */
+#define AHASH_BULK			8
+
 /* Max number of elements can be tuned */
 #ifdef IP_SET_HASH_WITH_MULTI
 static u8
@@ -70,35 +91,197 @@ tune_bucketsize(u8 curr, u32 multi)
 
 /* A hash bucket */
 struct hbucket {
-	struct rcu_head rcu;	/* for call_rcu_bh */
+	union {
+		struct rcu_head rcu;	/* for call_rcu_bh */
+		struct hbucket *next;	/* chain of the batched buckets */
+	};
 	/* Which positions are used in the array */
 	DECLARE_BITMAP(used, AHASH_MAX_TUNED);
+	/* Which positions were matched since the clock hand passed them */
+	DECLARE_BITMAP(ref, AHASH_MAX_TUNED);
 	u8 size;		/* size of the array */
 	u8 pos;			/* position of the first free entry */
+	u8 hand;		/* clock hand of the forceadd eviction */
+	u32 epoch;		/* dump epoch of the last change */
 	unsigned char value[]	/* the array of the values */
 		__aligned(__alignof__(u64));
 };
 
-/* Region size for locking == 2^HTABLE_REGION_BITS */
-#define HTABLE_REGION_BITS	10
-#define ahash_numof_locks(htable_bits)		\
-	((htable_bits) < HTABLE_REGION_BITS ? 1	\
-		: jhash_size((htable_bits) - HTABLE_REGION_BITS))
-#define ahash_sizeof_regions(htable_bits)		\
-	(ahash_numof_locks(htable_bits) * sizeof(struct ip_set_region))
-#define ahash_region(n, htable_bits)		\
-	((n) % ahash_numof_locks(htable_bits))
-#define ahash_bucket_start(h,  htable_bits)	\
-	((htable_bits) < HTABLE_REGION_BITS ? 0	\
-		: (h) * jhash_size(HTABLE_REGION_BITS))
-#define ahash_bucket_end(h,  htable_bits)	\
-	((htable_bits) < HTABLE_REGION_BITS ? jhash_size(htable_bits)	\
-		: ((h) + 1) * jhash_size(HTABLE_REGION_BITS))
+/* Multipliers of the multiply-shift hash: the common part of the hash
+ * structure must not depend on the family, the key words of the largest
+ * element plus the increment
+ */
+#define HKEY_MUL_MAX		16
+
+/* Region size for locking == 2^region_bits of the table */
+#define HTABLE_REGION_BITS	10	/* default */
+#define HTABLE_REGION_BITS_MIN	4
+#define HTABLE_REGION_BITS_MAX	16
+#define ahash_numof_locks(t)				\
+	((t)->htable_bits < (t)->region_bits ? 1		\
+		: jhash_size((t)->htable_bits - (t)->region_bits))
+#define ahash_sizeof_regions(t)				\
+	(ahash_numof_locks(t) * sizeof(struct ip_set_region))
+#define ahash_region(n, t)				\
+	((t)->htable_bits < (t)->region_bits ? 0 : (n) >> (t)->region_bits)
+#define ahash_region_size(t)				\
+	((t)->htable_bits < (t)->region_bits ? jhash_size((t)->htable_bits) \
+		: jhash_size((t)->region_bits))
+#define ahash_bucket_start(h, t)			\
+	((t)->htable_bits < (t)->region_bits ? 0	\
+		: (h) * jhash_size((t)->region_bits))
+#define ahash_bucket_end(h, t)				\
+	((t)->htable_bits < (t)->region_bits ? jhash_size((t)->htable_bits) \
+		: ((h) + 1) * jhash_size((t)->region_bits))
+
+/* Region locking with contention statistics while they are enabled: the
+ * uncontended case costs a trylock and the clock reads for the hold time.
+ * A zero locked_at marks an acquisition without statistics.
+ */
+static inline void
+ahash_region_lock(struct ip_set_region *region)
+{
+	bool contended = false;
+	u64 start = 0;
+
+	if (!static_branch_unlikely(&ip_set_stats_key)) {
+		spin_lock_bh(&region->lock);
+		region->locked_at = 0;
+		return;
+	}
+	if (!spin_trylock_bh(&region->lock)) {
+		start = local_clock();
+		spin_lock_bh(&region->lock);
+		contended = true;
+	}
+	region->locked_at = local_clock();
+	u64_stats_update_begin(&region->syncp);
+	if (contended) {
+		region->contended++;
+		region->wait += region->locked_at - start;
+	}
+	region->acquired++;
+	u64_stats_update_end(&region->syncp);
+}
+
+static inline void
+ahash_region_unlock(struct ip_set_region *region)
+{
+	if (region->locked_at) {
+		u64_stats_update_begin(&region->syncp);
+		region->hold += local_clock() - region->locked_at;
+		u64_stats_update_end(&region->syncp);
+	}
+	spin_unlock_bh(&region->lock);
+}
+
+/* Read the lock statistics of a region, without the lock */
+static inline void
+ahash_region_stat(const struct ip_set_region *region, u64 *acquired,
+		  u64 *contended, u64 *wait, u64 *hold)
+{
+	unsigned int start;
+	u64 a, c, w, h;
+
+	do {
+		start = u64_stats_fetch_begin(&region->syncp);
+		a = region->acquired;
+		c = region->contended;
+		w = region->wait;
+		h = region->hold;
+	} while (u64_stats_fetch_retry(&region->syncp, start));
+	*acquired += a;
+	*contended += c;
+	*wait += w;
+	*hold += h;
+}
 
 struct htable_gc {
-	struct delayed_work dwork;
-	struct ip_set *set;	/* Set the gc belongs to */
-	u32 region;		/* Last gc run position */
+	struct ip_set_gc sched;	/* Run by the gc scheduler */
+	unsigned long slot_len;	/* Length of the expiry slots in jiffies */
+	unsigned long slot;	/* Last processed expiry slot */
+	unsigned long next;	/* Expiry slot of the next gc run */
+	u32 region;		/* Region to continue the slot with */
+};
+
+/* Expiry index of the elements for the garbage collector: the time is
+ * divided into slots of the gc period and for every one of the next
+ * HTABLE_EXPIRY_SLOTS slots a bitmap records which buckets contain
+ * elements to be expired when the slot is due. Elements expiring later
+ * are recorded in the farthest slot and are recorded again in their real
+ * slot when the bucket is visited. Deleted or re-added elements may leave
+ * stale bits behind, which just cause a superfluous visit of the bucket.
+ */
+#define HTABLE_EXPIRY_SLOTS	16
+
+/* Requests for the background resize */
+enum {
+	HTABLE_RESIZE_GROW,
+	HTABLE_RESIZE_SHRINK,
+	HTABLE_RESIZE_COMPACT,
+	HTABLE_RESIZE_RESEED,
+};
+
+/* The buckets of a region are compacted in the background when the
+ * deletions left free slots below the bucket positions in one bucket
+ * out of HTABLE_COMPACT_RATIO
+ */
+#define HTABLE_COMPACT_RATIO	8
+#define ahash_compact_holes(t)						\
+	max_t(u32, ahash_region_size(t) / HTABLE_COMPACT_RATIO,		\
+	      AHASH_INIT_SIZE)
+
+/* The chains of a region are skewed, most likely by hash flooding, when
+ * a full bucket is HTABLE_SKEW_RATIO times longer than the average chain
+ * of its region. Growing the table does not help then, the table is
+ * rehashed with new hash keys instead, at most once per
+ * HTABLE_RESEED_INTERVAL.
+ */
+#define HTABLE_SKEW_RATIO	8
+#define HTABLE_RESEED_INTERVAL	(10 * HZ)
+#define ahash_region_skewed(t, r, chain)				\
+	((u64)(chain) * ahash_region_size(t) >				\
+	 (u64)HTABLE_SKEW_RATIO * (t)->hregion[r].elements &&		\
+	 time_after(jiffies, (t)->seeded + HTABLE_RESEED_INTERVAL))
+
+struct htable_resize {
+	struct work_struct work;
+	struct ip_set *set;	/* Set the resize belongs to */
+	struct mutex lock;	/* Serializes resizing and flushing */
+	unsigned long flags;	/* Requested resize operations */
+	u8 htable_bits;		/* Table size the resize was requested for */
+	u8 min_bits;		/* Table size the set was created with */
+	u8 grow_bits;		/* Table size reserved for a range add */
+};
+
+/* Kernel side adds queued by the asynchronous mode of the SET target */
+struct htable_async {
+	struct work_struct work;
+	struct ip_set *set;	/* Set the queues belong to */
+	struct llist_head __percpu *queue; /* Allocated at the first use */
+	atomic_t pending;	/* Number of the queued elements */
+};
+
+/* The elements of a frozen set are packed into an array, indexed by a
+ * minimal perfect hash of the keys (hash and displace): the hash of the
+ * table selects a displacement, which together with a second hash of the
+ * key gives the slot. Buckets of a single key store the slot itself.
+ * A lookup reads the displacement and compares the key in the slot.
+ */
+#define FROZEN_BUCKET_KEYS	4		/* keys per displacement */
+#define FROZEN_DIRECT		(1U << 31)	/* displacement is the slot */
+#define FROZEN_TRIES		(1U << 20)	/* displacements per bucket */
+#define FROZEN_SEEDS		8		/* seeds tried at most */
+
+struct htable_frozen {
+	u32 size;		/* number of the elements and the slots */
+	u32 buckets;		/* number of the displacements */
+	u32 seed;		/* seed of the second hash of the keys */
+	u32 epoch;		/* latest dump epoch of the elements */
+	u32 dsize;		/* size of the elements */
+	u8 htable_bits;		/* size of the table when it was frozen */
+	unsigned char *value;	/* the packed elements */
+	u32 disp[];		/* the displacements */
 };
 
 /* The hash table: the table size stored here in order to make resizing easy */
@@ -106,14 +289,407 @@ struct htable {
 	atomic_t ref;		/* References for resizing */
 	atomic_t uref;		/* References for dumping and gc */
 	u8 htable_bits;		/* size of hash table == 2^htable_bits */
+	u8 region_bits;		/* size of lock regions == 2^region_bits */
+	u8 pages;		/* pages backing the table, IPSET_PAGES_* */
 	u32 maxelem;		/* Maxelem per region */
+	u32 initval;		/* random jhash init value */
+	union {
+		hsiphash_key_t sip;	/* hsiphash key */
+		u64 mul[HKEY_MUL_MAX];	/* multiply-shift */
+	} hkey;			/* random keys of the other hash functions */
+	unsigned long seeded;	/* when the keys were chosen, in jiffies */
 	struct ip_set_region *hregion;	/* Region locks and ext sizes */
+#ifdef IP_SET_HASH_WITH_BLOOM
+	unsigned long *bloom;	/* Bloom filter of the elements, if enabled */
+	atomic_t bloom_fill;	/* Number of bits set in the filter */
+#endif
+	unsigned long *expiry;	/* Expiry index of the buckets, if timeout */
+	unsigned long expiry_slots; /* Slots with recorded buckets */
+	struct list_head free;	/* queued to be freed in the background */
+	struct hbucket_cache *bcache; /* bucket caches held until freed */
+	struct htable_frozen __rcu *frozen; /* elements of a frozen set */
 	struct hbucket __rcu *bucket[]; /* hashtable buckets */
 };
 
+#define htable_expiry_longs(htable_bits)	\
+	BITS_TO_LONGS(jhash_size(htable_bits))
+#define htable_expiry_size(htable_bits)		\
+	(HTABLE_EXPIRY_SLOTS * htable_expiry_longs(htable_bits) *	\
+	 sizeof(unsigned long))
+#define htable_expiry_map(t, slot)		\
+	((t)->expiry + ((slot) % HTABLE_EXPIRY_SLOTS) *	\
+	 htable_expiry_longs((t)->htable_bits))
+
+/* Record the bucket of an element with the given expiry time in the
+ * expiry index. Returns the slot if the gc must be run earlier than
+ * scheduled, otherwise zero.
+ */
+static unsigned long
+htable_expiry_add(struct htable_gc *gc, struct htable *t, u32 key,
+		  unsigned long expires)
+{
+	unsigned long now, slot;
+
+	if (!t->expiry || expires == IPSET_ELEM_PERMANENT)
+		return 0;
+	now = jiffies / gc->slot_len;
+	/* The slot after the expiry, when the element is surely expired */
+	slot = expires / gc->slot_len + 1;
+	if ((long)(slot - now) < 1)
+		slot = now + 1;
+	else if (slot - now >= HTABLE_EXPIRY_SLOTS)
+		slot = now + HTABLE_EXPIRY_SLOTS - 1;
+	set_bit(key, htable_expiry_map(t, slot));
+	if (!test_bit(slot % HTABLE_EXPIRY_SLOTS, &t->expiry_slots))
+		set_bit(slot % HTABLE_EXPIRY_SLOTS, &t->expiry_slots);
+
+	return (long)(slot - READ_ONCE(gc->next)) < 0 ? slot : 0;
+}
+
 #define hbucket(h, i)		((h)->bucket[i])
-#define ext_size(n, dsize)	\
-	(sizeof(struct hbucket) + (n) * (dsize))
+
+/* Slab caches of the hash buckets: one cache for every bucket size,
+ * in steps of AHASH_INIT_SIZE. The caches are shared by the sets of
+ * the type with the same element size.
+ */
+#define AHASH_BUCKET_CACHES	(AHASH_MAX_TUNED / AHASH_INIT_SIZE)
+
+struct hbucket_cache {
+	struct list_head list;
+	size_t dsize;		/* element size of the buckets */
+	unsigned int ref;	/* number of sets using the caches */
+	struct kmem_cache *cache[AHASH_BUCKET_CACHES];
+};
+
+static LIST_HEAD(hbucket_caches);
+static DEFINE_MUTEX(hbucket_caches_lock);
+
+#define hbucket_cache(c, n)	((c)->cache[(n) / AHASH_INIT_SIZE - 1])
+/* Memory used by a bucket of n elements */
+#define hbucket_size(c, n)	kmem_cache_size(hbucket_cache(c, n))
+
+static struct hbucket_cache *
+hbucket_cache_get(const char *type, size_t dsize)
+{
+	struct hbucket_cache *c;
+	char name[64];
+	unsigned int i;
+
+	mutex_lock(&hbucket_caches_lock);
+	list_for_each_entry(c, &hbucket_caches, list) {
+		if (c->dsize == dsize) {
+			c->ref++;
+			goto out;
+		}
+	}
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		goto out;
+	for (i = 0; i < AHASH_BUCKET_CACHES; i++) {
+		snprintf(name, sizeof(name), "ipset_%s_%zu_%u",
+			 type, dsize, (i + 1) * AHASH_INIT_SIZE);
+		c->cache[i] = kmem_cache_create(name, sizeof(struct hbucket) +
+				(i + 1) * AHASH_INIT_SIZE * dsize,
+				__alignof__(struct hbucket), SLAB_ACCOUNT,
+				NULL);
+		if (!c->cache[i]) {
+			while (i--)
+				kmem_cache_destroy(c->cache[i]);
+			kfree(c);
+			c = NULL;
+			goto out;
+		}
+	}
+	c->dsize = dsize;
+	c->ref = 1;
+	list_add(&c->list, &hbucket_caches);
+out:
+	mutex_unlock(&hbucket_caches_lock);
+	return c;
+}
+
+static void
+hbucket_cache_hold(struct hbucket_cache *c)
+{
+	mutex_lock(&hbucket_caches_lock);
+	c->ref++;
+	mutex_unlock(&hbucket_caches_lock);
+}
+
+static void
+hbucket_cache_put(struct hbucket_cache *c)
+{
+	unsigned int i;
+
+	mutex_lock(&hbucket_caches_lock);
+	if (--c->ref)
+		goto out;
+	list_del(&c->list);
+	/* Wait for the buckets freed by RCU callbacks */
+	rcu_barrier();
+	for (i = 0; i < AHASH_BUCKET_CACHES; i++)
+		kmem_cache_destroy(c->cache[i]);
+	kfree(c);
+out:
+	mutex_unlock(&hbucket_caches_lock);
+}
+
+/* NUMA placement of the tables and the buckets: no policy, a given node
+ * or the buckets interleaved over the nodes. The bucket pointer arrays of
+ * interleaved sets follow the policy of the task.
+ */
+#define HTABLE_NUMA_INTERLEAVE	(-2)
+
+#define htable_node(numa)	\
+	((numa) == HTABLE_NUMA_INTERLEAVE ? NUMA_NO_NODE : (numa))
+
+/* The node of the bucket i */
+static inline int
+hbucket_node(int numa, u32 i)
+{
+	int node;
+
+	if (numa != HTABLE_NUMA_INTERLEAVE)
+		return numa;
+	node = i % nr_node_ids;
+	return node_online(node) ? node : NUMA_NO_NODE;
+}
+
+static inline struct hbucket *
+hbucket_alloc(const struct hbucket_cache *c, u8 size, int numa, u32 i)
+{
+	struct hbucket *n = kmem_cache_alloc_node(hbucket_cache(c, size),
+						  GFP_ATOMIC | __GFP_ZERO,
+						  hbucket_node(numa, i));
+
+	if (n)
+		n->size = size;
+	return n;
+}
+
+/* Account a size change of the buckets of a region to the memory budget
+ * of the namespace: growing fails when the budget is used up, unless
+ * forced.
+ */
+static inline bool
+ahash_ext_size_force(struct ip_set *set, struct htable *t, u32 r, long size,
+		     bool force)
+{
+	if (!ip_set_mem_charge(set, size, force))
+		return false;
+	t->hregion[r].ext_size += size;
+	return true;
+}
+
+static inline bool
+ahash_ext_size(struct ip_set *set, struct htable *t, u32 r, long size)
+{
+	return ahash_ext_size_force(set, t, r, size, false);
+}
+
+/* Mark the bucket as changed in the current dump epoch: the counters of
+ * matched elements are updated on every packet, so write it once only.
+ */
+static inline void
+hbucket_mark(struct hbucket *n, u32 epoch)
+{
+	if (READ_ONCE(n->epoch) != epoch)
+		WRITE_ONCE(n->epoch, epoch);
+}
+
+/* Set the access bit of a matched element of a forceadd set: the bit is
+ * written once only between two passes of the clock hand.
+ */
+static inline void
+hbucket_touch(struct hbucket *n, u8 i)
+{
+	if (!test_bit(i, n->ref))
+		set_bit(i, n->ref);
+}
+
+/* Second chance eviction: the hand skips and clears the elements matched
+ * since it passed them last time, so that hot elements are not thrown out
+ * by a flood of new ones. The bucket is full and locked.
+ */
+static u8
+hbucket_clock(struct hbucket *n)
+{
+	u8 i;
+	int k;
+
+	if (n->hand >= n->pos)
+		n->hand = 0;
+	for (k = 0; k < n->pos; k++) {
+		i = n->hand;
+		n->hand = i + 1 < n->pos ? i + 1 : 0;
+		if (!test_and_clear_bit(i, n->ref))
+			return i;
+	}
+	/* All of them were matched: evict the one under the hand */
+	i = n->hand;
+	n->hand = i + 1 < n->pos ? i + 1 : 0;
+	return i;
+}
+
+/* kfree() can free the objects of any slab cache */
+static void
+hbucket_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct hbucket, rcu));
+}
+
+/* Buckets superseded while a userspace ADT batch is processed and the
+ * memory of the freed buckets which waits for a grace period
+ */
+struct hbucket_batch {
+	struct task_struct *task;	/* the task processing the batch */
+	struct hbucket *list;		/* buckets waiting for reclaim */
+	size_t size;			/* memory of the batched buckets */
+	atomic_long_t pending;		/* bytes waiting for a grace period */
+	long pending_gp;		/* bytes of the tracked grace period */
+	unsigned long busy;		/* a grace period is tracked */
+	struct rcu_head rcu;		/* tracks the grace periods */
+};
+
+/* One grace period shared by all buckets of a batch */
+struct hbucket_reclaim {
+	struct rcu_head rcu;
+	struct hbucket *list;
+};
+
+static void
+hbucket_free_list(struct hbucket *n)
+{
+	struct hbucket *next;
+
+	for (; n; n = next) {
+		next = n->next;
+		kfree(n);
+	}
+}
+
+static void
+hbucket_reclaim_rcu(struct rcu_head *head)
+{
+	struct hbucket_reclaim *r =
+		container_of(head, struct hbucket_reclaim, rcu);
+
+	hbucket_free_list(r->list);
+	kfree(r);
+}
+
+/* The freed bytes are accounted as pending until a grace period, started
+ * after they were queued, elapses. A single grace period is tracked at a
+ * time and it is restarted as long as there are pending bytes left.
+ */
+static void
+hbucket_pending_rcu(struct rcu_head *head)
+{
+	struct hbucket_batch *b = container_of(head, struct hbucket_batch, rcu);
+	long bytes = atomic_long_sub_return(b->pending_gp, &b->pending);
+
+	if (bytes <= 0) {
+		clear_bit(0, &b->busy);
+		smp_mb__after_atomic();
+		/* Bytes queued while the bit was still set */
+		bytes = atomic_long_read(&b->pending);
+		if (bytes <= 0 || test_and_set_bit(0, &b->busy))
+			return;
+	}
+	b->pending_gp = bytes;
+	call_rcu(&b->rcu, hbucket_pending_rcu);
+}
+
+static void
+hbucket_pending_add(struct hbucket_batch *b, size_t size)
+{
+	atomic_long_add(size, &b->pending);
+	if (test_and_set_bit(0, &b->busy))
+		return;
+	b->pending_gp = atomic_long_read(&b->pending);
+	call_rcu(&b->rcu, hbucket_pending_rcu);
+}
+
+/* Wait for the tracking of the grace periods before freeing the batch */
+static void
+hbucket_pending_wait(struct hbucket_batch *b)
+{
+	while (test_bit(0, &b->busy))
+		rcu_barrier();
+}
+
+/* Not kfree_rcu(): the callbacks must be waited for by rcu_barrier().
+ * Only the task processing the batch queues the buckets, anything else
+ * (packet path, gc, background resize) frees them one by one.
+ */
+static void
+hbucket_free_deferred(struct hbucket_batch *b, const struct hbucket_cache *c,
+		      struct hbucket *n)
+{
+	if (READ_ONCE(b->task) == current && !in_serving_softirq()) {
+		n->next = b->list;
+		b->list = n;
+		b->size += hbucket_size(c, n->size);
+	} else {
+		hbucket_pending_add(b, hbucket_size(c, n->size));
+		call_rcu(&n->rcu, hbucket_free_rcu);
+	}
+}
+
+static void
+hbucket_batch(struct hbucket_batch *b, bool start)
+{
+	struct hbucket_reclaim *r;
+	struct hbucket *n;
+
+	if (start) {
+		WRITE_ONCE(b->task, current);
+		return;
+	}
+	WRITE_ONCE(b->task, NULL);
+	n = b->list;
+	if (!n)
+		return;
+	b->list = NULL;
+	hbucket_pending_add(b, b->size);
+	b->size = 0;
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (!r) {
+		synchronize_rcu();
+		hbucket_free_list(n);
+		return;
+	}
+	r->list = n;
+	call_rcu(&r->rcu, hbucket_reclaim_rcu);
+}
+
+/* Preallocated buckets are not shrunk below their allocated size */
+#define hbucket_min_size(set, h)	\
+	(SET_WITH_PREALLOC(set) ? AHASH_MAX(h) : 0)
+
+/* Allocate all buckets of a table with room for size elements */
+static int
+htable_prealloc(struct htable *t, const struct hbucket_cache *c, u8 size,
+		int numa)
+{
+	struct hbucket *n;
+	u32 i, r;
+
+	for (i = 0; i < jhash_size(t->htable_bits); i++) {
+		n = kmem_cache_alloc_node(hbucket_cache(c, size),
+					  GFP_KERNEL | __GFP_ZERO,
+					  hbucket_node(numa, i));
+		if (!n)
+			return -ENOMEM;
+		n->size = size;
+		r = ahash_region(i, t);
+		t->hregion[r].ext_size += hbucket_size(c, size);
+		RCU_INIT_POINTER(hbucket(t, i), n);
+		if (!(i % jhash_size(t->region_bits)))
+			cond_resched();
+	}
+	return 0;
+}
 
 #ifndef IPSET_NET_COUNT
 #define IPSET_NET_COUNT		1
@@ -125,63 +701,696 @@ struct net_prefixes {
 	u8 cidr[IPSET_NET_COUNT];  /* the cidr value */
 };
 
-/* Compute the hash table size */
+/* Compute the hash table size */
+static size_t
+htable_size(u8 hbits)
+{
+	size_t hsize;
+
+	/* We must fit both into u32 in jhash and size_t */
+	if (hbits > 31)
+		return 0;
+	hsize = jhash_size(hbits);
+	if ((((size_t)-1) - sizeof(struct htable)) / sizeof(struct hbucket *)
+	    < hsize)
+		return 0;
+
+	return hsize * sizeof(struct hbucket *) + sizeof(struct htable);
+}
+
+/* Shrink the table when there are less elements than buckets / ratio */
+#define HTABLE_SHRINK_RATIO	8
+
+/* Compute the size a sparsely populated table can be shrunk to */
+static u8
+htable_shrink_bits(const struct htable *t, u8 min_bits)
+{
+	u32 r, elements = 0;
+	u8 hbits = t->htable_bits;
+
+	for (r = 0; r < ahash_numof_locks(t); r++)
+		elements += t->hregion[r].elements;
+	if (elements >= jhash_size(hbits) / HTABLE_SHRINK_RATIO)
+		return hbits;
+	/* Leave room to grow before the table needs to be resized again */
+	while (hbits > min_bits && jhash_size(hbits - 1) >= 2 * elements)
+		hbits--;
+	return hbits;
+}
+
+#ifdef IP_SET_HASH_WITH_BLOOM
+/* Blocked Bloom filter: all bits of an element are in the same cache line,
+ * the block is selected by the upper bits of the hash of the element.
+ * The filter is sized to the hash table, 16 bits per bucket. Deleted
+ * elements cannot be removed from it, so it is rebuilt at resizing.
+ */
+#define BLOOM_BLOCK_BITS	512
+#define BLOOM_BLOCK_SHIFT	5
+#define BLOOM_K			3
+
+static size_t
+htable_bloom_size(u8 hbits)
+{
+	u32 blocks = hbits > BLOOM_BLOCK_SHIFT ?
+		     jhash_size(hbits - BLOOM_BLOCK_SHIFT) : 1;
+
+	return (size_t)blocks * (BLOOM_BLOCK_BITS / BITS_PER_BYTE);
+}
+
+static unsigned long *
+htable_bloom_block(const struct htable *t, u32 hash)
+{
+	u32 b = t->htable_bits > BLOOM_BLOCK_SHIFT ?
+		hash >> (32 - (t->htable_bits - BLOOM_BLOCK_SHIFT)) : 0;
+
+	return t->bloom + b * (BLOOM_BLOCK_BITS / BITS_PER_LONG);
+}
+
+static void
+htable_bloom_add(struct htable *t, u32 hash)
+{
+	unsigned long *block = htable_bloom_block(t, hash);
+	u32 i, bit, h2 = jhash_1word(hash, 0);
+
+	for (i = 0; i < BLOOM_K; i++, h2 >>= 9) {
+		bit = h2 % BLOOM_BLOCK_BITS;
+		if (!test_bit(bit, block) && !test_and_set_bit(bit, block))
+			atomic_inc(&t->bloom_fill);
+	}
+}
+
+static bool
+htable_bloom_test(const struct htable *t, u32 hash)
+{
+	const unsigned long *block = htable_bloom_block(t, hash);
+	u32 i, h2 = jhash_1word(hash, 0);
+
+	for (i = 0; i < BLOOM_K; i++, h2 >>= 9)
+		if (!test_bit(h2 % BLOOM_BLOCK_BITS, block))
+			return false;
+	return true;
+}
+
+/* Estimated false positive rate in parts per million */
+static u32
+htable_bloom_fpr(const struct htable *t)
+{
+	u64 fill = (u64)atomic_read(&t->bloom_fill) * 1000000;
+
+	fill = div64_u64(fill, htable_bloom_size(t->htable_bits) *
+			       BITS_PER_BYTE);
+	return div_u64(div_u64(fill * fill, 1000000) * fill, 1000000);
+}
+
+/* More than one eighth of the bits is set (the size of the filter in
+ * bytes) and most of them belong to deleted or expired elements
+ */
+static bool
+htable_bloom_stale(const struct htable *t)
+{
+	u32 r, elements = 0, fill = atomic_read(&t->bloom_fill);
+
+	if (!t->bloom)
+		return false;
+	for (r = 0; r < ahash_numof_locks(t); r++)
+		elements += t->hregion[r].elements;
+	return fill > htable_bloom_size(t->htable_bits) &&
+	       fill > 2 * BLOOM_K * elements;
+}
+#else
+#define htable_bloom_stale(t)	false
+#endif
+
+#ifdef IP_SET_HASH_WITH_NETS
+#if IPSET_NET_COUNT > 1
+#define __CIDR(cidr, i)		(cidr[i])
+#else
+#define __CIDR(cidr, i)		(cidr)
+#endif
+
+/* cidr + 1 is stored in net_prefixes to support /0 */
+#define NCIDR_PUT(cidr)		((cidr) + 1)
+#define NCIDR_GET(cidr)		((cidr) - 1)
+
+#ifdef IP_SET_HASH_WITH_NETS_PACKED
+/* When cidr is packed with nomatch, cidr - 1 is stored in the data entry */
+#define DCIDR_PUT(cidr)		((cidr) - 1)
+#define DCIDR_GET(cidr, i)	(__CIDR(cidr, i) + 1)
+#else
+#define DCIDR_PUT(cidr)		(cidr)
+#define DCIDR_GET(cidr, i)	__CIDR(cidr, i)
+#endif
+
+#define INIT_CIDR(cidr, host_mask)	\
+	DCIDR_PUT(((cidr) ? NCIDR_GET(cidr) : host_mask))
+
+#ifdef IP_SET_HASH_WITH_NET0
+/* cidr from 0 to HOST_MASK value and c = cidr + 1 */
+#define NLEN			(HOST_MASK + 1)
+#define CIDR_POS(c)		((c) - 1)
+#else
+/* cidr from 1 to HOST_MASK value and c = cidr + 1 */
+#define NLEN			HOST_MASK
+#define CIDR_POS(c)		((c) - 2)
+#endif
+
+#else
+#define NLEN			0
+#endif /* IP_SET_HASH_WITH_NETS */
+
+#define SET_ELEM_EXPIRED(set, d)	\
+	(SET_WITH_TIMEOUT(set) &&	\
+	 ip_set_timeout_expired(ext_timeout(d, set)))
+
+#ifdef IP_SET_HASH_WITH_LPM
+/* Longest prefix match index of the stored networks.
+ *
+ * It is a path compressed binary trie of the network prefixes, maintained
+ * together with the net_prefixes book-keeping under the set lock. A walk
+ * from the root with a host address returns the prefix lengths which have
+ * got a stored network containing the address, so only those need to be
+ * looked up in the hash instead of all the different prefix lengths.
+ * Types with two network parts keep a trie for each part, and only the
+ * combinations of the returned prefix lengths are looked up.
+ * Readers walk the trie under RCU.
+ */
+struct lpm_node {
+	struct lpm_node __rcu *child[2];
+	struct rcu_head rcu;
+	union nf_inet_addr key;	/* network address, masked to plen */
+	u32 count;		/* number of elements with this network */
+	u8 plen;		/* prefix length */
+};
+
+struct lpm_trie {
+	struct lpm_node __rcu *root;
+	u32 nodes;		/* number of nodes in the trie */
+	bool broken;		/* node allocation failed, trie is unusable */
+};
+
+/* Bit of the address at the given position, counted from the MSB */
+static inline u8
+lpm_bit(const __be32 *addr, u8 pos)
+{
+	return (ntohl(addr[pos / 32]) >> (31 - pos % 32)) & 1;
+}
+
+/* Length of the common prefix of two addresses, at most len bits */
+static inline u8
+lpm_common(const __be32 *a, const __be32 *b, u8 len)
+{
+	u32 x;
+	u8 i, n;
+
+	for (i = 0, n = 0; n < len; i++, n += 32) {
+		x = ntohl(a[i] ^ b[i]);
+		if (x)
+			return min_t(u8, n + 32 - fls(x), len);
+	}
+	return len;
+}
+
+/* Fill out the prefix lengths of the stored networks which contain
+ * the address, in increasing order. Returns the number of the lengths.
+ */
+static int
+lpm_lookup(const struct lpm_trie *trie, const __be32 *addr, u8 maxlen,
+	   u8 *plens)
+{
+	const struct lpm_node *n = rcu_dereference_bh(trie->root);
+	int i = 0;
+
+	while (n && lpm_common(addr, n->key.ip6, n->plen) == n->plen) {
+		if (n->count)
+			plens[i++] = n->plen;
+		if (n->plen == maxlen)
+			break;
+		n = rcu_dereference_bh(n->child[lpm_bit(addr, n->plen)]);
+	}
+	return i;
+}
+
+static struct lpm_node *
+lpm_node_alloc(struct lpm_trie *trie, const __be32 *addr, u8 plen, u8 maxlen)
+{
+	struct lpm_node *n;
+	u8 i;
+
+	n = kzalloc(sizeof(*n), GFP_ATOMIC);
+	if (!n)
+		return NULL;
+	for (i = 0; i < maxlen / 32; i++)
+		n->key.ip6[i] = addr[i] & ip_set_netmask6(plen)[i];
+	n->plen = plen;
+	trie->nodes++;
+
+	return n;
+}
+
+/* Register a network in the trie. Called with the set lock held. */
+static void
+lpm_add(struct lpm_trie *trie, const __be32 *addr, u8 plen, u8 maxlen)
+{
+	struct lpm_node __rcu **pp = &trie->root;
+	struct lpm_node *n, *leaf, *fork;
+	u8 c = 0;
+
+	if (trie->broken)
+		return;
+	while ((n = __ipset_dereference(*pp)) != NULL) {
+		c = lpm_common(addr, n->key.ip6, min(plen, n->plen));
+		if (c < n->plen)
+			break;
+		/* n contains the network */
+		if (n->plen == plen) {
+			n->count++;
+			return;
+		}
+		pp = &n->child[lpm_bit(addr, n->plen)];
+	}
+	leaf = lpm_node_alloc(trie, addr, plen, maxlen);
+	if (!leaf)
+		goto broken;
+	leaf->count = 1;
+	if (!n) {
+		rcu_assign_pointer(*pp, leaf);
+		return;
+	}
+	if (c == plen) {
+		/* The network contains n */
+		RCU_INIT_POINTER(leaf->child[lpm_bit(n->key.ip6, plen)], n);
+		rcu_assign_pointer(*pp, leaf);
+		return;
+	}
+	/* Fork at the first differing bit */
+	fork = lpm_node_alloc(trie, addr, c, maxlen);
+	if (!fork) {
+		kfree(leaf);
+		trie->nodes--;
+		goto broken;
+	}
+	RCU_INIT_POINTER(fork->child[lpm_bit(addr, c)], leaf);
+	RCU_INIT_POINTER(fork->child[lpm_bit(n->key.ip6, c)], n);
+	rcu_assign_pointer(*pp, fork);
+	return;
+
+broken:
+	/* Readers fall back to probing all prefix lengths */
+	WRITE_ONCE(trie->broken, true);
+}
+
+/* Remaining child of a node with at most one child */
+#define lpm_single_child(n)			\
+	(rcu_access_pointer((n)->child[0]) ?	\
+	 __ipset_dereference((n)->child[0]) :	\
+	 __ipset_dereference((n)->child[1]))
+
+/* Unregister a network from the trie. Called with the set lock held. */
+static void
+lpm_del(struct lpm_trie *trie, const __be32 *addr, u8 plen)
+{
+	struct lpm_node __rcu **pp = &trie->root, **ppp = NULL;
+	struct lpm_node *n, *parent = NULL, *child;
+
+	if (trie->broken)
+		return;
+	while ((n = __ipset_dereference(*pp)) != NULL) {
+		if (n->plen > plen ||
+		    lpm_common(addr, n->key.ip6, n->plen) < n->plen)
+			return;
+		if (n->plen == plen)
+			break;
+		ppp = pp;
+		parent = n;
+		pp = &n->child[lpm_bit(addr, n->plen)];
+	}
+	if (!n || --n->count)
+		return;
+	/* Keep the node as a fork */
+	if (rcu_access_pointer(n->child[0]) &&
+	    rcu_access_pointer(n->child[1]))
+		return;
+	child = lpm_single_child(n);
+	rcu_assign_pointer(*pp, child);
+	kfree_rcu(n, rcu);
+	trie->nodes--;
+	/* A fork left with a single branch is removed as well */
+	if (child || !parent || parent->count)
+		return;
+	rcu_assign_pointer(*ppp, lpm_single_child(parent));
+	kfree_rcu(parent, rcu);
+	trie->nodes--;
+}
+
+/* Free a detached trie, by rotating the left branches to the right */
+static void
+lpm_free(struct lpm_node *n)
+{
+	struct lpm_node *tmp;
+
+	while (n) {
+		tmp = __ipset_dereference(n->child[0]);
+		if (tmp) {
+			RCU_INIT_POINTER(n->child[0], tmp->child[1]);
+			RCU_INIT_POINTER(tmp->child[1], n);
+		} else {
+			tmp = __ipset_dereference(n->child[1]);
+			kfree(n);
+		}
+		n = tmp;
+	}
+}
+
+static void
+lpm_free_rcu(struct rcu_head *head)
+{
+	lpm_free(container_of(head, struct lpm_node, rcu));
+}
+
+/* Empty the trie. Called with the set lock held. */
+static void
+lpm_flush(struct lpm_trie *trie)
+{
+	struct lpm_node *root = __ipset_dereference(trie->root);
+
+	RCU_INIT_POINTER(trie->root, NULL);
+	trie->nodes = 0;
+	WRITE_ONCE(trie->broken, false);
+	/* Readers may still walk the old trie */
+	if (root)
+		call_rcu(&root->rcu, lpm_free_rcu);
+}
+
+static inline bool
+lpm_broken(const struct lpm_trie *lpm, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (READ_ONCE(lpm[i].broken))
+			return true;
+	return false;
+}
+#endif /* IP_SET_HASH_WITH_LPM */
+
+/* The tables of huge sets are freed in the background at destroy and
+ * flush, so that the netlink commands are not blocked meanwhile.
+ */
+#define HTABLE_FREE_ASYNC_BITS	16	/* from 64k buckets */
+#define HTABLE_FREE_CHUNK	4096	/* buckets freed between reschedules */
+
+static void htable_free_work_fn(struct work_struct *work);
+
+static LIST_HEAD(htable_free_list);
+static DEFINE_SPINLOCK(htable_free_lock);
+static DECLARE_WORK(htable_free_work, htable_free_work_fn);
+
+static void
+htable_free(struct htable *t)
+{
+#ifdef IP_SET_HASH_WITH_BLOOM
+	ip_set_free(t->bloom);
+#endif
+	ip_set_free(t->expiry);
+	ip_set_free(t->hregion);
+	ip_set_free(t);
+}
+
+static void
+htable_free_work_fn(struct work_struct *work)
+{
+	struct htable *t, *tmp;
+	LIST_HEAD(list);
+	u32 i;
+
+	spin_lock(&htable_free_lock);
+	list_splice_init(&htable_free_list, &list);
+	spin_unlock(&htable_free_lock);
+	/* The flushed tables may still be walked by the readers */
+	synchronize_rcu();
+	list_for_each_entry_safe(t, tmp, &list, free) {
+		for (i = 0; i < jhash_size(t->htable_bits); i++) {
+			kfree(__ipset_dereference(hbucket(t, i)));
+			if (!((i + 1) % HTABLE_FREE_CHUNK))
+				cond_resched();
+		}
+		hbucket_cache_put(t->bcache);
+		htable_free(t);
+	}
+}
+
+/* Queue a detached table with a reference to the bucket caches,
+ * dropped when the buckets are freed.
+ */
+static void
+htable_free_async(struct htable *t, struct hbucket_cache *c)
+{
+	t->bcache = c;
+	spin_lock(&htable_free_lock);
+	list_add_tail(&t->free, &htable_free_list);
+	spin_unlock(&htable_free_lock);
+	queue_work(system_unbound_wq, &htable_free_work);
+}
+
+/* Called at module exit, after the sets are destroyed */
+static void
+htable_free_wait(void)
+{
+	flush_work(&htable_free_work);
+}
+
+/* Choose new random hash keys for the table */
+static void
+htable_seed(struct htable *t)
+{
+	get_random_bytes(&t->initval, sizeof(t->initval));
+	get_random_bytes(&t->hkey, sizeof(t->hkey));
+	t->seeded = jiffies;
+}
+
+/* Keep the hash keys of orig, when the elements are rehashed unchanged */
+static void
+htable_seed_copy(struct htable *t, const struct htable *orig)
+{
+	t->initval = orig->initval;
+	t->hkey = orig->hkey;
+	t->seeded = orig->seeded;
+}
+
+/* Allocate an empty table of the given size, with the keys and the
+ * indices of orig
+ */
+static struct htable *
+htable_alloc_bits(const struct htable *orig, u8 htable_bits, int numa)
+{
+	struct htable *t;
+	u8 pages = IPSET_PAGES_SMALL;
+	u32 i;
+
+	if (!htable_size(htable_bits))
+		return NULL;
+	t = ip_set_alloc_huge(htable_size(htable_bits),
+			      htable_node(numa), &pages);
+	if (!t)
+		return NULL;
+	t->pages = pages;
+	t->htable_bits = htable_bits;
+	t->region_bits = orig->region_bits;
+	t->maxelem = orig->maxelem;
+	htable_seed_copy(t, orig);
+	t->hregion = ip_set_alloc_node(ahash_sizeof_regions(t),
+				       htable_node(numa));
+	if (!t->hregion)
+		goto free;
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (orig->bloom) {
+		t->bloom = ip_set_alloc_node(htable_bloom_size(t->htable_bits),
+					     htable_node(numa));
+		if (!t->bloom)
+			goto free;
+	}
+#endif
+	if (orig->expiry) {
+		t->expiry = ip_set_alloc_node(
+				htable_expiry_size(t->htable_bits),
+				htable_node(numa));
+		if (!t->expiry)
+			goto free;
+	}
+	for (i = 0; i < ahash_numof_locks(t); i++) {
+		spin_lock_init(&t->hregion[i].lock);
+		u64_stats_init(&t->hregion[i].syncp);
+	}
+	return t;
+
+free:
+	htable_free(t);
+	return NULL;
+}
+
+/* Allocate an empty table of the same size and indices as orig */
+static struct htable *
+htable_alloc_like(const struct htable *orig, int numa)
+{
+	return htable_alloc_bits(orig, orig->htable_bits, numa);
+}
+
+/* Memory of the frozen elements and of their displacements */
 static size_t
-htable_size(u8 hbits)
+htable_frozen_size(const struct htable_frozen *f)
 {
-	size_t hsize;
-
-	/* We must fit both into u32 in jhash and size_t */
-	if (hbits > 31)
-		return 0;
-	hsize = jhash_size(hbits);
-	if ((((size_t)-1) - sizeof(struct htable)) / sizeof(struct hbucket *)
-	    < hsize)
-		return 0;
+	return ALIGN(sizeof(*f) + f->buckets * sizeof(u32),
+		     __alignof__(u64)) + (size_t)f->size * f->dsize;
+}
 
-	return hsize * sizeof(struct hbucket *) + sizeof(struct htable);
+static struct htable_frozen *
+htable_frozen_alloc(u32 size, size_t dsize, u8 htable_bits)
+{
+	struct htable_frozen tmp = {
+		.size = size,
+		.buckets = max_t(u32, size / FROZEN_BUCKET_KEYS, 1),
+		.dsize = dsize,
+	};
+	struct htable_frozen *f;
+
+	f = ip_set_alloc(htable_frozen_size(&tmp));
+	if (!f)
+		return NULL;
+	f->size = tmp.size;
+	f->buckets = tmp.buckets;
+	f->dsize = tmp.dsize;
+	f->htable_bits = htable_bits;
+	f->value = (unsigned char *)f +
+		   ALIGN(sizeof(*f) + f->buckets * sizeof(u32),
+			 __alignof__(u64));
+	return f;
 }
 
-#ifdef IP_SET_HASH_WITH_NETS
-#if IPSET_NET_COUNT > 1
-#define __CIDR(cidr, i)		(cidr[i])
-#else
-#define __CIDR(cidr, i)		(cidr)
-#endif
+/* The slot of a key by the hash of the table and by the second hash */
+static inline u32
+htable_frozen_slot(const struct htable_frozen *f, u32 hash, u32 hash2)
+{
+	u32 d = f->disp[reciprocal_scale(hash, f->buckets)];
 
-/* cidr + 1 is stored in net_prefixes to support /0 */
-#define NCIDR_PUT(cidr)		((cidr) + 1)
-#define NCIDR_GET(cidr)		((cidr) - 1)
+	if (d & FROZEN_DIRECT)
+		return d & ~FROZEN_DIRECT;
+	return reciprocal_scale(jhash_1word(hash2, d), f->size);
+}
 
-#ifdef IP_SET_HASH_WITH_NETS_PACKED
-/* When cidr is packed with nomatch, cidr - 1 is stored in the data entry */
-#define DCIDR_PUT(cidr)		((cidr) - 1)
-#define DCIDR_GET(cidr, i)	(__CIDR(cidr, i) + 1)
-#else
-#define DCIDR_PUT(cidr)		(cidr)
-#define DCIDR_GET(cidr, i)	__CIDR(cidr, i)
-#endif
+/* Compute the displacements from the hashes of the keys and store the
+ * slot of every key in slot[]. The buckets are placed from the largest
+ * one: the displacements are tried until all keys of the bucket land in
+ * free slots. The single keys get the remaining slots directly. -EAGAIN
+ * means the second hash has to be seeded again.
+ */
+static int
+htable_frozen_build(struct htable_frozen *f, const u32 *hash,
+		    const u32 *hash2, u32 *slot)
+{
+	u32 n = f->size, nb = f->buckets;
+	u32 *start, *member, *order, *sizes = NULL;
+	unsigned long *taken;
+	u32 i, j, k, b, c, d, s, largest = 0, free = 0;
+	int ret = -ENOMEM;
+
+	start = ip_set_alloc((nb + 1) * sizeof(u32));
+	member = ip_set_alloc(max_t(u32, n, 1) * sizeof(u32));
+	order = ip_set_alloc(nb * sizeof(u32));
+	taken = ip_set_alloc(BITS_TO_LONGS(max_t(u32, n, 1)) *
+			     sizeof(unsigned long));
+	if (!start || !member || !order || !taken)
+		goto out;
 
-#define INIT_CIDR(cidr, host_mask)	\
-	DCIDR_PUT(((cidr) ? NCIDR_GET(cidr) : host_mask))
+	/* The keys are grouped by buckets */
+	for (i = 0; i < n; i++)
+		start[reciprocal_scale(hash[i], nb) + 1]++;
+	for (b = 0; b < nb; b++) {
+		largest = max(largest, start[b + 1]);
+		start[b + 1] += start[b];
+		order[b] = start[b];
+	}
+	for (i = 0; i < n; i++)
+		member[order[reciprocal_scale(hash[i], nb)]++] = i;
 
-#ifdef IP_SET_HASH_WITH_NET0
-/* cidr from 0 to HOST_MASK value and c = cidr + 1 */
-#define NLEN			(HOST_MASK + 1)
-#define CIDR_POS(c)		((c) - 1)
-#else
-/* cidr from 1 to HOST_MASK value and c = cidr + 1 */
-#define NLEN			HOST_MASK
-#define CIDR_POS(c)		((c) - 2)
-#endif
+	/* Then the buckets are ordered by decreasing size */
+	sizes = ip_set_alloc((largest + 1) * sizeof(u32));
+	if (!sizes)
+		goto out;
+	for (b = 0; b < nb; b++)
+		sizes[start[b + 1] - start[b]]++;
+	for (c = largest, k = 0; c > 0; c--) {
+		j = sizes[c];
+		sizes[c] = k;
+		k += j;
+	}
+	for (b = 0; b < nb; b++) {
+		c = start[b + 1] - start[b];
+		if (c)
+			order[sizes[c]++] = b;
+	}
 
-#else
-#define NLEN			0
-#endif /* IP_SET_HASH_WITH_NETS */
+	ret = 0;
+	for (i = 0; i < k; i++) {
+		b = order[i];
+		c = start[b + 1] - start[b];
+		if (c == 1) {
+			free = find_next_zero_bit(taken, n, free);
+			__set_bit(free, taken);
+			slot[member[start[b]]] = free;
+			f->disp[b] = FROZEN_DIRECT | free;
+			continue;
+		}
+		for (d = 0; d < FROZEN_TRIES; d++) {
+			for (j = 0; j < c; j++) {
+				s = reciprocal_scale(
+					jhash_1word(hash2[member[start[b] + j]],
+						    d), n);
+				if (test_bit(s, taken))
+					break;
+				__set_bit(s, taken);
+				slot[member[start[b] + j]] = s;
+			}
+			if (j == c)
+				break;
+			while (j--)
+				__clear_bit(slot[member[start[b] + j]], taken);
+		}
+		if (d == FROZEN_TRIES) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		f->disp[b] = d;
+		if (!(i % 1024))
+			cond_resched();
+	}
+out:
+	ip_set_free(sizes);
+	ip_set_free(taken);
+	ip_set_free(order);
+	ip_set_free(member);
+	ip_set_free(start);
+	return ret;
+}
 
-#define SET_ELEM_EXPIRED(set, d)	\
-	(SET_WITH_TIMEOUT(set) &&	\
-	 ip_set_timeout_expired(ext_timeout(d, set)))
+/* Memory of a table charged to the budget: the arrays and the buckets */
+static long
+htable_charge(const struct htable *t)
+{
+	long size = htable_size(t->htable_bits) + ahash_sizeof_regions(t);
+	u32 r;
+
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (t->bloom)
+		size += htable_bloom_size(t->htable_bits);
+#endif
+	if (t->expiry)
+		size += htable_expiry_size(t->htable_bits);
+	for (r = 0; r < ahash_numof_locks(t); r++)
+		size += t->hregion[r].ext_size;
+	if (rcu_access_pointer(t->frozen))
+		size += htable_frozen_size(__ipset_dereference(t->frozen));
+	return size;
+}
 
 #endif /* _IP_SET_HASH_GEN_H */
 
@@ -200,6 +1409,7 @@ htable_size(u8 hbits)
 /* Family dependent templates */
 
 #undef ahash_data
+#undef ahash_frozen
 #undef mtype_data_equal
 #undef mtype_do_data_match
 #undef mtype_data_set_flags
@@ -208,6 +1418,8 @@ htable_size(u8 hbits)
 #undef mtype_data_netmask
 #undef mtype_data_list
 #undef mtype_data_next
+#undef mtype_data_lpm_addr
+#undef mtype_data_scan
 #undef mtype_elem
 
 #undef mtype_ahash_destroy
@@ -220,22 +1432,64 @@ htable_size(u8 hbits)
 #undef mtype_same_set
 #undef mtype_kadt
 #undef mtype_uadt
+#undef mtype_uadt_packed
 
 #undef mtype_add
 #undef mtype_del
 #undef mtype_test_cidrs
+#undef mtype_test_lpm
+#undef mtype_test_scan
 #undef mtype_test
+#undef mtype_test_bulk
+#undef mtype_test_lean
+#undef mtype_bulk_key
 #undef mtype_uref
+#undef mtype_batch
+#undef mtype_prefixes
+#undef mtype_clone
 #undef mtype_resize
+#undef mtype_reserve
+#undef mtype_rehash
 #undef mtype_ext_size
 #undef mtype_resize_ad
+#undef mtype_lookupstat
 #undef mtype_head
 #undef mtype_list
+#undef mtype_list_reset
+#undef mtype_top
+#undef mtype_notify_del
+#undef mtype_bucket_compact
+#undef mtype_gc_bucket
 #undef mtype_gc_do
+#undef mtype_gc_slot
+#undef mtype_gc_kick
 #undef mtype_gc
 #undef mtype_gc_init
+#undef mtype_purge_bucket
+#undef mtype_purge
+#undef mtype_compact
+#undef mtype_resize_work
+#undef mtype_resize_init
+#undef mtype_async_ad
+#undef mtype_async_drop
+#undef mtype_async_work
+#undef mtype_async_init
+#undef mtype_present
+#undef mtype_add_async
+#undef mtype_txn_flags
 #undef mtype_variant
+#undef mtype_lean_variant
 #undef mtype_data_match
+#undef mtype_hkey
+#undef mtype_rehash_elem
+#undef mtype_frozen_hash
+#undef mtype_frozen_find
+#undef mtype_frozen_match
+#undef mtype_frozen_test
+#undef mtype_frozen_free
+#undef mtype_freeze_table
+#undef mtype_thaw_table
+#undef mtype_freeze
 
 #undef htype
 #undef HKEY
@@ -252,6 +1506,8 @@ htable_size(u8 hbits)
 #define mtype_data_netmask	IPSET_TOKEN(MTYPE, _data_netmask)
 #define mtype_data_list		IPSET_TOKEN(MTYPE, _data_list)
 #define mtype_data_next		IPSET_TOKEN(MTYPE, _data_next)
+#define mtype_data_lpm_addr	IPSET_TOKEN(MTYPE, _data_lpm_addr)
+#define mtype_data_scan		IPSET_TOKEN(MTYPE, _data_scan)
 #define mtype_elem		IPSET_TOKEN(MTYPE, _elem)
 
 #define mtype_ahash_destroy	IPSET_TOKEN(MTYPE, _ahash_destroy)
@@ -264,22 +1520,64 @@ htable_size(u8 hbits)
 #define mtype_same_set		IPSET_TOKEN(MTYPE, _same_set)
 #define mtype_kadt		IPSET_TOKEN(MTYPE, _kadt)
 #define mtype_uadt		IPSET_TOKEN(MTYPE, _uadt)
+#define mtype_uadt_packed	IPSET_TOKEN(MTYPE, _uadt_packed)
 
 #define mtype_add		IPSET_TOKEN(MTYPE, _add)
 #define mtype_del		IPSET_TOKEN(MTYPE, _del)
 #define mtype_test_cidrs	IPSET_TOKEN(MTYPE, _test_cidrs)
+#define mtype_test_lpm		IPSET_TOKEN(MTYPE, _test_lpm)
+#define mtype_test_scan		IPSET_TOKEN(MTYPE, _test_scan)
 #define mtype_test		IPSET_TOKEN(MTYPE, _test)
+#define mtype_test_bulk		IPSET_TOKEN(MTYPE, _test_bulk)
+#define mtype_test_lean		IPSET_TOKEN(MTYPE, _test_lean)
+#define mtype_bulk_key		IPSET_TOKEN(MTYPE, _bulk_key)
 #define mtype_uref		IPSET_TOKEN(MTYPE, _uref)
+#define mtype_batch		IPSET_TOKEN(MTYPE, _batch)
+#define mtype_prefixes		IPSET_TOKEN(MTYPE, _prefixes)
+#define mtype_clone		IPSET_TOKEN(MTYPE, _clone)
 #define mtype_resize		IPSET_TOKEN(MTYPE, _resize)
+#define mtype_reserve		IPSET_TOKEN(MTYPE, _reserve)
+#define mtype_rehash		IPSET_TOKEN(MTYPE, _rehash)
 #define mtype_ext_size		IPSET_TOKEN(MTYPE, _ext_size)
 #define mtype_resize_ad		IPSET_TOKEN(MTYPE, _resize_ad)
+#define mtype_lookupstat	IPSET_TOKEN(MTYPE, _lookupstat)
 #define mtype_head		IPSET_TOKEN(MTYPE, _head)
 #define mtype_list		IPSET_TOKEN(MTYPE, _list)
+#define mtype_list_reset	IPSET_TOKEN(MTYPE, _list_reset)
+#define mtype_top		IPSET_TOKEN(MTYPE, _top)
+#define mtype_notify_del	IPSET_TOKEN(MTYPE, _notify_del)
+#define mtype_bucket_compact	IPSET_TOKEN(MTYPE, _bucket_compact)
+#define mtype_gc_bucket		IPSET_TOKEN(MTYPE, _gc_bucket)
 #define mtype_gc_do		IPSET_TOKEN(MTYPE, _gc_do)
+#define mtype_gc_slot		IPSET_TOKEN(MTYPE, _gc_slot)
+#define mtype_gc_kick		IPSET_TOKEN(MTYPE, _gc_kick)
 #define mtype_gc		IPSET_TOKEN(MTYPE, _gc)
 #define mtype_gc_init		IPSET_TOKEN(MTYPE, _gc_init)
+#define mtype_purge_bucket	IPSET_TOKEN(MTYPE, _purge_bucket)
+#define mtype_purge		IPSET_TOKEN(MTYPE, _purge)
+#define mtype_compact		IPSET_TOKEN(MTYPE, _compact)
+#define mtype_resize_work	IPSET_TOKEN(MTYPE, _resize_work)
+#define mtype_resize_init	IPSET_TOKEN(MTYPE, _resize_init)
+#define mtype_async_ad		IPSET_TOKEN(MTYPE, _async_ad)
+#define mtype_async_drop	IPSET_TOKEN(MTYPE, _async_drop)
+#define mtype_async_work	IPSET_TOKEN(MTYPE, _async_work)
+#define mtype_async_init	IPSET_TOKEN(MTYPE, _async_init)
+#define mtype_present		IPSET_TOKEN(MTYPE, _present)
+#define mtype_add_async		IPSET_TOKEN(MTYPE, _add_async)
+#define mtype_txn_flags		IPSET_TOKEN(MTYPE, _txn_flags)
 #define mtype_variant		IPSET_TOKEN(MTYPE, _variant)
+#define mtype_lean_variant	IPSET_TOKEN(MTYPE, _lean_variant)
 #define mtype_data_match	IPSET_TOKEN(MTYPE, _data_match)
+#define mtype_hkey		IPSET_TOKEN(MTYPE, _hkey)
+#define mtype_rehash_elem	IPSET_TOKEN(MTYPE, _rehash_elem)
+#define mtype_frozen_hash	IPSET_TOKEN(MTYPE, _frozen_hash)
+#define mtype_frozen_find	IPSET_TOKEN(MTYPE, _frozen_find)
+#define mtype_frozen_match	IPSET_TOKEN(MTYPE, _frozen_match)
+#define mtype_frozen_test	IPSET_TOKEN(MTYPE, _frozen_test)
+#define mtype_frozen_free	IPSET_TOKEN(MTYPE, _frozen_free)
+#define mtype_freeze_table	IPSET_TOKEN(MTYPE, _freeze_table)
+#define mtype_thaw_table	IPSET_TOKEN(MTYPE, _thaw_table)
+#define mtype_freeze		IPSET_TOKEN(MTYPE, _freeze)
 
 #ifndef HKEY_DATALEN
 #define HKEY_DATALEN		sizeof(struct mtype_elem)
@@ -287,26 +1585,30 @@ htable_size(u8 hbits)
 
 #define htype			MTYPE
 
-#define HKEY(data, initval, htable_bits)			\
-({								\
-	const u32 *__k = (const u32 *)data;			\
-	u32 __l = HKEY_DATALEN / sizeof(u32);			\
-								\
-	BUILD_BUG_ON(HKEY_DATALEN % sizeof(u32) != 0);		\
-								\
-	jhash2(__k, __l, initval) & jhash_mask(htable_bits);	\
-})
+#define HKEY_HASH(data, h, t)					\
+	mtype_hkey(h, t, (const u32 *)(data))
+
+#define HKEY(data, h, t)					\
+	(HKEY_HASH(data, h, t) & jhash_mask((t)->htable_bits))
 
 /* The generic hash structure */
 struct htype {
 	struct htable __rcu *table; /* the hash table */
 	struct htable_gc gc;	/* gc workqueue */
+	struct htable_resize resize; /* background resize */
+	struct htable_async async; /* queued kernel side adds */
 	u32 maxelem;		/* max elements in the hash */
-	u32 initval;		/* random jhash init value */
+	u8 hashfn;		/* hash function of the keys */
+	bool frozen;		/* the elements cannot be changed */
+	atomic_t epoch;		/* dump epoch, bumped by change listings */
+	struct ip_set_lookupstat __percpu *lstat; /* lookup statistics */
 #ifdef IP_SET_HASH_WITH_MARKMASK
 	u32 markmask;		/* markmask value for mark mask to store */
 #endif
 	u8 bucketsize;		/* max elements in an array block */
+	struct hbucket_cache *bcache; /* slab caches of the buckets */
+	struct hbucket_batch batch; /* buckets freed at the end of a batch */
+	int numa;		/* NUMA placement of the table */
 #ifdef IP_SET_HASH_WITH_NETMASK
 	u8 netmask;		/* netmask value for subnets to store */
 #endif
@@ -315,6 +1617,9 @@ struct htype {
 #ifdef IP_SET_HASH_WITH_NETS
 	struct net_prefixes nets[NLEN]; /* book-keeping of prefixes */
 #endif
+#ifdef IP_SET_HASH_WITH_LPM
+	struct lpm_trie lpm[IPSET_NET_COUNT]; /* longest prefix match indices */
+#endif
 };
 
 /* ADD|DEL entries saved during resize */
@@ -327,16 +1632,75 @@ struct mtype_resize_ad {
 	u32 flags;		/* Flags for ADD */
 };
 
+/* ADD entries queued by the asynchronous mode of the SET target */
+struct mtype_async_ad {
+	struct llist_node node;
+	struct mtype_elem d;	/* Element value */
+	struct ip_set_ext ext;	/* Extensions for ADD */
+	struct ip_set_ext mext;	/* Target extensions for ADD */
+	u32 flags;		/* Flags for ADD */
+};
+
+/* Compute the hash of the key part of an element, with the keys of
+ * the table
+ */
+static inline u32
+mtype_hkey(const struct htype *h, const struct htable *t, const u32 *k)
+{
+	u64 v;
+	u32 i;
+
+	BUILD_BUG_ON(HKEY_DATALEN % sizeof(u32) != 0);
+	BUILD_BUG_ON(HKEY_DATALEN / sizeof(u32) >= HKEY_MUL_MAX);
+
+	/* The single word keys, like the MAC addresses of hash:mac, are
+	 * hashed by the fixed length functions
+	 */
+	if (HKEY_DATALEN == sizeof(u64)) {
+		switch (h->hashfn) {
+		case IPSET_HASHFN_HSIPHASH:
+			return hsiphash_2u32(k[0], k[1], &t->hkey.sip);
+		case IPSET_HASHFN_MULSHIFT:
+			v = t->hkey.mul[2] + t->hkey.mul[0] * k[0] +
+			    t->hkey.mul[1] * k[1];
+			return v >> 32;
+		default:
+			return jhash_2words(k[0], k[1], t->initval);
+		}
+	}
+
+	switch (h->hashfn) {
+	case IPSET_HASHFN_HSIPHASH:
+		return hsiphash(k, HKEY_DATALEN, &t->hkey.sip);
+	case IPSET_HASHFN_MULSHIFT:
+		/* Strongly universal for 32 bits words in 64 bits arithmetic,
+		 * the key words are the multipliers and the increment.
+		 */
+		v = t->hkey.mul[HKEY_DATALEN / sizeof(u32)];
+		for (i = 0; i < HKEY_DATALEN / sizeof(u32); i++)
+			v += t->hkey.mul[i] * k[i];
+		return v >> 32;
+	default:
+		return jhash2(k, HKEY_DATALEN / sizeof(u32), t->initval);
+	}
+}
+
 #ifdef IP_SET_HASH_WITH_NETS
 /* Network cidr size book keeping when the hash stores different
  * sized networks. cidr == real cidr + 1 to support /0.
  */
 static void
-mtype_add_cidr(struct ip_set *set, struct htype *h, u8 cidr, u8 n)
+mtype_add_cidr(struct ip_set *set, struct htype *h,
+	       const struct mtype_elem *d, u8 cidr, u8 n)
 {
 	int i, j;
 
 	spin_lock_bh(&set->lock);
+#ifdef IP_SET_HASH_WITH_LPM
+	if (SET_WITH_LPM(set))
+		lpm_add(&h->lpm[n], mtype_data_lpm_addr(d, n),
+			NCIDR_GET(cidr), HOST_MASK);
+#endif
 	/* Add in increasing prefix order, so larger cidr first */
 	for (i = 0, j = -1; i < NLEN && h->nets[i].cidr[n]; i++) {
 		if (j != -1) {
@@ -359,11 +1723,17 @@ unlock:
 }
 
 static void
-mtype_del_cidr(struct ip_set *set, struct htype *h, u8 cidr, u8 n)
+mtype_del_cidr(struct ip_set *set, struct htype *h,
+	       const struct mtype_elem *d, u8 cidr, u8 n)
 {
 	u8 i, j, net_end = NLEN - 1;
 
 	spin_lock_bh(&set->lock);
+#ifdef IP_SET_HASH_WITH_LPM
+	if (SET_WITH_LPM(set))
+		lpm_del(&h->lpm[n], mtype_data_lpm_addr(d, n),
+			NCIDR_GET(cidr));
+#endif
 	for (i = 0; i < NLEN; i++) {
 		if (h->nets[i].cidr[n] != cidr)
 			continue;
@@ -384,13 +1754,36 @@ unlock:
 static size_t
 mtype_ahash_memsize(const struct htype *h, const struct htable *t)
 {
-	return sizeof(*h) + sizeof(*t) + ahash_sizeof_regions(t->htable_bits);
+	size_t memsize = sizeof(*h) + htable_size(t->htable_bits) +
+			 ahash_sizeof_regions(t) +
+			 num_possible_cpus() * sizeof(struct ip_set_lookupstat);
+	const struct htable_frozen *f = rcu_dereference_bh(t->frozen);
+
+	if (t->expiry)
+		memsize += htable_expiry_size(t->htable_bits);
+	if (f)
+		memsize += htable_frozen_size(f);
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (t->bloom)
+		memsize += htable_bloom_size(t->htable_bits);
+#endif
+#ifdef IP_SET_HASH_WITH_LPM
+	int i;
+
+	for (i = 0; i < IPSET_NET_COUNT; i++)
+		memsize += READ_ONCE(h->lpm[i].nodes) * sizeof(struct lpm_node);
+#endif
+	return memsize;
 }
 
 /* Get the ith element from the array block n */
 #define ahash_data(n, i, dsize)	\
 	((struct mtype_elem *)((n)->value + ((i) * (dsize))))
 
+/* Get the element in slot i of the frozen elements f */
+#define ahash_frozen(f, i, dsize)	\
+	((struct mtype_elem *)((f)->value + (size_t)(i) * (dsize)))
+
 static void
 mtype_ext_cleanup(struct ip_set *set, struct hbucket *n)
 {
@@ -401,36 +1794,168 @@ mtype_ext_cleanup(struct ip_set *set, struct hbucket *n)
 			ip_set_ext_destroy(set, ahash_data(n, i, set->dsize));
 }
 
+/* Free the frozen elements, with their extensions unless the elements
+ * were moved back into buckets
+ */
+static void
+mtype_frozen_free(struct ip_set *set, struct htable_frozen *f,
+		  bool ext_destroy)
+{
+	u32 i;
+
+	if (set->extensions & IPSET_EXT_DESTROY && ext_destroy)
+		for (i = 0; i < f->size; i++)
+			ip_set_ext_destroy(set,
+					   ahash_frozen(f, i, set->dsize));
+	ip_set_free(f);
+}
+
+/* The hashes of the key of a stored element of the frozen set f */
+static void
+mtype_frozen_hash(const struct htype *h, const struct htable *t,
+		  const struct htable_frozen *f, const struct mtype_elem *data,
+		  u32 *hash, u32 *hash2)
+{
+#ifdef IP_SET_HASH_WITH_NETS
+	struct mtype_elem tmp = *data;
+	u8 flags = 0;
+
+	/* The flags are stored in the key */
+	mtype_data_reset_flags(&tmp, &flags);
+	data = &tmp;
+#endif
+	*hash = HKEY_HASH(data, h, t);
+	*hash2 = jhash2((const u32 *)data, HKEY_DATALEN / sizeof(u32),
+			f->seed);
+}
+
+/* Drop the queued asynchronous adds */
+static void
+mtype_async_drop(struct htable_async *a)
+{
+	struct llist_head __percpu *queue = READ_ONCE(a->queue);
+	struct mtype_async_ad *x, *tmp;
+	struct llist_node *list;
+	int cpu;
+
+	if (!queue)
+		return;
+	for_each_possible_cpu(cpu) {
+		list = llist_del_all(per_cpu_ptr(queue, cpu));
+		llist_for_each_entry_safe(x, tmp, list, node) {
+			kfree(x);
+			atomic_dec(&a->pending);
+		}
+	}
+}
+
+static void
+mtype_ahash_destroy(struct ip_set *set, struct htable *t, bool ext_destroy);
+
 /* Flush a hash type of set: destroy all elements */
 static void
 mtype_flush(struct ip_set *set)
 {
 	struct htype *h = set->data;
-	struct htable *t;
+	struct htable *t, *nt;
+	struct htable_frozen *f;
 	struct hbucket *n;
 	u32 r, i;
 
+	/* Queued adds must not show up after the flush either */
+	mtype_async_drop(&h->async);
+	/* A background resize would resurrect the flushed elements */
+	mutex_lock(&h->resize.lock);
 	t = ipset_dereference_nfnl(h->table);
-	for (r = 0; r < ahash_numof_locks(t->htable_bits); r++) {
-		spin_lock_bh(&t->hregion[r].lock);
-		for (i = ahash_bucket_start(r, t->htable_bits);
-		     i < ahash_bucket_end(r, t->htable_bits); i++) {
+	f = __ipset_dereference(t->frozen);
+	if (f) {
+		/* The frozen elements go and the empty set is thawed, with a
+		 * table of the size before the freeze when possible
+		 */
+		nt = htable_alloc_bits(t, f->htable_bits, h->numa);
+		rcu_assign_pointer(t->frozen, NULL);
+		ip_set_mem_charge(set, -(long)htable_frozen_size(f), true);
+		if (nt) {
+			nt->maxelem = h->maxelem / ahash_numof_locks(nt);
+			atomic_set(&t->ref, 1);
+			atomic_inc(&t->uref);
+			rcu_assign_pointer(h->table, nt);
+			ip_set_mem_charge(set,
+					  htable_charge(nt) - htable_charge(t),
+					  true);
+		}
+		synchronize_rcu();
+		mtype_frozen_free(set, f, true);
+		WRITE_ONCE(h->frozen, false);
+		if (nt) {
+			if (atomic_dec_and_test(&t->uref))
+				mtype_ahash_destroy(set, t, false);
+			goto done;
+		}
+	}
+	if (!SET_WITH_PREALLOC(set) &&
+	    !(set->extensions & IPSET_EXT_DESTROY) &&
+	    t->htable_bits >= HTABLE_FREE_ASYNC_BITS &&
+	    (nt = htable_alloc_like(t, h->numa))) {
+		/* Replace the huge table by an empty one and free it in
+		 * the background, unless a dump or gc still uses it.
+		 */
+		atomic_set(&t->ref, 1);
+		atomic_inc(&t->uref);
+		rcu_assign_pointer(h->table, nt);
+		ip_set_mem_charge(set, htable_charge(nt) - htable_charge(t),
+				  true);
+		if (atomic_dec_and_test(&t->uref)) {
+			hbucket_cache_hold(h->bcache);
+			htable_free_async(t, h->bcache);
+		}
+		goto done;
+	}
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (t->bloom) {
+		memset(t->bloom, 0, htable_bloom_size(t->htable_bits));
+		atomic_set(&t->bloom_fill, 0);
+	}
+#endif
+	if (t->expiry) {
+		t->expiry_slots = 0;
+		memset(t->expiry, 0, htable_expiry_size(t->htable_bits));
+	}
+	for (r = 0; r < ahash_numof_locks(t); r++) {
+		ahash_region_lock(&t->hregion[r]);
+		for (i = ahash_bucket_start(r, t); i < ahash_bucket_end(r, t);
+		     i++) {
 			n = __ipset_dereference(hbucket(t, i));
 			if (!n)
 				continue;
 			if (set->extensions & IPSET_EXT_DESTROY)
 				mtype_ext_cleanup(set, n);
-			/* FIXME: use slab cache */
+			if (SET_WITH_PREALLOC(set)) {
+				/* Keep the bucket, just empty it */
+				bitmap_zero(n->used, AHASH_MAX_TUNED);
+				n->pos = 0;
+				continue;
+			}
 			rcu_assign_pointer(hbucket(t, i), NULL);
-			kfree_rcu(n, rcu);
+			hbucket_free_deferred(&h->batch, h->bcache, n);
 		}
-		t->hregion[r].ext_size = 0;
+		if (!SET_WITH_PREALLOC(set))
+			ahash_ext_size(set, t, r,
+				       -(long)t->hregion[r].ext_size);
 		t->hregion[r].elements = 0;
-		spin_unlock_bh(&t->hregion[r].lock);
+		ahash_region_unlock(&t->hregion[r]);
 	}
+done:
+	mutex_unlock(&h->resize.lock);
 #ifdef IP_SET_HASH_WITH_NETS
 	memset(h->nets, 0, sizeof(h->nets));
 #endif
+#ifdef IP_SET_HASH_WITH_LPM
+	spin_lock_bh(&set->lock);
+	for (i = 0; i < IPSET_NET_COUNT; i++)
+		lpm_flush(&h->lpm[i]);
+	spin_unlock_bh(&set->lock);
+#endif
 }
 
 /* Destroy the hashtable part of the set */
@@ -446,10 +1971,16 @@ mtype_ahash_destroy(struct ip_set *set, struct htable *t, bool ext_destroy)
 			continue;
 		if (set->extensions & IPSET_EXT_DESTROY && ext_destroy)
 			mtype_ext_cleanup(set, n);
-		/* FIXME: use slab cache */
 		kfree(n);
 	}
+	if (rcu_access_pointer(t->frozen))
+		mtype_frozen_free(set, __ipset_dereference(t->frozen),
+				  ext_destroy);
 
+#ifdef IP_SET_HASH_WITH_BLOOM
+	ip_set_free(t->bloom);
+#endif
+	ip_set_free(t->expiry);
 	ip_set_free(t->hregion);
 	ip_set_free(t);
 }
@@ -460,153 +1991,414 @@ mtype_destroy(struct ip_set *set)
 {
 	struct htype *h = set->data;
 	struct list_head *l, *lt;
+	struct htable *t;
+#ifdef IP_SET_HASH_WITH_LPM
+	int i;
+#endif
 
 	if (SET_WITH_TIMEOUT(set))
-		cancel_delayed_work_sync(&h->gc.dwork);
+		ip_set_gc_cancel(&h->gc.sched);
+	/* Queued adds may request a resize */
+	cancel_work_sync(&h->async.work);
+	mtype_async_drop(&h->async);
+	free_percpu(h->async.queue);
+	cancel_work_sync(&h->resize.work);
+	free_percpu(h->lstat);
 
-	mtype_ahash_destroy(set, ipset_dereference_nfnl(h->table), true);
+	t = ipset_dereference_nfnl(h->table);
+	if (!(set->extensions & IPSET_EXT_DESTROY) &&
+	    t->htable_bits >= HTABLE_FREE_ASYNC_BITS) {
+		/* The reference to the bucket caches goes with the table */
+		htable_free_async(t, h->bcache);
+		h->bcache = NULL;
+	} else {
+		mtype_ahash_destroy(set, t, true);
+	}
+#ifdef IP_SET_HASH_WITH_LPM
+	for (i = 0; i < IPSET_NET_COUNT; i++)
+		lpm_free(__ipset_dereference(h->lpm[i].root));
+#endif
 	list_for_each_safe(l, lt, &h->ad) {
 		list_del(l);
 		kfree(l);
 	}
-	kfree(h);
+	if (h->bcache)
+		hbucket_cache_put(h->bcache);
+	hbucket_pending_wait(&h->batch);
+	kfree(h);
+
+	set->data = NULL;
+}
+
+static bool
+mtype_same_set(const struct ip_set *a, const struct ip_set *b)
+{
+	const struct htype *x = a->data;
+	const struct htype *y = b->data;
+
+	/* Resizing changes htable_bits, so we ignore it */
+	return x->maxelem == y->maxelem &&
+	       a->timeout == b->timeout &&
+#ifdef IP_SET_HASH_WITH_NETMASK
+	       x->netmask == y->netmask &&
+#endif
+#ifdef IP_SET_HASH_WITH_MARKMASK
+	       x->markmask == y->markmask &&
+#endif
+	       a->extensions == b->extensions;
+}
+
+/* Report a deleted element to the listeners, expired or purged */
+static void
+mtype_notify_del(struct ip_set *set, const struct mtype_elem *data, u32 flags)
+{
+	struct sk_buff *skb;
+	struct nlattr *nested;
+
+	skb = ip_set_notify_start(set, IPSET_CMD_DEL, flags);
+	if (!skb)
+		return;
+	nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
+	if (!nested || mtype_data_list(skb, data)) {
+		kfree_skb(skb);
+		return;
+	}
+	ipset_nest_end(skb, nested);
+	ip_set_notify_end(set, skb);
+}
+
+/* Repack the elements of a bucket with free slots below its position
+ * into a new bucket of the smallest size, region lock must be held.
+ * The elements are copied, the lockless readers see the old bucket
+ * until the new one is published. Empty buckets are freed.
+ */
+static void
+mtype_bucket_compact(struct ip_set *set, struct htype *h, struct htable *t,
+		     u32 r, u32 i)
+{
+	struct hbucket *n, *tmp;
+	size_t dsize = set->dsize;
+	u32 j, d, size;
+
+	n = __ipset_dereference(hbucket(t, i));
+	if (!n)
+		return;
+	/* Free slots at the end are dropped in place */
+	while (n->pos && !test_bit(n->pos - 1, n->used))
+		n->pos--;
+	d = bitmap_weight(n->used, n->pos);
+	if (!d && !SET_WITH_PREALLOC(set)) {
+		ahash_ext_size(set, t, r,
+			       -(long)hbucket_size(h->bcache, n->size));
+		rcu_assign_pointer(hbucket(t, i), NULL);
+		hbucket_free_deferred(&h->batch, h->bcache, n);
+		return;
+	}
+	size = max_t(u32, roundup(d, AHASH_INIT_SIZE), AHASH_INIT_SIZE);
+	size = max_t(u32, size, hbucket_min_size(set, h));
+	if (size > n->size ||
+	    (size == n->size && n->pos - d < AHASH_INIT_SIZE))
+		return;
+
+	tmp = hbucket_alloc(h->bcache, size, h->numa, i);
+	if (!tmp)
+		return;
+	for (j = 0, d = 0; j < n->pos; j++) {
+		if (!test_bit(j, n->used))
+			continue;
+		memcpy(tmp->value + d * dsize, ahash_data(n, j, dsize), dsize);
+		set_bit(d, tmp->used);
+		d++;
+	}
+	tmp->pos = d;
+	tmp->epoch = n->epoch;
+	ahash_ext_size(set, t, r,
+		       (long)hbucket_size(h->bcache, tmp->size) -
+		       (long)hbucket_size(h->bcache, n->size));
+	rcu_assign_pointer(hbucket(t, i), tmp);
+	hbucket_free_deferred(&h->batch, h->bcache, n);
+}
+
+/* Expire the timed out elements of a bucket, region lock must be held */
+static void
+mtype_gc_bucket(struct ip_set *set, struct htype *h, struct htable *t,
+		u32 r, u32 i)
+{
+	struct hbucket *n;
+	struct mtype_elem *data;
+	u32 j, d;
+	size_t dsize = set->dsize;
+#ifdef IP_SET_HASH_WITH_NETS
+	u8 k;
+#endif
+
+	n = __ipset_dereference(hbucket(t, i));
+	if (!n)
+		return;
+	for (j = 0, d = 0; j < n->pos; j++) {
+		if (!test_bit(j, n->used)) {
+			d++;
+			continue;
+		}
+		data = ahash_data(n, j, dsize);
+		if (!ip_set_timeout_expired(ext_timeout(data, set))) {
+			/* Elements beyond the recorded slots */
+			htable_expiry_add(&h->gc, t, i,
+				ip_set_timeout_jiffies(ext_timeout(data, set)));
+			continue;
+		}
+		pr_debug("expired %u/%u\n", i, j);
+		mtype_notify_del(set, data, IPSET_FLAG_EXPIRED);
+		clear_bit(j, n->used);
+		smp_mb__after_atomic();
+#ifdef IP_SET_HASH_WITH_NETS
+		for (k = 0; k < IPSET_NET_COUNT; k++)
+			mtype_del_cidr(set, h, data,
+				NCIDR_PUT(DCIDR_GET(data->cidr, k)),
+				k);
+#endif
+		t->hregion[r].elements--;
+		ip_set_ext_destroy(set, data);
+		d++;
+	}
+	if (d)
+		mtype_bucket_compact(set, h, t, r, i);
+}
+
+/* Expire the timed out elements of a whole region and compact its buckets */
+static void
+mtype_gc_do(struct ip_set *set, struct htype *h, struct htable *t, u32 r)
+{
+	u64 start = ktime_get_ns();
+	u32 i, elements;
+
+	ahash_region_lock(&t->hregion[r]);
+	elements = t->hregion[r].elements;
+	for (i = ahash_bucket_start(r, t); i < ahash_bucket_end(r, t); i++)
+		mtype_gc_bucket(set, h, t, r, i);
+	/* Every bucket with free slots is compacted by the walk */
+	t->hregion[r].holes = 0;
+	elements -= t->hregion[r].elements;
+	ahash_region_unlock(&t->hregion[r]);
+	trace_ipset_gc(set, r, elements, start);
+}
+
+/* Expire the elements of the buckets of a region recorded in a slot */
+static void
+mtype_gc_slot(struct ip_set *set, struct htype *h, struct htable *t,
+	      u32 r, unsigned long slot)
+{
+	unsigned long *map = htable_expiry_map(t, slot);
+	u32 i, elements, end = ahash_bucket_end(r, t);
+	u64 start = ktime_get_ns();
+
+	ahash_region_lock(&t->hregion[r]);
+	elements = t->hregion[r].elements;
+	for (i = find_next_bit(map, end, ahash_bucket_start(r, t));
+	     i < end; i = find_next_bit(map, end, i + 1)) {
+		clear_bit(i, map);
+		mtype_gc_bucket(set, h, t, r, i);
+	}
+	elements -= t->hregion[r].elements;
+	ahash_region_unlock(&t->hregion[r]);
+	trace_ipset_gc(set, r, elements, start);
+}
+
+/* Run the gc earlier for a newly recorded slot */
+static void
+mtype_gc_kick(struct ip_set *set, struct htype *h, unsigned long slot)
+{
+	struct htable_gc *gc = &h->gc;
+
+	spin_lock_bh(&set->lock);
+	if ((long)(slot - gc->next) < 0) {
+		gc->next = slot;
+		ip_set_gc_schedule(&gc->sched, slot * gc->slot_len);
+	}
+	spin_unlock_bh(&set->lock);
+}
+
+static unsigned long
+mtype_gc(struct ip_set_gc *sched)
+{
+	struct htable_gc *gc = container_of(sched, struct htable_gc, sched);
+	struct ip_set *set = sched->set;
+	struct htype *h = set->data;
+	struct htable *t;
+	unsigned long now, slot, due;
+	bool expired = false;
+	u32 r;
+
+	spin_lock_bh(&set->lock);
+	t = ipset_dereference_set(h->table, set);
+	atomic_inc(&t->uref);
+	spin_unlock_bh(&set->lock);
+
+	/* Visit the buckets recorded in the due slots, at most a full round.
+	 * When the budget of the scheduler is used up, the slot is continued
+	 * with the next region at the next run.
+	 */
+	now = jiffies / gc->slot_len;
+	for (slot = gc->slot + 1;
+	     (long)(now - slot) >= 0 && slot - gc->slot <= HTABLE_EXPIRY_SLOTS;
+	     slot++) {
+		if (!test_and_clear_bit(slot % HTABLE_EXPIRY_SLOTS,
+					&t->expiry_slots) && !gc->region)
+			continue;
+		expired = true;
+		for (r = gc->region; r < ahash_numof_locks(t); r++) {
+			if (r > gc->region && ip_set_gc_yield(sched))
+				break;
+			mtype_gc_slot(set, h, t, r, slot);
+			cond_resched();
+		}
+		if (r < ahash_numof_locks(t)) {
+			gc->region = r;
+			break;
+		}
+		gc->region = 0;
+	}
+	if (gc->region) {
+		gc->slot = slot - 1;
+		due = jiffies;
+		goto out;
+	}
+	gc->slot = now;
 
-	set->data = NULL;
-}
+	/* Check whether the table can be shrunk after expiring elements */
+	if (expired && t->htable_bits > h->resize.min_bits) {
+		set_bit(HTABLE_RESIZE_SHRINK, &h->resize.flags);
+		queue_work(system_power_efficient_wq, &h->resize.work);
+	}
 
-static bool
-mtype_same_set(const struct ip_set *a, const struct ip_set *b)
-{
-	const struct htype *x = a->data;
-	const struct htype *y = b->data;
+	/* Schedule the next run by the first recorded slot, but wake up
+	 * at least once a full round.
+	 */
+	spin_lock_bh(&set->lock);
+	for (slot = now + 1; slot < now + HTABLE_EXPIRY_SLOTS; slot++) {
+		if (test_bit(slot % HTABLE_EXPIRY_SLOTS, &t->expiry_slots))
+			break;
+	}
+	gc->next = slot;
+	spin_unlock_bh(&set->lock);
+	due = slot * gc->slot_len;
 
-	/* Resizing changes htable_bits, so we ignore it */
-	return x->maxelem == y->maxelem &&
-	       a->timeout == b->timeout &&
-#ifdef IP_SET_HASH_WITH_NETMASK
-	       x->netmask == y->netmask &&
-#endif
-#ifdef IP_SET_HASH_WITH_MARKMASK
-	       x->markmask == y->markmask &&
-#endif
-	       a->extensions == b->extensions;
+out:
+	if (atomic_dec_and_test(&t->uref) && atomic_read(&t->ref)) {
+		pr_debug("Table destroy after resize by expire: %p\n", t);
+		mtype_ahash_destroy(set, t, false);
+	}
+	return due;
 }
 
-static void
-mtype_gc_do(struct ip_set *set, struct htype *h, struct htable *t, u32 r)
+/* Delete the elements of a bucket matching the purge condition, region
+ * lock must be held. The deletions are saved for a parallel resize.
+ */
+static u32
+mtype_purge_bucket(struct ip_set *set, struct htype *h, struct htable *t,
+		   u32 r, u32 i, const struct ip_set_purge *p,
+		   struct list_head *ad)
 {
-	struct hbucket *n, *tmp;
+	struct mtype_resize_ad *x;
+	struct hbucket *n;
 	struct mtype_elem *data;
-	u32 i, j, d;
+	u32 j, d, deleted = 0;
 	size_t dsize = set->dsize;
 #ifdef IP_SET_HASH_WITH_NETS
 	u8 k;
 #endif
-	u8 htable_bits = t->htable_bits;
 
-	spin_lock_bh(&t->hregion[r].lock);
-	for (i = ahash_bucket_start(r, htable_bits);
-	     i < ahash_bucket_end(r, htable_bits); i++) {
-		n = __ipset_dereference(hbucket(t, i));
-		if (!n)
-			continue;
-		for (j = 0, d = 0; j < n->pos; j++) {
-			if (!test_bit(j, n->used)) {
-				d++;
-				continue;
-			}
-			data = ahash_data(n, j, dsize);
-			if (!ip_set_timeout_expired(ext_timeout(data, set)))
-				continue;
-			pr_debug("expired %u/%u\n", i, j);
-			clear_bit(j, n->used);
-			smp_mb__after_atomic();
-#ifdef IP_SET_HASH_WITH_NETS
-			for (k = 0; k < IPSET_NET_COUNT; k++)
-				mtype_del_cidr(set, h,
-					NCIDR_PUT(DCIDR_GET(data->cidr, k)),
-					k);
-#endif
-			t->hregion[r].elements--;
-			ip_set_ext_destroy(set, data);
+	n = __ipset_dereference(hbucket(t, i));
+	if (!n)
+		return 0;
+	for (j = 0, d = 0; j < n->pos; j++) {
+		if (!test_bit(j, n->used)) {
 			d++;
+			continue;
 		}
-		if (d >= AHASH_INIT_SIZE) {
-			if (d >= n->size) {
-				t->hregion[r].ext_size -=
-					ext_size(n->size, dsize);
-				rcu_assign_pointer(hbucket(t, i), NULL);
-				kfree_rcu(n, rcu);
-				continue;
-			}
-			tmp = kzalloc(sizeof(*tmp) +
-				(n->size - AHASH_INIT_SIZE) * dsize,
-				GFP_ATOMIC);
-			if (!tmp)
-				/* Still try to delete expired elements. */
-				continue;
-			tmp->size = n->size - AHASH_INIT_SIZE;
-			for (j = 0, d = 0; j < n->pos; j++) {
-				if (!test_bit(j, n->used))
-					continue;
-				data = ahash_data(n, j, dsize);
-				memcpy(tmp->value + d * dsize,
-				       data, dsize);
-				set_bit(d, tmp->used);
-				d++;
+		data = ahash_data(n, j, dsize);
+		if (!ip_set_purge_match(set, data, p))
+			continue;
+		if (atomic_read(&t->ref)) {
+			x = kzalloc(sizeof(*x), GFP_ATOMIC);
+			if (x) {
+				x->ad = IPSET_DEL;
+				memcpy(&x->d, data, sizeof(struct mtype_elem));
+				list_add_tail(&x->list, ad);
 			}
-			tmp->pos = d;
-			t->hregion[r].ext_size -=
-				ext_size(AHASH_INIT_SIZE, dsize);
-			rcu_assign_pointer(hbucket(t, i), tmp);
-			kfree_rcu(n, rcu);
 		}
+		mtype_notify_del(set, data, 0);
+		clear_bit(j, n->used);
+		smp_mb__after_atomic();
+#ifdef IP_SET_HASH_WITH_NETS
+		for (k = 0; k < IPSET_NET_COUNT; k++)
+			mtype_del_cidr(set, h, data,
+				NCIDR_PUT(DCIDR_GET(data->cidr, k)),
+				k);
+#endif
+		t->hregion[r].elements--;
+		ip_set_ext_destroy(set, data);
+		deleted++;
+		d++;
 	}
-	spin_unlock_bh(&t->hregion[r].lock);
+	if (d)
+		mtype_bucket_compact(set, h, t, r, i);
+	return deleted;
 }
 
-static void
-mtype_gc(struct work_struct *work)
+/* Delete the elements matching the condition, region by region */
+static int
+mtype_purge(struct ip_set *set, const struct ip_set_purge *p)
 {
-	struct htable_gc *gc;
-	struct ip_set *set;
-	struct htype *h;
+	struct htype *h = set->data;
 	struct htable *t;
-	u32 r, numof_locks;
-	unsigned int next_run;
+	u32 i, r, deleted = 0;
+	LIST_HEAD(ad);
 
-	gc = container_of(work, struct htable_gc, dwork.work);
-	set = gc->set;
-	h = set->data;
+	if (READ_ONCE(h->frozen))
+		return -IPSET_ERR_FROZEN;
 
 	spin_lock_bh(&set->lock);
 	t = ipset_dereference_set(h->table, set);
 	atomic_inc(&t->uref);
-	numof_locks = ahash_numof_locks(t->htable_bits);
-	r = gc->region++;
-	if (r >= numof_locks) {
-		r = gc->region = 0;
-	}
-	next_run = (IPSET_GC_PERIOD(set->timeout) * HZ) / numof_locks;
-	if (next_run < HZ/10)
-		next_run = HZ/10;
 	spin_unlock_bh(&set->lock);
 
-	mtype_gc_do(set, h, t, r);
+	for (r = 0; r < ahash_numof_locks(t); r++) {
+		ahash_region_lock(&t->hregion[r]);
+		for (i = ahash_bucket_start(r, t); i < ahash_bucket_end(r, t);
+		     i++)
+			deleted += mtype_purge_bucket(set, h, t, r, i, p, &ad);
+		/* Every bucket with free slots is compacted by the walk */
+		t->hregion[r].holes = 0;
+		ahash_region_unlock(&t->hregion[r]);
+		cond_resched();
+	}
+	if (!list_empty(&ad)) {
+		spin_lock_bh(&set->lock);
+		list_splice_init(&ad, &h->ad);
+		spin_unlock_bh(&set->lock);
+	}
+	pr_debug("set %s: %u elements purged\n", set->name, deleted);
 
+	if (deleted && t->htable_bits > h->resize.min_bits) {
+		set_bit(HTABLE_RESIZE_SHRINK, &h->resize.flags);
+		queue_work(system_power_efficient_wq, &h->resize.work);
+	}
 	if (atomic_dec_and_test(&t->uref) && atomic_read(&t->ref)) {
-		pr_debug("Table destroy after resize by expire: %p\n", t);
+		pr_debug("Table destroy after resize by purge: %p\n", t);
 		mtype_ahash_destroy(set, t, false);
 	}
-
-	queue_delayed_work(system_power_efficient_wq, &gc->dwork, next_run);
+	return 0;
 }
 
 static void
-mtype_gc_init(struct htable_gc *gc)
+mtype_gc_init(struct ip_set *set, struct htable_gc *gc)
 {
-	INIT_DEFERRABLE_WORK(&gc->dwork, mtype_gc);
-	queue_delayed_work(system_power_efficient_wq, &gc->dwork, HZ);
+	ip_set_gc_init(set, &gc->sched, mtype_gc);
+	gc->slot_len = IPSET_GC_PERIOD(set->timeout) * HZ;
+	gc->slot = jiffies / gc->slot_len;
+	gc->next = gc->slot + HTABLE_EXPIRY_SLOTS;
+	ip_set_gc_schedule(&gc->sched, gc->next * gc->slot_len);
 }
 
 static int
@@ -616,16 +2408,69 @@ static int
 mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	  struct ip_set_ext *mext, u32 flags);
 
+/* Store a copy of the element in a table which is not visible yet: the
+ * bucket is allocated or grown as needed and returned in bucket. -EAGAIN
+ * means the bucket is full, the table has to be larger.
+ */
+static int
+mtype_rehash_elem(struct ip_set *set, struct htable *t,
+		  const struct mtype_elem *data, u32 hash,
+		  struct hbucket **bucket)
+{
+	struct htype *h = set->data;
+	size_t dsize = set->dsize;
+	u32 key = hash & jhash_mask(t->htable_bits);
+	u32 nr = ahash_region(key, t);
+	struct hbucket *m = __ipset_dereference(hbucket(t, key));
+
+	if (!m) {
+		m = hbucket_alloc(h->bcache, AHASH_INIT_SIZE, h->numa, key);
+		if (!m)
+			return -ENOMEM;
+		t->hregion[nr].ext_size += hbucket_size(h->bcache, m->size);
+		RCU_INIT_POINTER(hbucket(t, key), m);
+	} else if (m->pos >= m->size) {
+		struct hbucket *ht;
+
+		if (m->size >= AHASH_MAX(h))
+			return -EAGAIN;
+		ht = hbucket_alloc(h->bcache, m->size + AHASH_INIT_SIZE,
+				   h->numa, key);
+		if (!ht)
+			return -ENOMEM;
+		memcpy(ht, m, sizeof(struct hbucket) + m->size * dsize);
+		ht->size = m->size + AHASH_INIT_SIZE;
+		t->hregion[nr].ext_size += hbucket_size(h->bcache, ht->size) -
+					   hbucket_size(h->bcache, m->size);
+		kfree(m);
+		m = ht;
+		RCU_INIT_POINTER(hbucket(t, key), ht);
+	}
+	memcpy(ahash_data(m, m->pos, dsize), data, dsize);
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (t->bloom)
+		htable_bloom_add(t, hash);
+#endif
+	set_bit(m->pos++, m->used);
+	t->hregion[nr].elements++;
+	*bucket = m;
+	return 0;
+}
+
 /* Resize a hash: create a new hash table with doubling the hashsize
  * and inserting the elements to it. Repeat until we succeed or
- * fail due to memory pressures.
+ * fail due to memory pressures. When shrinking, start from the smallest
+ * size which can hold the elements and give up when a bucket would
+ * overflow at every size below the current one. A copy rebuilds the
+ * table at the current size. With reseed the new table gets new hash keys,
+ * otherwise the keys are kept.
  */
 static int
-mtype_resize(struct ip_set *set, bool retried)
+mtype_rehash(struct ip_set *set, bool shrink, bool copy, bool reseed)
 {
 	struct htype *h = set->data;
 	struct htable *t, *orig;
-	u8 htable_bits;
+	u8 htable_bits, pages = IPSET_PAGES_SMALL;
 	size_t hsize, dsize = set->dsize;
 #ifdef IP_SET_HASH_WITH_NETS
 	u8 flags;
@@ -636,7 +2481,11 @@ mtype_resize(struct ip_set *set, bool retried)
 	struct hbucket *n, *m;
 	struct list_head *l, *lt;
 	struct mtype_resize_ad *x;
-	u32 i, j, r, nr, key;
+	u32 i, j, r, hash;
+	u64 start = ktime_get_ns();
+	u8 old_bits;
+	bool rebuild = false, reserved = false;
+	LIST_HEAD(ad);
 	int ret;
 
 #ifdef IP_SET_HASH_WITH_NETS
@@ -644,46 +2493,143 @@ mtype_resize(struct ip_set *set, bool retried)
 	if (!tmp)
 		return -ENOMEM;
 #endif
-	orig = ipset_dereference_bh_nfnl(h->table);
+	mutex_lock(&h->resize.lock);
+	orig = ipset_dereference_resize(h->table, h);
 	htable_bits = orig->htable_bits;
+	old_bits = htable_bits;
+	/* The table of a frozen set is not rebuilt */
+	if (h->frozen) {
+		ret = -IPSET_ERR_FROZEN;
+		goto out;
+	}
+	if (shrink) {
+		u8 shrink_bits = htable_shrink_bits(orig, h->resize.min_bits);
+
+		/* Preallocated tables keep their size */
+		if (SET_WITH_PREALLOC(set))
+			shrink_bits = htable_bits;
+
+		/* A copy is made at the current size */
+		if (copy)
+			shrink_bits = htable_bits;
+		if (reseed) {
+			/* Reseeded while we were waiting for the lock */
+			if (time_before(jiffies,
+					orig->seeded + HTABLE_RESEED_INTERVAL)) {
+				ret = 0;
+				goto out;
+			}
+			shrink_bits = htable_bits;
+		}
+		/* A stale filter is rebuilt at the current size at least */
+		rebuild = copy || reseed || htable_bloom_stale(orig);
+		if (shrink_bits >= htable_bits && !rebuild) {
+			ret = 0;
+			goto out;
+		}
+		htable_bits = shrink_bits - 1;
+	} else if (htable_bits != READ_ONCE(h->resize.htable_bits)) {
+		/* Resized already while we were waiting for the lock */
+		ret = 0;
+		goto out;
+	} else {
+		u8 grow_bits = xchg(&h->resize.grow_bits, 0);
+
+		/* Grow to the reserved size at once */
+		if (grow_bits > htable_bits + 1) {
+			htable_bits = grow_bits - 1;
+			reserved = true;
+		}
+	}
 
 retry:
 	ret = 0;
 	htable_bits++;
+	if (shrink && htable_bits >= orig->htable_bits + rebuild)
+		/* Cannot shrink, keep the current table */
+		goto out;
 	if (!htable_bits)
 		goto hbwarn;
 	hsize = htable_size(htable_bits);
+	t = hsize ? ip_set_alloc_huge(hsize, htable_node(h->numa), &pages)
+		  : NULL;
+	if (!t && reserved) {
+		/* The reserved size is not available, grow by one step */
+		reserved = false;
+		htable_bits = old_bits;
+		goto retry;
+	}
 	if (!hsize)
 		goto hbwarn;
-	t = ip_set_alloc(hsize);
 	if (!t) {
 		ret = -ENOMEM;
 		goto out;
 	}
-	t->hregion = ip_set_alloc(ahash_sizeof_regions(htable_bits));
+	t->htable_bits = htable_bits;
+	t->region_bits = orig->region_bits;
+	t->pages = pages;
+	if (reseed)
+		htable_seed(t);
+	else
+		htable_seed_copy(t, orig);
+	t->hregion = ip_set_alloc_node(ahash_sizeof_regions(t),
+				       htable_node(h->numa));
 	if (!t->hregion) {
 		ip_set_free(t);
 		ret = -ENOMEM;
 		goto out;
 	}
-	t->htable_bits = htable_bits;
-	t->maxelem = h->maxelem / ahash_numof_locks(htable_bits);
-	for (i = 0; i < ahash_numof_locks(htable_bits); i++)
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (SET_WITH_BLOOM(set)) {
+		t->bloom = ip_set_alloc_node(htable_bloom_size(htable_bits),
+					     htable_node(h->numa));
+		if (!t->bloom) {
+			ip_set_free(t->hregion);
+			ip_set_free(t);
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+#endif
+	if (orig->expiry) {
+		t->expiry = ip_set_alloc_node(htable_expiry_size(htable_bits),
+					      htable_node(h->numa));
+		if (!t->expiry) {
+#ifdef IP_SET_HASH_WITH_BLOOM
+			ip_set_free(t->bloom);
+#endif
+			ip_set_free(t->hregion);
+			ip_set_free(t);
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	t->maxelem = h->maxelem / ahash_numof_locks(t);
+	for (i = 0; i < ahash_numof_locks(t); i++) {
 		spin_lock_init(&t->hregion[i].lock);
+		u64_stats_init(&t->hregion[i].syncp);
+	}
+	if (SET_WITH_PREALLOC(set) &&
+	    htable_prealloc(t, h->bcache, AHASH_MAX(h), h->numa)) {
+		mtype_ahash_destroy(set, t, false);
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	/* There can't be another parallel resizing,
-	 * but dumping, gc, kernel side add/del are possible
+	 * but dumping, gc, kernel side add/del are possible.
+	 * When resizing in the background, userspace add/del too.
 	 */
-	orig = ipset_dereference_bh_nfnl(h->table);
+	orig = ipset_dereference_resize(h->table, h);
 	atomic_set(&orig->ref, 1);
 	atomic_inc(&orig->uref);
 	pr_debug("attempt to resize set %s from %u to %u, t %p\n",
 		 set->name, orig->htable_bits, htable_bits, orig);
-	for (r = 0; r < ahash_numof_locks(orig->htable_bits); r++) {
+	for (r = 0; r < ahash_numof_locks(orig); r++) {
 		/* Expire may replace a hbucket with another one */
 		rcu_read_lock_bh();
-		for (i = ahash_bucket_start(r, orig->htable_bits);
-		     i < ahash_bucket_end(r, orig->htable_bits); i++) {
+		for (i = ahash_bucket_start(r, orig);
+		     i < ahash_bucket_end(r, orig); i++) {
 			n = __ipset_dereference(hbucket(orig, i));
 			if (!n)
 				continue;
@@ -702,75 +2648,47 @@ retry:
 				data = tmp;
 				mtype_data_reset_flags(data, &flags);
 #endif
-				key = HKEY(data, h->initval, htable_bits);
-				m = __ipset_dereference(hbucket(t, key));
-				nr = ahash_region(key, htable_bits);
-				if (!m) {
-					m = kzalloc(sizeof(*m) +
-					    AHASH_INIT_SIZE * dsize,
-					    GFP_ATOMIC);
-					if (!m) {
-						ret = -ENOMEM;
-						goto cleanup;
-					}
-					m->size = AHASH_INIT_SIZE;
-					t->hregion[nr].ext_size +=
-						ext_size(AHASH_INIT_SIZE,
-							 dsize);
-					RCU_INIT_POINTER(hbucket(t, key), m);
-				} else if (m->pos >= m->size) {
-					struct hbucket *ht;
-
-					if (m->size >= AHASH_MAX(h)) {
-						ret = -EAGAIN;
-					} else {
-						ht = kzalloc(sizeof(*ht) +
-						(m->size + AHASH_INIT_SIZE)
-						* dsize,
-						GFP_ATOMIC);
-						if (!ht)
-							ret = -ENOMEM;
-					}
-					if (ret < 0)
-						goto cleanup;
-					memcpy(ht, m, sizeof(struct hbucket) +
-					       m->size * dsize);
-					ht->size = m->size + AHASH_INIT_SIZE;
-					t->hregion[nr].ext_size +=
-						ext_size(AHASH_INIT_SIZE,
-							 dsize);
-					kfree(m);
-					m = ht;
-					RCU_INIT_POINTER(hbucket(t, key), ht);
-				}
-				d = ahash_data(m, m->pos, dsize);
-				memcpy(d, data, dsize);
-				set_bit(m->pos++, m->used);
-				t->hregion[nr].elements++;
+				hash = HKEY_HASH(data, h, t);
+				ret = mtype_rehash_elem(set, t, data, hash, &m);
+				if (ret < 0)
+					goto cleanup;
+				d = ahash_data(m, m->pos - 1, dsize);
+				if (SET_WITH_TIMEOUT(set))
+					htable_expiry_add(&h->gc, t,
+						hash & jhash_mask(htable_bits),
+						ip_set_timeout_jiffies(
+							ext_timeout(d, set)));
+				m->epoch = max(m->epoch, n->epoch);
 #ifdef IP_SET_HASH_WITH_NETS
 				mtype_data_reset_flags(d, &flags);
 #endif
 			}
 		}
 		rcu_read_unlock_bh();
+		cond_resched();
 	}
 
-	/* There can't be any other writer. */
+	/* There can't be any other resizing writer. */
 	rcu_assign_pointer(h->table, t);
+	ip_set_mem_charge(set, htable_charge(t) - htable_charge(orig), true);
 
 	/* Give time to other readers of the set */
 	synchronize_rcu();
 
 	pr_debug("set %s resized from %u (%p) to %u (%p)\n", set->name,
 		 orig->htable_bits, orig, t->htable_bits, t);
-	/* Add/delete elements processed by the SET target during resize.
-	 * Kernel-side add cannot trigger a resize and userspace actions
-	 * are serialized by the mutex.
+	/* Add/delete elements processed by the SET target or by userspace
+	 * commands during a background resize. The new table is not
+	 * referenced for resizing, so the replay cannot extend the list.
 	 */
-	list_for_each_safe(l, lt, &h->ad) {
+	spin_lock_bh(&set->lock);
+	list_splice_init(&h->ad, &ad);
+	spin_unlock_bh(&set->lock);
+	list_for_each_safe(l, lt, &ad) {
 		x = list_entry(l, struct mtype_resize_ad, list);
 		if (x->ad == IPSET_ADD) {
 			mtype_add(set, &x->d, &x->ext, &x->mext, x->flags);
+			kfree(x->ext.comment);
 		} else {
 			mtype_del(set, &x->d, NULL, NULL, 0);
 		}
@@ -784,6 +2702,10 @@ retry:
 	}
 
 out:
+	trace_ipset_resize(set, old_bits,
+			   ipset_dereference_resize(h->table, h)->htable_bits,
+			   ret, start);
+	mutex_unlock(&h->resize.lock);
 #ifdef IP_SET_HASH_WITH_NETS
 	kfree(tmp);
 #endif
@@ -798,11 +2720,330 @@ cleanup:
 		goto retry;
 	goto out;
 
-hbwarn:
-	/* In case we have plenty of memory :-) */
-	pr_warn("Cannot increase the hashsize of set %s further\n", set->name);
-	ret = -IPSET_ERR_HASH_FULL;
-	goto out;
+hbwarn:
+	/* In case we have plenty of memory :-) */
+	pr_warn("Cannot increase the hashsize of set %s further\n", set->name);
+	ret = -IPSET_ERR_HASH_FULL;
+	goto out;
+}
+
+static int
+mtype_resize(struct ip_set *set, bool retried)
+{
+	struct htype *h = set->data;
+
+	/* The add found the chains of a region skewed */
+	if (test_and_clear_bit(HTABLE_RESIZE_RESEED, &h->resize.flags))
+		return mtype_rehash(set, true, false, true);
+	return mtype_rehash(set, false, false, false);
+}
+
+/* Make room for the count elements of a range about to be added: when
+ * the table has got less buckets than elements, request a resize to the
+ * size which holds all of them at once, instead of multiple rehashings
+ * while adding. Called by uadt with the set locked, -EAGAIN triggers the
+ * resize and the add is retried from h->next.
+ */
+static inline int
+mtype_reserve(struct ip_set *set, u64 count)
+{
+	struct htype *h = set->data;
+	const struct htable *t = ipset_dereference_set(h->table, set);
+	u64 elements = 0;
+	u8 hbits = t->htable_bits;
+	u32 r;
+
+	for (r = 0; r < ahash_numof_locks(t); r++)
+		elements += t->hregion[r].elements;
+	elements = min_t(u64, elements + count, h->maxelem);
+	while (hbits < 31 && jhash_size(hbits) < elements)
+		hbits++;
+	if (hbits == t->htable_bits)
+		return 0;
+
+	WRITE_ONCE(h->resize.htable_bits, t->htable_bits);
+	WRITE_ONCE(h->resize.grow_bits, hbits);
+	return -EAGAIN;
+}
+
+#ifndef IP_SET_HASH_WITH_MULTI
+/* Freeze the set: the elements are moved from the buckets into an array
+ * indexed by a perfect hash of the keys and the table is replaced by an
+ * empty one of a single bucket. The set cannot be changed until thawed.
+ */
+static int
+mtype_freeze_table(struct ip_set *set)
+{
+	struct htype *h = set->data;
+	struct htable *t, *orig;
+	struct htable_frozen *f = NULL;
+	size_t dsize = set->dsize;
+	const struct hbucket *n;
+	struct mtype_elem *tmp = NULL;
+	u32 *hash = NULL, *hash2 = NULL, *slot = NULL;
+	u32 i, j, r, size = 0, seeds;
+	int ret = -ENOMEM;
+
+	/* The expired elements would stay in the array */
+	if (SET_WITH_TIMEOUT(set))
+		return -EOPNOTSUPP;
+	/* The queued adds are stored before the freeze */
+	flush_work(&h->async.work);
+	mutex_lock(&h->resize.lock);
+	orig = ipset_dereference_resize(h->table, h);
+	if (h->frozen) {
+		ret = 0;
+		goto out;
+	}
+	/* The writers check the flag under the region locks: once all the
+	 * regions are passed, the elements cannot change anymore.
+	 */
+	WRITE_ONCE(h->frozen, true);
+	for (r = 0; r < ahash_numof_locks(orig); r++) {
+		ahash_region_lock(&orig->hregion[r]);
+		size += orig->hregion[r].elements;
+		ahash_region_unlock(&orig->hregion[r]);
+	}
+	f = htable_frozen_alloc(size, dsize, orig->htable_bits);
+	hash = ip_set_alloc(max_t(u32, size, 1) * sizeof(u32));
+	hash2 = ip_set_alloc(max_t(u32, size, 1) * sizeof(u32));
+	slot = ip_set_alloc(max_t(u32, size, 1) * sizeof(u32));
+	tmp = kmalloc(dsize, GFP_KERNEL);
+	if (!f || !hash || !hash2 || !slot || !tmp)
+		goto thaw;
+
+	atomic_set(&orig->ref, 1);
+	atomic_inc(&orig->uref);
+	size = 0;
+	for (r = 0; r < ahash_numof_locks(orig); r++) {
+		/* The compaction may move the elements in the buckets */
+		ahash_region_lock(&orig->hregion[r]);
+		for (i = ahash_bucket_start(r, orig);
+		     i < ahash_bucket_end(r, orig); i++) {
+			n = __ipset_dereference(hbucket(orig, i));
+			if (!n)
+				continue;
+			for (j = 0; j < n->pos && size < f->size; j++) {
+				if (!test_bit(j, n->used))
+					continue;
+				memcpy(ahash_frozen(f, size++, dsize),
+				       ahash_data(n, j, dsize), dsize);
+			}
+			f->epoch = max(f->epoch, READ_ONCE(n->epoch));
+		}
+		ahash_region_unlock(&orig->hregion[r]);
+		cond_resched();
+	}
+	f->size = size;
+
+	for (seeds = 0; seeds < FROZEN_SEEDS; seeds++) {
+		f->seed = get_random_u32();
+		for (i = 0; i < f->size; i++)
+			mtype_frozen_hash(h, orig, f, ahash_frozen(f, i, dsize),
+					  &hash[i], &hash2[i]);
+		ret = htable_frozen_build(f, hash, hash2, slot);
+		if (ret != -EAGAIN)
+			break;
+	}
+	if (ret == -EAGAIN)
+		ret = -ENOSPC;
+	if (ret < 0)
+		goto unref;
+	/* Move the elements into their slots along the cycles */
+	for (i = 0; i < f->size; i++) {
+		while (slot[i] != i) {
+			j = slot[i];
+			memcpy(tmp, ahash_frozen(f, j, dsize), dsize);
+			memcpy(ahash_frozen(f, j, dsize),
+			       ahash_frozen(f, i, dsize), dsize);
+			memcpy(ahash_frozen(f, i, dsize), tmp, dsize);
+			slot[i] = slot[j];
+			slot[j] = j;
+		}
+	}
+
+	t = htable_alloc_bits(orig, 0, h->numa);
+	if (!t) {
+		ret = -ENOMEM;
+		goto unref;
+	}
+	t->maxelem = h->maxelem / ahash_numof_locks(t);
+	RCU_INIT_POINTER(t->frozen, f);
+	f = NULL;
+	rcu_assign_pointer(h->table, t);
+	ip_set_mem_charge(set, htable_charge(t) - htable_charge(orig), true);
+
+	/* Give time to other readers of the set */
+	synchronize_rcu();
+
+	pr_debug("set %s frozen with %u elements\n", set->name,
+		 __ipset_dereference(t->frozen)->size);
+	/* The extensions are moved into the array */
+	if (atomic_dec_and_test(&orig->uref))
+		mtype_ahash_destroy(set, orig, false);
+	ret = 0;
+	goto out;
+
+unref:
+	atomic_set(&orig->ref, 0);
+	atomic_dec(&orig->uref);
+thaw:
+	WRITE_ONCE(h->frozen, false);
+out:
+	mutex_unlock(&h->resize.lock);
+	kfree(tmp);
+	ip_set_free(slot);
+	ip_set_free(hash2);
+	ip_set_free(hash);
+	ip_set_free(f);
+	return ret;
+}
+
+/* Thaw the set: the frozen elements are stored in the buckets again, in
+ * a table of the size before the freeze or larger
+ */
+static int
+mtype_thaw_table(struct ip_set *set)
+{
+	struct htype *h = set->data;
+	struct htable *t, *orig;
+	const struct htable_frozen *f;
+	struct hbucket *m;
+	u32 i, hash, hash2;
+	u8 htable_bits;
+	int ret = 0;
+
+	mutex_lock(&h->resize.lock);
+	orig = ipset_dereference_resize(h->table, h);
+	f = __ipset_dereference(orig->frozen);
+	if (!f)
+		goto out;
+	htable_bits = f->htable_bits;
+
+retry:
+	t = htable_alloc_bits(orig, htable_bits, h->numa);
+	if (!t) {
+		ret = htable_size(htable_bits) ? -ENOMEM
+					       : -IPSET_ERR_HASH_FULL;
+		goto out;
+	}
+	t->maxelem = h->maxelem / ahash_numof_locks(t);
+	if (SET_WITH_PREALLOC(set) &&
+	    htable_prealloc(t, h->bcache, AHASH_MAX(h), h->numa)) {
+		mtype_ahash_destroy(set, t, false);
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < f->size; i++) {
+		mtype_frozen_hash(h, t, f, ahash_frozen(f, i, set->dsize),
+				  &hash, &hash2);
+		ret = mtype_rehash_elem(set, t, ahash_frozen(f, i, set->dsize),
+					hash, &m);
+		if (ret < 0)
+			break;
+		m->epoch = max(m->epoch, f->epoch);
+		if (!(i % 1024))
+			cond_resched();
+	}
+	if (ret < 0) {
+		mtype_ahash_destroy(set, t, false);
+		if (ret == -EAGAIN) {
+			/* A bucket overflowed, try a larger table */
+			htable_bits++;
+			goto retry;
+		}
+		goto out;
+	}
+
+	atomic_set(&orig->ref, 1);
+	atomic_inc(&orig->uref);
+	rcu_assign_pointer(h->table, t);
+	/* The writers still using the frozen table keep failing */
+	WRITE_ONCE(h->frozen, false);
+	ip_set_mem_charge(set, htable_charge(t) - htable_charge(orig), true);
+
+	/* Give time to other readers of the set */
+	synchronize_rcu();
+
+	pr_debug("set %s thawed into hashsize %u\n", set->name,
+		 jhash_size(t->htable_bits));
+	/* The extensions are moved into the buckets */
+	if (atomic_dec_and_test(&orig->uref))
+		mtype_ahash_destroy(set, orig, false);
+
+out:
+	mutex_unlock(&h->resize.lock);
+	return ret;
+}
+
+/* Freeze or thaw the set, under the nfnl mutex */
+static int
+mtype_freeze(struct ip_set *set, bool freeze)
+{
+	return freeze ? mtype_freeze_table(set) : mtype_thaw_table(set);
+}
+#endif
+
+/* Compact the buckets of the regions churned by the deletions */
+static void
+mtype_compact(struct ip_set *set)
+{
+	struct htype *h = set->data;
+	struct htable *t;
+	u32 i, r;
+
+	spin_lock_bh(&set->lock);
+	t = ipset_dereference_set(h->table, set);
+	atomic_inc(&t->uref);
+	spin_unlock_bh(&set->lock);
+
+	for (r = 0; r < ahash_numof_locks(t); r++) {
+		if (READ_ONCE(t->hregion[r].holes) < ahash_compact_holes(t))
+			continue;
+		ahash_region_lock(&t->hregion[r]);
+		for (i = ahash_bucket_start(r, t); i < ahash_bucket_end(r, t);
+		     i++)
+			mtype_bucket_compact(set, h, t, r, i);
+		t->hregion[r].holes = 0;
+		ahash_region_unlock(&t->hregion[r]);
+		cond_resched();
+	}
+
+	if (atomic_dec_and_test(&t->uref) && atomic_read(&t->ref)) {
+		pr_debug("Table destroy after compaction: %p\n", t);
+		mtype_ahash_destroy(set, t, false);
+	}
+}
+
+static void
+mtype_resize_work(struct work_struct *work)
+{
+	struct htable_resize *rs;
+	int ret = 0;
+
+	rs = container_of(work, struct htable_resize, work);
+	if (test_and_clear_bit(HTABLE_RESIZE_RESEED, &rs->flags)) {
+		/* Rebuilding the table with new keys shortens the chains */
+		clear_bit(HTABLE_RESIZE_GROW, &rs->flags);
+		clear_bit(HTABLE_RESIZE_SHRINK, &rs->flags);
+		ret = mtype_rehash(rs->set, true, false, true);
+	} else if (test_and_clear_bit(HTABLE_RESIZE_GROW, &rs->flags)) {
+		clear_bit(HTABLE_RESIZE_SHRINK, &rs->flags);
+		ret = mtype_rehash(rs->set, false, false, false);
+	} else if (test_and_clear_bit(HTABLE_RESIZE_SHRINK, &rs->flags)) {
+		ret = mtype_rehash(rs->set, true, false, false);
+	}
+	if (test_and_clear_bit(HTABLE_RESIZE_COMPACT, &rs->flags))
+		mtype_compact(rs->set);
+	if (ret)
+		pr_debug("background resize of set %s failed: %d\n",
+			 rs->set->name, ret);
+}
+
+static void
+mtype_resize_init(struct htable_resize *rs)
+{
+	INIT_WORK(&rs->work, mtype_resize_work);
 }
 
 /* Get the current number of elements and ext_size in the set  */
@@ -811,15 +3052,27 @@ mtype_ext_size(struct ip_set *set, u32 *elements, size_t *ext_size)
 {
 	struct htype *h = set->data;
 	const struct htable *t;
+	const struct htable_frozen *f;
 	u32 i, j, r;
 	struct hbucket *n;
 	struct mtype_elem *data;
 
 	*elements = 0;
 	t = rcu_dereference_bh(h->table);
-	for (r = 0; r < ahash_numof_locks(t->htable_bits); r++) {
-		for (i = ahash_bucket_start(r, t->htable_bits);
-		     i < ahash_bucket_end(r, t->htable_bits); i++) {
+	f = rcu_dereference_bh(t->frozen);
+	if (f)
+		*elements += f->size;
+	for (r = 0; r < ahash_numof_locks(t); r++) {
+		*ext_size += t->hregion[r].ext_size;
+		/* Without timeout the region counters are exact: the
+		 * header of huge sets is listed without walking the table
+		 */
+		if (!SET_WITH_TIMEOUT(set)) {
+			*elements += t->hregion[r].elements;
+			continue;
+		}
+		for (i = ahash_bucket_start(r, t); i < ahash_bucket_end(r, t);
+		     i++) {
 			n = rcu_dereference_bh(hbucket(t, i));
 			if (!n)
 				continue;
@@ -831,10 +3084,148 @@ mtype_ext_size(struct ip_set *set, u32 *elements, size_t *ext_size)
 					(*elements)++;
 			}
 		}
-		*ext_size += t->hregion[r].ext_size;
 	}
 }
 
+/* Add the queued elements in FIFO order per CPU */
+static void
+mtype_async_work(struct work_struct *work)
+{
+	struct htable_async *a = container_of(work, struct htable_async, work);
+	struct ip_set *set = a->set;
+	struct mtype_async_ad *x, *tmp;
+	struct llist_node *list;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		list = llist_del_all(per_cpu_ptr(a->queue, cpu));
+		if (!list)
+			continue;
+		list = llist_reverse_order(list);
+		llist_for_each_entry_safe(x, tmp, list, node) {
+			mtype_add(set, &x->d, &x->ext, &x->mext, x->flags);
+			kfree(x);
+			atomic_dec(&a->pending);
+		}
+		ip_set_gen_bump(set);
+		cond_resched();
+	}
+}
+
+static void
+mtype_async_init(struct htable_async *a)
+{
+	INIT_WORK(&a->work, mtype_async_work);
+}
+
+/* Lockless check whether the very element is stored in the set and
+ * whether a refresh (IPSET_FLAG_EXIST) could leave it alone
+ */
+static bool
+mtype_present(struct ip_set *set, const struct mtype_elem *d,
+	      const struct ip_set_ext *ext, u32 flags)
+{
+	struct htype *h = set->data;
+	const struct htable *t;
+	struct hbucket *n;
+	struct mtype_elem *data;
+	u32 hash, multi = 0;
+	bool ret = false;
+	int i;
+
+	rcu_read_lock_bh();
+	t = rcu_dereference_bh(h->table);
+	hash = HKEY_HASH(d, h, t);
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (t->bloom && !htable_bloom_test(t, hash))
+		goto out;
+#endif
+	n = rcu_dereference_bh(hbucket(t, hash & jhash_mask(t->htable_bits)));
+	if (!n)
+		goto out;
+	for (i = 0; i < n->pos; i++) {
+		if (!test_bit(i, n->used))
+			continue;
+		data = ahash_data(n, i, set->dsize);
+		if (!mtype_data_equal(data, d, &multi) ||
+		    SET_ELEM_EXPIRED(set, data))
+			continue;
+		ret = !(flags & IPSET_FLAG_EXIST) ||
+		      ip_set_refresh_skip(set, data, ext, flags);
+		break;
+	}
+out:
+	rcu_read_unlock_bh();
+	return ret;
+}
+
+/* Queue a kernel side add for the work instead of storing it right away.
+ * An add of a present element without refreshing, or with a refresh left
+ * out by coarse refresh, needs no queueing, so that is detected without
+ * locking. Beyond AHASH_ASYNC_MAX queued elements
+ * the adds are dropped: that is exactly the case when adding in the packet
+ * path would be too expensive.
+ */
+static int
+mtype_add_async(struct ip_set *set, void *value, const struct ip_set_ext *ext,
+		struct ip_set_ext *mext, u32 flags)
+{
+	struct htype *h = set->data;
+	struct htable_async *a = &h->async;
+	struct llist_head __percpu *queue, *old;
+	struct mtype_async_ad *x;
+
+	flags &= ~IPSET_FLAG_ADD_ASYNC;
+	if (mtype_present(set, value, ext, flags))
+		return flags & IPSET_FLAG_EXIST ? 0 : -IPSET_ERR_EXIST;
+
+	queue = READ_ONCE(a->queue);
+	if (unlikely(!queue)) {
+		queue = alloc_percpu_gfp(struct llist_head,
+					 GFP_ATOMIC | __GFP_NOWARN);
+		if (!queue)
+			return mtype_add(set, value, ext, mext, flags);
+		old = cmpxchg(&a->queue, NULL, queue);
+		if (old) {
+			free_percpu(queue);
+			queue = old;
+		}
+	}
+	if (atomic_inc_return(&a->pending) > AHASH_ASYNC_MAX) {
+		atomic_dec(&a->pending);
+		return -EBUSY;
+	}
+	x = kmalloc(sizeof(*x), GFP_ATOMIC | __GFP_NOWARN);
+	if (!x) {
+		atomic_dec(&a->pending);
+		return -ENOMEM;
+	}
+	memcpy(&x->d, value, sizeof(struct mtype_elem));
+	memcpy(&x->ext, ext, sizeof(struct ip_set_ext));
+	memcpy(&x->mext, mext, sizeof(struct ip_set_ext));
+	x->ext.comment = NULL;
+	x->flags = flags;
+	/* The queues are lockless, migration to another CPU is harmless */
+	if (llist_add(&x->node, raw_cpu_ptr(queue)))
+		schedule_work(&a->work);
+	return 0;
+}
+
+/* The add flags restoring an element removed by a transaction */
+static u32
+mtype_txn_flags(const struct mtype_elem *data)
+{
+#ifdef IP_SET_HASH_WITH_NETS
+	struct mtype_elem tmp = *data;
+	u8 flags = 0;
+
+	mtype_data_reset_flags(&tmp, &flags);
+	return (u32)flags << 16;
+#else
+	return 0;
+#endif
+}
+
 /* Add an element to a hash and update the internal counters when succeeded,
  * otherwise report the proper error code.
  */
@@ -849,17 +3240,39 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	struct hbucket *n, *old = ERR_PTR(-ENOENT);
 	int i, j = -1, ret;
 	bool flag_exist = flags & IPSET_FLAG_EXIST;
-	bool deleted = false, forceadd = false, reuse = false;
-	u32 r, key, multi = 0, elements, maxelem;
+	bool rollback = flags & IPSET_FLAG_TXN_ROLLBACK;
+	bool deleted = false, forceadd = false, reuse = false, txn = false;
+	bool mem_full = !rollback && ip_set_mem_full(set);
+	u32 r, key, hash, multi = 0, elements, maxelem;
+	unsigned long expiry_slot = 0;
+	long grow;
+
+	/* The capacity freed by a transaction is kept for its rollback */
+	if (ext->target && unlikely(READ_ONCE(set->txn)))
+		return -EBUSY;
+	if (ext->target && (flags & IPSET_FLAG_ADD_ASYNC))
+		return mtype_add_async(set, value, ext, mext, flags);
+	/* A coarse refresh is mostly decided without locking */
+	if ((flags & IPSET_FLAG_COARSE_REFRESH) && (flags & IPSET_FLAG_EXIST) &&
+	    ext->target && mtype_present(set, value, ext, flags))
+		return 0;
 
 	rcu_read_lock_bh();
 	t = rcu_dereference_bh(h->table);
-	key = HKEY(value, h->initval, t->htable_bits);
-	r = ahash_region(key, t->htable_bits);
+	hash = HKEY_HASH(value, h, t);
+	mext->hash = hash;
+	key = hash & jhash_mask(t->htable_bits);
+	r = ahash_region(key, t);
 	atomic_inc(&t->uref);
 	elements = t->hregion[r].elements;
 	maxelem = t->maxelem;
-	if (elements >= maxelem) {
+	/* Over the memory budget it is handled like a full set: the timed
+	 * out elements are evicted early, forceadd replaces an element.
+	 * The rollback of a transaction restores the elements over them.
+	 */
+	if (rollback) {
+		maxelem = UINT_MAX;
+	} else if (elements >= maxelem || mem_full) {
 		u32 e;
 		if (SET_WITH_TIMEOUT(set)) {
 			rcu_read_unlock_bh();
@@ -868,28 +3281,44 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 		}
 		maxelem = h->maxelem;
 		elements = 0;
-		for (e = 0; e < ahash_numof_locks(t->htable_bits); e++)
+		for (e = 0; e < ahash_numof_locks(t); e++)
 			elements += t->hregion[e].elements;
-		if (elements >= maxelem && SET_WITH_FORCEADD(set))
+		if ((elements >= maxelem || mem_full) &&
+		    SET_WITH_FORCEADD(set))
 			forceadd = true;
 	}
 	rcu_read_unlock_bh();
 
-	spin_lock_bh(&t->hregion[r].lock);
+	ahash_region_lock(&t->hregion[r]);
+	/* Checked under the region lock, which the freezing takes too.
+	 * The replaced table of a thawed set is still frozen.
+	 */
+	if (unlikely(READ_ONCE(h->frozen) || rcu_access_pointer(t->frozen))) {
+		ret = -IPSET_ERR_FROZEN;
+		goto unlock;
+	}
 	n = rcu_dereference_bh(hbucket(t, key));
 	if (!n) {
-		if (forceadd || elements >= maxelem)
+		if (elements >= maxelem)
 			goto set_full;
+		ret = ip_set_txn_record(set, ext, d, NULL, sizeof(*d), 0);
+		if (ret < 0)
+			goto unlock;
+		txn = ret;
 		old = NULL;
-		n = kzalloc(sizeof(*n) + AHASH_INIT_SIZE * set->dsize,
-			    GFP_ATOMIC);
+		if (!ahash_ext_size_force(set, t, r,
+					  hbucket_size(h->bcache,
+						       AHASH_INIT_SIZE),
+					  rollback))
+			goto mem_full;
+		n = hbucket_alloc(h->bcache, AHASH_INIT_SIZE, h->numa, key);
 		if (!n) {
+			ahash_ext_size(set, t, r,
+				       -(long)hbucket_size(h->bcache,
+							   AHASH_INIT_SIZE));
 			ret = -ENOMEM;
 			goto unlock;
 		}
-		n->size = AHASH_INIT_SIZE;
-		t->hregion[r].ext_size +=
-			ext_size(AHASH_INIT_SIZE, set->dsize);
 		goto copy_elem;
 	}
 	for (i = 0; i < n->pos; i++) {
@@ -906,6 +3335,12 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 			if (flag_exist || SET_ELEM_EXPIRED(set, data)) {
 				/* Just the extensions could be overwritten */
 				j = i;
+				ret = ip_set_txn_record(set, ext, d,
+						SET_ELEM_EXPIRED(set, data) ?
+						NULL : data, sizeof(*d),
+						mtype_txn_flags(data));
+				if (ret < 0)
+					goto unlock;
 				goto overwrite_extensions;
 			}
 			ret = -IPSET_ERR_EXIST;
@@ -919,12 +3354,18 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	}
 	if (reuse || forceadd) {
 		if (j == -1)
-			j = 0;
+			j = hbucket_clock(n);
 		data = ahash_data(n, j, set->dsize);
+		ret = ip_set_txn_record(set, ext, d,
+					deleted || SET_ELEM_EXPIRED(set, data) ?
+					NULL : data, sizeof(*d),
+					mtype_txn_flags(data));
+		if (ret < 0)
+			goto unlock;
 		if (!deleted) {
 #ifdef IP_SET_HASH_WITH_NETS
 			for (i = 0; i < IPSET_NET_COUNT; i++)
-				mtype_del_cidr(set, h,
+				mtype_del_cidr(set, h, data,
 					NCIDR_PUT(DCIDR_GET(data->cidr, i)),
 					i);
 #endif
@@ -935,28 +3376,49 @@ mtype_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	}
 	if (elements >= maxelem)
 		goto set_full;
+	ret = ip_set_txn_record(set, ext, d, NULL, sizeof(*d), 0);
+	if (ret < 0)
+		goto unlock;
+	txn = ret;
 	/* Create a new slot */
 	if (n->pos >= n->size) {
 		TUNE_BUCKETSIZE(h, multi);
 		if (n->size >= AHASH_MAX(h)) {
-			/* Trigger rehashing */
-			mtype_data_next(&h->next, d);
-			ret = -EAGAIN;
-			goto resize;
+			/* Same keys of multiple elements cannot be spread */
+			bool skewed = !multi &&
+				      ahash_region_skewed(t, r, n->pos);
+
+			WRITE_ONCE(h->resize.htable_bits, t->htable_bits);
+			if (skewed)
+				set_bit(HTABLE_RESIZE_RESEED,
+					&h->resize.flags);
+			if (n->size + AHASH_INIT_SIZE > AHASH_MAX_TUNED) {
+				/* Trigger rehashing */
+				mtype_data_next(&h->next, d);
+				ret = -EAGAIN;
+				goto resize;
+			}
+			/* Overgrow the bucket and rehash in the background */
+			if (!skewed)
+				set_bit(HTABLE_RESIZE_GROW, &h->resize.flags);
+			queue_work(system_power_efficient_wq, &h->resize.work);
 		}
 		old = n;
-		n = kzalloc(sizeof(*n) +
-			    (old->size + AHASH_INIT_SIZE) * set->dsize,
-			    GFP_ATOMIC);
+		grow = (long)hbucket_size(h->bcache,
+					  old->size + AHASH_INIT_SIZE) -
+		       (long)hbucket_size(h->bcache, old->size);
+		if (!ahash_ext_size_force(set, t, r, grow, rollback))
+			goto mem_full;
+		n = hbucket_alloc(h->bcache, old->size + AHASH_INIT_SIZE,
+				  h->numa, key);
 		if (!n) {
+			ahash_ext_size(set, t, r, -grow);
 			ret = -ENOMEM;
 			goto unlock;
 		}
 		memcpy(n, old, sizeof(struct hbucket) +
 		       old->size * set->dsize);
 		n->size = old->size + AHASH_INIT_SIZE;
-		t->hregion[r].ext_size +=
-			ext_size(AHASH_INIT_SIZE, set->dsize);
 	}
 
 copy_elem:
@@ -966,34 +3428,58 @@ copy_data:
 	t->hregion[r].elements++;
 #ifdef IP_SET_HASH_WITH_NETS
 	for (i = 0; i < IPSET_NET_COUNT; i++)
-		mtype_add_cidr(set, h, NCIDR_PUT(DCIDR_GET(d->cidr, i)), i);
+		mtype_add_cidr(set, h, d, NCIDR_PUT(DCIDR_GET(d->cidr, i)), i);
 #endif
 	memcpy(data, d, sizeof(struct mtype_elem));
+	/* A new element has to be matched to survive the next eviction */
+	if (SET_WITH_FORCEADD(set))
+		clear_bit(j, n->ref);
+	/* The sketch is kept when just the extensions are overwritten */
+	if (SET_WITH_DISTINCT(set))
+		ip_set_init_distinct(ext_distinct(data, set));
+	/* So is the bucket, a new element starts with a full one */
+	if (SET_WITH_RATELIMIT(set))
+		atomic64_set(&ext_ratelimit(data, set)->tat, 0);
 overwrite_extensions:
 #ifdef IP_SET_HASH_WITH_NETS
 	mtype_data_set_flags(data, flags);
 #endif
 	if (SET_WITH_COUNTER(set))
-		ip_set_init_counter(ext_counter(data, set), ext);
+		ip_set_init_counter(set, ext_counter(data, set), ext);
 	if (SET_WITH_COMMENT(set))
 		ip_set_init_comment(set, ext_comment(data, set), ext);
 	if (SET_WITH_SKBINFO(set))
 		ip_set_init_skbinfo(ext_skbinfo(data, set), ext);
+	if (SET_WITH_RATELIMIT(set))
+		ip_set_init_ratelimit(ext_ratelimit(data, set), ext);
 	/* Must come last for the case when timed out entry is reused */
-	if (SET_WITH_TIMEOUT(set))
+	if (SET_WITH_TIMEOUT(set)) {
 		ip_set_timeout_set(ext_timeout(data, set), ext->timeout);
+		expiry_slot = htable_expiry_add(&h->gc, t, key,
+				ip_set_timeout_jiffies(ext_timeout(data, set)));
+	}
+#ifdef IP_SET_HASH_WITH_BLOOM
+	/* The element must be in the filter before it becomes visible */
+	if (t->bloom)
+		htable_bloom_add(t, hash);
+#endif
+	hbucket_mark(n, atomic_read(&h->epoch));
 	smp_mb__before_atomic();
 	set_bit(j, n->used);
 	if (old != ERR_PTR(-ENOENT)) {
 		rcu_assign_pointer(hbucket(t, key), n);
 		if (old)
-			kfree_rcu(old, rcu);
+			hbucket_free_deferred(&h->batch, h->bcache, old);
 	}
 	ret = 0;
 resize:
-	spin_unlock_bh(&t->hregion[r].lock);
-	if (atomic_read(&t->ref) && ext->target) {
-		/* Resize is in process and kernel side add, save values */
+	ahash_region_unlock(&t->hregion[r]);
+	if (expiry_slot)
+		mtype_gc_kick(set, h, expiry_slot);
+	if (atomic_read(&t->ref) && (ext->target || !ret)) {
+		/* Resize is in process and kernel side add or
+		 * userspace add parallel with background resize, save values
+		 */
 		struct mtype_resize_ad *x;
 
 		x = kzalloc(sizeof(struct mtype_resize_ad), GFP_ATOMIC);
@@ -1004,6 +3490,9 @@ resize:
 		memcpy(&x->d, value, sizeof(struct mtype_elem));
 		memcpy(&x->ext, ext, sizeof(struct ip_set_ext));
 		memcpy(&x->mext, mext, sizeof(struct ip_set_ext));
+		/* The comment belongs to the netlink message */
+		if (ext->comment)
+			x->ext.comment = kstrdup(ext->comment, GFP_ATOMIC);
 		x->flags = flags;
 		spin_lock_bh(&set->lock);
 		list_add_tail(&x->list, &h->ad);
@@ -1016,9 +3505,18 @@ set_full:
 		pr_warn("Set %s is full, maxelem %u reached\n",
 			set->name, maxelem);
 	ret = -IPSET_ERR_HASH_FULL;
+	goto unlock;
+
+mem_full:
+	if (net_ratelimit())
+		pr_warn("Set %s is over the memory budget of its namespace\n",
+			set->name);
+	ret = -IPSET_ERR_MEM_BUDGET;
 unlock:
-	spin_unlock_bh(&t->hregion[r].lock);
+	ahash_region_unlock(&t->hregion[r]);
 out:
+	if (ret && txn)
+		ip_set_txn_forget(set);
 	if (atomic_dec_and_test(&t->uref) && atomic_read(&t->ref)) {
 		pr_debug("Table destroy after resize by add: %p\n", t);
 		mtype_ahash_destroy(set, t, false);
@@ -1038,21 +3536,31 @@ mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	struct mtype_elem *data;
 	struct hbucket *n;
 	struct mtype_resize_ad *x = NULL;
-	int i, j, k, r, ret = -IPSET_ERR_EXIST;
-	u32 key, multi = 0;
+	int i, k, r, ret = -IPSET_ERR_EXIST;
+#ifdef IP_SET_HASH_WITH_NETS
+	int j;
+#endif
+	u32 key, hash, multi = 0;
 	size_t dsize = set->dsize;
 
-	/* Userspace add and resize is excluded by the mutex.
-	 * Kernespace add does not trigger resize.
+	/* Userspace del and command triggered resize is excluded by
+	 * the mutex, parallel background resize saves the deletion.
 	 */
 	rcu_read_lock_bh();
 	t = rcu_dereference_bh(h->table);
-	key = HKEY(value, h->initval, t->htable_bits);
-	r = ahash_region(key, t->htable_bits);
+	hash = HKEY_HASH(value, h, t);
+	if (mext)
+		mext->hash = hash;
+	key = hash & jhash_mask(t->htable_bits);
+	r = ahash_region(key, t);
 	atomic_inc(&t->uref);
 	rcu_read_unlock_bh();
 
-	spin_lock_bh(&t->hregion[r].lock);
+	ahash_region_lock(&t->hregion[r]);
+	if (unlikely(READ_ONCE(h->frozen) || rcu_access_pointer(t->frozen))) {
+		ret = -IPSET_ERR_FROZEN;
+		goto out;
+	}
 	n = rcu_dereference_bh(hbucket(t, key));
 	if (!n)
 		goto out;
@@ -1067,21 +3575,33 @@ mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 		if (SET_ELEM_EXPIRED(set, data))
 			goto out;
 
+		ret = ip_set_txn_record(set, ext, NULL, data, sizeof(*d),
+					mtype_txn_flags(data));
+		if (ret < 0)
+			goto out;
 		ret = 0;
 		clear_bit(i, n->used);
 		smp_mb__after_atomic();
 		if (i + 1 == n->pos)
 			n->pos--;
 		t->hregion[r].elements--;
+		/* Region just became sparse: check the whole table */
+		if (t->htable_bits > h->resize.min_bits &&
+		    t->hregion[r].elements ==
+		    ahash_region_size(t) / HTABLE_SHRINK_RATIO - 1) {
+			set_bit(HTABLE_RESIZE_SHRINK, &h->resize.flags);
+			queue_work(system_power_efficient_wq, &h->resize.work);
+		}
 #ifdef IP_SET_HASH_WITH_NETS
 		for (j = 0; j < IPSET_NET_COUNT; j++)
-			mtype_del_cidr(set, h,
+			mtype_del_cidr(set, h, d,
 				       NCIDR_PUT(DCIDR_GET(d->cidr, j)), j);
 #endif
 		ip_set_ext_destroy(set, data);
 
-		if (atomic_read(&t->ref) && ext->target) {
-			/* Resize is in process and kernel side del,
+		if (atomic_read(&t->ref)) {
+			/* Resize is in process and kernel side del or
+			 * userspace del parallel with background resize,
 			 * save values
 			 */
 			x = kzalloc(sizeof(struct mtype_resize_ad),
@@ -1097,36 +3617,21 @@ mtype_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 			if (!test_bit(i, n->used))
 				k++;
 		}
-		if (n->pos == 0 && k == 0) {
-			t->hregion[r].ext_size -= ext_size(n->size, dsize);
-			rcu_assign_pointer(hbucket(t, key), NULL);
-			kfree_rcu(n, rcu);
-		} else if (k >= AHASH_INIT_SIZE) {
-			struct hbucket *tmp = kzalloc(sizeof(*tmp) +
-					(n->size - AHASH_INIT_SIZE) * dsize,
-					GFP_ATOMIC);
-			if (!tmp)
-				goto out;
-			tmp->size = n->size - AHASH_INIT_SIZE;
-			for (j = 0, k = 0; j < n->pos; j++) {
-				if (!test_bit(j, n->used))
-					continue;
-				data = ahash_data(n, j, dsize);
-				memcpy(tmp->value + k * dsize, data, dsize);
-				set_bit(k, tmp->used);
-				k++;
-			}
-			tmp->pos = k;
-			t->hregion[r].ext_size -=
-				ext_size(AHASH_INIT_SIZE, dsize);
-			rcu_assign_pointer(hbucket(t, key), tmp);
-			kfree_rcu(n, rcu);
+		if ((n->pos == 0 && k == 0 && !SET_WITH_PREALLOC(set)) ||
+		    (k >= AHASH_INIT_SIZE &&
+		     n->size - AHASH_INIT_SIZE >= hbucket_min_size(set, h))) {
+			mtype_bucket_compact(set, h, t, r, key);
+		} else if (k &&
+			   ++t->hregion[r].holes == ahash_compact_holes(t)) {
+			/* The rest is left to the background compaction */
+			set_bit(HTABLE_RESIZE_COMPACT, &h->resize.flags);
+			queue_work(system_power_efficient_wq, &h->resize.work);
 		}
 		goto out;
 	}
 
 out:
-	spin_unlock_bh(&t->hregion[r].lock);
+	ahash_region_unlock(&t->hregion[r]);
 	if (x) {
 		spin_lock_bh(&set->lock);
 		list_add(&x->list, &h->ad);
@@ -1140,8 +3645,51 @@ out:
 }
 
 static int
-mtype_data_match(struct mtype_elem *data, const struct ip_set_ext *ext,
-		 struct ip_set_ext *mext, struct ip_set *set, u32 flags)
+mtype_data_match(struct hbucket *n, struct mtype_elem *data,
+		 const struct ip_set_ext *ext, struct ip_set_ext *mext,
+		 struct ip_set *set, u32 flags)
+{
+	bool match = ip_set_match_extensions(set, ext, mext, flags, data);
+
+	if (SET_WITH_FORCEADD(set))
+		hbucket_touch(n, ((unsigned char *)data - n->value) /
+				 set->dsize);
+	if (SET_WITH_COUNTER(set)) {
+		const struct htype *h = set->data;
+
+		hbucket_mark(n, atomic_read(&h->epoch));
+	}
+	if (!match)
+		return 0;
+	/* nomatch entries return -ENOTEMPTY */
+	return mtype_do_data_match(data);
+}
+
+/* Find the element in the slot of the key of d in a frozen set */
+static struct mtype_elem *
+mtype_frozen_find(struct ip_set *set, const struct htable *t,
+		  const struct htable_frozen *f, const struct mtype_elem *d,
+		  struct ip_set_ext *mext, u32 *probes, u32 *compares)
+{
+	const struct htype *h = set->data;
+	struct mtype_elem *data;
+	u32 hash = HKEY_HASH(d, h, t), multi = 0;
+
+	mext->hash = hash;
+	(*probes)++;
+	if (!f->size)
+		return NULL;
+	data = ahash_frozen(f, htable_frozen_slot(f, hash,
+			jhash2((const u32 *)d, HKEY_DATALEN / sizeof(u32),
+			       f->seed)), set->dsize);
+	(*compares)++;
+	return mtype_data_equal(data, d, &multi) ? data : NULL;
+}
+
+static int
+mtype_frozen_match(struct ip_set *set, struct mtype_elem *data,
+		   const struct ip_set_ext *ext, struct ip_set_ext *mext,
+		   u32 flags)
 {
 	if (!ip_set_match_extensions(set, ext, mext, flags, data))
 		return 0;
@@ -1149,6 +3697,58 @@ mtype_data_match(struct mtype_elem *data, const struct ip_set_ext *ext,
 	return mtype_do_data_match(data);
 }
 
+/* Test an element in a frozen set: a single slot per probed prefix */
+static int
+mtype_frozen_test(struct ip_set *set, const struct htable *t,
+		  const struct htable_frozen *f, struct mtype_elem *d,
+		  const struct ip_set_ext *ext, struct ip_set_ext *mext,
+		  u32 flags, u32 *probes, u32 *compares)
+{
+	struct mtype_elem *data;
+#ifdef IP_SET_HASH_WITH_NETS
+	struct htype *h = set->data;
+#if IPSET_NET_COUNT == 2
+	struct mtype_elem orig = *d;
+	int ret, i, j, k;
+#else
+	int ret, i, j;
+#endif
+
+	for (i = 0; i < IPSET_NET_COUNT; i++)
+		if (DCIDR_GET(d->cidr, i) != HOST_MASK)
+			break;
+	if (i == IPSET_NET_COUNT) {
+		/* An address: try all network sizes of the set */
+		for (j = 0; j < NLEN && h->nets[j].cidr[0]; j++) {
+#if IPSET_NET_COUNT == 2
+			mtype_data_reset_elem(d, &orig);
+			mtype_data_netmask(d, NCIDR_GET(h->nets[j].cidr[0]),
+					   false);
+			for (k = 0; k < NLEN && h->nets[k].cidr[1]; k++) {
+				mtype_data_netmask(d,
+					NCIDR_GET(h->nets[k].cidr[1]), true);
+#else
+			mtype_data_netmask(d, NCIDR_GET(h->nets[j].cidr[0]));
+#endif
+			data = mtype_frozen_find(set, t, f, d, mext, probes,
+						 compares);
+			if (data) {
+				ret = mtype_frozen_match(set, data, ext, mext,
+							 flags);
+				if (ret != 0)
+					return ret;
+			}
+#if IPSET_NET_COUNT == 2
+			}
+#endif
+		}
+		return 0;
+	}
+#endif
+	data = mtype_frozen_find(set, t, f, d, mext, probes, compares);
+	return data ? mtype_frozen_match(set, data, ext, mext, flags) : 0;
+}
+
 #ifdef IP_SET_HASH_WITH_NETS
 /* Special test function which takes into account the different network
  * sizes added to the set
@@ -1156,7 +3756,8 @@ mtype_data_match(struct mtype_elem *data, const struct ip_set_ext *ext,
 static int
 mtype_test_cidrs(struct ip_set *set, struct mtype_elem *d,
 		 const struct ip_set_ext *ext,
-		 struct ip_set_ext *mext, u32 flags)
+		 struct ip_set_ext *mext, u32 flags,
+		 u32 *probes, u32 *compares)
 {
 	struct htype *h = set->data;
 	struct htable *t = rcu_dereference_bh(h->table);
@@ -1168,7 +3769,7 @@ mtype_test_cidrs(struct ip_set *set, struct mtype_elem *d,
 #else
 	int ret, i, j = 0;
 #endif
-	u32 key, multi = 0;
+	u32 key, hash, multi = 0;
 
 	pr_debug("test by nets\n");
 	for (; j < NLEN && h->nets[j].cidr[0] && !multi; j++) {
@@ -1182,17 +3783,99 @@ mtype_test_cidrs(struct ip_set *set, struct mtype_elem *d,
 #else
 		mtype_data_netmask(d, NCIDR_GET(h->nets[j].cidr[0]));
 #endif
-		key = HKEY(d, h->initval, t->htable_bits);
+		hash = HKEY_HASH(d, h, t);
+		mext->hash = hash;
+#ifdef IP_SET_HASH_WITH_BLOOM
+		if (t->bloom && !htable_bloom_test(t, hash))
+			continue;
+#endif
+		key = hash & jhash_mask(t->htable_bits);
+		n = rcu_dereference_bh(hbucket(t, key));
+		(*probes)++;
+		if (!n)
+			continue;
+		for (i = 0; i < n->pos; i++) {
+			if (!test_bit(i, n->used))
+				continue;
+			data = ahash_data(n, i, set->dsize);
+			(*compares)++;
+			if (!mtype_data_equal(data, d, &multi))
+				continue;
+			ret = mtype_data_match(n, data, ext, mext, set, flags);
+			if (ret != 0)
+				return ret;
+#ifdef IP_SET_HASH_WITH_MULTI
+			/* No match, reset multiple match flag */
+			multi = 0;
+#endif
+		}
+#if IPSET_NET_COUNT == 2
+		}
+#endif
+	}
+	return 0;
+}
+
+#ifdef IP_SET_HASH_WITH_LPM
+/* Test an address by the prefix lengths returned by the LPM index,
+ * from the most specific one
+ */
+static int
+mtype_test_lpm(struct ip_set *set, struct mtype_elem *d,
+	       const struct ip_set_ext *ext,
+	       struct ip_set_ext *mext, u32 flags,
+	       u32 *probes, u32 *compares)
+{
+	struct htype *h = set->data;
+	struct htable *t = rcu_dereference_bh(h->table);
+	struct hbucket *n;
+	struct mtype_elem *data;
+	u8 plens[HOST_MASK + 1];
+#if IPSET_NET_COUNT == 2
+	struct mtype_elem orig = *d;
+	u8 plens2[HOST_MASK + 1];
+	int ret, i, j, k, l;
+#else
+	int ret, i, j;
+#endif
+	u32 key, hash, multi = 0;
+
+	pr_debug("test by lpm\n");
+	j = lpm_lookup(&h->lpm[0], mtype_data_lpm_addr(d, 0), HOST_MASK, plens);
+#if IPSET_NET_COUNT == 2
+	l = lpm_lookup(&h->lpm[1], mtype_data_lpm_addr(d, 1), HOST_MASK,
+		       plens2);
+	if (!l)
+		return 0;
+#endif
+	while (j-- > 0 && !multi) {
+#if IPSET_NET_COUNT == 2
+		mtype_data_reset_elem(d, &orig);
+		mtype_data_netmask(d, plens[j], false);
+		for (k = l; k-- > 0 && !multi;) {
+			mtype_data_netmask(d, plens2[k], true);
+#else
+		mtype_data_netmask(d, plens[j]);
+#endif
+		hash = HKEY_HASH(d, h, t);
+		mext->hash = hash;
+#ifdef IP_SET_HASH_WITH_BLOOM
+		if (t->bloom && !htable_bloom_test(t, hash))
+			continue;
+#endif
+		key = hash & jhash_mask(t->htable_bits);
 		n = rcu_dereference_bh(hbucket(t, key));
+		(*probes)++;
 		if (!n)
 			continue;
 		for (i = 0; i < n->pos; i++) {
 			if (!test_bit(i, n->used))
 				continue;
 			data = ahash_data(n, i, set->dsize);
+			(*compares)++;
 			if (!mtype_data_equal(data, d, &multi))
 				continue;
-			ret = mtype_data_match(data, ext, mext, set, flags);
+			ret = mtype_data_match(n, data, ext, mext, set, flags);
 			if (ret != 0)
 				return ret;
 #ifdef IP_SET_HASH_WITH_MULTI
@@ -1207,6 +3890,43 @@ mtype_test_cidrs(struct ip_set *set, struct mtype_elem *d,
 	return 0;
 }
 #endif
+#endif
+
+#ifdef IP_SET_HASH_WITH_SCAN
+/* Test an element in a bucket of bare keys: the type compares a word
+ * worth of keys at once without branching and the result is masked
+ * by the used positions.
+ */
+static int
+mtype_test_scan(struct ip_set *set, struct hbucket *n, struct mtype_elem *d,
+		const struct ip_set_ext *ext,
+		struct ip_set_ext *mext, u32 flags, u32 *compares)
+{
+	unsigned long match;
+	u8 i;
+
+	for (i = 0; i < n->pos; i += BITS_PER_LONG) {
+		*compares += min_t(u8, n->pos - i, BITS_PER_LONG);
+		match = mtype_data_scan(ahash_data(n, i, set->dsize),
+					min_t(u8, n->pos - i, BITS_PER_LONG), d);
+		match &= n->used[BIT_WORD(i)];
+		if (match)
+			return mtype_data_match(n,
+					ahash_data(n, i + __ffs(match),
+						   set->dsize),
+					ext, mext, set, flags);
+	}
+	return 0;
+}
+#endif
+
+#ifndef IP_SET_HASH_WITH_NETS
+/* Key of a packet collected by a bulk test */
+struct mtype_bulk_key {
+	struct mtype_elem d;
+	struct ip_set_ext ext;
+};
+#endif
 
 /* Test whether the element is added to the set */
 static int
@@ -1215,14 +3935,33 @@ mtype_test(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 {
 	struct htype *h = set->data;
 	struct htable *t;
+	const struct htable_frozen *f;
 	struct mtype_elem *d = value;
 	struct hbucket *n;
 	struct mtype_elem *data;
 	int i, ret = 0;
-	u32 key, multi = 0;
+	u32 key, hash, multi = 0, probes = 0, compares = 0;
+
+#ifndef IP_SET_HASH_WITH_NETS
+	if (unlikely(flags & IPSET_FLAG_BULK_COLLECT)) {
+		struct ip_set_bulk *b =
+			container_of(mext, struct ip_set_bulk, opt.ext);
+		struct mtype_bulk_key *k =
+			(struct mtype_bulk_key *)b->keys + b->n++;
 
+		memcpy(&k->d, d, sizeof(struct mtype_elem));
+		memcpy(&k->ext, ext, sizeof(struct ip_set_ext));
+		return 0;
+	}
+#endif
 	rcu_read_lock_bh();
 	t = rcu_dereference_bh(h->table);
+	f = rcu_dereference_bh(t->frozen);
+	if (f) {
+		ret = mtype_frozen_test(set, t, f, d, ext, mext, flags,
+					&probes, &compares);
+		goto out;
+	}
 #ifdef IP_SET_HASH_WITH_NETS
 	/* If we test an IP address and not a network address,
 	 * try all possible network sizes
@@ -1231,35 +3970,239 @@ mtype_test(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 		if (DCIDR_GET(d->cidr, i) != HOST_MASK)
 			break;
 	if (i == IPSET_NET_COUNT) {
-		ret = mtype_test_cidrs(set, d, ext, mext, flags);
+#ifdef IP_SET_HASH_WITH_LPM
+		if (SET_WITH_LPM(set) &&
+		    !lpm_broken(h->lpm, IPSET_NET_COUNT)) {
+			ret = mtype_test_lpm(set, d, ext, mext, flags,
+					     &probes, &compares);
+			goto out;
+		}
+#endif
+		ret = mtype_test_cidrs(set, d, ext, mext, flags,
+				       &probes, &compares);
+		goto out;
+	}
+#endif
+
+	hash = HKEY_HASH(d, h, t);
+	mext->hash = hash;
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (t->bloom && !htable_bloom_test(t, hash)) {
+		ret = 0;
+		goto out;
+	}
+#endif
+	key = hash & jhash_mask(t->htable_bits);
+	n = rcu_dereference_bh(hbucket(t, key));
+	probes++;
+	if (!n) {
+		ret = 0;
+		goto out;
+	}
+#ifdef IP_SET_HASH_WITH_SCAN
+	/* Without extensions the bucket is a packed array of the keys */
+	if (set->dsize == sizeof(struct mtype_elem)) {
+		ret = mtype_test_scan(set, n, d, ext, mext, flags, &compares);
 		goto out;
 	}
 #endif
-
-	key = HKEY(d, h->initval, t->htable_bits);
-	n = rcu_dereference_bh(hbucket(t, key));
-	if (!n) {
-		ret = 0;
+	for (i = 0; i < n->pos; i++) {
+		if (!test_bit(i, n->used))
+			continue;
+		data = ahash_data(n, i, set->dsize);
+		compares++;
+		if (!mtype_data_equal(data, d, &multi))
+			continue;
+		ret = mtype_data_match(n, data, ext, mext, set, flags);
+		if (ret != 0)
+			goto out;
+	}
+out:
+	ip_set_lookupstat_add(h->lstat, ret, probes, compares);
+	rcu_read_unlock_bh();
+	return ret;
+}
+
+#ifdef IP_SET_HASH_WITH_LEAN
+/* Test function of the sets created without extensions, for the types
+ * with bucket scanning and without networks: the buckets are packed
+ * arrays of the keys at the constant stride of the element and there is
+ * nothing to check but the key itself.
+ */
+static int
+mtype_test_lean(struct ip_set *set, void *value, const struct ip_set_ext *ext,
+		struct ip_set_ext *mext, u32 flags)
+{
+	struct htype *h = set->data;
+	struct mtype_elem *d = value;
+	const struct mtype_elem *array;
+	struct htable *t;
+	struct hbucket *n;
+	unsigned long match;
+	u32 hash, probes = 0, compares = 0;
+	int i, ret = 0;
+
+	if (unlikely(flags & IPSET_FLAG_BULK_COLLECT))
+		return mtype_test(set, value, ext, mext, flags);
+
+	rcu_read_lock_bh();
+	t = rcu_dereference_bh(h->table);
+	if (unlikely(rcu_access_pointer(t->frozen))) {
+		rcu_read_unlock_bh();
+		return mtype_test(set, value, ext, mext, flags);
+	}
+	hash = HKEY_HASH(d, h, t);
+	mext->hash = hash;
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (t->bloom && !htable_bloom_test(t, hash))
+		goto out;
+#endif
+	n = rcu_dereference_bh(hbucket(t, hash & jhash_mask(t->htable_bits)));
+	probes++;
+	if (!n)
 		goto out;
-	}
-	for (i = 0; i < n->pos; i++) {
-		if (!test_bit(i, n->used))
-			continue;
-		data = ahash_data(n, i, set->dsize);
-		if (!mtype_data_equal(data, d, &multi))
-			continue;
-		ret = mtype_data_match(data, ext, mext, set, flags);
-		if (ret != 0)
-			goto out;
+	array = (const struct mtype_elem *)n->value;
+	for (i = 0; i < n->pos; i += BITS_PER_LONG) {
+		compares += min_t(u8, n->pos - i, BITS_PER_LONG);
+		match = mtype_data_scan(array + i,
+					min_t(u8, n->pos - i, BITS_PER_LONG), d);
+		match &= n->used[BIT_WORD(i)];
+		if (match) {
+			if (SET_WITH_FORCEADD(set))
+				hbucket_touch(n, i + __ffs(match));
+			ret = 1;
+			break;
+		}
 	}
 out:
+	ip_set_lookupstat_add(h->lstat, ret, probes, compares);
 	rcu_read_unlock_bh();
 	return ret;
 }
+#endif
+
+#ifndef IP_SET_HASH_WITH_NETS
+/* Test a burst of packets, under rcu_read_lock_bh: the keys of a chunk of
+ * AHASH_BULK packets are collected by the kadt function, then all of their
+ * buckets are prefetched before the comparisons. The kadt functions pass
+ * at most one key per packet to mtype_test().
+ */
+static void
+mtype_test_bulk(struct ip_set *set, struct sk_buff **skbs, unsigned int n,
+		const struct xt_action_param *par, struct ip_set_adt_opt *opt,
+		unsigned long *result)
+{
+	struct htype *h = set->data;
+	const struct htable *t = rcu_dereference_bh(h->table);
+	const struct htable_frozen *f = rcu_dereference_bh(t->frozen);
+	struct mtype_bulk_key keys[AHASH_BULK];
+	struct hbucket *buckets[AHASH_BULK];
+	u8 pkt[AHASH_BULK], probed[AHASH_BULK];
+	struct ip_set_bulk b = { .opt = *opt, .keys = keys };
+	struct mtype_elem *data;
+	struct hbucket *m;
+	unsigned int start, i, k, cnt;
+	u32 hash, multi, probes, compares;
+	int j, ret;
+
+	b.opt.cmdflags |= IPSET_FLAG_BULK_COLLECT;
+	for (start = 0; start < n; start += AHASH_BULK) {
+		cnt = min_t(unsigned int, n - start, AHASH_BULK);
+		b.n = 0;
+		for (i = 0; i < cnt; i++) {
+			k = b.n;
+			set->variant->kadt(set, skbs[start + i], par,
+					   IPSET_TEST, &b.opt);
+			if (b.n > k)
+				pkt[k] = i;
+		}
+		if (f) {
+			/* A single slot per key, nothing to prefetch */
+			for (k = 0; k < b.n; k++) {
+				probes = 0;
+				compares = 0;
+				ret = mtype_frozen_test(set, t, f, &keys[k].d,
+							&keys[k].ext,
+							&opt->ext,
+							opt->cmdflags,
+							&probes, &compares);
+				if (ret > 0)
+					__set_bit(start + pkt[k], result);
+				ip_set_lookupstat_add(h->lstat, ret, probes,
+						      compares);
+			}
+			continue;
+		}
+		for (k = 0; k < b.n; k++) {
+			hash = HKEY_HASH(&keys[k].d, h, t);
+			buckets[k] = NULL;
+			probed[k] = 0;
+#ifdef IP_SET_HASH_WITH_BLOOM
+			/* Rejected by the filter, no bucket is probed */
+			if (t->bloom && !htable_bloom_test(t, hash))
+				continue;
+#endif
+			m = rcu_dereference_bh(hbucket(t, hash &
+						jhash_mask(t->htable_bits)));
+			if (m)
+				prefetch(m);
+			buckets[k] = m;
+			probed[k] = 1;
+		}
+		for (k = 0; k < b.n; k++) {
+			m = buckets[k];
+			multi = 0;
+			compares = 0;
+			ret = 0;
+			for (j = 0; m && j < m->pos; j++) {
+				if (!test_bit(j, m->used))
+					continue;
+				data = ahash_data(m, j, set->dsize);
+				compares++;
+				if (!mtype_data_equal(data, &keys[k].d, &multi))
+					continue;
+				ret = mtype_data_match(m, data, &keys[k].ext,
+						       &opt->ext, set,
+						       opt->cmdflags);
+				if (ret > 0)
+					__set_bit(start + pkt[k], result);
+				if (ret != 0)
+					break;
+			}
+			ip_set_lookupstat_add(h->lstat, ret, probed[k],
+					      compares);
+		}
+	}
+}
+#endif
+
+/* Sum up the per-cpu lookup statistics: the counters are read without
+ * synchronization, these are statistics
+ */
+static void
+mtype_lookupstat(const struct ip_set *set, struct ip_set_lookupstat *stat)
+{
+	const struct htype *h = set->data;
+	const struct ip_set_lookupstat *s;
+	int cpu, i;
+
+	memset(stat, 0, sizeof(*stat));
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(h->lstat, cpu);
+		stat->tests += READ_ONCE(s->tests);
+		stat->hits += READ_ONCE(s->hits);
+		stat->misses += READ_ONCE(s->misses);
+		for (i = 0; i < IPSET_LOOKUP_HIST; i++) {
+			stat->probes[i] += READ_ONCE(s->probes[i]);
+			stat->compares[i] += READ_ONCE(s->compares[i]);
+		}
+	}
+}
 
 /* Reply a HEADER request: fill out the header part of the set */
 static int
-mtype_head(struct ip_set *set, struct sk_buff *skb)
+mtype_head(struct ip_set *set, struct sk_buff *skb,
+	   const struct netlink_callback *cb)
 {
 	struct htype *h = set->data;
 	const struct htable *t;
@@ -1267,13 +4210,47 @@ mtype_head(struct ip_set *set, struct sk_buff *skb)
 	size_t memsize;
 	u32 elements = 0;
 	size_t ext_size = 0;
-	u8 htable_bits;
+	u8 htable_bits, region_bits, pages;
+	struct ip_set_hash_lockstat stat;
+	struct ip_set_hash_lookupstat lookup;
+	struct ip_set_hash_memstat mem;
+	struct ip_set_lookupstat lsum;
+	size_t table_size, ext_payload;
+	long pending;
+	u64 acquired = 0, contended = 0, wait = 0, hold = 0;
+	u32 r, epoch, initval;
+#ifdef IP_SET_HASH_WITH_BLOOM
+	u32 fpr = 0;
+#endif
 
+	/* The listings of the changes start a new epoch: the elements
+	 * changed from now on are listed for it. Other listings just
+	 * report the current one.
+	 */
+	if (ip_set_dump_changed(cb) || ip_set_dump_reset(cb))
+		epoch = atomic_inc_return(&h->epoch);
+	else
+		epoch = atomic_read(&h->epoch);
 	rcu_read_lock_bh();
 	t = rcu_dereference_bh(h->table);
 	mtype_ext_size(set, &elements, &ext_size);
-	memsize = mtype_ahash_memsize(h, t) + ext_size + set->ext_size;
+	table_size = mtype_ahash_memsize(h, t);
+	memsize = table_size + ext_size + set->ext_size;
 	htable_bits = t->htable_bits;
+	/* A frozen set is listed with the size it is thawed into */
+	if (rcu_dereference_bh(t->frozen))
+		htable_bits = rcu_dereference_bh(t->frozen)->htable_bits;
+	region_bits = t->region_bits;
+	pages = t->pages;
+	initval = t->initval;
+	if (ip_set_dump_stats(cb))
+		for (r = 0; r < ahash_numof_locks(t); r++)
+			ahash_region_stat(&t->hregion[r], &acquired,
+					  &contended, &wait, &hold);
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (t->bloom)
+		fpr = htable_bloom_fpr(t);
+#endif
 	rcu_read_unlock_bh();
 
 	nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
@@ -1294,13 +4271,65 @@ mtype_head(struct ip_set *set, struct sk_buff *skb)
 #endif
 	if (set->flags & IPSET_CREATE_FLAG_BUCKETSIZE) {
 		if (nla_put_u8(skb, IPSET_ATTR_BUCKETSIZE, h->bucketsize) ||
-		    nla_put_net32(skb, IPSET_ATTR_INITVAL, htonl(h->initval)))
+		    nla_put_net32(skb, IPSET_ATTR_INITVAL, htonl(initval)))
+			goto nla_put_failure;
+	}
+	if (h->hashfn != IPSET_HASHFN_JHASH &&
+	    nla_put_u8(skb, IPSET_ATTR_HASHFN, h->hashfn))
+		goto nla_put_failure;
+	if (region_bits != HTABLE_REGION_BITS &&
+	    nla_put_u8(skb, IPSET_ATTR_REGIONBITS, region_bits))
+		goto nla_put_failure;
+	if (h->numa != NUMA_NO_NODE &&
+	    nla_put_net32(skb, IPSET_ATTR_NUMA,
+			  htonl(h->numa == HTABLE_NUMA_INTERLEAVE ?
+				IPSET_NUMA_INTERLEAVE : h->numa)))
+		goto nla_put_failure;
+	stat.acquired = cpu_to_be64(acquired);
+	stat.contended = cpu_to_be64(contended);
+	stat.wait = cpu_to_be64(wait);
+	stat.hold = cpu_to_be64(hold);
+	if (ip_set_dump_stats(cb) &&
+	    nla_put(skb, IPSET_ATTR_LOCKSTAT, sizeof(stat), &stat))
+		goto nla_put_failure;
+	if (ip_set_dump_stats(cb)) {
+		mtype_lookupstat(set, &lsum);
+		lookup.tests = cpu_to_be64(lsum.tests);
+		lookup.hits = cpu_to_be64(lsum.hits);
+		lookup.misses = cpu_to_be64(lsum.misses);
+		for (r = 0; r < IPSET_LOOKUP_HIST; r++) {
+			lookup.probes[r] = cpu_to_be64(lsum.probes[r]);
+			lookup.compares[r] = cpu_to_be64(lsum.compares[r]);
+		}
+		if (nla_put(skb, IPSET_ATTR_LOOKUPSTAT, sizeof(lookup),
+			    &lookup))
 			goto nla_put_failure;
 	}
+	/* The element part of the slots is the bucket payload */
+	ext_payload = (size_t)elements * (set->dsize - sizeof(struct mtype_elem));
+	pending = atomic_long_read(&h->batch.pending);
+	mem.table = cpu_to_be64(table_size);
+	mem.buckets = cpu_to_be64(ext_size - min(ext_payload, ext_size));
+	mem.extensions = cpu_to_be64(min(ext_payload, ext_size));
+	mem.comments = cpu_to_be64(set->ext_size);
+	mem.pending = cpu_to_be64(pending > 0 ? pending : 0);
+	if (ip_set_dump_stats(cb) &&
+	    (nla_put(skb, IPSET_ATTR_MEMSTAT, sizeof(mem), &mem) ||
+	     nla_put_u8(skb, IPSET_ATTR_TABLEPAGES, pages)))
+		goto nla_put_failure;
 	if (nla_put_net32(skb, IPSET_ATTR_REFERENCES, htonl(set->ref)) ||
 	    nla_put_net32(skb, IPSET_ATTR_MEMSIZE, htonl(memsize)) ||
 	    nla_put_net32(skb, IPSET_ATTR_ELEMENTS, htonl(elements)))
 		goto nla_put_failure;
+	if ((ip_set_dump_changed(cb) || ip_set_dump_reset(cb) ||
+	     ip_set_dump_stats(cb)) &&
+	    nla_put_net32(skb, IPSET_ATTR_EPOCH, htonl(epoch)))
+		goto nla_put_failure;
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (SET_WITH_BLOOM(set) &&
+	    nla_put_net32(skb, IPSET_ATTR_BLOOM_FPR, htonl(fpr)))
+		goto nla_put_failure;
+#endif
 	if (unlikely(ip_set_put_flags(skb, set)))
 		goto nla_put_failure;
 	ipset_nest_end(skb, nested);
@@ -1323,6 +4352,12 @@ mtype_uref(struct ip_set *set, struct netlink_callback *cb, bool start)
 		atomic_inc(&t->uref);
 		cb->args[IPSET_CB_PRIVATE] = (unsigned long)t;
 		rcu_read_unlock_bh();
+		/* Snapshot: the writers continue in a copy of the table,
+		 * which leaves the pinned one frozen for the listing. The
+		 * counters must be reset in the live table.
+		 */
+		if (ip_set_dump_snapshot(cb) && !ip_set_dump_reset(cb))
+			mtype_rehash(set, true, true, false);
 	} else if (cb->args[IPSET_CB_PRIVATE]) {
 		t = (struct htable *)cb->args[IPSET_CB_PRIVATE];
 		if (atomic_dec_and_test(&t->uref) && atomic_read(&t->ref)) {
@@ -1334,28 +4369,327 @@ mtype_uref(struct ip_set *set, struct netlink_callback *cb, bool start)
 	}
 }
 
+/* Free the buckets replaced by a userspace ADT batch at once */
+static void
+mtype_batch(struct ip_set *set, bool start)
+{
+	struct htype *h = set->data;
+
+	hbucket_batch(&h->batch, start);
+}
+
+#ifdef IP_SET_HASH_WITH_LPM
+/* Report the first dimension prefix of every element */
+static int
+mtype_prefixes(struct ip_set *set, void *priv,
+	       int (*fn)(void *priv, const __be32 *ip, u8 cidr))
+{
+	struct htype *h = set->data;
+	const struct htable *t;
+	const struct htable_frozen *f;
+	const struct hbucket *n;
+	const struct mtype_elem *e;
+	u32 i;
+	int j, ret = 0;
+
+	rcu_read_lock_bh();
+	t = rcu_dereference_bh(h->table);
+	f = rcu_dereference_bh(t->frozen);
+	for (i = 0; f && i < f->size && !ret; i++) {
+		e = ahash_frozen(f, i, set->dsize);
+		ret = fn(priv, mtype_data_lpm_addr(e, 0),
+			 DCIDR_GET(e->cidr, 0));
+	}
+	for (i = 0; i < jhash_size(t->htable_bits) && !ret; i++) {
+		n = rcu_dereference_bh(hbucket(t, i));
+		if (!n)
+			continue;
+		for (j = 0; j < n->pos && !ret; j++) {
+			if (!test_bit(j, n->used))
+				continue;
+			e = ahash_data(n, j, set->dsize);
+			if (SET_ELEM_EXPIRED(set, e))
+				continue;
+			ret = fn(priv, mtype_data_lpm_addr(e, 0),
+				 DCIDR_GET(e->cidr, 0));
+		}
+	}
+	rcu_read_unlock_bh();
+
+	return ret;
+}
+#endif
+
+/* Copy the elements into the empty clone, created with the header data
+ * of the set. The clone takes over the hash keys, so the buckets are
+ * copied as they are and only the extensions are duplicated.
+ */
+static int
+mtype_clone(struct ip_set *set, struct ip_set *clone)
+{
+	struct htype *h = set->data, *hc = clone->data;
+	struct htable *t, *tc = __ipset_dereference(hc->table);
+	const struct htable_frozen *f;
+	size_t dsize = set->dsize;
+	struct hbucket *n, *m;
+	struct mtype_elem *d;
+	u32 i, j, r, hash, hash2;
+	long charge;
+#ifdef IP_SET_HASH_WITH_NETS
+	int k;
+#endif
+	int ret = 0;
+
+	/* No resizing while the table is copied */
+	mutex_lock(&h->resize.lock);
+	t = ipset_dereference_resize(h->table, h);
+	f = __ipset_dereference(t->frozen);
+	if ((f ? f->htable_bits : t->htable_bits) != tc->htable_bits ||
+	    t->region_bits != tc->region_bits) {
+		ret = -IPSET_ERR_TYPE_MISMATCH;
+		goto out;
+	}
+	htable_seed_copy(tc, t);
+	if (f) {
+		/* The clone is not frozen: the elements go into buckets */
+		charge = htable_charge(tc);
+		for (i = 0; i < f->size; i++) {
+			d = ahash_frozen(f, i, dsize);
+			mtype_frozen_hash(hc, tc, f, d, &hash, &hash2);
+			ret = mtype_rehash_elem(clone, tc, d, hash, &m);
+			if (ret < 0)
+				break;
+			d = ahash_data(m, m->pos - 1, dsize);
+			ip_set_ext_clone(clone, d);
+#ifdef IP_SET_HASH_WITH_NETS
+			for (k = 0; k < IPSET_NET_COUNT; k++)
+				mtype_add_cidr(clone, hc, d,
+					NCIDR_PUT(DCIDR_GET(d->cidr, k)), k);
+#endif
+			if (!(i % 1024))
+				cond_resched();
+		}
+		ip_set_mem_charge(clone, htable_charge(tc) - charge, true);
+		if (ret == -EAGAIN)
+			ret = -IPSET_ERR_HASH_FULL;
+		goto out;
+	}
+	for (r = 0; r < ahash_numof_locks(t); r++) {
+		/* Expire may replace a hbucket with another one */
+		rcu_read_lock_bh();
+		for (i = ahash_bucket_start(r, t);
+		     i < ahash_bucket_end(r, t); i++) {
+			n = rcu_dereference_bh(hbucket(t, i));
+			if (!n || !n->pos)
+				continue;
+			m = __ipset_dereference(hbucket(tc, i));
+			/* Preallocated buckets are used when large enough */
+			if (!m || m->size < n->pos) {
+				struct hbucket *old = m;
+
+				m = hbucket_alloc(hc->bcache, n->size,
+						  hc->numa, i);
+				if (!m) {
+					rcu_read_unlock_bh();
+					ret = -ENOMEM;
+					goto out;
+				}
+				if (!ahash_ext_size(clone, tc, r,
+						    hbucket_size(hc->bcache,
+								 m->size))) {
+					rcu_read_unlock_bh();
+					kfree(m);
+					ret = -IPSET_ERR_MEM_BUDGET;
+					goto out;
+				}
+				if (old) {
+					ahash_ext_size(clone, tc, r,
+						-(long)hbucket_size(hc->bcache,
+								    old->size));
+					kfree(old);
+				}
+				RCU_INIT_POINTER(hbucket(tc, i), m);
+			}
+			memcpy(m->value, n->value, n->pos * dsize);
+			m->pos = n->pos;
+			for (j = 0; j < n->pos; j++) {
+				d = ahash_data(m, j, dsize);
+				if (!test_bit(j, n->used) ||
+				    SET_ELEM_EXPIRED(set, d))
+					continue;
+				set_bit(j, m->used);
+				ip_set_ext_clone(clone, d);
+				tc->hregion[r].elements++;
+#ifdef IP_SET_HASH_WITH_NETS
+				for (k = 0; k < IPSET_NET_COUNT; k++)
+					mtype_add_cidr(clone, hc, d,
+						NCIDR_PUT(DCIDR_GET(d->cidr, k)),
+						k);
+#endif
+			}
+		}
+		rcu_read_unlock_bh();
+		cond_resched();
+	}
+	/* The filter and the expiry index may cover the skipped
+	 * elements as well, which is harmless.
+	 */
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (t->bloom && tc->bloom) {
+		memcpy(tc->bloom, t->bloom, htable_bloom_size(t->htable_bits));
+		atomic_set(&tc->bloom_fill, atomic_read(&t->bloom_fill));
+	}
+#endif
+	if (t->expiry && tc->expiry) {
+		memcpy(tc->expiry, t->expiry,
+		       htable_expiry_size(t->htable_bits));
+		tc->expiry_slots = t->expiry_slots;
+	}
+out:
+	mutex_unlock(&h->resize.lock);
+	return ret;
+}
+
+/* Reset the counters of the elements of a bucket put into the message:
+ * the attributes follow the order of the listed positions.
+ */
+static void
+mtype_list_reset(const struct ip_set *set, const struct hbucket *n,
+		 const unsigned long *listed, void *start, struct sk_buff *skb)
+{
+	const struct nlattr *nla;
+	unsigned int i = 0;
+	int rem;
+
+	nla_for_each_attr(nla, start, (void *)skb_tail_pointer(skb) - start,
+			  rem) {
+		i = find_next_bit(listed, n->pos, i);
+		if (i >= n->pos)
+			break;
+		ip_set_reset_counter(set, ahash_data(n, i++, set->dsize), nla);
+	}
+}
+
+/* Compute the counter value of the top elements before listing them */
+static int
+mtype_top(const struct ip_set *set, const struct htable *t,
+	  struct ip_set_dump_opt *opt)
+{
+	const struct htable_frozen *f;
+	const struct hbucket *n;
+	const struct mtype_elem *e;
+	u32 i, size = 0;
+	u64 *heap;
+	int j;
+
+	heap = ip_set_alloc(opt->top * sizeof(u64));
+	if (!heap)
+		return -ENOMEM;
+	rcu_read_lock();
+	for (i = 0; ; i++) {
+		/* A flush frees the array after a grace period */
+		cond_resched_rcu();
+		f = rcu_dereference(t->frozen);
+		if (!f || i >= f->size)
+			break;
+		ip_set_top_add(heap, &size, opt->top,
+			       ip_set_top_value(set,
+						ahash_frozen(f, i, set->dsize),
+						opt->top_by));
+	}
+	for (i = 0; i < jhash_size(t->htable_bits); i++) {
+		cond_resched_rcu();
+		n = rcu_dereference(hbucket(t, i));
+		if (!n)
+			continue;
+		for (j = 0; j < n->pos; j++) {
+			if (!test_bit(j, n->used))
+				continue;
+			e = ahash_data(n, j, set->dsize);
+			if (SET_ELEM_EXPIRED(set, e))
+				continue;
+			ip_set_top_add(heap, &size, opt->top,
+				       ip_set_top_value(set, e, opt->top_by));
+		}
+	}
+	rcu_read_unlock();
+	/* Fewer elements than requested: all of them are listed */
+	opt->threshold = size < opt->top ? 0 : heap[0];
+	ip_set_free(heap);
+
+	return 0;
+}
+
 /* Reply a LIST/SAVE request: dump the elements of the specified set */
 static int
 mtype_list(const struct ip_set *set,
 	   struct sk_buff *skb, struct netlink_callback *cb)
 {
 	const struct htable *t;
+	const struct htable_frozen *f;
 	struct nlattr *atd, *nested;
 	const struct hbucket *n;
 	const struct mtype_elem *e;
 	u32 first = cb->args[IPSET_CB_ARG0];
+	/* Only the buckets changed in the epoch or later are listed */
+	u32 since = ip_set_dump_since(cb);
+	bool reset = SET_WITH_COUNTER(set) && ip_set_dump_reset(cb);
+	struct ip_set_dump_opt *opt = ip_set_dump_opt(cb);
+	bool top = opt && opt->top && SET_WITH_COUNTER(set);
+	DECLARE_BITMAP(listed, AHASH_MAX_TUNED);
 	/* We assume that one hash bucket fills into one page */
 	void *incomplete;
 	int i, ret = 0;
 
+	t = (const struct htable *)cb->args[IPSET_CB_PRIVATE];
+	/* The threshold is computed once, when the listing starts */
+	if (top && !first) {
+		ret = mtype_top(set, t, opt);
+		if (ret)
+			return ret;
+	}
 	atd = ipset_nest_start(skb, IPSET_ATTR_ADT);
 	if (!atd)
 		return -EMSGSIZE;
 
 	pr_debug("list hash set %s\n", set->name);
-	t = (const struct htable *)cb->args[IPSET_CB_PRIVATE];
 	/* Expire may replace a hbucket with another one */
 	rcu_read_lock();
+	if (rcu_access_pointer(t->frozen)) {
+		/* The slots of the array are listed one by one */
+		for (;; cb->args[IPSET_CB_ARG0]++) {
+			/* A flush frees the array after a grace period */
+			cond_resched_rcu();
+			f = rcu_dereference(t->frozen);
+			if (!f || cb->args[IPSET_CB_ARG0] >= f->size ||
+			    (f->epoch < since && !SET_WITH_COUNTER(set)))
+				break;
+			incomplete = skb_tail_pointer(skb);
+			e = ahash_frozen(f, cb->args[IPSET_CB_ARG0], set->dsize);
+			if (top && ip_set_top_value(set, e, opt->top_by) <
+				   opt->threshold)
+				continue;
+			nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
+			if (!nested) {
+				if (cb->args[IPSET_CB_ARG0] == first) {
+					nla_nest_cancel(skb, atd);
+					ret = -EMSGSIZE;
+					goto out;
+				}
+				goto nla_put_failure;
+			}
+			if (mtype_data_list(skb, e))
+				goto nla_put_failure;
+			if (ip_set_put_extensions(skb, set, e, true))
+				goto nla_put_failure;
+			ipset_nest_end(skb, nested);
+			if (reset)
+				ip_set_reset_counter(set,
+					ahash_frozen(f, cb->args[IPSET_CB_ARG0],
+						     set->dsize), nested);
+		}
+		goto done;
+	}
 	for (; cb->args[IPSET_CB_ARG0] < jhash_size(t->htable_bits);
 	     cb->args[IPSET_CB_ARG0]++) {
 		cond_resched_rcu();
@@ -1363,14 +4697,19 @@ mtype_list(const struct ip_set *set,
 		n = rcu_dereference(hbucket(t, cb->args[IPSET_CB_ARG0]));
 		pr_debug("cb->arg bucket: %lu, t %p n %p\n",
 			 cb->args[IPSET_CB_ARG0], t, n);
-		if (!n)
+		if (!n || READ_ONCE(n->epoch) < since)
 			continue;
+		if (reset)
+			bitmap_zero(listed, AHASH_MAX_TUNED);
 		for (i = 0; i < n->pos; i++) {
 			if (!test_bit(i, n->used))
 				continue;
 			e = ahash_data(n, i, set->dsize);
 			if (SET_ELEM_EXPIRED(set, e))
 				continue;
+			if (top && ip_set_top_value(set, e, opt->top_by) <
+				   opt->threshold)
+				continue;
 			pr_debug("list hash %lu hbucket %p i %u, data %p\n",
 				 cb->args[IPSET_CB_ARG0], n, i, e);
 			nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
@@ -1387,8 +4726,14 @@ mtype_list(const struct ip_set *set,
 			if (ip_set_put_extensions(skb, set, e, true))
 				goto nla_put_failure;
 			ipset_nest_end(skb, nested);
+			if (reset)
+				set_bit(i, listed);
 		}
+		/* The bucket is in the message as a whole */
+		if (reset)
+			mtype_list_reset(set, n, listed, incomplete, skb);
 	}
+done:
 	ipset_nest_end(skb, atd);
 	/* Set listing finished */
 	cb->args[IPSET_CB_ARG0] = 0;
@@ -1398,8 +4743,7 @@ mtype_list(const struct ip_set *set,
 nla_put_failure:
 	nlmsg_trim(skb, incomplete);
 	if (unlikely(first == cb->args[IPSET_CB_ARG0])) {
-		pr_warn("Can't list set %s: one bucket does not fit into a message. Please report it!\n",
-			set->name);
+		/* The core decides whether it is an error */
 		cb->args[IPSET_CB_ARG0] = 0;
 		ret = -EMSGSIZE;
 	} else {
@@ -1420,9 +4764,22 @@ IPSET_TOKEN(MTYPE, _uadt)(struct ip_set *set, struct nlattr *tb[],
 			  enum ipset_adt adt, u32 *lineno, u32 flags,
 			  bool retried);
 
+#ifdef IP_SET_HASH_WITH_PACKED
+static int
+IPSET_TOKEN(MTYPE, _uadt_packed)(struct ip_set *set,
+				 const struct ip_set_adt_packed *p,
+				 enum ipset_adt adt, u32 *index, u32 flags);
+#endif
+
 static const struct ip_set_type_variant mtype_variant = {
 	.kadt	= mtype_kadt,
+#ifndef IP_SET_HASH_WITH_NETS
+	.test_bulk = mtype_test_bulk,
+#endif
 	.uadt	= mtype_uadt,
+#ifdef IP_SET_HASH_WITH_PACKED
+	.uadt_packed = mtype_uadt_packed,
+#endif
 	.adt	= {
 		[IPSET_ADD] = mtype_add,
 		[IPSET_DEL] = mtype_del,
@@ -1433,10 +4790,54 @@ static const struct ip_set_type_variant mtype_variant = {
 	.head	= mtype_head,
 	.list	= mtype_list,
 	.uref	= mtype_uref,
+	.batch	= mtype_batch,
+#ifdef IP_SET_HASH_WITH_LPM
+	.prefixes = mtype_prefixes,
+#endif
+	.clone	= mtype_clone,
+#ifndef IP_SET_HASH_WITH_MULTI
+	.freeze	= mtype_freeze,
+#endif
+	.purge	= mtype_purge,
+	.lookupstat = mtype_lookupstat,
+	.resize	= mtype_resize,
+	.same_set = mtype_same_set,
+	.region_lock = true,
+	.txn	= true,
+};
+
+#ifdef IP_SET_HASH_WITH_LEAN
+/* Variant of the sets without extensions */
+static const struct ip_set_type_variant mtype_lean_variant = {
+	.kadt	= mtype_kadt,
+	.test_bulk = mtype_test_bulk,
+	.uadt	= mtype_uadt,
+#ifdef IP_SET_HASH_WITH_PACKED
+	.uadt_packed = mtype_uadt_packed,
+#endif
+	.adt	= {
+		[IPSET_ADD] = mtype_add,
+		[IPSET_DEL] = mtype_del,
+		[IPSET_TEST] = mtype_test_lean,
+	},
+	.destroy = mtype_destroy,
+	.flush	= mtype_flush,
+	.head	= mtype_head,
+	.list	= mtype_list,
+	.uref	= mtype_uref,
+	.batch	= mtype_batch,
+	.clone	= mtype_clone,
+#ifndef IP_SET_HASH_WITH_MULTI
+	.freeze	= mtype_freeze,
+#endif
+	.purge	= mtype_purge,
+	.lookupstat = mtype_lookupstat,
 	.resize	= mtype_resize,
 	.same_set = mtype_same_set,
 	.region_lock = true,
+	.txn	= true,
 };
+#endif
 
 #ifdef IP_SET_EMIT_CREATE
 static int
@@ -1447,30 +4848,38 @@ IPSET_TOKEN(HTYPE, _create)(struct net *net, struct ip_set *set,
 #ifdef IP_SET_HASH_WITH_MARKMASK
 	u32 markmask;
 #endif
-	u8 hbits;
+	u8 hbits, pages = IPSET_PAGES_SMALL;
 #ifdef IP_SET_HASH_WITH_NETMASK
 	u8 netmask;
 #endif
 	size_t hsize;
 	struct htype *h;
 	struct htable *t;
+	int numa = NUMA_NO_NODE;
 	u32 i;
 
 	pr_debug("Create set %s with family %s\n",
-		 set->name, set->family == NFPROTO_IPV4 ? "inet" : "inet6");
+		 set->name, set->family == NFPROTO_IPV4 ? "inet" :
+			    set->family == NFPROTO_IPV6 ? "inet6" : "inet46");
 
 #ifdef IP_SET_PROTO_UNDEF
 	if (set->family != NFPROTO_UNSPEC)
 		return -IPSET_ERR_INVALID_FAMILY;
 #else
-	if (!(set->family == NFPROTO_IPV4 || set->family == NFPROTO_IPV6))
+	if (!(set->family == NFPROTO_IPV4 || set->family == NFPROTO_IPV6
+#ifdef IP_SET_HASH_WITH_INET
+	      /* Dual-stack: the IPv6 variant with IPv4-mapped addresses */
+	      || set->family == NFPROTO_INET
+#endif
+	      ))
 		return -IPSET_ERR_INVALID_FAMILY;
 #endif
 
 	if (unlikely(!ip_set_optattr_netorder(tb, IPSET_ATTR_HASHSIZE) ||
 		     !ip_set_optattr_netorder(tb, IPSET_ATTR_MAXELEM) ||
 		     !ip_set_optattr_netorder(tb, IPSET_ATTR_TIMEOUT) ||
-		     !ip_set_optattr_netorder(tb, IPSET_ATTR_CADT_FLAGS)))
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_CADT_FLAGS) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_NUMA)))
 		return -IPSET_ERR_PROTOCOL;
 
 #ifdef IP_SET_HASH_WITH_MARKMASK
@@ -1493,6 +4902,7 @@ IPSET_TOKEN(HTYPE, _create)(struct net *net, struct ip_set *set,
 
 		if ((set->family == NFPROTO_IPV4 && netmask > 32) ||
 		    (set->family == NFPROTO_IPV6 && netmask > 128) ||
+		    set->family == NFPROTO_INET ||
 		    netmask == 0)
 			return -IPSET_ERR_INVALID_NETMASK;
 	}
@@ -1507,6 +4917,33 @@ IPSET_TOKEN(HTYPE, _create)(struct net *net, struct ip_set *set,
 	if (tb[IPSET_ATTR_MAXELEM])
 		maxelem = ip_set_get_h32(tb[IPSET_ATTR_MAXELEM]);
 
+	if (tb[IPSET_ATTR_CADT_FLAGS] &&
+	    (ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]) &
+	     IPSET_FLAG_WITH_PREALLOC)) {
+		/* Room for maxelem at an average AHASH_INIT_SIZE per bucket */
+		if (hashsize < maxelem / AHASH_INIT_SIZE)
+			hashsize = maxelem / AHASH_INIT_SIZE;
+		set->flags |= IPSET_CREATE_FLAG_PREALLOC;
+	}
+
+	if (tb[IPSET_ATTR_HASHFN] &&
+	    nla_get_u8(tb[IPSET_ATTR_HASHFN]) >= __IPSET_HASHFN_MAX)
+		return -IPSET_ERR_PROTOCOL;
+	if (tb[IPSET_ATTR_REGIONBITS] &&
+	    (nla_get_u8(tb[IPSET_ATTR_REGIONBITS]) < HTABLE_REGION_BITS_MIN ||
+	     nla_get_u8(tb[IPSET_ATTR_REGIONBITS]) > HTABLE_REGION_BITS_MAX))
+		return -IPSET_ERR_PROTOCOL;
+	if (tb[IPSET_ATTR_NUMA]) {
+		u32 node = ip_set_get_h32(tb[IPSET_ATTR_NUMA]);
+
+		if (node == IPSET_NUMA_INTERLEAVE)
+			numa = HTABLE_NUMA_INTERLEAVE;
+		else if (node < nr_node_ids && node_online(node))
+			numa = node;
+		else
+			return -IPSET_ERR_HASH_NUMA_NODE;
+	}
+
 	hsize = sizeof(*h);
 	h = kzalloc(hsize, GFP_KERNEL);
 	if (!h)
@@ -1522,20 +4959,34 @@ IPSET_TOKEN(HTYPE, _create)(struct net *net, struct ip_set *set,
 		kfree(h);
 		return -ENOMEM;
 	}
-	t = ip_set_alloc(hsize);
+	h->numa = numa;
+	atomic_set(&h->epoch, 1);
+	t = ip_set_alloc_huge(hsize, htable_node(numa), &pages);
 	if (!t) {
 		kfree(h);
 		return -ENOMEM;
 	}
-	t->hregion = ip_set_alloc(ahash_sizeof_regions(hbits));
+	t->pages = pages;
+	t->htable_bits = hbits;
+	t->region_bits = HTABLE_REGION_BITS;
+	if (tb[IPSET_ATTR_REGIONBITS])
+		t->region_bits = nla_get_u8(tb[IPSET_ATTR_REGIONBITS]);
+	t->hregion = ip_set_alloc_node(ahash_sizeof_regions(t),
+				       htable_node(numa));
 	if (!t->hregion) {
 		ip_set_free(t);
 		kfree(h);
 		return -ENOMEM;
 	}
-	h->gc.set = set;
-	for (i = 0; i < ahash_numof_locks(hbits); i++)
+	h->resize.set = set;
+	h->async.set = set;
+	h->resize.htable_bits = hbits;
+	h->resize.min_bits = hbits;
+	mutex_init(&h->resize.lock);
+	for (i = 0; i < ahash_numof_locks(t); i++) {
 		spin_lock_init(&t->hregion[i].lock);
+		u64_stats_init(&t->hregion[i].syncp);
+	}
 	h->maxelem = maxelem;
 #ifdef IP_SET_HASH_WITH_NETMASK
 	h->netmask = netmask;
@@ -1543,10 +4994,11 @@ IPSET_TOKEN(HTYPE, _create)(struct net *net, struct ip_set *set,
 #ifdef IP_SET_HASH_WITH_MARKMASK
 	h->markmask = markmask;
 #endif
+	htable_seed(t);
 	if (tb[IPSET_ATTR_INITVAL])
-		h->initval = ntohl(nla_get_be32(tb[IPSET_ATTR_INITVAL]));
-	else
-		get_random_bytes(&h->initval, sizeof(h->initval));
+		t->initval = ntohl(nla_get_be32(tb[IPSET_ATTR_INITVAL]));
+	if (tb[IPSET_ATTR_HASHFN])
+		h->hashfn = nla_get_u8(tb[IPSET_ATTR_HASHFN]);
 	h->bucketsize = AHASH_MAX_SIZE;
 	if (tb[IPSET_ATTR_BUCKETSIZE]) {
 		h->bucketsize = nla_get_u8(tb[IPSET_ATTR_BUCKETSIZE]);
@@ -1557,9 +5009,46 @@ IPSET_TOKEN(HTYPE, _create)(struct net *net, struct ip_set *set,
 		else if (h->bucketsize % 2)
 			h->bucketsize += 1;
 	}
-	t->htable_bits = hbits;
-	t->maxelem = h->maxelem / ahash_numof_locks(hbits);
+	t->maxelem = h->maxelem / ahash_numof_locks(t);
 	RCU_INIT_POINTER(h->table, t);
+#ifdef IP_SET_HASH_WITH_LPM
+	if (tb[IPSET_ATTR_CADT_FLAGS] &&
+	    (ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]) & IPSET_FLAG_WITH_LPM))
+		set->flags |= IPSET_CREATE_FLAG_LPM;
+#endif
+#ifdef IP_SET_HASH_WITH_AGGREGATE
+	if (tb[IPSET_ATTR_CADT_FLAGS] &&
+	    (ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]) &
+	     IPSET_FLAG_WITH_AGGREGATE))
+		set->flags |= IPSET_CREATE_FLAG_AGGREGATE;
+#endif
+#ifdef IP_SET_HASH_WITH_BLOOM
+	if (tb[IPSET_ATTR_CADT_FLAGS] &&
+	    (ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]) & IPSET_FLAG_WITH_BLOOM)) {
+		t->bloom = ip_set_alloc_node(htable_bloom_size(hbits),
+					     htable_node(numa));
+		if (!t->bloom) {
+			ip_set_free(t->hregion);
+			ip_set_free(t);
+			kfree(h);
+			return -ENOMEM;
+		}
+		set->flags |= IPSET_CREATE_FLAG_BLOOM;
+	}
+#endif
+	if (tb[IPSET_ATTR_TIMEOUT]) {
+		t->expiry = ip_set_alloc_node(htable_expiry_size(hbits),
+					      htable_node(numa));
+		if (!t->expiry) {
+#ifdef IP_SET_HASH_WITH_BLOOM
+			ip_set_free(t->bloom);
+#endif
+			ip_set_free(t->hregion);
+			ip_set_free(t);
+			kfree(h);
+			return -ENOMEM;
+		}
+	}
 
 	INIT_LIST_HEAD(&h->ad);
 	set->data = h;
@@ -1570,26 +5059,68 @@ IPSET_TOKEN(HTYPE, _create)(struct net *net, struct ip_set *set,
 		set->dsize = ip_set_elem_len(set, tb,
 			sizeof(struct IPSET_TOKEN(HTYPE, 4_elem)),
 			__alignof__(struct IPSET_TOKEN(HTYPE, 4_elem)));
+#ifdef IP_SET_HASH_WITH_LEAN
+		if (set->dsize == sizeof(struct IPSET_TOKEN(HTYPE, 4_elem)))
+			set->variant = &IPSET_TOKEN(HTYPE, 4_lean_variant);
+#endif
+		IPSET_TOKEN(HTYPE, 4_resize_init)(&h->resize);
+		IPSET_TOKEN(HTYPE, 4_async_init)(&h->async);
 #ifndef IP_SET_PROTO_UNDEF
 	} else {
 		set->variant = &IPSET_TOKEN(HTYPE, 6_variant);
 		set->dsize = ip_set_elem_len(set, tb,
 			sizeof(struct IPSET_TOKEN(HTYPE, 6_elem)),
 			__alignof__(struct IPSET_TOKEN(HTYPE, 6_elem)));
+#ifdef IP_SET_HASH_WITH_LEAN
+		if (set->dsize == sizeof(struct IPSET_TOKEN(HTYPE, 6_elem)))
+			set->variant = &IPSET_TOKEN(HTYPE, 6_lean_variant);
+#endif
+		IPSET_TOKEN(HTYPE, 6_resize_init)(&h->resize);
+		IPSET_TOKEN(HTYPE, 6_async_init)(&h->async);
 	}
 #endif
+	h->bcache = hbucket_cache_get(set->type->name, set->dsize);
+	if (!h->bcache) {
+#ifdef IP_SET_HASH_WITH_BLOOM
+		ip_set_free(t->bloom);
+#endif
+		ip_set_free(t->expiry);
+		ip_set_free(t->hregion);
+		ip_set_free(t);
+		kfree(h);
+		set->data = NULL;
+		return -ENOMEM;
+	}
+	if (SET_WITH_PREALLOC(set) &&
+	    htable_prealloc(t, h->bcache, AHASH_MAX(h), numa)) {
+		mtype_ahash_destroy(set, t, false);
+		hbucket_cache_put(h->bcache);
+		kfree(h);
+		set->data = NULL;
+		return -ENOMEM;
+	}
+	h->lstat = alloc_percpu(struct ip_set_lookupstat);
+	if (!h->lstat) {
+		mtype_ahash_destroy(set, t, false);
+		hbucket_cache_put(h->bcache);
+		kfree(h);
+		set->data = NULL;
+		return -ENOMEM;
+	}
 	set->timeout = IPSET_NO_TIMEOUT;
 	if (tb[IPSET_ATTR_TIMEOUT]) {
 		set->timeout = ip_set_timeout_uget(tb[IPSET_ATTR_TIMEOUT]);
 #ifndef IP_SET_PROTO_UNDEF
 		if (set->family == NFPROTO_IPV4)
 #endif
-			IPSET_TOKEN(HTYPE, 4_gc_init)(&h->gc);
+			IPSET_TOKEN(HTYPE, 4_gc_init)(set, &h->gc);
 #ifndef IP_SET_PROTO_UNDEF
 		else
-			IPSET_TOKEN(HTYPE, 6_gc_init)(&h->gc);
+			IPSET_TOKEN(HTYPE, 6_gc_init)(set, &h->gc);
 #endif
 	}
+	/* The empty table is always accepted */
+	ip_set_mem_charge(set, htable_charge(t), true);
 	pr_debug("create %s hashsize %u (%u) maxelem %u: %p(%p)\n",
 		 set->name, jhash_size(t->htable_bits),
 		 t->htable_bits, h->maxelem, set->data, t);
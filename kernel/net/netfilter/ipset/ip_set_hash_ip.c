@@ -25,7 +25,18 @@
 /*				2	   Comments support */
 /*				3	   Forceadd support */
 /*				4	   skbinfo support */
-#define IPSET_TYPE_REV_MAX	5	/* bucketsize, initval support  */
+/*				5	   bucketsize, initval support */
+/*				6	   percpu counters support */
+/*				7	   bloom filter support */
+/*				8	   hashfn support */
+/*				9	   prealloc support */
+/*				10	   regionbits support */
+/*				11	   numa support */
+/*				12	   counter sampling support */
+/*				13	   packed element arrays support */
+/*				14	   rate limit support */
+/*				15	   dual-stack family support */
+#define IPSET_TYPE_REV_MAX	16	/* conntrack events support */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -35,6 +46,11 @@ MODULE_ALIAS("ip_set_hash:ip");
 /* Type specific function prefix */
 #define HTYPE		hash_ip
 #define IP_SET_HASH_WITH_NETMASK
+#define IP_SET_HASH_WITH_SCAN
+#define IP_SET_HASH_WITH_LEAN
+#define IP_SET_HASH_WITH_BLOOM
+#define IP_SET_HASH_WITH_PACKED
+#define IP_SET_HASH_WITH_INET
 
 /* IPv4 variant */
 
@@ -71,6 +87,21 @@ hash_ip4_data_next(struct hash_ip4_elem *next, const struct hash_ip4_elem *e)
 	next->ip = e->ip;
 }
 
+/* Branch free comparison of the key with an array of keys,
+ * which the compiler can vectorize
+ */
+static unsigned long
+hash_ip4_data_scan(const struct hash_ip4_elem *array, u8 num,
+		   const struct hash_ip4_elem *e)
+{
+	unsigned long match = 0;
+	u8 i;
+
+	for (i = 0; i < num; i++)
+		match |= (unsigned long)(array[i].ip == e->ip) << i;
+	return match;
+}
+
 #define MTYPE		hash_ip4
 #define HOST_MASK	32
 #include "ip_set_hash_gen.h"
@@ -99,7 +130,7 @@ static int
 hash_ip4_uadt(struct ip_set *set, struct nlattr *tb[],
 	      enum ipset_adt adt, u32 *lineno, u32 flags, bool retried)
 {
-	const struct hash_ip4 *h = set->data;
+	struct hash_ip4 *h = set->data;
 	ipset_adtfn adtfn = set->variant->adt[adt];
 	struct hash_ip4_elem e = { 0 };
 	struct ip_set_ext ext = IP_SET_INIT_UEXT(set);
@@ -155,6 +186,13 @@ hash_ip4_uadt(struct ip_set *set, struct nlattr *tb[],
 		ip = ntohl(h->next.ip);
 		e.ip = htonl(ip);
 	}
+	if (adt == IPSET_ADD && ip < ip_to) {
+		ret = hash_ip4_reserve(set, ((u64)ip_to - ip) / hosts + 1);
+		if (ret) {
+			hash_ip4_data_next(&h->next, &e);
+			return ret;
+		}
+	}
 	for (; ip <= ip_to;) {
 		ret = adtfn(set, &e, &ext, &ext, flags);
 		if (ret && !ip_set_eexist(ret, flags))
@@ -170,6 +208,36 @@ hash_ip4_uadt(struct ip_set *set, struct nlattr *tb[],
 	return ret;
 }
 
+static int
+hash_ip4_uadt_packed(struct ip_set *set, const struct ip_set_adt_packed *p,
+		     enum ipset_adt adt, u32 *index, u32 flags)
+{
+	const struct hash_ip4 *h = set->data;
+	ipset_adtfn adtfn = set->variant->adt[adt];
+	struct hash_ip4_elem e = { 0 };
+	struct ip_set_ext ext = IP_SET_INIT_UEXT(set);
+	__be32 netmask = ip_set_netmask(h->netmask);
+	const void *elem;
+	int ret;
+
+	if (p->flags & IPSET_PACKED_TIMEOUT && !SET_WITH_TIMEOUT(set))
+		return -IPSET_ERR_TIMEOUT;
+
+	for (; *index < p->count; (*index)++) {
+		elem = ip_set_packed_elem(p, *index);
+		e.ip = *(const __be32 *)elem & netmask;
+		if (e.ip == 0)
+			return -IPSET_ERR_HASH_ELEM;
+		if (p->flags & IPSET_PACKED_TIMEOUT)
+			ext.timeout = ip_set_packed_timeout(p, elem);
+
+		ret = adtfn(set, &e, &ext, &ext, flags);
+		if (ret && !ip_set_eexist(ret, flags))
+			return ret;
+	}
+	return 0;
+}
+
 /* IPv6 variant */
 
 /* Member elements */
@@ -209,6 +277,22 @@ hash_ip6_data_next(struct hash_ip6_elem *next, const struct hash_ip6_elem *e)
 {
 }
 
+static unsigned long
+hash_ip6_data_scan(const struct hash_ip6_elem *array, u8 num,
+		   const struct hash_ip6_elem *e)
+{
+	unsigned long match = 0;
+	u8 i;
+
+	for (i = 0; i < num; i++)
+		match |= (unsigned long)(((array[i].ip.all[0] ^ e->ip.all[0]) |
+					  (array[i].ip.all[1] ^ e->ip.all[1]) |
+					  (array[i].ip.all[2] ^ e->ip.all[2]) |
+					  (array[i].ip.all[3] ^ e->ip.all[3])) == 0)
+			 << i;
+	return match;
+}
+
 #undef MTYPE
 #undef HOST_MASK
 
@@ -228,7 +312,7 @@ hash_ip6_kadt(struct ip_set *set, const struct sk_buff *skb,
 	struct hash_ip6_elem e = { { .all = { 0 } } };
 	struct ip_set_ext ext = IP_SET_INIT_KEXT(skb, opt, set);
 
-	ip6addrptr(skb, opt->flags & IPSET_DIM_ONE_SRC, &e.ip.in6);
+	inetaddrptr(skb, opt->family, opt->flags & IPSET_DIM_ONE_SRC, &e.ip.in6);
 	hash_ip6_netmask(&e.ip, h->netmask);
 	if (ipv6_addr_any(&e.ip.in6))
 		return -EINVAL;
@@ -277,6 +361,36 @@ hash_ip6_uadt(struct ip_set *set, struct nlattr *tb[],
 	return ip_set_eexist(ret, flags) ? 0 : ret;
 }
 
+static int
+hash_ip6_uadt_packed(struct ip_set *set, const struct ip_set_adt_packed *p,
+		     enum ipset_adt adt, u32 *index, u32 flags)
+{
+	const struct hash_ip6 *h = set->data;
+	ipset_adtfn adtfn = set->variant->adt[adt];
+	struct hash_ip6_elem e = { { .all = { 0 } } };
+	struct ip_set_ext ext = IP_SET_INIT_UEXT(set);
+	const void *elem;
+	int ret;
+
+	if (p->flags & IPSET_PACKED_TIMEOUT && !SET_WITH_TIMEOUT(set))
+		return -IPSET_ERR_TIMEOUT;
+
+	for (; *index < p->count; (*index)++) {
+		elem = ip_set_packed_elem(p, *index);
+		memcpy(&e.ip.in6, elem, sizeof(e.ip.in6));
+		hash_ip6_netmask(&e.ip, h->netmask);
+		if (ipv6_addr_any(&e.ip.in6))
+			return -IPSET_ERR_HASH_ELEM;
+		if (p->flags & IPSET_PACKED_TIMEOUT)
+			ext.timeout = ip_set_packed_timeout(p, elem);
+
+		ret = adtfn(set, &e, &ext, &ext, flags);
+		if (ret && !ip_set_eexist(ret, flags))
+			return ret;
+	}
+	return 0;
+}
+
 static struct ip_set_type hash_ip_type __read_mostly = {
 	.name		= "hash:ip",
 	.protocol	= IPSET_PROTOCOL,
@@ -285,12 +399,31 @@ static struct ip_set_type hash_ip_type __read_mostly = {
 	.family		= NFPROTO_UNSPEC,
 	.revision_min	= IPSET_TYPE_REV_MIN,
 	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create_flags[5] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[6] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[7] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[8] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[9] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[10] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[11] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[12] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[13] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[14] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[15] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create_flags[IPSET_TYPE_REV_MAX] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create		= hash_ip_create,
 	.create_policy	= {
 		[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
 		[IPSET_ATTR_INITVAL]	= { .type = NLA_U32 },
+		[IPSET_ATTR_HASHFN]	= { .type = NLA_U8 },
+		[IPSET_ATTR_REGIONBITS] = { .type = NLA_U8 },
+		[IPSET_ATTR_NUMA]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
+		[IPSET_ATTR_RATE]	= { .type = NLA_U32 },
+		[IPSET_ATTR_BURST]	= { .type = NLA_U32 },
+		[IPSET_ATTR_CTEVENTS]	= { .type = NLA_U32 },
+		[IPSET_ATTR_CTDIR]	= { .type = NLA_U32 },
 		[IPSET_ATTR_BUCKETSIZE]	= { .type = NLA_U8 },
 		[IPSET_ATTR_RESIZE]	= { .type = NLA_U8  },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
@@ -310,6 +443,8 @@ static struct ip_set_type hash_ip_type __read_mostly = {
 		[IPSET_ATTR_SKBMARK]	= { .type = NLA_U64 },
 		[IPSET_ATTR_SKBPRIO]	= { .type = NLA_U32 },
 		[IPSET_ATTR_SKBQUEUE]	= { .type = NLA_U16 },
+		[IPSET_ATTR_RATE]	= { .type = NLA_U32 },
+		[IPSET_ATTR_BURST]	= { .type = NLA_U32 },
 	},
 	.me		= THIS_MODULE,
 };
@@ -323,6 +458,7 @@ hash_ip_init(void)
 static void __exit
 hash_ip_fini(void)
 {
+	htable_free_wait();
 	rcu_barrier();
 	ip_set_type_unregister(&hash_ip_type);
 }
@@ -23,7 +23,13 @@
 #include <linux/netfilter/ipset/ip_set_hash.h>
 
 #define IPSET_TYPE_REV_MIN	0
-#define IPSET_TYPE_REV_MAX	1	/* bucketsize, initval support  */
+/*				1	   bucketsize, initval support */
+/*				2	   percpu counters support */
+/*				3	   hashfn support */
+/*				4	   prealloc support */
+/*				5	   regionbits support */
+/*				6	   numa support */
+#define IPSET_TYPE_REV_MAX	7	/* counter sampling support */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Tomasz Chilinski <tomasz.chilinski@chilan.com>");
@@ -268,12 +274,22 @@ static struct ip_set_type hash_ipmac_type __read_mostly = {
 	.family		= NFPROTO_UNSPEC,
 	.revision_min	= IPSET_TYPE_REV_MIN,
 	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create_flags[1] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[2] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[3] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[4] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[5] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[6] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create_flags[IPSET_TYPE_REV_MAX] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create		= hash_ipmac_create,
 	.create_policy	= {
 		[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
 		[IPSET_ATTR_INITVAL]	= { .type = NLA_U32 },
+		[IPSET_ATTR_HASHFN]	= { .type = NLA_U8 },
+		[IPSET_ATTR_REGIONBITS] = { .type = NLA_U8 },
+		[IPSET_ATTR_NUMA]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_BUCKETSIZE]	= { .type = NLA_U8 },
 		[IPSET_ATTR_RESIZE]	= { .type = NLA_U8  },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
@@ -304,6 +320,7 @@ hash_ipmac_init(void)
 static void __exit
 hash_ipmac_fini(void)
 {
+	htable_free_wait();
 	ip_set_type_unregister(&hash_ipmac_type);
 }
 
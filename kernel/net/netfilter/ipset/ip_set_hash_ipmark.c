@@ -24,7 +24,13 @@
 #define IPSET_TYPE_REV_MIN	0
 /*				1	   Forceadd support */
 /*				2	   skbinfo support */
-#define IPSET_TYPE_REV_MAX	3	/* bucketsize, initval support  */
+/*				3	   bucketsize, initval support */
+/*				4	   percpu counters support */
+/*				5	   hashfn support */
+/*				6	   prealloc support */
+/*				7	   regionbits support */
+/*				8	   numa support */
+#define IPSET_TYPE_REV_MAX	9	/* counter sampling support */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Vytas Dauksa <vytas.dauksa@smoothwall.net>");
@@ -285,6 +291,12 @@ static struct ip_set_type hash_ipmark_type __read_mostly = {
 	.family		= NFPROTO_UNSPEC,
 	.revision_min	= IPSET_TYPE_REV_MIN,
 	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create_flags[3] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[4] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[5] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[6] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[7] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[8] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create_flags[IPSET_TYPE_REV_MAX] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create		= hash_ipmark_create,
 	.create_policy	= {
@@ -292,6 +304,10 @@ static struct ip_set_type hash_ipmark_type __read_mostly = {
 		[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
 		[IPSET_ATTR_INITVAL]	= { .type = NLA_U32 },
+		[IPSET_ATTR_HASHFN]	= { .type = NLA_U8 },
+		[IPSET_ATTR_REGIONBITS] = { .type = NLA_U8 },
+		[IPSET_ATTR_NUMA]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_BUCKETSIZE]	= { .type = NLA_U8 },
 		[IPSET_ATTR_RESIZE]	= { .type = NLA_U8  },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
@@ -324,6 +340,7 @@ hash_ipmark_init(void)
 static void __exit
 hash_ipmark_fini(void)
 {
+	htable_free_wait();
 	rcu_barrier();
 	ip_set_type_unregister(&hash_ipmark_type);
 }
@@ -27,7 +27,14 @@
 /*				3    Comments support added */
 /*				4    Forceadd support added */
 /*				5    skbinfo support added */
-#define IPSET_TYPE_REV_MAX	6 /* bucketsize, initval support added */
+/*				6    bucketsize, initval support added */
+/*				7    percpu counters support added */
+/*				8    hashfn support added */
+/*				9    prealloc support added */
+/*				10    regionbits support added */
+/*				11    numa support added */
+/*				12    counter sampling support added */
+#define IPSET_TYPE_REV_MAX	13 /* conntrack events support added */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -346,12 +353,25 @@ static struct ip_set_type hash_ipport_type __read_mostly = {
 	.family		= NFPROTO_UNSPEC,
 	.revision_min	= IPSET_TYPE_REV_MIN,
 	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create_flags[6] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[7] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[8] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[9] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[10] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[11] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[12] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create_flags[IPSET_TYPE_REV_MAX] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create		= hash_ipport_create,
 	.create_policy	= {
 		[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
 		[IPSET_ATTR_INITVAL]	= { .type = NLA_U32 },
+		[IPSET_ATTR_HASHFN]	= { .type = NLA_U8 },
+		[IPSET_ATTR_REGIONBITS] = { .type = NLA_U8 },
+		[IPSET_ATTR_NUMA]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
+		[IPSET_ATTR_CTEVENTS]	= { .type = NLA_U32 },
+		[IPSET_ATTR_CTDIR]	= { .type = NLA_U32 },
 		[IPSET_ATTR_BUCKETSIZE]	= { .type = NLA_U8 },
 		[IPSET_ATTR_RESIZE]	= { .type = NLA_U8  },
 		[IPSET_ATTR_PROTO]	= { .type = NLA_U8 },
@@ -387,6 +407,7 @@ hash_ipport_init(void)
 static void __exit
 hash_ipport_fini(void)
 {
+	htable_free_wait();
 	rcu_barrier();
 	ip_set_type_unregister(&hash_ipport_type);
 }
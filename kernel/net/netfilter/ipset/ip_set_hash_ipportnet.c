@@ -29,7 +29,13 @@
 /*				5    Comments support added */
 /*				6    Forceadd support added */
 /*				7    skbinfo support added */
-#define IPSET_TYPE_REV_MAX	8 /* bucketsize, initval support added */
+/*				8    bucketsize, initval support added */
+/*				9    percpu counters support added */
+/*				10    hashfn support added */
+/*				11    prealloc support added */
+/*				12    regionbits support added */
+/*				13    numa support added */
+#define IPSET_TYPE_REV_MAX	14 /* counter sampling support added */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -518,12 +524,22 @@ static struct ip_set_type hash_ipportnet_type __read_mostly = {
 	.family		= NFPROTO_UNSPEC,
 	.revision_min	= IPSET_TYPE_REV_MIN,
 	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create_flags[8] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[9] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[10] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[11] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[12] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[13] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create_flags[IPSET_TYPE_REV_MAX] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create		= hash_ipportnet_create,
 	.create_policy	= {
 		[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
 		[IPSET_ATTR_INITVAL]	= { .type = NLA_U32 },
+		[IPSET_ATTR_HASHFN]	= { .type = NLA_U8 },
+		[IPSET_ATTR_REGIONBITS] = { .type = NLA_U8 },
+		[IPSET_ATTR_NUMA]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_BUCKETSIZE]	= { .type = NLA_U8 },
 		[IPSET_ATTR_RESIZE]	= { .type = NLA_U8  },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
@@ -562,6 +578,7 @@ hash_ipportnet_init(void)
 static void __exit
 hash_ipportnet_fini(void)
 {
+	htable_free_wait();
 	rcu_barrier();
 	ip_set_type_unregister(&hash_ipportnet_type);
 }
@@ -17,7 +17,13 @@
 #include <linux/netfilter/ipset/ip_set_hash.h>
 
 #define IPSET_TYPE_REV_MIN	0
-#define IPSET_TYPE_REV_MAX	1	/* bucketsize, initval support */
+/*				1	   bucketsize, initval support */
+/*				2	   percpu counters support */
+/*				3	   hashfn support */
+/*				4	   prealloc support */
+/*				5	   regionbits support */
+/*				6	   numa support */
+#define IPSET_TYPE_REV_MAX	7	/* counter sampling support */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -29,12 +35,15 @@ MODULE_ALIAS("ip_set_hash:mac");
 
 /* Member elements */
 struct hash_mac4_elem {
-	/* Zero valued IP addresses cannot be stored */
+	/* Zero valued MAC addresses cannot be stored */
 	union {
 		unsigned char ether[ETH_ALEN];
-		__be32 foo[2];
+		/* The address with the spare bytes zeroed, unaligned so
+		 * that the extensions are not padded
+		 */
+		u64 key __packed;
 	};
-};
+} __aligned(4);
 
 /* Common functions */
 
@@ -43,7 +52,7 @@ hash_mac4_data_equal(const struct hash_mac4_elem *e1,
 		     const struct hash_mac4_elem *e2,
 		     u32 *multi)
 {
-	return ether_addr_equal(e1->ether, e2->ether);
+	return e1->key == e2->key;
 }
 
 static bool
@@ -75,19 +84,17 @@ hash_mac4_kadt(struct ip_set *set, const struct sk_buff *skb,
 	       enum ipset_adt adt, struct ip_set_adt_opt *opt)
 {
 	ipset_adtfn adtfn = set->variant->adt[adt];
-	struct hash_mac4_elem e = { { .foo[0] = 0, .foo[1] = 0 } };
+	struct hash_mac4_elem e;
 	struct ip_set_ext ext = IP_SET_INIT_KEXT(skb, opt, set);
 
 	if (skb_mac_header(skb) < skb->head ||
 	    (skb_mac_header(skb) + ETH_HLEN) > skb->data)
 		return -EINVAL;
 
-	if (opt->flags & IPSET_DIM_ONE_SRC)
-		ether_addr_copy(e.ether, eth_hdr(skb)->h_source);
-	else
-		ether_addr_copy(e.ether, eth_hdr(skb)->h_dest);
-
-	if (is_zero_ether_addr(e.ether))
+	e.key = ip_set_ether_key(opt->flags & IPSET_DIM_ONE_SRC ?
+				 eth_hdr(skb)->h_source :
+				 eth_hdr(skb)->h_dest);
+	if (!e.key)
 		return -EINVAL;
 	return adtfn(set, &e, &ext, &opt->ext, opt->cmdflags);
 }
@@ -97,7 +104,7 @@ hash_mac4_uadt(struct ip_set *set, struct nlattr *tb[],
 	       enum ipset_adt adt, u32 *lineno, u32 flags, bool retried)
 {
 	ipset_adtfn adtfn = set->variant->adt[adt];
-	struct hash_mac4_elem e = { { .foo[0] = 0, .foo[1] = 0 } };
+	struct hash_mac4_elem e;
 	struct ip_set_ext ext = IP_SET_INIT_UEXT(set);
 	int ret;
 
@@ -111,8 +118,8 @@ hash_mac4_uadt(struct ip_set *set, struct nlattr *tb[],
 	ret = ip_set_get_extensions(set, tb, &ext);
 	if (ret)
 		return ret;
-	ether_addr_copy(e.ether, nla_data(tb[IPSET_ATTR_ETHER]));
-	if (is_zero_ether_addr(e.ether))
+	e.key = ip_set_ether_key(nla_data(tb[IPSET_ATTR_ETHER]));
+	if (!e.key)
 		return -IPSET_ERR_HASH_ELEM;
 
 	return adtfn(set, &e, &ext, &ext, flags);
@@ -126,12 +133,22 @@ static struct ip_set_type hash_mac_type __read_mostly = {
 	.family		= NFPROTO_UNSPEC,
 	.revision_min	= IPSET_TYPE_REV_MIN,
 	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create_flags[1] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[2] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[3] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[4] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[5] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[6] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create_flags[IPSET_TYPE_REV_MAX] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create		= hash_mac_create,
 	.create_policy	= {
 		[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
 		[IPSET_ATTR_INITVAL]	= { .type = NLA_U32 },
+		[IPSET_ATTR_HASHFN]	= { .type = NLA_U8 },
+		[IPSET_ATTR_REGIONBITS] = { .type = NLA_U8 },
+		[IPSET_ATTR_NUMA]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_BUCKETSIZE]	= { .type = NLA_U8 },
 		[IPSET_ATTR_RESIZE]	= { .type = NLA_U8  },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
@@ -162,6 +179,7 @@ hash_mac_init(void)
 static void __exit
 hash_mac_fini(void)
 {
+	htable_free_wait();
 	rcu_barrier();
 	ip_set_type_unregister(&hash_mac_type);
 }
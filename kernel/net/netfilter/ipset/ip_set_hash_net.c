@@ -26,7 +26,19 @@
 /*				4    Comments support added */
 /*				5    Forceadd support added */
 /*				6    skbinfo support added */
-#define IPSET_TYPE_REV_MAX	7 /* bucketsize, initval support added */
+/*				7    bucketsize, initval support added */
+/*				8    lpm support added */
+/*				9    percpu counters support added */
+/*				10    bloom filter support added */
+/*				11    hashfn support added */
+/*				12    prealloc support added */
+/*				13    regionbits support added */
+/*				14    numa support added */
+/*				15    counter sampling support added */
+/*				16    aggregate support added */
+/*				17    distinct support added */
+/*				18    rate limit support added */
+#define IPSET_TYPE_REV_MAX	19 /* dual-stack family support added */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -36,6 +48,15 @@ MODULE_ALIAS("ip_set_hash:net");
 /* Type specific function prefix */
 #define HTYPE		hash_net
 #define IP_SET_HASH_WITH_NETS
+#define IP_SET_HASH_WITH_LPM
+#define IP_SET_HASH_WITH_BLOOM
+#define IP_SET_HASH_WITH_AGGREGATE
+#define IP_SET_HASH_WITH_INET
+
+/* Adding to an aggregating set: not a nomatch element */
+#define AGGREGATE_ADD(set, adt, flags)			\
+	((adt) == IPSET_ADD && SET_WITH_AGGREGATE(set) &&	\
+	 !((flags) & (IPSET_FLAG_NOMATCH << 16)))
 
 /* IPv4 variant */
 
@@ -106,6 +127,12 @@ hash_net4_data_next(struct hash_net4_elem *next,
 	next->ip = d->ip;
 }
 
+static const __be32 *
+hash_net4_data_lpm_addr(const struct hash_net4_elem *e, u8 n)
+{
+	return &e->ip;
+}
+
 #define MTYPE		hash_net4
 #define HOST_MASK	32
 #include "ip_set_hash_gen.h"
@@ -133,11 +160,63 @@ hash_net4_kadt(struct ip_set *set, const struct sk_buff *skb,
 	return adtfn(set, &e, &ext, &opt->ext, opt->cmdflags);
 }
 
+/* Add an element to an aggregating set: skip it when a matching prefix
+ * covers it already, otherwise merge it with its sibling prefix into the
+ * parent one as long as the sibling is in the set too. A covering nomatch
+ * prefix bounds the merging. The merged prefix gets the extensions of the
+ * element being added.
+ */
+static int
+hash_net4_aggregate(struct ip_set *set, struct hash_net4_elem *e,
+		    struct ip_set_ext *ext, u32 flags, bool retried)
+{
+	ipset_adtfn addfn = set->variant->adt[IPSET_ADD];
+	ipset_adtfn delfn = set->variant->adt[IPSET_DEL];
+	ipset_adtfn testfn = set->variant->adt[IPSET_TEST];
+	struct ip_set_ext mext = *ext;
+	struct hash_net4_elem s = {}, p = {};
+	u8 cidr, floor = 0;
+	int ret;
+
+	for (cidr = e->cidr - 1; cidr > 0; cidr--) {
+		s.ip = e->ip & ip_set_netmask(cidr);
+		s.cidr = cidr;
+		ret = testfn(set, &s, ext, &mext, 0);
+		if (ret > 0)
+			return 0;
+		if (ret == -ENOTEMPTY) {
+			floor = cidr;
+			break;
+		}
+	}
+
+	ret = addfn(set, e, ext, ext, flags);
+	/* Added at the first round when we resized the table */
+	if (ret && !(ret == -IPSET_ERR_EXIST && retried))
+		return ret;
+
+	while (e->cidr - 1 > floor) {
+		s.ip = e->ip ^ htonl(1U << (HOST_MASK - e->cidr));
+		s.cidr = e->cidr;
+		if (testfn(set, &s, ext, &mext, 0) <= 0)
+			break;
+		p.ip = e->ip & ip_set_netmask(e->cidr - 1);
+		p.cidr = e->cidr - 1;
+		ret = addfn(set, &p, ext, ext, flags | IPSET_FLAG_EXIST);
+		if (ret)
+			return ret;
+		delfn(set, &s, ext, ext, 0);
+		delfn(set, e, ext, ext, 0);
+		*e = p;
+	}
+	return 0;
+}
+
 static int
 hash_net4_uadt(struct ip_set *set, struct nlattr *tb[],
 	       enum ipset_adt adt, u32 *lineno, u32 flags, bool retried)
 {
-	const struct hash_net4 *h = set->data;
+	struct hash_net4 *h = set->data;
 	ipset_adtfn adtfn = set->variant->adt[adt];
 	struct hash_net4_elem e = { .cidr = HOST_MASK };
 	struct ip_set_ext ext = IP_SET_INIT_UEXT(set);
@@ -174,7 +253,11 @@ hash_net4_uadt(struct ip_set *set, struct nlattr *tb[],
 
 	if (adt == IPSET_TEST || !tb[IPSET_ATTR_IP_TO]) {
 		e.ip = htonl(ip & ip_set_hostmask(e.cidr));
-		ret = adtfn(set, &e, &ext, &ext, flags);
+		if (AGGREGATE_ADD(set, adt, flags))
+			ret = hash_net4_aggregate(set, &e, &ext, flags,
+						  retried);
+		else
+			ret = adtfn(set, &e, &ext, &ext, flags);
 		return ip_set_enomatch(ret, flags, adt, set) ? -ret :
 		       ip_set_eexist(ret, flags) ? 0 : ret;
 	}
@@ -200,10 +283,21 @@ hash_net4_uadt(struct ip_set *set, struct nlattr *tb[],
 
 	if (retried)
 		ip = ntohl(h->next.ip);
+	if (adt == IPSET_ADD && n > 1) {
+		ret = hash_net4_reserve(set, n);
+		if (ret) {
+			h->next.ip = htonl(ip);
+			return ret;
+		}
+	}
 	do {
 		e.ip = htonl(ip);
 		ip = ip_set_range_to_cidr(ip, ip_to, &e.cidr);
-		ret = adtfn(set, &e, &ext, &ext, flags);
+		if (AGGREGATE_ADD(set, adt, flags))
+			ret = hash_net4_aggregate(set, &e, &ext, flags,
+						  retried);
+		else
+			ret = adtfn(set, &e, &ext, &ext, flags);
 		if (ret && !ip_set_eexist(ret, flags))
 			return ret;
 
@@ -279,6 +373,12 @@ hash_net6_data_next(struct hash_net6_elem *next,
 {
 }
 
+static const __be32 *
+hash_net6_data_lpm_addr(const struct hash_net6_elem *e, u8 n)
+{
+	return e->ip.ip6;
+}
+
 #undef MTYPE
 #undef HOST_MASK
 
@@ -304,12 +404,65 @@ hash_net6_kadt(struct ip_set *set, const struct sk_buff *skb,
 	if (adt == IPSET_TEST)
 		e.cidr = HOST_MASK;
 
-	ip6addrptr(skb, opt->flags & IPSET_DIM_ONE_SRC, &e.ip.in6);
+	inetaddrptr(skb, opt->family, opt->flags & IPSET_DIM_ONE_SRC, &e.ip.in6);
 	ip6_netmask(&e.ip, e.cidr);
 
 	return adtfn(set, &e, &ext, &opt->ext, opt->cmdflags);
 }
 
+static int
+hash_net6_aggregate(struct ip_set *set, struct hash_net6_elem *e,
+		    struct ip_set_ext *ext, u32 flags, bool retried)
+{
+	ipset_adtfn addfn = set->variant->adt[IPSET_ADD];
+	ipset_adtfn delfn = set->variant->adt[IPSET_DEL];
+	ipset_adtfn testfn = set->variant->adt[IPSET_TEST];
+	struct ip_set_ext mext = *ext;
+	struct hash_net6_elem s = {}, p = {};
+	u8 cidr, floor = 0;
+	int ret;
+
+	for (cidr = e->cidr - 1; cidr > 0; cidr--) {
+		s.ip = e->ip;
+		ip6_netmask(&s.ip, cidr);
+		s.cidr = cidr;
+		ret = testfn(set, &s, ext, &mext, 0);
+		if (ret > 0)
+			return 0;
+		if (ret == -ENOTEMPTY) {
+			floor = cidr;
+			break;
+		}
+	}
+	/* The IPv4 nets of the dual-stack sets stay in ::ffff:0:0/96 */
+	if (set->family == NFPROTO_INET && ipv6_addr_v4mapped(&e->ip.in6) &&
+	    floor < 96)
+		floor = 96;
+
+	ret = addfn(set, e, ext, ext, flags);
+	if (ret && !(ret == -IPSET_ERR_EXIST && retried))
+		return ret;
+
+	while (e->cidr - 1 > floor) {
+		s.ip = e->ip;
+		s.ip.ip6[(e->cidr - 1) / 32] ^=
+			htonl(1U << (31 - (e->cidr - 1) % 32));
+		s.cidr = e->cidr;
+		if (testfn(set, &s, ext, &mext, 0) <= 0)
+			break;
+		p.ip = e->ip;
+		ip6_netmask(&p.ip, e->cidr - 1);
+		p.cidr = e->cidr - 1;
+		ret = addfn(set, &p, ext, ext, flags | IPSET_FLAG_EXIST);
+		if (ret)
+			return ret;
+		delfn(set, &s, ext, ext, 0);
+		delfn(set, e, ext, ext, 0);
+		*e = p;
+	}
+	return 0;
+}
+
 static int
 hash_net6_uadt(struct ip_set *set, struct nlattr *tb[],
 	       enum ipset_adt adt, u32 *lineno, u32 flags, bool retried)
@@ -351,7 +504,10 @@ hash_net6_uadt(struct ip_set *set, struct nlattr *tb[],
 			flags |= (IPSET_FLAG_NOMATCH << 16);
 	}
 
-	ret = adtfn(set, &e, &ext, &ext, flags);
+	if (AGGREGATE_ADD(set, adt, flags))
+		ret = hash_net6_aggregate(set, &e, &ext, flags, retried);
+	else
+		ret = adtfn(set, &e, &ext, &ext, flags);
 
 	return ip_set_enomatch(ret, flags, adt, set) ? -ret :
 	       ip_set_eexist(ret, flags) ? 0 : ret;
@@ -365,12 +521,30 @@ static struct ip_set_type hash_net_type __read_mostly = {
 	.family		= NFPROTO_UNSPEC,
 	.revision_min	= IPSET_TYPE_REV_MIN,
 	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create_flags[7] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[8] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[9] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[10] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[11] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[12] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[13] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[14] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[15] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[16] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[17] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[18] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create_flags[IPSET_TYPE_REV_MAX] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create		= hash_net_create,
 	.create_policy	= {
 		[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
 		[IPSET_ATTR_INITVAL]	= { .type = NLA_U32 },
+		[IPSET_ATTR_HASHFN]	= { .type = NLA_U8 },
+		[IPSET_ATTR_REGIONBITS] = { .type = NLA_U8 },
+		[IPSET_ATTR_NUMA]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
+		[IPSET_ATTR_RATE]	= { .type = NLA_U32 },
+		[IPSET_ATTR_BURST]	= { .type = NLA_U32 },
 		[IPSET_ATTR_BUCKETSIZE]	= { .type = NLA_U8 },
 		[IPSET_ATTR_RESIZE]	= { .type = NLA_U8  },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
@@ -390,6 +564,8 @@ static struct ip_set_type hash_net_type __read_mostly = {
 		[IPSET_ATTR_SKBMARK]	= { .type = NLA_U64 },
 		[IPSET_ATTR_SKBPRIO]	= { .type = NLA_U32 },
 		[IPSET_ATTR_SKBQUEUE]	= { .type = NLA_U16 },
+		[IPSET_ATTR_RATE]	= { .type = NLA_U32 },
+		[IPSET_ATTR_BURST]	= { .type = NLA_U32 },
 	},
 	.me		= THIS_MODULE,
 };
@@ -403,6 +579,7 @@ hash_net_init(void)
 static void __exit
 hash_net_fini(void)
 {
+	htable_free_wait();
 	rcu_barrier();
 	ip_set_type_unregister(&hash_net_type);
 }
@@ -5,11 +5,14 @@
 /* Kernel module implementing an IP set type: the hash:net,iface type */
 
 #include <linux/jhash.h>
+#include <linux/hash.h>
 #include <linux/module.h>
 #include <linux/ip.h>
 #include <linux/skbuff.h>
 #include <linux/errno.h>
 #include <linux/random.h>
+#include <linux/idr.h>
+#include <linux/netdevice.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
 #include <net/netlink.h>
@@ -28,7 +31,13 @@
 /*				5    Forceadd support added */
 /*				6    skbinfo support added */
 /*				7    interface wildcard support added */
-#define IPSET_TYPE_REV_MAX	8 /* bucketsize, initval support added */
+/*				8    bucketsize, initval support added */
+/*				9    percpu counters support added */
+/*				10    hashfn support added */
+/*				11    prealloc support added */
+/*				12    regionbits support added */
+/*				13    numa support added */
+#define IPSET_TYPE_REV_MAX	14 /* counter sampling support added */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -41,7 +50,221 @@ MODULE_ALIAS("ip_set_hash:net,iface");
 #define IP_SET_HASH_WITH_MULTI
 #define IP_SET_HASH_WITH_NET0
 
-#define STRLCPY(a, b)	strlcpy(a, b, IFNAMSIZ)
+/* The interface names are interned: the elements store the id of the
+ * name and the bucket scan compares the ids. The names of the devices are
+ * interned too, so that the packet path just maps the device to the id
+ * of its name, kept up to date over renames by the netdevice notifier,
+ * and wildcard elements can compare the prefix by the names.
+ *
+ * The names given to elements stay interned till the module is unloaded,
+ * the names of the devices only as long as a device has got the name.
+ */
+struct netiface_name {
+	struct hlist_node node;		/* netiface_names */
+	struct rcu_head rcu;
+	u32 id;				/* Stored in the elements */
+	u32 devs;			/* Devices with the name */
+	bool used;			/* Given to elements */
+	char name[IFNAMSIZ];
+};
+
+struct netiface_dev {
+	struct hlist_node node;		/* netiface_devs */
+	struct rcu_head rcu;
+	const struct net_device *dev;
+	struct netiface_name *name;
+	u32 id;				/* Of the name, for the packet path */
+};
+
+#define NETIFACE_HASH_BITS	8
+
+/* Protects the hashes and the ids, the readers use RCU */
+static DEFINE_SPINLOCK(netiface_lock);
+static DEFINE_IDR(netiface_ids);
+static struct hlist_head netiface_names[1 << NETIFACE_HASH_BITS];
+static struct hlist_head netiface_devs[1 << NETIFACE_HASH_BITS];
+
+static struct hlist_head *
+netiface_name_head(const char *name)
+{
+	return &netiface_names[jhash(name, strlen(name), 0) &
+			       ((1 << NETIFACE_HASH_BITS) - 1)];
+}
+
+/* Get the interned name, called with netiface_lock held */
+static struct netiface_name *
+netiface_name_get(const char *name)
+{
+	struct hlist_head *head = netiface_name_head(name);
+	struct netiface_name *n;
+	int id;
+
+	hlist_for_each_entry(n, head, node)
+		if (strcmp(n->name, name) == 0)
+			return n;
+
+	n = kzalloc(sizeof(*n), GFP_ATOMIC);
+	if (!n)
+		return NULL;
+	/* Zero is the id of no name */
+	id = idr_alloc(&netiface_ids, n, 1, 0, GFP_ATOMIC);
+	if (id < 0) {
+		kfree(n);
+		return NULL;
+	}
+	n->id = id;
+	strscpy(n->name, name, IFNAMSIZ);
+	hlist_add_head_rcu(&n->node, head);
+
+	return n;
+}
+
+static void
+netiface_name_put(struct netiface_name *n)
+{
+	if (n->devs || n->used)
+		return;
+	hlist_del_rcu(&n->node);
+	idr_remove(&netiface_ids, n->id);
+	kfree_rcu(n, rcu);
+}
+
+/* The name of the id, called under RCU or for the ids of elements */
+static const char *
+netiface_name(u32 id)
+{
+	const struct netiface_name *n = idr_find(&netiface_ids, id);
+
+	return n ? n->name : "";
+}
+
+static bool
+netiface_wildcard_match(u32 prefix, u32 id)
+{
+	const char *name = netiface_name(prefix);
+
+	return prefix == id ||
+	       strncmp(name, netiface_name(id), strlen(name)) == 0;
+}
+
+/* The id of the name from userspace, zero if it cannot be interned */
+static u32
+netiface_uget(const char *name)
+{
+	struct netiface_name *n;
+	u32 id = 0;
+
+	spin_lock_bh(&netiface_lock);
+	n = netiface_name_get(name);
+	if (n) {
+		n->used = true;
+		id = n->id;
+	}
+	spin_unlock_bh(&netiface_lock);
+
+	return id;
+}
+
+static struct hlist_head *
+netiface_dev_head(const struct net_device *dev)
+{
+	return &netiface_devs[hash_ptr(dev, NETIFACE_HASH_BITS)];
+}
+
+/* The id of the name of the device, zero if not known */
+static u32
+netiface_kget(const struct net_device *dev)
+{
+	const struct netiface_dev *d;
+
+	hlist_for_each_entry_rcu(d, netiface_dev_head(dev), node)
+		if (d->dev == dev)
+			return READ_ONCE(d->id);
+	return 0;
+}
+
+static struct netiface_dev *
+netiface_dev_find(const struct net_device *dev)
+{
+	struct netiface_dev *d;
+
+	hlist_for_each_entry(d, netiface_dev_head(dev), node)
+		if (d->dev == dev)
+			return d;
+	return NULL;
+}
+
+/* The device is registered or renamed */
+static void
+netiface_dev_set(const struct net_device *dev)
+{
+	struct netiface_name *n, *old = NULL;
+	struct netiface_dev *d;
+
+	spin_lock_bh(&netiface_lock);
+	n = netiface_name_get(dev->name);
+	if (!n)
+		goto out;
+	d = netiface_dev_find(dev);
+	if (d) {
+		old = d->name;
+	} else {
+		d = kzalloc(sizeof(*d), GFP_ATOMIC);
+		if (!d) {
+			netiface_name_put(n);
+			goto out;
+		}
+		d->dev = dev;
+		hlist_add_head_rcu(&d->node, netiface_dev_head(dev));
+	}
+	n->devs++;
+	d->name = n;
+	WRITE_ONCE(d->id, n->id);
+	if (old) {
+		old->devs--;
+		netiface_name_put(old);
+	}
+out:
+	spin_unlock_bh(&netiface_lock);
+}
+
+static void
+netiface_dev_unset(const struct net_device *dev)
+{
+	struct netiface_dev *d;
+
+	spin_lock_bh(&netiface_lock);
+	d = netiface_dev_find(dev);
+	if (d) {
+		hlist_del_rcu(&d->node);
+		d->name->devs--;
+		netiface_name_put(d->name);
+		kfree_rcu(d, rcu);
+	}
+	spin_unlock_bh(&netiface_lock);
+}
+
+static int
+netiface_netdev_event(struct notifier_block *this, unsigned long event,
+		      void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+
+	switch (event) {
+	case NETDEV_REGISTER:
+	case NETDEV_CHANGENAME:
+		netiface_dev_set(dev);
+		break;
+	case NETDEV_UNREGISTER:
+		netiface_dev_unset(dev);
+		break;
+	}
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block netiface_netdev_notifier = {
+	.notifier_call	= netiface_netdev_event,
+};
 
 /* IPv4 variant */
 
@@ -61,7 +284,7 @@ struct hash_netiface4_elem {
 	u8 nomatch;
 	u8 elem;
 	u8 wildcard;
-	char iface[IFNAMSIZ];
+	u32 iface;			/* Id of the interned name */
 };
 
 /* Common functions */
@@ -76,8 +299,8 @@ hash_netiface4_data_equal(const struct hash_netiface4_elem *ip1,
 	       (++*multi) &&
 	       ip1->physdev == ip2->physdev &&
 	       (ip1->wildcard ?
-		strncmp(ip1->iface, ip2->iface, strlen(ip1->iface)) == 0 :
-		strcmp(ip1->iface, ip2->iface) == 0);
+		netiface_wildcard_match(ip1->iface, ip2->iface) :
+		ip1->iface == ip2->iface);
 }
 
 static int
@@ -116,7 +339,8 @@ hash_netiface4_data_list(struct sk_buff *skb,
 		flags |= IPSET_FLAG_NOMATCH;
 	if (nla_put_ipaddr4(skb, IPSET_ATTR_IP, data->ip) ||
 	    nla_put_u8(skb, IPSET_ATTR_CIDR, data->cidr) ||
-	    nla_put_string(skb, IPSET_ATTR_IFACE, data->iface) ||
+	    nla_put_string(skb, IPSET_ATTR_IFACE,
+			   netiface_name(data->iface)) ||
 	    (flags &&
 	     nla_put_net32(skb, IPSET_ATTR_CADT_FLAGS, htonl(flags))))
 		goto nla_put_failure;
@@ -138,21 +362,28 @@ hash_netiface4_data_next(struct hash_netiface4_elem *next,
 #define HKEY_DATALEN	sizeof(struct hash_netiface4_elem_hashed)
 #include "ip_set_hash_gen.h"
 
-#if IS_ENABLED(CONFIG_BRIDGE_NETFILTER)
-static const char *get_physindev_name(const struct sk_buff *skb)
-{
-	struct net_device *dev = nf_bridge_get_physindev(skb);
-
-	return dev ? dev->name : NULL;
-}
 
-static const char *get_physoutdev_name(const struct sk_buff *skb)
+/* The id of the name of the interface of the packet */
+static u32
+hash_netiface_kget(const struct sk_buff *skb,
+		   const struct xt_action_param *par,
+		   const struct ip_set_adt_opt *opt, u8 *physdev)
 {
-	struct net_device *dev = nf_bridge_get_physoutdev(skb);
+	const struct net_device *dev = NULL;
+	bool src = opt->flags & IPSET_DIM_TWO_SRC;
 
-	return dev ? dev->name : NULL;
-}
+	if (opt->cmdflags & IPSET_FLAG_PHYSDEV) {
+#if IS_ENABLED(CONFIG_BRIDGE_NETFILTER)
+		dev = src ? nf_bridge_get_physindev(skb) :
+			    nf_bridge_get_physoutdev(skb);
+		*physdev = 1;
 #endif
+	} else {
+		dev = src ? XAP_STATE(par)->in : XAP_STATE(par)->out;
+	}
+
+	return dev ? netiface_kget(dev) : 0;
+}
 
 static int
 hash_netiface4_kadt(struct ip_set *set, const struct sk_buff *skb,
@@ -173,24 +404,8 @@ hash_netiface4_kadt(struct ip_set *set, const struct sk_buff *skb,
 	ip4addrptr(skb, opt->flags & IPSET_DIM_ONE_SRC, &e.ip);
 	e.ip &= ip_set_netmask(e.cidr);
 
-#define IFACE(dir)	(XAP_STATE(par)->dir ? XAP_STATE(par)->dir->name : "")
-#define SRCDIR		(opt->flags & IPSET_DIM_TWO_SRC)
-
-	if (opt->cmdflags & IPSET_FLAG_PHYSDEV) {
-#if IS_ENABLED(CONFIG_BRIDGE_NETFILTER)
-		const char *eiface = SRCDIR ? get_physindev_name(skb) :
-					      get_physoutdev_name(skb);
-
-		if (!eiface)
-			return -EINVAL;
-		STRLCPY(e.iface, eiface);
-		e.physdev = 1;
-#endif
-	} else {
-		STRLCPY(e.iface, SRCDIR ? IFACE(in) : IFACE(out));
-	}
-
-	if (strlen(e.iface) == 0)
+	e.iface = hash_netiface_kget(skb, par, opt, &e.physdev);
+	if (!e.iface)
 		return -EINVAL;
 	return adtfn(set, &e, &ext, &opt->ext, opt->cmdflags);
 }
@@ -204,6 +419,7 @@ hash_netiface4_uadt(struct ip_set *set, struct nlattr *tb[],
 	struct hash_netiface4_elem e = { .cidr = HOST_MASK, .elem = 1 };
 	struct ip_set_ext ext = IP_SET_INIT_UEXT(set);
 	u32 ip = 0, ip_to = 0, ipn, n = 0;
+	char iface[IFNAMSIZ];
 	int ret;
 
 	if (tb[IPSET_ATTR_LINENO])
@@ -227,7 +443,10 @@ hash_netiface4_uadt(struct ip_set *set, struct nlattr *tb[],
 		if (e.cidr > HOST_MASK)
 			return -IPSET_ERR_INVALID_CIDR;
 	}
-	nla_strscpy(e.iface, tb[IPSET_ATTR_IFACE], IFNAMSIZ);
+	nla_strscpy(iface, tb[IPSET_ATTR_IFACE], IFNAMSIZ);
+	e.iface = netiface_uget(iface);
+	if (!e.iface)
+		return -ENOMEM;
 
 	if (tb[IPSET_ATTR_CADT_FLAGS]) {
 		u32 cadt_flags = ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]);
@@ -298,7 +517,7 @@ struct hash_netiface6_elem {
 	u8 nomatch;
 	u8 elem;
 	u8 wildcard;
-	char iface[IFNAMSIZ];
+	u32 iface;			/* Id of the interned name */
 };
 
 /* Common functions */
@@ -313,8 +532,8 @@ hash_netiface6_data_equal(const struct hash_netiface6_elem *ip1,
 	       (++*multi) &&
 	       ip1->physdev == ip2->physdev &&
 	       (ip1->wildcard ?
-		strncmp(ip1->iface, ip2->iface, strlen(ip1->iface)) == 0 :
-		strcmp(ip1->iface, ip2->iface) == 0);
+		netiface_wildcard_match(ip1->iface, ip2->iface) :
+		ip1->iface == ip2->iface);
 }
 
 static int
@@ -353,7 +572,8 @@ hash_netiface6_data_list(struct sk_buff *skb,
 		flags |= IPSET_FLAG_NOMATCH;
 	if (nla_put_ipaddr6(skb, IPSET_ATTR_IP, &data->ip.in6) ||
 	    nla_put_u8(skb, IPSET_ATTR_CIDR, data->cidr) ||
-	    nla_put_string(skb, IPSET_ATTR_IFACE, data->iface) ||
+	    nla_put_string(skb, IPSET_ATTR_IFACE,
+			   netiface_name(data->iface)) ||
 	    (flags &&
 	     nla_put_net32(skb, IPSET_ATTR_CADT_FLAGS, htonl(flags))))
 		goto nla_put_failure;
@@ -397,21 +617,8 @@ hash_netiface6_kadt(struct ip_set *set, const struct sk_buff *skb,
 	ip6addrptr(skb, opt->flags & IPSET_DIM_ONE_SRC, &e.ip.in6);
 	ip6_netmask(&e.ip, e.cidr);
 
-	if (opt->cmdflags & IPSET_FLAG_PHYSDEV) {
-#if IS_ENABLED(CONFIG_BRIDGE_NETFILTER)
-		const char *eiface = SRCDIR ? get_physindev_name(skb) :
-					      get_physoutdev_name(skb);
-
-		if (!eiface)
-			return -EINVAL;
-		STRLCPY(e.iface, eiface);
-		e.physdev = 1;
-#endif
-	} else {
-		STRLCPY(e.iface, SRCDIR ? IFACE(in) : IFACE(out));
-	}
-
-	if (strlen(e.iface) == 0)
+	e.iface = hash_netiface_kget(skb, par, opt, &e.physdev);
+	if (!e.iface)
 		return -EINVAL;
 
 	return adtfn(set, &e, &ext, &opt->ext, opt->cmdflags);
@@ -424,6 +631,7 @@ hash_netiface6_uadt(struct ip_set *set, struct nlattr *tb[],
 	ipset_adtfn adtfn = set->variant->adt[adt];
 	struct hash_netiface6_elem e = { .cidr = HOST_MASK, .elem = 1 };
 	struct ip_set_ext ext = IP_SET_INIT_UEXT(set);
+	char iface[IFNAMSIZ];
 	int ret;
 
 	if (tb[IPSET_ATTR_LINENO])
@@ -452,7 +660,10 @@ hash_netiface6_uadt(struct ip_set *set, struct nlattr *tb[],
 
 	ip6_netmask(&e.ip, e.cidr);
 
-	nla_strscpy(e.iface, tb[IPSET_ATTR_IFACE], IFNAMSIZ);
+	nla_strscpy(iface, tb[IPSET_ATTR_IFACE], IFNAMSIZ);
+	e.iface = netiface_uget(iface);
+	if (!e.iface)
+		return -ENOMEM;
 
 	if (tb[IPSET_ATTR_CADT_FLAGS]) {
 		u32 cadt_flags = ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]);
@@ -480,12 +691,22 @@ static struct ip_set_type hash_netiface_type __read_mostly = {
 	.family		= NFPROTO_UNSPEC,
 	.revision_min	= IPSET_TYPE_REV_MIN,
 	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create_flags[8] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[9] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[10] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[11] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[12] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[13] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create_flags[IPSET_TYPE_REV_MAX] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create		= hash_netiface_create,
 	.create_policy	= {
 		[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
 		[IPSET_ATTR_INITVAL]	= { .type = NLA_U32 },
+		[IPSET_ATTR_HASHFN]	= { .type = NLA_U8 },
+		[IPSET_ATTR_REGIONBITS] = { .type = NLA_U8 },
+		[IPSET_ATTR_NUMA]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_BUCKETSIZE]	= { .type = NLA_U8 },
 		[IPSET_ATTR_RESIZE]	= { .type = NLA_U8  },
 		[IPSET_ATTR_PROTO]	= { .type = NLA_U8 },
@@ -515,14 +736,33 @@ static struct ip_set_type hash_netiface_type __read_mostly = {
 static int __init
 hash_netiface_init(void)
 {
-	return ip_set_type_register(&hash_netiface_type);
+	int ret;
+
+	/* Interns the names of the existing devices */
+	ret = register_netdevice_notifier(&netiface_netdev_notifier);
+	if (ret)
+		return ret;
+	ret = ip_set_type_register(&hash_netiface_type);
+	if (ret)
+		unregister_netdevice_notifier(&netiface_netdev_notifier);
+	return ret;
 }
 
 static void __exit
 hash_netiface_fini(void)
 {
+	htable_free_wait();
+	struct netiface_name *n;
+	int id;
+
 	rcu_barrier();
 	ip_set_type_unregister(&hash_netiface_type);
+	unregister_netdevice_notifier(&netiface_netdev_notifier);
+	rcu_barrier();
+	/* Just the names given to elements are left */
+	idr_for_each_entry(&netiface_ids, n, id)
+		kfree(n);
+	idr_destroy(&netiface_ids);
 }
 
 module_init(hash_netiface_init);
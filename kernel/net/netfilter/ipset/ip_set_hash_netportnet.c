@@ -25,7 +25,14 @@
 /*				0    Comments support added */
 /*				1    Forceadd support added */
 /*				2    skbinfo support added */
-#define IPSET_TYPE_REV_MAX	3 /* bucketsize, initval support added */
+/*				3    bucketsize, initval support added */
+/*				4    lpm support added */
+/*				5    percpu counters support added */
+/*				6    hashfn support added */
+/*				7    prealloc support added */
+/*				8    regionbits support added */
+/*				9    numa support added */
+#define IPSET_TYPE_REV_MAX	10 /* counter sampling support added */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Oliver Smith <oliver@8.c.9.b.0.7.4.0.1.0.0.2.ip6.arpa>");
@@ -36,6 +43,7 @@ MODULE_ALIAS("ip_set_hash:net,port,net");
 #define HTYPE		hash_netportnet
 #define IP_SET_HASH_WITH_PROTO
 #define IP_SET_HASH_WITH_NETS
+#define IP_SET_HASH_WITH_LPM
 #define IPSET_NET_COUNT 2
 
 /* IPv4 variant */
@@ -136,6 +144,12 @@ hash_netportnet4_data_next(struct hash_netportnet4_elem *next,
 	next->port = d->port;
 }
 
+static const __be32 *
+hash_netportnet4_data_lpm_addr(const struct hash_netportnet4_elem *e, u8 n)
+{
+	return &e->ip[n];
+}
+
 #define MTYPE		hash_netportnet4
 #define HOST_MASK	32
 #include "ip_set_hash_gen.h"
@@ -425,6 +439,12 @@ hash_netportnet6_data_next(struct hash_netportnet6_elem *next,
 	next->port = d->port;
 }
 
+static const __be32 *
+hash_netportnet6_data_lpm_addr(const struct hash_netportnet6_elem *e, u8 n)
+{
+	return e->ip[n].ip6;
+}
+
 #undef MTYPE
 #undef HOST_MASK
 
@@ -574,12 +594,23 @@ static struct ip_set_type hash_netportnet_type __read_mostly = {
 	.family		= NFPROTO_UNSPEC,
 	.revision_min	= IPSET_TYPE_REV_MIN,
 	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create_flags[3] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[4] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[5] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[6] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[7] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[8] = IPSET_CREATE_FLAG_BUCKETSIZE,
+	.create_flags[9] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create_flags[IPSET_TYPE_REV_MAX] = IPSET_CREATE_FLAG_BUCKETSIZE,
 	.create		= hash_netportnet_create,
 	.create_policy	= {
 		[IPSET_ATTR_HASHSIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
 		[IPSET_ATTR_INITVAL]	= { .type = NLA_U32 },
+		[IPSET_ATTR_HASHFN]	= { .type = NLA_U8 },
+		[IPSET_ATTR_REGIONBITS] = { .type = NLA_U8 },
+		[IPSET_ATTR_NUMA]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_BUCKETSIZE]	= { .type = NLA_U8 },
 		[IPSET_ATTR_RESIZE]	= { .type = NLA_U8  },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
@@ -618,6 +649,7 @@ hash_netportnet_init(void)
 static void __exit
 hash_netportnet_fini(void)
 {
+	htable_free_wait();
 	rcu_barrier();
 	ip_set_type_unregister(&hash_netportnet_type);
 }
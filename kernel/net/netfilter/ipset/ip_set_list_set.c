@@ -9,14 +9,20 @@
 #include <linux/rculist.h>
 #include <linux/skbuff.h>
 #include <linux/errno.h>
+#include <linux/jhash.h>
+#include <linux/workqueue.h>
 
 #include <linux/netfilter/ipset/ip_set.h>
 #include <linux/netfilter/ipset/ip_set_list.h>
+#include <linux/netfilter/ipset/pfxlen.h>
 
 #define IPSET_TYPE_REV_MIN	0
 /*				1    Counters support added */
 /*				2    Comments support added */
-#define IPSET_TYPE_REV_MAX	3 /* skbinfo support added */
+/*				3    skbinfo support added */
+/*				4    percpu counters support added */
+/*				5    merged index support added */
+#define IPSET_TYPE_REV_MAX	6 /* counter sampling support added */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
@@ -37,17 +43,256 @@ struct set_adt_elem {
 	int before;
 };
 
+/* Merged index of the member sets */
+#define LIST_SET_INDEX_MEMBERS	64	/* Members covered by the index */
+#define LIST_SET_INDEX_PREFIXES	(1 << 16) /* Max prefixes in the index */
+#define LIST_SET_INDEX_DELAY	(HZ/10)	/* Rebuild after membership change */
+#define LIST_SET_INDEX_STALE	HZ	/* Rebuild after member set change */
+
+struct list_set_member {
+	struct ip_set *set;	/* the set behind the id at build time */
+	ip_set_id_t id;		/* the set id of the member */
+	u32 gen;		/* generation of the set at build time */
+};
+
+struct list_set_prefix {
+	union nf_inet_addr ip;	/* masked first dimension address */
+	u64 members;		/* members with the prefix, zero if empty */
+	u8 family;		/* family of the prefix */
+	u8 cidr;		/* prefix length */
+};
+
+struct list_set_index {
+	struct rcu_head rcu;
+	u64 indexed;		/* members completely in the index */
+	struct list_set_member member[LIST_SET_INDEX_MEMBERS];
+	DECLARE_BITMAP(cidr4, 32 + 1); /* prefix lengths in the index */
+	DECLARE_BITMAP(cidr6, 128 + 1);
+	u32 hmask;		/* mask of the open addressing table */
+	u32 prefixes;		/* number of used table slots */
+	struct list_set_prefix table[];
+};
+
 /* Type structure */
 struct list_set {
 	u32 size;		/* size of set list array */
-	struct timer_list gc;	/* garbage collection */
-#ifdef HAVE_TIMER_SETUP
+	struct ip_set_gc gc;	/* garbage collection */
 	struct ip_set *set;	/* attached to this ip_set */
-#endif
 	struct net *net;	/* namespace */
 	struct list_head members; /* the set members */
+	struct list_set_index __rcu *index; /* merged index */
+	struct delayed_work index_work; /* index rebuild */
+	u32 index_gen;		/* changed when the members change */
+};
+
+static u32
+list_set_prefix_hash(const union nf_inet_addr *ip, u8 family, u8 cidr,
+		     u32 hmask)
+{
+	return jhash2(ip->all, family == NFPROTO_IPV4 ? 1 : 4, cidr) & hmask;
+}
+
+static struct list_set_prefix *
+list_set_prefix_find(struct list_set_index *idx, const union nf_inet_addr *ip,
+		     u8 family, u8 cidr)
+{
+	struct list_set_prefix *p;
+	u32 i = list_set_prefix_hash(ip, family, cidr, idx->hmask);
+
+	for (p = &idx->table[i]; p->members;
+	     i = (i + 1) & idx->hmask, p = &idx->table[i])
+		if (p->family == family && p->cidr == cidr &&
+		    ipv6_addr_equal(&p->ip.in6, &ip->in6))
+			break;
+	return p;
+}
+
+/* Candidate members of the packet: the members of the index which are
+ * not in the returned mask cannot match it.
+ */
+static u64
+list_set_index_lookup(struct list_set_index *idx, const struct sk_buff *skb,
+		      const struct ip_set_adt_opt *opt)
+{
+	bool src = opt->flags & IPSET_DIM_ONE_SRC;
+	union nf_inet_addr addr = {}, ip;
+	const unsigned long *cidrs;
+	unsigned int cidr, max;
+	u64 members = 0;
+
+	if (opt->family == NFPROTO_IPV4) {
+		ip4addrptr(skb, src, &addr.ip);
+		cidrs = idx->cidr4;
+		max = 32;
+	} else if (opt->family == NFPROTO_IPV6) {
+		ip6addrptr(skb, src, &addr.in6);
+		cidrs = idx->cidr6;
+		max = 128;
+	} else {
+		return 0;
+	}
+	for_each_set_bit(cidr, cidrs, max + 1) {
+		ip = addr;
+		if (opt->family == NFPROTO_IPV4)
+			ip.ip &= ip_set_netmask(cidr);
+		else
+			ip6_netmask(&ip, cidr);
+		members |= list_set_prefix_find(idx, &ip, opt->family,
+						cidr)->members;
+	}
+	return members;
+}
+
+static void
+list_set_index_free_rcu(struct rcu_head *rcu)
+{
+	struct list_set_index *idx = container_of(rcu, struct list_set_index,
+						  rcu);
+
+	ip_set_free(idx);
+}
+
+/* Drop the index and rebuild it: the members changed.
+ * Called with the set lock held.
+ */
+static void
+list_set_index_reset(struct ip_set *set)
+{
+	struct list_set *map = set->data;
+	struct list_set_index *idx;
+
+	if (!SET_WITH_INDEX(set))
+		return;
+	map->index_gen++;
+	idx = rcu_dereference_protected(map->index, 1);
+	if (idx) {
+		RCU_INIT_POINTER(map->index, NULL);
+		call_rcu(&idx->rcu, list_set_index_free_rcu);
+	}
+	schedule_delayed_work(&map->index_work, LIST_SET_INDEX_DELAY);
+}
+
+struct list_set_index_build {
+	struct list_set_index *idx;
+	u64 member;		/* bit of the member */
+	u8 family;		/* family of the member */
 };
 
+static int
+list_set_index_add(void *priv, const __be32 *ip, u8 cidr)
+{
+	struct list_set_index_build *b = priv;
+	struct list_set_index *idx = b->idx;
+	struct list_set_prefix *p;
+	union nf_inet_addr addr = {};
+
+	memcpy(&addr, ip, b->family == NFPROTO_IPV4 ? sizeof(addr.ip)
+						     : sizeof(addr.in6));
+	p = list_set_prefix_find(idx, &addr, b->family, cidr);
+	if (!p->members) {
+		/* Keep the table at most half full */
+		if (idx->prefixes >= (idx->hmask + 1) / 2)
+			return -ENOSPC;
+		idx->prefixes++;
+		p->ip = addr;
+		p->family = b->family;
+		p->cidr = cidr;
+		set_bit(cidr, b->family == NFPROTO_IPV4 ? idx->cidr4
+							: idx->cidr6);
+	}
+	p->members |= b->member;
+	return 0;
+}
+
+/* Build the index from the members with prefix reporting, like the hash
+ * types of networks. The other members are always tested.
+ */
+static void
+list_set_index_work(struct work_struct *work)
+{
+	struct list_set *map = container_of(to_delayed_work(work),
+					    struct list_set, index_work);
+	struct ip_set *set = map->set, *s;
+	struct list_set_member member[LIST_SET_INDEX_MEMBERS];
+	struct list_set_index_build b;
+	struct list_set_index *idx, *old;
+	u32 i, n = 0, elements = 0, hsize, gen;
+	struct set_elem *e;
+
+	spin_lock_bh(&set->lock);
+	gen = map->index_gen;
+	spin_unlock_bh(&set->lock);
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(e, &map->members, list) {
+		if (n == LIST_SET_INDEX_MEMBERS)
+			break;
+		s = ip_set_ref_byindex(map->net, e->id);
+		member[n].set = s;
+		member[n].id = e->id;
+		member[n].gen = atomic_read(&s->gen);
+		if (s->variant->prefixes)
+			elements += s->elements;
+		n++;
+	}
+	rcu_read_unlock();
+	/* Elements added after here change the generation of the set */
+	smp_rmb();
+
+	hsize = roundup_pow_of_two(2 * clamp_t(u32, elements, 8,
+					       LIST_SET_INDEX_PREFIXES));
+	idx = ip_set_alloc(sizeof(*idx) + hsize * sizeof(idx->table[0]));
+	if (idx) {
+		idx->hmask = hsize - 1;
+		memcpy(idx->member, member, n * sizeof(member[0]));
+		b.idx = idx;
+		for (i = 0; i < n; i++) {
+			s = member[i].set;
+			if (!s->variant->prefixes ||
+			    (s->family != NFPROTO_IPV4 &&
+			     s->family != NFPROTO_IPV6))
+				continue;
+			b.member = BIT_ULL(i);
+			b.family = s->family;
+			if (!s->variant->prefixes(s, &b, list_set_index_add))
+				idx->indexed |= b.member;
+		}
+	}
+	for (i = 0; i < n; i++)
+		ip_set_put_byindex(map->net, member[i].id);
+	if (!idx)
+		return;
+
+	spin_lock_bh(&set->lock);
+	if (gen == map->index_gen) {
+		old = rcu_dereference_protected(map->index, 1);
+		rcu_assign_pointer(map->index, idx);
+		idx = old;
+	}
+	spin_unlock_bh(&set->lock);
+	if (idx)
+		call_rcu(&idx->rcu, list_set_index_free_rcu);
+}
+
+/* Can we skip the member at the position without testing it? */
+static bool
+list_set_index_skip(struct list_set *map, struct list_set_index *idx,
+		    u32 i, const struct set_elem *e, u64 members)
+{
+	const struct list_set_member *m = &idx->member[i];
+	struct ip_set *s;
+
+	if (!(idx->indexed & BIT_ULL(i)) || m->id != e->id)
+		return false;
+	s = ip_set_lookup_byindex(map->net, e->id);
+	if (s != m->set || atomic_read(&s->gen) != m->gen) {
+		/* Swapped or new elements added */
+		schedule_delayed_work(&map->index_work, LIST_SET_INDEX_STALE);
+		return false;
+	}
+	return !(members & BIT_ULL(i));
+}
+
 static int
 list_set_ktest(struct ip_set *set, const struct sk_buff *skb,
 	       const struct xt_action_param *par,
@@ -55,15 +300,22 @@ list_set_ktest(struct ip_set *set, const struct sk_buff *skb,
 {
 	struct list_set *map = set->data;
 	struct ip_set_ext *mext = &opt->ext;
+	struct list_set_index *idx = rcu_dereference(map->index);
 	struct set_elem *e;
-	u32 flags = opt->cmdflags;
+	u32 flags = opt->cmdflags, i = 0;
+	u64 members = 0;
 	int ret;
 
 	/* Don't lookup sub-counters at all */
 	opt->cmdflags &= ~IPSET_FLAG_MATCH_COUNTERS;
 	if (opt->cmdflags & IPSET_FLAG_SKIP_SUBCOUNTER_UPDATE)
 		opt->cmdflags |= IPSET_FLAG_SKIP_COUNTER_UPDATE;
+	if (idx)
+		members = list_set_index_lookup(idx, skb, opt);
 	list_for_each_entry_rcu(e, &map->members, list) {
+		if (idx && i < LIST_SET_INDEX_MEMBERS &&
+		    list_set_index_skip(map, idx, i++, e, members))
+			continue;
 		ret = ip_set_test(e->id, skb, par, opt);
 		if (ret <= 0)
 			continue;
@@ -161,6 +413,7 @@ list_set_del(struct ip_set *set, struct set_elem *e)
 	list_del_rcu(&e->list);
 	ip_set_put_byindex(map->net, e->id);
 	call_rcu(&e->rcu, __list_set_del_rcu);
+	list_set_index_reset(set);
 }
 
 static void
@@ -171,6 +424,7 @@ list_set_replace(struct ip_set *set, struct set_elem *e, struct set_elem *old)
 	list_replace_rcu(&old->list, &e->list);
 	ip_set_put_byindex(map->net, old->id);
 	call_rcu(&old->rcu, __list_set_del_rcu);
+	list_set_index_reset(set);
 }
 
 static void
@@ -221,11 +475,13 @@ list_set_init_extensions(struct ip_set *set, const struct ip_set_ext *ext,
 			 struct set_elem *e)
 {
 	if (SET_WITH_COUNTER(set))
-		ip_set_init_counter(ext_counter(e, set), ext);
+		ip_set_init_counter(set, ext_counter(e, set), ext);
 	if (SET_WITH_COMMENT(set))
 		ip_set_init_comment(set, ext_comment(e, set), ext);
 	if (SET_WITH_SKBINFO(set))
 		ip_set_init_skbinfo(ext_skbinfo(e, set), ext);
+	if (SET_WITH_RATELIMIT(set))
+		ip_set_init_ratelimit(ext_ratelimit(e, set), ext);
 	/* Update timeout last */
 	if (SET_WITH_TIMEOUT(set))
 		ip_set_timeout_set(ext_timeout(e, set), ext->timeout);
@@ -309,6 +565,7 @@ list_set_uadd(struct ip_set *set, void *value, const struct ip_set_ext *ext,
 	else
 		list_add_tail_rcu(&e->list, &map->members);
 	set->elements++;
+	list_set_index_reset(set);
 
 	return 0;
 }
@@ -430,7 +687,11 @@ list_set_destroy(struct ip_set *set)
 	struct set_elem *e, *n;
 
 	if (SET_WITH_TIMEOUT(set))
-		del_timer_sync(&map->gc);
+		ip_set_gc_cancel(&map->gc);
+	if (SET_WITH_INDEX(set)) {
+		cancel_delayed_work_sync(&map->index_work);
+		ip_set_free(rcu_dereference_protected(map->index, 1));
+	}
 
 	list_for_each_entry_safe(e, n, &map->members, list) {
 		list_del(&e->list);
@@ -447,19 +708,25 @@ list_set_destroy(struct ip_set *set)
 static size_t
 list_set_memsize(const struct list_set *map, size_t dsize)
 {
+	const struct list_set_index *idx;
 	struct set_elem *e;
+	size_t isize = 0;
 	u32 n = 0;
 
 	rcu_read_lock();
 	list_for_each_entry_rcu(e, &map->members, list)
 		n++;
+	idx = rcu_dereference(map->index);
+	if (idx)
+		isize = sizeof(*idx) + (idx->hmask + 1) * sizeof(idx->table[0]);
 	rcu_read_unlock();
 
-	return (sizeof(*map) + n * dsize);
+	return (sizeof(*map) + n * dsize + isize);
 }
 
 static int
-list_set_head(struct ip_set *set, struct sk_buff *skb)
+list_set_head(struct ip_set *set, struct sk_buff *skb,
+	      const struct netlink_callback *cb)
 {
 	const struct list_set *map = set->data;
 	struct nlattr *nested;
@@ -545,7 +812,8 @@ list_set_same_set(const struct ip_set *a, const struct ip_set *b)
 
 	return x->size == y->size &&
 	       a->timeout == b->timeout &&
-	       a->extensions == b->extensions;
+	       a->extensions == b->extensions &&
+	       SET_WITH_INDEX(a) == SET_WITH_INDEX(b);
 }
 
 static const struct ip_set_type_variant set_variant = {
@@ -563,26 +831,26 @@ static const struct ip_set_type_variant set_variant = {
 	.same_set = list_set_same_set,
 };
 
-static void
-list_set_gc(GC_ARG)
+static unsigned long
+list_set_gc(struct ip_set_gc *gc)
 {
-	INIT_GC_VARS(list_set, map);
+	struct ip_set *set = gc->set;
 
 	spin_lock_bh(&set->lock);
 	set_cleanup_entries(set);
 	spin_unlock_bh(&set->lock);
 
-	map->gc.expires = jiffies + IPSET_GC_PERIOD(set->timeout) * HZ;
-	add_timer(&map->gc);
+	return jiffies + IPSET_GC_PERIOD(set->timeout) * HZ;
 }
 
 static void
-list_set_gc_init(struct ip_set *set, void (*gc)(GC_ARG))
+list_set_gc_init(struct ip_set *set, unsigned long (*gc)(struct ip_set_gc *gc))
 {
 	struct list_set *map = set->data;
 
-	TIMER_SETUP(&map->gc, gc);
-	mod_timer(&map->gc, jiffies + IPSET_GC_PERIOD(set->timeout) * HZ);
+	ip_set_gc_init(set, &map->gc, gc);
+	ip_set_gc_schedule(&map->gc,
+			   jiffies + IPSET_GC_PERIOD(set->timeout) * HZ);
 }
 
 /* Create list:set type of sets */
@@ -598,10 +866,9 @@ init_list_set(struct net *net, struct ip_set *set, u32 size)
 
 	map->size = size;
 	map->net = net;
-#ifdef HAVE_TIMER_SETUP
 	map->set = set;
-#endif
 	INIT_LIST_HEAD(&map->members);
+	INIT_DELAYED_WORK(&map->index_work, list_set_index_work);
 	set->data = map;
 
 	return true;
@@ -624,6 +891,9 @@ list_set_create(struct net *net, struct ip_set *set, struct nlattr *tb[],
 		size = IP_SET_LIST_MIN_SIZE;
 
 	set->variant = &set_variant;
+	if (tb[IPSET_ATTR_CADT_FLAGS] &&
+	    (ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]) & IPSET_FLAG_WITH_INDEX))
+		set->flags |= IPSET_CREATE_FLAG_INDEX;
 	set->dsize = ip_set_elem_len(set, tb, sizeof(struct set_elem),
 				     __alignof__(struct set_elem));
 	if (!init_list_set(net, set, size))
@@ -648,6 +918,7 @@ static struct ip_set_type list_set_type __read_mostly = {
 		[IPSET_ATTR_SIZE]	= { .type = NLA_U32 },
 		[IPSET_ATTR_TIMEOUT]	= { .type = NLA_U32 },
 		[IPSET_ATTR_CADT_FLAGS]	= { .type = NLA_U32 },
+		[IPSET_ATTR_SAMPLE]	= { .type = NLA_U32 },
 	},
 	.adt_policy	= {
 		[IPSET_ATTR_NAME]	= { .type = NLA_STRING,
@@ -0,0 +1,671 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ */
+
+/* Kernel module implementing an IP set type: the range:ip type */
+
+#include <linux/module.h>
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/errno.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <net/netlink.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter/ipset/pfxlen.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <linux/netfilter/ipset/ip_set_range.h>
+
+#define IPSET_TYPE_REV_MIN	0
+#define IPSET_TYPE_REV_MAX	0
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Jozsef Kadlecsik <kadlec@netfilter.org>");
+IP_SET_MODULE_DESC("range:ip", IPSET_TYPE_REV_MIN, IPSET_TYPE_REV_MAX);
+MODULE_ALIAS("ip_set_range:ip");
+
+/* Addresses in host order as 128 bit numbers, IPv4 ones in the low half */
+struct range_ip_key {
+	u64 hi;
+	u64 lo;
+};
+
+/* Disjoint, not adjacent intervals sorted by their first addresses.
+ * The first addresses are searched only, so these are stored apart
+ * from the last ones.
+ */
+struct range_ip_array {
+	struct rcu_head rcu;
+	u32 len;			/* intervals in the array */
+	u32 cap;			/* allocated intervals */
+	struct range_ip_key *last;	/* last addresses of the intervals */
+	struct range_ip_key first[]	/* first addresses of the intervals */
+		__aligned(__alignof__(u64));
+};
+
+/* Type structure.
+ * The readers search the published array. The writers change a private
+ * copy of it, which is published through RCU when the userspace message
+ * is processed.
+ */
+struct range_ip {
+	struct range_ip_array __rcu *live;	/* published array */
+	struct range_ip_array *draft;		/* array under change */
+	bool dirty;				/* draft must be published */
+	u32 maxelem;				/* max elements in the set */
+	size_t memsize;				/* size of the arrays */
+};
+
+/* ADT structure for generic function args */
+struct range_ip_adt_elem {
+	struct range_ip_key first;
+	struct range_ip_key last;
+};
+
+#define range_ip_dereference(set, map)			\
+	rcu_dereference_protected((map)->live,		\
+		lockdep_is_held(&(set)->lock))
+
+/* Comparison and arithmetic of the keys, without branches */
+
+static inline bool
+key_le(const struct range_ip_key *a, const struct range_ip_key *b)
+{
+	return (a->hi < b->hi) | ((a->hi == b->hi) & (a->lo <= b->lo));
+}
+
+static inline bool
+key_lt(const struct range_ip_key *a, const struct range_ip_key *b)
+{
+	return (a->hi < b->hi) | ((a->hi == b->hi) & (a->lo < b->lo));
+}
+
+/* The next address, the highest one is kept */
+static inline struct range_ip_key
+key_next(const struct range_ip_key *k)
+{
+	struct range_ip_key n = *k;
+	bool max = !(~k->hi | ~k->lo);
+
+	n.lo += !max;
+	n.hi += !max & !n.lo;
+	return n;
+}
+
+/* The previous address, the lowest one is kept */
+static inline struct range_ip_key
+key_prev(const struct range_ip_key *k)
+{
+	struct range_ip_key p = *k;
+	bool min = !(k->hi | k->lo);
+
+	p.hi -= !min & !k->lo;
+	p.lo -= !min;
+	return p;
+}
+
+static void
+key_from_ip4(struct range_ip_key *k, u32 ip)
+{
+	k->hi = 0;
+	k->lo = ip;
+}
+
+static void
+key_from_ip6(struct range_ip_key *k, const union nf_inet_addr *ip)
+{
+	k->hi = (u64)ntohl(ip->ip6[0]) << 32 | ntohl(ip->ip6[1]);
+	k->lo = (u64)ntohl(ip->ip6[2]) << 32 | ntohl(ip->ip6[3]);
+}
+
+static void
+key_to_ip6(union nf_inet_addr *ip, const struct range_ip_key *k)
+{
+	ip->ip6[0] = htonl(k->hi >> 32);
+	ip->ip6[1] = htonl((u32)k->hi);
+	ip->ip6[2] = htonl(k->lo >> 32);
+	ip->ip6[3] = htonl((u32)k->lo);
+}
+
+/* The interval of the network of the key with bits host bits */
+static void
+key_netmask(struct range_ip_adt_elem *e, const struct range_ip_key *k,
+	    u8 bits)
+{
+	u64 lo = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+	u64 hi = bits >= 128 ? ~0ULL : bits > 64 ? (1ULL << (bits - 64)) - 1 : 0;
+
+	e->first.hi = k->hi & ~hi;
+	e->first.lo = k->lo & ~lo;
+	e->last.hi = k->hi | hi;
+	e->last.lo = k->lo | lo;
+}
+
+/* Position of the last interval starting not after the key or -1.
+ * The loop runs log2(len) times whatever the data and the selection
+ * is compiled into a conditional move.
+ */
+static int
+range_ip_find(const struct range_ip_array *a, u32 len,
+	      const struct range_ip_key *k)
+{
+	const struct range_ip_key *base = a->first;
+	u32 half;
+
+	if (!len || key_lt(k, &a->first[0]))
+		return -1;
+	while (len > 1) {
+		half = len / 2;
+		base = key_le(&base[half], k) ? base + half : base;
+		len -= half;
+	}
+	return base - a->first;
+}
+
+/* Replace n intervals from pos by the given ones */
+static void
+range_ip_splice(struct range_ip_array *a, u32 pos, u32 n,
+		const struct range_ip_adt_elem *e, u32 count)
+{
+	u32 i, tail = a->len - pos - n;
+
+	memmove(&a->first[pos + count], &a->first[pos + n],
+		tail * sizeof(struct range_ip_key));
+	memmove(&a->last[pos + count], &a->last[pos + n],
+		tail * sizeof(struct range_ip_key));
+	for (i = 0; i < count; i++) {
+		a->first[pos + i] = e[i].first;
+		a->last[pos + i] = e[i].last;
+	}
+	a->len = a->len - n + count;
+}
+
+static size_t
+range_ip_array_size(u32 cap)
+{
+	return sizeof(struct range_ip_array) +
+	       2 * (size_t)cap * sizeof(struct range_ip_key);
+}
+
+static struct range_ip_array *
+range_ip_array_alloc(struct range_ip *map, u32 cap)
+{
+	struct range_ip_array *a = ip_set_alloc(range_ip_array_size(cap));
+
+	if (!a)
+		return NULL;
+	a->cap = cap;
+	a->last = a->first + cap;
+	map->memsize += range_ip_array_size(cap);
+	return a;
+}
+
+static void
+range_ip_array_free_rcu(struct rcu_head *head)
+{
+	struct range_ip_array *a = container_of(head, struct range_ip_array,
+						rcu);
+
+	ip_set_free(a);
+}
+
+static void
+range_ip_array_release(struct ip_set *set, struct range_ip_array *a)
+{
+	struct range_ip *map = set->data;
+
+	map->memsize -= range_ip_array_size(a->cap);
+	ip_set_mem_charge(set, -(long)range_ip_array_size(a->cap), true);
+	call_rcu(&a->rcu, range_ip_array_free_rcu);
+}
+
+/* Low level add/del/test functions */
+
+static int
+range_ip_test(struct ip_set *set, void *value, const struct ip_set_ext *ext,
+	      struct ip_set_ext *mext, u32 flags)
+{
+	struct range_ip *map = set->data;
+	const struct range_ip_adt_elem *e = value;
+	const struct range_ip_array *a = rcu_dereference_bh(map->live);
+	int i;
+
+	if (!a)
+		return 0;
+	i = range_ip_find(a, a->len, &e->first);
+	return i >= 0 && key_le(&e->last, &a->last[i]);
+}
+
+/* There must be room for one more interval in the draft */
+static bool
+range_ip_room(struct range_ip *map)
+{
+	return map->draft && map->draft->len < map->draft->cap;
+}
+
+static int
+range_ip_add(struct ip_set *set, void *value, const struct ip_set_ext *ext,
+	     struct ip_set_ext *mext, u32 flags)
+{
+	struct range_ip *map = set->data;
+	struct range_ip_adt_elem m = *(const struct range_ip_adt_elem *)value;
+	struct range_ip_array *a = map->draft;
+	struct range_ip_key k;
+	int i, j, lo;
+
+	if (!range_ip_room(map))
+		return -EAGAIN;
+
+	/* The intervals overlapping or adjacent to the new one are merged */
+	i = range_ip_find(a, a->len, &m.first);
+	if (i >= 0 && key_le(&m.last, &a->last[i]))
+		return (flags & IPSET_FLAG_EXIST) ? 0 : -IPSET_ERR_EXIST;
+	lo = i + 1;
+	if (i >= 0) {
+		k = key_next(&a->last[i]);
+		if (key_le(&m.first, &k))
+			lo = i;
+	}
+	k = key_next(&m.last);
+	j = range_ip_find(a, a->len, &k);
+	if (j < lo && a->len >= map->maxelem)
+		return -IPSET_ERR_RANGE_FULL;
+	if (j >= lo) {
+		if (key_lt(&a->first[lo], &m.first))
+			m.first = a->first[lo];
+		if (key_lt(&m.last, &a->last[j]))
+			m.last = a->last[j];
+	}
+	range_ip_splice(a, lo, j - lo + 1, &m, 1);
+	set->elements = a->len;
+	map->dirty = true;
+
+	return 0;
+}
+
+static int
+range_ip_del(struct ip_set *set, void *value, const struct ip_set_ext *ext,
+	     struct ip_set_ext *mext, u32 flags)
+{
+	struct range_ip *map = set->data;
+	const struct range_ip_adt_elem *e = value;
+	struct range_ip_array *a = map->draft;
+	struct range_ip_adt_elem m[2];
+	u32 count = 0;
+	int i, f, l;
+
+	if (!range_ip_room(map))
+		return -EAGAIN;
+
+	/* The overlapping intervals are cut back or removed */
+	i = range_ip_find(a, a->len, &e->first);
+	f = i >= 0 && key_le(&e->first, &a->last[i]) ? i : i + 1;
+	l = range_ip_find(a, a->len, &e->last);
+	if (l < f)
+		return -IPSET_ERR_EXIST;
+	if (key_lt(&a->first[f], &e->first)) {
+		m[count].first = a->first[f];
+		m[count++].last = key_prev(&e->first);
+	}
+	if (key_lt(&e->last, &a->last[l])) {
+		m[count].first = key_next(&e->last);
+		m[count++].last = a->last[l];
+	}
+	range_ip_splice(a, f, l - f + 1, m, count);
+	set->elements = a->len;
+	map->dirty = true;
+
+	return 0;
+}
+
+/* Make room in a new draft, out of the set lock */
+static int
+range_ip_resize(struct ip_set *set, bool retried)
+{
+	struct range_ip *map = set->data;
+	struct range_ip_array *src, *tmp, *old;
+	u64 cap;
+	u32 len;
+
+	src = map->draft ? map->draft
+			 : rcu_dereference_protected(map->live, 1);
+	len = src ? src->len : 0;
+	cap = (u64)len + max_t(u32, len / 2, 64);
+	if (cap > U32_MAX)
+		return -ENOMEM;
+
+	if (!ip_set_mem_charge(set, range_ip_array_size(cap), false))
+		return -IPSET_ERR_MEM_BUDGET;
+	tmp = range_ip_array_alloc(map, cap);
+	if (!tmp) {
+		ip_set_mem_charge(set, -(long)range_ip_array_size(cap), true);
+		return -ENOMEM;
+	}
+	if (src) {
+		memcpy(tmp->first, src->first, len * sizeof(*src->first));
+		memcpy(tmp->last, src->last, len * sizeof(*src->last));
+		tmp->len = len;
+	}
+	spin_lock_bh(&set->lock);
+	old = map->draft;
+	map->draft = tmp;
+	spin_unlock_bh(&set->lock);
+	if (old)
+		range_ip_array_release(set, old);
+
+	return 0;
+}
+
+/* Publish the changes of a userspace message */
+static void
+range_ip_batch(struct ip_set *set, bool start)
+{
+	struct range_ip *map = set->data;
+	struct range_ip_array *old;
+
+	if (start)
+		return;
+	spin_lock_bh(&set->lock);
+	if (map->dirty) {
+		old = range_ip_dereference(set, map);
+		rcu_assign_pointer(map->live, map->draft);
+		map->draft = NULL;
+		map->dirty = false;
+		if (old)
+			range_ip_array_release(set, old);
+	}
+	spin_unlock_bh(&set->lock);
+}
+
+static int
+range_ip_kadt(struct ip_set *set, const struct sk_buff *skb,
+	      const struct xt_action_param *par,
+	      enum ipset_adt adt, struct ip_set_adt_opt *opt)
+{
+	ipset_adtfn adtfn = set->variant->adt[adt];
+	struct range_ip_adt_elem e;
+	union nf_inet_addr ip;
+
+	/* The arrays are changed from userspace only */
+	if (adt != IPSET_TEST)
+		return -EOPNOTSUPP;
+
+	if (set->family == NFPROTO_IPV4) {
+		key_from_ip4(&e.first,
+			     ntohl(ip4addr(skb, opt->flags & IPSET_DIM_ONE_SRC)));
+	} else {
+		ip6addrptr(skb, opt->flags & IPSET_DIM_ONE_SRC, &ip.in6);
+		key_from_ip6(&e.first, &ip);
+	}
+	e.last = e.first;
+
+	return adtfn(set, &e, NULL, NULL, opt->cmdflags);
+}
+
+static int
+range_ip_get_key(const struct ip_set *set, struct nlattr *nla,
+		 struct range_ip_key *k)
+{
+	union nf_inet_addr ip;
+	u32 ip4;
+	int ret;
+
+	if (set->family == NFPROTO_IPV4) {
+		ret = ip_set_get_hostipaddr4(nla, &ip4);
+		if (!ret)
+			key_from_ip4(k, ip4);
+	} else {
+		ret = ip_set_get_ipaddr6(nla, &ip);
+		if (!ret)
+			key_from_ip6(k, &ip);
+	}
+	return ret;
+}
+
+static int
+range_ip_uadt(struct ip_set *set, struct nlattr *tb[],
+	      enum ipset_adt adt, u32 *lineno, u32 flags, bool retried)
+{
+	ipset_adtfn adtfn = set->variant->adt[adt];
+	u8 host_mask = set->family == NFPROTO_IPV4 ? 32 : 128;
+	struct range_ip_adt_elem e;
+	struct range_ip_key k;
+	int ret;
+
+	if (tb[IPSET_ATTR_LINENO])
+		*lineno = nla_get_u32(tb[IPSET_ATTR_LINENO]);
+
+	if (unlikely(!tb[IPSET_ATTR_IP]))
+		return -IPSET_ERR_PROTOCOL;
+
+	ret = range_ip_get_key(set, tb[IPSET_ATTR_IP], &k);
+	if (ret)
+		return ret;
+
+	if (tb[IPSET_ATTR_IP_TO]) {
+		e.first = k;
+		ret = range_ip_get_key(set, tb[IPSET_ATTR_IP_TO], &e.last);
+		if (ret)
+			return ret;
+		if (key_lt(&e.last, &e.first))
+			swap(e.first, e.last);
+	} else if (tb[IPSET_ATTR_CIDR]) {
+		u8 cidr = nla_get_u8(tb[IPSET_ATTR_CIDR]);
+
+		if (!cidr || cidr > host_mask)
+			return -IPSET_ERR_INVALID_CIDR;
+		key_netmask(&e, &k, host_mask - cidr);
+	} else {
+		e.first = e.last = k;
+	}
+
+	return adtfn(set, &e, NULL, NULL, flags);
+}
+
+static void
+range_ip_flush(struct ip_set *set)
+{
+	struct range_ip *map = set->data;
+	struct range_ip_array *a = range_ip_dereference(set, map);
+
+	if (a) {
+		RCU_INIT_POINTER(map->live, NULL);
+		range_ip_array_release(set, a);
+	}
+	if (map->draft) {
+		range_ip_array_release(set, map->draft);
+		map->draft = NULL;
+	}
+	map->dirty = false;
+	set->elements = 0;
+}
+
+static void
+range_ip_destroy(struct ip_set *set)
+{
+	struct range_ip *map = set->data;
+
+	ip_set_free(rcu_dereference_protected(map->live, 1));
+	ip_set_free(map->draft);
+	kfree(map);
+
+	set->data = NULL;
+}
+
+static int
+range_ip_head(struct ip_set *set, struct sk_buff *skb,
+	      const struct netlink_callback *cb)
+{
+	const struct range_ip *map = set->data;
+	struct nlattr *nested;
+
+	nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
+	if (!nested)
+		goto nla_put_failure;
+	if (nla_put_net32(skb, IPSET_ATTR_MAXELEM, htonl(map->maxelem)) ||
+	    nla_put_net32(skb, IPSET_ATTR_REFERENCES, htonl(set->ref)) ||
+	    nla_put_net32(skb, IPSET_ATTR_MEMSIZE,
+			  htonl(sizeof(*map) + map->memsize)) ||
+	    nla_put_net32(skb, IPSET_ATTR_ELEMENTS, htonl(set->elements)))
+		goto nla_put_failure;
+	if (unlikely(ip_set_put_flags(skb, set)))
+		goto nla_put_failure;
+	ipset_nest_end(skb, nested);
+
+	return 0;
+nla_put_failure:
+	return -EMSGSIZE;
+}
+
+static bool
+range_ip_list_addr(struct sk_buff *skb, const struct ip_set *set, int type,
+		   const struct range_ip_key *k)
+{
+	union nf_inet_addr ip;
+
+	if (set->family == NFPROTO_IPV4)
+		return nla_put_ipaddr4(skb, type, htonl((u32)k->lo));
+	key_to_ip6(&ip, k);
+	return nla_put_ipaddr6(skb, type, &ip.in6);
+}
+
+static int
+range_ip_list(const struct ip_set *set,
+	      struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct range_ip *map = set->data;
+	const struct range_ip_array *a;
+	struct nlattr *adt, *nested;
+	u32 i, first = cb->args[IPSET_CB_ARG0];
+	int ret = 0;
+
+	adt = ipset_nest_start(skb, IPSET_ATTR_ADT);
+	if (!adt)
+		return -EMSGSIZE;
+	rcu_read_lock_bh();
+	a = rcu_dereference_bh(map->live);
+	for (i = first; a && i < a->len; i++) {
+		nested = ipset_nest_start(skb, IPSET_ATTR_DATA);
+		if (!nested)
+			goto nla_put_failure;
+		if (range_ip_list_addr(skb, set, IPSET_ATTR_IP,
+				       &a->first[i]) ||
+		    (key_lt(&a->first[i], &a->last[i]) &&
+		     range_ip_list_addr(skb, set, IPSET_ATTR_IP_TO,
+					&a->last[i])))
+			goto nla_put_failure;
+		ipset_nest_end(skb, nested);
+	}
+	ipset_nest_end(skb, adt);
+
+	/* Set listing finished */
+	cb->args[IPSET_CB_ARG0] = 0;
+
+	goto out;
+
+nla_put_failure:
+	nla_nest_cancel(skb, nested);
+	if (unlikely(i == first)) {
+		nla_nest_cancel(skb, adt);
+		cb->args[IPSET_CB_ARG0] = 0;
+		ret = -EMSGSIZE;
+	} else {
+		cb->args[IPSET_CB_ARG0] = i;
+		ipset_nest_end(skb, adt);
+	}
+out:
+	rcu_read_unlock_bh();
+	return ret;
+}
+
+static bool
+range_ip_same_set(const struct ip_set *a, const struct ip_set *b)
+{
+	const struct range_ip *x = a->data;
+	const struct range_ip *y = b->data;
+
+	return x->maxelem == y->maxelem;
+}
+
+static const struct ip_set_type_variant range_ip_variant = {
+	.kadt	= range_ip_kadt,
+	.uadt	= range_ip_uadt,
+	.adt	= {
+		[IPSET_ADD] = range_ip_add,
+		[IPSET_DEL] = range_ip_del,
+		[IPSET_TEST] = range_ip_test,
+	},
+	.resize	= range_ip_resize,
+	.destroy = range_ip_destroy,
+	.flush	= range_ip_flush,
+	.head	= range_ip_head,
+	.list	= range_ip_list,
+	.batch	= range_ip_batch,
+	.same_set = range_ip_same_set,
+};
+
+/* Create range:ip type of sets */
+
+static int
+range_ip_create(struct net *net, struct ip_set *set, struct nlattr *tb[],
+		u32 flags)
+{
+	struct range_ip *map;
+
+	if (!(set->family == NFPROTO_IPV4 || set->family == NFPROTO_IPV6))
+		return -IPSET_ERR_INVALID_FAMILY;
+
+	if (unlikely(!ip_set_optattr_netorder(tb, IPSET_ATTR_MAXELEM)))
+		return -IPSET_ERR_PROTOCOL;
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	map->maxelem = IPSET_DEFAULT_RANGE_MAXELEM;
+	if (tb[IPSET_ATTR_MAXELEM])
+		map->maxelem = ip_set_get_h32(tb[IPSET_ATTR_MAXELEM]);
+	set->timeout = IPSET_NO_TIMEOUT;
+	set->data = map;
+	set->variant = &range_ip_variant;
+
+	return 0;
+}
+
+static struct ip_set_type range_ip_type __read_mostly = {
+	.name		= "range:ip",
+	.protocol	= IPSET_PROTOCOL,
+	.features	= IPSET_TYPE_IP,
+	.dimension	= IPSET_DIM_ONE,
+	.family		= NFPROTO_UNSPEC,
+	.revision_min	= IPSET_TYPE_REV_MIN,
+	.revision_max	= IPSET_TYPE_REV_MAX,
+	.create		= range_ip_create,
+	.create_policy	= {
+		[IPSET_ATTR_MAXELEM]	= { .type = NLA_U32 },
+	},
+	.adt_policy	= {
+		[IPSET_ATTR_IP]		= { .type = NLA_NESTED },
+		[IPSET_ATTR_IP_TO]	= { .type = NLA_NESTED },
+		[IPSET_ATTR_CIDR]	= { .type = NLA_U8 },
+		[IPSET_ATTR_LINENO]	= { .type = NLA_U32 },
+	},
+	.me		= THIS_MODULE,
+};
+
+static int __init
+range_ip_init(void)
+{
+	return ip_set_type_register(&range_ip_type);
+}
+
+static void __exit
+range_ip_fini(void)
+{
+	rcu_barrier();
+	ip_set_type_unregister(&range_ip_type);
+}
+
+module_init(range_ip_init);
+module_exit(range_ip_fini);
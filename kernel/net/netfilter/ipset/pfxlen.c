@@ -146,8 +146,10 @@
 
 /* This table works for both IPv4 and IPv6;
  * just use prefixlen_netmask_map[prefixlength].ip.
+ * An entry is aligned to its size, for the wide word masking.
  */
-const union nf_inet_addr ip_set_netmask_map[] = {
+const union nf_inet_addr ip_set_netmask_map[]
+__aligned(sizeof(union nf_inet_addr)) = {
 	PREFIXES_MAP
 };
 EXPORT_SYMBOL_GPL(ip_set_netmask_map);
@@ -160,8 +162,10 @@ EXPORT_SYMBOL_GPL(ip_set_netmask_map);
 
 /* This table works for both IPv4 and IPv6;
  * just use prefixlen_hostmask_map[prefixlength].ip.
+ * An entry is aligned to its size, for the wide word masking.
  */
-const union nf_inet_addr ip_set_hostmask_map[] = {
+const union nf_inet_addr ip_set_hostmask_map[]
+__aligned(sizeof(union nf_inet_addr)) = {
 	PREFIXES_MAP
 };
 EXPORT_SYMBOL_GPL(ip_set_hostmask_map);
@@ -300,6 +300,143 @@ static const struct ipset_arg ipset_args[] = {
 		.print = ipset_print_hexnumber,
 		.help = "[initval VALUE]",
 	},
+	[IPSET_ARG_LPM] = {
+		.name = { "lpm", NULL },
+		.has_arg = IPSET_NO_ARG,
+		.opt = IPSET_OPT_LPM,
+		.parse = ipset_parse_flag,
+		.print = ipset_print_flag,
+		.help = "[lpm]",
+	},
+	[IPSET_ARG_PERCPU] = {
+		.name = { "percpu", NULL },
+		.has_arg = IPSET_NO_ARG,
+		.opt = IPSET_OPT_PERCPU,
+		.parse = ipset_parse_flag,
+		.print = ipset_print_flag,
+		.help = "[percpu]",
+	},
+	[IPSET_ARG_BLOOM] = {
+		.name = { "bloom", NULL },
+		.has_arg = IPSET_NO_ARG,
+		.opt = IPSET_OPT_BLOOM,
+		.parse = ipset_parse_flag,
+		.print = ipset_print_flag,
+		.help = "[bloom]",
+	},
+	[IPSET_ARG_HASHFN] = {
+		.name = { "hashfn", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_HASHFN,
+		.parse = ipset_parse_hashfn,
+		.print = ipset_print_hashfn,
+		.help = "[hashfn jhash|hsiphash|mulshift]",
+	},
+	[IPSET_ARG_PREALLOC] = {
+		.name = { "prealloc", NULL },
+		.has_arg = IPSET_NO_ARG,
+		.opt = IPSET_OPT_PREALLOC,
+		.parse = ipset_parse_flag,
+		.print = ipset_print_flag,
+		.help = "[prealloc]",
+	},
+	[IPSET_ARG_REGIONBITS] = {
+		.name = { "regionbits", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_REGIONBITS,
+		.parse = ipset_parse_uint8,
+		.print = ipset_print_number,
+		.help = "[regionbits VALUE]",
+	},
+	[IPSET_ARG_NUMA] = {
+		.name = { "numa", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_NUMA,
+		.parse = ipset_parse_numa,
+		.print = ipset_print_numa,
+		.help = "[numa interleave|NODE]",
+	},
+	[IPSET_ARG_INDEX] = {
+		.name = { "index", NULL },
+		.has_arg = IPSET_NO_ARG,
+		.opt = IPSET_OPT_MERGED_INDEX,
+		.parse = ipset_parse_flag,
+		.print = ipset_print_flag,
+		.help = "[index]",
+	},
+	[IPSET_ARG_SAMPLE] = {
+		.name = { "sample", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_SAMPLE,
+		.parse = ipset_parse_uint32,
+		.print = ipset_print_number,
+		.help = "[sample VALUE]",
+	},
+	[IPSET_ARG_AGGREGATE] = {
+		.name = { "aggregate", NULL },
+		.has_arg = IPSET_NO_ARG,
+		.opt = IPSET_OPT_AGGREGATE,
+		.parse = ipset_parse_flag,
+		.print = ipset_print_flag,
+		.help = "[aggregate]",
+	},
+	[IPSET_ARG_DISTINCT] = {
+		.name = { "distinct", NULL },
+		.has_arg = IPSET_NO_ARG,
+		.opt = IPSET_OPT_DISTINCT,
+		.parse = ipset_parse_flag,
+		.print = ipset_print_flag,
+		.help = "[distinct]",
+	},
+	/* Listed only: the saved estimate is skipped at restore */
+	[IPSET_ARG_ADT_DISTINCT] = {
+		.name = { "distinct", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_ADT_DISTINCT,
+		.parse = ipset_parse_listed,
+		.print = ipset_print_number,
+	},
+	[IPSET_ARG_RATE] = {
+		.name = { "rate", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_RATE,
+		.parse = ipset_parse_uint32,
+		.print = ipset_print_number,
+		.help = "[rate VALUE]",
+	},
+	[IPSET_ARG_BURST] = {
+		.name = { "burst", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_BURST,
+		.parse = ipset_parse_uint32,
+		.print = ipset_print_number,
+		.help = "[burst VALUE]",
+	},
+	/* The family of the types supporting dual-stack sets */
+	[IPSET_ARG_FAMILY_INET46] = {
+		.name = { "family", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_FAMILY,
+		.parse = ipset_parse_family,
+		.print = ipset_print_family,
+		.help = "[family inet|inet6|inet46]|[-4|-6]",
+	},
+	[IPSET_ARG_CTEVENTS] = {
+		.name = { "ctevents", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_CTEVENTS,
+		.parse = ipset_parse_ctevents,
+		.print = ipset_print_ctevents,
+		.help = "[ctevents new|assured[,destroy]]",
+	},
+	[IPSET_ARG_CTDIR] = {
+		.name = { "ctdir", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.opt = IPSET_OPT_CTDIR,
+		.parse = ipset_parse_ctdir,
+		.print = ipset_print_ctdir,
+		.help = "[ctdir [original:|reply:]src|dst[,src|dst...]]",
+	},
 };
 
 const struct ipset_arg *
@@ -27,6 +27,8 @@
 struct ipset_data {
 	/* Option bits: which fields are set */
 	uint64_t bits;
+	/* Extended option bits: which fields are set */
+	uint64_t ext_bits;
 	/* Option bits: which options are ignored */
 	uint64_t ignored;
 	/* Setname  */
@@ -39,6 +41,8 @@ struct ipset_data {
 	uint32_t flags;		/* command level flags */
 	uint32_t cadt_flags;	/* data level flags */
 	uint32_t timeout;
+	uint32_t rate;
+	uint32_t burst;
 	union nf_inet_addr ip;
 	union nf_inet_addr ip_to;
 	uint32_t mark;
@@ -53,6 +57,13 @@ struct ipset_data {
 			uint8_t bucketsize;
 			uint8_t resize;
 			uint8_t netmask;
+			uint8_t hashfn;
+			uint8_t regionbits;
+			uint8_t tablepages;
+			uint32_t numa;
+			uint32_t sample;
+			uint32_t ctevents;
+			uint32_t ctdir;
 			uint32_t hashsize;
 			uint32_t maxelem;
 			uint32_t markmask;
@@ -62,6 +73,11 @@ struct ipset_data {
 			uint32_t references;
 			uint32_t elements;
 			uint32_t memsize;
+			uint32_t bloom_fpr;
+			uint32_t epoch;
+			struct ipset_lockstat lockstat;
+			struct ipset_lookupstat lookupstat;
+			struct ipset_memstat memstat;
 			char typename[IPSET_MAXNAMELEN];
 			uint8_t revision_min;
 			uint8_t revision;
@@ -82,6 +98,8 @@ struct ipset_data {
 			uint64_t skbmark;
 			uint32_t skbprio;
 			uint16_t skbqueue;
+			/* Filled out by kernel */
+			uint32_t distinct;
 		} adt;
 	};
 };
@@ -177,6 +195,49 @@ ipset_data_flags_unset(struct ipset_data *data, uint64_t flags)
 	data->bits &= ~flags;
 }
 
+/**
+ * ipset_data_ext_flags_test - test extended option bits in the data blob
+ * @data: data blob
+ * @flags: the extended option flags to test
+ *
+ * Returns true if the extended options are already set in the data blob.
+ */
+bool
+ipset_data_ext_flags_test(const struct ipset_data *data, uint64_t flags)
+{
+	assert(data);
+	return !!(data->ext_bits & flags);
+}
+
+/**
+ * ipset_data_ext_flags_set - set extended option bits in the data blob
+ * @data: data blob
+ * @flags: the extended option flags to set
+ *
+ * The function sets the flags in the data blob so that
+ * the corresponding fields are regarded as if filled with proper data.
+ */
+void
+ipset_data_ext_flags_set(struct ipset_data *data, uint64_t flags)
+{
+	assert(data);
+	data->ext_bits |= flags;
+}
+
+/**
+ * ipset_data_ext_flags_unset - unset extended option bits in the data blob
+ * @data: data blob
+ * @flags: the extended option flags to unset
+ *
+ * The function unsets the flags in the data blob.
+ */
+void
+ipset_data_ext_flags_unset(struct ipset_data *data, uint64_t flags)
+{
+	assert(data);
+	data->ext_bits &= ~flags;
+}
+
 #define flag_type_attr(data, opt, flag)		\
 do {						\
 	data->flags |= flag;			\
@@ -257,13 +318,15 @@ ipset_data_set(struct ipset_data *data, enum ipset_opt opt, const void *value)
 	/* CADT options */
 	case IPSET_OPT_IP:
 		if (!(data->family == NFPROTO_IPV4 ||
-		      data->family == NFPROTO_IPV6))
+		      data->family == NFPROTO_IPV6 ||
+		      data->family == NFPROTO_INET))
 			return -1;
 		copy_addr(data->family, &data->ip, value);
 		break;
 	case IPSET_OPT_IP_TO:
 		if (!(data->family == NFPROTO_IPV4 ||
-		      data->family == NFPROTO_IPV6))
+		      data->family == NFPROTO_IPV6 ||
+		      data->family == NFPROTO_INET))
 			return -1;
 		copy_addr(data->family, &data->ip_to, value);
 		break;
@@ -282,6 +345,12 @@ ipset_data_set(struct ipset_data *data, enum ipset_opt opt, const void *value)
 	case IPSET_OPT_TIMEOUT:
 		data->timeout = *(const uint32_t *) value;
 		break;
+	case IPSET_OPT_RATE:
+		data->rate = *(const uint32_t *) value;
+		break;
+	case IPSET_OPT_BURST:
+		data->burst = *(const uint32_t *) value;
+		break;
 	case IPSET_OPT_INDEX:
 		data->index = *(const uint16_t *) value;
 		break;
@@ -322,6 +391,27 @@ ipset_data_set(struct ipset_data *data, enum ipset_opt opt, const void *value)
 	case IPSET_OPT_SKBINFO:
 		cadt_flag_type_attr(data, opt, IPSET_FLAG_WITH_SKBINFO);
 		break;
+	case IPSET_OPT_LPM:
+		cadt_flag_type_attr(data, opt, IPSET_FLAG_WITH_LPM);
+		break;
+	case IPSET_OPT_PERCPU:
+		cadt_flag_type_attr(data, opt, IPSET_FLAG_WITH_PERCPU);
+		break;
+	case IPSET_OPT_BLOOM:
+		cadt_flag_type_attr(data, opt, IPSET_FLAG_WITH_BLOOM);
+		break;
+	case IPSET_OPT_PREALLOC:
+		cadt_flag_type_attr(data, opt, IPSET_FLAG_WITH_PREALLOC);
+		break;
+	case IPSET_OPT_MERGED_INDEX:
+		cadt_flag_type_attr(data, opt, IPSET_FLAG_WITH_INDEX);
+		break;
+	case IPSET_OPT_AGGREGATE:
+		cadt_flag_type_attr(data, opt, IPSET_FLAG_WITH_AGGREGATE);
+		break;
+	case IPSET_OPT_DISTINCT:
+		cadt_flag_type_attr(data, opt, IPSET_FLAG_WITH_DISTINCT);
+		break;
 	/* Create-specific options, filled out by the kernel */
 	case IPSET_OPT_ELEMENTS:
 		data->create.elements = *(const uint32_t *) value;
@@ -332,6 +422,45 @@ ipset_data_set(struct ipset_data *data, enum ipset_opt opt, const void *value)
 	case IPSET_OPT_MEMSIZE:
 		data->create.memsize = *(const uint32_t *) value;
 		break;
+	case IPSET_OPT_BLOOM_FPR:
+		data->create.bloom_fpr = *(const uint32_t *) value;
+		break;
+	case IPSET_OPT_HASHFN:
+		data->create.hashfn = *(const uint8_t *) value;
+		break;
+	case IPSET_OPT_REGIONBITS:
+		data->create.regionbits = *(const uint8_t *) value;
+		break;
+	case IPSET_OPT_TABLEPAGES:
+		data->create.tablepages = *(const uint8_t *) value;
+		break;
+	case IPSET_OPT_NUMA:
+		data->create.numa = *(const uint32_t *) value;
+		break;
+	case IPSET_OPT_SAMPLE:
+		data->create.sample = *(const uint32_t *) value;
+		break;
+	case IPSET_OPT_CTEVENTS:
+		data->create.ctevents = *(const uint32_t *) value;
+		break;
+	case IPSET_OPT_CTDIR:
+		data->create.ctdir = *(const uint32_t *) value;
+		break;
+	case IPSET_OPT_EPOCH:
+		data->create.epoch = *(const uint32_t *) value;
+		break;
+	case IPSET_OPT_LOCKSTAT:
+		memcpy(&data->create.lockstat, value,
+		       sizeof(data->create.lockstat));
+		break;
+	case IPSET_OPT_LOOKUPSTAT:
+		memcpy(&data->create.lookupstat, value,
+		       sizeof(data->create.lookupstat));
+		break;
+	case IPSET_OPT_MEMSTAT:
+		memcpy(&data->create.memstat, value,
+		       sizeof(data->create.memstat));
+		break;
 	/* Create-specific options, type */
 	case IPSET_OPT_TYPENAME:
 		ipset_strlcpy(data->create.typename, value,
@@ -355,13 +484,15 @@ ipset_data_set(struct ipset_data *data, enum ipset_opt opt, const void *value)
 		break;
 	case IPSET_OPT_IP2:
 		if (!(data->family == NFPROTO_IPV4 ||
-		      data->family == NFPROTO_IPV6))
+		      data->family == NFPROTO_IPV6 ||
+		      data->family == NFPROTO_INET))
 			return -1;
 		copy_addr(data->family, &data->adt.ip2, value);
 		break;
 	case IPSET_OPT_IP2_TO:
 		if (!(data->family == NFPROTO_IPV4 ||
-		      data->family == NFPROTO_IPV6))
+		      data->family == NFPROTO_IPV6 ||
+		      data->family == NFPROTO_INET))
 			return -1;
 		copy_addr(data->family, &data->adt.ip2_to, value);
 		break;
@@ -393,6 +524,9 @@ ipset_data_set(struct ipset_data *data, enum ipset_opt opt, const void *value)
 	case IPSET_OPT_SKBQUEUE:
 		data->adt.skbqueue = *(const uint16_t *) value;
 		break;
+	case IPSET_OPT_ADT_DISTINCT:
+		data->adt.distinct = *(const uint32_t *) value;
+		break;
 	/* Swap/rename */
 	case IPSET_OPT_SETNAME2:
 		ipset_strlcpy(data->setname2, value, IPSET_MAXNAMELEN);
@@ -439,12 +573,36 @@ ipset_data_set(struct ipset_data *data, enum ipset_opt opt, const void *value)
 		if (data->cadt_flags & IPSET_FLAG_IFACE_WILDCARD)
 			ipset_data_flags_set(data,
 					     IPSET_FLAG(IPSET_OPT_IFACE_WILDCARD));
+		if (data->cadt_flags & IPSET_FLAG_WITH_LPM)
+			ipset_data_flags_set(data,
+					     IPSET_FLAG(IPSET_OPT_LPM));
+		if (data->cadt_flags & IPSET_FLAG_WITH_PERCPU)
+			ipset_data_flags_set(data,
+					     IPSET_FLAG(IPSET_OPT_PERCPU));
+		if (data->cadt_flags & IPSET_FLAG_WITH_BLOOM)
+			ipset_data_flags_set(data,
+					     IPSET_FLAG(IPSET_OPT_BLOOM));
+		if (data->cadt_flags & IPSET_FLAG_WITH_PREALLOC)
+			ipset_data_flags_set(data,
+					     IPSET_FLAG(IPSET_OPT_PREALLOC));
+		if (data->cadt_flags & IPSET_FLAG_WITH_INDEX)
+			ipset_data_ext_flags_set(data,
+					IPSET_EXT_FLAG(IPSET_OPT_MERGED_INDEX));
+		if (data->cadt_flags & IPSET_FLAG_WITH_AGGREGATE)
+			ipset_data_ext_flags_set(data,
+					IPSET_EXT_FLAG(IPSET_OPT_AGGREGATE));
+		if (data->cadt_flags & IPSET_FLAG_WITH_DISTINCT)
+			ipset_data_ext_flags_set(data,
+					IPSET_EXT_FLAG(IPSET_OPT_DISTINCT));
 		break;
 	default:
 		return -1;
 	};
 
-	ipset_data_flags_set(data, IPSET_FLAG(opt));
+	if (opt >= IPSET_OPT_EXT)
+		ipset_data_ext_flags_set(data, IPSET_EXT_FLAG(opt));
+	else
+		ipset_data_flags_set(data, IPSET_FLAG(opt));
 	return 0;
 }
 
@@ -495,6 +653,10 @@ ipset_data_get(const struct ipset_data *data, enum ipset_opt opt)
 		return &data->port_to;
 	case IPSET_OPT_TIMEOUT:
 		return &data->timeout;
+	case IPSET_OPT_RATE:
+		return &data->rate;
+	case IPSET_OPT_BURST:
+		return &data->burst;
 	case IPSET_OPT_INDEX:
 		return &data->index;
 	/* Create-specific options */
@@ -521,6 +683,30 @@ ipset_data_get(const struct ipset_data *data, enum ipset_opt opt)
 		return &data->create.references;
 	case IPSET_OPT_MEMSIZE:
 		return &data->create.memsize;
+	case IPSET_OPT_BLOOM_FPR:
+		return &data->create.bloom_fpr;
+	case IPSET_OPT_HASHFN:
+		return &data->create.hashfn;
+	case IPSET_OPT_REGIONBITS:
+		return &data->create.regionbits;
+	case IPSET_OPT_TABLEPAGES:
+		return &data->create.tablepages;
+	case IPSET_OPT_NUMA:
+		return &data->create.numa;
+	case IPSET_OPT_SAMPLE:
+		return &data->create.sample;
+	case IPSET_OPT_CTEVENTS:
+		return &data->create.ctevents;
+	case IPSET_OPT_CTDIR:
+		return &data->create.ctdir;
+	case IPSET_OPT_EPOCH:
+		return &data->create.epoch;
+	case IPSET_OPT_LOCKSTAT:
+		return &data->create.lockstat;
+	case IPSET_OPT_LOOKUPSTAT:
+		return &data->create.lookupstat;
+	case IPSET_OPT_MEMSTAT:
+		return &data->create.memstat;
 	/* Create-specific options, TYPE */
 	case IPSET_OPT_REVISION:
 		return &data->create.revision;
@@ -555,6 +741,8 @@ ipset_data_get(const struct ipset_data *data, enum ipset_opt opt)
 		return &data->adt.skbprio;
 	case IPSET_OPT_SKBQUEUE:
 		return &data->adt.skbqueue;
+	case IPSET_OPT_ADT_DISTINCT:
+		return &data->adt.distinct;
 	/* Swap/rename */
 	case IPSET_OPT_SETNAME2:
 		return data->setname2;
@@ -571,6 +759,13 @@ ipset_data_get(const struct ipset_data *data, enum ipset_opt opt)
 	case IPSET_OPT_FORCEADD:
 	case IPSET_OPT_SKBINFO:
 	case IPSET_OPT_IFACE_WILDCARD:
+	case IPSET_OPT_LPM:
+	case IPSET_OPT_PERCPU:
+	case IPSET_OPT_BLOOM:
+	case IPSET_OPT_PREALLOC:
+	case IPSET_OPT_MERGED_INDEX:
+	case IPSET_OPT_AGGREGATE:
+	case IPSET_OPT_DISTINCT:
 		return &data->cadt_flags;
 	default:
 		return NULL;
@@ -608,6 +803,8 @@ ipset_data_sizeof(enum ipset_opt opt, uint8_t family)
 	case IPSET_OPT_NAMEREF:
 		return IPSET_MAXNAMELEN;
 	case IPSET_OPT_TIMEOUT:
+	case IPSET_OPT_RATE:
+	case IPSET_OPT_BURST:
 	case IPSET_OPT_INITVAL:
 	case IPSET_OPT_HASHSIZE:
 	case IPSET_OPT_MAXELEM:
@@ -616,7 +813,14 @@ ipset_data_sizeof(enum ipset_opt opt, uint8_t family)
 	case IPSET_OPT_ELEMENTS:
 	case IPSET_OPT_REFERENCES:
 	case IPSET_OPT_MEMSIZE:
+	case IPSET_OPT_BLOOM_FPR:
 	case IPSET_OPT_SKBPRIO:
+	case IPSET_OPT_NUMA:
+	case IPSET_OPT_SAMPLE:
+	case IPSET_OPT_CTEVENTS:
+	case IPSET_OPT_CTDIR:
+	case IPSET_OPT_EPOCH:
+	case IPSET_OPT_ADT_DISTINCT:
 		return sizeof(uint32_t);
 	case IPSET_OPT_PACKETS:
 	case IPSET_OPT_BYTES:
@@ -628,7 +832,16 @@ ipset_data_sizeof(enum ipset_opt opt, uint8_t family)
 	case IPSET_OPT_BUCKETSIZE:
 	case IPSET_OPT_RESIZE:
 	case IPSET_OPT_PROTO:
+	case IPSET_OPT_HASHFN:
+	case IPSET_OPT_REGIONBITS:
+	case IPSET_OPT_TABLEPAGES:
 		return sizeof(uint8_t);
+	case IPSET_OPT_LOCKSTAT:
+		return sizeof(struct ipset_lockstat);
+	case IPSET_OPT_LOOKUPSTAT:
+		return sizeof(struct ipset_lookupstat);
+	case IPSET_OPT_MEMSTAT:
+		return sizeof(struct ipset_memstat);
 	case IPSET_OPT_ETHER:
 		return ETH_ALEN;
 	/* Flags doesn't counted once :-( */
@@ -638,6 +851,13 @@ ipset_data_sizeof(enum ipset_opt opt, uint8_t family)
 	case IPSET_OPT_COUNTERS:
 	case IPSET_OPT_FORCEADD:
 	case IPSET_OPT_IFACE_WILDCARD:
+	case IPSET_OPT_LPM:
+	case IPSET_OPT_PERCPU:
+	case IPSET_OPT_BLOOM:
+	case IPSET_OPT_PREALLOC:
+	case IPSET_OPT_MERGED_INDEX:
+	case IPSET_OPT_AGGREGATE:
+	case IPSET_OPT_DISTINCT:
 		return sizeof(uint32_t);
 	case IPSET_OPT_ADT_COMMENT:
 		return IPSET_MAX_COMMENT_SIZE + 1;
@@ -689,7 +909,8 @@ ipset_data_cidr(const struct ipset_data *data)
 	assert(data);
 	return ipset_data_test(data, IPSET_OPT_CIDR) ? data->cidr :
 	       data->family == NFPROTO_IPV4 ? 32 :
-	       data->family == NFPROTO_IPV6 ? 128 : 0;
+	       data->family == NFPROTO_IPV6 ||
+	       data->family == NFPROTO_INET ? 128 : 0;
 }
 
 /**
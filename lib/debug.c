@@ -23,6 +23,12 @@ static const struct ipset_attrname cmdattr2name[] = {
 	[IPSET_ATTR_ADT]	= { .name = "ADT" },
 	[IPSET_ATTR_LINENO]	= { .name = "LINENO" },
 	[IPSET_ATTR_PROTOCOL_MIN] = { .name = "PROTO_MIN" },
+	[IPSET_ATTR_INDEX]	= { .name = "INDEX" },
+	[IPSET_ATTR_ADT_PACKED]	= { .name = "ADT_PACKED" },
+	[IPSET_ATTR_LOST]	= { .name = "LOST" },
+	[IPSET_ATTR_SINCE]	= { .name = "SINCE" },
+	[IPSET_ATTR_TOP]	= { .name = "TOP" },
+	[IPSET_ATTR_TOP_BY]	= { .name = "TOP_BY" },
 };
 
 static const struct ipset_attrname createattr2name[] = {
@@ -39,6 +45,8 @@ static const struct ipset_attrname createattr2name[] = {
 	[IPSET_ATTR_HASHSIZE]	= { .name = "HASHSIZE" },
 	[IPSET_ATTR_MAXELEM]	= { .name = "MAXELEM" },
 	[IPSET_ATTR_MARKMASK]	= { .name = "MARKMASK" },
+	[IPSET_ATTR_RATE]	= { .name = "RATE" },
+	[IPSET_ATTR_BURST]	= { .name = "BURST" },
 	[IPSET_ATTR_NETMASK]	= { .name = "NETMASK" },
 	[IPSET_ATTR_BUCKETSIZE]	= { .name = "BUCKETSIZE" },
 	[IPSET_ATTR_RESIZE]	= { .name = "RESIZE" },
@@ -46,6 +54,18 @@ static const struct ipset_attrname createattr2name[] = {
 	[IPSET_ATTR_ELEMENTS]	= { .name = "ELEMENTS" },
 	[IPSET_ATTR_REFERENCES]	= { .name = "REFERENCES" },
 	[IPSET_ATTR_MEMSIZE]	= { .name = "MEMSIZE" },
+	[IPSET_ATTR_BLOOM_FPR]	= { .name = "BLOOM_FPR" },
+	[IPSET_ATTR_HASHFN]	= { .name = "HASHFN" },
+	[IPSET_ATTR_REGIONBITS]	= { .name = "REGIONBITS" },
+	[IPSET_ATTR_LOCKSTAT]	= { .name = "LOCKSTAT" },
+	[IPSET_ATTR_NUMA]	= { .name = "NUMA" },
+	[IPSET_ATTR_SAMPLE]	= { .name = "SAMPLE" },
+	[IPSET_ATTR_EPOCH]	= { .name = "EPOCH" },
+	[IPSET_ATTR_LOOKUPSTAT] = { .name = "LOOKUPSTAT" },
+	[IPSET_ATTR_MEMSTAT]	= { .name = "MEMSTAT" },
+	[IPSET_ATTR_CTEVENTS]	= { .name = "CTEVENTS" },
+	[IPSET_ATTR_CTDIR]	= { .name = "CTDIR" },
+	[IPSET_ATTR_TABLEPAGES]	= { .name = "TABLEPAGES" },
 };
 
 static const struct ipset_attrname adtattr2name[] = {
@@ -70,6 +90,9 @@ static const struct ipset_attrname adtattr2name[] = {
 	[IPSET_ATTR_SKBMARK]	= { .name = "SKBMARK" },
 	[IPSET_ATTR_SKBPRIO]	= { .name = "SKBPRIO" },
 	[IPSET_ATTR_SKBQUEUE]	= { .name = "SKBQUEUE" },
+	[IPSET_ATTR_DISTINCT]	= { .name = "DISTINCT" },
+	[IPSET_ATTR_RATE]	= { .name = "RATE" },
+	[IPSET_ATTR_BURST]	= { .name = "BURST" },
 };
 
 static void
@@ -187,6 +210,15 @@ debug_cmd_attrs(int cmd, struct nlattr *nla[])
 				cmdattr2name[i].name,
 				(const char *) mnl_attr_get_payload(nla[i]));
 			break;
+		case MNL_TYPE_BINARY: {
+			const struct ip_set_adt_packed *p =
+				mnl_attr_get_payload(nla[i]);
+
+			fprintf(stderr, "\t%s: family %u, flags %u, %u elements\n",
+				cmdattr2name[i].name,
+				p->family, p->flags, p->count);
+			break;
+		}
 		case MNL_TYPE_NESTED:
 			if (i == IPSET_ATTR_DATA) {
 				switch (cmd) {
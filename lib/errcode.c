@@ -17,6 +17,7 @@
 #include <libipset/linux_ip_set_bitmap.h>	/* bitmap specific errcodes */
 #include <libipset/linux_ip_set_hash.h>		/* hash specific errcodes */
 #include <libipset/linux_ip_set_list.h>		/* list specific errcodes */
+#include <libipset/linux_ip_set_range.h>	/* range specific errcodes */
 
 /* Core kernel error codes */
 static const struct ipset_errcode_table core_errcode_table[] = {
@@ -63,6 +64,24 @@ static const struct ipset_errcode_table core_errcode_table[] = {
 	{ IPSET_ERR_TYPE_MISMATCH, IPSET_CMD_SWAP,
 	  "The sets cannot be swapped: their type does not match" },
 
+	/* CLONE specific error codes */
+	{ IPSET_ERR_EXIST_SETNAME2, IPSET_CMD_CLONE,
+	  "Set cannot be cloned: a set with the new name already exists" },
+	{ EOPNOTSUPP, IPSET_CMD_CLONE,
+	  "Set cannot be cloned: not supported by the set type" },
+
+	/* FREEZE/THAW specific error codes */
+	{ EOPNOTSUPP, IPSET_CMD_FREEZE,
+	  "Set cannot be frozen: not supported by the set type or by sets with timeout" },
+	{ ENOSPC, IPSET_CMD_FREEZE,
+	  "Set cannot be frozen: no perfect hash found for the elements, try again" },
+	{ EOPNOTSUPP, IPSET_CMD_THAW,
+	  "Set cannot be thawed: not supported by the set type" },
+
+	/* PURGE specific error codes */
+	{ EOPNOTSUPP, IPSET_CMD_PURGE,
+	  "Set cannot be purged: not supported by the set type" },
+
 	/* LIST/SAVE specific error codes */
 
 	/* Generic (CADT) error codes */
@@ -80,6 +99,24 @@ static const struct ipset_errcode_table core_errcode_table[] = {
 	  "Comment cannot be used: set was created without comment support" },
 	{ IPSET_ERR_SKBINFO, 0,
 	  "Skbinfo mapping cannot be used: set was created without skbinfo support" },
+	{ IPSET_ERR_COUNTER_SAMPLE, IPSET_CMD_CREATE,
+	  "Counter sampling needs counters and a rate between 1 and 65536" },
+	{ IPSET_ERR_MEM_BUDGET, 0,
+	  "The memory budget of the sets in the namespace is used up" },
+	{ IPSET_ERR_TRANSACTION, 0,
+	  "Atomic add/del is supported by the hash types only" },
+	{ IPSET_ERR_TXN_ROLLBACK, 0,
+	  "Atomic add/del failed and some of its changes could not be reverted" },
+	{ IPSET_ERR_RATELIMIT, IPSET_CMD_CREATE,
+	  "Rate limit needs a rate and a burst of at least 1" },
+	{ IPSET_ERR_RATELIMIT, 0,
+	  "Rate limit cannot be used: set was created without rate limit support, or the rate or the burst is zero" },
+	{ IPSET_ERR_CTEVENT, IPSET_CMD_CREATE,
+	  "Invalid conntrack events or direction, or the conntrack events are not supported by the kernel" },
+	{ IPSET_ERR_CTEVENT_BUSY, IPSET_CMD_CREATE,
+	  "The conntrack events are already listened by another module, like ctnetlink" },
+	{ IPSET_ERR_FROZEN, 0,
+	  "The set is frozen: thaw it before changing its elements" },
 
 	/* ADD specific error codes */
 	{ IPSET_ERR_EXIST, IPSET_CMD_ADD,
@@ -127,6 +164,8 @@ static const struct ipset_errcode_table hash_errcode_table[] = {
 	  "Range is not supported in the \"net\" component of the element" },
 	{ IPSET_ERR_HASH_RANGE, 0,
 	  "Invalid range, covers the whole address space" },
+	{ IPSET_ERR_HASH_NUMA_NODE, IPSET_CMD_CREATE,
+	  "The NUMA node does not exist or is offline" },
 	{ },
 };
 
@@ -150,6 +189,14 @@ static const struct ipset_errcode_table list_errcode_table[] = {
 	{ },
 };
 
+/* Range type-specific error codes */
+static const struct ipset_errcode_table range_errcode_table[] = {
+	/* Generic (CADT) error codes */
+	{ IPSET_ERR_RANGE_FULL, 0,
+	  "The set is full, more ranges cannot be added." },
+	{ },
+};
+
 /* Match set type names */
 #define MATCH_TYPENAME(a, b)    STRNEQ(a, b, strlen(b))
 
@@ -180,6 +227,8 @@ ipset_errcode(struct ipset_session *session, enum ipset_cmd cmd, int errcode)
 				table = hash_errcode_table;
 			else if (MATCH_TYPENAME(type->name, "list:"))
 				table = list_errcode_table;
+			else if (MATCH_TYPENAME(type->name, "range:"))
+				table = range_errcode_table;
 		}
 	}
 
@@ -8,14 +8,27 @@
 #include <assert.h>				/* assert */
 #include <ctype.h>				/* isspace */
 #include <errno.h>				/* errno */
+#include <fcntl.h>				/* fcntl */
+#include <poll.h>				/* poll */
+#include <signal.h>				/* sigaction */
 #include <stdarg.h>				/* va_* */
 #include <stdbool.h>				/* bool */
 #include <stdio.h>				/* printf */
 #include <stdlib.h>				/* exit */
 #include <string.h>				/* str* */
 #include <inttypes.h>				/* PRIu64 */
+#include <pthread.h>				/* pthread_* */
+#include <unistd.h>				/* pread */
+#include <arpa/inet.h>				/* ntohl */
+#include <sys/mman.h>				/* mmap */
+#include <sys/socket.h>				/* socket */
+#include <sys/stat.h>				/* fstat */
+#include <sys/un.h>				/* struct sockaddr_un */
 
 #include <config.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>				/* gz* */
+#endif
 
 #include <libipset/debug.h>			/* D() */
 #include <libipset/linux_ip_set.h>		/* IPSET_CMD_* */
@@ -52,8 +65,29 @@ struct ipset {
 	char *newargv[MAX_ARGS];
 	int newargc;
 	const char *filename;			/* Input/output filename */
+	ipset_print_outfn print_outfn;		/* Custom output function */
+	unsigned int jobs;			/* Restore workers */
+	const char *server;			/* Server socket */
+	bool serving;				/* In server mode */
 	bool xlate;
 	struct list_head xlate_sets;
+	/* Translate: element block of the consecutive add lines */
+	bool xlate_aggregate;			/* Blocks and ranges */
+	char xlate_block[IPSET_MAXNAMELEN];	/* Set of the open block */
+	uint32_t xlate_elems;			/* Elements in the block */
+	bool xlate_range;			/* Range not printed yet */
+	uint8_t xlate_family;			/* Family of the range */
+	uint32_t xlate_from[4], xlate_to[4];	/* Range in host order */
+	/* Translate to tc flower filters */
+	char *xlate_flower;			/* Attach point of filters */
+	bool xlate_flower_dst;			/* Match dst_ip, not src_ip */
+	uint16_t xlate_prio;			/* Next free priority */
+	/* Restore fast path: set of the last plain add/del line */
+	const struct ipset_commands *fast_cmd;	/* Command */
+	const struct ipset_type *fast_type;	/* Set type */
+	uint8_t fast_family;			/* Set family */
+	char fast_setname[IPSET_MAXNAMELEN];	/* Setname */
+	struct restore_count **counts;		/* Add lines per set */
 };
 
 struct ipset_xlate_set {
@@ -62,6 +96,9 @@ struct ipset_xlate_set {
 	uint8_t netmask;
 	uint8_t family;
 	bool interval;
+	bool ranges;				/* Interval set */
+	uint16_t prio;				/* Flower priorities, 0: none */
+	uint64_t cidrs;				/* Flower priorities in use */
 	const struct ipset_type *type;
 };
 
@@ -95,8 +132,10 @@ const struct ipset_commands ipset_commands[] = {
 		.cmd = IPSET_CMD_TEST,
 		.name = { "test", "-T", NULL },
 		.has_arg = IPSET_MANDATORY_ARG2,
-		.help = "SETNAME ENTRY\n"
-			"        Test entry in the named set",
+		.help = "SETNAME ENTRY|-\n"
+			"        Test entry in the named set, with -\n"
+			"        print the entries read from stdin\n"
+			"        which are not in the set",
 	},
 	{	/* des[troy], --destroy, x, -X */
 		.cmd = IPSET_CMD_DESTROY,
@@ -147,6 +186,50 @@ const struct ipset_commands ipset_commands[] = {
 		.help = "FROM-SETNAME TO-SETNAME\n"
 			"        Swap the contect of two existing sets",
 	},
+	{	/* cl[one] */
+		.cmd = IPSET_CMD_CLONE,
+		.name = { "clone", NULL },
+		.has_arg = IPSET_MANDATORY_ARG2,
+		.help = "FROM-SETNAME TO-SETNAME\n"
+			"        Copy a set with its elements into a new set",
+	},
+	{	/* fr[eeze] */
+		.cmd = IPSET_CMD_FREEZE,
+		.name = { "freeze", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.help = "SETNAME\n"
+			"        Make the set read-only, compacted for lookups",
+	},
+	{	/* th[aw] */
+		.cmd = IPSET_CMD_THAW,
+		.name = { "thaw", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.help = "SETNAME\n"
+			"        Make a frozen set writable again",
+	},
+	{	/* pu[rge] */
+		.cmd = IPSET_CMD_PURGE,
+		.name = { "purge", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.help = "SETNAME [comment PREFIX] [packets-lt N] [bytes-lt N]\n"
+			"              [timeout-lt N]\n"
+			"        Delete the entries matching all the conditions",
+	},
+	{	/* sy[nc] */
+		.cmd = IPSET_CMD_SYNC,
+		.name = { "sync", NULL },
+		.has_arg = IPSET_MANDATORY_ARG,
+		.help = "SETNAME\n"
+			"        Sync the set to the elements read from stdin",
+	},
+	{	/* mon[itor] */
+		.cmd = IPSET_CMD_MONITOR,
+		.name = { "monitor", NULL },
+		.has_arg = IPSET_OPTIONAL_ARG,
+		.help = "[elements]\n"
+			"        Print the changes of the sets, with elements\n"
+			"        the changes of the elements too",
+	},
 	{	/* h[elp, --help, -H */
 		.cmd = IPSET_CMD_HELP,
 		.name = { "help", "-h", "-H" },
@@ -205,17 +288,28 @@ ipset_match_cmd(const char *arg, const char * const name[])
 
 /* Used up so far
  *
+ *	-a		-aggregate
  *	-A		add
+ *	-b		-flower
+ *	-c		-changed
+ *	-d		-stats
  *	-D		del
+ *	-e		-regex
  *	-E		rename
  *	-f		-file
  *	-F		flush
+ *	-g		-match
  *	-h		help
+ *	-i		-header
+ *	-k		-top
  *	-H		help
+ *	-l		-total
  *	-L		list
+ *	-m		-atomic
  *	-n		-name
  *	-N		create
  *	-o		-output
+ *	-O		-optimistic
  *	-r		-resolve
  *	-R		restore
  *	-s		-sorted
@@ -227,6 +321,8 @@ ipset_match_cmd(const char *arg, const char * const name[])
  *	-v		version
  *	-V		version
  *	-W		swap
+ *	-y		-snapshot
+ *	-z		-reset
  *	-!		-exist
  */
 
@@ -234,7 +330,7 @@ const struct ipset_envopts ipset_envopts[] = {
 	{ .name = { "-o", "-output" },
 	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_OPT_MAX,
 	  .parse = ipset_parse_output,
-	  .help = "plain|save|xml\n"
+	  .help = "plain|save|xml|binary\n"
 		  "       Specify output mode for listing sets.\n"
 		  "       Default value for \"list\" command is mode \"plain\"\n"
 		  "       and for \"save\" command is mode \"save\".",
@@ -278,6 +374,119 @@ const struct ipset_envopts ipset_envopts[] = {
 		  "        When listing, list setnames and set headers\n"
 		  "        from kernel only.",
 	},
+	{ .name = { "-c", "-changed" },
+	  .parse = ipset_parse_changed,
+	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_ENV_LIST_CHANGED,
+	  .help = "EPOCH\n"
+		  "        When listing, list the elements of hash sets\n"
+		  "        changed since the epoch of a previous listing.",
+	},
+	{ .name = { "-k", "-top" },
+	  .parse = ipset_parse_top,
+	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_OPT_MAX,
+	  .help = "N[,bytes|packets]\n"
+		  "        When listing, list just the N elements with\n"
+		  "        the largest byte (or packet) counters.",
+	},
+	{ .name = { "-g", "-match" },
+	  .parse = ipset_parse_match,
+	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_OPT_MAX,
+	  .help = "[!]PATTERN\n"
+		  "        When listing, list just the members matching\n"
+		  "        the shell wildcard pattern.",
+	},
+	{ .name = { "-e", "-regex" },
+	  .parse = ipset_parse_regex,
+	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_OPT_MAX,
+	  .help = "[!]REGEX\n"
+		  "        When listing, list just the members matching\n"
+		  "        the extended regular expression.",
+	},
+	{ .name = { "-i", "-header" },
+	  .parse = ipset_parse_header,
+	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_OPT_MAX,
+	  .help = "FIELD{=|!=|<|<=|>|>=}VALUE\n"
+		  "        When listing, list just the sets which header\n"
+		  "        field satisfies the condition.",
+	},
+	{ .name = { "-l", "-total" },
+	  .parse = ipset_envopt_parse,
+	  .has_arg = IPSET_NO_ARG,	.flag = IPSET_ENV_LIST_TOTAL,
+	  .help = "\n"
+		  "        When listing, print the number of the listed\n"
+		  "        sets, their entries and size in memory.",
+	},
+	{ .name = { "-d", "-stats" },
+	  .parse = ipset_envopt_parse,
+	  .has_arg = IPSET_NO_ARG,	.flag = IPSET_ENV_LIST_STATS,
+	  .help = "\n"
+		  "        When listing, list the statistics of hash sets\n"
+		  "        in the header.",
+	},
+	{ .name = { "-z", "-reset" },
+	  .parse = ipset_envopt_parse,
+	  .has_arg = IPSET_NO_ARG,	.flag = IPSET_ENV_LIST_RESET,
+	  .help = "\n"
+		  "        When listing, reset the counters of the listed\n"
+		  "        elements of hash sets.",
+	},
+	{ .name = { "-y", "-snapshot" },
+	  .parse = ipset_envopt_parse,
+	  .has_arg = IPSET_NO_ARG,	.flag = IPSET_ENV_LIST_SNAPSHOT,
+	  .help = "\n"
+		  "        When listing, list a point-in-time copy of\n"
+		  "        hash sets.",
+	},
+	{ .name = { "-p", "-pipeline" },
+	  .parse = ipset_envopt_parse,
+	  .has_arg = IPSET_NO_ARG,	.flag = IPSET_ENV_PIPELINE,
+	  .help = "\n"
+		  "        Restore: send the next add/del batches before\n"
+		  "        the kernel acknowledged the previous ones.",
+	},
+	{ .name = { "-j", "-jobs" },
+	  .parse = ipset_parse_jobs,
+	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_OPT_MAX,
+	  .help = "N\n"
+		  "        Restore: add/del the elements of different sets\n"
+		  "        in N parallel workers.",
+	},
+	{ .name = { "-a", "-aggregate" },
+	  .parse = ipset_parse_aggregate,
+	  .has_arg = IPSET_NO_ARG,	.flag = IPSET_OPT_MAX,
+	  .help = "\n"
+		  "        Translate: add the elements of the consecutive\n"
+		  "        add commands of a set in one block and merge\n"
+		  "        the adjacent addresses into ranges.",
+	},
+	{ .name = { "-m", "-atomic" },
+	  .parse = ipset_envopt_parse,
+	  .has_arg = IPSET_NO_ARG,	.flag = IPSET_ENV_ATOMIC,
+	  .help = "\n"
+		  "        Add/del: apply the elements of each batch\n"
+		  "        completely or not at all.",
+	},
+	{ .name = { "-O", "-optimistic" },
+	  .parse = ipset_envopt_parse,
+	  .has_arg = IPSET_NO_ARG,	.flag = IPSET_ENV_OPTIMISTIC,
+	  .help = "\n"
+		  "        Use the protocol version and the set types\n"
+		  "        cached by the previous commands.",
+	},
+	{ .name = { "-b", "-flower" },
+	  .parse = ipset_parse_flower,
+	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_OPT_MAX,
+	  .help = "ATTACH[,src|,dst]\n"
+		  "        Translate: print the elements of IPv4 hash:ip\n"
+		  "        and hash:net sets as tc flower filters.",
+	},
+	{ .name = { "-u", "-server" },
+	  .parse = ipset_parse_server,
+	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_OPT_MAX,
+	  .help = "SOCKET\n"
+		  "        Execute the commands of the clients connected\n"
+		  "        to the Unix socket in one session.",
+	},
 	{ .name = { "-f", "-file" },
 	  .parse = ipset_parse_filename,
 	  .has_arg = IPSET_MANDATORY_ARG,	.flag = IPSET_OPT_MAX,
@@ -395,6 +604,9 @@ ipset_parse_filename(struct ipset *ipset,
 {
 	void *p = ipset_session_printf_private(ipset->session);
 
+	if (ipset->serving)
+		return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
+			"-file option is not supported in server mode");
 	if (ipset->filename)
 		return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
 			"-file option cannot be used when full io is activated");
@@ -403,6 +615,234 @@ ipset_parse_filename(struct ipset *ipset,
 	return 0;
 }
 
+/* Max number of parallel restore workers */
+#define IPSET_JOBS_MAX				64
+
+/**
+ * ipset_parse_jobs - parse the number of restore workers
+ * @ipset: ipset structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse the number of parallel workers of the "-jobs" option.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_jobs(struct ipset *ipset,
+		 int opt UNUSED, const char *str)
+{
+	void *p = ipset_session_printf_private(ipset->session);
+	unsigned long jobs;
+	char *end;
+
+	errno = 0;
+	jobs = strtoul(str, &end, 10);
+	if (errno || end == str || *end || jobs < 1 || jobs > IPSET_JOBS_MAX)
+		return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
+			"-jobs option requires a number between 1 and %u",
+			IPSET_JOBS_MAX);
+	ipset->jobs = jobs;
+
+	return 0;
+}
+
+/**
+ * ipset_parse_changed - parse the epoch of the changed elements
+ * @ipset: ipset structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse the epoch of the "-changed" option.
+ * The value is stored in the session.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_changed(struct ipset *ipset, int opt, const char *str)
+{
+	void *p = ipset_session_printf_private(ipset->session);
+	unsigned long epoch;
+	char *end;
+
+	errno = 0;
+	epoch = strtoul(str, &end, 10);
+	if (errno || end == str || *end || epoch > UINT32_MAX)
+		return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
+			"-changed option requires the epoch of a listing");
+	ipset_envopt_set(ipset->session, opt);
+
+	return ipset_session_list_since(ipset->session, epoch);
+}
+
+/**
+ * ipset_parse_top - parse the number of the top elements
+ * @ipset: ipset structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse the "-top" option: the number of the elements with the largest
+ * counters, optionally followed by the counter, bytes or packets.
+ * The value is stored in the session.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_top(struct ipset *ipset, int opt UNUSED, const char *str)
+{
+	void *p = ipset_session_printf_private(ipset->session);
+	uint8_t top_by = IPSET_TOP_BYTES;
+	unsigned long top;
+	char *end;
+
+	errno = 0;
+	top = strtoul(str, &end, 10);
+	if (!errno && *end == ',') {
+		if (STREQ(end + 1, "packets"))
+			top_by = IPSET_TOP_PACKETS;
+		else if (!STREQ(end + 1, "bytes"))
+			errno = EINVAL;
+		end += strlen(end);
+	}
+	if (errno || end == str || *end || top < 1 || top > IPSET_TOP_MAX)
+		return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
+			"-top option requires a number between 1 and %u, "
+			"optionally followed by ,bytes or ,packets",
+			IPSET_TOP_MAX);
+
+	return ipset_session_list_top(ipset->session, top, top_by);
+}
+
+/**
+ * ipset_parse_match - parse the wildcard pattern of the listed members
+ * @ipset: ipset structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse the "-match" option: the members matching the shell wildcard
+ * pattern are listed only. The pattern is stored in the session.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_match(struct ipset *ipset, int opt UNUSED, const char *str)
+{
+	return ipset_session_list_match(ipset->session, str, false);
+}
+
+/**
+ * ipset_parse_regex - parse the regular expression of the listed members
+ * @ipset: ipset structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse the "-regex" option: the members matching the extended regular
+ * expression are listed only. The expression is stored in the session.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_regex(struct ipset *ipset, int opt UNUSED, const char *str)
+{
+	return ipset_session_list_match(ipset->session, str, true);
+}
+
+/**
+ * ipset_parse_header - parse a condition on the set headers
+ * @ipset: ipset structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse the "-header" option: the sets are listed only, which header
+ * satisfies all of the conditions given. The condition is stored in
+ * the session.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_header(struct ipset *ipset, int opt UNUSED, const char *str)
+{
+	return ipset_session_list_header(ipset->session, str);
+}
+
+/**
+ * ipset_parse_aggregate - parse the aggregate option of translate
+ * @ipset: ipset structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse the "-aggregate" option: ipset-translate prints the elements
+ * of the consecutive add commands of a set in one element block.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_aggregate(struct ipset *ipset, int opt UNUSED,
+		      const char *str UNUSED)
+{
+	ipset->xlate_aggregate = true;
+	return 0;
+}
+
+/**
+ * ipset_parse_flower - parse the flower option of translate
+ * @ipset: ipset structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse the "-flower" option: ipset-translate prints the elements as
+ * tc filters attached to the given point, like "dev eth0 ingress",
+ * matching the source or with ",dst" the destination address.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_flower(struct ipset *ipset, int opt UNUSED, const char *str)
+{
+	char *attach, *dir;
+
+	attach = strdup(str);
+	if (!attach)
+		return ipset_err(ipset->session, "Cannot allocate memory");
+	dir = strrchr(attach, ',');
+	if (dir && (STREQ(dir + 1, "src") || STREQ(dir + 1, "dst"))) {
+		ipset->xlate_flower_dst = STREQ(dir + 1, "dst");
+		*dir = '\0';
+	}
+	if (attach[0] == '\0') {
+		free(attach);
+		return ipset_err(ipset->session,
+				 "Missing attach point of the filters");
+	}
+	free(ipset->xlate_flower);
+	ipset->xlate_flower = attach;
+	return 0;
+}
+
+/**
+ * ipset_parse_server - parse the socket of the server mode
+ * @ipset: ipset structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse the "-server" option: the path of the Unix socket, on which
+ * ipset accepts the commands of the clients.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_server(struct ipset *ipset, int opt UNUSED, const char *str)
+{
+	void *p = ipset_session_printf_private(ipset->session);
+
+	if (ipset->serving || ipset->restore_line != 0)
+		return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
+			"-server option is invalid in restore or server mode");
+	ipset->server = str;
+
+	return 0;
+}
+
 /**
  * ipset_parse_output - parse output format name
  * @ipset: ipset structure
@@ -430,6 +870,9 @@ ipset_parse_output(struct ipset *ipset,
 		return ipset_session_output(session, IPSET_LIST_XML);
 	else if (STREQ(str, "save"))
 		return ipset_session_output(session, IPSET_LIST_SAVE);
+	else if (STREQ(str, "binary") && !ipset->serving)
+		/* Written to the output stream, not to the clients */
+		return ipset_session_output(session, IPSET_LIST_BINARY);
 
 	return ipset_err(session,
 		"Syntax error: unknown output mode '%s'", str);
@@ -460,6 +903,13 @@ ipset_envopt_parse(struct ipset *ipset, int opt,
 	case IPSET_ENV_EXIST:
 	case IPSET_ENV_LIST_SETNAME:
 	case IPSET_ENV_LIST_HEADER:
+	case IPSET_ENV_PIPELINE:
+	case IPSET_ENV_LIST_RESET:
+	case IPSET_ENV_LIST_STATS:
+	case IPSET_ENV_LIST_SNAPSHOT:
+	case IPSET_ENV_LIST_TOTAL:
+	case IPSET_ENV_OPTIMISTIC:
+	case IPSET_ENV_ATOMIC:
 		ipset_envopt_set(session, opt);
 		return 0;
 	default:
@@ -637,12 +1087,146 @@ build_argv(struct ipset *ipset, char *buffer)
 	return 0;
 }
 
+/* Check the magic of a regular restore file saved in binary format */
+static bool
+binary_file(FILE *f, size_t *size)
+{
+	char magic[sizeof(IPSET_BINARY_MAGIC) - 1];
+	struct stat st;
+
+	if (fstat(fileno(f), &st) < 0 || !S_ISREG(st.st_mode) ||
+	    pread(fileno(f), magic, sizeof(magic), 0) != sizeof(magic))
+		return false;
+	*size = st.st_size;
+	return memcmp(magic, IPSET_BINARY_MAGIC, sizeof(magic)) == 0;
+}
+
+/* Restore a set from the mapped binary file: the records are checked
+ * against the CRC32 before the set is created by its create line and
+ * the element blocks are sent as packed elements. The elements are
+ * counted as lines in the error messages. */
+static int
+restore_binary_set(struct ipset *ipset, const char **pos, const char *end)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	void *p = ipset_session_printf_private(session);
+	struct ipset_binary_set set;
+	const char *c = *pos, *elems;
+	size_t createlen, stride;
+	uint32_t count, crc;
+	int ret;
+
+	if ((size_t)(end - c) < sizeof(set))
+		goto broken;
+	memcpy(&set, c, sizeof(set));
+	createlen = ntohs(set.createlen);
+	if ((set.family != NFPROTO_IPV4 && set.family != NFPROTO_IPV6 &&
+	     set.family != NFPROTO_INET) ||
+	    !memchr(set.setname, '\0', sizeof(set.setname)) ||
+	    createlen >= sizeof(ipset->cmdline) ||
+	    (size_t)(end - c) < sizeof(set) + createlen)
+		goto broken;
+	stride = (set.family == NFPROTO_IPV4 ? sizeof(uint32_t)
+					     : sizeof(struct in6_addr)) +
+		 (set.flags & IPSET_PACKED_TIMEOUT ? sizeof(uint32_t) : 0);
+
+	elems = c + sizeof(set) + createlen;
+	crc = ipset_crc32(0, c, elems - c);
+	for (c = elems; ; c += count * stride) {
+		if ((size_t)(end - c) < sizeof(count))
+			goto broken;
+		memcpy(&count, c, sizeof(count));
+		count = ntohl(count);
+		if ((size_t)(end - c - sizeof(count)) / stride < count)
+			goto broken;
+		crc = ipset_crc32(crc, c, sizeof(count) + count * stride);
+		c += sizeof(count);
+		if (count == 0)
+			break;
+	}
+	if ((size_t)(end - c) < sizeof(crc))
+		goto broken;
+	memcpy(&count, c, sizeof(count));
+	if (crc != ntohl(count))
+		return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
+			"Checksum mismatch of set %s in the binary "
+			"restore file.", set.setname);
+	*pos = c + sizeof(crc);
+
+	memcpy(ipset->cmdline, elems - createlen, createlen);
+	ipset->cmdline[createlen] = '\0';
+	ipset->restore_line++;
+	ret = ipset_parse_line(ipset, ipset->cmdline);
+	if (ret < 0)
+		return ipset->standard_error(ipset, p);
+
+	for (c = elems; ; c += count * stride) {
+		memcpy(&count, c, sizeof(count));
+		count = ntohl(count);
+		c += sizeof(count);
+		if (count == 0)
+			break;
+		ret = ipset_session_add_packed(session, set.setname,
+					       set.family, set.flags,
+					       c, count,
+					       ipset->restore_line + 1);
+		ipset->restore_line += count;
+		if (ret < 0)
+			return ipset->standard_error(ipset, p);
+	}
+	return 0;
+
+broken:
+	return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
+		"Broken binary restore file after line %u.",
+		ipset->restore_line);
+}
+
+static int
+restore_binary(struct ipset *ipset, FILE *f, size_t size)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	void *p = ipset_session_printf_private(session);
+	struct ipset_binary_header header;
+	const char *map, *c;
+	int ret = 0;
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (map == MAP_FAILED)
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+			"Cannot map the restore file: %s", strerror(errno));
+	if (size < sizeof(header)) {
+		ret = -1;
+	} else {
+		memcpy(&header, map, sizeof(header));
+		if (ntohl(header.version) != IPSET_BINARY_VERSION)
+			ret = -1;
+	}
+	if (ret < 0) {
+		munmap((void *) map, size);
+		return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
+			"Unsupported binary restore file.");
+	}
+	madvise((void *) map, size, MADV_SEQUENTIAL);
+	for (c = map + sizeof(header); ret == 0 && c < map + size; )
+		ret = restore_binary_set(ipset, &c, map + size);
+	munmap((void *) map, size);
+	if (ret < 0)
+		return ret;
+
+	ret = ipset_commit(session);
+	if (ret < 0)
+		ipset->standard_error(ipset, p);
+	return ret;
+}
+
 static int
 restore(struct ipset *ipset)
 {
 	struct ipset_session *session = ipset_session(ipset);
 	int ret = 0;
 	FILE *f = stdin;	/* Default from stdin */
+	size_t size;
 
 	if (ipset->filename) {
 		ret = ipset_session_io_normal(session, ipset->filename,
@@ -651,9 +1235,61 @@ restore(struct ipset *ipset)
 			return ret;
 		f = ipset_session_io_stream(session, IPSET_IO_INPUT);
 	}
+	/* Binary files are mapped, pipes can be restored as text only */
+	if (binary_file(f, &size))
+		return restore_binary(ipset, f, size);
 	return ipset_parse_stream(ipset, f);
 }
 
+static int
+test_stream(struct ipset *ipset)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	struct ipset_data *data = ipset_session_data(session);
+	void *p = ipset_session_printf_private(session);
+	const struct ipset_type *type;
+	char setname[IPSET_MAXNAMELEN];
+	uint32_t lineno = 0;
+	int ret;
+	char *c, *e;
+
+	ipset_strlcpy(setname, ipset_data_setname(data), sizeof(setname));
+	ipset_data_reset(data);
+
+	while (fgets(ipset->cmdline, sizeof(ipset->cmdline), stdin)) {
+		lineno++;
+		c = ipset->cmdline;
+		while (isspace(c[0]))
+			c++;
+		if (c[0] == '\0' || c[0] == '#')
+			continue;
+		for (e = c + strlen(c); isspace(e[-1]); e--)
+			;
+		*e = '\0';
+
+		/* The data is reset after every command */
+		ret = ipset_parse_setname(session, IPSET_SETNAME, setname);
+		if (ret == 0) {
+			type = ipset_type_get(session, IPSET_CMD_TEST);
+			ret = type == NULL ? -1 :
+			      ipset_parse_elem(session,
+					       type->last_elem_optional, c);
+		}
+		if (ret == 0)
+			ret = ipset_cmd(session, IPSET_CMD_TEST, lineno);
+		if (ret < 0) {
+			ipset_data_reset(data);
+			ipset->standard_error(ipset, p);
+		}
+	}
+	ret = ipset_commit(session);
+	if (ret < 0)
+		ipset->standard_error(ipset, p);
+	ipset_envopt_unset(session, IPSET_ENV_TEST_STREAM);
+
+	return ret;
+}
+
 static bool do_parse(const struct ipset_arg *arg, bool family)
 {
 	return !((family == true) ^ (arg->opt == IPSET_OPT_FAMILY));
@@ -751,8 +1387,54 @@ err_unknown:
 				   "Unknown argument: `%s'", argv[i]);
 }
 
-static enum ipset_adt
-cmd2cmd(int cmd)
+/* The conditions of the purge command, over the extensions */
+static const struct {
+	const char * const name[2];
+	enum ipset_opt opt;
+	ipset_parsefn parse;
+} purge_args[] = {
+	{ { "comment", NULL },	  IPSET_OPT_ADT_COMMENT, ipset_parse_comment },
+	{ { "packets-lt", NULL }, IPSET_OPT_PACKETS,	 ipset_parse_uint64 },
+	{ { "bytes-lt", NULL },	  IPSET_OPT_BYTES,	 ipset_parse_uint64 },
+	{ { "timeout-lt", NULL }, IPSET_OPT_TIMEOUT,	 ipset_parse_timeout },
+};
+
+static int
+parse_purge(struct ipset *ipset, int *argc, char *argv[])
+{
+	void *p = ipset_session_printf_private(ipset->session);
+	unsigned int j;
+	int ret, i = 1;
+
+	if (*argc < 2)
+		return ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
+			"Missing condition of the purge command: "
+			"comment, packets-lt, bytes-lt or timeout-lt");
+	while (*argc > i) {
+		for (j = 0; j < ARRAY_SIZE(purge_args); j++)
+			if (ipset_match_option(argv[i], purge_args[j].name))
+				break;
+		if (j == ARRAY_SIZE(purge_args))
+			return ipset->custom_error(ipset, p,
+				IPSET_PARAMETER_PROBLEM,
+				"Unknown argument: `%s'", argv[i]);
+		if (*argc - i < 2)
+			return ipset->custom_error(ipset, p,
+				IPSET_PARAMETER_PROBLEM,
+				"Missing mandatory argument of option `%s'",
+				argv[i]);
+		ret = purge_args[j].parse(ipset->session, purge_args[j].opt,
+					  argv[i + 1]);
+		if (ret < 0)
+			return ret;
+		i += 2;
+	}
+	*argc = 0;
+	return 0;
+}
+
+static enum ipset_adt
+cmd2cmd(int cmd)
 {
 	switch (cmd) {
 	case IPSET_CMD_ADD:
@@ -797,7 +1479,8 @@ check_mandatory(struct ipset *ipset,
 
 	for (i = 0; type->cmd[cmd].args[i] != IPSET_ARG_NONE; i++) {
 		arg = ipset_keyword(type->cmd[cmd].args[i]);
-		if (mandatory & IPSET_FLAG(arg->opt)) {
+		if (arg->opt < IPSET_OPT_EXT &&
+		    mandatory & IPSET_FLAG(arg->opt)) {
 			ipset->custom_error(ipset, p, IPSET_PARAMETER_PROBLEM,
 				   "Mandatory option `%s' is missing",
 				   arg->name[0]);
@@ -825,6 +1508,8 @@ session_family(struct ipset_session *session)
 		return "inet";
 	case NFPROTO_IPV6:
 		return "inet6";
+	case NFPROTO_INET:
+		return "inet46";
 	default:
 		return "unspec";
 	}
@@ -936,10 +1621,10 @@ static const char *cmd_prefix[] = {
 	[IPSET_TEST]   = "test   SETNAME",
 };
 
-static const struct ipset_xlate_set *
+static struct ipset_xlate_set *
 ipset_xlate_set_get(struct ipset *ipset, const char *name)
 {
-	const struct ipset_xlate_set *set;
+	struct ipset_xlate_set *set;
 
 	list_for_each_entry(set, &ipset->xlate_sets, list) {
 		if (!strcmp(set->name, name))
@@ -958,9 +1643,15 @@ static const struct ipset_type *ipset_xlate_type_get(struct ipset *ipset,
 	if (!set)
 		return NULL;
 
+	/* The elements are parsed in the family of the set */
+	if (set->family != NFPROTO_UNSPEC)
+		ipset_session_data_set(ipset->session, IPSET_OPT_FAMILY,
+				       &set->family);
 	return set->type;
 }
 
+static int server_run(struct ipset *ipset);
+
 static int
 ipset_parser(struct ipset *ipset, int oargc, char *oargv[])
 {
@@ -1037,6 +1728,8 @@ ipset_parser(struct ipset *ipset, int oargc, char *oargv[])
 
 		if (ipset->restore_line != 0 &&
 		    (command->cmd == IPSET_CMD_RESTORE ||
+		     command->cmd == IPSET_CMD_SYNC ||
+		     command->cmd == IPSET_CMD_MONITOR ||
 		     command->cmd == IPSET_CMD_VERSION ||
 		     command->cmd == IPSET_CMD_HELP))
 			return ipset->custom_error(ipset, p,
@@ -1049,6 +1742,11 @@ ipset_parser(struct ipset *ipset, int oargc, char *oargv[])
 			       "in interactive mode\n");
 			return 0;
 		}
+		if (ipset->interactive && command->cmd == IPSET_CMD_SYNC) {
+			printf("Sync command is not supported "
+			       "in interactive mode\n");
+			return 0;
+		}
 
 		/* Shift off matched command arg */
 		ipset_shift_argv(&argc, argv, 1);
@@ -1089,6 +1787,8 @@ ipset_parser(struct ipset *ipset, int oargc, char *oargv[])
 	/* Third: catch interactive mode, handle help, version */
 	switch (cmd) {
 	case IPSET_CMD_NONE:
+		if (ipset->server && !ipset->serving && argc == 1)
+			return server_run(ipset);
 		if (ipset->interactive) {
 			printf("No command specified\n");
 			if (session)
@@ -1252,8 +1952,29 @@ ipset_parser(struct ipset *ipset, int oargc, char *oargv[])
 		}
 		break;
 
+	case IPSET_CMD_FREEZE:
+	case IPSET_CMD_THAW:
+		/* Args: setname */
+		ret = ipset_parse_setname(session, IPSET_SETNAME, arg0);
+		if (ret < 0)
+			return ipset->standard_error(ipset, p);
+		break;
+
+	case IPSET_CMD_PURGE:
+		/* Args: setname condition */
+		ret = ipset_parse_setname(session, IPSET_SETNAME, arg0);
+		if (ret < 0)
+			return ipset->standard_error(ipset, p);
+		ret = parse_purge(ipset, &argc, argv);
+		if (ret < 0)
+			return ipset->standard_error(ipset, p);
+		else if (ret)
+			return ret;
+		break;
+
 	case IPSET_CMD_RENAME:
 	case IPSET_CMD_SWAP:
+	case IPSET_CMD_CLONE:
 		/* Args: from-setname to-setname */
 		ret = ipset_parse_setname(session, IPSET_SETNAME, arg0);
 		if (ret < 0)
@@ -1270,6 +1991,29 @@ ipset_parser(struct ipset *ipset, int oargc, char *oargv[])
 				p, IPSET_PARAMETER_PROBLEM,
 				"Unknown argument %s", argv[1]);
 		return IPSET_CMD_RESTORE;
+	case IPSET_CMD_SYNC:
+		/* Args: setname, the elements are read from stdin */
+		if (argc > 1)
+			return ipset->custom_error(ipset,
+				p, IPSET_PARAMETER_PROBLEM,
+				"Unknown argument %s", argv[1]);
+		ret = ipset_parse_setname(session, IPSET_SETNAME, arg0);
+		if (ret < 0)
+			return ipset->standard_error(ipset, p);
+		return IPSET_CMD_SYNC;
+	case IPSET_CMD_MONITOR:
+		/* Args: [elements] */
+		if (arg0) {
+			uint32_t flags = IPSET_FLAG_MONITOR_ELEM;
+
+			if (!STREQ(arg0, "elements"))
+				return ipset->custom_error(ipset,
+					p, IPSET_PARAMETER_PROBLEM,
+					"Unknown argument %s", arg0);
+			ipset_session_data_set(session, IPSET_OPT_FLAGS,
+					       &flags);
+		}
+		break;
 	case IPSET_CMD_ADD:
 	case IPSET_CMD_DEL:
 	case IPSET_CMD_TEST:
@@ -1285,15 +2029,32 @@ ipset_parser(struct ipset *ipset, int oargc, char *oargv[])
 			type = ipset_xlate_type_get(ipset, arg0);
 			ipset_session_data_set(session, IPSET_OPT_TYPE, type);
 		}
+		if (type == NULL && ipset_session_guessed(session))
+			goto renegotiate;
 		if (type == NULL)
 			return ipset->standard_error(ipset, p);
 
+		if (cmd == IPSET_CMD_TEST && STREQ(arg1, "-") &&
+		    !ipset->xlate && ipset->restore_line == 0) {
+			/* Elements are read from stdin */
+			if (argc > 1)
+				return ipset->custom_error(ipset,
+					p, IPSET_PARAMETER_PROBLEM,
+					"Unknown argument %s", argv[1]);
+			ipset_envopt_set(session, IPSET_ENV_TEST_STREAM);
+			return cmd;
+		}
+
 		ret = ipset_parse_elem(session, type->last_elem_optional, arg1);
+		if (ret < 0 && ipset_session_guessed(session))
+			goto renegotiate;
 		if (ret < 0)
 			return ipset->standard_error(ipset, p);
 
 		/* Parse additional ADT options */
 		ret = call_parser(ipset, &argc, argv, type, cmd2cmd(cmd), false);
+		if (ret < 0 && ipset_session_guessed(session))
+			goto renegotiate;
 		if (ret < 0)
 			return ipset->standard_error(ipset, p);
 		else if (ret)
@@ -1303,6 +2064,19 @@ ipset_parser(struct ipset *ipset, int oargc, char *oargv[])
 		check_mandatory(ipset, type, cmd);
 		check_allowed(ipset, type, cmd);
 
+		/* Plain "add|del SETNAME ELEM" restore line */
+		if (ipset->restore_line != 0 && !ipset->xlate &&
+		    cmd != IPSET_CMD_TEST && oargc == 4 && argc == 1) {
+			for (command = ipset_commands; command->cmd != cmd;
+			     command++)
+				;
+			ipset->fast_cmd = command;
+			ipset->fast_type = type;
+			ipset->fast_family =
+				ipset_data_family(ipset_session_data(session));
+			ipset_strlcpy(ipset->fast_setname, arg0,
+				      sizeof(ipset->fast_setname));
+		}
 		break;
 	default:
 		break;
@@ -1313,10 +2087,17 @@ ipset_parser(struct ipset *ipset, int oargc, char *oargv[])
 			"Unknown argument %s", argv[1]);
 
 	return cmd;
+
+renegotiate:
+	/* The cached set type does not fit, ask the kernel */
+	ipset_session_guess_reset(session);
+	return ipset_parser(ipset, oargc, oargv);
 }
 
 /* Workhorses */
 
+static int sync_set(struct ipset *ipset);
+
 /**
  * ipset_parse_argv - parse and argv array and execute the command
  * @ipset: ipset structure
@@ -1341,8 +2122,21 @@ ipset_parse_argv(struct ipset *ipset, int oargc, char *oargv[])
 
 	if (cmd == IPSET_CMD_RESTORE)
 		return restore(ipset);
+	if (cmd == IPSET_CMD_TEST &&
+	    ipset_envopt_test(session, IPSET_ENV_TEST_STREAM))
+		return test_stream(ipset);
+	if (cmd == IPSET_CMD_SYNC)
+		return sync_set(ipset);
 
 	ret = ipset_cmd(session, cmd, ipset->restore_line);
+	if (ret < 0 && ipset_session_guess_failed(session)) {
+		/* The kernel rejected the cached protocol or set type */
+		ipset_session_guess_reset(session);
+		cmd = ipset_parser(ipset, oargc, oargv);
+		if (cmd < 0)
+			return cmd;
+		ret = ipset_cmd(session, cmd, ipset->restore_line);
+	}
 	D("ret %d", ret);
 	/* In the case of warning, the return code is success */
 	if (ret < 0 || ipset_session_report_type(session) > IPSET_NO_ERROR)
@@ -1383,182 +2177,1791 @@ ipset_parse_line(struct ipset *ipset, char *line)
 	return ipset_parse_argv(ipset, ipset->newargc, ipset->newargv);
 }
 
-/**
- * ipset_parse_stream - parse an stream and execute the commands
- * @ipset: ipset structure
- * @f: stream
- *
- * Parse an already opened file as stream and execute the commands.
- *
- * Returns 0 on success or a negative error code.
- */
-int
-ipset_parse_stream(struct ipset *ipset, FILE *f)
+/* Split the line into exactly three words without quotes. The line
+ * is not modified: it is parsed in full if the fast path is not taken. */
+static bool
+split_plain_adt(char *c, char *word[3], size_t len[3])
 {
-	struct ipset_session *session = ipset_session(ipset);
-	void *p = ipset_session_printf_private(session);
-	int ret = 0;
-	char *c;
+	int i;
 
-	while (fgets(ipset->cmdline, sizeof(ipset->cmdline), f)) {
-		ipset->restore_line++;
-		c = ipset->cmdline;
-		while (isspace(c[0]))
+	if (strchr(c, '"'))
+		return false;
+	for (i = 0; i < 3; i++) {
+		while (isspace(*c))
+			c++;
+		if (*c == '\0')
+			return false;
+		word[i] = c;
+		while (*c && !isspace(*c))
+			c++;
+		len[i] = c - word[i];
+		while (isspace(*c))
 			c++;
-		if (c[0] == '\0' || c[0] == '#')
-			continue;
-		else if (STREQ(c, "COMMIT\n") || STREQ(c, "COMMIT\r\n")) {
-			ret = ipset_commit(ipset->session);
-			if (ret < 0)
-				ipset->standard_error(ipset, p);
-			continue;
-		}
-		/* Build faked argv, argc */
-		ret = build_argv(ipset, c);
-		if (ret < 0)
-			return ret;
-
-		/* Execute line */
-		ret = ipset_parse_argv(ipset, ipset->newargc, ipset->newargv);
-		if (ret < 0)
-			ipset->standard_error(ipset, p);
 	}
-	/* implicit "COMMIT" at EOF */
-	ret = ipset_commit(ipset->session);
+	return *c == '\0';
+}
+
+/* Execute a restore line which repeats the command and the set of the
+ * last plain add/del line: the element is parsed with the saved settype
+ * and the argv building and option parsing is skipped.
+ * Returns 1 if the line must be parsed in full, otherwise the
+ * result of the command. */
+static int
+parse_fast_adt(struct ipset *ipset, char *c)
+{
+	struct ipset_session *session = ipset->session;
+	const struct ipset_type *type = ipset->fast_type;
+	void *p = ipset_session_printf_private(session);
+	enum ipset_cmd cmd;
+	char name[IPSET_MAXNAMELEN];
+	char *word[3];
+	size_t len[3];
+	int ret;
+
+	if (!ipset->fast_cmd)
+		return 1;
+	if (!split_plain_adt(c, word, len) ||
+	    len[0] >= sizeof(name) ||
+	    strncmp(word[1], ipset->fast_setname, len[1]) != 0 ||
+	    ipset->fast_setname[len[1]] != '\0')
+		return 1;
+	ipset_strlcpy(name, word[0], len[0] + 1);
+	if (!ipset_match_cmd(name, ipset->fast_cmd->name))
+		return 1;
+	cmd = ipset->fast_cmd->cmd;
+	/* Only trailing whitespace follows the element */
+	word[2][len[2]] = '\0';
+
+	ipset_session_lineno(session, ipset->restore_line);
+	ret = ipset_parse_setname(session, IPSET_SETNAME,
+				  ipset->fast_setname);
 	if (ret < 0)
+		return ipset->standard_error(ipset, p);
+	ipset_session_data_set(session, IPSET_OPT_FAMILY, &ipset->fast_family);
+	ipset_session_data_set(session, IPSET_OPT_TYPE, type);
+	ret = ipset_parse_elem(session, type->last_elem_optional, word[2]);
+	if (ret < 0)
+		return ipset->standard_error(ipset, p);
+	check_mandatory(ipset, type, cmd);
+	check_allowed(ipset, type, cmd);
+
+	ret = ipset_cmd(session, cmd, ipset->restore_line);
+	if (ret < 0 || ipset_session_report_type(session) > IPSET_NO_ERROR)
 		ipset->standard_error(ipset, p);
 
 	return ret;
 }
 
-/**
- * ipset_session - returns the session pointer of an ipset structure
- * @ipset: ipset structure
- *
- * Returns the session pointer of an ipset structure.
- */
-struct ipset_session *
-ipset_session(struct ipset *ipset)
-{
-	return ipset->session;
-}
+/* Restore input: regular files are mapped, other streams are read in
+ * large chunks. The lines are terminated in place and passed to the
+ * parser without copying, so their length is not limited. */
+struct ipset_input {
+	int fd;
+#ifdef HAVE_ZLIB
+	gzFile gz;				/* Decompressed read stream */
+#endif
+	char *buf;				/* Mapped file or read buffer */
+	size_t size;				/* Size of the buffer */
+	size_t len;				/* Data in the buffer */
+	size_t pos;				/* Start of the next line */
+	char *last;				/* Unterminated last line */
+	bool mapped;				/* The file is mapped */
+	bool eof;				/* No more data to read */
+	bool error;				/* Read or allocation error */
+};
 
-/**
- * ipset_is_interactive - is the interactive mode enabled?
- * @ipset: ipset structure
- *
- * Returns true if the interactive mode is enabled.
- */
-bool
-ipset_is_interactive(struct ipset *ipset)
+#define IPSET_INPUT_CHUNK			65536
+
+/* The magic of the gzip compressed files */
+#define input_compressed(buf, len)		\
+	((len) >= 2 && (uint8_t)(buf)[0] == 0x1f && (uint8_t)(buf)[1] == 0x8b)
+
+static int
+input_init(struct ipset_input *in, FILE *f)
 {
-	return ipset->interactive;
+	struct stat st;
+#ifdef HAVE_ZLIB
+	int fd;
+#endif
+
+	memset(in, 0, sizeof(*in));
+	in->fd = fileno(f);
+	if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size > 0 && ftello(f) == 0) {
+		in->buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE, in->fd, 0);
+		if (in->buf != MAP_FAILED &&
+		    !input_compressed(in->buf, (size_t)st.st_size)) {
+			madvise(in->buf, st.st_size, MADV_SEQUENTIAL);
+			in->size = in->len = st.st_size;
+			in->mapped = in->eof = true;
+			return 0;
+		}
+		/* Compressed files are decompressed chunk by chunk */
+		if (in->buf != MAP_FAILED)
+			munmap(in->buf, st.st_size);
+	}
+#ifdef HAVE_ZLIB
+	/* Uncompressed input is read through transparently */
+	fd = dup(in->fd);
+	if (fd < 0)
+		return -1;
+	in->gz = gzdopen(fd, "rb");
+	if (!in->gz) {
+		close(fd);
+		return -1;
+	}
+	gzbuffer(in->gz, IPSET_INPUT_CHUNK);
+#endif
+	/* Room for the terminating null of the last line */
+	in->buf = malloc(IPSET_INPUT_CHUNK + 1);
+	if (!in->buf) {
+#ifdef HAVE_ZLIB
+		gzclose(in->gz);
+#endif
+		return -1;
+	}
+	in->size = IPSET_INPUT_CHUNK;
+	return 0;
 }
 
-/**
- * ipset_custom_printf - set custom print functions
- * @ipset: ipset structure
- * @custom_error: custom error function
- * @standard_error: standard error function
- * @print_outfn: output/printing function
- * @p: pointer to private data area
- *
- * The function makes possible to set custom error and
- * output functions for the library. The private data
- * pointer can be used to pass arbitrary data to these functions.
- * If a function argument is NULL, the default printing function is set.
- *
- * Returns 0 on success or a negative error code.
- */
-int
-ipset_custom_printf(struct ipset *ipset,
-		    ipset_custom_errorfn custom_error,
-		    ipset_standard_errorfn standard_error,
-		    ipset_print_outfn print_outfn,
-		    void *p)
+/* Read more data after the partial line in the buffer */
+static void
+input_read(struct ipset_input *in)
 {
-	ipset->no_vhi = !!(custom_error || standard_error || print_outfn);
-	ipset->custom_error =
-		custom_error ? custom_error : default_custom_error;
-	ipset->standard_error =
-		standard_error ? standard_error : default_standard_error;
+	ssize_t n;
 
-	return ipset_session_print_outfn(ipset->session, print_outfn, p);
+	if (in->pos) {
+		memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+		in->len -= in->pos;
+		in->pos = 0;
+	}
+	if (in->len == in->size) {
+		char *buf = realloc(in->buf, 2 * in->size + 1);
+
+		if (!buf) {
+			in->error = in->eof = true;
+			return;
+		}
+		in->buf = buf;
+		in->size *= 2;
+	}
+#ifdef HAVE_ZLIB
+	if (in->gz)
+		n = gzread(in->gz, in->buf + in->len, in->size - in->len);
+	else
+#endif
+	do {
+		n = read(in->fd, in->buf + in->len, in->size - in->len);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) {
+		in->error = n < 0;
+		in->eof = true;
+		return;
+	}
+	in->len += n;
 }
 
-/**
- * ipset_init - initialize ipset library interface
- *
- * Initialize the ipset library interface.
- *
- * Returns the created ipset structure for success or NULL for failure.
- */
-struct ipset *
-ipset_init(void)
+/* Return the next line without the newline or NULL at the end */
+static char *
+input_line(struct ipset_input *in)
 {
-	struct ipset *ipset;
+	char *line, *nl;
 
-	ipset = calloc(1, sizeof(struct ipset));
-	if (ipset == NULL)
-		return NULL;
-	ipset->newargv[0] =
-		calloc(strlen(program_name) + 1, sizeof(*program_name));
-	if (!ipset->newargv[0]) {
-		free(ipset);
-		return NULL;
+	while (!(nl = memchr(in->buf + in->pos, '\n', in->len - in->pos)) &&
+	       !in->eof)
+		input_read(in);
+
+	line = in->buf + in->pos;
+	if (nl) {
+		*nl = '\0';
+		in->pos = nl + 1 - in->buf;
+		return line;
 	}
-	ipset_strlcpy(ipset->newargv[0], program_name,
-		      strlen(program_name) + 1);
-	ipset->newargc = 1;
-	ipset->session = ipset_session_init(NULL, NULL);
-	if (ipset->session == NULL) {
-		free(ipset->newargv[0]);
-		free(ipset);
+	if (in->pos == in->len)
 		return NULL;
+	in->pos = in->len;
+	if (!in->mapped) {
+		in->buf[in->len] = '\0';
+		return line;
 	}
-	ipset_custom_printf(ipset, NULL, NULL, NULL, NULL);
-
-	INIT_LIST_HEAD(&ipset->xlate_sets);
+	/* The mapped file cannot be terminated beyond its end */
+	in->last = strndup(line, in->buf + in->len - line);
+	in->error = in->last == NULL;
+	return in->last;
+}
 
-	return ipset;
+static void
+input_fini(struct ipset_input *in)
+{
+	if (in->mapped)
+		munmap(in->buf, in->size);
+	else
+		free(in->buf);
+#ifdef HAVE_ZLIB
+	if (in->gz)
+		gzclose(in->gz);
+#endif
+	free(in->last);
 }
 
-/**
- * ipset_fini - destroy an ipset library interface
- * @ipset: ipset structure
- *
- * Destroys an ipset library interface
- *
- * Returns 0 on success or a negative error code.
- */
-int
-ipset_fini(struct ipset *ipset)
+/* Restore pre-sizing: the add lines of a mapped input are counted per
+ * set before the input is parsed. The create lines of the hash types
+ * without hashsize then get the number of the elements as hashsize, so
+ * that the set is not resized over and over while it is filled up. */
+struct restore_count {
+	struct restore_count *next;		/* Next in the hash bucket */
+	uint32_t count;				/* Number of add lines */
+	char setname[IPSET_MAXNAMELEN];		/* Setname */
+};
+
+#define RESTORE_COUNT_SIZE			256
+/* Defaults of the kernel */
+#define RESTORE_DEFAULT_HASHSIZE		1024
+#define RESTORE_DEFAULT_MAXELEM			65536
+
+static bool
+restore_match_cmd(const char *arg, enum ipset_cmd cmd)
 {
-	struct ipset_xlate_set *xlate_set, *next;
+	const struct ipset_commands *command;
 
-	assert(ipset);
+	for (command = ipset_commands; command->cmd; command++)
+		if (command->cmd == cmd)
+			return ipset_match_cmd(arg, command->name);
+	return false;
+}
 
-	if (ipset->session)
-		ipset_session_fini(ipset->session);
-	reset_argv(ipset);
-	if (ipset->newargv[0])
-		free(ipset->newargv[0]);
+static unsigned int
+restore_count_hash(const char *setname, size_t len)
+{
+	unsigned int h = 0;
 
-	list_for_each_entry_safe(xlate_set, next, &ipset->xlate_sets, list)
-		free(xlate_set);
+	while (len--)
+		h = h * 31 + (unsigned char)*setname++;
+	return h % RESTORE_COUNT_SIZE;
+}
 
-	free(ipset);
-	return 0;
+static struct restore_count *
+restore_count_find(struct ipset *ipset, const char *setname, size_t len)
+{
+	struct restore_count *n;
+
+	for (n = ipset->counts[restore_count_hash(setname, len)]; n;
+	     n = n->next)
+		if (strncmp(n->setname, setname, len) == 0 &&
+		    n->setname[len] == '\0')
+			return n;
+	return NULL;
 }
 
-/* Ignore the set family, use inet. */
-static const char *ipset_xlate_family(uint8_t family)
+/* Count the add lines of the sets in the mapped input */
+static void
+restore_count_adds(struct ipset *ipset, const char *buf, size_t size)
 {
-	return "inet";
+	const char *c = buf, *end = buf + size, *eol, *word;
+	char cmd[16];
+	struct restore_count *n;
+	unsigned int h;
+	size_t len;
+
+	ipset->counts = calloc(RESTORE_COUNT_SIZE, sizeof(*ipset->counts));
+	if (!ipset->counts)
+		return;
+	for (; c < end; c = eol + 1) {
+		eol = memchr(c, '\n', end - c);
+		if (!eol)
+			eol = end;
+		while (c < eol && isspace(*c))
+			c++;
+		for (len = 0; c + len < eol && !isspace(c[len]); len++)
+			;
+		if (len == 0 || len >= sizeof(cmd))
+			continue;
+		memcpy(cmd, c, len);
+		cmd[len] = '\0';
+		if (!restore_match_cmd(cmd, IPSET_CMD_ADD))
+			continue;
+		for (word = c + len; word < eol && isspace(*word); word++)
+			;
+		for (len = 0; word + len < eol && !isspace(word[len]); len++)
+			;
+		if (len == 0 || len >= IPSET_MAXNAMELEN ||
+		    memchr(word, '"', len))
+			continue;
+		n = restore_count_find(ipset, word, len);
+		if (!n) {
+			n = calloc(1, sizeof(*n));
+			if (!n)
+				return;
+			memcpy(n->setname, word, len);
+			h = restore_count_hash(word, len);
+			n->next = ipset->counts[h];
+			ipset->counts[h] = n;
+		}
+		n->count++;
+	}
 }
 
-enum ipset_xlate_set_type {
-	IPSET_XLATE_TYPE_UNKNOWN	= 0,
+static void
+restore_count_free(struct ipset *ipset)
+{
+	struct restore_count *n;
+	unsigned int i;
+
+	if (!ipset->counts)
+		return;
+	for (i = 0; i < RESTORE_COUNT_SIZE; i++)
+		while ((n = ipset->counts[i]) != NULL) {
+			ipset->counts[i] = n->next;
+			free(n);
+		}
+	free(ipset->counts);
+	ipset->counts = NULL;
+}
+
+/* Add hashsize to the argv of a create line of a hash type */
+static int
+restore_presize(struct ipset *ipset)
+{
+	void *p = ipset_session_printf_private(ipset->session);
+	const struct restore_count *n;
+	uint32_t hashsize, maxelem = RESTORE_DEFAULT_MAXELEM;
+	char *const *argv = ipset->newargv;
+	char num[16];
+	int i;
+
+	if (!ipset->counts || ipset->newargc < 4 ||
+	    ipset->newargc + 2 >= MAX_ARGS ||
+	    !restore_match_cmd(argv[1], IPSET_CMD_CREATE) ||
+	    strncmp(argv[3], "hash:", 5) != 0)
+		return 0;
+	for (i = 4; i < ipset->newargc; i++) {
+		const char *opt = argv[i];
+
+		while (*opt == '-')
+			opt++;
+		if (STREQ(opt, "hashsize"))
+			return 0;
+		if (STREQ(opt, "maxelem") && i + 1 < ipset->newargc)
+			maxelem = strtoul(argv[i + 1], NULL, 10);
+	}
+	n = restore_count_find(ipset, argv[2], strlen(argv[2]));
+	if (!n)
+		return 0;
+	hashsize = n->count < maxelem ? n->count : maxelem;
+	if (hashsize <= RESTORE_DEFAULT_HASHSIZE)
+		return 0;
+
+	snprintf(num, sizeof(num), "%u", hashsize);
+	ipset->newargv[ipset->newargc] = strdup("hashsize");
+	ipset->newargv[ipset->newargc + 1] = strdup(num);
+	if (!ipset->newargv[ipset->newargc] ||
+	    !ipset->newargv[ipset->newargc + 1]) {
+		free(ipset->newargv[ipset->newargc]);
+		ipset->newargv[ipset->newargc] = NULL;
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+					   "Cannot allocate memory.");
+	}
+	ipset->newargc += 2;
+	return 0;
+}
+
+/* Execute a restore line. Returns a negative error code if the
+ * restore must be aborted. */
+static int
+exec_restore_line(struct ipset *ipset, char *c)
+{
+	void *p = ipset_session_printf_private(ipset->session);
+	int ret;
+
+	if (STREQ(c, "COMMIT") || STREQ(c, "COMMIT\r")) {
+		ret = ipset_commit(ipset->session);
+		if (ret < 0)
+			ipset->standard_error(ipset, p);
+		return 0;
+	}
+	/* Most lines add elements to the same set */
+	ret = parse_fast_adt(ipset, c);
+	if (ret <= 0) {
+		if (ret < 0)
+			ipset->standard_error(ipset, p);
+		return 0;
+	}
+	/* Any other line may change the sets */
+	ipset->fast_cmd = NULL;
+
+	/* Build faked argv, argc */
+	ret = build_argv(ipset, c);
+	if (ret < 0)
+		return ret;
+	ret = restore_presize(ipset);
+	if (ret < 0)
+		return ret;
+
+	/* Execute line */
+	ret = ipset_parse_argv(ipset, ipset->newargc, ipset->newargv);
+	if (ret < 0)
+		ipset->standard_error(ipset, p);
+	return 0;
+}
+
+/* Skip the empty and comment lines of the input */
+static char *
+next_restore_line(struct ipset *ipset, struct ipset_input *in)
+{
+	char *c;
+
+	while ((c = input_line(in)) != NULL) {
+		ipset->restore_line++;
+		while (isspace(c[0]))
+			c++;
+		if (c[0] != '\0' && c[0] != '#')
+			return c;
+	}
+	return NULL;
+}
+
+/* Parallel restore: the add/del lines are distributed to the workers
+ * by set name, so the lines of a set keep their order. Any other line
+ * is a barrier, executed when the workers are done with the lines
+ * before it. Every worker has got its own ipset, session and socket.
+ * The lines are passed in chunks of the lineno and the line. */
+#define IPSET_JOB_CHUNK				65536
+
+struct ipset_job {
+	struct ipset *ipset;			/* Worker ipset */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *work;				/* Chunk of the worker */
+	size_t worklen;
+	char *fill;				/* Chunk being filled */
+	size_t filllen, fillsize;
+	bool quit;				/* Stop the worker */
+};
+
+static void *
+job_worker(void *arg)
+{
+	struct ipset_job *job = arg;
+	struct ipset *ipset = job->ipset;
+	void *p = ipset_session_printf_private(ipset->session);
+	char *c, *end;
+	uint32_t lineno;
+
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		while (!job->work && !job->quit)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (!job->work)
+			break;
+		pthread_mutex_unlock(&job->lock);
+
+		end = job->work + job->worklen;
+		for (c = job->work; c < end; c += strlen(c) + 1) {
+			memcpy(&lineno, c, sizeof(lineno));
+			c += sizeof(lineno);
+			ipset->restore_line = lineno;
+			exec_restore_line(ipset, c);
+		}
+		/* The barrier lines must see the elements */
+		if (ipset_commit(ipset->session) < 0)
+			ipset->standard_error(ipset, p);
+
+		pthread_mutex_lock(&job->lock);
+		free(job->work);
+		job->work = NULL;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+static int
+job_start(struct ipset *ipset, struct ipset_job *job)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	const struct ipset_envopts *opt;
+
+	job->ipset = ipset_init();
+	if (!job->ipset)
+		return -1;
+	ipset_custom_printf(job->ipset, ipset->custom_error,
+			    ipset->standard_error, NULL,
+			    ipset_session_printf_private(session));
+	for (opt = ipset_envopts; opt->flag; opt++)
+		if (opt->parse == ipset_envopt_parse &&
+		    ipset_envopt_test(session, opt->flag))
+			ipset_envopt_set(job->ipset->session, opt->flag);
+
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+	if (pthread_create(&job->thread, NULL, job_worker, job) != 0) {
+		pthread_cond_destroy(&job->cond);
+		pthread_mutex_destroy(&job->lock);
+		ipset_fini(job->ipset);
+		return -1;
+	}
+	return 0;
+}
+
+/* Hand the filled chunk to the worker when it is idle */
+static void
+job_submit(struct ipset_job *job)
+{
+	if (!job->filllen)
+		return;
+	pthread_mutex_lock(&job->lock);
+	while (job->work)
+		pthread_cond_wait(&job->cond, &job->lock);
+	job->work = job->fill;
+	job->worklen = job->filllen;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	job->fill = NULL;
+	job->filllen = job->fillsize = 0;
+}
+
+static void
+job_wait(struct ipset_job *job)
+{
+	pthread_mutex_lock(&job->lock);
+	while (job->work)
+		pthread_cond_wait(&job->cond, &job->lock);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void
+job_stop(struct ipset_job *job)
+{
+	job_submit(job);
+	pthread_mutex_lock(&job->lock);
+	job->quit = true;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	pthread_join(job->thread, NULL);
+	pthread_cond_destroy(&job->cond);
+	pthread_mutex_destroy(&job->lock);
+	ipset_fini(job->ipset);
+	free(job->fill);
+}
+
+static int
+job_queue(struct ipset_job *job, uint32_t lineno, const char *c)
+{
+	size_t len = sizeof(lineno) + strlen(c) + 1;
+
+	if (job->filllen + len > job->fillsize) {
+		size_t size = job->fillsize ? job->fillsize : IPSET_JOB_CHUNK;
+		char *fill;
+
+		while (size < job->filllen + len)
+			size *= 2;
+		fill = realloc(job->fill, size);
+		if (!fill)
+			return -1;
+		job->fill = fill;
+		job->fillsize = size;
+	}
+	memcpy(job->fill + job->filllen, &lineno, sizeof(lineno));
+	strcpy(job->fill + job->filllen + sizeof(lineno), c);
+	job->filllen += len;
+	if (job->filllen >= IPSET_JOB_CHUNK)
+		job_submit(job);
+	return 0;
+}
+
+/* Returns the worker of an add/del line or -1 for a barrier line */
+static int
+job_of_line(const char *c, unsigned int jobs)
+{
+	const struct ipset_commands *command;
+	char name[16];
+	unsigned int h = 0;
+	size_t len;
+
+	for (len = 0; c[len] && !isspace(c[len]); len++)
+		;
+	if (len >= sizeof(name))
+		return -1;
+	memcpy(name, c, len);
+	name[len] = '\0';
+	for (command = ipset_commands; command->cmd; command++)
+		if ((command->cmd == IPSET_CMD_ADD ||
+		     command->cmd == IPSET_CMD_DEL) &&
+		    ipset_match_cmd(name, command->name))
+			break;
+	if (!command->cmd)
+		return -1;
+
+	/* Options or quotes before the element are left to the barrier */
+	for (c += len; isspace(*c); c++)
+		;
+	if (*c == '\0' || *c == '-')
+		return -1;
+	for (; *c && !isspace(*c); c++) {
+		if (*c == '"')
+			return -1;
+		h = h * 31 + (unsigned char)*c;
+	}
+	return h % jobs;
+}
+
+static int
+parse_stream_lines(struct ipset *ipset, struct ipset_input *in)
+{
+	int ret = 0;
+	char *c;
+
+	while (ret == 0 && (c = next_restore_line(ipset, in)) != NULL)
+		ret = exec_restore_line(ipset, c);
+	return ret;
+}
+
+static int
+parse_stream_jobs(struct ipset *ipset, struct ipset_input *in)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	void *p = ipset_session_printf_private(session);
+	struct ipset_job job[IPSET_JOBS_MAX];
+	unsigned int i, jobs;
+	int ret = 0, n;
+	char *c;
+
+	memset(job, 0, sizeof(job));
+	for (jobs = 0; jobs < ipset->jobs; jobs++)
+		if (job_start(ipset, &job[jobs]) < 0)
+			break;
+	if (jobs == 0)
+		return parse_stream_lines(ipset, in);
+
+	while ((c = next_restore_line(ipset, in)) != NULL) {
+		n = job_of_line(c, jobs);
+		if (n >= 0) {
+			if (job_queue(&job[n], ipset->restore_line, c) == 0)
+				continue;
+			ret = ipset->custom_error(ipset, p,
+				IPSET_OTHER_PROBLEM, "Cannot allocate memory.");
+			break;
+		}
+		for (i = 0; i < jobs; i++)
+			job_submit(&job[i]);
+		for (i = 0; i < jobs; i++)
+			job_wait(&job[i]);
+		ret = exec_restore_line(ipset, c);
+		if (ret < 0)
+			break;
+		/* The next lines of the workers must see the result */
+		if (ipset_commit(session) < 0)
+			ipset->standard_error(ipset, p);
+	}
+	for (i = 0; i < jobs; i++)
+		job_stop(&job[i]);
+
+	return ret;
+}
+
+/* Sync mode: the members of the set and the desired elements are
+ * compared by the printed form of the elements, then the missing
+ * elements are added and the surplus ones deleted. */
+struct sync_elem {
+	struct sync_elem *next;			/* Next in the hash bucket */
+	struct sync_elem *list;			/* Next in the input order */
+	char *line;				/* Desired line, if any */
+	uint32_t lineno;			/* Line number of the line */
+	bool member;				/* Member of the set */
+	char elem[];				/* Printed element */
+};
+
+#define SYNC_HASH_SIZE				65536
+
+struct sync_state {
+	struct sync_elem *hash[SYNC_HASH_SIZE];
+	struct sync_elem *first, **last;	/* Elements in input order */
+	char *buf;				/* Saved set */
+	size_t len, size;
+	bool error;				/* Allocation error */
+};
+
+static int
+sync_outfn(struct ipset_session *session UNUSED, void *p, const char *fmt, ...)
+{
+	struct sync_state *sync = p;
+	va_list args;
+	size_t size;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(sync->buf + sync->len, sync->size - sync->len,
+			fmt, args);
+	va_end(args);
+	if (len < 0)
+		return -1;
+	if ((size_t)len >= sync->size - sync->len) {
+		char *buf;
+
+		for (size = sync->size ? sync->size : IPSET_INPUT_CHUNK;
+		     size - sync->len <= (size_t)len; size *= 2)
+			;
+		buf = realloc(sync->buf, size);
+		if (!buf) {
+			sync->error = true;
+			return -1;
+		}
+		sync->buf = buf;
+		sync->size = size;
+		va_start(args, fmt);
+		vsnprintf(sync->buf + sync->len, sync->size - sync->len,
+			  fmt, args);
+		va_end(args);
+	}
+	sync->len += len;
+	return 0;
+}
+
+/* Look up the element, create it if it is not found */
+static struct sync_elem *
+sync_elem(struct sync_state *sync, const char *elem, size_t len)
+{
+	struct sync_elem *e;
+	uint32_t h = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = h * 31 + (unsigned char)elem[i];
+	for (e = sync->hash[h % SYNC_HASH_SIZE]; e; e = e->next)
+		if (strncmp(e->elem, elem, len) == 0 && e->elem[len] == '\0')
+			return e;
+
+	e = calloc(1, sizeof(*e) + len + 1);
+	if (!e) {
+		sync->error = true;
+		return NULL;
+	}
+	memcpy(e->elem, elem, len);
+	e->next = sync->hash[h % SYNC_HASH_SIZE];
+	sync->hash[h % SYNC_HASH_SIZE] = e;
+	*sync->last = e;
+	sync->last = &e->list;
+	return e;
+}
+
+static void
+sync_free(struct sync_state *sync)
+{
+	struct sync_elem *e, *next;
+
+	for (e = sync->first; e; e = next) {
+		next = e->list;
+		free(e->line);
+		free(e);
+	}
+	free(sync->buf);
+	free(sync);
+}
+
+/* Save the set and collect its members */
+static int
+sync_members(struct ipset *ipset, struct sync_state *sync)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	void *p = ipset_session_printf_private(session);
+	bool resolve = ipset_envopt_test(session, IPSET_ENV_RESOLVE);
+	bool terse = ipset_envopt_test(session, IPSET_ENV_LIST_HEADER);
+	struct sync_elem *e;
+	char *c, *nl;
+	size_t len;
+	int ret;
+
+	/* The elements must be printed as they are parsed back */
+	ipset_envopt_unset(session, IPSET_ENV_RESOLVE);
+	ipset_envopt_unset(session, IPSET_ENV_LIST_HEADER);
+	ipset_session_output(session, IPSET_LIST_SAVE);
+	ipset_session_print_outfn(session, sync_outfn, sync);
+	ret = ipset_cmd(session, IPSET_CMD_SAVE, 0);
+	ipset_session_print_outfn(session, ipset->print_outfn, p);
+	if (resolve)
+		ipset_envopt_set(session, IPSET_ENV_RESOLVE);
+	if (terse)
+		ipset_envopt_set(session, IPSET_ENV_LIST_HEADER);
+	if (sync->error)
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+					   "Cannot allocate memory.");
+	if (ret < 0)
+		return ipset->standard_error(ipset, p);
+
+	/* "add SETNAME ELEM [options]" lines follow the create line */
+	for (c = sync->buf; c && c < sync->buf + sync->len; c = nl) {
+		nl = memchr(c, '\n', sync->buf + sync->len - c);
+		if (nl)
+			*nl++ = '\0';
+		if (!STRNEQ(c, "add ", 4))
+			continue;
+		/* Skip the setname, the element is never quoted */
+		for (c += 4; *c && !isspace(*c); c++)
+			;
+		while (isspace(*c))
+			c++;
+		for (len = 0; c[len] && !isspace(c[len]); len++)
+			;
+		if (len == 0)
+			continue;
+		e = sync_elem(sync, c, len);
+		if (!e)
+			return ipset->custom_error(ipset, p,
+				IPSET_OTHER_PROBLEM, "Cannot allocate memory.");
+		e->member = true;
+	}
+	return 0;
+}
+
+/* Read the desired elements: "ELEM [add options]" lines */
+static int
+sync_desired(struct ipset *ipset, struct sync_state *sync,
+	     struct ipset_input *in, const char *setname)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	struct ipset_data *data = ipset_session_data(session);
+	void *p = ipset_session_printf_private(session);
+	const struct ipset_type *type;
+	char elem[MAX_CMDLINE_CHARS];
+	struct sync_elem *e;
+	uint32_t lineno = 0;
+	uint8_t family;
+	char *c, *end, save;
+	int ret, len;
+
+	ret = ipset_parse_setname(session, IPSET_SETNAME, setname);
+	if (ret < 0)
+		return ipset->standard_error(ipset, p);
+	type = ipset_type_get(session, IPSET_CMD_ADD);
+	if (type == NULL)
+		return ipset->standard_error(ipset, p);
+	family = ipset_data_family(data);
+	ipset_data_reset(data);
+
+	while ((c = input_line(in)) != NULL) {
+		lineno++;
+		while (isspace(c[0]))
+			c++;
+		if (c[0] == '\0' || c[0] == '#')
+			continue;
+		for (end = c; *end && !isspace(*end); end++)
+			;
+
+		/* Parse the element alone and print it back */
+		ipset_session_lineno(session, lineno);
+		ipset_parse_setname(session, IPSET_SETNAME, setname);
+		ipset_session_data_set(session, IPSET_OPT_FAMILY, &family);
+		ipset_session_data_set(session, IPSET_OPT_TYPE, type);
+		save = *end;
+		*end = '\0';
+		ret = ipset_parse_elem(session, type->last_elem_optional, c);
+		*end = save;
+		len = ret < 0 ? ret :
+		      ipset_print_elem(elem, sizeof(elem), data,
+				       IPSET_OPT_ELEM, 0);
+		ipset_data_reset(data);
+		if (len < 0 || len >= (int)sizeof(elem)) {
+			ipset->standard_error(ipset, p);
+			continue;
+		}
+
+		e = sync_elem(sync, elem, len);
+		if (e && e->line)
+			/* Repeated element: the first line is used */
+			continue;
+		if (e)
+			e->line = strdup(c);
+		if (!e || !e->line)
+			return ipset->custom_error(ipset, p,
+				IPSET_OTHER_PROBLEM, "Cannot allocate memory.");
+		e->lineno = lineno;
+	}
+	if (in->error)
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+					   "Cannot read the sync input.");
+	return 0;
+}
+
+/* Execute "CMD SETNAME ARGS" as a restore line */
+static int
+sync_exec(struct ipset *ipset, const char *cmd, const char *setname,
+	  const char *args, uint32_t lineno)
+{
+	void *p = ipset_session_printf_private(ipset->session);
+	char *line;
+	int ret;
+
+	line = malloc(strlen(cmd) + strlen(setname) + strlen(args) + 3);
+	if (!line)
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+					   "Cannot allocate memory.");
+	sprintf(line, "%s %s %s", cmd, setname, args);
+	ipset->restore_line = lineno;
+	ret = exec_restore_line(ipset, line);
+	free(line);
+	return ret;
+}
+
+/* Sync the set to the elements read from stdin or from the file */
+static int
+sync_set(struct ipset *ipset)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	struct ipset_data *data = ipset_session_data(session);
+	void *p = ipset_session_printf_private(session);
+	char setname[IPSET_MAXNAMELEN];
+	struct ipset_input in;
+	struct sync_state *sync;
+	struct sync_elem *e;
+	uint32_t lineno = 0;
+	FILE *f = stdin;
+	int ret;
+
+	ipset_strlcpy(setname, ipset_data_setname(data), sizeof(setname));
+	if (ipset->filename) {
+		ret = ipset_session_io_normal(session, ipset->filename,
+					      IPSET_IO_INPUT);
+		if (ret < 0)
+			return ret;
+		f = ipset_session_io_stream(session, IPSET_IO_INPUT);
+	}
+	sync = calloc(1, sizeof(*sync));
+	if (!sync)
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+					   "Cannot allocate memory.");
+	sync->last = &sync->first;
+	if (input_init(&in, f) < 0) {
+		free(sync);
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+					   "Cannot allocate memory.");
+	}
+	ret = sync_members(ipset, sync);
+	if (ret == 0)
+		ret = sync_desired(ipset, sync, &in, setname);
+	input_fini(&in);
+
+	/* Delete first, so that the additions fit into maxelem. The
+	 * deleted elements are numbered in their own sequence. */
+	for (e = sync->first; ret == 0 && e; e = e->list)
+		if (e->member && !e->line)
+			ret = sync_exec(ipset, "del", setname, e->elem,
+					++lineno);
+	for (e = sync->first; ret == 0 && e; e = e->list)
+		if (!e->member && e->line)
+			ret = sync_exec(ipset, "add", setname, e->line,
+					e->lineno);
+	ipset->fast_cmd = NULL;
+	ipset->restore_line = 0;
+	sync_free(sync);
+	if (ret < 0)
+		return ret;
+
+	ret = ipset_commit(session);
+	if (ret < 0)
+		ipset->standard_error(ipset, p);
+	return ret;
+}
+
+/* Server mode: the commands of the clients connected to a Unix socket
+ * are executed in one long running session. The lines read in a round
+ * from all of the clients are executed in order, the consecutive add/del
+ * commands are buffered like in restore mode, so that the commands of
+ * different clients are sent to the kernel in shared batches. The kernel
+ * stops a batch at the first failing command and reports its lineno: the
+ * commands before it succeeded and the ones after it are executed again.
+ *
+ * Every command is answered by its output, each line prefixed by "> ",
+ * then by a status line: the exit status of the command as ipset would
+ * return it, followed by the error or warning message, if any. */
+
+#define SERVER_BUF_SIZE				65536
+#define SERVER_OUT_MAX				(1 << 20)
+#define SERVER_CLIENTS_MAX			1024
+
+struct server_buf {
+	char *data;
+	size_t len, size;
+};
+
+struct server_client {
+	int fd;
+	char in[SERVER_BUF_SIZE];		/* Unprocessed input */
+	size_t inlen;
+	size_t parsed;				/* Split into lines */
+	struct server_buf out;			/* Unsent replies */
+	bool eof;				/* Input closed */
+	bool quit;				/* Close after the replies */
+	bool error;				/* Close at once */
+};
+
+struct server_cmd {
+	struct server_client *client;
+	char *line;				/* In the client input */
+	struct server_buf reply;
+	bool bol;				/* Output at line start */
+	bool done;				/* Status line added */
+};
+
+struct server {
+	struct ipset *ipset;
+	int fd;					/* Listening socket */
+	struct server_client *client[SERVER_CLIENTS_MAX];
+	unsigned int clients;
+	struct server_cmd *cmd;			/* Commands read */
+	size_t cmds, size;
+	size_t cur;				/* Command being executed */
+	size_t batch;				/* First one batched */
+	bool open;				/* Batch buffered */
+	bool exist;				/* -exist of the batch */
+	uint16_t envopts;			/* Options of the server */
+	struct server_buf tmp;			/* Printed output */
+};
+
+static volatile sig_atomic_t server_stop;
+
+static void
+server_signal(int sig UNUSED)
+{
+	server_stop = 1;
+}
+
+static int
+server_buf_add(struct server_buf *b, const char *s, size_t len)
+{
+	size_t size;
+	char *data;
+
+	if (b->len + len > b->size) {
+		for (size = b->size ? b->size : 256; size < b->len + len; )
+			size *= 2;
+		data = realloc(b->data, size);
+		if (!data)
+			return -1;
+		b->data = data;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+	return 0;
+}
+
+/* Answer the current command by the status line */
+static void
+server_reply(struct server *srv, int status, const char *prefix,
+	     const char *msg)
+{
+	struct server_cmd *cmd = &srv->cmd[srv->cur];
+	char line[IPSET_ERRORBUFLEN + 32];
+	unsigned int lineno;
+	int n, len;
+	char *c;
+
+	if (cmd->done)
+		return;
+	if (status > IPSET_VERSION_PROBLEM)
+		status = IPSET_OTHER_PROBLEM;
+	/* The linenos of the batches mean nothing to the clients */
+	if (msg && sscanf(msg, "Error in line %u: %n", &lineno, &n) == 1 &&
+	    n > 0)
+		msg += n;
+	if (msg && *msg)
+		len = snprintf(line, sizeof(line), "%d %s%s", status,
+			       prefix, msg);
+	else
+		len = snprintf(line, sizeof(line), "%d", status);
+	if (len >= (int)sizeof(line))
+		len = sizeof(line) - 1;
+	/* One line, whatever the message is */
+	while (len > 0 && isspace(line[len - 1]))
+		len--;
+	line[len] = '\0';
+	for (c = line; *c; c++)
+		if (*c == '\n')
+			*c = ' ';
+	line[len++] = '\n';
+	if (!cmd->bol)
+		server_buf_add(&cmd->reply, "\n", 1);
+	server_buf_add(&cmd->reply, line, len);
+	cmd->done = true;
+}
+
+static int __attribute__((format(printf, 4, 5)))
+server_custom_error(struct ipset *ipset, void *p, int status,
+		    const char *msg, ...)
+{
+	struct server *srv = p;
+	char buf[IPSET_ERRORBUFLEN];
+	va_list args;
+
+	/* Only quit reports no problem */
+	if (status == IPSET_NO_PROBLEM)
+		srv->cmd[srv->cur].client->quit = true;
+	buf[0] = '\0';
+	if (msg) {
+		va_start(args, msg);
+		vsnprintf(buf, sizeof(buf), msg, args);
+		va_end(args);
+	}
+	server_reply(srv, status, "", buf);
+	ipset_session_report_reset(ipset->session);
+	return -1;
+}
+
+static int
+server_standard_error(struct ipset *ipset, void *p)
+{
+	struct server *srv = p;
+	const char *msg = ipset_session_report_msg(ipset->session);
+
+	switch (ipset_session_report_type(ipset->session)) {
+	case IPSET_WARNING:
+		server_reply(srv, IPSET_NO_PROBLEM, "Warning: ", msg);
+		break;
+	case IPSET_NO_ERROR:
+		server_reply(srv, IPSET_NO_PROBLEM, "", msg);
+		break;
+	default:
+		server_reply(srv, IPSET_OTHER_PROBLEM, "", msg);
+		break;
+	}
+	ipset_session_report_reset(ipset->session);
+	return -1;
+}
+
+/* The output of the current command, prefixed line by line */
+static int __attribute__((format(printf, 3, 4)))
+server_outfn(struct ipset_session *session UNUSED, void *p,
+	     const char *fmt, ...)
+{
+	struct server *srv = p;
+	struct server_cmd *cmd = &srv->cmd[srv->cur];
+	struct server_buf *tmp = &srv->tmp;
+	va_list args;
+	char *buf, *c, *e;
+	size_t size;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(tmp->data, tmp->size, fmt, args);
+	va_end(args);
+	if (len < 0)
+		return -1;
+	if ((size_t)len >= tmp->size) {
+		for (size = tmp->size ? tmp->size : IPSET_INPUT_CHUNK;
+		     size <= (size_t)len; size *= 2)
+			;
+		buf = realloc(tmp->data, size);
+		if (!buf)
+			return -1;
+		tmp->data = buf;
+		tmp->size = size;
+		va_start(args, fmt);
+		vsnprintf(tmp->data, tmp->size, fmt, args);
+		va_end(args);
+	}
+	buf = tmp->data;
+	for (c = buf; c < buf + len; c = e) {
+		e = memchr(c, '\n', buf + len - c);
+		e = e ? e + 1 : buf + len;
+		if (cmd->bol && server_buf_add(&cmd->reply, "> ", 2) < 0)
+			break;
+		if (server_buf_add(&cmd->reply, c, e - c) < 0)
+			break;
+		cmd->bol = e[-1] == '\n';
+	}
+	return c < buf + len ? -1 : len;
+}
+
+/* Every command starts from the options of the server */
+static void
+server_envopts(struct ipset_session *session, uint16_t envopts)
+{
+	int bit;
+
+	for (bit = IPSET_ENV_BIT_SORTED; bit <= IPSET_ENV_BIT_LIST_TOTAL; bit++)
+		if (envopts & (1 << bit))
+			ipset_envopt_set(session, 1 << bit);
+		else
+			ipset_envopt_unset(session, 1 << bit);
+}
+
+/* Parse the current command in the session data */
+static int
+server_parse(struct server *srv)
+{
+	struct ipset *ipset = srv->ipset;
+	struct ipset_session *session = ipset->session;
+	int ret;
+
+	server_envopts(session, srv->envopts);
+	ipset_session_list_reset(session);
+	ipset_data_reset(ipset_session_data(session));
+	ipset->restore_line = srv->cur + 1;
+	ret = build_argv(ipset, srv->cmd[srv->cur].line);
+	if (ret < 0)
+		return ret;
+	ret = ipset_parser(ipset, ipset->newargc, ipset->newargv);
+	/* No batch may be executed after a failed one */
+	ipset_envopt_unset(session, IPSET_ENV_PIPELINE);
+	return ret;
+}
+
+/* A batch failed: answer the commands up to the failed one, the
+ * execution continues after it. The commands from the first of the
+ * batch up to end (exclusive) may be in the failed message. */
+static void
+server_failed(struct server *srv, size_t end)
+{
+	struct ipset *ipset = srv->ipset;
+	uint32_t lineno = ipset_session_report_lineno(ipset->session);
+	size_t failed = lineno - 1, i;
+
+	if (lineno == 0 || failed < srv->batch || failed >= end) {
+		/* Not known which one failed: all of them did */
+		for (srv->cur = srv->batch; srv->cur < end; srv->cur++)
+			server_reply(srv, IPSET_OTHER_PROBLEM, "",
+				ipset_session_report_msg(ipset->session));
+		ipset_session_report_reset(ipset->session);
+	} else {
+		for (i = srv->batch; i < failed; i++) {
+			srv->cur = i;
+			server_reply(srv, IPSET_NO_PROBLEM, "", NULL);
+		}
+		srv->cur = failed;
+		server_standard_error(ipset, srv);
+		srv->cur = failed + 1;
+	}
+	ipset_data_reset(ipset_session_data(ipset->session));
+	srv->open = false;
+}
+
+/* Send the buffered batch */
+static int
+server_flush(struct server *srv)
+{
+	struct ipset_session *session = srv->ipset->session;
+	size_t end = srv->cur;
+
+	if (ipset_commit(session) < 0 ||
+	    ipset_session_report_type(session) == IPSET_ERROR) {
+		server_failed(srv, end);
+		return -1;
+	}
+	for (srv->cur = srv->batch; srv->cur < end; srv->cur++)
+		server_reply(srv, IPSET_NO_PROBLEM, "", NULL);
+	srv->open = false;
+	return 0;
+}
+
+/* Execute the commands of the round */
+static void
+server_exec(struct server *srv)
+{
+	struct ipset_session *session = srv->ipset->session;
+	bool batch, exist;
+	int cmd, ret;
+
+	srv->cur = 0;
+	srv->open = false;
+	for (;;) {
+		if (srv->cur == srv->cmds) {
+			if (!srv->open || server_flush(srv) == 0)
+				break;
+			continue;
+		}
+		if (srv->cmd[srv->cur].done ||
+		    srv->cmd[srv->cur].client->quit) {
+			/* Answered before a retry or after quit */
+			srv->cur++;
+			continue;
+		}
+		cmd = server_parse(srv);
+		if (cmd <= 0) {
+			server_reply(srv, IPSET_PARAMETER_PROBLEM, "",
+				     "No command specified.");
+			srv->cur++;
+			continue;
+		}
+		if (ipset_envopt_test(session, IPSET_ENV_TEST_STREAM)) {
+			server_reply(srv, IPSET_PARAMETER_PROBLEM, "",
+				     "Testing a stream is not supported "
+				     "in server mode");
+			srv->cur++;
+			continue;
+		}
+		batch = cmd == IPSET_CMD_ADD || cmd == IPSET_CMD_DEL;
+		exist = ipset_envopt_test(session, IPSET_ENV_EXIST);
+		if (srv->open && (!batch || exist != srv->exist)) {
+			/* The command is parsed again after the batch */
+			ipset_data_reset(ipset_session_data(session));
+			server_flush(srv);
+			continue;
+		}
+		if (batch && !srv->open) {
+			srv->open = true;
+			srv->batch = srv->cur;
+			srv->exist = exist;
+		}
+		ret = ipset_cmd(session, cmd, srv->cur + 1);
+		if (batch && ret < 0 &&
+		    ipset_session_report_lineno(session) != srv->cur + 1) {
+			/* A previous message of the batch failed */
+			server_failed(srv, srv->cur + 1);
+			continue;
+		}
+		if (batch && ret == 0) {
+			srv->cur++;
+			continue;
+		}
+		if (ret < 0 ||
+		    ipset_session_report_type(session) > IPSET_NO_ERROR)
+			server_standard_error(srv->ipset, srv);
+		else
+			server_reply(srv, IPSET_NO_PROBLEM, "", NULL);
+		srv->cur++;
+	}
+}
+
+static void
+server_close(struct server *srv, unsigned int i)
+{
+	struct server_client *client = srv->client[i];
+
+	close(client->fd);
+	free(client->out.data);
+	free(client);
+	srv->client[i] = srv->client[--srv->clients];
+}
+
+static void
+server_accept(struct server *srv)
+{
+	struct server_client *client;
+	int fd;
+
+	while ((fd = accept(srv->fd, NULL, NULL)) >= 0) {
+		if (srv->clients == SERVER_CLIENTS_MAX ||
+		    fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+		    fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+		    !(client = calloc(1, sizeof(*client)))) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		srv->client[srv->clients++] = client;
+	}
+}
+
+static void
+server_read(struct server_client *client)
+{
+	ssize_t len;
+
+	len = read(client->fd, client->in + client->inlen,
+		   sizeof(client->in) - client->inlen);
+	if (len > 0) {
+		client->inlen += len;
+	} else if (len == 0) {
+		client->eof = true;
+		/* Terminate the last line */
+		if (client->inlen && client->in[client->inlen - 1] != '\n' &&
+		    client->inlen < sizeof(client->in))
+			client->in[client->inlen++] = '\n';
+	} else if (errno != EAGAIN && errno != EINTR) {
+		client->error = true;
+	}
+}
+
+static void
+server_write(struct server_client *client)
+{
+	ssize_t len;
+
+	if (!client->out.len)
+		return;
+	len = send(client->fd, client->out.data, client->out.len,
+		   MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (len > 0) {
+		client->out.len -= len;
+		memmove(client->out.data, client->out.data + len,
+			client->out.len);
+	} else if (len < 0 && errno != EAGAIN && errno != EINTR) {
+		client->error = true;
+	}
+}
+
+/* Split the complete input lines of the clients into commands */
+static int
+server_lines(struct server *srv)
+{
+	struct server_client *client;
+	struct server_cmd *cmd;
+	unsigned int i;
+	char *c, *e, *end;
+	size_t size;
+
+	srv->cmds = 0;
+	for (i = 0; i < srv->clients; i++) {
+		client = srv->client[i];
+		if (client->quit || client->error)
+			continue;
+		end = client->in + client->inlen;
+		for (c = client->in; (e = memchr(c, '\n', end - c));
+		     c = e + 1) {
+			*e = '\0';
+			while (isspace(*c))
+				c++;
+			if (*c == '\0' || *c == '#')
+				continue;
+			if (srv->cmds == srv->size) {
+				size = srv->size ? 2 * srv->size : 256;
+				cmd = realloc(srv->cmd, size * sizeof(*cmd));
+				if (!cmd)
+					return -1;
+				srv->cmd = cmd;
+				srv->size = size;
+			}
+			cmd = &srv->cmd[srv->cmds++];
+			memset(cmd, 0, sizeof(*cmd));
+			cmd->client = client;
+			cmd->line = c;
+			cmd->bol = true;
+		}
+		client->parsed = c - client->in;
+		/* No line end in the whole buffer */
+		if (client->parsed == 0 && client->inlen == sizeof(client->in))
+			client->error = true;
+	}
+	return 0;
+}
+
+/* Queue the replies in the order of the commands and drop the lines */
+static void
+server_replies(struct server *srv)
+{
+	struct server_client *client;
+	struct server_cmd *cmd;
+	unsigned int i;
+	size_t n;
+
+	for (n = 0; n < srv->cmds; n++) {
+		cmd = &srv->cmd[n];
+		if (cmd->reply.len &&
+		    server_buf_add(&cmd->client->out, cmd->reply.data,
+				   cmd->reply.len) < 0)
+			cmd->client->error = true;
+		free(cmd->reply.data);
+	}
+	for (i = 0; i < srv->clients; i++) {
+		client = srv->client[i];
+		client->inlen -= client->parsed;
+		memmove(client->in, client->in + client->parsed,
+			client->inlen);
+		client->parsed = 0;
+	}
+}
+
+static int
+server_listen(struct server *srv, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	/* Replace the socket of a previous server */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	srv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (srv->fd < 0)
+		return -1;
+	if (fcntl(srv->fd, F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(srv->fd, F_SETFD, FD_CLOEXEC) < 0 ||
+	    bind(srv->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(srv->fd, SOMAXCONN) < 0) {
+		close(srv->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+server_run(struct ipset *ipset)
+{
+	struct ipset_session *session = ipset->session;
+	ipset_custom_errorfn custom_error = ipset->custom_error;
+	ipset_standard_errorfn standard_error = ipset->standard_error;
+	ipset_print_outfn print_outfn = ipset->print_outfn;
+	void *p = ipset_session_printf_private(session);
+	struct sigaction sa = { .sa_handler = server_signal }, oint, oterm;
+	struct pollfd pfd[SERVER_CLIENTS_MAX + 1];
+	struct server srv = { .ipset = ipset };
+	struct server_client *client;
+	const char *path = ipset->server;
+	unsigned int i, bit;
+	int ret = 0;
+
+	if (server_listen(&srv, path) < 0)
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+			"Cannot listen on %s: %s", path, strerror(errno));
+	for (bit = IPSET_ENV_BIT_SORTED; bit <= IPSET_ENV_BIT_LIST_TOTAL; bit++)
+		if (ipset_envopt_test(session, 1 << bit))
+			srv.envopts |= 1 << bit;
+	server_stop = 0;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &oint);
+	sigaction(SIGTERM, &sa, &oterm);
+	ipset->custom_error = server_custom_error;
+	ipset->standard_error = server_standard_error;
+	ipset_session_print_outfn(session, server_outfn, &srv);
+	ipset->serving = true;
+
+	while (!server_stop) {
+		pfd[0].fd = srv.fd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < srv.clients; i++) {
+			client = srv.client[i];
+			pfd[i + 1].fd = client->fd;
+			/* Stop reading from the clients not reading replies */
+			pfd[i + 1].events =
+				(client->out.len < SERVER_OUT_MAX &&
+				 !client->eof && !client->quit ? POLLIN : 0) |
+				(client->out.len ? POLLOUT : 0);
+		}
+		if (poll(pfd, srv.clients + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < srv.clients; i++) {
+			if (pfd[i + 1].revents & POLLOUT)
+				server_write(srv.client[i]);
+			if (pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+				server_read(srv.client[i]);
+		}
+		if (server_lines(&srv) < 0) {
+			ret = -1;
+			break;
+		}
+		server_exec(&srv);
+		server_replies(&srv);
+		for (i = srv.clients; i-- > 0; ) {
+			client = srv.client[i];
+			server_write(client);
+			if (client->error ||
+			    ((client->eof || client->quit) && !client->out.len))
+				server_close(&srv, i);
+		}
+		if (pfd[0].revents & POLLIN)
+			server_accept(&srv);
+	}
+
+	while (srv.clients)
+		server_close(&srv, srv.clients - 1);
+	free(srv.cmd);
+	free(srv.tmp.data);
+	close(srv.fd);
+	unlink(path);
+	ipset->serving = false;
+	ipset->fast_cmd = NULL;
+	ipset->restore_line = 0;
+	ipset->custom_error = custom_error;
+	ipset->standard_error = standard_error;
+	ipset_session_print_outfn(session, print_outfn, p);
+	sigaction(SIGINT, &oint, NULL);
+	sigaction(SIGTERM, &oterm, NULL);
+	server_envopts(session, srv.envopts);
+	ipset_session_list_reset(session);
+
+	if (ret < 0)
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+			"Server failure: %s", strerror(errno));
+	return ipset->custom_error(ipset, p, IPSET_NO_PROBLEM, NULL);
+}
+
+/**
+ * ipset_parse_stream - parse an stream and execute the commands
+ * @ipset: ipset structure
+ * @f: stream
+ *
+ * Parse an already opened file as stream and execute the commands.
+ * With the "-jobs" option the add/del commands of different sets
+ * are executed in parallel.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_stream(struct ipset *ipset, FILE *f)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	void *p = ipset_session_printf_private(session);
+	struct ipset_input in;
+	int ret;
+
+	if (input_init(&in, f) < 0)
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+					   "Cannot allocate memory.");
+	if (in.mapped)
+		restore_count_adds(ipset, in.buf, in.len);
+	if (ipset->jobs > 1)
+		ret = parse_stream_jobs(ipset, &in);
+	else
+		ret = parse_stream_lines(ipset, &in);
+	restore_count_free(ipset);
+	if (ret < 0) {
+		input_fini(&in);
+		return ret;
+	}
+	if (in.error) {
+		input_fini(&in);
+		return ipset->custom_error(ipset, p, IPSET_OTHER_PROBLEM,
+					   "Cannot read the restore input.");
+	}
+	input_fini(&in);
+	/* implicit "COMMIT" at EOF */
+	ret = ipset_commit(ipset->session);
+	if (ret < 0)
+		ipset->standard_error(ipset, p);
+
+	return ret;
+}
+
+/**
+ * ipset_session - returns the session pointer of an ipset structure
+ * @ipset: ipset structure
+ *
+ * Returns the session pointer of an ipset structure.
+ */
+struct ipset_session *
+ipset_session(struct ipset *ipset)
+{
+	return ipset->session;
+}
+
+/**
+ * ipset_is_interactive - is the interactive mode enabled?
+ * @ipset: ipset structure
+ *
+ * Returns true if the interactive mode is enabled.
+ */
+bool
+ipset_is_interactive(struct ipset *ipset)
+{
+	return ipset->interactive;
+}
+
+/**
+ * ipset_custom_printf - set custom print functions
+ * @ipset: ipset structure
+ * @custom_error: custom error function
+ * @standard_error: standard error function
+ * @print_outfn: output/printing function
+ * @p: pointer to private data area
+ *
+ * The function makes possible to set custom error and
+ * output functions for the library. The private data
+ * pointer can be used to pass arbitrary data to these functions.
+ * If a function argument is NULL, the default printing function is set.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_custom_printf(struct ipset *ipset,
+		    ipset_custom_errorfn custom_error,
+		    ipset_standard_errorfn standard_error,
+		    ipset_print_outfn print_outfn,
+		    void *p)
+{
+	ipset->no_vhi = !!(custom_error || standard_error || print_outfn);
+	ipset->print_outfn = print_outfn;
+	ipset->custom_error =
+		custom_error ? custom_error : default_custom_error;
+	ipset->standard_error =
+		standard_error ? standard_error : default_standard_error;
+
+	return ipset_session_print_outfn(ipset->session, print_outfn, p);
+}
+
+/**
+ * ipset_init - initialize ipset library interface
+ *
+ * Initialize the ipset library interface.
+ *
+ * Returns the created ipset structure for success or NULL for failure.
+ */
+struct ipset *
+ipset_init(void)
+{
+	struct ipset *ipset;
+
+	ipset = calloc(1, sizeof(struct ipset));
+	if (ipset == NULL)
+		return NULL;
+	ipset->newargv[0] =
+		calloc(strlen(program_name) + 1, sizeof(*program_name));
+	if (!ipset->newargv[0]) {
+		free(ipset);
+		return NULL;
+	}
+	ipset_strlcpy(ipset->newargv[0], program_name,
+		      strlen(program_name) + 1);
+	ipset->newargc = 1;
+	ipset->session = ipset_session_init(NULL, NULL);
+	if (ipset->session == NULL) {
+		free(ipset->newargv[0]);
+		free(ipset);
+		return NULL;
+	}
+	ipset_custom_printf(ipset, NULL, NULL, NULL, NULL);
+
+	INIT_LIST_HEAD(&ipset->xlate_sets);
+
+	return ipset;
+}
+
+/**
+ * ipset_fini - destroy an ipset library interface
+ * @ipset: ipset structure
+ *
+ * Destroys an ipset library interface
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_fini(struct ipset *ipset)
+{
+	struct ipset_xlate_set *xlate_set, *next;
+
+	assert(ipset);
+
+	if (ipset->session)
+		ipset_session_fini(ipset->session);
+	reset_argv(ipset);
+	if (ipset->newargv[0])
+		free(ipset->newargv[0]);
+
+	list_for_each_entry_safe(xlate_set, next, &ipset->xlate_sets, list)
+		free(xlate_set);
+	free(ipset->xlate_flower);
+
+	free(ipset);
+	return 0;
+}
+
+/* Ignore the set family, use inet. */
+static const char *ipset_xlate_family(uint8_t family)
+{
+	return "inet";
+}
+
+enum ipset_xlate_set_type {
+	IPSET_XLATE_TYPE_UNKNOWN	= 0,
 	IPSET_XLATE_TYPE_HASH_MAC,
 	IPSET_XLATE_TYPE_HASH_IP,
 	IPSET_XLATE_TYPE_HASH_IP_MAC,
@@ -1574,6 +3977,7 @@ enum ipset_xlate_set_type {
 	IPSET_XLATE_TYPE_BITMAP_PORT,
 	IPSET_XLATE_TYPE_BITMAP_IP_MAC,
 	IPSET_XLATE_TYPE_BITMAP_IP,
+	IPSET_XLATE_TYPE_RANGE_IP,
 };
 
 static enum ipset_xlate_set_type ipset_xlate_set_type(const char *typename)
@@ -1610,6 +4014,8 @@ static enum ipset_xlate_set_type ipset_xlate_set_type(const char *typename)
 		return IPSET_XLATE_TYPE_BITMAP_IP_MAC;
 	else if (!strcmp(typename, "bitmap:ip"))
 		return IPSET_XLATE_TYPE_BITMAP_IP;
+	else if (!strcmp(typename, "range:ip"))
+		return IPSET_XLATE_TYPE_RANGE_IP;
 
 	return IPSET_XLATE_TYPE_UNKNOWN;
 }
@@ -1709,16 +4115,245 @@ ipset_xlate_type_to_nftables(int family, enum ipset_xlate_set_type type,
 		else if (family == AF_INET6)
 			return "ipv6_addr";
 		break;
+	case IPSET_XLATE_TYPE_RANGE_IP:
+		*flags |= NFT_SET_INTERVAL;
+		if (family == AF_INET)
+			return "ipv4_addr";
+		else if (family == AF_INET6)
+			return "ipv6_addr";
+		break;
 	}
 	/* This should not ever happen. */
 	return "unknown";
 }
 
+/* Elements in an element block at most */
+#define IPSET_XLATE_BLOCK_MAX	65536
+
+/* Translated element with its options */
+#define IPSET_XLATE_ELEM_LEN	1024
+
+static void __attribute__((format(printf, 2, 3)))
+ipset_xlate_cat(char *elem, const char *fmt, ...)
+{
+	size_t len = strlen(elem);
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(elem + len, IPSET_XLATE_ELEM_LEN - len, fmt, args);
+	va_end(args);
+}
+
+/* Compare addresses in host order words */
+static int
+ipset_xlate_addr_cmp(const uint32_t *a, const uint32_t *b)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
+	return 0;
+}
+
+static void
+ipset_xlate_elem_sep(struct ipset *ipset)
+{
+	printf(ipset->xlate_elems++ ? ",\n\t" : "\t");
+}
+
+/* Print the pending range of addresses */
+static void
+ipset_xlate_range_print(struct ipset *ipset)
+{
+	union nf_inet_addr from, to;
+	uint32_t hostmask[4];
+	uint8_t bits, cidr;
+	char buf[INET6_ADDRSTRLEN];
+	int i, af;
+
+	if (!ipset->xlate_range)
+		return;
+	ipset->xlate_range = false;
+	ipset_xlate_elem_sep(ipset);
+
+	af = ipset->xlate_family == NFPROTO_IPV6 ? AF_INET6 : AF_INET;
+	bits = af == AF_INET6 ? 128 : 32;
+	for (i = 0; i < 4; i++) {
+		from.all[i] = htonl(ipset->xlate_from[i]);
+		to.all[i] = htonl(ipset->xlate_to[i]);
+	}
+	if (af == AF_INET) {
+		from.ip = from.all[3];
+		to.ip = to.all[3];
+	}
+	inet_ntop(af, &from, buf, sizeof(buf));
+	printf("%s", buf);
+	if (!memcmp(ipset->xlate_from, ipset->xlate_to,
+		    sizeof(ipset->xlate_from)))
+		return;
+	/* A network, if the range covers the host part exactly */
+	for (cidr = bits; cidr > 0; cidr--) {
+		for (i = 0; i < 4; i++) {
+			int hbits = 128 - (cidr + 128 - bits) - 32 * (3 - i);
+
+			hostmask[i] = hbits >= 32 ? 0xFFFFFFFF :
+				      hbits <= 0 ? 0 :
+				      (1U << hbits) - 1;
+		}
+		for (i = 0; i < 4; i++)
+			if ((ipset->xlate_from[i] & hostmask[i]) ||
+			    (ipset->xlate_from[i] | hostmask[i]) !=
+			    ipset->xlate_to[i])
+				break;
+		if (i == 4) {
+			printf("/%u", cidr);
+			return;
+		}
+	}
+	inet_ntop(af, &to, buf, sizeof(buf));
+	printf("-%s", buf);
+}
+
+/* Close the element block */
+static void
+ipset_xlate_block_end(struct ipset *ipset)
+{
+	if (ipset->xlate_block[0] == '\0')
+		return;
+	ipset_xlate_range_print(ipset);
+	printf("\n}\n");
+	ipset->xlate_block[0] = '\0';
+	ipset->xlate_elems = 0;
+}
+
+/* Continue the element block of the set or start a new one */
+static void
+ipset_xlate_block(struct ipset *ipset, uint8_t family, const char *table,
+		  const char *set)
+{
+	if (ipset->xlate_block[0] != '\0' &&
+	    (!STREQ(ipset->xlate_block, set) ||
+	     ipset->xlate_elems >= IPSET_XLATE_BLOCK_MAX))
+		ipset_xlate_block_end(ipset);
+	if (ipset->xlate_block[0] != '\0')
+		return;
+	printf("add element %s %s %s {\n",
+	       ipset_xlate_family(family), table, set);
+	ipset_strlcpy(ipset->xlate_block, set, sizeof(ipset->xlate_block));
+}
+
+/* Merge a plain address or network element of an interval set into the
+ * pending range, when adjacent to it.
+ *
+ * Returns false if the element cannot be a part of a range.
+ */
+static bool
+ipset_xlate_range(struct ipset *ipset, const struct ipset_data *data,
+		  const uint8_t *netmask)
+{
+	static const enum ipset_opt others[] = {
+		IPSET_OPT_IP2, IPSET_OPT_PORT, IPSET_OPT_MARK,
+		IPSET_OPT_IFACE, IPSET_OPT_ETHER, IPSET_OPT_PACKETS,
+		IPSET_OPT_BYTES, IPSET_OPT_TIMEOUT, IPSET_OPT_ADT_COMMENT,
+	};
+	uint32_t from[4] = {}, to[4], next[4];
+	const union nf_inet_addr *ip;
+	uint8_t family = ipset_data_family(data), bits, cidr;
+	unsigned int i;
+	int hbits;
+
+	if (!ipset_data_test(data, IPSET_OPT_IP) ||
+	    (family != NFPROTO_IPV4 && family != NFPROTO_IPV6))
+		return false;
+	for (i = 0; i < ARRAY_SIZE(others); i++)
+		if (ipset_data_test(data, others[i]))
+			return false;
+
+	bits = family == NFPROTO_IPV6 ? 128 : 32;
+	cidr = netmask ? *netmask : bits;
+	if (ipset_data_test(data, IPSET_OPT_CIDR))
+		cidr = *(const uint8_t *) ipset_data_get(data, IPSET_OPT_CIDR);
+	ip = ipset_data_get(data, IPSET_OPT_IP);
+	if (family == NFPROTO_IPV4)
+		from[3] = ntohl(ip->ip);
+	else
+		for (i = 0; i < 4; i++)
+			from[i] = ntohl(ip->all[i]);
+	for (i = 0; i < 4; i++) {
+		hbits = 128 - (cidr + 128 - bits) - 32 * (3 - i);
+		if (hbits >= 32) {
+			from[i] = 0;
+			to[i] = 0xFFFFFFFF;
+		} else if (hbits > 0) {
+			from[i] &= ~((1U << hbits) - 1);
+			to[i] = from[i] | ((1U << hbits) - 1);
+		} else {
+			to[i] = from[i];
+		}
+	}
+	if (ipset_data_test(data, IPSET_OPT_IP_TO)) {
+		ip = ipset_data_get(data, IPSET_OPT_IP_TO);
+		if (family == NFPROTO_IPV4)
+			to[3] = ntohl(ip->ip);
+		else
+			for (i = 0; i < 4; i++)
+				to[i] = ntohl(ip->all[i]);
+	}
+
+	if (ipset->xlate_range && ipset->xlate_family == family) {
+		bool carry = true;
+
+		/* next = the address after the pending range */
+		for (i = 4; i-- > 0;) {
+			next[i] = ipset->xlate_to[i] + carry;
+			carry = carry && next[i] == 0;
+		}
+		if (ipset_xlate_addr_cmp(from, ipset->xlate_from) >= 0 &&
+		    (carry || ipset_xlate_addr_cmp(from, next) <= 0)) {
+			if (ipset_xlate_addr_cmp(to, ipset->xlate_to) > 0)
+				memcpy(ipset->xlate_to, to, sizeof(to));
+			return true;
+		}
+	}
+	ipset_xlate_range_print(ipset);
+	ipset->xlate_range = true;
+	ipset->xlate_family = family;
+	memcpy(ipset->xlate_from, from, sizeof(from));
+	memcpy(ipset->xlate_to, to, sizeof(to));
+	return true;
+}
+
+/* Record the created set for the parsing of its elements */
+static struct ipset_xlate_set *
+ipset_xlate_set_new(struct ipset *ipset, const char *set, uint8_t family,
+		    const char *typename)
+{
+	const struct ipset_type *ipset_type;
+	struct ipset_xlate_set *xlate_set;
+
+	xlate_set = calloc(1, sizeof(*xlate_set));
+	if (!xlate_set)
+		return NULL;
+
+	snprintf(xlate_set->name, sizeof(xlate_set->name), "%s", set);
+	ipset_type = ipset_types();
+	while (ipset_type) {
+		if (!strcmp(ipset_type->name, typename))
+			break;
+		ipset_type = ipset_type->next;
+	}
+
+	xlate_set->family = family;
+	xlate_set->type = ipset_type;
+	list_add_tail(&xlate_set->list, &ipset->xlate_sets);
+	return xlate_set;
+}
+
 static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 		       const char *table)
 {
 	const char *set, *typename, *nft_type;
-	const struct ipset_type *ipset_type;
 	struct ipset_xlate_set *xlate_set;
 	enum ipset_xlate_set_type type;
 	struct ipset_session *session;
@@ -1730,6 +4365,7 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 	const char *comment;
 	uint32_t flags = 0;
 	uint8_t family;
+	char elem[IPSET_XLATE_ELEM_LEN];
 	char buf[64];
 	bool concat;
 	char *term;
@@ -1741,6 +4377,9 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 	set = ipset_data_get(data, IPSET_SETNAME);
 	family = ipset_data_family(data);
 
+	if (cmd != IPSET_CMD_ADD)
+		ipset_xlate_block_end(ipset);
+
 	switch (cmd) {
 	case IPSET_CMD_CREATE:
 		/* Not supported. */
@@ -1753,6 +4392,13 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 		/* Ignore:
 		 * - IPSET_FLAG_WITH_COMMENT
 		 * - IPSET_FLAG_WITH_FORCEADD
+		 * - IPSET_FLAG_WITH_LPM
+		 * - IPSET_FLAG_WITH_PERCPU
+		 * - IPSET_FLAG_WITH_BLOOM
+		 * - IPSET_FLAG_WITH_PREALLOC
+		 * - IPSET_FLAG_WITH_INDEX
+		 * - IPSET_FLAG_WITH_AGGREGATE
+		 * - IPSET_FLAG_WITH_DISTINCT
 		 */
 		if (cadt_flags &&
 		    (*cadt_flags & (IPSET_FLAG_BEFORE |
@@ -1797,6 +4443,10 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 		 * - IPSET_OPT_RESIZE
 		 * - IPSET_OPT_SIZE
 		 * - IPSET_OPT_FORCEADD
+		 * - IPSET_OPT_HASHFN
+		 * - IPSET_OPT_REGIONBITS
+		 * - IPSET_OPT_NUMA
+		 * - IPSET_OPT_SAMPLE
 		 *
 		 * Ranges and CIDR are safe to be ignored too:
 		 * - IPSET_OPT_IP_FROM
@@ -1807,25 +4457,14 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 
 		printf("}\n");
 
-		xlate_set = calloc(1, sizeof(*xlate_set));
+		xlate_set = ipset_xlate_set_new(ipset, set, family, typename);
 		if (!xlate_set)
 			return -1;
-
-		snprintf(xlate_set->name, sizeof(xlate_set->name), "%s", set);
-		ipset_type = ipset_types();
-		while (ipset_type) {
-			if (!strcmp(ipset_type->name, typename))
-				break;
-			ipset_type = ipset_type->next;
-		}
-
-		xlate_set->family = family;
-		xlate_set->type = ipset_type;
+		xlate_set->ranges = flags & NFT_SET_INTERVAL;
 		if (netmask) {
 			xlate_set->netmask = *netmask;
 			xlate_set->interval = true;
 		}
-		list_add_tail(&xlate_set->list, &ipset->xlate_sets);
 		break;
 	case IPSET_CMD_DESTROY:
 		printf("del set %s %s %s\n",
@@ -1843,6 +4482,11 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 		printf("# %s", ipset->cmdline);
 		return -1;
 	case IPSET_CMD_SWAP:
+	case IPSET_CMD_CLONE:
+	case IPSET_CMD_MONITOR:
+	case IPSET_CMD_FREEZE:
+	case IPSET_CMD_THAW:
+	case IPSET_CMD_PURGE:
 		printf("# %s", ipset->cmdline);
 		return -1;
 	case IPSET_CMD_LIST:
@@ -1867,14 +4511,10 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 		    ipset_data_test(data, IPSET_OPT_SKBPRIO) ||
 		    ipset_data_test(data, IPSET_OPT_SKBQUEUE) ||
 		    ipset_data_test(data, IPSET_OPT_IFACE_WILDCARD)) {
+			ipset_xlate_block_end(ipset);
 			printf("# %s", ipset->cmdline);
 			break;
 		}
-		printf("%s element %s %s %s { ",
-		       cmd == IPSET_CMD_ADD ? "add" :
-				cmd == IPSET_CMD_DEL ? "delete" : "get",
-		       ipset_xlate_family(family), table, set);
-
 		typename = ipset_data_get(data, IPSET_OPT_TYPENAME);
 		type = ipset_xlate_set_type(typename);
 
@@ -1885,31 +4525,38 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 		else
 			netmask = NULL;
 
+		if (ipset->xlate_aggregate && cmd == IPSET_CMD_ADD) {
+			ipset_xlate_block(ipset, family, table, set);
+			if (xlate_set && xlate_set->ranges &&
+			    ipset_xlate_range(ipset, data, netmask))
+				break;
+		}
+		elem[0] = '\0';
 		concat = false;
 		if (ipset_data_test(data, IPSET_OPT_IP)) {
 			ipset_print_data(buf, sizeof(buf), data, IPSET_OPT_IP, 0);
-			printf("%s", buf);
+			ipset_xlate_cat(elem, "%s", buf);
 			if (netmask)
-				printf("/%u ", *netmask);
+				ipset_xlate_cat(elem, "/%u ", *netmask);
 			else
-				printf(" ");
+				ipset_xlate_cat(elem, " ");
 
 			concat = true;
 		}
 		if (ipset_data_test(data, IPSET_OPT_MARK)) {
 			ipset_print_mark(buf, sizeof(buf), data, IPSET_OPT_MARK, 0);
-			printf("%s%s ", concat ? ". " : "", buf);
+			ipset_xlate_cat(elem, "%s%s ", concat ? ". " : "", buf);
 		}
 		if (ipset_data_test(data, IPSET_OPT_IFACE)) {
 			ipset_print_data(buf, sizeof(buf), data, IPSET_OPT_IFACE, 0);
-			printf("%s%s ", concat ? ". " : "", buf);
+			ipset_xlate_cat(elem, "%s%s ", concat ? ". " : "", buf);
 		}
 		if (ipset_data_test(data, IPSET_OPT_ETHER)) {
 			ipset_print_ether(buf, sizeof(buf), data, IPSET_OPT_ETHER, 0);
 			for (i = 0; i < strlen(buf); i++)
 				buf[i] = tolower(buf[i]);
 
-			printf("%s%s ", concat ? ". " : "", buf);
+			ipset_xlate_cat(elem, "%s%s ", concat ? ". " : "", buf);
 			concat = true;
 		}
 		if (ipset_data_test(data, IPSET_OPT_PORT)) {
@@ -1917,18 +4564,18 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 			term = strchr(buf, ':');
 			if (term) {
 				*term = '\0';
-				printf("%s%s ", concat ? ". " : "", buf);
+				ipset_xlate_cat(elem, "%s%s ", concat ? ". " : "", buf);
 			}
 			ipset_print_data(buf, sizeof(buf), data, IPSET_OPT_PORT, 0);
-			printf("%s%s ", concat ? ". " : "", buf);
+			ipset_xlate_cat(elem, "%s%s ", concat ? ". " : "", buf);
 		}
 		if (ipset_data_test(data, IPSET_OPT_IP2)) {
 			ipset_print_ip(buf, sizeof(buf), data, IPSET_OPT_IP2, 0);
-			printf("%s%s", concat ? ". " : "", buf);
+			ipset_xlate_cat(elem, "%s%s", concat ? ". " : "", buf);
 			if (netmask)
-				printf("/%u ", *netmask);
+				ipset_xlate_cat(elem, "/%u ", *netmask);
 			else
-				printf(" ");
+				ipset_xlate_cat(elem, " ");
 		}
 		if (ipset_data_test(data, IPSET_OPT_PACKETS) &&
 		    ipset_data_test(data, IPSET_OPT_BYTES)) {
@@ -1937,18 +4584,28 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 			pkts = ipset_data_get(data, IPSET_OPT_PACKETS);
 			bytes = ipset_data_get(data, IPSET_OPT_BYTES);
 
-			printf("counter packets %" PRIu64 " bytes %" PRIu64 " ",
-			       *pkts, *bytes);
+			ipset_xlate_cat(elem, "counter packets %" PRIu64
+					" bytes %" PRIu64 " ", *pkts, *bytes);
 		}
 		timeout = ipset_data_get(data, IPSET_OPT_TIMEOUT);
 		if (timeout)
-			printf("timeout %us ", *timeout);
+			ipset_xlate_cat(elem, "timeout %us ", *timeout);
 
 		comment = ipset_data_get(data, IPSET_OPT_ADT_COMMENT);
 		if (comment)
-			printf("comment \"%s\" ", comment);
+			ipset_xlate_cat(elem, "comment \"%s\" ", comment);
 
-		printf("}\n");
+		if (ipset->xlate_aggregate && cmd == IPSET_CMD_ADD) {
+			ipset_xlate_range_print(ipset);
+			ipset_xlate_elem_sep(ipset);
+			/* Without the trailing space */
+			printf("%.*s", (int) strlen(elem) - 1, elem);
+			break;
+		}
+		printf("%s element %s %s %s { %s}\n",
+		       cmd == IPSET_CMD_ADD ? "add" :
+				cmd == IPSET_CMD_DEL ? "delete" : "get",
+		       ipset_xlate_family(family), table, set, elem);
 		break;
 	case IPSET_CMD_GET_BYNAME:
 		printf("# %s", ipset->cmdline);
@@ -1963,6 +4620,144 @@ static int ipset_xlate(struct ipset *ipset, enum ipset_cmd cmd,
 	return 0;
 }
 
+/* The filters of an IPv4 set get 33 priorities, from the /32 to the
+ * /0 networks, and the network address is the handle of the filter,
+ * so the filters can be deleted without knowing more. */
+#define IPSET_FLOWER_PRIOS	33
+
+static void
+ipset_xlate_flower_filter(struct ipset *ipset, enum ipset_cmd cmd,
+			  struct ipset_xlate_set *set,
+			  uint32_t ip, uint8_t cidr)
+{
+	uint32_t handle = cidr ? ip & (0xFFFFFFFFU << (32 - cidr)) : 0;
+	char addr[INET_ADDRSTRLEN];
+	struct in_addr in = { .s_addr = htonl(handle) };
+
+	inet_ntop(AF_INET, &in, addr, sizeof(addr));
+	/* The other networks are multiples of two, but 0.0.0.0/32 has
+	 * got no valid handle */
+	if (handle == 0 && cidr != 32)
+		handle = 1;
+	else if (handle == 0) {
+		printf("# %s", ipset->cmdline);
+		return;
+	}
+
+	set->cidrs |= 1ULL << cidr;
+	printf("filter %s %s protocol ip prio %u handle 0x%x flower",
+	       cmd == IPSET_CMD_ADD ? "add" : "del", ipset->xlate_flower,
+	       set->prio + 32 - cidr, handle);
+	if (cmd == IPSET_CMD_ADD)
+		printf(" skip_sw %s %s/%u action drop",
+		       ipset->xlate_flower_dst ? "dst_ip" : "src_ip",
+		       addr, cidr);
+	printf("\n");
+}
+
+/* Translate to tc flower filters: the hardware offload of the IPv4
+ * hash:ip and hash:net sets, with the set match in software after
+ * the filters, for the elements which could not be offloaded. */
+static int ipset_xlate_flower(struct ipset *ipset, enum ipset_cmd cmd)
+{
+	struct ipset_session *session = ipset_session(ipset);
+	struct ipset_data *data = ipset_session_data(session);
+	struct ipset_xlate_set *xlate_set, *next;
+	const union nf_inet_addr *ip, *ip_to;
+	const uint32_t *cadt_flags;
+	const char *set, *typename;
+	uint64_t from, end;
+	uint8_t cidr;
+	unsigned int i;
+
+	set = ipset_data_get(data, IPSET_SETNAME);
+
+	switch (cmd) {
+	case IPSET_CMD_CREATE:
+		typename = ipset_data_get(data, IPSET_OPT_TYPENAME);
+		xlate_set = ipset_xlate_set_new(ipset, set,
+						ipset_data_family(data),
+						typename);
+		if (!xlate_set)
+			return -1;
+		printf("# %s", ipset->cmdline);
+		if (xlate_set->family != NFPROTO_IPV4 ||
+		    !(STREQ(typename, "hash:ip") ||
+		      STREQ(typename, "hash:net")) ||
+		    ipset->xlate_prio > 65535 - IPSET_FLOWER_PRIOS)
+			break;
+		xlate_set->prio = ipset->xlate_prio ? ipset->xlate_prio : 1;
+		ipset->xlate_prio = xlate_set->prio + IPSET_FLOWER_PRIOS;
+		if (ipset_data_test(data, IPSET_OPT_NETMASK)) {
+			xlate_set->netmask = *(const uint8_t *)
+				ipset_data_get(data, IPSET_OPT_NETMASK);
+			xlate_set->interval = true;
+		}
+		break;
+	case IPSET_CMD_DESTROY:
+	case IPSET_CMD_FLUSH:
+		printf("# %s", ipset->cmdline);
+		list_for_each_entry_safe(xlate_set, next, &ipset->xlate_sets,
+					 list) {
+			if (set && !STREQ(xlate_set->name, set))
+				continue;
+			for (i = 0; i < IPSET_FLOWER_PRIOS; i++) {
+				if (!(xlate_set->cidrs & (1ULL << (32 - i))))
+					continue;
+				printf("filter del %s prio %u\n",
+				       ipset->xlate_flower,
+				       xlate_set->prio + i);
+			}
+			xlate_set->cidrs = 0;
+			if (cmd == IPSET_CMD_DESTROY) {
+				list_del(&xlate_set->list);
+				free(xlate_set);
+			}
+		}
+		break;
+	case IPSET_CMD_ADD:
+	case IPSET_CMD_DEL:
+		xlate_set = ipset_xlate_set_get(ipset, set);
+		cadt_flags = ipset_data_get(data, IPSET_OPT_CADT_FLAGS);
+		if (!xlate_set || !xlate_set->prio ||
+		    (cadt_flags && *cadt_flags & IPSET_FLAG_NOMATCH)) {
+			printf("# %s", ipset->cmdline);
+			break;
+		}
+		ip = ipset_data_get(data, IPSET_OPT_IP);
+		ip_to = ipset_data_get(data, IPSET_OPT_IP_TO);
+		cidr = ipset_data_test(data, IPSET_OPT_CIDR) ?
+		       *(const uint8_t *) ipset_data_get(data, IPSET_OPT_CIDR)
+		       : 32;
+		if (xlate_set->interval && xlate_set->netmask < cidr)
+			cidr = xlate_set->netmask;
+		if (!ip_to) {
+			ipset_xlate_flower_filter(ipset, cmd, xlate_set,
+						  ntohl(ip->ip), cidr);
+			break;
+		}
+		/* Split the range into the largest networks */
+		from = ntohl(ip->ip);
+		end = (uint64_t) ntohl(ip_to->ip) + 1;
+		while (from < end) {
+			cidr = 32;
+			while (cidr > 0 &&
+			       !(from & ((1ULL << (33 - cidr)) - 1)) &&
+			       from + (1ULL << (33 - cidr)) <= end)
+				cidr--;
+			ipset_xlate_flower_filter(ipset, cmd, xlate_set,
+						  from, cidr);
+			from += 1ULL << (32 - cidr);
+		}
+		break;
+	default:
+		printf("# %s", ipset->cmdline);
+		break;
+	}
+
+	return 0;
+}
+
 static int ipset_xlate_restore(struct ipset *ipset)
 {
 	struct ipset_session *session = ipset_session(ipset);
@@ -1983,7 +4778,8 @@ static int ipset_xlate_restore(struct ipset *ipset)
 	}
 
 	/* TODO: Allow to specify the table name other than 'global'. */
-	printf("add table inet global\n");
+	if (!ipset->xlate_flower)
+		printf("add table inet global\n");
 
 	while (fgets(ipset->cmdline, sizeof(ipset->cmdline), f)) {
 		ipset->restore_line++;
@@ -1995,6 +4791,10 @@ static int ipset_xlate_restore(struct ipset *ipset)
 		else if (STREQ(c, "COMMIT\n") || STREQ(c, "COMMIT\r\n"))
 			continue;
 
+		/* The elements removed at timeout, in monitor output */
+		if (ipset->xlate_flower && STRNEQ(c, "expire ", 7))
+			memcpy(c, "del    ", 7);
+
 		ret = build_argv(ipset, c);
 		if (ret < 0)
 			return ret;
@@ -2003,6 +4803,13 @@ static int ipset_xlate_restore(struct ipset *ipset)
 		if (cmd < 0)
 			ipset->standard_error(ipset, p);
 
+		if (ipset->xlate_flower) {
+			ret = ipset_xlate_flower(ipset, cmd);
+			if (ret < 0)
+				break;
+			ipset_data_reset(data);
+			continue;
+		}
 		/* TODO: Allow to specify the table name other than 'global'. */
 		ret = ipset_xlate(ipset, cmd, "global");
 		if (ret < 0)
@@ -2010,6 +4817,7 @@ static int ipset_xlate_restore(struct ipset *ipset)
 
 		ipset_data_reset(data);
 	}
+	ipset_xlate_block_end(ipset);
 
 	if (filename)
 		fclose(f);
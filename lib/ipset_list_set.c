@@ -286,6 +286,234 @@ static struct ipset_type ipset_list_set3 = {
 	.description = "skbinfo support",
 };
 
+/* percpu counters support */
+static struct ipset_type ipset_list_set4 = {
+	.name = "list:set",
+	.alias = { "setlist", NULL },
+	.revision = 4,
+	.family = NFPROTO_UNSPEC,
+	.dimension = IPSET_DIM_ONE,
+	.elem = {
+		[IPSET_DIM_ONE - 1] = {
+			.parse = ipset_parse_setname,
+			.print = ipset_print_name,
+			.opt = IPSET_OPT_NAME
+		},
+	},
+	.compat_parse_elem = ipset_parse_name_compat,
+	.cmd = {
+		[IPSET_CREATE] = {
+			.args = {
+				IPSET_ARG_SIZE,
+				IPSET_ARG_TIMEOUT,
+				IPSET_ARG_COUNTERS,
+				IPSET_ARG_PERCPU,
+				IPSET_ARG_COMMENT,
+				IPSET_ARG_SKBINFO,
+				IPSET_ARG_NONE,
+			},
+			.need = 0,
+			.full = 0,
+			.help = "",
+		},
+		[IPSET_ADD] = {
+			.args = {
+				IPSET_ARG_TIMEOUT,
+				IPSET_ARG_BEFORE,
+				IPSET_ARG_AFTER,
+				IPSET_ARG_PACKETS,
+				IPSET_ARG_BYTES,
+				IPSET_ARG_ADT_COMMENT,
+				IPSET_ARG_SKBMARK,
+				IPSET_ARG_SKBPRIO,
+				IPSET_ARG_SKBQUEUE,
+				IPSET_ARG_NONE,
+			},
+			.need = IPSET_FLAG(IPSET_OPT_NAME),
+			.full = IPSET_FLAG(IPSET_OPT_NAME)
+				| IPSET_FLAG(IPSET_OPT_BEFORE),
+			.help = "NAME [before|after NAME]",
+		},
+		[IPSET_DEL] = {
+			.args = {
+				IPSET_ARG_BEFORE,
+				IPSET_ARG_AFTER,
+				IPSET_ARG_NONE,
+			},
+			.need = IPSET_FLAG(IPSET_OPT_NAME),
+			.full = IPSET_FLAG(IPSET_OPT_NAME)
+				| IPSET_FLAG(IPSET_OPT_BEFORE),
+			.help = "NAME [before|after NAME]",
+		},
+		[IPSET_TEST] = {
+			.args = {
+				IPSET_ARG_BEFORE,
+				IPSET_ARG_AFTER,
+				IPSET_ARG_NONE,
+			},
+			.need = IPSET_FLAG(IPSET_OPT_NAME),
+			.full = IPSET_FLAG(IPSET_OPT_NAME)
+				| IPSET_FLAG(IPSET_OPT_BEFORE),
+			.help = "NAME [before|after NAME]",
+		},
+	},
+	.usage = "where NAME are existing set names.",
+	.description = "percpu counters support",
+};
+
+/* merged index support */
+static struct ipset_type ipset_list_set5 = {
+	.name = "list:set",
+	.alias = { "setlist", NULL },
+	.revision = 5,
+	.family = NFPROTO_UNSPEC,
+	.dimension = IPSET_DIM_ONE,
+	.elem = {
+		[IPSET_DIM_ONE - 1] = {
+			.parse = ipset_parse_setname,
+			.print = ipset_print_name,
+			.opt = IPSET_OPT_NAME
+		},
+	},
+	.compat_parse_elem = ipset_parse_name_compat,
+	.cmd = {
+		[IPSET_CREATE] = {
+			.args = {
+				IPSET_ARG_SIZE,
+				IPSET_ARG_TIMEOUT,
+				IPSET_ARG_COUNTERS,
+				IPSET_ARG_PERCPU,
+				IPSET_ARG_COMMENT,
+				IPSET_ARG_SKBINFO,
+				IPSET_ARG_INDEX,
+				IPSET_ARG_NONE,
+			},
+			.need = 0,
+			.full = 0,
+			.help = "",
+		},
+		[IPSET_ADD] = {
+			.args = {
+				IPSET_ARG_TIMEOUT,
+				IPSET_ARG_BEFORE,
+				IPSET_ARG_AFTER,
+				IPSET_ARG_PACKETS,
+				IPSET_ARG_BYTES,
+				IPSET_ARG_ADT_COMMENT,
+				IPSET_ARG_SKBMARK,
+				IPSET_ARG_SKBPRIO,
+				IPSET_ARG_SKBQUEUE,
+				IPSET_ARG_NONE,
+			},
+			.need = IPSET_FLAG(IPSET_OPT_NAME),
+			.full = IPSET_FLAG(IPSET_OPT_NAME)
+				| IPSET_FLAG(IPSET_OPT_BEFORE),
+			.help = "NAME [before|after NAME]",
+		},
+		[IPSET_DEL] = {
+			.args = {
+				IPSET_ARG_BEFORE,
+				IPSET_ARG_AFTER,
+				IPSET_ARG_NONE,
+			},
+			.need = IPSET_FLAG(IPSET_OPT_NAME),
+			.full = IPSET_FLAG(IPSET_OPT_NAME)
+				| IPSET_FLAG(IPSET_OPT_BEFORE),
+			.help = "NAME [before|after NAME]",
+		},
+		[IPSET_TEST] = {
+			.args = {
+				IPSET_ARG_BEFORE,
+				IPSET_ARG_AFTER,
+				IPSET_ARG_NONE,
+			},
+			.need = IPSET_FLAG(IPSET_OPT_NAME),
+			.full = IPSET_FLAG(IPSET_OPT_NAME)
+				| IPSET_FLAG(IPSET_OPT_BEFORE),
+			.help = "NAME [before|after NAME]",
+		},
+	},
+	.usage = "where NAME are existing set names.",
+	.description = "merged index support",
+};
+
+/* counter sampling support */
+static struct ipset_type ipset_list_set6 = {
+	.name = "list:set",
+	.alias = { "setlist", NULL },
+	.revision = 6,
+	.family = NFPROTO_UNSPEC,
+	.dimension = IPSET_DIM_ONE,
+	.elem = {
+		[IPSET_DIM_ONE - 1] = {
+			.parse = ipset_parse_setname,
+			.print = ipset_print_name,
+			.opt = IPSET_OPT_NAME
+		},
+	},
+	.compat_parse_elem = ipset_parse_name_compat,
+	.cmd = {
+		[IPSET_CREATE] = {
+			.args = {
+				IPSET_ARG_SIZE,
+				IPSET_ARG_TIMEOUT,
+				IPSET_ARG_COUNTERS,
+				IPSET_ARG_PERCPU,
+				IPSET_ARG_SAMPLE,
+				IPSET_ARG_COMMENT,
+				IPSET_ARG_SKBINFO,
+				IPSET_ARG_INDEX,
+				IPSET_ARG_NONE,
+			},
+			.need = 0,
+			.full = 0,
+			.help = "",
+		},
+		[IPSET_ADD] = {
+			.args = {
+				IPSET_ARG_TIMEOUT,
+				IPSET_ARG_BEFORE,
+				IPSET_ARG_AFTER,
+				IPSET_ARG_PACKETS,
+				IPSET_ARG_BYTES,
+				IPSET_ARG_ADT_COMMENT,
+				IPSET_ARG_SKBMARK,
+				IPSET_ARG_SKBPRIO,
+				IPSET_ARG_SKBQUEUE,
+				IPSET_ARG_NONE,
+			},
+			.need = IPSET_FLAG(IPSET_OPT_NAME),
+			.full = IPSET_FLAG(IPSET_OPT_NAME)
+				| IPSET_FLAG(IPSET_OPT_BEFORE),
+			.help = "NAME [before|after NAME]",
+		},
+		[IPSET_DEL] = {
+			.args = {
+				IPSET_ARG_BEFORE,
+				IPSET_ARG_AFTER,
+				IPSET_ARG_NONE,
+			},
+			.need = IPSET_FLAG(IPSET_OPT_NAME),
+			.full = IPSET_FLAG(IPSET_OPT_NAME)
+				| IPSET_FLAG(IPSET_OPT_BEFORE),
+			.help = "NAME [before|after NAME]",
+		},
+		[IPSET_TEST] = {
+			.args = {
+				IPSET_ARG_BEFORE,
+				IPSET_ARG_AFTER,
+				IPSET_ARG_NONE,
+			},
+			.need = IPSET_FLAG(IPSET_OPT_NAME),
+			.full = IPSET_FLAG(IPSET_OPT_NAME)
+				| IPSET_FLAG(IPSET_OPT_BEFORE),
+			.help = "NAME [before|after NAME]",
+		},
+	},
+	.usage = "where NAME are existing set names.",
+	.description = "counter sampling support",
+};
+
 void _init(void);
 void _init(void)
 {
@@ -293,4 +521,7 @@ void _init(void)
 	ipset_type_add(&ipset_list_set1);
 	ipset_type_add(&ipset_list_set2);
 	ipset_type_add(&ipset_list_set3);
+	ipset_type_add(&ipset_list_set4);
+	ipset_type_add(&ipset_list_set5);
+	ipset_type_add(&ipset_list_set6);
 }
@@ -9,6 +9,7 @@
 #include <stdlib.h>				/* calloc, free */
 #include <time.h>				/* time */
 #include <arpa/inet.h>				/* hto* */
+#include <sys/socket.h>				/* setsockopt */
 
 #include <libipset/linux_ip_set.h>		/* enum ipset_cmd */
 #include <libipset/debug.h>			/* D() */
@@ -17,6 +18,9 @@
 #include <libipset/utils.h>			/* UNUSED */
 #include <libipset/mnl.h>			/* prototypes */
 
+/* Socket buffer size: room for full restore batches and their replies */
+#define IPSET_SOCKBUFSIZE	(16 * IPSET_BUFSIZE_MAX)
+
 #ifndef NFNL_SUBSYS_IPSET
 #define NFNL_SUBSYS_IPSET	6
 #endif
@@ -46,6 +50,11 @@ static const uint16_t cmdflags[] = {
 	[IPSET_CMD_HEADER-1]	= NLM_F_REQUEST,
 	[IPSET_CMD_TYPE-1]	= NLM_F_REQUEST,
 	[IPSET_CMD_PROTOCOL-1]	= NLM_F_REQUEST,
+	[IPSET_CMD_CLONE-1]	= NLM_F_REQUEST|NLM_F_ACK,
+	[IPSET_CMD_MONITOR-1]	= NLM_F_REQUEST|NLM_F_ACK,
+	[IPSET_CMD_FREEZE-1]	= NLM_F_REQUEST|NLM_F_ACK,
+	[IPSET_CMD_THAW-1]	= NLM_F_REQUEST|NLM_F_ACK,
+	[IPSET_CMD_PURGE-1]	= NLM_F_REQUEST|NLM_F_ACK,
 };
 
 /**
@@ -118,6 +127,58 @@ ipset_mnl_query(struct ipset_handle *handle, void *buffer, size_t len)
 	return ret;
 }
 
+/* Send a message without waiting for the reply */
+static int
+ipset_mnl_send(struct ipset_handle *handle, void *buffer, size_t len UNUSED)
+{
+	struct nlmsghdr *nlh = buffer;
+
+	assert(handle);
+	assert(buffer);
+
+	nlh->nlmsg_seq = ++handle->seq;
+#ifdef IPSET_DEBUG
+	ipset_debug_msg("sent", nlh, nlh->nlmsg_len);
+#endif
+	if (mnl_socket_sendto(handle->h, nlh, nlh->nlmsg_len) < 0)
+		return -ECOMM;
+	return 0;
+}
+
+/* Receive and process the reply of a message sent earlier */
+static int
+ipset_mnl_recv(struct ipset_handle *handle, void *buffer, size_t len)
+{
+	int ret;
+
+	assert(handle);
+	assert(buffer);
+
+	ret = mnl_socket_recvfrom(handle->h, buffer, len);
+#ifdef IPSET_DEBUG
+	ipset_debug_msg("received", buffer, ret);
+#endif
+	if (ret <= 0)
+		return ret < 0 ? ret : -ECOMM;
+	/* Replies arrive in the order of the messages sent after the
+	 * last query, so the sequence number is not checked */
+	return mnl_cb_run2(buffer, ret, 0, handle->portid,
+			   handle->cb_ctl[NLMSG_MIN_TYPE], handle->data,
+			   handle->cb_ctl, NLMSG_MIN_TYPE);
+}
+
+/* Raise the socket buffer sizes, over the system limits when
+ * we are permitted to. Failure is not fatal. */
+static void
+ipset_mnl_sockbuf(struct mnl_socket *h, int force, int opt)
+{
+	int fd = mnl_socket_get_fd(h);
+	int size = IPSET_SOCKBUFSIZE;
+
+	if (setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)) < 0)
+		setsockopt(fd, SOL_SOCKET, opt, &size, sizeof(size));
+}
+
 static struct ipset_handle *
 ipset_mnl_init(mnl_cb_t *cb_ctl, void *data)
 {
@@ -137,6 +198,9 @@ ipset_mnl_init(mnl_cb_t *cb_ctl, void *data)
 	if (mnl_socket_bind(handle->h, 0, MNL_SOCKET_AUTOPID) < 0)
 		goto close_nl;
 
+	ipset_mnl_sockbuf(handle->h, SO_SNDBUFFORCE, SO_SNDBUF);
+	ipset_mnl_sockbuf(handle->h, SO_RCVBUFFORCE, SO_RCVBUF);
+
 	handle->portid = mnl_socket_get_portid(handle->h);
 	handle->cb_ctl = cb_ctl;
 	handle->data = data;
@@ -169,4 +233,6 @@ const struct ipset_transport ipset_mnl_transport = {
 	.fini	= ipset_mnl_fini,
 	.fill_hdr = ipset_mnl_fill_hdr,
 	.query	= ipset_mnl_query,
+	.send	= ipset_mnl_send,
+	.recv	= ipset_mnl_recv,
 };
@@ -7,21 +7,25 @@
 #include <assert.h>				/* assert */
 #include <errno.h>				/* errno */
 #include <limits.h>				/* ULLONG_MAX */
-#include <netdb.h>				/* getservbyname, getaddrinfo */
+#include <netdb.h>				/* getaddrinfo */
+#include <pthread.h>				/* pthread_mutex_* */
 #include <stdlib.h>				/* strtoull, etc. */
 #include <sys/types.h>				/* getaddrinfo */
 #include <sys/socket.h>				/* getaddrinfo, AF_ */
 #include <net/ethernet.h>			/* ETH_ALEN */
 #include <net/if.h>				/* IFNAMSIZ */
 #include <netinet/in.h>				/* IPPROTO_ */
+#include <arpa/inet.h>				/* inet_pton */
 
 #include <libipset/debug.h>			/* D() */
 #include <libipset/data.h>			/* IPSET_OPT_* */
 #include <libipset/icmp.h>			/* name_to_icmp */
 #include <libipset/icmpv6.h>			/* name_to_icmpv6 */
 #include <libipset/pfxlen.h>			/* prefixlen_netmask_map */
+#include <libipset/services.h>			/* ipset_service_port */
 #include <libipset/session.h>			/* ipset_err */
 #include <libipset/types.h>			/* ipset_type_get */
+#include <libipset/linux_ip_set_hash.h>		/* IPSET_HASHFN_* */
 #include <libipset/utils.h>			/* string utilities */
 #include <libipset/parse.h>			/* prototypes */
 #include "../config.h"
@@ -280,9 +284,8 @@ static int
 parse_portname(struct ipset_session *session, const char *str,
 	       uint16_t *port, const char *proto)
 {
-	char *saved, *tmp, *protoname;
-	const struct protoent *protoent;
-	struct servent *service;
+	const char *protoname = proto;
+	char *saved, *tmp;
 	uint8_t protonum = 0;
 
 	saved = tmp = ipset_strdup(session, str);
@@ -292,17 +295,13 @@ parse_portname(struct ipset_session *session, const char *str,
 	if (tmp == NULL)
 		goto error;
 
-	protoname = (char *)proto;
 	if (string_to_u8(session, proto, &protonum, IPSET_WARNING) == 0) {
-		protoent = getprotobynumber(protonum);
-		if (protoent == NULL)
+		protoname = ipset_proto_name(protonum);
+		if (protoname == NULL)
 			goto error;
-		protoname = protoent->p_name;
 	}
 
-	service = getservbyname(tmp, protoname);
-	if (service != NULL) {
-		*port = ntohs((uint16_t) service->s_port);
+	if (ipset_service_port(tmp, protoname, port) == 0) {
 		free(saved);
 		return 0;
 	}
@@ -484,7 +483,6 @@ int
 ipset_parse_proto(struct ipset_session *session,
 		  enum ipset_opt opt, const char *str)
 {
-	const struct protoent *protoent;
 	uint8_t proto = 0;
 	uint8_t protonum = 0;
 
@@ -493,22 +491,23 @@ ipset_parse_proto(struct ipset_session *session,
 	assert(str);
 
 	if (string_to_u8(session, str, &protonum, IPSET_WARNING) == 0) {
-		/* Optimise by not calling getprotobynumber() for known protocols */
+		/* Optimise by not looking up known protocols */
 		if ((protonum == IPPROTO_TCP) ||
 		    (protonum == IPPROTO_UDP) ||
 		    (protonum == IPPROTO_ICMP))
 			return ipset_session_data_set(session, opt, &protonum);
-		protoent = getprotobynumber(protonum);
+		if (ipset_proto_name(protonum) == NULL)
+			return syntax_err("cannot parse '%s' "
+					  "as a protocol", str);
+		proto = protonum;
 	} else {
 		/* No error, so reset false error messages */
 		ipset_session_report_reset(session);
-		protoent = getprotobyname(strcasecmp(str, "icmpv6") == 0
-					  ? "ipv6-icmp" : str);
+		if (ipset_proto_number(strcasecmp(str, "icmpv6") == 0
+				       ? "ipv6-icmp" : str, &proto) < 0)
+			return syntax_err("cannot parse '%s' "
+					  "as a protocol", str);
 	}
-	if (protoent == NULL)
-		return syntax_err("cannot parse '%s' "
-				  "as a protocol", str);
-	proto = protoent->p_proto;
 	if (!proto)
 		return syntax_err("Unsupported protocol '%s'", str);
 
@@ -765,6 +764,8 @@ ipset_parse_family(struct ipset_session *session,
 		family = NFPROTO_IPV4;
 	else if (STREQ(str, "inet6") || STREQ(str, "ipv6") || STREQ(str, "-6"))
 		family = NFPROTO_IPV6;
+	else if (STREQ(str, "inet46"))
+		family = NFPROTO_INET;
 	else if (STREQ(str, "any") || STREQ(str, "unspec"))
 		family = NFPROTO_UNSPEC;
 	else
@@ -773,6 +774,179 @@ ipset_parse_family(struct ipset_session *session,
 	return ipset_data_set(data, opt, &family);
 }
 
+/**
+ * ipset_parse_hashfn - parse hash function name
+ * @session: session structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse string as a hash function name of the hash types.
+ * The value is stored in the data blob of the session.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_hashfn(struct ipset_session *session,
+		   enum ipset_opt opt, const char *str)
+{
+	struct ipset_data *data;
+	uint8_t hashfn;
+
+	assert(session);
+	assert(opt == IPSET_OPT_HASHFN);
+	assert(str);
+
+	data = ipset_session_data(session);
+	if (STREQ(str, "jhash"))
+		hashfn = IPSET_HASHFN_JHASH;
+	else if (STREQ(str, "hsiphash"))
+		hashfn = IPSET_HASHFN_HSIPHASH;
+	else if (STREQ(str, "mulshift"))
+		hashfn = IPSET_HASHFN_MULSHIFT;
+	else
+		return syntax_err("unknown hash function %s", str);
+
+	return ipset_data_set(data, opt, &hashfn);
+}
+
+/**
+ * ipset_parse_numa - parse NUMA placement
+ * @session: session structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse string as "interleave" or as a NUMA node number.
+ * The value is stored in the data blob of the session.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_numa(struct ipset_session *session,
+		 enum ipset_opt opt, const char *str)
+{
+	uint32_t node;
+	int err;
+
+	assert(session);
+	assert(opt == IPSET_OPT_NUMA);
+	assert(str);
+
+	if (STREQ(str, "interleave"))
+		node = IPSET_NUMA_INTERLEAVE;
+	else if ((err = string_to_u32(session, str, &node)) != 0)
+		return err;
+	else if (node == IPSET_NUMA_INTERLEAVE)
+		return syntax_err("invalid NUMA node %s", str);
+
+	return ipset_session_data_set(session, opt, &node);
+}
+
+/**
+ * ipset_parse_ctevents - parse the conntrack events populating a set
+ * @session: session structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse string as a comma separated list of the "new", "assured"
+ * and "destroy" conntrack events. The value is stored in the data
+ * blob of the session.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_ctevents(struct ipset_session *session,
+		     enum ipset_opt opt, const char *str)
+{
+	uint32_t events = 0;
+	char *saved, *tmp, *ev;
+	int err = 0;
+
+	assert(session);
+	assert(opt == IPSET_OPT_CTEVENTS);
+	assert(str);
+
+	saved = tmp = ipset_strdup(session, str);
+	if (tmp == NULL)
+		return -1;
+
+	while ((ev = strsep(&tmp, IPSET_ELEM_SEPARATOR)) != NULL) {
+		if (STREQ(ev, "new"))
+			events |= IPSET_CTEVENT_NEW;
+		else if (STREQ(ev, "assured"))
+			events |= IPSET_CTEVENT_ASSURED;
+		else if (STREQ(ev, "destroy"))
+			events |= IPSET_CTEVENT_DESTROY;
+		else {
+			err = syntax_err("unknown conntrack event %s", ev);
+			goto out;
+		}
+	}
+	if (!(events & (IPSET_CTEVENT_NEW | IPSET_CTEVENT_ASSURED)))
+		err = syntax_err("the flows must be added at the new "
+				 "or at the assured event");
+	else
+		err = ipset_session_data_set(session, opt, &events);
+out:
+	free(saved);
+	return err;
+}
+
+/**
+ * ipset_parse_ctdir - parse the conntrack tuple of the elements
+ * @session: session structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Parse string as "[original:|reply:]src|dst[,src|dst[,src|dst]]",
+ * the direction of the tuple and the source or destination address or
+ * port in every dimension of the elements. The value is stored in the
+ * data blob of the session.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_ctdir(struct ipset_session *session,
+		  enum ipset_opt opt, const char *str)
+{
+	uint32_t ctdir = 0;
+	char *saved, *tmp, *dir;
+	int i = 0, err = 0;
+
+	assert(session);
+	assert(opt == IPSET_OPT_CTDIR);
+	assert(str);
+
+	saved = tmp = ipset_strdup(session, str);
+	if (tmp == NULL)
+		return -1;
+
+	if (STRNEQ(tmp, "reply:", 6)) {
+		ctdir |= IPSET_CTDIR_REPLY;
+		tmp += 6;
+	} else if (STRNEQ(tmp, "original:", 9))
+		tmp += 9;
+
+	while ((dir = strsep(&tmp, IPSET_ELEM_SEPARATOR)) != NULL) {
+		if (i == IPSET_DIM_THREE) {
+			err = syntax_err("more than %u dimensions in %s",
+					 IPSET_DIM_THREE, str);
+			goto out;
+		}
+		if (STREQ(dir, "src"))
+			ctdir |= 1 << (IPSET_DIM_ONE + i);
+		else if (!STREQ(dir, "dst")) {
+			err = syntax_err("cannot parse %s as source "
+					 "or destination", dir);
+			goto out;
+		}
+		i++;
+	}
+	err = ipset_session_data_set(session, opt, &ctdir);
+out:
+	free(saved);
+	return err;
+}
+
 /*
  * Parse IPv4/IPv6 addresses, networks and ranges.
  * We resolve hostnames but just the first IP address is used.
@@ -787,30 +961,151 @@ print_warn(struct ipset_session *session)
 	ipset_session_report_reset(session);
 }
 
+/* Resolved hostnames of the thread, released at the end of the session */
+#define IPSET_RESOLVED_HSIZE	256
+
+struct ipset_resolved {
+	struct ipset_resolved *next;
+	union nf_inet_addr addr;		/* First address */
+	uint8_t family;				/* Address family */
+	bool multiple;				/* Multiple addresses */
+	char name[0];				/* Hostname */
+};
+
+static __thread struct ipset_resolved **resolved;
+
+static unsigned int
+resolved_hash(const char *str, uint8_t family)
+{
+	unsigned int h = family;
+
+	while (*str)
+		h = h * 31 + (unsigned char)*str++;
+	return h % IPSET_RESOLVED_HSIZE;
+}
+
+static void
+resolved_add(const char *str, uint8_t family, const void *addr,
+	     bool multiple)
+{
+	unsigned int h = resolved_hash(str, family);
+	struct ipset_resolved *r;
+
+	/* Failing to cache the name is not an error */
+	if (resolved == NULL) {
+		resolved = calloc(IPSET_RESOLVED_HSIZE, sizeof(*resolved));
+		if (resolved == NULL)
+			return;
+	}
+	r = calloc(1, sizeof(*r) + strlen(str) + 1);
+	if (r == NULL)
+		return;
+	memcpy(&r->addr, addr, family == NFPROTO_IPV4
+				? sizeof(r->addr.in) : sizeof(r->addr.in6));
+	r->family = family;
+	r->multiple = multiple;
+	strcpy(r->name, str);
+	r->next = resolved[h];
+	resolved[h] = r;
+}
+
+static void
+warn_multiple(struct ipset_session *session, const char *str)
+{
+	ipset_warn(session,
+		   "%s resolves to multiple addresses: "
+		   "using only the first one returned "
+		   "by the resolver.",
+		   str);
+	print_warn(session);
+}
+
+/* Try the string as a numeric address, then as an already resolved
+ * hostname. Returns 1 if the resolver must be called. */
+static int
+get_known_addr(struct ipset_session *session, enum ipset_opt opt,
+	       const char *str, uint8_t family)
+{
+	union nf_inet_addr addr;
+	struct ipset_resolved *r;
+
+	if (inet_pton(family == NFPROTO_IPV4 ? AF_INET : AF_INET6,
+		      str, &addr) == 1)
+		return ipset_session_data_set(session, opt, &addr);
+
+	if (resolved == NULL)
+		return 1;
+	for (r = resolved[resolved_hash(str, family)]; r; r = r->next) {
+		if (r->family != family || !STREQ(r->name, str))
+			continue;
+		if (r->multiple)
+			warn_multiple(session, str);
+		return ipset_session_data_set(session, opt, &r->addr);
+	}
+	return 1;
+}
+
+/**
+ * ipset_resolved_fini - release the resolved hostnames
+ *
+ * Release the cache of the resolved hostnames of the calling thread.
+ */
+void
+ipset_resolved_fini(void)
+{
+	struct ipset_resolved *r;
+	int i;
+
+	if (resolved == NULL)
+		return;
+	for (i = 0; i < IPSET_RESOLVED_HSIZE; i++) {
+		while (resolved[i]) {
+			r = resolved[i];
+			resolved[i] = r->next;
+			free(r);
+		}
+	}
+	free(resolved);
+	resolved = NULL;
+}
+
 #ifdef HAVE_GETHOSTBYNAME2
+/* The result of gethostbyname2() is in static storage */
+static pthread_mutex_t hostbyname_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int
 get_hostbyname2(struct ipset_session *session,
 		enum ipset_opt opt,
 		const char *str,
 		int af)
 {
-	struct hostent *h = gethostbyname2(str, af);
+	uint8_t family = af == AF_INET ? NFPROTO_IPV4 : NFPROTO_IPV6;
+	union nf_inet_addr addr;
+	struct hostent *h;
+	bool multiple;
+	int err;
+
+	if ((err = get_known_addr(session, opt, str, family)) <= 0)
+		return err;
 
+	pthread_mutex_lock(&hostbyname_lock);
+	h = gethostbyname2(str, af);
+	if (h != NULL) {
+		memcpy(&addr, h->h_addr_list[0], family == NFPROTO_IPV4
+			? sizeof(addr.in) : sizeof(addr.in6));
+		multiple = h->h_addr_list[1] != NULL;
+	}
+	pthread_mutex_unlock(&hostbyname_lock);
 	if (h == NULL) {
 		syntax_err("cannot parse %s: resolving to %s address failed",
 			   str, af == AF_INET ? "IPv4" : "IPv6");
 		return -1;
 	}
-	if (h->h_addr_list[1] != NULL) {
-		ipset_warn(session,
-			   "%s resolves to multiple addresses: "
-			   "using only the first one returned "
-			   "by the resolver.",
-			   str);
-		print_warn(session);
-	}
+	if (multiple)
+		warn_multiple(session, str);
+	resolved_add(str, family, &addr, multiple);
 
-	return ipset_session_data_set(session, opt, h->h_addr_list[0]);
+	return ipset_session_data_set(session, opt, &addr);
 }
 
 static int
@@ -911,6 +1206,10 @@ get_addrinfo(struct ipset_session *session,
 					   : sizeof(struct sockaddr_in6);
 	int found, err = 0;
 
+	*info = NULL;
+	if ((err = get_known_addr(session, opt, str, family)) <= 0)
+		return err;
+
 	if ((*info = call_getaddrinfo(session, str, family)) == NULL) {
 		syntax_err("cannot parse %s: resolving to %s address failed",
 			   str, family == NFPROTO_IPV4 ? "IPv4" : "IPv6");
@@ -939,12 +1238,7 @@ get_addrinfo(struct ipset_session *session,
 					opt, &saddr->sin6_addr);
 			}
 		} else if (found == 1) {
-			ipset_warn(session,
-				   "%s resolves to multiple addresses: "
-				   "using only the first one returned "
-				   "by the resolver.",
-				   str);
-			print_warn(session);
+			warn_multiple(session, str);
 		}
 		found++;
 	}
@@ -953,6 +1247,9 @@ get_addrinfo(struct ipset_session *session,
 				  "%s address could not be resolved",
 				  str,
 				  family == NFPROTO_IPV4 ? "IPv4" : "IPv6");
+	if (err == 0)
+		resolved_add(str, family, ipset_session_data_get(session, opt),
+			     found > 1);
 	return err;
 }
 
@@ -1006,7 +1303,9 @@ parse_ipaddr(struct ipset_session *session,
 	if ((aerr = get_addrinfo(session, opt, tmp, &info, family)) != 0 ||
 	    !range)
 		goto out;
-	freeaddrinfo(info);
+	if (info)
+		freeaddrinfo(info);
+	info = NULL;
 	a = strip_escape(session, a);
 	if (a == NULL) {
 		err = -1;
@@ -1015,9 +1314,11 @@ parse_ipaddr(struct ipset_session *session,
 	aerr = get_addrinfo(session, opt2, a, &info, family);
 
 out:
-	if (aerr != EINVAL)
+	if (aerr != EINVAL) {
 		/* getaddrinfo not failed */
-		freeaddrinfo(info);
+		if (info)
+			freeaddrinfo(info);
+	}
 	else if (aerr)
 		err = -1;
 	free(saved);
@@ -1040,6 +1341,49 @@ cidr_hostaddr(const char *str, uint8_t family)
 	return family == NFPROTO_IPV4 ? STREQ(a, "/32") : STREQ(a, "/128");
 }
 
+static int
+parse_ip(struct ipset_session *session,
+	 enum ipset_opt opt, const char *str, enum ipaddr_type addrtype);
+
+/* The dual-stack sets store the IPv4 addresses IPv4-mapped: the address
+ * is parsed in its own family, then mapped.
+ */
+static int
+parse_ip_inet(struct ipset_session *session,
+	      enum ipset_opt opt, const char *str, enum ipaddr_type addrtype)
+{
+	struct ipset_data *data = ipset_session_data(session);
+	enum ipset_opt copt = opt == IPSET_OPT_IP ? IPSET_OPT_CIDR
+						  : IPSET_OPT_CIDR2;
+	uint8_t family = strchr(str, ':') ? NFPROTO_IPV6 : NFPROTO_IPV4;
+	uint8_t inet = NFPROTO_INET, cidr;
+	struct in6_addr addr = {};
+	int err;
+
+	if (addrtype == IPADDR_RANGE || escape_range_separator(str))
+		return syntax_err("IP ranges are not supported in inet46 "
+				  "sets: %s", str);
+
+	ipset_data_set(data, IPSET_OPT_FAMILY, &family);
+	err = parse_ip(session, opt, str, addrtype);
+	if (!err && family == NFPROTO_IPV4) {
+		addr.s6_addr[10] = addr.s6_addr[11] = 0xff;
+		memcpy(&addr.s6_addr[12], ipset_data_get(data, opt),
+		       sizeof(struct in_addr));
+	} else if (!err) {
+		memcpy(&addr, ipset_data_get(data, opt), sizeof(addr));
+	}
+	ipset_data_set(data, IPSET_OPT_FAMILY, &inet);
+	if (err)
+		return err;
+
+	if (family == NFPROTO_IPV4 && ipset_data_test(data, copt)) {
+		cidr = *(const uint8_t *) ipset_data_get(data, copt) + 96;
+		ipset_data_set(data, copt, &cidr);
+	}
+	return ipset_data_set(data, opt, &addr);
+}
+
 static int
 parse_ip(struct ipset_session *session,
 	 enum ipset_opt opt, const char *str, enum ipaddr_type addrtype)
@@ -1050,6 +1394,8 @@ parse_ip(struct ipset_session *session,
 	if (family == NFPROTO_UNSPEC) {
 		family = NFPROTO_IPV4;
 		ipset_data_set(data, IPSET_OPT_FAMILY, &family);
+	} else if (family == NFPROTO_INET) {
+		return parse_ip_inet(session, opt, str, addrtype);
 	}
 
 	switch (addrtype) {
@@ -1929,6 +2275,30 @@ ipset_parse_ignored(struct ipset_session *session,
 	return 0;
 }
 
+/**
+ * ipset_parse_listed - "parse" a value listed by the kernel
+ * @session: session structure
+ * @opt: option kind of the data
+ * @str: string to parse
+ *
+ * Check the number of a value which is computed by the kernel, like the
+ * estimate of the distinct sources, so that the saved sets can be
+ * restored. The value cannot be set and it is not stored.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_parse_listed(struct ipset_session *session,
+		   enum ipset_opt opt UNUSED, const char *str)
+{
+	uint32_t value;
+
+	assert(session);
+	assert(str);
+
+	return string_to_u32(session, str, &value);
+}
+
 /**
  * ipset_call_parser - call a parser function
  * @session: session structure
@@ -1949,7 +2319,7 @@ ipset_call_parser(struct ipset_session *session,
 {
 	struct ipset_data *data = ipset_session_data(session);
 
-	if (ipset_data_flags_test(data, IPSET_FLAG(arg->opt))
+	if (ipset_data_test(data, arg->opt)
 	    && !(arg->opt == IPSET_OPT_FAMILY
 		 && ipset_data_test_ignored(data, IPSET_OPT_FAMILY)))
 		return syntax_err("%s already specified", arg->name[0]);
@@ -19,8 +19,10 @@
 #include <libipset/data.h>			/* ipset_data_* */
 #include <libipset/icmp.h>			/* icmp_to_name */
 #include <libipset/icmpv6.h>			/* icmpv6_to_name */
+#include <libipset/services.h>			/* ipset_proto_name */
 #include <libipset/parse.h>			/* IPSET_*_SEPARATOR */
 #include <libipset/types.h>			/* ipset set types */
+#include <libipset/linux_ip_set_hash.h>		/* IPSET_HASHFN_* */
 #include <libipset/session.h>			/* IPSET_FLAG_ */
 #include <libipset/utils.h>			/* UNUSED */
 #include <libipset/ipset.h>			/* IPSET_ENV_* */
@@ -36,6 +38,52 @@ do {								\
 	len -= size;						\
 } while (0)
 
+/* Formatters of the values printed for every element: the digits are
+ * produced directly, without the format parsing of snprintf. They
+ * follow snprintf: the returned size is not less than len when the
+ * value does not fit into the buffer. */
+
+static const char hexdigits[] = "0123456789ABCDEF";
+
+static inline int
+fmt_u64(char *s, uint64_t n)
+{
+	char tmp[20];
+	int i = 0, size;
+
+	do {
+		tmp[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	size = i;
+	while (i)
+		*s++ = tmp[--i];
+	return size;
+}
+
+static int
+copy_out(char *buf, unsigned int len, const char *tmp, int size)
+{
+	if ((unsigned int) size >= len)
+		return size;
+	memcpy(buf, tmp, size);
+	buf[size] = '\0';
+	return size;
+}
+
+/* Print a number after an optional separator */
+static int
+print_u64(char *buf, unsigned int len, const char *sep, uint64_t n)
+{
+	char tmp[24];
+	int size = 0;
+
+	while (*sep)
+		tmp[size++] = *sep++;
+	size += fmt_u64(tmp + size, n);
+	return copy_out(buf, len, tmp, size);
+}
+
 /**
  * ipset_print_ether - print ethernet address to string
  * @buf: printing buffer
@@ -54,7 +102,7 @@ ipset_print_ether(char *buf, unsigned int len,
 		  uint8_t env UNUSED)
 {
 	const unsigned char *ether;
-	int i, size, offset = 0;
+	int i;
 
 	assert(buf);
 	assert(len > 0);
@@ -67,14 +115,14 @@ ipset_print_ether(char *buf, unsigned int len,
 	ether = ipset_data_get(data, opt);
 	assert(ether);
 
-	size = snprintf(buf, len, "%02X", ether[0]);
-	SNPRINTF_FAILURE(size, len, offset);
-	for (i = 1; i < ETH_ALEN; i++) {
-		size = snprintf(buf + offset, len, ":%02X", ether[i]);
-		SNPRINTF_FAILURE(size, len, offset);
+	for (i = 0; i < ETH_ALEN; i++) {
+		buf[i * 3] = hexdigits[ether[i] >> 4];
+		buf[i * 3 + 1] = hexdigits[ether[i] & 0xf];
+		buf[i * 3 + 2] = ':';
 	}
+	buf[ETH_ALEN * 3 - 1] = '\0';
 
-	return offset;
+	return ETH_ALEN * 3 - 1;
 }
 
 /**
@@ -102,14 +150,164 @@ ipset_print_family(char *buf, unsigned int len,
 	assert(data);
 	assert(opt == IPSET_OPT_FAMILY);
 
-	if (len < strlen("inet6") + 1)
+	if (len < strlen("inet46") + 1)
 		return -1;
 
 	family = ipset_data_family(data);
 
 	return snprintf(buf, len, "%s",
 			family == AF_INET ? "inet" :
-			family == AF_INET6 ? "inet6" : "any");
+			family == AF_INET6 ? "inet6" :
+			family == NFPROTO_INET ? "inet46" : "any");
+}
+
+/**
+ * ipset_print_hashfn - print hash function name
+ * @buf: printing buffer
+ * @len: length of available buffer space
+ * @data: data blob
+ * @opt: the option kind
+ * @env: environment flags
+ *
+ * Print the hash function name of a hash type set to output buffer.
+ *
+ * Return lenght of printed string or error size.
+ */
+int
+ipset_print_hashfn(char *buf, unsigned int len,
+		   const struct ipset_data *data,
+		   enum ipset_opt opt,
+		   uint8_t env UNUSED)
+{
+	uint8_t hashfn;
+
+	assert(buf);
+	assert(len > 0);
+	assert(data);
+	assert(opt == IPSET_OPT_HASHFN);
+
+	hashfn = *(const uint8_t *) ipset_data_get(data, opt);
+
+	return snprintf(buf, len, "%s",
+			hashfn == IPSET_HASHFN_HSIPHASH ? "hsiphash" :
+			hashfn == IPSET_HASHFN_MULSHIFT ? "mulshift" : "jhash");
+}
+
+/**
+ * ipset_print_numa - print NUMA placement
+ * @buf: printing buffer
+ * @len: length of available buffer space
+ * @data: data blob
+ * @opt: the option kind
+ * @env: environment flags
+ *
+ * Print the NUMA node or "interleave" of a hash type set to output buffer.
+ *
+ * Return lenght of printed string or error size.
+ */
+int
+ipset_print_numa(char *buf, unsigned int len,
+		 const struct ipset_data *data,
+		 enum ipset_opt opt,
+		 uint8_t env UNUSED)
+{
+	uint32_t node;
+
+	assert(buf);
+	assert(len > 0);
+	assert(data);
+	assert(opt == IPSET_OPT_NUMA);
+
+	node = *(const uint32_t *) ipset_data_get(data, opt);
+	if (node == IPSET_NUMA_INTERLEAVE)
+		return snprintf(buf, len, "interleave");
+	return snprintf(buf, len, "%u", node);
+}
+
+/**
+ * ipset_print_ctevents - print the conntrack events populating a set
+ * @buf: printing buffer
+ * @len: length of available buffer space
+ * @data: data blob
+ * @opt: the option kind
+ * @env: environment flags
+ *
+ * Print the comma separated conntrack events of a set to output buffer.
+ *
+ * Return lenght of printed string or error size.
+ */
+int
+ipset_print_ctevents(char *buf, unsigned int len,
+		     const struct ipset_data *data,
+		     enum ipset_opt opt,
+		     uint8_t env UNUSED)
+{
+	static const char * const names[] = { "new", "assured", "destroy" };
+	uint32_t events;
+	int size, offset = 0;
+	unsigned int i;
+
+	assert(buf);
+	assert(len > 0);
+	assert(data);
+	assert(opt == IPSET_OPT_CTEVENTS);
+
+	events = *(const uint32_t *) ipset_data_get(data, opt);
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		if (!(events & (1 << i)))
+			continue;
+		size = snprintf(buf + offset, len, "%s%s",
+				offset ? IPSET_ELEM_SEPARATOR : "", names[i]);
+		SNPRINTF_FAILURE(size, len, offset);
+	}
+	return offset;
+}
+
+/**
+ * ipset_print_ctdir - print the conntrack tuple of the elements
+ * @buf: printing buffer
+ * @len: length of available buffer space
+ * @data: data blob
+ * @opt: the option kind
+ * @env: environment flags
+ *
+ * Print the tuple direction and the source or destination in every
+ * dimension of the set type to output buffer.
+ *
+ * Return lenght of printed string or error size.
+ */
+int
+ipset_print_ctdir(char *buf, unsigned int len,
+		  const struct ipset_data *data,
+		  enum ipset_opt opt,
+		  uint8_t env UNUSED)
+{
+	const struct ipset_type *type;
+	uint32_t ctdir;
+	int size, offset = 0;
+	uint8_t i, dim;
+
+	assert(buf);
+	assert(len > 0);
+	assert(data);
+	assert(opt == IPSET_OPT_CTDIR);
+
+	ctdir = *(const uint32_t *) ipset_data_get(data, opt);
+	type = ipset_data_get(data, IPSET_OPT_TYPE);
+	dim = type ? type->dimension : IPSET_DIM_ONE;
+	if (dim > IPSET_DIM_THREE)
+		dim = IPSET_DIM_THREE;
+
+	size = snprintf(buf, len, "%s",
+			ctdir & IPSET_CTDIR_REPLY ? "reply:" : "");
+	SNPRINTF_FAILURE(size, len, offset);
+	for (i = IPSET_DIM_ONE; i <= dim; i++) {
+		size = snprintf(buf + offset, len, "%s%s",
+				i > IPSET_DIM_ONE ? IPSET_ELEM_SEPARATOR : "",
+				ctdir & (1 << i) ? "src" : "dst");
+		SNPRINTF_FAILURE(size, len, offset);
+	}
+	return offset;
 }
 
 /**
@@ -144,6 +342,33 @@ ipset_print_type(char *buf, unsigned int len,
 	return snprintf(buf, len, "%s", type->name);
 }
 
+static inline int
+__ntop4(char *buf, unsigned int len, const union nf_inet_addr *addr)
+{
+	const uint8_t *b = (const uint8_t *) &addr->ip;
+	char tmp[INET_ADDRSTRLEN];
+	int size;
+
+	size = fmt_u64(tmp, b[0]);
+	tmp[size++] = '.';
+	size += fmt_u64(tmp + size, b[1]);
+	tmp[size++] = '.';
+	size += fmt_u64(tmp + size, b[2]);
+	tmp[size++] = '.';
+	size += fmt_u64(tmp + size, b[3]);
+	return copy_out(buf, len, tmp, size);
+}
+
+static inline int
+__ntop6(char *buf, unsigned int len, const union nf_inet_addr *addr)
+{
+	char tmp[INET6_ADDRSTRLEN];
+
+	if (!inet_ntop(AF_INET6, &addr->in6, tmp, sizeof(tmp)))
+		return -1;
+	return copy_out(buf, len, tmp, strlen(tmp));
+}
+
 static inline int
 __getnameinfo4(char *buf, unsigned int len,
 	       int flags, const union nf_inet_addr *addr)
@@ -223,15 +448,18 @@ snprintf_ipv##f(char *buf, unsigned int len, int flags,			\
 {									\
 	int size, offset = 0;						\
 									\
-	size = __getnameinfo##f(buf, len, flags, ip);			\
+	/* Numeric addresses need no resolver call */			\
+	if (flags & NI_NUMERICHOST)					\
+		size = __ntop##f(buf, len, ip);				\
+	else								\
+		size = __getnameinfo##f(buf, len, flags, ip);		\
 	SNPRINTF_FAILURE(size, len, offset);				\
 									\
 	D("cidr %u mask %u", cidr, mask);				\
 	if (cidr == mask)						\
 		return offset;						\
 	D("print cidr");						\
-	size = snprintf(buf + offset, len,				\
-			"%s%u", IPSET_CIDR_SEPARATOR, cidr);		\
+	size = print_u64(buf + offset, len, IPSET_CIDR_SEPARATOR, cidr); \
 	SNPRINTF_FAILURE(size, len, offset);				\
 	return offset;							\
 }
@@ -240,6 +468,19 @@ SNPRINTF_IP(32, 4)
 
 SNPRINTF_IP(128, 6)
 
+/* The dual-stack sets store the IPv4 addresses IPv4-mapped */
+static int
+snprintf_inet(char *buf, unsigned int len, int flags,
+	      const union nf_inet_addr *ip, uint8_t cidr)
+{
+	union nf_inet_addr ip4 = {};
+
+	if (!IN6_IS_ADDR_V4MAPPED(&ip->in6) || cidr < 96)
+		return snprintf_ipv6(buf, len, flags, ip, cidr);
+	ip4.ip = ip->ip6[3];
+	return snprintf_ipv4(buf, len, flags, &ip4, cidr - 96);
+}
+
 /**
  * ipset_print_ip - print IPv4|IPv6 address to string
  * @buf: printing buffer
@@ -274,7 +515,7 @@ ipset_print_ip(char *buf, unsigned int len,
 		cidr = *(const uint8_t *) ipset_data_get(data, cidropt);
 		D("CIDR: %u", cidr);
 	} else
-		cidr = family == NFPROTO_IPV6 ? 128 : 32;
+		cidr = family == NFPROTO_IPV4 ? 32 : 128;
 	flags = (env & IPSET_ENV_RESOLVE) ? 0 : NI_NUMERICHOST;
 
 	ip = ipset_data_get(data, opt);
@@ -283,6 +524,8 @@ ipset_print_ip(char *buf, unsigned int len,
 		size = snprintf_ipv4(buf, len, flags, ip, cidr);
 	else if (family == NFPROTO_IPV6)
 		size = snprintf_ipv6(buf, len, flags, ip, cidr);
+	else if (family == NFPROTO_INET)
+		size = snprintf_inet(buf, len, flags, ip, cidr);
 	else
 		return -1;
 	D("size %i, len %u", size, len);
@@ -341,7 +584,7 @@ ipset_print_ipaddr(char *buf, unsigned int len,
 	if (ipset_data_test(data, cidropt))
 		cidr = *(const uint8_t *) ipset_data_get(data, cidropt);
 	else
-		cidr = family == NFPROTO_IPV6 ? 128 : 32;
+		cidr = family == NFPROTO_IPV4 ? 32 : 128;
 	flags = (env & IPSET_ENV_RESOLVE) ? 0 : NI_NUMERICHOST;
 
 	ip = ipset_data_get(data, opt);
@@ -350,6 +593,8 @@ ipset_print_ipaddr(char *buf, unsigned int len,
 		return snprintf_ipv4(buf, len, flags, ip, cidr);
 	else if (family == NFPROTO_IPV6)
 		return snprintf_ipv6(buf, len, flags, ip, cidr);
+	else if (family == NFPROTO_INET)
+		return snprintf_inet(buf, len, flags, ip, cidr);
 
 	return -1;
 }
@@ -382,15 +627,13 @@ ipset_print_number(char *buf, unsigned int len,
 	maxsize = ipset_data_sizeof(opt, AF_INET);
 	D("opt: %u, maxsize %zu", opt, maxsize);
 	if (maxsize == sizeof(uint8_t))
-		return snprintf(buf, len, "%u", *(const uint8_t *) number);
+		return print_u64(buf, len, "", *(const uint8_t *) number);
 	else if (maxsize == sizeof(uint16_t))
-		return snprintf(buf, len, "%u", *(const uint16_t *) number);
+		return print_u64(buf, len, "", *(const uint16_t *) number);
 	else if (maxsize == sizeof(uint32_t))
-		return snprintf(buf, len, "%lu",
-				(long unsigned) *(const uint32_t *) number);
+		return print_u64(buf, len, "", *(const uint32_t *) number);
 	else if (maxsize == sizeof(uint64_t))
-		return snprintf(buf, len, "%llu",
-				(long long unsigned) *(const uint64_t *) number);
+		return print_u64(buf, len, "", *(const uint64_t *) number);
 	else
 		assert(0);
 	return 0;
@@ -521,14 +764,13 @@ ipset_print_port(char *buf, unsigned int len,
 
 	port = ipset_data_get(data, IPSET_OPT_PORT);
 	assert(port);
-	size = snprintf(buf, len, "%u", *port);
+	size = print_u64(buf, len, "", *port);
 	SNPRINTF_FAILURE(size, len, offset);
 
 	if (ipset_data_test(data, IPSET_OPT_PORT_TO)) {
 		port = ipset_data_get(data, IPSET_OPT_PORT_TO);
-		size = snprintf(buf + offset, len,
-				"%s%u",
-				IPSET_RANGE_SEPARATOR, *port);
+		size = print_u64(buf + offset, len,
+				 IPSET_RANGE_SEPARATOR, *port);
 		SNPRINTF_FAILURE(size, len, offset);
 	}
 
@@ -707,7 +949,7 @@ ipset_print_proto(char *buf, unsigned int len,
 		  enum ipset_opt opt ASSERT_UNUSED,
 		  uint8_t env UNUSED)
 {
-	const struct protoent *protoent;
+	const char *name;
 	uint8_t proto;
 
 	assert(buf);
@@ -718,9 +960,9 @@ ipset_print_proto(char *buf, unsigned int len,
 	proto = *(const uint8_t *) ipset_data_get(data, IPSET_OPT_PROTO);
 	assert(proto);
 
-	protoent = getprotobynumber(proto);
-	if (protoent)
-		return snprintf(buf, len, "%s", protoent->p_name);
+	name = ipset_proto_name(proto);
+	if (name)
+		return snprintf(buf, len, "%s", name);
 
 	/* Should not happen */
 	return snprintf(buf, len, "%u", proto);
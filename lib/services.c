@@ -0,0 +1,301 @@
+/* Copyright 2007-2010 Jozsef Kadlecsik (kadlec@netfilter.org)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <netdb.h>				/* getservent, getprotoent */
+#include <pthread.h>				/* pthread_mutex_* */
+#include <stdbool.h>				/* bool */
+#include <stdlib.h>				/* calloc, free */
+#include <string.h>				/* strlen, strcpy */
+#include <arpa/inet.h>				/* ntohs */
+
+#include <libipset/utils.h>			/* STREQ */
+#include <libipset/services.h>			/* prototypes */
+
+/* The protocol and service databases are read once, at the first
+ * lookup: the by-name and by-number calls scan them at every element.
+ * Names which cannot be found in the tables are looked up directly
+ * and added to the tables. Every thread has got its own tables, the
+ * database calls, which are not reentrant, are serialized. */
+
+#define SERVICES_HSIZE		1024
+
+struct service {
+	struct service *next;
+	uint16_t port;				/* Port in host order */
+	const char *proto;			/* Protocol name */
+	char name[0];				/* Service name, protocol */
+};
+
+struct protocol {
+	struct protocol *next;
+	uint8_t proto;				/* Protocol number */
+	char name[0];				/* Protocol name or alias */
+};
+
+struct services_db {
+	struct service *services[SERVICES_HSIZE];
+	struct protocol *protocols;		/* Names and aliases */
+	char *protonames[UINT8_MAX + 1];	/* Names by number */
+	bool services_loaded, protocols_loaded;
+};
+
+static __thread struct services_db *db;
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+db_init(void)
+{
+	if (db == NULL)
+		db = calloc(1, sizeof(*db));
+	return db != NULL;
+}
+
+static unsigned int
+service_hash(const char *name, const char *proto)
+{
+	unsigned int h = 0;
+
+	while (*name)
+		h = h * 31 + (unsigned char)*name++;
+	while (*proto)
+		h = h * 31 + (unsigned char)*proto++;
+	return h % SERVICES_HSIZE;
+}
+
+static struct service *
+find_service(const char *name, const char *proto)
+{
+	struct service *s;
+
+	for (s = db->services[service_hash(name, proto)]; s; s = s->next)
+		if (STREQ(s->name, name) && STREQ(s->proto, proto))
+			return s;
+	return NULL;
+}
+
+/* The first entry of a name wins, like in the database lookups */
+static void
+add_service(const char *name, const char *proto, int port)
+{
+	size_t len = strlen(name) + 1;
+	unsigned int h;
+	struct service *s;
+
+	if (find_service(name, proto))
+		return;
+	s = calloc(1, sizeof(*s) + len + strlen(proto) + 1);
+	if (s == NULL)
+		return;
+	s->port = ntohs((uint16_t) port);
+	strcpy(s->name, name);
+	strcpy(s->name + len, proto);
+	s->proto = s->name + len;
+	h = service_hash(name, proto);
+	s->next = db->services[h];
+	db->services[h] = s;
+}
+
+static void
+add_servent(const struct servent *se)
+{
+	char **alias;
+
+	add_service(se->s_name, se->s_proto, se->s_port);
+	for (alias = se->s_aliases; alias && *alias; alias++)
+		add_service(*alias, se->s_proto, se->s_port);
+}
+
+static struct protocol *
+find_protocol(const char *name)
+{
+	struct protocol *p;
+
+	for (p = db->protocols; p; p = p->next)
+		if (STREQ(p->name, name))
+			return p;
+	return NULL;
+}
+
+static void
+add_protocol(const char *name, uint8_t proto)
+{
+	struct protocol *p;
+
+	if (find_protocol(name))
+		return;
+	p = calloc(1, sizeof(*p) + strlen(name) + 1);
+	if (p == NULL)
+		return;
+	p->proto = proto;
+	strcpy(p->name, name);
+	p->next = db->protocols;
+	db->protocols = p;
+}
+
+static void
+add_protoent(const struct protoent *pe)
+{
+	char **alias;
+
+	if (pe->p_proto < 0 || pe->p_proto > UINT8_MAX)
+		return;
+	if (db->protonames[pe->p_proto] == NULL)
+		db->protonames[pe->p_proto] = strdup(pe->p_name);
+	add_protocol(pe->p_name, pe->p_proto);
+	for (alias = pe->p_aliases; alias && *alias; alias++)
+		add_protocol(*alias, pe->p_proto);
+}
+
+static void
+load_protocols(void)
+{
+	const struct protoent *pe;
+
+	pthread_mutex_lock(&db_lock);
+	setprotoent(1);
+	while ((pe = getprotoent()) != NULL)
+		add_protoent(pe);
+	endprotoent();
+	pthread_mutex_unlock(&db_lock);
+	db->protocols_loaded = true;
+}
+
+static void
+load_services(void)
+{
+	const struct servent *se;
+
+	pthread_mutex_lock(&db_lock);
+	setservent(1);
+	while ((se = getservent()) != NULL)
+		add_servent(se);
+	endservent();
+	pthread_mutex_unlock(&db_lock);
+	db->services_loaded = true;
+}
+
+/**
+ * ipset_proto_name - get the name of a protocol
+ * @proto: protocol number
+ *
+ * Returns the official name of the protocol or NULL if
+ * it is unknown.
+ */
+const char *
+ipset_proto_name(uint8_t proto)
+{
+	const struct protoent *pe;
+
+	if (!db_init())
+		return NULL;
+	if (!db->protocols_loaded)
+		load_protocols();
+	if (db->protonames[proto] == NULL) {
+		pthread_mutex_lock(&db_lock);
+		if ((pe = getprotobynumber(proto)))
+			add_protoent(pe);
+		pthread_mutex_unlock(&db_lock);
+	}
+	return db->protonames[proto];
+}
+
+/**
+ * ipset_proto_number - get the number of a protocol
+ * @name: protocol name or alias
+ * @proto: pointer to store the protocol number
+ *
+ * Returns 0 on success or -1 if the protocol is unknown.
+ */
+int
+ipset_proto_number(const char *name, uint8_t *proto)
+{
+	const struct protoent *pe;
+	const struct protocol *p;
+
+	if (!db_init())
+		return -1;
+	if (!db->protocols_loaded)
+		load_protocols();
+	p = find_protocol(name);
+	if (p == NULL) {
+		pthread_mutex_lock(&db_lock);
+		if ((pe = getprotobyname(name)))
+			add_protoent(pe);
+		pthread_mutex_unlock(&db_lock);
+		p = find_protocol(name);
+	}
+	if (p == NULL)
+		return -1;
+	*proto = p->proto;
+	return 0;
+}
+
+/**
+ * ipset_service_port - get the port of a service
+ * @name: service name or alias
+ * @proto: protocol name
+ * @port: pointer to store the port in host order
+ *
+ * Returns 0 on success or -1 if the service is unknown.
+ */
+int
+ipset_service_port(const char *name, const char *proto, uint16_t *port)
+{
+	const struct servent *se;
+	const struct service *s;
+	int ret = -1;
+
+	if (!db_init())
+		return -1;
+	if (!db->services_loaded)
+		load_services();
+	s = find_service(name, proto);
+	if (s != NULL) {
+		*port = s->port;
+		return 0;
+	}
+	pthread_mutex_lock(&db_lock);
+	if ((se = getservbyname(name, proto))) {
+		add_servent(se);
+		/* The name may be stored with another protocol name */
+		*port = ntohs((uint16_t) se->s_port);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&db_lock);
+	return ret;
+}
+
+/**
+ * ipset_services_fini - release the protocol and service tables
+ *
+ * Release the protocol and service tables of the calling thread.
+ */
+void
+ipset_services_fini(void)
+{
+	struct service *s;
+	struct protocol *p;
+	int i;
+
+	if (db == NULL)
+		return;
+	for (i = 0; i < SERVICES_HSIZE; i++) {
+		while (db->services[i]) {
+			s = db->services[i];
+			db->services[i] = s->next;
+			free(s);
+		}
+	}
+	while (db->protocols) {
+		p = db->protocols;
+		db->protocols = p->next;
+		free(p);
+	}
+	for (i = 0; i <= UINT8_MAX; i++)
+		free(db->protonames[i]);
+	free(db);
+	db = NULL;
+}
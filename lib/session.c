@@ -5,39 +5,75 @@
  * published by the Free Software Foundation.
  */
 #include <assert.h>				/* assert */
+#include <ctype.h>				/* isspace */
 #include <endian.h>				/* htobe64 */
 #include <errno.h>				/* errno */
+#include <fnmatch.h>				/* fnmatch */
+#include <pthread.h>				/* pthread_once */
+#include <regex.h>				/* regcomp, regexec */
 #include <setjmp.h>				/* setjmp, longjmp */
 #include <stdio.h>				/* snprintf */
 #include <stdarg.h>				/* va_* */
 #include <stdbool.h>				/* bool */
 #include <stdlib.h>				/* free */
 #include <string.h>				/* str* */
+#include <time.h>				/* clock_gettime */
 #include <unistd.h>				/* getpagesize */
 #include <net/ethernet.h>			/* ETH_ALEN */
 #include <net/if.h>				/* IFNAMSIZ */
+#include <sys/stat.h>				/* stat */
+
+#include <config.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>				/* gz* */
+#endif
 
 #include <libipset/compat.h>			/* be64toh() */
 #include <libipset/debug.h>			/* D() */
 #include <libipset/data.h>			/* IPSET_OPT_* */
 #include <libipset/errcode.h>			/* ipset_errcode */
 #include <libipset/print.h>			/* ipset_print_* */
+#include <libipset/services.h>			/* ipset_services_fini */
 #include <libipset/types.h>			/* struct ipset_type */
+#include <libipset/linux_ip_set_hash.h>		/* ip_set_hash_lockstat */
 #include <libipset/transport.h>			/* transport */
 #include <libipset/mnl.h>			/* default backend */
 #include <libipset/utils.h>			/* STREQ */
 #include <libipset/ipset.h>			/* IPSET_ENV_* */
-#include <libipset/list_sort.h>			/* list_sort */
 #include <libipset/session.h>			/* prototypes */
 
 #define IPSET_NEST_MAX	4
 
+/* Initial output buffer size: listed elements are printed in chunks */
+#define IPSET_LIST_OUTBUFLEN	(8 * IPSET_OUTBUFLEN)
+
 /* When we want to sort the entries */
 struct ipset_sorted {
-	struct list_head list;
+	uint64_t key;				/* Binary sort key */
 	size_t offset;				/* Offset in outbuf */
 };
 
+/* Bits of the binary sort keys: IPv4 address and inverted cidr */
+#define IPSET_SORT_KEYBITS	40
+
+/* Conditions on the set headers: "entries>1000" */
+#define IPSET_HEADER_COND_MAX	8
+
+enum ipset_header_cmp {
+	IPSET_CMP_EQ,
+	IPSET_CMP_NE,
+	IPSET_CMP_LT,
+	IPSET_CMP_LE,
+	IPSET_CMP_GT,
+	IPSET_CMP_GE,
+};
+
+struct ipset_header_cond {
+	enum ipset_opt opt;			/* Header field */
+	enum ipset_header_cmp cmp;		/* Comparison */
+	uint32_t value;				/* Compared to */
+};
+
 
 /* The session structure */
 struct ipset_session {
@@ -52,29 +88,71 @@ struct ipset_session {
 	const struct ipset_type *saved_type;	/* Saved type */
 	struct nlattr *nested[IPSET_NEST_MAX];	/* Pointer to nest levels */
 	uint8_t nestid;				/* Current nest level */
+	struct nlattr *packed;			/* Packed elements attribute */
+	uint32_t packed_lineno;			/* Lineno of first packed elem */
+	uint8_t inflight;			/* Batches sent, not ACKed yet */
 	uint8_t protocol;			/* The protocol used */
 	bool version_checked;			/* Version checked */
+	bool dump_bufsize;			/* Kernel takes IPSET_ATTR_BUFSIZE */
+	bool guessed;				/* Cached protocol/type used */
+	bool guess_failed;			/* and rejected by the kernel */
+	bool no_guess;				/* Negotiate every time */
 	/* Output buffer */
 	char *outbuf;				/* Output buffer */
 	size_t outbuflen;			/* Output buffer size */
 	size_t pos;				/* Printing position in outbuf */
-	struct list_head sorted;		/* Sorted entries */
-	struct list_head pool;			/* Pool to reuse */
+	struct ipset_sorted *sorted;		/* Sorted entries */
+	size_t sorted_num;			/* Number of sorted entries */
+	size_t sorted_max;			/* Allocated sorted entries */
 	enum ipset_output_mode mode;		/* Output mode */
 	ipset_print_outfn print_outfn;		/* Output function to file */
 	void *p;				/* Private data for print_outfn */
 	bool sort;				/* Print sorted hash:* types */
+	bool sort_key;				/* Sort by binary keys */
+	bool sort_top;				/* Sort by the counters */
 	size_t save_elem_prefix;		/* "add setname " */
+	jmp_buf printf_failure;			/* Handle printing failures */
+	ipset_elem_fn elem_fn;			/* Element callback */
+	void *elem_p;				/* Private area of the callback */
+	size_t bin_stride;			/* Binary save: element size */
+	uint32_t bin_count;			/* Elements in the block */
+	uint32_t bin_crc;			/* CRC32 of the set records */
+	uint8_t bin_flags;			/* IPSET_PACKED_* flags */
 	/* Session IO */
 	bool normal_io, full_io;		/* Default/normal/full IO */
 	FILE *istream, *ostream;		/* Session input/output stream */
+#ifdef HAVE_ZLIB
+	gzFile gzout;				/* Compressed output stream */
+#endif
 	/* Error/warning reporting */
 	char report[IPSET_ERRORBUFLEN];		/* Error/report buffer */
 	enum ipset_err_type err_type;		/* ERROR/WARNING/NOTICE */
-	uint8_t envopts;			/* Session env opts */
+	uint16_t envopts;			/* Session env opts */
+	uint32_t since;				/* List the changes since */
+	uint32_t top;				/* List the top elements */
+	uint8_t top_by;				/* Counter of the top ones */
+	/* List filters */
+	char *match;				/* Glob pattern of the members */
+	regex_t *regex;				/* Regex of the members */
+	bool match_not;				/* List the non-matching ones */
+	struct ipset_header_cond cond[IPSET_HEADER_COND_MAX];
+	uint8_t conds;				/* Conditions on the headers */
+	bool skip_set;				/* Set filtered out */
+	uint32_t matched;			/* Members of the set counted */
+	uint32_t set_memsize;			/* Size of the set */
+	uint32_t total_sets;			/* Totals of the listing */
+	uint64_t total_elements;
+	uint64_t total_memsize;
 	/* Kernel message buffer */
 	size_t bufsize;
 	void *buffer;
+	void *ackbuf;				/* Buffer for deferred ACKs */
+#ifdef IPSET_DEBUG
+	/* Kernel message statistics */
+	uint64_t sent_msgs;			/* Messages sent */
+	uint64_t sent_bytes;			/* Bytes sent */
+	struct timespec start;			/* Session start time */
+#endif
 };
 
 /*
@@ -134,6 +212,23 @@ ipset_session_lineno(struct ipset_session *session, uint32_t lineno)
 	session->lineno = lineno;
 }
 
+/**
+ * ipset_session_report_lineno - get the lineno of the reported error
+ * @session: session structure
+ *
+ * In restore mode the kernel reports the lineno of the command which
+ * failed in a batch: the commands before it were executed, the ones
+ * after it were not.
+ *
+ * Returns the lineno of the last error or command.
+ */
+uint32_t
+ipset_session_report_lineno(const struct ipset_session *session)
+{
+	assert(session);
+	return session->lineno;
+}
+
 /**
  * ipset_session_printf_private - returns the session private pointer
  * @session: session structure
@@ -214,6 +309,218 @@ ipset_session_output(struct ipset_session *session,
 	return 0;
 }
 
+/**
+ * ipset_session_list_since - list the changed elements only
+ * @session: session structure
+ * @epoch: the epoch reported by a previous listing
+ *
+ * Set the epoch so that the list and save commands report the
+ * elements the counters or timeouts of which changed since then.
+ * Zero lists all elements.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_session_list_since(struct ipset_session *session, uint32_t epoch)
+{
+	assert(session);
+	session->since = epoch;
+	return 0;
+}
+
+/**
+ * ipset_session_list_top - list the top elements by a counter
+ * @session: session structure
+ * @top: number of the elements to list, zero for all
+ * @top_by: IPSET_TOP_BYTES or IPSET_TOP_PACKETS
+ *
+ * Set the list and save commands to report the elements with the
+ * largest counter values only, in descending order.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_session_list_top(struct ipset_session *session, uint32_t top,
+		       uint8_t top_by)
+{
+	assert(session);
+	if (top > IPSET_TOP_MAX || top_by > IPSET_TOP_PACKETS)
+		return ipset_err(session,
+				 "At most %u top elements can be listed",
+				 IPSET_TOP_MAX);
+	session->top = top;
+	session->top_by = top_by;
+	return 0;
+}
+
+/**
+ * ipset_session_list_match - list the members matching a pattern
+ * @session: session structure
+ * @pattern: shell wildcard pattern or extended regular expression
+ * @regex: @pattern is a regular expression
+ *
+ * Set the list and save commands to print the members only, which
+ * are matched by the pattern. The pattern is matched against the
+ * element part of the members, without the options: a leading '!'
+ * inverts the match.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_session_list_match(struct ipset_session *session, const char *pattern,
+			 bool regex)
+{
+	bool match_not = false;
+	int ret;
+
+	assert(session);
+	assert(pattern);
+	if (session->match || session->regex)
+		return ipset_err(session,
+				 "Only one member pattern can be given");
+	if (pattern[0] == '!') {
+		match_not = true;
+		pattern++;
+	}
+	if (!regex) {
+		session->match = strdup(pattern);
+		if (!session->match)
+			return ipset_err(session,
+					 "Cannot allocate memory for the pattern");
+		session->match_not = match_not;
+		return 0;
+	}
+	session->regex = malloc(sizeof(*session->regex));
+	if (!session->regex)
+		return ipset_err(session,
+				 "Cannot allocate memory for the pattern");
+	ret = regcomp(session->regex, pattern, REG_EXTENDED | REG_NOSUB);
+	if (ret) {
+		char msg[128];
+
+		regerror(ret, session->regex, msg, sizeof(msg));
+		free(session->regex);
+		session->regex = NULL;
+		return ipset_err(session, "Invalid regular expression: %s",
+				 msg);
+	}
+	session->match_not = match_not;
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	enum ipset_opt opt;
+} header_fields[] = {
+	{ "entries",	IPSET_OPT_ELEMENTS },
+	{ "references",	IPSET_OPT_REFERENCES },
+	{ "memsize",	IPSET_OPT_MEMSIZE },
+	{ "revision",	IPSET_OPT_REVISION },
+	{ "hashsize",	IPSET_OPT_HASHSIZE },
+	{ "maxelem",	IPSET_OPT_MAXELEM },
+	{ "timeout",	IPSET_OPT_TIMEOUT },
+};
+
+/* Longer operators first */
+static const struct {
+	const char *str;
+	enum ipset_header_cmp cmp;
+} header_cmps[] = {
+	{ "==", IPSET_CMP_EQ },
+	{ "!=", IPSET_CMP_NE },
+	{ "<=", IPSET_CMP_LE },
+	{ ">=", IPSET_CMP_GE },
+	{ "=",  IPSET_CMP_EQ },
+	{ "<",  IPSET_CMP_LT },
+	{ ">",  IPSET_CMP_GT },
+};
+
+/**
+ * ipset_session_list_header - list the sets matching a header condition
+ * @session: session structure
+ * @cond: condition in the form of FIELD OP VALUE, like "entries>1000"
+ *
+ * Set the list and save commands to report the sets only, which
+ * header fields satisfy all of the conditions given. The fields are
+ * entries, references, memsize, revision, hashsize, maxelem and timeout,
+ * the operators are =, ==, !=, <, <=, > and >=. A set without the field
+ * in its header does not match.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_session_list_header(struct ipset_session *session, const char *cond)
+{
+	struct ipset_header_cond *c;
+	unsigned long value;
+	size_t i, len;
+	char *end;
+
+	assert(session);
+	assert(cond);
+	if (session->conds == IPSET_HEADER_COND_MAX)
+		return ipset_err(session,
+				 "At most %u header conditions can be given",
+				 IPSET_HEADER_COND_MAX);
+	c = &session->cond[session->conds];
+	for (i = 0; i < ARRAY_SIZE(header_fields); i++) {
+		len = strlen(header_fields[i].name);
+		if (strncmp(cond, header_fields[i].name, len) == 0 &&
+		    cond[len] && strchr("=!<>", cond[len]))
+			break;
+	}
+	if (i == ARRAY_SIZE(header_fields))
+		return ipset_err(session,
+				 "Unknown header field in condition %s", cond);
+	c->opt = header_fields[i].opt;
+	cond += len;
+	for (i = 0; i < ARRAY_SIZE(header_cmps); i++) {
+		len = strlen(header_cmps[i].str);
+		if (strncmp(cond, header_cmps[i].str, len) == 0)
+			break;
+	}
+	if (i == ARRAY_SIZE(header_cmps))
+		return ipset_err(session,
+				 "Unknown operator in condition %s", cond);
+	c->cmp = header_cmps[i].cmp;
+	cond += len;
+	errno = 0;
+	value = strtoul(cond, &end, 0);
+	if (errno || end == cond || *end || value > UINT32_MAX)
+		return ipset_err(session,
+				 "Invalid value in header condition: %s", cond);
+	c->value = value;
+	session->conds++;
+	return 0;
+}
+
+/**
+ * ipset_session_list_reset - reset the list options
+ * @session: session structure
+ *
+ * Clear the output mode, the epoch, the top elements, the member pattern
+ * and the header conditions of the list and save commands, so that the
+ * next command of a long running session starts from the defaults.
+ */
+void
+ipset_session_list_reset(struct ipset_session *session)
+{
+	assert(session);
+	session->mode = IPSET_LIST_NONE;
+	session->since = 0;
+	session->top = 0;
+	session->top_by = 0;
+	if (session->regex) {
+		regfree(session->regex);
+		free(session->regex);
+		session->regex = NULL;
+	}
+	free(session->match);
+	session->match = NULL;
+	session->match_not = false;
+	session->conds = 0;
+}
+
 /*
  * Error and warning reporting
  */
@@ -383,6 +690,31 @@ static const struct ipset_attr_policy cmd_attrs[] = {
 		.type = MNL_TYPE_U16,
 		.opt = IPSET_OPT_INDEX,
 	},
+	[IPSET_ATTR_ADT_PACKED] = {
+		.type = MNL_TYPE_BINARY,
+		.len = sizeof(struct ip_set_adt_packed),
+	},
+	[IPSET_ATTR_LOST] = {
+		.type = MNL_TYPE_U32,
+	},
+	[IPSET_ATTR_SINCE] = {
+		.type = MNL_TYPE_U32,
+	},
+	[IPSET_ATTR_TOP] = {
+		.type = MNL_TYPE_U32,
+	},
+	[IPSET_ATTR_TOP_BY] = {
+		.type = MNL_TYPE_U8,
+	},
+	[IPSET_ATTR_SNAPSHOT] = {
+		.type = MNL_TYPE_FLAG,
+	},
+	[IPSET_ATTR_BUFSIZE] = {
+		.type = MNL_TYPE_U32,
+	},
+	[IPSET_ATTR_TRANSACTION] = {
+		.type = MNL_TYPE_FLAG,
+	},
 };
 
 static const struct ipset_attr_policy create_attrs[] = {
@@ -434,6 +766,14 @@ static const struct ipset_attr_policy create_attrs[] = {
 		.type = MNL_TYPE_U32,
 		.opt = IPSET_OPT_MARKMASK,
 	},
+	[IPSET_ATTR_RATE] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_RATE,
+	},
+	[IPSET_ATTR_BURST] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_BURST,
+	},
 	[IPSET_ATTR_NETMASK] = {
 		.type = MNL_TYPE_U8,
 		.opt = IPSET_OPT_NETMASK,
@@ -462,6 +802,57 @@ static const struct ipset_attr_policy create_attrs[] = {
 		.type = MNL_TYPE_U32,
 		.opt = IPSET_OPT_MEMSIZE,
 	},
+	[IPSET_ATTR_BLOOM_FPR] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_BLOOM_FPR,
+	},
+	[IPSET_ATTR_HASHFN] = {
+		.type = MNL_TYPE_U8,
+		.opt = IPSET_OPT_HASHFN,
+	},
+	[IPSET_ATTR_REGIONBITS] = {
+		.type = MNL_TYPE_U8,
+		.opt = IPSET_OPT_REGIONBITS,
+	},
+	[IPSET_ATTR_LOCKSTAT] = {
+		.type = MNL_TYPE_BINARY,
+		.opt = IPSET_OPT_LOCKSTAT,
+		.len = sizeof(struct ip_set_hash_lockstat),
+	},
+	[IPSET_ATTR_LOOKUPSTAT] = {
+		.type = MNL_TYPE_BINARY,
+		.opt = IPSET_OPT_LOOKUPSTAT,
+		.len = sizeof(struct ip_set_hash_lookupstat),
+	},
+	[IPSET_ATTR_MEMSTAT] = {
+		.type = MNL_TYPE_BINARY,
+		.opt = IPSET_OPT_MEMSTAT,
+		.len = sizeof(struct ip_set_hash_memstat),
+	},
+	[IPSET_ATTR_NUMA] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_NUMA,
+	},
+	[IPSET_ATTR_SAMPLE] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_SAMPLE,
+	},
+	[IPSET_ATTR_CTEVENTS] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_CTEVENTS,
+	},
+	[IPSET_ATTR_CTDIR] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_CTDIR,
+	},
+	[IPSET_ATTR_TABLEPAGES] = {
+		.type = MNL_TYPE_U8,
+		.opt = IPSET_OPT_TABLEPAGES,
+	},
+	[IPSET_ATTR_EPOCH] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_EPOCH,
+	},
 };
 
 static const struct ipset_attr_policy adt_attrs[] = {
@@ -481,6 +872,14 @@ static const struct ipset_attr_policy adt_attrs[] = {
 		.type = MNL_TYPE_U32,
 		.opt = IPSET_OPT_MARK,
 	},
+	[IPSET_ATTR_RATE] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_RATE,
+	},
+	[IPSET_ATTR_BURST] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_BURST,
+	},
 	[IPSET_ATTR_PORT] = {
 		.type = MNL_TYPE_U16,
 		.opt = IPSET_OPT_PORT,
@@ -566,6 +965,10 @@ static const struct ipset_attr_policy adt_attrs[] = {
 		.type = MNL_TYPE_UNSPEC,
 		.len = 0,
 	},
+	[IPSET_ATTR_DISTINCT] = {
+		.type = MNL_TYPE_U32,
+		.opt = IPSET_OPT_ADT_DISTINCT,
+	},
 };
 
 static const struct ipset_attr_policy ipaddr_attrs[] = {
@@ -602,6 +1005,9 @@ generic_data_attr_cb(const struct nlattr *attr, void *data,
 	if (policy[type].type == MNL_TYPE_NUL_STRING &&
 	    mnl_attr_get_payload_len(attr) > policy[type].len)
 		return MNL_CB_ERROR;
+	if (policy[type].type == MNL_TYPE_BINARY &&
+	    mnl_attr_get_payload_len(attr) < policy[type].len)
+		return MNL_CB_ERROR;
 	tb[type] = attr;
 	return MNL_CB_OK;
 }
@@ -640,7 +1046,10 @@ attr2data(struct ipset_session *session, struct nlattr *nla[],
 	uint64_t v64;
 	uint32_t v32;
 	uint16_t v16;
-	int ret;
+	struct ipset_lockstat lockstat;
+	struct ipset_lookupstat lookupstat;
+	struct ipset_memstat memstat;
+	int ret, i;
 
 	attr = &attrs[type];
 	d = mnl_attr_get_payload(nla[type]);
@@ -671,6 +1080,7 @@ attr2data(struct ipset_session *session, struct nlattr *nla[],
 					"address attribute!");
 			break;
 		case NFPROTO_IPV6:
+		case NFPROTO_INET:
 			atype = IPSET_ATTR_IPADDR_IPV6;
 			if (!ipattr[atype])
 				FAILURE("Broken kernel message: IPv6 address "
@@ -714,6 +1124,40 @@ attr2data(struct ipset_session *session, struct nlattr *nla[],
 		if (!d || strlen(d) >= attr->len)
 			FAILURE("Broken kernel message: "
 				"string type attribute missing or too long!");
+	} else if (attr->opt == IPSET_OPT_LOCKSTAT) {
+		struct ip_set_hash_lockstat tmp;
+
+		/* Ensure data alignment */
+		memcpy(&tmp, d, sizeof(tmp));
+		lockstat.acquired = be64toh(tmp.acquired);
+		lockstat.contended = be64toh(tmp.contended);
+		lockstat.wait = be64toh(tmp.wait);
+		lockstat.hold = be64toh(tmp.hold);
+		d = &lockstat;
+	} else if (attr->opt == IPSET_OPT_LOOKUPSTAT) {
+		struct ip_set_hash_lookupstat tmp;
+
+		/* Ensure data alignment */
+		memcpy(&tmp, d, sizeof(tmp));
+		lookupstat.tests = be64toh(tmp.tests);
+		lookupstat.hits = be64toh(tmp.hits);
+		lookupstat.misses = be64toh(tmp.misses);
+		for (i = 0; i < IPSET_LOOKUP_HIST; i++) {
+			lookupstat.probes[i] = be64toh(tmp.probes[i]);
+			lookupstat.compares[i] = be64toh(tmp.compares[i]);
+		}
+		d = &lookupstat;
+	} else if (attr->opt == IPSET_OPT_MEMSTAT) {
+		struct ip_set_hash_memstat tmp;
+
+		/* Ensure data alignment */
+		memcpy(&tmp, d, sizeof(tmp));
+		memstat.table = be64toh(tmp.table);
+		memstat.buckets = be64toh(tmp.buckets);
+		memstat.extensions = be64toh(tmp.extensions);
+		memstat.comments = be64toh(tmp.comments);
+		memstat.pending = be64toh(tmp.pending);
+		d = &memstat;
 	}
 #ifdef IPSET_DEBUG
 	 else
@@ -749,6 +1193,11 @@ static const char cmd2name[][9] = {
 	[IPSET_CMD_HEADER]	= "HEADER",
 	[IPSET_CMD_TYPE]	= "TYPE",
 	[IPSET_CMD_PROTOCOL]	= "PROTOCOL",
+	[IPSET_CMD_CLONE]	= "CLONE",
+	[IPSET_CMD_MONITOR]	= "MONITOR",
+	[IPSET_CMD_FREEZE]	= "FREEZE",
+	[IPSET_CMD_THAW]	= "THAW",
+	[IPSET_CMD_PURGE]	= "PURGE",
 };
 
 static inline int
@@ -763,21 +1212,19 @@ call_outfn(struct ipset_session *session)
 	return ret < 0 ? ret : 0;
 }
 
-/* Handle printing failures */
-static jmp_buf printf_failure;
-
+/* The lines to sort are collected in the buffer: it is doubled to
+ * keep the reallocations few for large sets */
 static void
 realloc_outbuf(struct ipset_session *session)
 {
-	char *buf = realloc(session->outbuf,
-			    session->outbuflen + IPSET_OUTBUFLEN);
+	char *buf = realloc(session->outbuf, 2 * session->outbuflen);
 	if (!buf) {
 		ipset_err(session,
 			  "Could not allocate memory to print sorted!");
-		longjmp(printf_failure, 1);
+		longjmp(session->printf_failure, 1);
 	}
 	session->outbuf = buf;
-	session->outbuflen += IPSET_OUTBUFLEN;
+	session->outbuflen *= 2;
 }
 
 static int
@@ -795,14 +1242,14 @@ handle_snprintf_error(struct ipset_session *session,
 		if (loop) {
 			ipset_err(session,
 				"Internal error at printing, loop detected!");
-			longjmp(printf_failure, 1);
+			longjmp(session->printf_failure, 1);
 		}
 
 		session->outbuf[session->pos] = '\0';
 		if (call_outfn(session)) {
 			ipset_err(session,
 				"Internal error, could not print output buffer!");
-			longjmp(printf_failure, 1);
+			longjmp(session->printf_failure, 1);
 		}
 		return 1;
 	}
@@ -830,6 +1277,21 @@ safe_snprintf(struct ipset_session *session, const char *fmt, ...)
 	return ret;
 }
 
+/* Append a string without format processing */
+static void
+safe_write(struct ipset_session *session, const char *str, size_t len)
+{
+	int loop = 0;
+
+	do {
+		if (session->pos + len < session->outbuflen) {
+			memcpy(session->outbuf + session->pos, str, len);
+			session->outbuf[session->pos + len] = '\0';
+		}
+		loop = handle_snprintf_error(session, len, loop);
+	} while (loop);
+}
+
 static int
 safe_dprintf(struct ipset_session *session, ipset_printfn fn,
 	     enum ipset_opt opt)
@@ -848,16 +1310,105 @@ safe_dprintf(struct ipset_session *session, ipset_printfn fn,
 	return ret;
 }
 
+/* The members are filtered by a pattern */
+static inline bool
+list_elem_filter(const struct ipset_session *session)
+{
+	return (session->match || session->regex) &&
+	       (session->cmd == IPSET_CMD_LIST ||
+		session->cmd == IPSET_CMD_SAVE);
+}
+
+/* The set headers are needed to filter or count the sets */
+static inline bool
+list_header_filter(const struct ipset_session *session)
+{
+	return session->conds ||
+	       (session->envopts & IPSET_ENV_LIST_TOTAL);
+}
+
+/* Just the matching members are counted, not printed */
+static inline bool
+list_count_only(const struct ipset_session *session)
+{
+	return list_elem_filter(session) &&
+	       session->mode != IPSET_LIST_SAVE &&
+	       (session->envopts &
+		(IPSET_ENV_LIST_SETNAME | IPSET_ENV_LIST_HEADER));
+}
+
+static bool
+list_elem_match(const struct ipset_session *session, const char *elem)
+{
+	bool match;
+
+	if (session->regex)
+		match = regexec(session->regex, elem, 0, NULL, 0) == 0;
+	else
+		match = fnmatch(session->match, elem, 0) == 0;
+
+	return match != session->match_not;
+}
+
+static bool
+list_header_match(const struct ipset_session *session)
+{
+	const struct ipset_data *data = session->data;
+	const struct ipset_header_cond *c;
+	uint32_t value;
+	uint8_t i;
+
+	for (i = 0; i < session->conds; i++) {
+		c = &session->cond[i];
+		if (!ipset_data_test(data, c->opt))
+			return false;
+		if (c->opt == IPSET_OPT_REVISION)
+			value = *(const uint8_t *) ipset_data_get(data, c->opt);
+		else
+			value = *(const uint32_t *) ipset_data_get(data, c->opt);
+		switch (c->cmp) {
+		case IPSET_CMP_EQ:
+			if (!(value == c->value))
+				return false;
+			break;
+		case IPSET_CMP_NE:
+			if (!(value != c->value))
+				return false;
+			break;
+		case IPSET_CMP_LT:
+			if (!(value < c->value))
+				return false;
+			break;
+		case IPSET_CMP_LE:
+			if (!(value <= c->value))
+				return false;
+			break;
+		case IPSET_CMP_GT:
+			if (!(value > c->value))
+				return false;
+			break;
+		case IPSET_CMP_GE:
+			if (!(value >= c->value))
+				return false;
+			break;
+		}
+	}
+	return true;
+}
+
 static int
 list_adt(struct ipset_session *session, struct nlattr *nla[])
 {
 	const struct ipset_data *data = session->data;
 	const struct ipset_type *type;
 	const struct ipset_arg *arg;
-	size_t offset = 0;
+	bool filter = list_elem_filter(session);
+	size_t start, elem, offset = 0;
 	int i, found = 0;
 
 	D("enter");
+	if (session->skip_set)
+		return MNL_CB_OK;
 	/* Check and load type, family */
 	if (!ipset_data_test(data, IPSET_OPT_TYPE))
 		type = ipset_type_get(session, IPSET_CMD_ADD);
@@ -876,6 +1427,15 @@ list_adt(struct ipset_session *session, struct nlattr *nla[])
 	if (!found)
 		return MNL_CB_OK;
 
+	/* A filtered out member is dropped from the buffer: it must not
+	 * be pushed out while the member is printed */
+	if (filter && !session->sort &&
+	    session->pos > session->outbuflen / 2 && call_outfn(session)) {
+		ipset_err(session,
+			  "Internal error, could not print output buffer!");
+		longjmp(session->printf_failure, 1);
+	}
+	start = session->pos;
 	if (session->sort) {
 		if (session->outbuflen <= session->pos + 1)
 			realloc_outbuf(session);
@@ -885,7 +1445,10 @@ list_adt(struct ipset_session *session, struct nlattr *nla[])
 
 	switch (session->mode) {
 	case IPSET_LIST_SAVE:
-		safe_snprintf(session, "add %s ", ipset_data_setname(data));
+		safe_write(session, "add ", 4);
+		safe_write(session, ipset_data_setname(data),
+			   strlen(ipset_data_setname(data)));
+		safe_write(session, " ", 1);
 		break;
 	case IPSET_LIST_XML:
 		safe_snprintf(session, "<member><elem>");
@@ -895,7 +1458,20 @@ list_adt(struct ipset_session *session, struct nlattr *nla[])
 		break;
 	}
 
+	elem = session->pos;
 	safe_dprintf(session, ipset_print_elem, IPSET_OPT_ELEM);
+	if (filter) {
+		/* The options are not printed for the dropped members */
+		bool match = list_elem_match(session, session->outbuf + elem);
+
+		if (match)
+			session->matched++;
+		if (!match || list_count_only(session)) {
+			session->pos = start;
+			session->outbuf[start] = '\0';
+			return MNL_CB_OK;
+		}
+	}
 	if (session->mode == IPSET_LIST_XML)
 		safe_snprintf(session, "</elem>");
 
@@ -908,11 +1484,12 @@ list_adt(struct ipset_session *session, struct nlattr *nla[])
 		switch (session->mode) {
 		case IPSET_LIST_SAVE:
 		case IPSET_LIST_PLAIN:
-			if (arg->has_arg == IPSET_NO_ARG) {
-				safe_snprintf(session, " %s", arg->name[0]);
+			safe_write(session, " ", 1);
+			safe_write(session, arg->name[0],
+				   strlen(arg->name[0]));
+			if (arg->has_arg == IPSET_NO_ARG)
 				break;
-			}
-			safe_snprintf(session, " %s ", arg->name[0]);
+			safe_write(session, " ", 1);
 			safe_dprintf(session, arg->print, arg->opt);
 			break;
 		case IPSET_LIST_XML:
@@ -933,25 +1510,48 @@ list_adt(struct ipset_session *session, struct nlattr *nla[])
 	if (session->mode == IPSET_LIST_XML)
 		safe_snprintf(session, "</member>\n");
 	else
-		safe_snprintf(session, "\n");
+		safe_write(session, "\n", 1);
 
 	if (session->sort) {
 		struct ipset_sorted *sorted;
 
-		if (!list_empty(&session->pool)) {
-			sorted = list_first_entry(&session->pool,
-					struct ipset_sorted, list);
-			list_del(&sorted->list);
-		} else {
-			sorted = calloc(1, sizeof(struct ipset_sorted));
+		if (session->sorted_num == session->sorted_max) {
+			size_t max = session->sorted_max ?
+				     2 * session->sorted_max : 1024;
+
+			sorted = realloc(session->sorted,
+					 max * sizeof(*sorted));
 			if (!sorted) {
 				ipset_err(session,
 					  "Could not allocate memory to print sorted!");
-				longjmp(printf_failure, 1);
+				longjmp(session->printf_failure, 1);
 			}
+			session->sorted = sorted;
+			session->sorted_max = max;
 		}
+		sorted = &session->sorted[session->sorted_num++];
 		sorted->offset = offset;
-		list_add_tail(&sorted->list, &session->sorted);
+		sorted->key = 0;
+		if (session->sort_top) {
+			enum ipset_opt opt = session->top_by == IPSET_TOP_PACKETS
+					     ? IPSET_OPT_PACKETS
+					     : IPSET_OPT_BYTES;
+
+			if (ipset_data_test(data, opt))
+				sorted->key = *(const uint64_t *)
+					ipset_data_get(data, opt);
+		} else if (session->sort_key) {
+			const union nf_inet_addr *ip =
+				ipset_data_get(data, IPSET_OPT_IP);
+			uint8_t cidr = ipset_data_test(data, IPSET_OPT_CIDR) ?
+				*(const uint8_t *)
+					ipset_data_get(data, IPSET_OPT_CIDR) :
+				32;
+
+			/* Same order as bystrcmp: larger cidr first */
+			sorted->key = (uint64_t) ntohl(ip->ip) << 8 |
+				      (uint8_t) ~cidr;
+		}
 	}
 	return MNL_CB_OK;
 }
@@ -960,6 +1560,20 @@ list_adt(struct ipset_session *session, struct nlattr *nla[])
 	((f) == NFPROTO_IPV4 ? "inet" :	\
 	 (f) == NFPROTO_IPV6 ? "inet6" : "any")
 
+/* The pages backing the hash table of the set */
+static const char *
+tablepages_name(const struct ipset_data *data)
+{
+	switch (*(const uint8_t *) ipset_data_get(data, IPSET_OPT_TABLEPAGES)) {
+	case IPSET_PAGES_CONTIG:
+		return "contiguous";
+	case IPSET_PAGES_HUGE:
+		return "huge";
+	default:
+		return "vmalloc";
+	}
+}
+
 static int
 list_create(struct ipset_session *session, struct nlattr *nla[])
 {
@@ -980,9 +1594,36 @@ list_create(struct ipset_session *session, struct nlattr *nla[])
 		return MNL_CB_ERROR;
 	family = ipset_data_family(data);
 
+	session->matched = 0;
+	session->sort = false;
+	if (session->conds && !list_header_match(session)) {
+		session->skip_set = true;
+		return MNL_CB_OK;
+	}
+	session->set_memsize = ipset_data_test(data, IPSET_OPT_MEMSIZE) ?
+		*(const uint32_t *) ipset_data_get(data, IPSET_OPT_MEMSIZE) : 0;
+	if (!list_elem_filter(session) &&
+	    ipset_data_test(data, IPSET_OPT_ELEMENTS))
+		session->matched =
+			*(const uint32_t *) ipset_data_get(data,
+							   IPSET_OPT_ELEMENTS);
+	/* Just the names of the matching sets are printed when done */
+	if (session->envopts & IPSET_ENV_LIST_SETNAME &&
+	    session->mode != IPSET_LIST_SAVE)
+		return MNL_CB_OK;
+
 	session->save_elem_prefix = strlen(ipset_data_setname(data)) + 5;
 	switch (session->mode) {
 	case IPSET_LIST_SAVE:
+		/* The scrapers of the changes need the epoch */
+		if ((session->envopts &
+		     (IPSET_ENV_LIST_CHANGED | IPSET_ENV_LIST_RESET)) &&
+		    ipset_data_test(data, IPSET_OPT_EPOCH)) {
+			safe_snprintf(session, "# epoch ");
+			safe_dprintf(session, ipset_print_number,
+				     IPSET_OPT_EPOCH);
+			safe_snprintf(session, "\n");
+		}
 		safe_snprintf(session, "create %s %s",
 			      ipset_data_setname(data),
 			      type->name);
@@ -1055,6 +1696,69 @@ list_create(struct ipset_session *session, struct nlattr *nla[])
 			safe_snprintf(session, "\nNumber of entries: ");
 			safe_dprintf(session, ipset_print_number, IPSET_OPT_ELEMENTS);
 		}
+		if (ipset_data_test(data, IPSET_OPT_BLOOM_FPR)) {
+			const uint32_t *fpr =
+				ipset_data_get(data, IPSET_OPT_BLOOM_FPR);
+
+			/* Reported in parts per million */
+			safe_snprintf(session,
+				      "\nBloom false positive rate: %u.%04u%%",
+				      *fpr / 10000, *fpr % 10000);
+		}
+		if (ipset_data_test(data, IPSET_OPT_LOCKSTAT)) {
+			const struct ipset_lockstat *ls =
+				ipset_data_get(data, IPSET_OPT_LOCKSTAT);
+
+			safe_snprintf(session,
+				      "\nRegion locks: acquired %llu, "
+				      "contended %llu, wait %llu ns, "
+				      "hold %llu ns",
+				      (unsigned long long) ls->acquired,
+				      (unsigned long long) ls->contended,
+				      (unsigned long long) ls->wait,
+				      (unsigned long long) ls->hold);
+		}
+		if (ipset_data_test(data, IPSET_OPT_MEMSTAT)) {
+			const struct ipset_memstat *ms =
+				ipset_data_get(data, IPSET_OPT_MEMSTAT);
+
+			safe_snprintf(session,
+				      "\nMemory usage: table %llu, "
+				      "buckets %llu, extensions %llu, "
+				      "comments %llu, pending free %llu",
+				      (unsigned long long) ms->table,
+				      (unsigned long long) ms->buckets,
+				      (unsigned long long) ms->extensions,
+				      (unsigned long long) ms->comments,
+				      (unsigned long long) ms->pending);
+		}
+		if (ipset_data_test(data, IPSET_OPT_TABLEPAGES))
+			safe_snprintf(session, "\nTable pages: %s",
+				      tablepages_name(data));
+		if (ipset_data_test(data, IPSET_OPT_LOOKUPSTAT)) {
+			const struct ipset_lookupstat *st =
+				ipset_data_get(data, IPSET_OPT_LOOKUPSTAT);
+
+			safe_snprintf(session,
+				      "\nLookups: tests %llu, hits %llu, "
+				      "misses %llu",
+				      (unsigned long long) st->tests,
+				      (unsigned long long) st->hits,
+				      (unsigned long long) st->misses);
+			safe_snprintf(session, "\nLookup probes:");
+			for (i = 0; i < IPSET_LOOKUP_HIST; i++)
+				safe_snprintf(session, " %llu",
+					(unsigned long long) st->probes[i]);
+			safe_snprintf(session, "\nLookup compares:");
+			for (i = 0; i < IPSET_LOOKUP_HIST; i++)
+				safe_snprintf(session, " %llu",
+					(unsigned long long) st->compares[i]);
+		}
+		if (ipset_data_test(data, IPSET_OPT_EPOCH)) {
+			safe_snprintf(session, "\nEpoch: ");
+			safe_dprintf(session, ipset_print_number,
+				     IPSET_OPT_EPOCH);
+		}
 		safe_snprintf(session,
 			session->envopts & IPSET_ENV_LIST_HEADER ?
 			"\n" : "\nMembers:\n");
@@ -1070,6 +1774,72 @@ list_create(struct ipset_session *session, struct nlattr *nla[])
 			safe_dprintf(session, ipset_print_number, IPSET_OPT_ELEMENTS);
 			safe_snprintf(session, "</numentries>\n");
 		}
+		if (ipset_data_test(data, IPSET_OPT_BLOOM_FPR)) {
+			safe_snprintf(session, "<bloomfpr>");
+			safe_dprintf(session, ipset_print_number,
+				     IPSET_OPT_BLOOM_FPR);
+			safe_snprintf(session, "</bloomfpr>\n");
+		}
+		if (ipset_data_test(data, IPSET_OPT_LOCKSTAT)) {
+			const struct ipset_lockstat *ls =
+				ipset_data_get(data, IPSET_OPT_LOCKSTAT);
+
+			safe_snprintf(session,
+				      "<lockstat><acquired>%llu</acquired>"
+				      "<contended>%llu</contended>"
+				      "<wait>%llu</wait><hold>%llu</hold>"
+				      "</lockstat>\n",
+				      (unsigned long long) ls->acquired,
+				      (unsigned long long) ls->contended,
+				      (unsigned long long) ls->wait,
+				      (unsigned long long) ls->hold);
+		}
+		if (ipset_data_test(data, IPSET_OPT_MEMSTAT)) {
+			const struct ipset_memstat *ms =
+				ipset_data_get(data, IPSET_OPT_MEMSTAT);
+
+			safe_snprintf(session,
+				      "<memstat><table>%llu</table>"
+				      "<buckets>%llu</buckets>"
+				      "<extensions>%llu</extensions>"
+				      "<comments>%llu</comments>"
+				      "<pending>%llu</pending></memstat>\n",
+				      (unsigned long long) ms->table,
+				      (unsigned long long) ms->buckets,
+				      (unsigned long long) ms->extensions,
+				      (unsigned long long) ms->comments,
+				      (unsigned long long) ms->pending);
+		}
+		if (ipset_data_test(data, IPSET_OPT_TABLEPAGES))
+			safe_snprintf(session,
+				      "<tablepages>%s</tablepages>\n",
+				      tablepages_name(data));
+		if (ipset_data_test(data, IPSET_OPT_LOOKUPSTAT)) {
+			const struct ipset_lookupstat *st =
+				ipset_data_get(data, IPSET_OPT_LOOKUPSTAT);
+
+			safe_snprintf(session,
+				      "<lookupstat><tests>%llu</tests>"
+				      "<hits>%llu</hits>"
+				      "<misses>%llu</misses><probes>",
+				      (unsigned long long) st->tests,
+				      (unsigned long long) st->hits,
+				      (unsigned long long) st->misses);
+			for (i = 0; i < IPSET_LOOKUP_HIST; i++)
+				safe_snprintf(session, i ? " %llu" : "%llu",
+					(unsigned long long) st->probes[i]);
+			safe_snprintf(session, "</probes><compares>");
+			for (i = 0; i < IPSET_LOOKUP_HIST; i++)
+				safe_snprintf(session, i ? " %llu" : "%llu",
+					(unsigned long long) st->compares[i]);
+			safe_snprintf(session, "</compares></lookupstat>\n");
+		}
+		if (ipset_data_test(data, IPSET_OPT_EPOCH)) {
+			safe_snprintf(session, "<epoch>");
+			safe_dprintf(session, ipset_print_number,
+				     IPSET_OPT_EPOCH);
+			safe_snprintf(session, "</epoch>\n");
+		}
 		safe_snprintf(session,
 			session->envopts & IPSET_ENV_LIST_HEADER ?
 			"</header>\n" :
@@ -1081,7 +1851,23 @@ list_create(struct ipset_session *session, struct nlattr *nla[])
 	session->printed_set++;
 
 	session->sort = strncmp(type->name, "hash:", 5) == 0 &&
-			ipset_envopt_test(session, IPSET_ENV_SORTED);
+			ipset_envopt_test(session, IPSET_ENV_SORTED) &&
+			!list_count_only(session);
+	/* Single IPv4 address or network elements are sorted
+	 * by their binary values */
+	session->sort_key = session->sort &&
+			    type->dimension == IPSET_DIM_ONE &&
+			    ipset_data_family(data) == NFPROTO_IPV4 &&
+			    !(session->envopts & IPSET_ENV_RESOLVE);
+	/* The top elements are sorted by the counters and cut here: the
+	 * kernel sends the candidates only for the hash types.
+	 */
+	session->sort_top = session->top && session->mode != IPSET_LIST_BINARY &&
+			    !list_count_only(session);
+	if (session->sort_top) {
+		session->sort = true;
+		session->sort_key = false;
+	}
 
 	return MNL_CB_OK;
 }
@@ -1089,13 +1875,16 @@ list_create(struct ipset_session *session, struct nlattr *nla[])
 /* "<member><elem>" */
 #define XML_ELEM_PREFIX_LEN	14
 
+/* The session of the entries sorted by qsort() in this thread */
+static __thread struct ipset_session *sort_session;
+
 /* Core should handle sorting more directly */
 static int
-bystrcmp(void *priv, struct list_head *a, struct list_head *b)
+bystrcmp(const void *a, const void *b)
 {
-	struct ipset_session *session = priv;
-	struct ipset_sorted *x = list_entry(a, struct ipset_sorted, list);
-	struct ipset_sorted *y = list_entry(b, struct ipset_sorted, list);
+	struct ipset_session *session = sort_session;
+	const struct ipset_sorted *x = a;
+	const struct ipset_sorted *y = b;
 	char *sep1, *x1 = session->outbuf + x->offset;
 	char *sep2, *x2 = session->outbuf + y->offset;
 	long int n1, n2;
@@ -1171,48 +1960,363 @@ bystrcmp(void *priv, struct list_head *a, struct list_head *b)
 	return *x1 != '\0' ? 1 : (*x2 != '\0' ? -1 : 0);
 }
 
+/* LSD radix sort of the entries by their binary keys. The passes
+ * in which all keys have got the same byte are skipped. */
 static int
-print_set_done(struct ipset_session *session, bool callback_done)
+radix_sort(struct ipset_session *session)
 {
-	D("called for %s", session->saved_setname[0] == '\0'
-		? "NONE" : session->saved_setname);
-	if (session->sort) {
-		struct ipset_sorted *pos;
-		int ret;
+	struct ipset_sorted *src = session->sorted, *dst, *tmp, *buf;
+	size_t n = session->sorted_num, count[256], i, c, sum;
+	unsigned int shift, b;
 
-		/* Print set header */
-		ret = call_outfn(session);
+	if (n < 2)
+		return 0;
+	buf = dst = malloc(n * sizeof(*dst));
+	if (!buf)
+		return -1;
+	for (shift = 0; shift < IPSET_SORT_KEYBITS; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(src[i].key >> shift) & 0xff]++;
+		if (count[(src[0].key >> shift) & 0xff] == n)
+			continue;
+		for (b = 0, sum = 0; b < 256; b++) {
+			c = count[b];
+			count[b] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != session->sorted)
+		memcpy(session->sorted, src, n * sizeof(*src));
+	free(buf);
+	return 0;
+}
 
-		if (ret)
-			return MNL_CB_ERROR;
+/* Larger counters first, the listing order is kept otherwise */
+static int
+bycounter(const void *a, const void *b)
+{
+	const struct ipset_sorted *x = a;
+	const struct ipset_sorted *y = b;
 
-		list_sort(session, &session->sorted, bystrcmp);
+	if (x->key != y->key)
+		return x->key < y->key ? 1 : -1;
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
 
-		list_for_each_entry(pos, &session->sorted, list) {
+/* Print the sorted entries, collected into chunks when possible */
+static int
+print_sorted(struct ipset_session *session)
+{
+	char *chunk = malloc(IPSET_LIST_OUTBUFLEN);
+	size_t i, len, pos = 0;
+	const char *line;
+	int ret = 0;
+
+	for (i = 0; i < session->sorted_num && ret >= 0; i++) {
+		line = session->outbuf + session->sorted[i].offset;
+		len = strlen(line);
+		if (chunk && pos + len >= IPSET_LIST_OUTBUFLEN && pos) {
+			chunk[pos] = '\0';
 			ret = session->print_outfn(session, session->p,
-					"%s",
-					session->outbuf + pos->offset);
-			if (ret < 0)
-				return MNL_CB_ERROR;
+						   "%s", chunk);
+			pos = 0;
+		}
+		if (chunk && len < IPSET_LIST_OUTBUFLEN) {
+			memcpy(chunk + pos, line, len);
+			pos += len;
+		} else if (ret >= 0) {
+			ret = session->print_outfn(session, session->p,
+						   "%s", line);
 		}
-		list_splice(&session->sorted, &session->pool);
-		INIT_LIST_HEAD(&session->sorted);
 	}
-	switch (session->mode) {
+	if (chunk && pos && ret >= 0) {
+		chunk[pos] = '\0';
+		ret = session->print_outfn(session, session->p, "%s", chunk);
+	}
+	free(chunk);
+	return ret < 0 ? ret : 0;
+}
+
+/* Binary save: the blocks of the elements are built in the output
+ * buffer and written to the output stream directly */
+static int
+binary_write(struct ipset_session *session, const void *buf, size_t len)
+{
+#ifdef HAVE_ZLIB
+	/* The binary restore files are mapped */
+	if (session->gzout)
+		return ipset_err(session,
+				 "Binary output cannot be compressed");
+#endif
+	if (fwrite(buf, 1, len, session->ostream) != len)
+		return ipset_err(session,
+				 "Cannot write binary output: %s",
+				 strerror(errno));
+	return 0;
+}
+
+static int
+binary_flush(struct ipset_session *session)
+{
+	uint32_t count = htonl(session->bin_count);
+
+	memcpy(session->outbuf, &count, sizeof(count));
+	session->bin_crc = ipset_crc32(session->bin_crc, session->outbuf,
+				       session->pos);
+	session->bin_count = 0;
+	if (binary_write(session, session->outbuf, session->pos) < 0)
+		return -1;
+	session->pos = sizeof(count);
+	return 0;
+}
+
+static int
+binary_create(struct ipset_session *session, struct nlattr *nla[])
+{
+	const struct ipset_data *data = session->data;
+	const struct ipset_type *type;
+	struct ipset_binary_set set = {};
+	int ret;
+
+	/* The create line is printed as in save mode, without newline */
+	session->mode = IPSET_LIST_SAVE;
+	ret = list_create(session, nla);
+	session->mode = IPSET_LIST_BINARY;
+	session->sort = false;
+	if (ret != MNL_CB_OK)
+		return ret;
+	type = ipset_data_get(data, IPSET_OPT_TYPE);
+	if (!type->packed_adt)
+		FAILURE("Set %s of type %s cannot be saved in binary format.",
+			ipset_data_setname(data), type->name);
+
+	if (session->printed_set == 1) {
+		struct ipset_binary_header header = {
+			.version = htonl(IPSET_BINARY_VERSION),
+		};
+
+		memcpy(header.magic, IPSET_BINARY_MAGIC, sizeof(header.magic));
+		if (binary_write(session, &header, sizeof(header)) < 0)
+			return MNL_CB_ERROR;
+	}
+	ipset_strlcpy(set.setname, ipset_data_setname(data),
+		      sizeof(set.setname));
+	set.createlen = htons(session->pos - 1);
+	set.family = ipset_data_family(data);
+	set.flags = session->bin_flags =
+		ipset_data_test(data, IPSET_OPT_TIMEOUT) ?
+		IPSET_PACKED_TIMEOUT : 0;
+	session->bin_stride =
+		(set.family == NFPROTO_IPV4 ? sizeof(uint32_t)
+					    : sizeof(struct in6_addr)) +
+		(set.flags & IPSET_PACKED_TIMEOUT ? sizeof(uint32_t) : 0);
+	session->bin_crc = ipset_crc32(0, &set, sizeof(set));
+	session->bin_crc = ipset_crc32(session->bin_crc, session->outbuf,
+				       session->pos - 1);
+	if (binary_write(session, &set, sizeof(set)) < 0 ||
+	    binary_write(session, session->outbuf, session->pos - 1) < 0)
+		return MNL_CB_ERROR;
+	/* Room for the count of the first block */
+	session->pos = sizeof(uint32_t);
+	session->bin_count = 0;
+
+	return MNL_CB_OK;
+}
+
+static int
+binary_adt(struct ipset_session *session, struct nlattr *nla[])
+{
+	const struct ipset_data *data = session->data;
+	bool timeout = session->bin_flags & IPSET_PACKED_TIMEOUT;
+	size_t alen;
+	char *tail;
+	int i;
+
+	for (i = IPSET_ATTR_UNSPEC + 1; i <= IPSET_ATTR_ADT_MAX; i++)
+		if (nla[i])
+			ATTR2DATA(session, nla, i, adt_attrs);
+	if (!ipset_data_test(data, IPSET_OPT_IP) ||
+	    ipset_data_test(data, IPSET_OPT_TIMEOUT) != timeout ||
+	    (ipset_data_flags(data) & IPSET_ADT_FLAGS &
+	     ~(IPSET_FLAG(IPSET_OPT_IP) | IPSET_FLAG(IPSET_OPT_TIMEOUT))))
+		FAILURE("An element of set %s cannot be saved "
+			"in binary format.", ipset_data_setname(data));
+
+	if (session->pos + session->bin_stride > session->outbuflen &&
+	    binary_flush(session) < 0)
+		return MNL_CB_ERROR;
+	tail = session->outbuf + session->pos;
+	alen = session->bin_stride - (timeout ? sizeof(uint32_t) : 0);
+	memcpy(tail, ipset_data_get(data, IPSET_OPT_IP), alen);
+	if (timeout) {
+		uint32_t value = htonl(*(const uint32_t *)
+				ipset_data_get(data, IPSET_OPT_TIMEOUT));
+
+		memcpy(tail + alen, &value, sizeof(value));
+	}
+	session->pos += session->bin_stride;
+	session->bin_count++;
+
+	return MNL_CB_OK;
+}
+
+/* Write the last block, the empty one and the CRC32 of the set */
+static int
+binary_done(struct ipset_session *session)
+{
+	uint32_t crc;
+	int ret = 0;
+
+	if (session->bin_count)
+		ret = binary_flush(session);
+	if (ret == 0)
+		ret = binary_flush(session);
+	crc = htonl(session->bin_crc);
+	if (ret == 0)
+		ret = binary_write(session, &crc, sizeof(crc));
+	session->bin_stride = 0;
+	session->outbuf[0] = '\0';
+	session->pos = 0;
+
+	return ret;
+}
+
+/* Print the name of the set listed by the filters and count it */
+static void
+list_set_done(struct ipset_session *session)
+{
+	if (session->envopts & IPSET_ENV_LIST_SETNAME &&
+	    session->mode != IPSET_LIST_SAVE) {
+		if (list_elem_filter(session) && !session->matched)
+			return;
+		if (session->mode == IPSET_LIST_XML)
+			safe_snprintf(session, "<ipset name=\"%s\"/>\n",
+				      session->saved_setname);
+		else
+			safe_snprintf(session, "%s\n", session->saved_setname);
+	} else if (list_elem_filter(session) &&
+		   session->mode == IPSET_LIST_PLAIN) {
+		safe_snprintf(session, "Matched entries: %u\n",
+			      session->matched);
+	}
+	session->total_sets++;
+	session->total_elements += session->matched;
+	session->total_memsize += session->set_memsize;
+}
+
+/* Element callback: the data is filled in from the attributes and
+ * passed to the callback, nothing is printed */
+static int
+elem_create(struct ipset_session *session, struct nlattr *nla[])
+{
+	int i;
+
+	for (i = IPSET_ATTR_UNSPEC + 1; i <= IPSET_ATTR_CREATE_MAX; i++)
+		if (nla[i])
+			ATTR2DATA(session, nla, i, create_attrs);
+
+	return ipset_type_check(session) ? MNL_CB_OK : MNL_CB_ERROR;
+}
+
+static int
+elem_adt(struct ipset_session *session, struct nlattr *nla[])
+{
+	int i, found = 0;
+
+	for (i = IPSET_ATTR_UNSPEC + 1; i <= IPSET_ATTR_ADT_MAX; i++)
+		if (nla[i]) {
+			found++;
+			ATTR2DATA(session, nla, i, adt_attrs);
+		}
+	if (!found)
+		return MNL_CB_OK;
+
+	return session->elem_fn(session, session->elem_p,
+				session->data) < 0 ? MNL_CB_ERROR : MNL_CB_OK;
+}
+
+static int
+print_set_done(struct ipset_session *session, bool callback_done)
+{
+	bool listed = !session->skip_set &&
+		      session->saved_setname[0] != '\0';
+
+	D("called for %s", session->saved_setname[0] == '\0'
+		? "NONE" : session->saved_setname);
+	if (session->sort) {
+		int ret;
+
+		/* Print set header */
+		ret = call_outfn(session);
+
+		if (ret)
+			return MNL_CB_ERROR;
+
+		if (session->sort_top) {
+			qsort(session->sorted, session->sorted_num,
+			      sizeof(*session->sorted), bycounter);
+			if (session->sorted_num > session->top)
+				session->sorted_num = session->top;
+		} else if (!session->sort_key || radix_sort(session) < 0) {
+			sort_session = session;
+			qsort(session->sorted, session->sorted_num,
+			      sizeof(*session->sorted), bystrcmp);
+		}
+		ret = print_sorted(session);
+		session->sorted_num = 0;
+		if (ret < 0)
+			return MNL_CB_ERROR;
+	}
+	switch (session->mode) {
+	case IPSET_LIST_BINARY:
+		if (session->bin_stride && binary_done(session) < 0)
+			return MNL_CB_ERROR;
+		break;
+	case IPSET_LIST_ELEM:
+		session->skip_set = false;
+		return MNL_CB_STOP;
 	case IPSET_LIST_XML:
-		if (session->envopts & IPSET_ENV_LIST_SETNAME)
-			break;
-		if (session->envopts & IPSET_ENV_LIST_HEADER) {
-			if (session->saved_setname[0] != '\0')
-				safe_snprintf(session, "</ipset>\n");
+		if (listed)
+			list_set_done(session);
+		if (!listed || session->envopts & IPSET_ENV_LIST_SETNAME)
 			break;
-		}
-		if (session->saved_setname[0] != '\0')
-			safe_snprintf(session, "</members>\n</ipset>\n");
+		if (!(session->envopts & IPSET_ENV_LIST_HEADER))
+			safe_snprintf(session, "</members>\n");
+		if (list_elem_filter(session))
+			safe_snprintf(session, "<matched>%u</matched>\n",
+				      session->matched);
+		safe_snprintf(session, "</ipset>\n");
 		break;
 	default:
+		if (listed)
+			list_set_done(session);
 		break;
 	}
+	session->skip_set = false;
+	if (callback_done && session->envopts & IPSET_ENV_LIST_TOTAL) {
+		if (session->mode == IPSET_LIST_XML)
+			safe_snprintf(session,
+				      "<total><sets>%u</sets>"
+				      "<entries>%llu</entries>"
+				      "<memsize>%llu</memsize></total>\n",
+				      session->total_sets,
+				      (unsigned long long) session->total_elements,
+				      (unsigned long long) session->total_memsize);
+		else if (session->mode == IPSET_LIST_PLAIN)
+			safe_snprintf(session,
+				      "\nTotal sets: %u\n"
+				      "Total entries: %llu\n"
+				      "Total size in memory: %llu\n",
+				      session->total_sets,
+				      (unsigned long long) session->total_elements,
+				      (unsigned long long) session->total_memsize);
+	}
 	if (callback_done && session->mode == IPSET_LIST_XML)
 		safe_snprintf(session, "</ipsets>\n");
 	return call_outfn(session) ? MNL_CB_ERROR : MNL_CB_STOP;
@@ -1224,7 +2328,7 @@ callback_list(struct ipset_session *session, struct nlattr *nla[],
 {
 	struct ipset_data *data = session->data;
 
-	if (setjmp(printf_failure)) {
+	if (setjmp(session->printf_failure)) {
 		session->saved_setname[0] = '\0';
 		session->printed_set = 0;
 		return MNL_CB_ERROR;
@@ -1237,7 +2341,10 @@ callback_list(struct ipset_session *session, struct nlattr *nla[],
 	ATTR2DATA(session, nla, IPSET_ATTR_SETNAME, cmd_attrs);
 	D("setname %s", ipset_data_setname(data));
 	if (session->envopts & IPSET_ENV_LIST_SETNAME &&
-	    session->mode != IPSET_LIST_SAVE) {
+	    session->mode != IPSET_LIST_SAVE &&
+	    session->mode != IPSET_LIST_BINARY &&
+	    session->mode != IPSET_LIST_ELEM &&
+	    !list_elem_filter(session) && !list_header_filter(session)) {
 		if (session->mode == IPSET_LIST_XML)
 			safe_snprintf(session, "<ipset name=\"%s\"/>\n",
 				      ipset_data_setname(data));
@@ -1277,6 +2384,7 @@ callback_list(struct ipset_session *session, struct nlattr *nla[],
 
 		/* Reset CREATE specific flags */
 		ipset_data_flags_unset(data, IPSET_CREATE_FLAGS);
+		ipset_data_ext_flags_unset(data, IPSET_FLAGS_ALL);
 		D("nla typename %s",
 		  (char *) mnl_attr_get_payload(nla[IPSET_ATTR_TYPENAME]));
 
@@ -1291,7 +2399,11 @@ callback_list(struct ipset_session *session, struct nlattr *nla[],
 			FAILURE("Broken %s kernel message: "
 				"cannot validate DATA attributes!",
 				cmd2name[cmd]);
-		if (list_create(session, cattr) != MNL_CB_OK)
+		if ((session->mode == IPSET_LIST_BINARY ?
+		     binary_create(session, cattr) :
+		     session->mode == IPSET_LIST_ELEM ?
+		     elem_create(session, cattr) :
+		     list_create(session, cattr)) != MNL_CB_OK)
 			return MNL_CB_ERROR;
 		strcpy(session->saved_setname, ipset_data_setname(data));
 	}
@@ -1308,15 +2420,78 @@ callback_list(struct ipset_session *session, struct nlattr *nla[],
 				FAILURE("Broken %s kernel message: "
 					"cannot validate ADT attributes!",
 					cmd2name[cmd]);
-			if (list_adt(session, adt) != MNL_CB_OK)
+			if ((session->mode == IPSET_LIST_BINARY ?
+			     binary_adt(session, adt) :
+			     session->mode == IPSET_LIST_ELEM ?
+			     elem_adt(session, adt) :
+			     list_adt(session, adt)) != MNL_CB_OK)
 				return MNL_CB_ERROR;
 		}
-		if (session->sort)
+		/* Print the elements in large chunks, the rest is
+		 * printed when the set is done */
+		if (session->sort ||
+		    session->pos < session->outbuflen / 2)
 			return MNL_CB_OK;
 	}
+	if (session->mode == IPSET_LIST_BINARY ||
+	    session->mode == IPSET_LIST_ELEM)
+		/* Blocks are written when full or the set is done */
+		return MNL_CB_OK;
 	return call_outfn(session) ? MNL_CB_ERROR : MNL_CB_OK;
 }
 
+static int
+callback_test(struct ipset_session *session, struct nlattr *nla[])
+{
+	struct ipset_data *saved = session->data;
+	struct nlattr *tb, *adt[IPSET_ATTR_ADT_MAX+1];
+	int ret = MNL_CB_OK;
+
+	if (!(nla[IPSET_ATTR_SETNAME] && nla[IPSET_ATTR_FAMILY] &&
+	      nla[IPSET_ATTR_ADT]))
+		FAILURE("Broken TEST kernel message: missing %s!",
+			!nla[IPSET_ATTR_SETNAME] ? "setname" :
+			!nla[IPSET_ATTR_FAMILY] ? "family" : "elements");
+
+	/* The data may already hold the next element to be sent */
+	session->data = ipset_data_init();
+	if (!session->data) {
+		session->data = saved;
+		FAILURE("Cannot allocate memory for the TEST reply");
+	}
+	if (attr2data(session, nla, IPSET_ATTR_SETNAME, cmd_attrs) < 0 ||
+	    attr2data(session, nla, IPSET_ATTR_FAMILY, cmd_attrs) < 0) {
+		ret = MNL_CB_ERROR;
+		goto out;
+	}
+	ipset_data_set(session->data, IPSET_OPT_TYPE, session->saved_type);
+
+	if (setjmp(session->printf_failure)) {
+		ret = MNL_CB_ERROR;
+		goto out;
+	}
+	/* Print the elements which are not in the set */
+	mnl_attr_for_each_nested(tb, nla[IPSET_ATTR_ADT]) {
+		memset(adt, 0, sizeof(adt));
+		ipset_data_flags_unset(session->data, IPSET_ADT_FLAGS);
+		if (mnl_attr_parse_nested(tb, adt_attr_cb, adt) < 0) {
+			ipset_err(session, "Broken TEST kernel message: "
+				  "cannot validate ADT attributes!");
+			ret = MNL_CB_ERROR;
+			goto out;
+		}
+		ret = list_adt(session, adt);
+		if (ret != MNL_CB_OK)
+			goto out;
+	}
+	if (call_outfn(session))
+		ret = MNL_CB_ERROR;
+out:
+	ipset_data_fini(session->data);
+	session->data = saved;
+	return ret;
+}
+
 #ifndef IPSET_PROTOCOL_MIN
 #define IPSET_PROTOCOL_MIN	IPSET_PROTOCOL
 #endif
@@ -1325,6 +2500,277 @@ callback_list(struct ipset_session *session, struct nlattr *nla[],
 #define IPSET_PROTOCOL_MAX	IPSET_PROTOCOL
 #endif
 
+/*
+ * Cache file of the optimistic mode
+ *
+ * Single commands may skip the PROTOCOL and HEADER round trips by
+ * reusing the protocol version and the set types negotiated by the
+ * previous commands. The header line of the file records the boot
+ * and network namespace the data is valid in:
+ *
+ *	ipset-cache BOOT_ID NETNS_INODE PROTOCOL
+ *	TYPENAME FAMILY REVISION SETNAME
+ *	...
+ */
+
+#ifndef IPSET_CACHE_FILE
+#define IPSET_CACHE_FILE	"/run/ipset.cache"
+#endif
+#define IPSET_CACHE_IDLEN	80
+
+static const char *
+cache_file_name(void)
+{
+	const char *name = getenv("IPSET_CACHE_FILE");
+
+	return name && *name ? name : IPSET_CACHE_FILE;
+}
+
+static bool
+cache_file_id(char *id, size_t len)
+{
+	char boot[40];
+	struct stat st;
+	FILE *f;
+	bool ok;
+
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (!f)
+		return false;
+	ok = fgets(boot, sizeof(boot), f) != NULL;
+	fclose(f);
+	if (!ok || stat("/proc/self/ns/net", &st) < 0)
+		return false;
+	boot[strcspn(boot, "\n")] = '\0';
+	snprintf(id, len, "ipset-cache %s %lu",
+		 boot, (unsigned long) st.st_ino);
+	return true;
+}
+
+/* Open the file and check its header */
+static FILE *
+cache_file_open(uint8_t *protocol)
+{
+	char id[IPSET_CACHE_IDLEN], line[IPSET_CACHE_IDLEN];
+	unsigned int proto;
+	size_t len;
+	FILE *f;
+
+	if (!cache_file_id(id, sizeof(id)))
+		return NULL;
+	f = fopen(cache_file_name(), "r");
+	if (!f)
+		return NULL;
+	len = strlen(id);
+	if (fgets(line, sizeof(line), f) == NULL ||
+	    strncmp(line, id, len) != 0 || line[len] != ' ' ||
+	    sscanf(line + len, "%u", &proto) != 1 ||
+	    proto < IPSET_PROTOCOL_MIN || proto > IPSET_PROTOCOL_MAX) {
+		fclose(f);
+		return NULL;
+	}
+	*protocol = proto;
+	return f;
+}
+
+static inline bool
+may_guess(const struct ipset_session *session)
+{
+	return session->envopts & IPSET_ENV_OPTIMISTIC &&
+	       session->lineno == 0 && !session->no_guess;
+}
+
+/* Use the cached protocol version */
+static int
+cache_file_protocol(struct ipset_session *session)
+{
+	FILE *f = cache_file_open(&session->protocol);
+
+	if (!f)
+		return -1;
+	fclose(f);
+	session->version_checked = true;
+	session->guessed = true;
+	return 0;
+}
+
+/* Fill up the data as the HEADER reply of the kernel would */
+static int
+cache_file_header(struct ipset_session *session)
+{
+	struct ipset_data *data = session->data;
+	const char *setname = ipset_data_setname(data);
+	char line[2 * IPSET_MAXNAMELEN + 16];
+	char typename[IPSET_MAXNAMELEN], scanned[IPSET_MAXNAMELEN];
+	unsigned int family, revision;
+	uint8_t protocol, u8;
+	bool found = false;
+	FILE *f;
+	int n;
+
+	f = cache_file_open(&protocol);
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "%31s %u %u %n",
+			   scanned, &family, &revision, &n) != 3 ||
+		    !STREQ(line + n, setname))
+			continue;
+		/* The last line of the set is the valid one */
+		ipset_strlcpy(typename, scanned, sizeof(typename));
+		found = true;
+	}
+	fclose(f);
+	if (!found)
+		return -1;
+
+	ipset_data_set(data, IPSET_OPT_TYPENAME, typename);
+	u8 = revision;
+	ipset_data_set(data, IPSET_OPT_REVISION, &u8);
+	u8 = family;
+	ipset_data_set(data, IPSET_OPT_FAMILY, &u8);
+	session->guessed = true;
+	return 0;
+}
+
+/* Record the set type received from the kernel */
+static void
+cache_file_store(struct ipset_session *session)
+{
+	const struct ipset_data *data = session->data;
+	const char *setname = ipset_data_setname(data);
+	const char *name = cache_file_name();
+	char id[IPSET_CACHE_IDLEN], *tmp;
+	uint8_t protocol;
+	FILE *f;
+	int fd;
+
+	/* Names which cannot be read back are not cached */
+	if (setname[0] == '\0' || isspace((unsigned char)setname[0]) ||
+	    strchr(setname, '\n') != NULL)
+		return;
+
+	f = cache_file_open(&protocol);
+	if (f != NULL && protocol == session->protocol) {
+		fclose(f);
+		f = fopen(name, "a");
+		if (!f)
+			return;
+	} else {
+		/* Start a new file, which is renamed into place */
+		if (f)
+			fclose(f);
+		if (!cache_file_id(id, sizeof(id)))
+			return;
+		tmp = malloc(strlen(name) + sizeof(".XXXXXX"));
+		if (!tmp)
+			return;
+		sprintf(tmp, "%s.XXXXXX", name);
+		fd = mkstemp(tmp);
+		f = fd < 0 ? NULL : fdopen(fd, "w");
+		if (!f) {
+			if (fd >= 0) {
+				close(fd);
+				unlink(tmp);
+			}
+			free(tmp);
+			return;
+		}
+		fprintf(f, "%s %u\n", id, session->protocol);
+		if (fflush(f) != 0 || rename(tmp, name) < 0) {
+			fclose(f);
+			unlink(tmp);
+			free(tmp);
+			return;
+		}
+		free(tmp);
+	}
+	fprintf(f, "%s %u %u %s\n",
+		(const char *) ipset_data_get(data, IPSET_OPT_TYPENAME),
+		ipset_data_family(data),
+		*(const uint8_t *) ipset_data_get(data, IPSET_OPT_REVISION),
+		setname);
+	fclose(f);
+}
+
+/* Sets created, destroyed or renamed */
+static inline void
+cache_file_drop(void)
+{
+	unlink(cache_file_name());
+}
+
+/* Errors of the kernel when the cached protocol or set type does not
+ * fit: the command is rejected before it could change the set */
+static bool
+guess_rejected(int errcode)
+{
+	switch (errcode) {
+	case ENOENT:
+	case IPSET_ERR_PROTOCOL:
+	case IPSET_ERR_FIND_TYPE:
+	case IPSET_ERR_TYPE_MISMATCH:
+	case IPSET_ERR_INVALID_CIDR:
+	case IPSET_ERR_INVALID_FAMILY:
+	case IPSET_ERR_IPADDR_IPV4:
+	case IPSET_ERR_IPADDR_IPV6:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * ipset_session_guessed - is cached data used by the command
+ * @session: session structure
+ *
+ * Returns true when the protocol version or the set type of the
+ * command came from the cache file of the optimistic mode.
+ */
+bool
+ipset_session_guessed(const struct ipset_session *session)
+{
+	assert(session);
+	return session->guessed;
+}
+
+/**
+ * ipset_session_guess_failed - was the cached data rejected
+ * @session: session structure
+ *
+ * Returns true when the kernel rejected a command which was built
+ * from the cache file of the optimistic mode, so the command should
+ * be parsed and executed again after ipset_session_guess_reset().
+ */
+bool
+ipset_session_guess_failed(const struct ipset_session *session)
+{
+	assert(session);
+	return session->guess_failed;
+}
+
+/**
+ * ipset_session_guess_reset - negotiate with the kernel again
+ * @session: session structure
+ *
+ * Remove the cache file of the optimistic mode, reset the report and
+ * the data of the failed command and check the protocol version and
+ * the set types with the kernel from now on in the session.
+ */
+void
+ipset_session_guess_reset(struct ipset_session *session)
+{
+	assert(session);
+	cache_file_drop();
+	session->version_checked = false;
+	session->guessed = false;
+	session->guess_failed = false;
+	session->no_guess = true;
+	ipset_session_report_reset(session);
+	ipset_data_reset(session->data);
+}
+
 static int
 callback_version(struct ipset_session *session, struct nlattr *nla[])
 {
@@ -1352,6 +2798,8 @@ callback_version(struct ipset_session *session, struct nlattr *nla[])
 
 	session->protocol = MIN(max, IPSET_PROTOCOL_MAX);
 	session->version_checked = true;
+	/* Older kernels reject the unknown attribute in a dump request */
+	session->dump_bufsize = nla[IPSET_ATTR_BUFSIZE] != NULL;
 
 	return MNL_CB_STOP;
 }
@@ -1425,6 +2873,146 @@ cmd_attr_cb(const struct nlattr *attr, void *data)
 	return generic_data_attr_cb(attr, data, IPSET_ATTR_CMD_MAX, cmd_attrs);
 }
 
+/* Print the elements of a packed ADT attribute of a notification */
+static void
+monitor_packed(struct ipset_session *session, const char *cmd,
+	       const struct nlattr *nla)
+{
+	struct ipset_data *data = session->data;
+	const struct ip_set_adt_packed *p = mnl_attr_get_payload(nla);
+	size_t alen = p->family == NFPROTO_IPV4 ? sizeof(uint32_t)
+					       : sizeof(struct in6_addr);
+	size_t stride = alen +
+		(p->flags & IPSET_PACKED_TIMEOUT ? sizeof(uint32_t) : 0);
+	const char *elem = (const char *)(p + 1);
+	union nf_inet_addr ip = {};
+	uint32_t timeout;
+	uint16_t i;
+
+	if (mnl_attr_get_payload_len(nla) < sizeof(*p) + p->count * stride)
+		return;
+	ipset_data_set(data, IPSET_OPT_FAMILY, &p->family);
+	for (i = 0; i < p->count; i++, elem += stride) {
+		memcpy(&ip, elem, alen);
+		ipset_data_set(data, IPSET_OPT_IP, &ip);
+		safe_snprintf(session, "%s %s ", cmd, ipset_data_setname(data));
+		safe_dprintf(session, ipset_print_ip, IPSET_OPT_IP);
+		if (p->flags & IPSET_PACKED_TIMEOUT) {
+			memcpy(&timeout, elem + alen, sizeof(timeout));
+			safe_snprintf(session, " timeout %u", ntohl(timeout));
+		}
+		safe_write(session, "\n", 1);
+	}
+}
+
+/* Print a change notification: set changes and added or deleted
+ * elements are printed in the restore format, expired elements
+ * with the expire command.
+ */
+static int
+callback_monitor(struct ipset_session *session, struct nlattr *nla[],
+		 enum ipset_cmd cmd)
+{
+	struct ipset_data *data = session->data;
+	const char *name, *name2 = NULL;
+	uint32_t flags = 0;
+
+	if (setjmp(session->printf_failure))
+		return MNL_CB_ERROR;
+
+	if (cmd == IPSET_CMD_MONITOR) {
+		if (nla[IPSET_ATTR_LOST])
+			safe_snprintf(session, "# %u events lost\n",
+				ntohl(mnl_attr_get_u32(nla[IPSET_ATTR_LOST])));
+		return call_outfn(session) ? MNL_CB_ERROR : MNL_CB_OK;
+	}
+	if (!nla[IPSET_ATTR_SETNAME])
+		FAILURE("Broken %s kernel message: missing setname!",
+			cmd < IPSET_MSG_MAX ? cmd2name[cmd] : "unknown");
+	name = mnl_attr_get_str(nla[IPSET_ATTR_SETNAME]);
+	if (nla[IPSET_ATTR_SETNAME2])
+		name2 = mnl_attr_get_str(nla[IPSET_ATTR_SETNAME2]);
+
+	switch (cmd) {
+	case IPSET_CMD_CREATE:
+		if (!name2)
+			FAILURE("Broken %s kernel message: missing typename!",
+				cmd2name[cmd]);
+		safe_snprintf(session, "create %s %s", name, name2);
+		if (nla[IPSET_ATTR_FAMILY] &&
+		    mnl_attr_get_u8(nla[IPSET_ATTR_FAMILY]) == NFPROTO_IPV6)
+			safe_snprintf(session, " family inet6");
+		else if (nla[IPSET_ATTR_FAMILY] &&
+			 mnl_attr_get_u8(nla[IPSET_ATTR_FAMILY]) == NFPROTO_INET)
+			safe_snprintf(session, " family inet46");
+		safe_write(session, "\n", 1);
+		break;
+	case IPSET_CMD_DESTROY:
+	case IPSET_CMD_FLUSH:
+		safe_snprintf(session, "%s %s\n",
+			      cmd == IPSET_CMD_DESTROY ? "destroy" : "flush",
+			      name);
+		break;
+	case IPSET_CMD_RENAME:
+	case IPSET_CMD_SWAP:
+	case IPSET_CMD_CLONE:
+		if (!name2)
+			FAILURE("Broken %s kernel message: missing setname2!",
+				cmd2name[cmd]);
+		safe_snprintf(session, "%s %s %s\n",
+			      cmd == IPSET_CMD_RENAME ? "rename" :
+			      cmd == IPSET_CMD_SWAP ? "swap" : "clone",
+			      name, name2);
+		break;
+	case IPSET_CMD_ADD:
+	case IPSET_CMD_DEL: {
+		struct nlattr *adt[IPSET_ATTR_ADT_MAX+1] = {};
+		const char *verb;
+
+		if (!(nla[IPSET_ATTR_TYPENAME] &&
+		      nla[IPSET_ATTR_FAMILY] &&
+		      nla[IPSET_ATTR_REVISION]))
+			FAILURE("Broken %s kernel message: missing %s!",
+				cmd2name[cmd],
+				!nla[IPSET_ATTR_TYPENAME] ? "typename" :
+				!nla[IPSET_ATTR_FAMILY] ? "family" :
+				"revision");
+		ipset_data_reset(data);
+		ATTR2DATA(session, nla, IPSET_ATTR_SETNAME, cmd_attrs);
+		ATTR2DATA(session, nla, IPSET_ATTR_FAMILY, cmd_attrs);
+		ATTR2DATA(session, nla, IPSET_ATTR_TYPENAME, cmd_attrs);
+		ATTR2DATA(session, nla, IPSET_ATTR_REVISION, cmd_attrs);
+		if (nla[IPSET_ATTR_FLAGS])
+			flags = ntohl(mnl_attr_get_u32(nla[IPSET_ATTR_FLAGS]));
+		verb = cmd == IPSET_CMD_ADD ? "add" :
+		       flags & IPSET_FLAG_EXPIRED ? "expire" : "del";
+		if (nla[IPSET_ATTR_ADT_PACKED]) {
+			monitor_packed(session, verb,
+				       nla[IPSET_ATTR_ADT_PACKED]);
+			break;
+		}
+		if (!nla[IPSET_ATTR_DATA])
+			FAILURE("Broken %s kernel message: "
+				"missing DATA part!", cmd2name[cmd]);
+		if (!ipset_type_check(session))
+			return MNL_CB_ERROR;
+		if (mnl_attr_parse_nested(nla[IPSET_ATTR_DATA],
+					  adt_attr_cb, adt) < 0)
+			FAILURE("Broken %s kernel message: "
+				"cannot validate DATA attributes!",
+				cmd2name[cmd]);
+		safe_snprintf(session, "%s %s ", verb, name);
+		if (list_adt(session, adt) != MNL_CB_OK)
+			return MNL_CB_ERROR;
+		break;
+	}
+	default:
+		/* Unknown events are skipped */
+		return MNL_CB_OK;
+	}
+	return call_outfn(session) ? MNL_CB_ERROR : MNL_CB_OK;
+}
+
 #if 0
 static int
 mnl_attr_parse_dbg(const struct nlmsghdr *nlh, int offset,
@@ -1459,7 +3047,8 @@ callback_data(const struct nlmsghdr *nlh, void *data)
 		/* Kernel always send IPSET_CMD_LIST */
 		cmd = IPSET_CMD_SAVE;
 
-	if (cmd != session->cmd)
+	/* Notifications may arrive with any command */
+	if (cmd != session->cmd && session->cmd != IPSET_CMD_MONITOR)
 		FAILURE("Protocol error, we sent command %s "
 			"and received %s[%u]",
 			cmd2name[session->cmd],
@@ -1483,6 +3072,9 @@ callback_data(const struct nlmsghdr *nlh, void *data)
 			"does not match our protocol version %u",
 			proto, session->protocol);
 
+	if (session->cmd == IPSET_CMD_MONITOR)
+		return callback_monitor(session, nla, cmd);
+
 	D("Message: %s", cmd2name[cmd]);
 	switch (cmd) {
 	case IPSET_CMD_LIST:
@@ -1502,6 +3094,9 @@ callback_data(const struct nlmsghdr *nlh, void *data)
 	case IPSET_CMD_TYPE:
 		ret = callback_type(session, nla);
 		break;
+	case IPSET_CMD_TEST:
+		ret = callback_test(session, nla);
+		break;
 	default:
 		FAILURE("Data message received when not expected at %s",
 			cmd2name[session->cmd]);
@@ -1586,14 +3181,17 @@ callback_error(const struct nlmsghdr *nlh, void *cbdata)
 			ipset_cache_add(ipset_data_setname(data),
 					ipset_data_get(data, IPSET_OPT_TYPE),
 					ipset_data_family(data));
+			cache_file_drop();
 			break;
 		case IPSET_CMD_DESTROY:
 			/* Delete destroyed sets from the cache */
 			ipset_cache_del(ipset_data_setname(data));
+			cache_file_drop();
 			/* Fall through */
 		case IPSET_CMD_FLUSH:
 			break;
 		case IPSET_CMD_RENAME:
+			cache_file_drop();
 			ipset_cache_rename(ipset_data_setname(data),
 					   ipset_data_get(data,
 							  IPSET_OPT_SETNAME2));
@@ -1603,6 +3201,13 @@ callback_error(const struct nlmsghdr *nlh, void *cbdata)
 					 ipset_data_get(data,
 							IPSET_OPT_SETNAME2));
 			break;
+		case IPSET_CMD_CLONE:
+			cache_file_drop();
+			break;
+		case IPSET_CMD_FREEZE:
+		case IPSET_CMD_THAW:
+		case IPSET_CMD_PURGE:
+			break;
 		case IPSET_CMD_TEST:
 			if (!(session->envopts & IPSET_ENV_QUIET)) {
 				ipset_print_elem(session->report,
@@ -1615,6 +3220,7 @@ callback_error(const struct nlmsghdr *nlh, void *cbdata)
 			/* Fall through */
 		case IPSET_CMD_ADD:
 		case IPSET_CMD_DEL:
+		case IPSET_CMD_MONITOR:
 			break;
 		case IPSET_CMD_LIST:
 		case IPSET_CMD_SAVE:
@@ -1646,6 +3252,9 @@ callback_error(const struct nlmsghdr *nlh, void *cbdata)
 		return ret;
 	}
 
+	if (session->guessed && guess_rejected(-err->error))
+		session->guess_failed = true;
+
 	decode_errmsg(session, nlh);
 
 	return ret;
@@ -1840,8 +3449,14 @@ build_send_private_msg(struct ipset_session *session, enum ipset_cmd cmd)
 		cmd == IPSET_CMD_PROTOCOL ? IPSET_PROTOCOL : session->protocol);
 
 	switch (cmd) {
-	case IPSET_CMD_PROTOCOL:
+	case IPSET_CMD_PROTOCOL: {
+		/* Ask whether the dumps take the receive buffer size */
+		uint32_t bufsize = IPSET_BUFSIZE_MAX;
+
+		ADDATTR_RAW(session, nlh, &bufsize,
+			    IPSET_ATTR_BUFSIZE, cmd_attrs);
 		break;
+	}
 	case IPSET_CMD_HEADER:
 		if (!ipset_data_test(data, IPSET_SETNAME))
 			return ipset_err(session,
@@ -1868,19 +3483,97 @@ build_send_private_msg(struct ipset_session *session, enum ipset_cmd cmd)
 				 "unknown private command %u", cmd);
 	}
 
-	/* Backup, then restore real command */
-	session->cmd = cmd;
-	ret = session->transport->query(session->handle, buffer, len);
-	session->cmd = saved;
+	/* Backup, then restore real command */
+	session->cmd = cmd;
+	ret = session->transport->query(session->handle, buffer, len);
+	session->cmd = saved;
+
+	return ret;
+}
+
+/* Options which can be sent as packed elements */
+#define IPSET_PACKED_FLAGS					\
+	(IPSET_FLAG(IPSET_SETNAME) | IPSET_FLAG(IPSET_OPT_TYPENAME) |	\
+	 IPSET_FLAG(IPSET_OPT_REVISION) | IPSET_FLAG(IPSET_OPT_FAMILY) | \
+	 IPSET_FLAG(IPSET_OPT_TYPE) | IPSET_FLAG(IPSET_OPT_IP) |	\
+	 IPSET_FLAG(IPSET_OPT_TIMEOUT))
+
+static inline bool
+may_pack_ad(struct ipset_session *session, const struct ipset_data *data)
+{
+	const struct ipset_type *type = ipset_data_get(data, IPSET_OPT_TYPE);
+
+	return session->lineno != 0 && session->cmd != IPSET_CMD_TEST &&
+	       type->packed_adt &&
+	       !(ipset_data_flags(data) & ~IPSET_PACKED_FLAGS);
+}
+
+static void
+open_packed(struct ipset_session *session, struct nlmsghdr *nlh,
+	    const struct ipset_data *data)
+{
+	struct ip_set_adt_packed p = {
+		.family = ipset_data_family(data),
+		.flags = ipset_data_test(data, IPSET_OPT_TIMEOUT) ?
+			 IPSET_PACKED_TIMEOUT : 0,
+	};
+
+	session->packed = mnl_nlmsg_get_payload_tail(nlh);
+	session->packed_lineno = session->lineno;
+	mnl_attr_put(nlh, IPSET_ATTR_ADT_PACKED, sizeof(p), &p);
+}
+
+static int
+addattr_packed(struct ipset_session *session, struct nlmsghdr *nlh,
+	       const struct ipset_data *data)
+{
+	struct ip_set_adt_packed *p = mnl_attr_get_payload(session->packed);
+	bool timeout = ipset_data_test(data, IPSET_OPT_TIMEOUT);
+	size_t alen = p->family == NFPROTO_IPV4 ? sizeof(uint32_t)
+						: sizeof(struct in6_addr);
+	char *tail;
+
+	/* The kernel derives the lineno of the elements from the first one */
+	if (!may_pack_ad(session, data) ||
+	    ipset_data_family(data) != p->family ||
+	    !!(p->flags & IPSET_PACKED_TIMEOUT) != timeout ||
+	    p->count == UINT16_MAX ||
+	    session->packed_lineno + p->count != session->lineno)
+		return 1;
+	if (nlh->nlmsg_len + alen + (timeout ? sizeof(uint32_t) : 0) +
+	    MNL_ALIGN(sizeof(struct nlmsgerr)) > session->bufsize)
+		return 1;
+
+	tail = mnl_nlmsg_get_payload_tail(nlh);
+	memcpy(tail, ipset_data_get(data, IPSET_OPT_IP), alen);
+	if (timeout) {
+		uint32_t value = htonl(*(const uint32_t *)
+				ipset_data_get(data, IPSET_OPT_TIMEOUT));
+
+		memcpy(tail + alen, &value, sizeof(value));
+		alen += sizeof(value);
+	}
+	nlh->nlmsg_len += alen;
+	session->packed->nla_len += alen;
+	p->count++;
+
+	return 0;
+}
 
-	return ret;
+/* Tests are aggregated only when reading the elements from a stream */
+static inline bool
+aggregate_cmd(const struct ipset_session *session, enum ipset_cmd cmd)
+{
+	return cmd == IPSET_CMD_ADD || cmd == IPSET_CMD_DEL ||
+	       (cmd == IPSET_CMD_TEST &&
+		(session->envopts & IPSET_ENV_TEST_STREAM));
 }
 
 static inline bool
 may_aggregate_ad(struct ipset_session *session, enum ipset_cmd cmd)
 {
 	return session->lineno != 0 &&
-	       (cmd == IPSET_CMD_ADD || cmd == IPSET_CMD_DEL) &&
+	       aggregate_cmd(session, cmd) &&
 	       cmd == session->cmd &&
 	       STREQ(ipset_data_setname(session->data), session->saved_setname);
 }
@@ -1943,43 +3636,119 @@ build_msg(struct ipset_session *session, bool aggregate)
 	}
 	case IPSET_CMD_DESTROY:
 	case IPSET_CMD_FLUSH:
-	case IPSET_CMD_SAVE:
 		if (ipset_data_test(data, IPSET_SETNAME))
 			ADDATTR_SETNAME(session, nlh, data);
 		break;
-	case IPSET_CMD_LIST: {
+	case IPSET_CMD_LIST:
+	case IPSET_CMD_SAVE: {
 		uint32_t flags = 0;
 
-		if (session->envopts & IPSET_ENV_LIST_SETNAME)
-			flags |= IPSET_FLAG_LIST_SETNAME;
-		if (session->envopts & IPSET_ENV_LIST_HEADER)
-			flags |= IPSET_FLAG_LIST_HEADER;
+		if (session->cmd == IPSET_CMD_LIST &&
+		    session->mode != IPSET_LIST_SAVE &&
+		    session->mode != IPSET_LIST_BINARY) {
+			/* The filters need the headers or the members */
+			bool members = list_elem_filter(session);
+
+			if (session->envopts & IPSET_ENV_LIST_SETNAME &&
+			    !members)
+				flags |= list_header_filter(session) ?
+					 IPSET_FLAG_LIST_HEADER :
+					 IPSET_FLAG_LIST_SETNAME;
+			else if (session->envopts & IPSET_ENV_LIST_HEADER &&
+				 !members)
+				flags |= IPSET_FLAG_LIST_HEADER;
+		}
+		if (session->envopts & IPSET_ENV_LIST_RESET)
+			flags |= IPSET_FLAG_LIST_RESET;
+		if (session->envopts & IPSET_ENV_LIST_STATS)
+			flags |= IPSET_FLAG_LIST_STATS;
 		if (ipset_data_test(data, IPSET_SETNAME))
 			ADDATTR_SETNAME(session, nlh, data);
-		if (flags && session->mode != IPSET_LIST_SAVE) {
+		if (flags) {
 			ipset_data_set(data, IPSET_OPT_FLAGS, &flags);
 			ADDATTR(session, nlh, data, IPSET_ATTR_FLAGS,
 				NFPROTO_IPV4, cmd_attrs);
 		}
+		/* Even the zero epoch, which lists everything */
+		if (session->since ||
+		    session->envopts & IPSET_ENV_LIST_CHANGED)
+			ADDATTR_RAW(session, nlh, &session->since,
+				    IPSET_ATTR_SINCE, cmd_attrs);
+		if (session->top) {
+			ADDATTR_RAW(session, nlh, &session->top,
+				    IPSET_ATTR_TOP, cmd_attrs);
+			if (session->top_by != IPSET_TOP_BYTES)
+				ADDATTR_RAW(session, nlh, &session->top_by,
+					    IPSET_ATTR_TOP_BY, cmd_attrs);
+		}
+		if (session->envopts & IPSET_ENV_LIST_SNAPSHOT)
+			mnl_attr_put(nlh, IPSET_ATTR_SNAPSHOT, 0, NULL);
+		if (session->dump_bufsize &&
+		    session->bufsize == IPSET_BUFSIZE_MAX) {
+			uint32_t bufsize = session->bufsize;
+
+			ADDATTR_RAW(session, nlh, &bufsize,
+				    IPSET_ATTR_BUFSIZE, cmd_attrs);
+		}
 		break;
 	}
+	case IPSET_CMD_MONITOR:
+		if (ipset_data_test(data, IPSET_OPT_FLAGS))
+			ADDATTR(session, nlh, data, IPSET_ATTR_FLAGS,
+				NFPROTO_IPV4, cmd_attrs);
+		break;
+	case IPSET_CMD_FREEZE:
+	case IPSET_CMD_THAW:
+		if (!ipset_data_test(data, IPSET_SETNAME))
+			return ipset_err(session,
+				"Invalid %s command: missing setname",
+				session->cmd == IPSET_CMD_FREEZE ? "freeze" :
+				"thaw");
+		ADDATTR_SETNAME(session, nlh, data);
+		break;
+	case IPSET_CMD_PURGE:
+		if (!ipset_data_test(data, IPSET_SETNAME))
+			return ipset_err(session,
+				"Invalid purge command: missing setname");
+		ADDATTR_SETNAME(session, nlh, data);
+		/* The condition, in the attributes of the extensions */
+		open_nested(session, nlh, IPSET_ATTR_DATA);
+		ADDATTR_IF(session, nlh, data, IPSET_ATTR_COMMENT,
+			   NFPROTO_IPV4, adt_attrs);
+		ADDATTR_IF(session, nlh, data, IPSET_ATTR_BYTES,
+			   NFPROTO_IPV4, adt_attrs);
+		ADDATTR_IF(session, nlh, data, IPSET_ATTR_PACKETS,
+			   NFPROTO_IPV4, adt_attrs);
+		ADDATTR_IF(session, nlh, data, IPSET_ATTR_TIMEOUT,
+			   NFPROTO_IPV4, adt_attrs);
+		close_nested(session, nlh);
+		break;
 	case IPSET_CMD_RENAME:
 	case IPSET_CMD_SWAP:
+	case IPSET_CMD_CLONE:
 		if (!ipset_data_test(data, IPSET_SETNAME))
 			return ipset_err(session,
 				"Invalid %s command: missing from-setname",
 				session->cmd == IPSET_CMD_SWAP ? "swap" :
+				session->cmd == IPSET_CMD_CLONE ? "clone" :
 				"rename");
 		if (!ipset_data_test(data, IPSET_OPT_SETNAME2))
 			return ipset_err(session,
 				"Invalid %s command: missing to-setname",
 				session->cmd == IPSET_CMD_SWAP ? "swap" :
+				session->cmd == IPSET_CMD_CLONE ? "clone" :
 				"rename");
 		ADDATTR_SETNAME(session, nlh, data);
 		ADDATTR_RAW(session, nlh,
 			    ipset_data_get(data, IPSET_OPT_SETNAME2),
 			    IPSET_ATTR_SETNAME2, cmd_attrs);
 		break;
+	case IPSET_CMD_TEST:
+		if (session->lineno == 0 ||
+		    !(session->envopts & IPSET_ENV_TEST_STREAM))
+			goto single_test;
+		/* Elements from a stream are tested in batches */
+		/* Fall through */
 	case IPSET_CMD_ADD:
 	case IPSET_CMD_DEL: {
 		DD(const struct ipset_type *type);
@@ -1990,23 +3759,36 @@ build_msg(struct ipset_session *session, bool aggregate)
 				return ipset_err(session,
 					"Invalid %s command: missing setname",
 					session->cmd == IPSET_CMD_ADD ? "add" :
-					"del");
+					session->cmd == IPSET_CMD_DEL ? "del" :
+					"test");
 
 			if (!ipset_data_test(data, IPSET_OPT_TYPE))
 				return ipset_err(session,
 					"Invalid %s command: missing settype",
 					session->cmd == IPSET_CMD_ADD ? "add" :
-					"del");
+					session->cmd == IPSET_CMD_DEL ? "del" :
+					"test");
 
 			/* Core options: setname */
 			ADDATTR_SETNAME(session, nlh, data);
+			if (session->envopts & IPSET_ENV_ATOMIC &&
+			    session->cmd != IPSET_CMD_TEST)
+				mnl_attr_put(nlh, IPSET_ATTR_TRANSACTION,
+					     0, NULL);
 			if (session->lineno != 0) {
 				/* Restore mode */
 				ADDATTR_RAW(session, nlh, &session->lineno,
 					    IPSET_ATTR_LINENO, cmd_attrs);
-				open_nested(session, nlh, IPSET_ATTR_ADT);
+				if (may_pack_ad(session, data))
+					open_packed(session, nlh, data);
+				else
+					open_nested(session, nlh,
+						    IPSET_ATTR_ADT);
 			}
 		}
+		if (session->packed)
+			/* Start a new message when it cannot be packed */
+			return addattr_packed(session, nlh, data);
 		DD(type = ipset_data_get(data, IPSET_OPT_TYPE));
 		D("family: %u, type family %u",
 		  ipset_data_family(data), type->family);
@@ -2026,9 +3808,10 @@ build_msg(struct ipset_session *session, bool aggregate)
 		close_nested(session, nlh);
 		break;
 	}
-	case IPSET_CMD_TEST: {
+	single_test: {
 		DD(const struct ipset_type *type);
-		/* Return codes are not aggregated, so tests cannot be either */
+		/* Return codes are not aggregated, so single tests cannot be
+		 * either */
 
 		/* Setname, type not checked/added yet */
 
@@ -2056,16 +3839,42 @@ build_msg(struct ipset_session *session, bool aggregate)
 	return 0;
 }
 
-/**
- * ipset_commit - commit buffered commands
- * @session: session structure
- *
- * Commit buffered commands, if there are any.
- *
- * Returns 0 on success or a negative error code.
- */
-int
-ipset_commit(struct ipset_session *session)
+/* Max number of restore batches sent before reading their ACKs */
+#define IPSET_INFLIGHT_MAX	8
+
+/* Read the ACKs of the batches in flight until keep of them remain.
+ * The first error is reported, the lineno is restored for the batch
+ * being built. Returns -1 if a batch failed. */
+static int
+read_acks(struct ipset_session *session, uint8_t keep)
+{
+	char report[IPSET_ERRORBUFLEN];
+	uint32_t lineno = session->lineno;
+	bool failed = false;
+	int ret = 0, r;
+
+	while (session->inflight > keep) {
+		session->inflight--;
+		r = session->transport->recv(session->handle,
+					     session->ackbuf,
+					     session->bufsize);
+		if (r < 0 && ret == 0)
+			ret = r;
+		if (failed) {
+			memcpy(session->report, report, sizeof(report));
+			session->err_type = IPSET_ERROR;
+		} else if (session->err_type == IPSET_ERROR) {
+			failed = true;
+			memcpy(report, session->report, sizeof(report));
+		}
+	}
+	session->lineno = lineno;
+
+	return failed && ret == 0 ? -1 : ret;
+}
+
+static int
+commit(struct ipset_session *session, bool pipeline)
 {
 	struct nlmsghdr *nlh;
 	int ret = 0, i;
@@ -2075,27 +3884,52 @@ ipset_commit(struct ipset_session *session)
 	nlh = session->buffer;
 	D("send buffer: len %u, cmd %s",
 	  nlh->nlmsg_len, cmd2name[session->cmd]);
+
+	if (pipeline && !session->ackbuf)
+		session->ackbuf = malloc(session->bufsize);
+	/* Fall back to waiting for the ACK without the buffer */
+	pipeline = pipeline && session->ackbuf != NULL;
+
+	/* Make room for the batch or wait for all ACKs */
+	ret = read_acks(session, pipeline ? IPSET_INFLIGHT_MAX - 1 : 0);
 	if (nlh->nlmsg_len == 0)
 		/* Nothing to do */
-		return 0;
+		goto done;
+	if (ret < 0)
+		/* Don't send the batch after a failed one */
+		goto reset;
 
 	/* Close nested data blocks */
 	for (i = session->nestid - 1; i >= 0; i--)
 		close_nested(session, nlh);
 
 	/* Send buffer */
-	ret = session->transport->query(session->handle,
-					session->buffer,
-					session->bufsize);
-
+#ifdef IPSET_DEBUG
+	session->sent_msgs++;
+	session->sent_bytes += nlh->nlmsg_len;
+#endif
+	if (pipeline) {
+		ret = session->transport->send(session->handle,
+					       session->buffer,
+					       session->bufsize);
+		if (ret == 0)
+			session->inflight++;
+	} else
+		ret = session->transport->query(session->handle,
+						session->buffer,
+						session->bufsize);
+
+reset:
 	/* Reset saved data and nested state */
 	session->saved_setname[0] = '\0';
 	session->printed_set = 0;
 	for (i = session->nestid - 1; i >= 0; i--)
 		session->nested[i] = NULL;
 	session->nestid = 0;
+	session->packed = NULL;
 	nlh->nlmsg_len = 0;
 
+done:
 	D("ret: %d", ret);
 
 	if (ret < 0) {
@@ -2108,6 +3942,101 @@ ipset_commit(struct ipset_session *session)
 	return 0;
 }
 
+/**
+ * ipset_commit - commit buffered commands
+ * @session: session structure
+ *
+ * Commit buffered commands, if there are any, and wait for
+ * the replies of all of them.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_commit(struct ipset_session *session)
+{
+	return commit(session, false);
+}
+
+/* Resize the buffer: the open nested attributes are moved into
+ * the new one. Returns 0 if the buffer is resized. */
+static int
+resize_buffer(struct ipset_session *session, size_t bufsize)
+{
+	size_t offset[IPSET_NEST_MAX], packed = 0;
+	char *buf;
+	int i;
+
+	/* The ACKs in flight are read into a buffer of the current size */
+	if (session->inflight)
+		return -1;
+
+	for (i = 0; i < session->nestid; i++)
+		offset[i] = (char *)session->nested[i] -
+			    (char *)session->buffer;
+	if (session->packed)
+		packed = (char *)session->packed - (char *)session->buffer;
+
+	buf = realloc(session->buffer, bufsize);
+	if (!buf)
+		return -1;
+
+	for (i = 0; i < session->nestid; i++)
+		session->nested[i] = (struct nlattr *)(buf + offset[i]);
+	if (session->packed)
+		session->packed = (struct nlattr *)(buf + packed);
+	session->buffer = buf;
+	session->bufsize = bufsize;
+	free(session->ackbuf);
+	session->ackbuf = NULL;
+	D("buffer resized to %zu", bufsize);
+
+	return 0;
+}
+
+/* Double the buffer of a full restore batch instead of sending it.
+ * A batch cut short by packing is not counted as full: the buffer
+ * must be filled at least half. Returns 0 if the buffer is grown. */
+static int
+grow_buffer(struct ipset_session *session)
+{
+	struct nlmsghdr *nlh = session->buffer;
+	size_t bufsize = session->bufsize * 2;
+
+	if (bufsize > IPSET_BUFSIZE_MAX ||
+	    nlh->nlmsg_len <= session->bufsize / 2)
+		return -1;
+
+	return resize_buffer(session, bufsize);
+}
+
+/* Receive and print the change notifications after subscribing to them.
+ * It returns only when an error occurs.
+ */
+static int
+monitor(struct ipset_session *session)
+{
+	struct nlmsghdr *nlh = session->buffer;
+	int ret;
+
+	do {
+		ret = session->transport->recv(session->handle,
+					       session->buffer,
+					       session->bufsize);
+		if (ret < 0 && errno == ENOBUFS) {
+			/* Receive buffer overrun */
+			if (session->print_outfn(session, session->p,
+						 "# events lost\n") < 0)
+				break;
+			ret = MNL_CB_OK;
+		}
+	} while (ret > 0);
+	nlh->nlmsg_len = 0;
+
+	if (ret < 0 && session->report[0] == '\0')
+		return ipset_err(session, "Internal protocol error");
+	return ret < 0 ? -1 : 0;
+}
+
 static mnl_cb_t cb_ctl[] = {
 	[NLMSG_NOOP] = callback_noop,
 	[NLMSG_ERROR] = callback_error,
@@ -2158,7 +4087,8 @@ ipset_cmd(struct ipset_session *session, enum ipset_cmd cmd, uint32_t lineno)
 	data = session->data;
 
 	/* Check protocol version once */
-	if (!session->version_checked) {
+	if (!session->version_checked &&
+	    !(may_guess(session) && cache_file_protocol(session) == 0)) {
 		if (build_send_private_msg(session, IPSET_CMD_PROTOCOL) < 0)
 			return -1;
 		if (ipset_session_report_type(session) == IPSET_WARNING &&
@@ -2171,6 +4101,15 @@ ipset_cmd(struct ipset_session *session, enum ipset_cmd cmd, uint32_t lineno)
 		return 0;
 
 	/* Private commands */
+	if (cmd == IPSET_CMD_HEADER &&
+	    session->envopts & IPSET_ENV_OPTIMISTIC && session->lineno == 0) {
+		if (may_guess(session) && cache_file_header(session) == 0)
+			return 0;
+		ret = build_send_private_msg(session, cmd);
+		if (ret == 0)
+			cache_file_store(session);
+		return ret;
+	}
 	if (cmd == IPSET_CMD_TYPE || cmd == IPSET_CMD_HEADER)
 		return build_send_private_msg(session, cmd);
 
@@ -2194,6 +4133,20 @@ ipset_cmd(struct ipset_session *session, enum ipset_cmd cmd, uint32_t lineno)
 	} else if (cmd == IPSET_CMD_SAVE) {
 		if (session->mode == IPSET_LIST_NONE)
 			session->mode = IPSET_LIST_SAVE;
+	} else if (cmd == IPSET_CMD_MONITOR) {
+		/* Elements are printed after the command and setname */
+		session->mode = IPSET_LIST_PLAIN;
+	}
+	if (cmd == IPSET_CMD_LIST || cmd == IPSET_CMD_SAVE) {
+		/* Receive the dump in as few messages as possible when
+		 * the kernel can be told about the size of the buffer */
+		if (session->dump_bufsize &&
+		    session->bufsize < IPSET_BUFSIZE_MAX)
+			resize_buffer(session, IPSET_BUFSIZE_MAX);
+		session->skip_set = false;
+		session->total_sets = 0;
+		session->total_elements = 0;
+		session->total_memsize = 0;
 	}
 	/* Start the root element in XML mode */
 	if ((cmd == IPSET_CMD_LIST || cmd == IPSET_CMD_SAVE) &&
@@ -2204,9 +4157,15 @@ ipset_cmd(struct ipset_session *session, enum ipset_cmd cmd, uint32_t lineno)
 	/* Build new message or append buffered commands */
 	ret = build_msg(session, aggregate);
 	D("build_msg returned %u", ret);
+	/* Fill up larger restore batches before sending them */
+	while (ret > 0 && aggregate && grow_buffer(session) == 0)
+		ret = build_msg(session, aggregate);
 	if (ret > 0) {
 		/* Buffer is full, send buffered commands */
-		ret = ipset_commit(session);
+		ret = commit(session, (session->envopts & IPSET_ENV_PIPELINE) &&
+				      session->lineno != 0 &&
+				      (cmd == IPSET_CMD_ADD ||
+				       cmd == IPSET_CMD_DEL));
 		if (ret < 0)
 			goto cleanup;
 		ret = build_msg(session, false);
@@ -2218,8 +4177,7 @@ ipset_cmd(struct ipset_session *session, enum ipset_cmd cmd, uint32_t lineno)
 
 	/* We have to save the type for error handling */
 	session->saved_type = ipset_data_get(data, IPSET_OPT_TYPE);
-	if (session->lineno != 0 &&
-	    (cmd == IPSET_CMD_ADD || cmd == IPSET_CMD_DEL)) {
+	if (session->lineno != 0 && aggregate_cmd(session, cmd)) {
 		/* Save setname for the next possible aggregated restore line */
 		strcpy(session->saved_setname, ipset_data_setname(data));
 		ipset_data_reset(data);
@@ -2230,6 +4188,8 @@ ipset_cmd(struct ipset_session *session, enum ipset_cmd cmd, uint32_t lineno)
 
 	D("call commit");
 	ret = ipset_commit(session);
+	if (ret == 0 && cmd == IPSET_CMD_MONITOR)
+		ret = monitor(session);
 
 cleanup:
 	D("reset data");
@@ -2237,6 +4197,257 @@ cleanup:
 	return ret;
 }
 
+/* Copy elements into the packed ADT attribute of the message */
+static void
+copy_packed(char *tail, const char *key, size_t n, size_t stride,
+	    size_t alen, const uint32_t *timeout)
+{
+	uint32_t value;
+	size_t i;
+
+	if (!timeout && stride == alen) {
+		memcpy(tail, key, n * alen);
+		return;
+	}
+	for (i = 0; i < n; i++, key += stride) {
+		memcpy(tail, key, alen);
+		tail += alen;
+		if (timeout) {
+			value = htonl(timeout[i]);
+			memcpy(tail, &value, sizeof(value));
+			tail += sizeof(value);
+		}
+	}
+}
+
+/* Send the elements in messages as large as possible. The elements
+ * hold the fields of the packed layout, separated by stride bytes;
+ * the timeouts come from a separate array if it is not NULL. */
+static int
+add_packed(struct ipset_session *session, const char *setname,
+	   uint8_t family, uint8_t flags, const char *key, size_t stride,
+	   const uint32_t *timeout, size_t count, uint32_t lineno)
+{
+	size_t alen = (family == NFPROTO_IPV4 ? sizeof(uint32_t)
+					      : sizeof(struct in6_addr)) +
+		      (flags & IPSET_PACKED_TIMEOUT && !timeout ?
+		       sizeof(uint32_t) : 0);
+	size_t elen = alen + (timeout ? sizeof(uint32_t) : 0);
+	bool pipeline = session->envopts & IPSET_ENV_PIPELINE;
+	int ret;
+
+	ret = ipset_commit(session);
+	if (ret < 0)
+		return ret;
+	if (session->handle == NULL && init_transport(session) == NULL)
+		return ipset_err(session,
+				 "Cannot open session to kernel.");
+
+	session->cmd = IPSET_CMD_ADD;
+	while (count) {
+		struct nlmsghdr *nlh = session->buffer;
+		struct ip_set_adt_packed p = {
+			.family = family,
+			.flags = flags,
+		};
+		struct ip_set_adt_packed *packed;
+		size_t n;
+
+		session->lineno = lineno;
+		session->transport->fill_hdr(session->handle, IPSET_CMD_ADD,
+					     session->buffer, session->bufsize,
+					     session->envopts);
+		ADDATTR_PROTOCOL(nlh, session->protocol);
+		ADDATTR_RAW(session, nlh, setname, IPSET_ATTR_SETNAME,
+			    cmd_attrs);
+		ADDATTR_RAW(session, nlh, &lineno, IPSET_ATTR_LINENO,
+			    cmd_attrs);
+		if (session->envopts & IPSET_ENV_ATOMIC)
+			mnl_attr_put(nlh, IPSET_ATTR_TRANSACTION, 0, NULL);
+		session->packed = mnl_nlmsg_get_payload_tail(nlh);
+		mnl_attr_put(nlh, IPSET_ATTR_ADT_PACKED, sizeof(p), &p);
+		/* Fill up the buffer, grown to the max size if possible */
+		do {
+			packed = mnl_attr_get_payload(session->packed);
+			n = (session->bufsize - nlh->nlmsg_len -
+			     MNL_ALIGN(sizeof(struct nlmsgerr))) / elen;
+			if (n > count)
+				n = count;
+			if (n > UINT16_MAX - packed->count)
+				n = UINT16_MAX - packed->count;
+			copy_packed(mnl_nlmsg_get_payload_tail(nlh), key, n,
+				    stride, alen, timeout);
+			nlh->nlmsg_len += n * elen;
+			session->packed->nla_len += n * elen;
+			packed->count += n;
+			key += n * stride;
+			if (timeout)
+				timeout += n;
+			lineno += n;
+			count -= n;
+		} while (count && packed->count < UINT16_MAX &&
+			 grow_buffer(session) == 0);
+
+		ret = commit(session, pipeline);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/**
+ * ipset_session_add_packed - add packed elements to a set
+ * @session: session structure
+ * @setname: name of the set
+ * @family: family of the elements
+ * @flags: IPSET_PACKED_* flags of the elements
+ * @elems: elements in the layout of the packed ADT attribute
+ * @count: number of the elements
+ * @lineno: lineno of the first element in restore mode
+ *
+ * Add the elements in messages as large as possible, without parsing
+ * them one by one. The buffered commands are committed first and the
+ * messages are pipelined when IPSET_ENV_PIPELINE is set: the caller
+ * must commit the session to read all replies.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_session_add_packed(struct ipset_session *session, const char *setname,
+			 uint8_t family, uint8_t flags, const void *elems,
+			 uint32_t count, uint32_t lineno)
+{
+	size_t stride = (family == NFPROTO_IPV4 ? sizeof(uint32_t)
+					       : sizeof(struct in6_addr)) +
+			(flags & IPSET_PACKED_TIMEOUT ? sizeof(uint32_t) : 0);
+
+	assert(session);
+	assert(setname);
+
+	return add_packed(session, setname, family, flags, elems, stride,
+			  NULL, count, lineno);
+}
+
+/**
+ * ipset_session_add_bulk - add elements from binary keys to a set
+ * @session: session structure
+ * @setname: name of the set
+ * @family: NFPROTO_IPV4, NFPROTO_IPV6 or NFPROTO_INET (IPv4-mapped keys)
+ * @keys: addresses in network byte order
+ * @n: number of the keys
+ * @stride: distance of the keys in bytes
+ * @timeout: timeout values of the elements or NULL
+ *
+ * Add the addresses to a set of a type supporting packed elements
+ * (hash:ip) in netlink batches built directly from the keys, without
+ * formatting and parsing the elements. Each key starts with the four
+ * or sixteen bytes of the address, the rest of the stride is skipped.
+ * The timeout values, if given, are in host byte order. The data of
+ * the session is not used. Errors are reported with the index of
+ * the failing element plus one as line number.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_session_add_bulk(struct ipset_session *session, const char *setname,
+		       uint8_t family, const void *keys, size_t n,
+		       size_t stride, const uint32_t *timeout)
+{
+	size_t alen = family == NFPROTO_IPV4 ? sizeof(uint32_t)
+					     : sizeof(struct in6_addr);
+	int ret;
+
+	assert(session);
+	assert(setname);
+	assert(keys || n == 0);
+
+	if (family != NFPROTO_IPV4 && family != NFPROTO_IPV6 &&
+	    family != NFPROTO_INET)
+		return ipset_err(session,
+			"Bulk add: family must be inet, inet6 or inet46");
+	if (stride < alen)
+		return ipset_err(session,
+			"Bulk add: stride %zu is smaller than the address",
+			stride);
+	if (strlen(setname) >= IPSET_MAXNAMELEN)
+		return ipset_err(session,
+			"Bulk add: setname '%s' is longer than %u characters",
+			setname, IPSET_MAXNAMELEN - 1);
+
+	ret = add_packed(session, setname, family,
+			 timeout ? IPSET_PACKED_TIMEOUT : 0, keys, stride,
+			 timeout, n, 1);
+	if (ret < 0)
+		return ret;
+	/* Read the replies of the pipelined batches */
+	return ipset_commit(session);
+}
+
+/**
+ * ipset_crc32 - update a CRC32 checksum
+ * @crc: checksum of the preceding data, zero at start
+ * @buf: data buffer
+ * @len: length of the data
+ *
+ * Returns the CRC32 (IEEE 802.3) checksum updated with the data.
+ */
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32_init(void)
+{
+	uint32_t c, i, k;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, k = 0; k < 8; k++)
+			c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc32_table[i] = c;
+	}
+}
+
+uint32_t
+ipset_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	pthread_once(&crc32_once, crc32_init);
+	crc = ~crc;
+	while (len--)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#ifdef HAVE_ZLIB
+/* gzprintf() cannot write more than its buffer at once: the output is
+ * formatted locally, into an allocated buffer in the case of long lines */
+static
+int __attribute__ ((format (printf, 2, 0)))
+gz_vprintf(gzFile gz, const char *fmt, va_list args)
+{
+	char line[1024], *buf = line;
+	va_list copy;
+	int len;
+
+	va_copy(copy, args);
+	len = vsnprintf(line, sizeof(line), fmt, copy);
+	va_end(copy);
+	if (len < 0)
+		return len;
+	if ((size_t)len >= sizeof(line)) {
+		buf = malloc(len + 1);
+		if (!buf)
+			return -1;
+		vsnprintf(buf, len + 1, fmt, args);
+	}
+	if (len && gzwrite(gz, buf, len) != len)
+		len = -1;
+	if (buf != line)
+		free(buf);
+	return len;
+}
+#endif
+
 static
 int __attribute__ ((format (printf, 3, 4)))
 default_print_outfn(struct ipset_session *session, void *p UNUSED,
@@ -2246,6 +4457,11 @@ default_print_outfn(struct ipset_session *session, void *p UNUSED,
 	va_list args;
 
 	va_start(args, fmt);
+#ifdef HAVE_ZLIB
+	if (session->gzout)
+		len = gz_vprintf(session->gzout, fmt, args);
+	else
+#endif
 	len = vfprintf(session->ostream, fmt, args);
 	va_end(args);
 
@@ -2275,6 +4491,35 @@ ipset_session_print_outfn(struct ipset_session *session,
 	return 0;
 }
 
+/**
+ * ipset_session_elem_fn - set the element callback of the listing
+ * @session: session structure
+ * @fn: element callback function
+ * @p: pointer to private area
+ *
+ * The list and save commands call @fn for every element instead of
+ * printing the sets. The session data passed to @fn holds the element
+ * and its extensions as received from the kernel, together with the
+ * setname and the header options of the set, and can be read by
+ * ipset_data_get(). The member and header filters are not applied.
+ * A negative return value of @fn stops the listing with an error.
+ * Setting @fn selects the IPSET_LIST_ELEM output mode, NULL restores
+ * the default one.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int
+ipset_session_elem_fn(struct ipset_session *session,
+		      ipset_elem_fn fn, void *p)
+{
+	assert(session);
+
+	session->elem_fn = fn;
+	session->elem_p = p;
+	session->mode = fn ? IPSET_LIST_ELEM : IPSET_LIST_NONE;
+	return 0;
+}
+
 /**
  * ipset_session_init - initialize an ipset session
  * @outfn: output printing function
@@ -2293,20 +4538,24 @@ ipset_session_init(ipset_print_outfn print_outfn, void *p)
 	size_t bufsize = getpagesize();
 
 	/* Create session object */
-	session = calloc(1, sizeof(struct ipset_session) + bufsize);
+	session = calloc(1, sizeof(struct ipset_session));
 	if (session == NULL)
 		return NULL;
-	session->outbuf = calloc(1, IPSET_OUTBUFLEN);
-	if (session->outbuf == NULL)
+	/* The kernel message buffer is grown in restore mode */
+	session->buffer = calloc(1, bufsize);
+	if (session->buffer == NULL)
 		goto free_session;
-	session->outbuflen = IPSET_OUTBUFLEN;
+	session->outbuf = calloc(1, IPSET_LIST_OUTBUFLEN);
+	if (session->outbuf == NULL)
+		goto free_buffer;
+	session->outbuflen = IPSET_LIST_OUTBUFLEN;
 	session->bufsize = bufsize;
-	session->buffer = session + 1;
+#ifdef IPSET_DEBUG
+	clock_gettime(CLOCK_MONOTONIC, &session->start);
+#endif
 	session->istream = stdin;
 	session->ostream = stdout;
 	session->protocol = IPSET_PROTOCOL;
-	INIT_LIST_HEAD(&session->sorted);
-	INIT_LIST_HEAD(&session->pool);
 
 	/* The single transport method yet */
 	session->transport = &ipset_mnl_transport;
@@ -2324,11 +4573,66 @@ ipset_session_init(ipset_print_outfn print_outfn, void *p)
 
 free_outbuf:
 	free(session->outbuf);
+free_buffer:
+	free(session->buffer);
 free_session:
 	free(session);
 	return NULL;
 }
 
+/* Open the output file: the output is compressed by gzip when the name
+ * of the file ends in ".gz" */
+static int
+session_open_output(struct ipset_session *session, const char *filename)
+{
+	FILE *f;
+#ifdef HAVE_ZLIB
+	size_t len = strlen(filename);
+	int fd;
+#endif
+
+	f = fopen(filename, "w");
+	if (!f)
+		return ipset_err(session,
+			"Cannot open %s for writing: %s",
+			filename, strerror(errno));
+#ifdef HAVE_ZLIB
+	if (len > 3 && STREQ(filename + len - 3, ".gz")) {
+		fd = dup(fileno(f));
+		session->gzout = fd < 0 ? NULL : gzdopen(fd, "wb");
+		if (!session->gzout) {
+			if (fd >= 0)
+				close(fd);
+			fclose(f);
+			return ipset_err(session,
+				"Cannot compress the output to %s",
+				filename);
+		}
+	}
+#endif
+	session->ostream = f;
+	return 0;
+}
+
+/* Close the output file, flushing the compressed output */
+static int
+session_close_output(struct ipset_session *session)
+{
+	int ret = 0;
+
+#ifdef HAVE_ZLIB
+	if (session->gzout) {
+		ret = gzclose(session->gzout) == Z_OK ? 0 : -1;
+		session->gzout = NULL;
+	}
+#endif
+	if (session->ostream != stdout) {
+		fclose(session->ostream);
+		session->ostream = stdout;
+	}
+	return ret;
+}
+
 /**
  * ipset_session_io_full - set full IO for the session
  * @session: session structure
@@ -2342,7 +4646,7 @@ free_session:
  * When a filename for input is passed, then the file will be opened
  * for reading.
  * When a filename for output is passed, then the file will be opened
- * for writing.
+ * for writing. If the name ends in ".gz", the output is compressed.
  * Previously opened files are closed.
  * If NULL is passed as filename, stdin/stdout is set.
  * Input/output files can be set separatedly.
@@ -2356,6 +4660,7 @@ ipset_session_io_full(struct ipset_session *session, const char *filename,
 		      enum ipset_io_type what)
 {
 	FILE *f;
+	int ret;
 
 	assert(session);
 
@@ -2379,17 +4684,11 @@ ipset_session_io_full(struct ipset_session *session, const char *filename,
 		}
 		break;
 	case IPSET_IO_OUTPUT:
-		if (session->ostream != stdout)
-			fclose(session->ostream);
-		if (!filename) {
-			session->ostream = stdout;
-		} else {
-			f = fopen(filename, "w");
-			if (!f)
-				return ipset_err(session,
-					"Cannot open %s for writing: %s",
-					filename, strerror(errno));
-			session->ostream = f;
+		session_close_output(session);
+		if (filename) {
+			ret = session_open_output(session, filename);
+			if (ret < 0)
+				return ret;
 		}
 		break;
 	default:
@@ -2414,7 +4713,7 @@ ipset_session_io_full(struct ipset_session *session, const char *filename,
  * When a filename for input is passed, then the file will be opened
  * for reading.
  * When a filename for output is passed, then the file will be opened
- * for writing.
+ * for writing. If the name ends in ".gz", the output is compressed.
  * Previously opened files are closed.
  * If NULL is passed as filename, stdin/stdout is set.
  * Input/output files cannot be set separatedly.
@@ -2428,6 +4727,7 @@ ipset_session_io_normal(struct ipset_session *session, const char *filename,
 			enum ipset_io_type what)
 {
 	FILE *f;
+	int ret;
 
 	assert(session);
 	assert(filename);
@@ -2439,10 +4739,7 @@ ipset_session_io_normal(struct ipset_session *session, const char *filename,
 		fclose(session->istream);
 		session->istream = stdin;
 	}
-	if (session->ostream != stdout) {
-		fclose(session->ostream);
-		session->ostream = stdout;
-	}
+	session_close_output(session);
 	switch (what) {
 	case IPSET_IO_INPUT:
 		f = fopen(filename, "r");
@@ -2453,12 +4750,9 @@ ipset_session_io_normal(struct ipset_session *session, const char *filename,
 		session->istream = f;
 		break;
 	case IPSET_IO_OUTPUT:
-		f = fopen(filename, "w");
-		if (!f)
-			return ipset_err(session,
-				"Cannot open %s for writing: %s",
-				filename, strerror(errno));
-		session->ostream = f;
+		ret = session_open_output(session, filename);
+		if (ret < 0)
+			return ret;
 		break;
 	default:
 		return ipset_err(session,
@@ -2509,10 +4803,9 @@ ipset_session_io_close(struct ipset_session *session,
 		}
 		break;
 	case IPSET_IO_OUTPUT:
-		if (session->ostream != stdout) {
-			fclose(session->ostream);
-			session->ostream = stdout;
-		}
+		if (session_close_output(session) < 0)
+			return ipset_err(session,
+				"Cannot write the compressed output");
 		break;
 	default:
 		break;
@@ -2531,28 +4824,45 @@ ipset_session_io_close(struct ipset_session *session,
 int
 ipset_session_fini(struct ipset_session *session)
 {
-	struct ipset_sorted *pos, *n;
+#ifdef IPSET_DEBUG
+	struct timespec now;
+	double elapsed;
+#endif
 	assert(session);
 
+#ifdef IPSET_DEBUG
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - session->start.tv_sec) +
+		  (now.tv_nsec - session->start.tv_nsec) / 1e9;
+	if (session->sent_msgs)
+		D("messages: %llu, bytes/message: %llu, messages/sec: %.0f, "
+		  "buffer size: %zu",
+		  (unsigned long long)session->sent_msgs,
+		  (unsigned long long)(session->sent_bytes /
+				       session->sent_msgs),
+		  elapsed > 0 ? session->sent_msgs / elapsed : 0.0,
+		  session->bufsize);
+#endif
 	if (session->handle)
 		session->transport->fini(session->handle);
 	if (session->data)
 		ipset_data_fini(session->data);
 	if (session->istream != stdin)
 		fclose(session->istream);
-	if (session->ostream != stdout)
-		fclose(session->ostream);
+	session_close_output(session);
 
 	ipset_cache_fini();
+	ipset_resolved_fini();
+	ipset_services_fini();
 
-	list_for_each_entry_safe(pos, n, &session->sorted, list) {
-		list_del(&pos->list);
-		free(pos);
-	}
-	list_for_each_entry_safe(pos, n, &session->pool, list) {
-		list_del(&pos->list);
-		free(pos);
+	if (session->regex) {
+		regfree(session->regex);
+		free(session->regex);
 	}
+	free(session->match);
+	free(session->sorted);
+	free(session->ackbuf);
+	free(session->buffer);
 	free(session->outbuf);
 	free(session);
 	return 0;
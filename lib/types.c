@@ -6,11 +6,13 @@
  */
 #include <assert.h>				/* assert */
 #include <errno.h>				/* errno */
+#include <pthread.h>				/* pthread_mutex_* */
 #include <net/ethernet.h>			/* ETH_ALEN */
 #include <netinet/in.h>				/* struct in6_addr */
 #include <sys/socket.h>				/* AF_ */
 #include <stdlib.h>				/* malloc, free */
 #include <stdio.h>				/* FIXME: debug */
+#include <string.h>				/* strcmp */
 #include <libmnl/libmnl.h>			/* MNL_ALIGN */
 
 #include <libipset/debug.h>			/* D() */
@@ -34,8 +36,84 @@ struct ipset {
 	struct ipset *next;
 };
 
+/* The cached sets are hashed by name. Every thread has got its own
+ * cache, allocated at the first added set. */
+#define IPSET_CACHE_HSIZE	4096
+
+struct ipset_cache {
+	struct ipset *hash[IPSET_CACHE_HSIZE];	/* cached sets */
+	struct ipset *last;			/* last looked up set */
+};
+
 static struct ipset_type *typelist;		/* registered set types */
-static struct ipset *setlist;			/* cached sets */
+static __thread struct ipset_cache *setcache;	/* cache of the thread */
+
+/* The registered types are not modified after loading them, except
+ * the sorting at the first lookup, under types_lock, and the result
+ * of the kernel check, which is the same in every thread */
+#define kernel_check_get(t)	\
+	__atomic_load_n(&(t)->kernel_check, __ATOMIC_RELAXED)
+#define kernel_check_set(t, v)	\
+	__atomic_store_n(&(t)->kernel_check, v, __ATOMIC_RELAXED)
+
+static unsigned int
+cache_hash(const char *name)
+{
+	unsigned int h = 0;
+
+	while (*name)
+		h = h * 31 + (unsigned char)*name++;
+	return h % IPSET_CACHE_HSIZE;
+}
+
+/* Consecutive restore lines mostly refer to the same set */
+static struct ipset *
+cache_find(const char *name)
+{
+	struct ipset *s;
+
+	if (setcache == NULL)
+		return NULL;
+	if (setcache->last && STREQ(setcache->last->name, name))
+		return setcache->last;
+	for (s = setcache->hash[cache_hash(name)]; s != NULL; s = s->next) {
+		if (STREQ(s->name, name)) {
+			setcache->last = s;
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/* Unlink the set from its hash chain */
+static struct ipset *
+cache_unlink(const char *name)
+{
+	struct ipset **s, *match;
+
+	if (setcache == NULL)
+		return NULL;
+	for (s = &setcache->hash[cache_hash(name)]; *s != NULL;
+	     s = &(*s)->next) {
+		if (STREQ((*s)->name, name)) {
+			match = *s;
+			*s = match->next;
+			if (setcache->last == match)
+				setcache->last = NULL;
+			return match;
+		}
+	}
+	return NULL;
+}
+
+static void
+cache_link(struct ipset *s)
+{
+	unsigned int h = cache_hash(s->name);
+
+	s->next = setcache->hash[h];
+	setcache->hash[h] = s;
+}
 
 /**
  * ipset_cache_add - add a set to the cache
@@ -51,11 +129,19 @@ int
 ipset_cache_add(const char *name, const struct ipset_type *type,
 		uint8_t family)
 {
-	struct ipset *s, *n;
+	struct ipset *n;
 
 	assert(name);
 	assert(type);
 
+	if (cache_find(name) != NULL)
+		return -EEXIST;
+
+	if (setcache == NULL) {
+		setcache = calloc(1, sizeof(*setcache));
+		if (setcache == NULL)
+			return -ENOMEM;
+	}
 	n = malloc(sizeof(*n));
 	if (n == NULL)
 		return -ENOMEM;
@@ -63,19 +149,7 @@ ipset_cache_add(const char *name, const struct ipset_type *type,
 	ipset_strlcpy(n->name, name, IPSET_MAXNAMELEN);
 	n->type = type;
 	n->family = family;
-	n->next = NULL;
-
-	if (setlist == NULL) {
-		setlist = n;
-		return 0;
-	}
-	for (s = setlist; s->next != NULL; s = s->next) {
-		if (STREQ(name, s->name)) {
-			free(n);
-			return -EEXIST;
-		}
-	}
-	s->next = n;
+	cache_link(n);
 
 	return 0;
 }
@@ -92,27 +166,13 @@ ipset_cache_add(const char *name, const struct ipset_type *type,
 int
 ipset_cache_del(const char *name)
 {
-	struct ipset *s, *match = NULL, *prev = NULL;
+	struct ipset *match;
 
 	if (!name) {
-		for (s = setlist; s != NULL; ) {
-			prev = s;
-			s = s->next;
-			free(prev);
-		}
-		setlist = NULL;
+		ipset_cache_fini();
 		return 0;
 	}
-	for (s = setlist; s != NULL && match == NULL; s = s->next) {
-		if (STREQ(s->name, name)) {
-			match = s;
-			if (prev == NULL)
-				setlist = match->next;
-			else
-				prev->next = match->next;
-		}
-		prev = s;
-	}
+	match = cache_unlink(name);
 	if (match == NULL)
 		return -EEXIST;
 
@@ -137,13 +197,12 @@ ipset_cache_rename(const char *from, const char *to)
 	assert(from);
 	assert(to);
 
-	for (s = setlist; s != NULL; s = s->next) {
-		if (STREQ(s->name, from)) {
-			ipset_strlcpy(s->name, to, IPSET_MAXNAMELEN);
-			return 0;
-		}
-	}
-	return -EEXIST;
+	s = cache_unlink(from);
+	if (s == NULL)
+		return -EEXIST;
+	ipset_strlcpy(s->name, to, IPSET_MAXNAMELEN);
+	cache_link(s);
+	return 0;
 }
 
 /**
@@ -158,20 +217,23 @@ ipset_cache_rename(const char *from, const char *to)
 int
 ipset_cache_swap(const char *from, const char *to)
 {
-	struct ipset *s, *a = NULL, *b = NULL;
+	struct ipset *a, *b;
+	const struct ipset_type *type;
+	uint8_t family;
 
 	assert(from);
 	assert(to);
 
-	for (s = setlist; s != NULL && (a == NULL || b == NULL); s = s->next) {
-		if (a == NULL && STREQ(s->name, from))
-			a = s;
-		if (b == NULL && STREQ(s->name, to))
-			b = s;
-	}
+	a = cache_find(from);
+	b = cache_find(to);
 	if (a != NULL && b != NULL) {
-		ipset_strlcpy(a->name, to, IPSET_MAXNAMELEN);
-		ipset_strlcpy(b->name, from, IPSET_MAXNAMELEN);
+		/* The names stay in place, so the hash chains too */
+		type = a->type;
+		family = a->family;
+		a->type = b->type;
+		a->family = b->family;
+		b->type = type;
+		b->family = family;
 		return 0;
 	}
 
@@ -198,10 +260,176 @@ ipset_match_typename(const char *name, const struct ipset_type *type)
 	return false;
 }
 
+/* The registered types are sorted by name and descending revision and
+ * indexed by their names and aliases at the first lookup after types
+ * were added, so that registering the types at startup is cheap and
+ * the lookups are binary searches. */
+
+struct type_name {
+	const char *name;			/* name or alias */
+	struct ipset_type *type;		/* highest revision */
+};
+
+static struct ipset_type *typepending;	/* added, not sorted yet */
+static bool types_dirty;
+static struct type_name *typenames;		/* sorted index */
+static size_t typenames_num;
+static pthread_mutex_t types_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define for_each_revision(t, head)	\
+	for (t = head; t != NULL && STREQ(t->name, (head)->name); t = t->next)
+
+static int
+type_cmp(const struct ipset_type *a, const struct ipset_type *b)
+{
+	int ret = strcmp(a->name, b->name);
+
+	return ret ? ret : (int)b->revision - (int)a->revision;
+}
+
+/* Stable merge sort of the type list */
+static struct ipset_type *
+type_sort(struct ipset_type *list, size_t n)
+{
+	struct ipset_type *a, *b, **tail, *t, *sorted = NULL;
+	size_t i;
+
+	if (n < 2)
+		return list;
+	for (t = list, i = 1; i < n / 2; i++)
+		t = t->next;
+	b = t->next;
+	t->next = NULL;
+	a = type_sort(list, n / 2);
+	b = type_sort(b, n - n / 2);
+
+	for (tail = &sorted; a != NULL && b != NULL; tail = &(*tail)->next) {
+		if (type_cmp(a, b) <= 0) {
+			*tail = a;
+			a = a->next;
+		} else {
+			*tail = b;
+			b = b->next;
+		}
+	}
+	*tail = a != NULL ? a : b;
+	return sorted;
+}
+
+static int
+type_name_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct type_name *)a)->name,
+		      ((const struct type_name *)b)->name);
+}
+
+static void
+type_name_add(struct type_name *names, size_t *num, struct ipset_type *head)
+{
+	const struct ipset_type *t;
+	const char * const *alias;
+
+	names[(*num)++] = (struct type_name) { head->name, head };
+	for_each_revision(t, head)
+		for (alias = t->alias; *alias != NULL; alias++)
+			names[(*num)++] = (struct type_name) { *alias, head };
+}
+
+static void
+types_resolve_locked(void)
+{
+	struct ipset_type *t, *next, *head, *list = typelist, **tail;
+	const struct ipset_arg *arg;
+	struct type_name *names;
+	enum ipset_adt cmd;
+	size_t n = 0, num = 0;
+	int i;
+
+	/* Append the new types in the order of the registration */
+	for (tail = &list; *tail != NULL; tail = &(*tail)->next)
+		n++;
+	for (t = typepending, typepending = NULL; t != NULL; t = next) {
+		next = t->next;
+		t->next = *tail;
+		*tail = t;
+		n++;
+		for (cmd = IPSET_ADD; cmd < IPSET_CADT_MAX; cmd++) {
+			for (i = 0; t->cmd[cmd].args[i] != IPSET_ARG_NONE;
+			     i++) {
+				arg = ipset_keyword(t->cmd[cmd].args[i]);
+				if (arg->opt < IPSET_OPT_EXT)
+					t->cmd[cmd].full |=
+						IPSET_FLAG(arg->opt);
+			}
+		}
+	}
+	typelist = type_sort(list, n);
+
+	/* The first registered one of the same revisions is kept */
+	for (t = typelist; t != NULL && t->next != NULL; ) {
+		if (type_cmp(t, t->next) == 0)
+			t->next = t->next->next;
+		else
+			t = t->next;
+	}
+
+	for (n = 0, t = typelist; t != NULL; t = t->next, n++)
+		for (i = 0; t->alias[i] != NULL; i++)
+			n++;
+	names = realloc(typenames, n * sizeof(*names));
+	if (names == NULL) {
+		/* Lookups fall back to scanning the list */
+		free(typenames);
+		typenames = NULL;
+		typenames_num = 0;
+		return;
+	}
+	for (head = typelist; head != NULL; head = t) {
+		type_name_add(names, &num, head);
+		for_each_revision(t, head)
+			;
+	}
+	qsort(names, num, sizeof(*names), type_name_cmp);
+	typenames = names;
+	typenames_num = num;
+}
+
+static void
+types_resolve(void)
+{
+	if (!__atomic_load_n(&types_dirty, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&types_lock);
+	if (types_dirty) {
+		types_resolve_locked();
+		__atomic_store_n(&types_dirty, false, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&types_lock);
+}
+
+/* The highest revision of the type with the given name or alias */
+static struct ipset_type *
+type_lookup(const char *name)
+{
+	const struct type_name key = { .name = name }, *found;
+	struct ipset_type *t;
+
+	types_resolve();
+	if (typenames == NULL) {
+		for (t = typelist; t != NULL; t = t->next)
+			if (ipset_match_typename(name, t))
+				return t;
+		return NULL;
+	}
+	found = bsearch(&key, typenames, typenames_num, sizeof(*typenames),
+			type_name_cmp);
+	return found != NULL ? found->type : NULL;
+}
+
 static inline const struct ipset_type *
 create_type_get(struct ipset_session *session)
 {
-	struct ipset_type *t, *match = NULL;
+	struct ipset_type *t, *head, *match = NULL;
 	struct ipset_data *data;
 	const char *typename;
 	uint8_t family, tmin = 0, tmax = 0;
@@ -216,12 +444,12 @@ create_type_get(struct ipset_session *session)
 	family = ipset_data_family(data);
 
 	/* Check registered types in userspace */
-	for (t = typelist; t != NULL; t = t->next) {
+	head = type_lookup(typename);
+	for_each_revision(t, head) {
 		/* Skip revisions which are unsupported by the kernel */
-		if (t->kernel_check == IPSET_KERNEL_MISMATCH)
+		if (kernel_check_get(t) == IPSET_KERNEL_MISMATCH)
 			continue;
-		if (ipset_match_typename(typename, t)
-		    && MATCH_FAMILY(t, family)) {
+		if (MATCH_FAMILY(t, family)) {
 			if (match == NULL) {
 				match = t;
 				tmin = tmax = t->revision;
@@ -243,7 +471,7 @@ create_type_get(struct ipset_session *session)
 			ignore_family = true;
 	}
 
-	if (match->kernel_check == IPSET_KERNEL_OK)
+	if (kernel_check_get(match) == IPSET_KERNEL_OK)
 		goto found;
 
 	/* Check kernel */
@@ -281,19 +509,19 @@ create_type_get(struct ipset_session *session)
 	}
 
 	/* Disable unsupported revisions */
-	for (match = NULL, t = typelist; t != NULL; t = t->next) {
+	match = NULL;
+	for_each_revision(t, head) {
 		/* Skip revisions which are unsupported by the kernel */
-		if (t->kernel_check == IPSET_KERNEL_MISMATCH)
+		if (kernel_check_get(t) == IPSET_KERNEL_MISMATCH)
 			continue;
-		if (ipset_match_typename(typename, t)
-		    && MATCH_FAMILY(t, family)) {
+		if (MATCH_FAMILY(t, family)) {
 			if (t->revision < kmin || t->revision > kmax)
-				t->kernel_check = IPSET_KERNEL_MISMATCH;
+				kernel_check_set(t, IPSET_KERNEL_MISMATCH);
 			else if (match == NULL)
 				match = t;
 		}
 	}
-	match->kernel_check = IPSET_KERNEL_OK;
+	kernel_check_set(match, IPSET_KERNEL_OK);
 found:
 	ipset_data_set(data, IPSET_OPT_TYPE, match);
 
@@ -319,7 +547,7 @@ adt_type_get(struct ipset_session *session)
 {
 	struct ipset_data *data;
 	struct ipset *s;
-	struct ipset_type *t;
+	struct ipset_type *t, *head;
 	const struct ipset_type *match;
 	const char *setname, *typename;
 	const uint8_t *revision;
@@ -332,12 +560,11 @@ adt_type_get(struct ipset_session *session)
 	assert(setname);
 
 	/* Check existing sets in cache */
-	for (s = setlist; s != NULL; s = s->next) {
-		if (STREQ(setname, s->name)) {
-			ipset_data_set(data, IPSET_OPT_FAMILY, &s->family);
-			ipset_data_set(data, IPSET_OPT_TYPE, s->type);
-			return s->type;
-		}
+	s = cache_find(setname);
+	if (s != NULL) {
+		ipset_data_set(data, IPSET_OPT_FAMILY, &s->family);
+		ipset_data_set(data, IPSET_OPT_TYPE, s->type);
+		return s->type;
 	}
 
 	/* Check kernel */
@@ -350,15 +577,17 @@ adt_type_get(struct ipset_session *session)
 	family = ipset_data_family(data);
 
 	/* Check registered types */
-	for (t = typelist, match = NULL;
-	     t != NULL && match == NULL; t = t->next) {
-		if (t->kernel_check == IPSET_KERNEL_MISMATCH)
+	head = type_lookup(typename);
+	match = NULL;
+	for_each_revision(t, head) {
+		if (kernel_check_get(t) == IPSET_KERNEL_MISMATCH)
 			continue;
 		if (STREQ(typename, t->name)
 		    && MATCH_FAMILY(t, family)
 		    && *revision == t->revision) {
-			t->kernel_check = IPSET_KERNEL_OK;
+			kernel_check_set(t, IPSET_KERNEL_OK);
 			match = t;
+			break;
 		}
 	}
 	if (!match)
@@ -427,13 +656,11 @@ ipset_type_get(struct ipset_session *session, enum ipset_cmd cmd)
 const struct ipset_type *
 ipset_type_higher_rev(const struct ipset_type *type)
 {
-	const struct ipset_type *t;
+	const struct ipset_type *t, *head = type_lookup(type->name);
 
-	/* Check all registered types in userspace */
-	for (t = typelist; t != NULL; t = t->next) {
-		if (STREQ(type->name, t->name)
-		    && type->family == t->family
-		    && type == t->next)
+	/* Check the revisions of the type in userspace */
+	for_each_revision(t, head) {
+		if (type->family == t->family && type == t->next)
 			return t;
 	}
 	return type;
@@ -451,7 +678,7 @@ ipset_type_higher_rev(const struct ipset_type *type)
 const struct ipset_type *
 ipset_type_check(struct ipset_session *session)
 {
-	const struct ipset_type *t, *match = NULL;
+	const struct ipset_type *t, *head, *match = NULL;
 	struct ipset_data *data;
 	const char *typename;
 	uint8_t family = NFPROTO_UNSPEC, revision;
@@ -465,13 +692,14 @@ ipset_type_check(struct ipset_session *session)
 	revision = *(const uint8_t *) ipset_data_get(data, IPSET_OPT_REVISION);
 
 	/* Check registered types */
-	for (t = typelist; t != NULL && match == NULL; t = t->next) {
-		if (t->kernel_check == IPSET_KERNEL_MISMATCH)
+	head = type_lookup(typename);
+	for_each_revision(t, head) {
+		if (kernel_check_get(t) == IPSET_KERNEL_MISMATCH)
 			continue;
-		if (ipset_match_typename(typename, t)
-		    && MATCH_FAMILY(t, family)
-		    && t->revision == revision)
+		if (MATCH_FAMILY(t, family) && t->revision == revision) {
 			match = t;
+			break;
+		}
 	}
 	if (!match)
 		return ipset_errptr(session,
@@ -488,57 +716,26 @@ ipset_type_check(struct ipset_session *session)
  * ipset_type_add - add (register) a userspace set type
  * @type: pointer to the set type structure
  *
- * Add the given set type to the type list. The types
- * are added sorted, in descending revision number.
+ * Add the given set type to the type list. The list is sorted by
+ * name and descending revision number at the next lookup, when the
+ * later added one of the types with the same name and revision is
+ * dropped.
  *
  * Returns 0 on success or a negative error code.
  */
 int
 ipset_type_add(struct ipset_type *type)
 {
-	struct ipset_type *t, *prev;
-	const struct ipset_arg *arg;
-	enum ipset_adt cmd;
-	int i;
-
 	assert(type);
 
 	if (strlen(type->name) > IPSET_MAXNAMELEN - 1)
 		return -EINVAL;
 
-	for (cmd = IPSET_ADD; cmd < IPSET_CADT_MAX; cmd++) {
-		for (i = 0; type->cmd[cmd].args[i] != IPSET_ARG_NONE; i++) {
-			arg = ipset_keyword(type->cmd[cmd].args[i]);
-			type->cmd[cmd].full |= IPSET_FLAG(arg->opt);
-		}
-	}
-	/* Add to the list: higher revision numbers first */
-	for (t = typelist, prev = NULL; t != NULL; t = t->next) {
-		if (STREQ(t->name, type->name)) {
-			if (t->revision == type->revision)
-				return -EEXIST;
-			else if (t->revision < type->revision) {
-				type->next = t;
-				if (prev)
-					prev->next = type;
-				else
-					typelist = type;
-				return 0;
-			}
-		}
-		if (t->next != NULL && STREQ(t->next->name, type->name)) {
-			if (t->next->revision == type->revision)
-				return -EEXIST;
-			else if (t->next->revision < type->revision) {
-				type->next = t->next;
-				t->next = type;
-				return 0;
-			}
-		}
-		prev = t;
-	}
-	type->next = typelist;
-	typelist = type;
+	pthread_mutex_lock(&types_lock);
+	type->next = typepending;
+	typepending = type;
+	__atomic_store_n(&types_dirty, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&types_lock);
 	return 0;
 }
 
@@ -554,12 +751,9 @@ ipset_type_add(struct ipset_type *type)
 const char *
 ipset_typename_resolve(const char *str)
 {
-	const struct ipset_type *t;
+	const struct ipset_type *t = type_lookup(str);
 
-	for (t = typelist; t != NULL; t = t->next)
-		if (ipset_match_typename(str, t))
-			return t->name;
-	return NULL;
+	return t != NULL ? t->name : NULL;
 }
 
 /**
@@ -573,6 +767,7 @@ ipset_typename_resolve(const char *str)
 const struct ipset_type *
 ipset_types(void)
 {
+	types_resolve();
 	return typelist;
 }
 
@@ -592,18 +787,25 @@ ipset_cache_init(void)
 /**
  * ipset_cache_fini - release the set cache
  *
- * Release the set cache.
+ * Release the set cache of the calling thread.
  */
 void
 ipset_cache_fini(void)
 {
 	struct ipset *set;
+	int i;
 
-	while (setlist) {
-		set = setlist;
-		setlist = setlist->next;
-		free(set);
+	if (setcache == NULL)
+		return;
+	for (i = 0; i < IPSET_CACHE_HSIZE; i++) {
+		while (setcache->hash[i]) {
+			set = setcache->hash[i];
+			setcache->hash[i] = set->next;
+			free(set);
+		}
 	}
+	free(setcache);
+	setcache = NULL;
 }
 
 extern void ipset_types_init(void);
@@ -611,7 +813,8 @@ extern void ipset_types_init(void);
 /**
  * ipset_load_types - load known set types
  *
- * Load in (register) all known set types for the system
+ * Load in (register) all known set types for the system. The types
+ * must be loaded before sessions are started on several threads.
  */
 void
 ipset_load_types(void)
@@ -626,7 +829,7 @@ ipset_load_types(void)
 	int    len;
 #endif
 
-	if (typelist != NULL)
+	if (typelist != NULL || typepending != NULL)
 		return;
 
 	/* Initialize static types */
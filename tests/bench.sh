@@ -0,0 +1,177 @@
+#!/bin/bash
+
+# Throughput of restore, save and list for large sets of every type.
+#
+#	bench.sh [-s "sizes"] [-t "types"] [-m] [-o file]
+#
+# The results are printed as CSV lines, one per set type, size and
+# operation:
+#
+#	type,family,elements,op,real,user,sys,sent,received
+#
+# real/user/sys are the seconds of the ipset process: the netlink
+# messages are processed by the kernel in the context of the sender,
+# so sys is the time spent in the kernel. With -m the operations are
+# run again under strace, to count the netlink messages sent and the
+# (dump) messages received.
+
+ipset=${IPSET_BIN:-../src/ipset}
+
+sizes="100000 1000000 10000000 50000000"
+types="bitmap:ip bitmap:ip,mac bitmap:port
+hash:ip hash:ip6 hash:ip,mac hash:ip,mark hash:ip,port hash:ip6,port
+hash:ip,port,ip hash:ip,port,net hash:mac hash:net hash:net6
+hash:net,iface hash:net,net hash:net,port hash:net,port,net range:ip"
+msgs=
+out=/dev/stdout
+
+while getopts "s:t:mo:" opt; do
+    case $opt in
+    s) sizes="$OPTARG";;
+    t) types="$OPTARG";;
+    m) msgs=1;;
+    o) out="$OPTARG";;
+    *) echo "Usage: $0 [-s sizes] [-t types] [-m] [-o file]" >&2
+       exit 1;;
+    esac
+done
+
+if ! $ipset version >/dev/null 2>&1; then
+    echo "$ipset cannot talk to the kernel, skipping the benchmarks" >&2
+    exit 0
+fi
+if [ -n "$msgs" ] && ! command -v strace >/dev/null; then
+    echo "strace is not installed, the messages are not counted" >&2
+    msgs=
+fi
+
+# For correct sorting:
+LC_ALL=C
+export LC_ALL
+
+TIMEFORMAT='%R %U %S'
+restore=${TMPDIR:-/tmp}/ipset-bench.$$
+trap 'rm -f $restore $restore.*; $ipset x bench 2>/dev/null' EXIT
+
+# The restore file of the set: the elements are generated from their
+# index, so the IPv4 addresses start at 16.0.0.0 to fit 50M of /30 nets
+gen() {
+    local type=$1 family=inet create
+
+    case $type in
+    *6*) family=inet6; type=${type//6/};;
+    esac
+    case $type in
+    bitmap:port) create="range 0-65535";;
+    bitmap:*) create="range 10.0.0.0/16";;
+    range:*) create="family $family";;
+    *) create="family $family hashsize $(( $2 / 8 + 64 )) maxelem $2";;
+    esac
+    [ $type = hash:mac ] && create=${create#family inet }
+    echo "create bench $type $create"
+    awk -v n=$2 -v type=$type -v family=$family '
+    function ip4(v) {
+        v += 16 * 16777216
+        return sprintf("%d.%d.%d.%d", int(v / 16777216),
+                       int(v / 65536) % 256, int(v / 256) % 256, v % 256)
+    }
+    function ip(v) {
+        if (family == "inet")
+            return ip4(v)
+        return sprintf("2001:db8::%x:%x", int(v / 65536), v % 65536)
+    }
+    function net(v) {
+        if (family == "inet")
+            return ip4(v * 4) "/30"
+        return sprintf("2001:db8:%x:%x::/64", int(v / 65536), v % 65536)
+    }
+    function mac(v) {
+        return sprintf("02:00:%02x:%02x:%02x:%02x", int(v / 16777216),
+                       int(v / 65536) % 256, int(v / 256) % 256, v % 256)
+    }
+    BEGIN {
+        for (i = 0; i < n; i++) {
+            if (type == "bitmap:ip")
+                e = sprintf("10.0.%d.%d", int(i / 256), i % 256)
+            else if (type == "bitmap:ip,mac")
+                e = sprintf("10.0.%d.%d,%s", int(i / 256), i % 256, mac(i))
+            else if (type == "bitmap:port")
+                e = i
+            else if (type == "hash:ip")
+                e = ip(i)
+            else if (type == "hash:ip,mac")
+                e = ip(i) "," mac(i)
+            else if (type == "hash:ip,mark")
+                e = ip(i) "," i % 256
+            else if (type == "hash:ip,port")
+                e = ip(i) ",tcp:" 1 + i % 1024
+            else if (type == "hash:ip,port,ip")
+                e = ip(i) ",80,192.168.0.1"
+            else if (type == "hash:ip,port,net")
+                e = ip(i) ",80,192.168.0.0/24"
+            else if (type == "hash:mac")
+                e = mac(i)
+            else if (type == "hash:net")
+                e = net(i)
+            else if (type == "hash:net,iface")
+                e = net(i) ",eth" i % 16
+            else if (type == "hash:net,net")
+                e = net(i) ",192.168.0.0/24"
+            else if (type == "hash:net,port")
+                e = net(i) ",80"
+            else if (type == "hash:net,port,net")
+                e = net(i) ",80,192.168.0.0/24"
+            else if (type == "range:ip")
+                e = ip4(i * 4) "-" ip4(i * 4 + 1)
+            print "add bench " e
+        }
+    }'
+}
+
+# Time the operation, then count its messages in a second run, which
+# starts from the same state: prints real,user,sys,sent,received
+run() {
+    local op=$1 t sent= recv=
+
+    shift
+    t=$( { time "$@" >/dev/null 2>&1 ; } 2>&1 )
+    if [ -n "$msgs" ]; then
+        [ $op = restore ] && $ipset x bench
+        strace -f -qq -e trace=sendto,sendmsg,recvfrom,recvmsg \
+            -o $restore.trace "$@" >/dev/null 2>&1
+        sent=$(grep -c -E '^[0-9]+ +send' $restore.trace)
+        recv=$(grep -c -E '^[0-9]+ +recv' $restore.trace)
+    fi
+    echo "${t// /,},$sent,$recv"
+}
+
+echo "type,family,elements,op,real,user,sys,sent,received" > $out
+for type in $types; do
+    family=inet
+    case $type in
+    *6*) family=inet6;;
+    esac
+    last=
+    for size in $sizes; do
+        case $type in
+        bitmap:*) [ $size -gt 65536 ] && size=65536;;
+        esac
+        [ "$size" = "$last" ] && continue
+        last=$size
+        echo "$type $size" >&2
+        $ipset x bench 2>/dev/null
+        gen $type $size > $restore
+        for op in restore save list-sorted list-terse; do
+            case $op in
+            restore) cmd="sh -c \"exec $ipset restore < $restore\"";;
+            save) cmd="$ipset save bench";;
+            list-sorted) cmd="$ipset -sorted list bench";;
+            list-terse) cmd="$ipset -terse list bench";;
+            esac
+            [ $op = restore ] && $ipset x bench 2>/dev/null
+            echo "${type/6/},$family,$size,$op,$(eval run $op $cmd)" >> $out
+        done
+        $ipset x bench
+        rm -f $restore
+    done
+done
@@ -1,5 +1,24 @@
 #!/bin/sh
 
+# With -t, print how long the listing and the saving take
+timed() {
+    if [ -z "$TIMING" ]; then
+        "$@"
+        return
+    fi
+    start=`date +%s%N`
+    "$@"
+    ret=$?
+    end=`date +%s%N`
+    echo "$*: $(( (end - start) / 1000000 )) ms" >&2
+    return $ret
+}
+
+TIMING=
+if [ "$1" = "-t" ]; then
+    TIMING=1
+fi
+
 ipset x test >/dev/null 2>&1
 ipset n test hash:ip
 for x in `seq 0 255`; do
@@ -7,8 +26,8 @@ for x in `seq 0 255`; do
         echo "a test 10.10.$x.$y"
     done
 done | ipset r
-ipset -t list > .foo
+timed ipset -t list > .foo
 diff .foo big_sort.terse
-ipset -s save > .foo
+timed ipset -s save > .foo
 diff .foo big_sort.saved
 ipset x test
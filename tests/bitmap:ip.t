@@ -230,4 +230,26 @@ skip which sendip
 0 ./check_extensions test 10.255.255.64 600 6 $((6*40))
 # Counters and timeout: destroy set
 0 ipset x test
+# Large range: create set from a /8
+0 ipset create test bitmap:ip range 10.0.0.0/8
+# Large range: add a /12 at once
+0 ipset add test 10.16.0.0/12
+# Large range: add single elements
+0 ipset add test 10.200.1.1
+# Large range: add single elements
+0 ipset add test 10.200.1.2
+# Large range: test element from the /12
+0 ipset test test 10.31.255.255
+# Large range: test element outside of the /12
+1 ipset test test 10.32.0.0
+# Large range: delete element from the /12
+0 ipset del test 10.20.3.4
+# Large range: test deleted element
+1 ipset test test 10.20.3.4
+# Large range: check number of elements
+0 ipset -t list test | grep -q 'Number of entries: 1048577'
+# Large range: extensions are not supported
+1 ipset create test2 bitmap:ip range 10.0.0.0/8 counters
+# Large range: destroy set
+0 ipset x test
 # eof
@@ -136,6 +136,20 @@
 0 ipset flush test
 # Hash comment: Delete test set
 0 ipset destroy test
+# Hash comment: Create set for shared comments
+0 ipset create test hash:ip comment
+# Hash comment: Add elements sharing the same comment
+0 for x in `seq 0 255`; do echo "add test 2.0.0.$x comment \\\"threatfeed\\\""; done | ipset restore
+# Hash comment: Delete an element sharing the comment
+0 ipset del test 2.0.0.0
+# Hash comment: Check that the others keep the comment
+0 n=`ipset list test | grep -c 'comment "threatfeed"'` && test $n -eq 255
+# Hash comment: Change the comment of an element
+0 ipset -! add test 2.0.0.1 comment "other"
+# Hash comment: Check the changed and the shared comments
+0 ipset list test | grep -q '^2.0.0.1 comment "other"' && ipset list test | grep -q '^2.0.0.2 comment "threatfeed"'
+# Hash comment: Delete test set
+0 ipset destroy test
 # List comment: Create a, b, c sets
 0 for x in a b c; do ipset n $x hash:ip; done
 # List comment: Create test set with comment
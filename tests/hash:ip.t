@@ -40,6 +40,14 @@
 1 ipset -T test 1.1.1.2
 # IP: Delete test set
 0 ipset -X test
+# IP: Restore packed elements, check the line of the failed one
+0 printf 'create test2 hash:ip\nadd test2 10.0.0.1\nadd test2 10.0.0.2\nadd test2 10.0.0.1\n' | ipset -R 2>&1 | grep -q 'Error in line 4:'
+# IP: Check that the elements before the failed one are added
+0 test `ipset -S test2| grep add| wc -l` -eq 2
+# IP: Test elements read from stdin, print the missing ones
+0 test "`printf '10.0.0.1\n10.0.0.3\n10.0.0.2\n' | ipset test test2 -`" = "10.0.0.3"
+# IP: Delete test2 set
+0 ipset -X test2
 # IP: Restore values so that rehashing is triggered
 0 sed 's/hashsize 128/hashsize 128 timeout 4/' iphash.t.restore | ipset -R
 # IP: Check that the values are restored
@@ -50,6 +58,12 @@
 0 test `ipset -S test| grep add| wc -l` -eq 0
 # IP: Flush test set
 0 ipset -F test
+# IP: Restore values with pipelined batches
+0 sed '/^create/d' iphash.t.restore | ipset -pipeline -R
+# IP: Check that the values are restored
+0 test `ipset -S test| grep add| wc -l` -eq 129
+# IP: Flush test set
+0 ipset -F test
 # IP: Stress test resizing
 0 ./resize.sh
 # IP: Check listing, which requires multiple messages
@@ -210,4 +224,361 @@ skip which sendip
 0 ./check_extensions test 10.255.255.64 600 6 $((6*40))
 # Counters and timeout: destroy set
 0 ipset x test
+# Bloom filter: create set
+0 ipset n test hash:ip bloom
+# Bloom filter: check listing header
+0 ipset -L test | grep -q '^Header: .* bloom'
+# Bloom filter: check false positive rate in listing
+0 ipset -L test | grep -q '^Bloom false positive rate: '
+# Bloom filter: add element
+0 ipset a test 2.0.0.1
+# Bloom filter: test element
+0 ipset t test 2.0.0.1
+# Bloom filter: test element not added
+1 ipset t test 2.0.0.2
+# Bloom filter: delete element
+0 ipset d test 2.0.0.1
+# Bloom filter: test deleted element
+1 ipset t test 2.0.0.1
+# Bloom filter: add range of elements
+0 ipset a test 10.0.0.0-10.0.3.255
+# Bloom filter: test element from range
+0 ipset t test 10.0.2.17
+# Bloom filter: test element outside of range
+1 ipset t test 10.0.4.17
+# Bloom filter: flush set
+0 ipset f test
+# Bloom filter: test flushed element
+1 ipset t test 10.0.2.17
+# Bloom filter: destroy set
+0 ipset x test
+# Hash function: create set with hsiphash
+0 ipset n test hash:ip hashfn hsiphash
+# Hash function: check listing header
+0 ipset -L test | grep -q '^Header: .* hashfn hsiphash'
+# Hash function: add range of elements
+0 ipset a test 10.0.0.0-10.0.3.255
+# Hash function: test element from range
+0 ipset t test 10.0.2.17
+# Hash function: test element outside of range
+1 ipset t test 10.0.4.17
+# Hash function: destroy set
+0 ipset x test
+# Hash function: create set with mulshift
+0 ipset n test hash:ip hashfn mulshift
+# Hash function: add range of elements
+0 ipset a test 10.0.0.0-10.0.3.255
+# Hash function: test element from range
+0 ipset t test 10.0.2.17
+# Hash function: test element outside of range
+1 ipset t test 10.0.4.17
+# Hash function: destroy set
+0 ipset x test
+# Hash function: unknown function
+1 ipset n test hash:ip hashfn md5
+# Prealloc: create set
+0 ipset n test hash:ip maxelem 4096 prealloc
+# Prealloc: check listing header
+0 ipset -L test | grep -q '^Header: .* prealloc'
+# Prealloc: check hashsize sized by maxelem
+0 ipset -L test | grep -q '^Header: .* hashsize 2048 '
+# Prealloc: add range of elements
+0 ipset a test 10.0.0.0-10.0.3.255
+# Prealloc: test element from range
+0 ipset t test 10.0.2.17
+# Prealloc: delete element
+0 ipset d test 10.0.2.17
+# Prealloc: test deleted element
+1 ipset t test 10.0.2.17
+# Prealloc: flush set
+0 ipset f test
+# Prealloc: test flushed element
+1 ipset t test 10.0.1.1
+# Prealloc: add element after flush
+0 ipset a test 10.0.1.1
+# Prealloc: test element
+0 ipset t test 10.0.1.1
+# Prealloc: destroy set
+0 ipset x test
+# Regionbits: create set with too small regions
+1 ipset n test hash:ip regionbits 2
+# Regionbits: enable the statistics
+0 echo 1 > /sys/module/ip_set/parameters/stats
+# Regionbits: create set
+0 ipset n test hash:ip hashsize 1024 regionbits 4
+# Regionbits: check listing header
+0 ipset -L test | grep -q '^Header: .* regionbits 4'
+# Regionbits: add range of elements
+0 ipset a test 10.0.0.0-10.0.3.255
+# Regionbits: test element from range
+0 ipset t test 10.0.2.17
+# Regionbits: check lock statistics
+0 ipset -stats -L test | grep -q '^Region locks: acquired [1-9][0-9]*, '
+# Regionbits: check lookup statistics
+0 ipset -stats -L test | grep -q '^Lookups: tests [1-9][0-9]*, hits [1-9][0-9]*, '
+# Regionbits: check lookup statistics in procfs
+0 grep -q '^test [1-9][0-9]* ' /proc/net/ip_set/stats
+# Regionbits: check memory usage by components
+0 ipset -stats -L test | grep -q '^Memory usage: table [1-9][0-9]*, buckets [1-9][0-9]*, '
+# Regionbits: check the pages of the table
+0 ipset -stats -L test | grep -q '^Table pages: \(vmalloc\|contiguous\|huge\)$'
+# Regionbits: destroy set
+0 ipset x test
+# Regionbits: disable the statistics
+0 echo 0 > /sys/module/ip_set/parameters/stats
+# NUMA: create set with invalid node
+1 ipset n test hash:ip numa 4095
+# NUMA: create set on node 0
+0 ipset n test hash:ip numa 0
+# NUMA: check listing header
+0 ipset -L test | grep -q '^Header: .* numa 0'
+# NUMA: destroy set
+0 ipset x test
+# NUMA: create interleaved set
+0 ipset n test hash:ip numa interleave
+# NUMA: check listing header
+0 ipset -L test | grep -q '^Header: .* numa interleave'
+# NUMA: add range of elements
+0 ipset a test 10.0.0.0-10.0.3.255
+# NUMA: test element from range
+0 ipset t test 10.0.2.17
+# NUMA: destroy set
+0 ipset x test
+# GC: create set with timeout
+0 ipset n test hash:ip timeout 3
+# GC: add element expiring soon
+0 ipset a test 10.0.0.1 timeout 1
+# GC: the set is listed by the scheduler
+0 grep -q '^test [0-9]* ' /proc/net/ip_set/gc
+# GC: sleep 4s so that the element is collected
+0 sleep 4
+# GC: check the run of the set in procfs
+0 grep -q '^test [0-9]* [1-9][0-9]* ' /proc/net/ip_set/gc
+# GC: check the element is evicted
+0 ipset -L test | grep -q '^Number of entries: 0$'
+# GC: destroy set
+0 ipset x test
+# GC: the destroyed set is not listed
+1 grep -q '^test ' /proc/net/ip_set/gc
+# Atomic: create set
+0 ipset n test hash:ip
+# Atomic: add element
+0 ipset a test 10.0.0.3
+# Atomic: restore a batch failing at its last element
+1 printf 'add test 10.0.0.1\nadd test 10.0.0.2\nadd test 10.0.0.3\n' | ipset -atomic -R
+# Atomic: the elements before the failed one are reverted
+0 test `ipset -S test | grep add | wc -l` -eq 1
+# Atomic: add a range overlapping the element
+1 ipset -atomic a test 10.0.0.1-10.0.0.5
+# Atomic: the range is reverted
+0 test `ipset -S test | grep add | wc -l` -eq 1
+# Atomic: restore a del batch failing at its last element
+1 printf 'del test 10.0.0.3\ndel test 10.0.0.9\n' | ipset -atomic -R
+# Atomic: the deleted element is restored
+0 ipset t test 10.0.0.3
+# Atomic: destroy set
+0 ipset x test
+# Clone: create set
+0 ipset n test hash:ip timeout 0 comment
+# Clone: add elements
+0 ipset a test 10.0.0.1 comment "first" && ipset a test 10.0.0.2 timeout 100
+# Clone: clone set
+0 ipset clone test test2
+# Clone: clone to existing set
+1 ipset clone test test2
+# Clone: test element in clone
+0 ipset t test2 10.0.0.1
+# Clone: check comment in clone
+0 ipset -L test2 | grep -q '^10.0.0.1 .*comment "first"'
+# Clone: check the number of elements in clone
+0 test `ipset -S test2 | grep add | wc -l` -eq 2
+# Clone: add element to clone
+0 ipset a test2 10.0.0.3
+# Clone: test element not in original set
+1 ipset t test 10.0.0.3
+# Clone: destroy sets
+0 ipset x test && ipset x test2
+# Freeze: create set
+0 ipset n test hash:ip hashsize 128 comment
+# Freeze: add elements
+0 for x in `seq 1 200`; do echo a test 10.0.1.$x comment "e$x"; done | ipset restore
+# Freeze: freeze set
+0 ipset freeze test
+# Freeze: freeze frozen set
+0 ipset freeze test
+# Freeze: test element
+0 ipset t test 10.0.1.100
+# Freeze: test element not in set
+1 ipset t test 10.0.2.100
+# Freeze: check comment
+0 ipset -L test | grep -q '^10.0.1.7 comment "e7"'
+# Freeze: check the number of elements
+0 test `ipset -S test | grep add | wc -l` -eq 200
+# Freeze: add element fails
+1 ipset a test 10.0.2.1
+# Freeze: delete element fails
+1 ipset d test 10.0.1.1
+# Freeze: clone set
+0 ipset clone test test2
+# Freeze: add element to clone
+0 ipset a test2 10.0.2.1
+# Freeze: destroy clone
+0 ipset x test2
+# Freeze: thaw set
+0 ipset thaw test
+# Freeze: delete element
+0 ipset d test 10.0.1.1
+# Freeze: add element
+0 ipset a test 10.0.2.1
+# Freeze: check the number of elements
+0 test `ipset -S test | grep add | wc -l` -eq 200
+# Freeze: flush frozen set
+0 ipset freeze test && ipset f test
+# Freeze: add element to flushed set
+0 ipset a test 10.0.2.1
+# Freeze: destroy set
+0 ipset x test
+# Freeze: set with timeout cannot be frozen
+1 ipset n test hash:ip timeout 10 && ipset freeze test
+# Freeze: destroy set
+0 ipset x test
+# Purge: create set
+0 ipset n test hash:ip timeout 600 counters comment
+# Purge: add elements
+0 for x in `seq 1 100`; do echo a test 10.0.3.$x timeout $((100 + x * 5)) packets $x comment "tag$((x % 2))-$x"; done | ipset restore
+# Purge: delete the elements by comment prefix
+0 ipset purge test comment tag1-
+# Purge: check the number of elements
+0 test `ipset -S test | grep add | wc -l` -eq 50
+# Purge: no element with the purged comment left
+1 ipset -S test | grep -q 'comment "tag1-'
+# Purge: delete the elements below a packet counter
+0 ipset purge test packets-lt 21
+# Purge: check the number of elements
+0 test `ipset -S test | grep add | wc -l` -eq 40
+# Purge: delete the elements expiring soon
+0 ipset purge test timeout-lt 395 comment tag0-
+# Purge: check the number of elements
+0 test `ipset -S test | grep add | wc -l` -eq 21
+# Purge: a condition is required
+1 ipset purge test
+# Purge: destroy set
+0 ipset x test
+# Purge: condition over a missing extension is rejected
+1 ipset n test hash:ip && ipset purge test comment tag
+# Purge: destroy set
+0 ipset x test
+# Sync: create set
+0 ipset n test hash:ip
+# Sync: add elements
+0 ipset a test 10.0.0.1 && ipset a test 10.0.0.2
+# Sync: sync set to new elements
+0 printf '10.0.0.2\n# comment\n10.0.0.3\n10.0.0.3\n' | ipset sync test
+# Sync: test kept element
+0 ipset t test 10.0.0.2
+# Sync: test added element
+0 ipset t test 10.0.0.3
+# Sync: test deleted element
+1 ipset t test 10.0.0.1
+# Sync: check number of elements
+0 test `ipset -S test | grep add | wc -l` -eq 2
+# Sync: empty input flushes the set
+0 ipset sync test < /dev/null
+# Sync: check the set is empty
+0 test `ipset -S test | grep add | wc -l` -eq 0
+# Sync: destroy set
+0 ipset x test
+# Changed: create set with counters
+0 ipset n test hash:ip counters
+# Changed: add element
+0 ipset a test 10.0.0.1 packets 5 bytes 10
+# Changed: check epoch in listing header
+0 ipset -stats -L test | grep -q '^Epoch: [1-9][0-9]*$'
+# Changed: plain listing keeps the epoch
+0 e=`ipset -stats -t -L test | sed -n 's/^Epoch: //p'` && ipset -L test >/dev/null && test `ipset -stats -t -L test | sed -n 's/^Epoch: //p'` -eq $e
+# Changed: unchanged element is not listed
+0 e=`ipset -changed 0 -S test | sed -n 's/^# epoch //p'` && test `ipset -changed $e -S test | grep add | wc -l` -eq 0
+# Changed: updated element is listed
+0 e=`ipset -changed 0 -S test | sed -n 's/^# epoch //p'` && ipset -! a test 10.0.0.1 packets 7 bytes 20 && ipset -changed $e -S test | grep -q '^add test 10.0.0.1 '
+# Changed: epoch comment in save format
+0 ipset -changed 0 -S test | grep -q '^# epoch [1-9][0-9]*$'
+# Reset: list and reset counters
+0 ipset -reset -S test | grep -q 'packets 7 bytes 20'
+# Reset: check counters are reset
+0 ipset -S test | grep -q 'packets 0 bytes 0'
+# Snapshot: save a copy of the set
+0 ipset -snapshot -S test | grep -q '^add test 10.0.0.1 '
+# Snapshot: the set continues in the copy
+0 ipset t test 10.0.0.1
+# Changed: destroy set
+0 ipset x test
+# Top: create set with counters
+0 ipset n test hash:ip counters
+# Top: add elements
+0 ipset a test 10.0.0.1 packets 1 bytes 100 && ipset a test 10.0.0.2 packets 3 bytes 50 && ipset a test 10.0.0.3 packets 2 bytes 300
+# Top: list the top elements by bytes
+0 test "`ipset -top 2 -S test | grep add | cut -d' ' -f3 | tr '\n' ' '`" = "10.0.0.3 10.0.0.1 "
+# Top: list the top element by packets
+0 test "`ipset -top 1,packets -S test | grep add | cut -d' ' -f3`" = "10.0.0.2"
+# Top: destroy set
+0 ipset x test
+# Filter: create sets
+0 ipset n test hash:ip && ipset n test2 hash:ip maxelem 1024
+# Filter: add elements
+0 ipset a test 10.0.0.1 && ipset a test 10.0.0.2 && ipset a test 10.0.1.1 && ipset a test2 192.168.0.1
+# Filter: list the members matching a wildcard pattern
+0 test "`ipset -match '10.0.0.*' -S test | grep add | cut -d' ' -f3 | sort | tr '\n' ' '`" = "10.0.0.1 10.0.0.2 "
+# Filter: list the members not matching a regex
+0 test "`ipset -regex '!^10\.0\.0\.' -S test | grep add | cut -d' ' -f3`" = "10.0.1.1"
+# Filter: count the matching members
+0 ipset -t -match '10.0.0.*' -L test | grep -q '^Matched entries: 2$'
+# Filter: list the names of the sets with matching members
+0 test "`ipset -n -match '192.*' -L`" = "test2"
+# Filter: list the names of the sets by their header
+0 test "`ipset -n -header maxelem=1024 -L`" = "test2"
+# Filter: conditions on the header fields must all hold
+0 test "`ipset -n -header 'entries>1' -header 'entries<=3' -L`" = "test"
+# Filter: unknown header field
+1 ipset -n -header size=1 -L
+# Filter: total of the listed sets
+0 ipset -t -total -L | grep -q '^Total entries: 4$'
+# Filter: destroy sets
+0 ipset x test && ipset x test2
+# Ratelimit: create set with a default rate limit
+0 ipset create test hash:ip rate 100 burst 200
+# Ratelimit: check that the defaults are listed
+0 ipset -L test | grep -q '^Header: .* rate 100 burst 200'
+# Ratelimit: add an element with the defaults
+0 ipset -A test 10.0.0.1
+# Ratelimit: add an element with its own rate
+0 ipset -A test 10.0.0.2 rate 10
+# Ratelimit: check the listed limits of the elements
+0 test "`ipset -S test | grep add | sort | tr '\n' ' '`" = "add test 10.0.0.1 rate 100 burst 200 add test 10.0.0.2 rate 10 burst 200 "
+# Ratelimit: a zero rate is rejected
+1 ipset -A test 10.0.0.3 rate 0
+# Ratelimit: destroy set
+0 ipset x test
+# Ratelimit: a burst without a rate is rejected
+1 ipset create test hash:ip burst 10
+# Ratelimit: create set without rate limit
+0 ipset create test hash:ip
+# Ratelimit: rate of an element is rejected
+1 ipset -A test 10.0.0.1 rate 10
+# Ratelimit: destroy set
+0 ipset x test
+# Ctevents: a destroy event only is rejected
+1 ipset create test hash:ip ctevents destroy
+# Ctevents: an unknown event is rejected
+1 ipset create test hash:ip ctevents new,related
+# Ctevents: more dimensions than three are rejected
+1 ipset create test hash:ip ctevents new ctdir src,src,src,src
+# Ctevents: a direction without events is rejected
+1 ipset create test hash:ip ctdir reply:src
+skip modprobe ip_set_ctevent
+# Ctevents: create set populated by the conntrack events
+0 ipset create test hash:ip ctevents new,destroy ctdir reply:dst timeout 60
+# Ctevents: check the events and the direction in the listing
+0 ipset -L test | grep -q '^Header: .* ctevents new,destroy ctdir reply:dst'
+# Ctevents: destroy set
+0 ipset x test
 # eof
@@ -166,4 +166,30 @@
 0 ./check_extensions test 2.0.0.0/25,2.0.0.0/25 700 13 12479
 # Counters and timeout: destroy set
 0 ipset x test
+# LPM: create set with lpm index
+0 ipset n test hash:net,net lpm
+# LPM: add an element
+0 ipset a test 10.0.0.0/8,192.168.0.0/16
+# LPM: add a more specific non-matching element
+0 ipset a test 10.1.0.0/16,192.168.1.0/24 nomatch
+# LPM: add an element with different prefixes
+0 ipset a test 10.1.2.0/24,172.16.0.0/12
+# LPM: check matching element
+0 ipset t test 10.1.1.1,192.168.2.1
+# LPM: check non-matching element
+1 ipset t test 10.1.1.1,192.168.1.1
+# LPM: check element matching by the most specific first part
+0 ipset t test 10.1.2.1,172.16.1.1
+# LPM: check element without matching second part
+1 ipset t test 10.1.2.1,10.0.0.1
+# LPM: delete non-matching element
+0 ipset d test 10.1.0.0/16,192.168.1.0/24
+# LPM: check element again
+0 ipset t test 10.1.1.1,192.168.1.1
+# LPM: flush set
+0 ipset f test
+# LPM: check element after flush
+1 ipset t test 10.1.1.1,192.168.1.1
+# LPM: destroy set
+0 ipset x test
 # eof
@@ -180,4 +180,22 @@
 0 ./check_extensions test 2.0.0.20 700 13 12479
 # Counters and timeout: destroy set
 0 ipset x test
+# LPM: create set with lpm index
+0 ipset n test hash:net,port,net lpm
+# LPM: add an element
+0 ipset a test 10.0.0.0/8,tcp:80,192.168.0.0/16
+# LPM: add a more specific non-matching element
+0 ipset a test 10.1.0.0/16,tcp:80,192.168.1.0/24 nomatch
+# LPM: add an element with short second prefix
+0 ipset a test 10.1.2.0/24,udp:53,0.0.0.0/1
+# LPM: check matching element
+0 ipset t test 10.1.1.1,tcp:80,192.168.2.1
+# LPM: check non-matching element
+1 ipset t test 10.1.1.1,tcp:80,192.168.1.1
+# LPM: check element with different port
+1 ipset t test 10.1.1.1,tcp:81,192.168.2.1
+# LPM: check element matching the short prefix
+0 ipset t test 10.1.2.1,udp:53,1.2.3.4
+# LPM: destroy set
+0 ipset x test
 # eof
@@ -154,6 +154,38 @@
 0 ./check_counters test 2.0.0.0/25 13 12479
 # Counters: destroy set
 0 ipset x test
+# Per-cpu counters: create set
+0 ipset n test hash:net counters percpu
+# Per-cpu counters: check listing header
+0 ipset -L test | grep -q '^Header: .* counters percpu'
+# Per-cpu counters: add element with packet, byte counters
+0 ipset a test 2.0.0.1/24 packets 5 bytes 3456
+# Per-cpu counters: check counters
+0 ./check_counters test 2.0.0.0/24 5 3456
+# Per-cpu counters: update counters
+0 ipset -! a test 2.0.0.1/24 packets 13 bytes 12479
+# Per-cpu counters: check counters
+0 ./check_counters test 2.0.0.0/24 13 12479
+# Per-cpu counters: delete element
+0 ipset d test 2.0.0.1/24
+# Per-cpu counters: flush set
+0 ipset f test
+# Per-cpu counters: destroy set
+0 ipset x test
+# Sampled counters: create set without counters
+1 ipset n test hash:net sample 64
+# Sampled counters: create set with invalid rate
+1 ipset n test hash:net counters sample 0
+# Sampled counters: create set
+0 ipset n test hash:net counters sample 64
+# Sampled counters: check listing header
+0 ipset -L test | grep -q '^Header: .* counters sample 64'
+# Sampled counters: add element with packet, byte counters
+0 ipset a test 2.0.0.1/24 packets 5 bytes 3456
+# Sampled counters: check counters
+0 ./check_counters test 2.0.0.0/24 5 3456
+# Sampled counters: destroy set
+0 ipset x test
 # Counters and timeout: create set
 0 ipset n test hash:net counters timeout 600
 # Counters and timeout: add element with packet, byte counters
@@ -180,4 +212,116 @@
 0 ./check_extensions test 2.0.0.0/25 700 13 12479
 # Counters and timeout: destroy set
 0 ipset x test
+# LPM: create set with lpm index
+0 ipset create test hash:net lpm
+# LPM: add a non-matching IP address entry
+0 ipset -A test 1.1.1.1 nomatch
+# LPM: add an overlapping matching small net
+0 ipset -A test 1.1.1.0/30
+# LPM: add an overlapping non-matching larger net
+0 ipset -A test 1.1.1.0/28 nomatch
+# LPM: add an even larger matching net
+0 ipset -A test 1.1.1.0/26
+# LPM: add a disjoint net
+0 ipset -A test 10.0.0.0/8
+# LPM: check non-matching IP
+1 ipset -T test 1.1.1.1
+# LPM: check matching IP from non-matching small net
+0 ipset -T test 1.1.1.3
+# LPM: check non-matching IP from larger net
+1 ipset -T test 1.1.1.4
+# LPM: check matching IP from even larger net
+0 ipset -T test 1.1.1.16
+# LPM: check IP from the disjoint net
+0 ipset -T test 10.1.2.3
+# LPM: check IP not covered by any net
+1 ipset -T test 1.1.2.1
+# LPM: delete overlapping small net
+0 ipset -D test 1.1.1.0/30
+# LPM: check IP from the deleted net
+1 ipset -T test 1.1.1.3
+# LPM: check that the option is listed
+0 ipset -L test | grep -q '^Header: .* lpm'
+# LPM: flush set
+0 ipset flush test
+# LPM: check IP after flush
+1 ipset -T test 10.1.2.3
+# LPM: destroy set
+0 ipset x test
+# Aggregate: create set with aggregation
+0 ipset create test hash:net aggregate
+# Aggregate: add a net
+0 ipset -A test 10.0.0.0/24
+# Aggregate: add its sibling net
+0 ipset -A test 10.0.1.0/24
+# Aggregate: check that the nets are merged
+0 ipset -L test | grep -q '^10.0.0.0/23$'
+# Aggregate: check that the sibling nets are gone
+1 ipset -L test | grep -q '^10.0.1.0/24$'
+# Aggregate: add a covered net
+0 ipset -A test 10.0.1.128/25
+# Aggregate: check that the covered net is not added
+1 ipset -L test | grep -q '^10.0.1.128/25$'
+# Aggregate: check IP from the merged net
+0 ipset -T test 10.0.1.200
+# Aggregate: add a non-matching net
+0 ipset -A test 10.0.2.0/24 nomatch
+# Aggregate: add a net below the non-matching one
+0 ipset -A test 10.0.2.0/25
+# Aggregate: add its sibling net
+0 ipset -A test 10.0.2.128/25
+# Aggregate: check that the merging stopped at the non-matching net
+0 ipset -L test | grep -q '^10.0.2.0/24 nomatch$'
+# Aggregate: check that the option is listed
+0 ipset -L test | grep -q '^Header: .* aggregate'
+# Aggregate: destroy set
+0 ipset x test
+# Distinct: create set with distinct sources estimate
+0 ipset create test hash:net counters distinct
+# Distinct: add a net
+0 ipset -A test 10.0.0.0/24
+# Distinct: check that the empty estimate is listed
+0 ipset -L test | grep -q '^10.0.0.0/24 packets 0 bytes 0 distinct 0$'
+# Distinct: check that the option is listed
+0 ipset -L test | grep -q '^Header: .* distinct'
+# Distinct: save set
+0 ipset save test > .foo
+# Distinct: destroy set
+0 ipset x test
+# Distinct: restore the saved set with the listed estimate
+0 ipset restore < .foo
+# Distinct: check the restored net
+0 ipset -T test 10.0.0.1
+# Distinct: destroy set
+0 ipset x test
+# Dual-stack: create set of family inet46
+0 ipset create test hash:net family inet46
+# Dual-stack: check the listed family
+0 ipset -L test | grep -q '^Header: family inet46 '
+# Dual-stack: add an IPv4 network
+0 ipset -A test 10.0.0.0/24
+# Dual-stack: add an IPv6 network
+0 ipset -A test 2001:db8::/32
+# Dual-stack: test an IPv4 address
+0 ipset -T test 10.0.0.1
+# Dual-stack: test an IPv6 address
+0 ipset -T test 2001:db8::1
+# Dual-stack: test an IPv4 address outside of the set
+1 ipset -T test 10.0.1.1
+# Dual-stack: check the listed elements
+0 test "`ipset -S test | grep add | sort | tr '\n' ' '`" = "add test 10.0.0.0/24 add test 2001:db8::/32 "
+# Dual-stack: save set
+0 ipset -S test > .foo
+# Dual-stack: destroy set
+0 ipset x test
+# Dual-stack: restore set
+0 ipset -R < .foo && rm .foo
+# Dual-stack: test an IPv4 address of the restored set
+0 ipset -T test 10.0.0.1
+# Dual-stack: IP ranges are rejected
+1 ipset -A test 10.0.2.0-10.0.2.9
+# Dual-stack: destroy set
+0 ipset x test
+# Dual-stack: netmask is rejected
+1 ipset create test hash:ip family inet46 netmask 24
 # eof
@@ -136,4 +136,20 @@
 0 ./check_extensions test 2:: 700 13 12479
 # Counters and timeout: destroy set
 0 ipset x test
+# LPM: create set with lpm index
+0 ipset n test hash:net -6 lpm
+# LPM: add a matching net
+0 ipset a test 2001:db8::/32
+# LPM: add an overlapping non-matching net
+0 ipset a test 2001:db8:1::/48 nomatch
+# LPM: check IP from the matching net
+0 ipset t test 2001:db8:2::1
+# LPM: check IP from the non-matching net
+1 ipset t test 2001:db8:1::1
+# LPM: delete the non-matching net
+0 ipset d test 2001:db8:1::/48
+# LPM: check IP from the matching net again
+0 ipset t test 2001:db8:1::1
+# LPM: destroy set
+0 ipset x test
 # eof
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Rough per-lookup cost of the hash functions: fill a set, then time
+# a batch of test commands through restore for every hash function.
+# The netlink round trip of each command dominates the result, so only
+# the differences between the functions are meaningful.
+
+ipset=${IPSET_BIN:-../src/ipset}
+type=${1:-hash:ip,port,ip}
+n=${2:-65536}
+
+gen() {
+    for x in `seq 0 $((n / 256 - 1))`; do
+        for y in `seq 0 255`; do
+            case "$type" in
+            hash:ip) echo "$1 hashfn-test 10.0.$x.$y";;
+            hash:ip,port) echo "$1 hashfn-test 10.0.$x.$y,tcp:80";;
+            *) echo "$1 hashfn-test 10.0.$x.$y,tcp:80,192.168.$y.$x";;
+            esac
+        done
+    done
+}
+
+adds=`mktemp`; tests=`mktemp`
+trap "rm -f $adds $tests; $ipset x hashfn-test 2>/dev/null" EXIT
+gen a > $adds
+gen t > $tests
+
+set -e
+
+for fn in jhash hsiphash mulshift; do
+    $ipset x hashfn-test 2>/dev/null || true
+    $ipset n hashfn-test $type hashsize $n maxelem $((n * 2)) hashfn $fn
+    $ipset restore < $adds
+    start=`date +%s%N`
+    $ipset restore < $tests
+    end=`date +%s%N`
+    echo "$fn: $(( (end - start) / n )) ns/lookup"
+done
@@ -0,0 +1,310 @@
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* Microbenchmarks of the set types compiled in userspace:
+ *
+ *	bench [-f filter] [-n maxsize] [-r repeats] [-s seed] [-v]
+ *
+ * Every benchmark is identified as type/family/operation/size and
+ * reports the best time per operation of the repeats. The sizes grow
+ * by four from 1024 up to maxsize (default 262144). The types marked
+ * "generic" run a set without extensions with the functions of the sets
+ * with extensions, against the lean test function of hash:ip. The
+ * operations:
+ *
+ *	add	userspace add of size elements into the empty set
+ *	hit	packet path test of the elements in the set
+ *	miss	packet path test of the addresses not in the set
+ *	list	listing of the set, per element
+ *	resize	a forced resize of the full set, per element
+ *	del	userspace delete of all the elements
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+#include "kshim_set.h"
+
+#define NFPROTO_IPV4	2
+#define NFPROTO_IPV6	10
+
+struct bench_type {
+	const char *name;
+	uint8_t family;
+	uint8_t cidr;		/* of the elements of the net types */
+	uint32_t maxsize;	/* of the bitmap types */
+	bool generic;		/* without the lean variant */
+};
+
+static const struct bench_type bench_types[] = {
+	{ "hash:ip",	NFPROTO_IPV4 },
+	{ "hash:ip",	NFPROTO_IPV4, .generic = true },
+	{ "hash:ip",	NFPROTO_IPV6 },
+	{ "hash:ip",	NFPROTO_IPV6, .generic = true },
+	{ "hash:net",	NFPROTO_IPV4, 24 },
+	{ "hash:net",	NFPROTO_IPV6, 64 },
+	{ "bitmap:ip",	NFPROTO_IPV4, 0, 65536 },
+};
+
+static const char *filter;
+static unsigned int repeats = 3;
+
+/* The n-th address of the elements, scattered over the address space:
+ * the multiplication by an odd number is a permutation modulo 2^k
+ */
+static void
+bench_addr(const struct bench_type *t, uint32_t n, bool miss, uint8_t *ip)
+{
+	uint32_t v = (n * 2654435761U) & 0x7fffff;
+
+	memset(ip, 0, 16);
+	if (t->maxsize) {
+		/* Misses fall into the other half of the bitmap */
+		v = (n * 40503U) & (t->maxsize / 2 - 1);
+		if (miss)
+			v |= t->maxsize / 2;
+	} else if (miss) {
+		v |= 0x800000;
+	}
+	if (t->family == NFPROTO_IPV4) {
+		/* 10.0.0.0/7, the net types spread the nets in 0.0.0.0/0 */
+		v = t->cidr ? v << (32 - t->cidr) : (10U << 24) + v;
+		v = htonl(v);
+		memcpy(ip, &v, sizeof(v));
+	} else {
+		/* 2001:db8::/32 */
+		ip[0] = 0x20;
+		ip[1] = 0x01;
+		ip[2] = 0x0d;
+		ip[3] = 0xb8;
+		v = htonl(v);
+		memcpy(t->cidr ? ip + 4 : ip + 12, &v, sizeof(v));
+	}
+}
+
+static struct kshim_set *
+bench_create(const struct bench_type *t, uint32_t size)
+{
+	struct kshim_set_opts opts = { .maxelem = size * 2 };
+	struct kshim_set *set;
+	uint32_t ip = htonl(10U << 24), ip_to = htonl((10U << 24) + 0xffff);
+	int ret;
+
+	if (t->maxsize) {
+		memcpy(opts.ip, &ip, sizeof(ip));
+		memcpy(opts.ip_to, &ip_to, sizeof(ip_to));
+	}
+	ret = kshim_set_create(&set, "bench", t->name, t->family, &opts);
+	if (ret) {
+		fprintf(stderr, "Cannot create %s: %d\n", t->name, ret);
+		exit(1);
+	}
+	if (t->generic) {
+		/* The sets with timeout use the generic functions */
+		struct kshim_set *from = NULL;
+
+		opts.timeout = 600;
+		ret = kshim_set_create(&from, "bench-generic", t->name,
+				       t->family, &opts);
+		if (!ret)
+			ret = kshim_set_variant_of(set, from);
+		if (from)
+			kshim_set_destroy(from);
+		if (ret) {
+			fprintf(stderr, "Cannot create generic %s: %d\n",
+				t->name, ret);
+			exit(1);
+		}
+	}
+	return set;
+}
+
+static void
+bench_elem(const struct bench_type *t, uint32_t n, struct kshim_elem *elem)
+{
+	memset(elem, 0, sizeof(*elem));
+	bench_addr(t, n, false, elem->ip);
+	elem->cidr = t->cidr;
+}
+
+static int
+bench_count(void *priv, const struct kshim_elem *elem)
+{
+	(*(uint32_t *)priv)++;
+	return 0;
+}
+
+static void
+bench_check(int ret, const char *what)
+{
+	if (ret < 0) {
+		fprintf(stderr, "%s failed: %d\n", what, ret);
+		exit(1);
+	}
+}
+
+enum {
+	BENCH_ADD, BENCH_HIT, BENCH_MISS, BENCH_LIST, BENCH_RESIZE, BENCH_DEL,
+	BENCH_MAX,
+};
+
+static const char * const bench_ops[BENCH_MAX] = {
+	"add", "hit", "miss", "list", "resize", "del",
+};
+
+/* One round of all the operations, the times are in ns per element */
+static void
+bench_round(const struct bench_type *t, uint32_t size, double *ns)
+{
+	struct kshim_set *set = bench_create(t, size);
+	struct kshim_elem elem;
+	uint8_t ip[16];
+	uint32_t i, listed = 0;
+	unsigned long long start;
+	int ret;
+
+	start = ktime_get_ns();
+	for (i = 0; i < size; i++) {
+		bench_elem(t, i, &elem);
+		bench_check(kshim_set_uadt(set, IPSET_ADD, &elem, 0), "add");
+	}
+	ns[BENCH_ADD] = (double)(ktime_get_ns() - start) / size;
+
+	for (int op = BENCH_HIT; op <= BENCH_MISS; op++) {
+		start = ktime_get_ns();
+		for (i = 0; i < size; i++) {
+			bench_addr(t, i, op == BENCH_MISS, ip);
+			ret = kshim_set_kadt(set, IPSET_TEST, ip);
+			if ((ret > 0) != (op == BENCH_HIT)) {
+				fprintf(stderr, "%s of element %u failed\n",
+					bench_ops[op], i);
+				exit(1);
+			}
+		}
+		ns[op] = (double)(ktime_get_ns() - start) / size;
+	}
+
+	start = ktime_get_ns();
+	bench_check(kshim_set_list_start(set, 16384), "list");
+	while ((ret = kshim_set_list_step(set, bench_count, &listed)) > 0)
+		;
+	bench_check(ret, "list");
+	ns[BENCH_LIST] = (double)(ktime_get_ns() - start) / size;
+	if (listed != size) {
+		fprintf(stderr, "listed %u elements instead of %u\n",
+			listed, size);
+		exit(1);
+	}
+
+	start = ktime_get_ns();
+	ret = kshim_set_resize(set);
+	ns[BENCH_RESIZE] = ret == -EOPNOTSUPP ? -1 :
+			   (double)(ktime_get_ns() - start) / size;
+	kshim_quiesce();
+
+	start = ktime_get_ns();
+	for (i = 0; i < size; i++) {
+		bench_elem(t, i, &elem);
+		bench_check(kshim_set_uadt(set, IPSET_DEL, &elem, 0), "del");
+	}
+	ns[BENCH_DEL] = (double)(ktime_get_ns() - start) / size;
+
+	kshim_set_destroy(set);
+}
+
+static bool
+bench_selected(const char *name)
+{
+	return !filter || strstr(name, filter);
+}
+
+static void
+bench_run(const struct bench_type *t, uint32_t size)
+{
+	double best[BENCH_MAX], ns[BENCH_MAX];
+	char names[BENCH_MAX][64];
+	bool any = false;
+	unsigned int r;
+	int op;
+
+	for (op = 0; op < BENCH_MAX; op++) {
+		snprintf(names[op], sizeof(names[op]), "%s%s/%s/%s/%u",
+			 t->name, t->generic ? ",generic" : "",
+			 t->family == NFPROTO_IPV4 ? "inet" : "inet6",
+			 bench_ops[op], size);
+		any |= bench_selected(names[op]);
+		best[op] = -1;
+	}
+	if (!any)
+		return;
+	for (r = 0; r < repeats; r++) {
+		bench_round(t, size, ns);
+		for (op = 0; op < BENCH_MAX; op++)
+			if (best[op] < 0 || (ns[op] >= 0 && ns[op] < best[op]))
+				best[op] = ns[op];
+	}
+	for (op = 0; op < BENCH_MAX; op++) {
+		if (!bench_selected(names[op]) || best[op] < 0)
+			continue;
+		printf("%-36s %12.1f ns %12u\n", names[op], best[op], size);
+	}
+	fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long long seed = 1;
+	uint32_t maxsize = 262144, size;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:n:r:s:v")) != -1) {
+		switch (opt) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 'n':
+			maxsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			repeats = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			kshim_verbose = 1;
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: %s [-f filter] [-n maxsize] [-r repeats] [-s seed] [-v]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (!repeats)
+		repeats = 1;
+	kshim_seed(seed);
+	if (kshim_set_init()) {
+		fprintf(stderr, "Cannot register the set types\n");
+		return 1;
+	}
+	printf("%-36s %15s %12s\n", "Benchmark", "Time", "Elements");
+	for (i = 0; i < sizeof(bench_types) / sizeof(bench_types[0]); i++)
+		for (size = 1024; size <= maxsize; size *= 4)
+			if (!bench_types[i].maxsize ||
+			    size <= bench_types[i].maxsize / 2)
+				bench_run(&bench_types[i], size);
+	kshim_set_fini();
+	return 0;
+}
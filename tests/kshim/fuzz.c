@@ -0,0 +1,537 @@
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* Fuzz target of the set types compiled in userspace.
+ *
+ * The input is a program: the first byte selects the set type and the
+ * create options, the rest are operations with their arguments. The
+ * elements are indexed by 16 bits, the target keeps a model of the set
+ * and aborts when the set disagrees with it.
+ *
+ * Built with -DKSHIM_FUZZ_MAIN it is a standalone driver as well:
+ *
+ *	fuzz-replay file...	run the inputs in the files
+ *	fuzz-replay -r count [-s seed]	run random inputs
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+#include "kshim_set.h"
+
+#define NFPROTO_IPV4	2
+#define NFPROTO_IPV6	10
+
+#define FUZZ_ELEMS	65536
+/* Expiry times closer than this to the clock are not checked */
+#define FUZZ_SLACK	(2 * KSHIM_HZ)
+
+struct fuzz_type {
+	const char *name;
+	uint8_t family;
+	uint8_t cidr;		/* of the elements of the net types */
+	uint8_t pos;		/* of the index in the address */
+	bool bitmap;
+};
+
+static const struct fuzz_type fuzz_types[] = {
+	{ "hash:ip",	NFPROTO_IPV4, 0, 2 },
+	{ "hash:ip",	NFPROTO_IPV6, 0, 14 },
+	{ "hash:net",	NFPROTO_IPV4, 24, 1 },
+	{ "bitmap:ip",	NFPROTO_IPV4, 0, 2, true },
+};
+
+enum fuzz_state {
+	FUZZ_ABSENT,
+	FUZZ_PRESENT,
+	FUZZ_UNKNOWN,		/* after a failed operation */
+};
+
+struct fuzz {
+	const uint8_t *data;
+	size_t size;
+	const struct fuzz_type *t;
+	struct kshim_set *set;
+	bool timeout;
+	bool frozen;		/* add and del fail */
+	unsigned long now;	/* ticks since the creation */
+	uint8_t state[FUZZ_ELEMS];
+	unsigned long expires[FUZZ_ELEMS];	/* zero: permanent */
+	uint8_t listed[FUZZ_ELEMS];
+};
+
+#define fuzz_fail(f, fmt, args...)					\
+do {									\
+	fprintf(stderr, "%s/%s: " fmt "\n", (f)->t->name,		\
+		(f)->t->family == NFPROTO_IPV4 ? "inet" : "inet6", ## args); \
+	abort();							\
+} while (0)
+
+static uint8_t
+fuzz_u8(struct fuzz *f)
+{
+	if (!f->size)
+		return 0;
+	f->size--;
+	return *f->data++;
+}
+
+static uint16_t
+fuzz_u16(struct fuzz *f)
+{
+	uint16_t hi = fuzz_u8(f);
+
+	return hi << 8 | fuzz_u8(f);
+}
+
+/* The address of the element: 10.0.0.0/16, 10.0.0.0/8 of /24 nets
+ * or 2001:db8::/112
+ */
+static void
+fuzz_addr(const struct fuzz_type *t, uint16_t n, uint8_t *ip)
+{
+	static const uint8_t net4[] = { 10 };
+	static const uint8_t net6[] = { 0x20, 0x01, 0x0d, 0xb8 };
+
+	memset(ip, 0, 16);
+	if (t->family == NFPROTO_IPV4)
+		memcpy(ip, net4, sizeof(net4));
+	else
+		memcpy(ip, net6, sizeof(net6));
+	ip[t->pos] = n >> 8;
+	ip[t->pos + 1] = n;
+}
+
+static uint16_t
+fuzz_index(const struct fuzz_type *t, const uint8_t *ip)
+{
+	return ip[t->pos] << 8 | ip[t->pos + 1];
+}
+
+/* Whether the element is in the set for sure, not at all, or either */
+static enum fuzz_state
+fuzz_model(const struct fuzz *f, uint16_t n)
+{
+	unsigned long expires = f->expires[n];
+
+	if (f->state[n] != FUZZ_PRESENT || !expires)
+		return f->state[n];
+	if (f->now + FUZZ_SLACK < expires)
+		return FUZZ_PRESENT;
+	if (f->now > expires + FUZZ_SLACK)
+		return FUZZ_ABSENT;
+	return FUZZ_UNKNOWN;
+}
+
+static void
+fuzz_learn(struct fuzz *f, uint16_t n, bool present)
+{
+	f->state[n] = present ? FUZZ_PRESENT : FUZZ_ABSENT;
+	if (!present)
+		f->expires[n] = 0;
+}
+
+static void
+fuzz_add(struct fuzz *f, uint16_t n, uint32_t timeout, uint32_t flags)
+{
+	struct kshim_elem elem = { .cidr = f->t->cidr };
+	enum fuzz_state model = fuzz_model(f, n);
+	int ret;
+
+	fuzz_addr(f->t, n, elem.ip);
+	if (f->timeout) {
+		elem.with_timeout = true;
+		elem.timeout = timeout;
+	}
+	ret = kshim_set_uadt(f->set, IPSET_ADD, &elem, flags);
+	if (ret == 0) {
+		if (model == FUZZ_PRESENT && !(flags & IPSET_FLAG_EXIST))
+			fuzz_fail(f, "add of existing element %u", n);
+		f->state[n] = FUZZ_PRESENT;
+		f->expires[n] = timeout ? f->now + timeout * KSHIM_HZ : 0;
+	} else if (ret == -IPSET_ERR_EXIST) {
+		if (model == FUZZ_ABSENT || (flags & IPSET_FLAG_EXIST))
+			fuzz_fail(f, "add of element %u: exists", n);
+		/* The timeout of a pending element is not refreshed */
+		f->state[n] = FUZZ_PRESENT;
+	} else if (ret == -ENOMEM) {
+		f->state[n] = FUZZ_UNKNOWN;
+	} else if (ret != -IPSET_ERR_FROZEN || !f->frozen) {
+		fuzz_fail(f, "add of element %u: %d", n, ret);
+	}
+}
+
+static void
+fuzz_del(struct fuzz *f, uint16_t n)
+{
+	struct kshim_elem elem = { .cidr = f->t->cidr };
+	enum fuzz_state model = fuzz_model(f, n);
+	int ret;
+
+	fuzz_addr(f->t, n, elem.ip);
+	ret = kshim_set_uadt(f->set, IPSET_DEL, &elem, 0);
+	if (ret == 0) {
+		if (model == FUZZ_ABSENT)
+			fuzz_fail(f, "del of missing element %u", n);
+		fuzz_learn(f, n, false);
+	} else if (ret == -IPSET_ERR_EXIST) {
+		if (model == FUZZ_PRESENT)
+			fuzz_fail(f, "del of element %u: missing", n);
+		fuzz_learn(f, n, false);
+	} else if (ret == -ENOMEM) {
+		f->state[n] = FUZZ_UNKNOWN;
+	} else if (ret != -IPSET_ERR_FROZEN || !f->frozen) {
+		fuzz_fail(f, "del of element %u: %d", n, ret);
+	}
+}
+
+static void
+fuzz_test(struct fuzz *f, uint16_t n, bool kadt)
+{
+	struct kshim_elem elem = { .cidr = f->t->cidr };
+	enum fuzz_state model = fuzz_model(f, n);
+	bool found;
+	int ret;
+
+	fuzz_addr(f->t, n, elem.ip);
+	if (kadt) {
+		/* Any address of the net matches it */
+		if (f->t->cidr)
+			elem.ip[3] = n;
+		ret = kshim_set_kadt(f->set, IPSET_TEST, elem.ip);
+		if (ret == -ENOMEM)
+			return;
+		if (ret < 0)
+			fuzz_fail(f, "kadt test of element %u: %d", n, ret);
+		found = ret > 0;
+	} else {
+		ret = kshim_set_uadt(f->set, IPSET_TEST, &elem, 0);
+		if (ret == -ENOMEM)
+			return;
+		if (ret && ret != -IPSET_ERR_EXIST)
+			fuzz_fail(f, "test of element %u: %d", n, ret);
+		found = !ret;
+	}
+	if (model != FUZZ_UNKNOWN && found != (model == FUZZ_PRESENT))
+		fuzz_fail(f, "test of element %u: %s", n,
+			  found ? "found" : "not found");
+	if (model == FUZZ_UNKNOWN && (!found || !f->expires[n]))
+		fuzz_learn(f, n, found);
+}
+
+/* Delete the elements expiring in less than timeout seconds */
+static void
+fuzz_purge(struct fuzz *f, uint32_t timeout)
+{
+	unsigned long limit = f->now + timeout * KSHIM_HZ;
+	unsigned int n;
+	int ret;
+
+	ret = kshim_set_purge(f->set, timeout);
+	if (ret) {
+		/* Only the hash types with timeout support it */
+		if ((ret != -EOPNOTSUPP || !f->t->bitmap) &&
+		    (ret != -IPSET_ERR_TIMEOUT || f->timeout || f->t->bitmap))
+			fuzz_fail(f, "purge: %d", ret);
+		return;
+	}
+	for (n = 0; n < FUZZ_ELEMS; n++) {
+		if (f->state[n] != FUZZ_PRESENT || !f->expires[n])
+			continue;
+		if (f->expires[n] + FUZZ_SLACK < limit)
+			fuzz_learn(f, n, false);
+		else if (f->expires[n] <= limit + FUZZ_SLACK)
+			f->state[n] = FUZZ_UNKNOWN;
+	}
+}
+
+static int
+fuzz_list_elem(void *priv, const struct kshim_elem *elem)
+{
+	struct fuzz *f = priv;
+	uint16_t n = fuzz_index(f->t, elem->ip);
+	uint8_t ip[16];
+
+	fuzz_addr(f->t, n, ip);
+	if (memcmp(ip, elem->ip, sizeof(ip)))
+		fuzz_fail(f, "listed alien element");
+	if (f->t->cidr && elem->cidr != f->t->cidr)
+		fuzz_fail(f, "listed element %u with cidr %u", n, elem->cidr);
+	if (f->timeout != elem->with_timeout)
+		fuzz_fail(f, "listed element %u with wrong timeout", n);
+	if (f->listed[n]++)
+		fuzz_fail(f, "element %u listed twice", n);
+	return 0;
+}
+
+/* A listing without changes of the set must match the model */
+static void
+fuzz_list(struct fuzz *f, unsigned int msgsize)
+{
+	uint32_t elements, memsize, listed = 0;
+	unsigned int n;
+	int ret;
+
+	memset(f->listed, 0, sizeof(f->listed));
+	ret = kshim_set_list_start(f->set, msgsize);
+	if (ret)
+		fuzz_fail(f, "list start: %d", ret);
+	while ((ret = kshim_set_list_step(f->set, fuzz_list_elem, f)) > 0)
+		;
+	if (ret == -ENOMEM) {
+		return;
+	} else if (ret < 0) {
+		fuzz_fail(f, "list: %d", ret);
+	}
+	for (n = 0; n < FUZZ_ELEMS; n++) {
+		enum fuzz_state model = fuzz_model(f, n);
+
+		if (model != FUZZ_UNKNOWN &&
+		    f->listed[n] != (model == FUZZ_PRESENT))
+			fuzz_fail(f, "element %u %s", n,
+				  f->listed[n] ? "listed" : "not listed");
+		listed += f->listed[n];
+	}
+	/* The header counts the elements without listing them: the
+	 * expired ones are counted until the garbage collector runs
+	 */
+	ret = kshim_set_header(f->set, &elements, &memsize);
+	if (ret)
+		fuzz_fail(f, "header: %d", ret);
+	if (!f->timeout && elements != listed)
+		fuzz_fail(f, "header of %u elements, %u listed",
+			  elements, listed);
+}
+
+/* One step of a listing, the set may be changed before the next one.
+ * The elements are checked against themselves only.
+ */
+static void
+fuzz_list_step(struct fuzz *f)
+{
+	int ret;
+
+	memset(f->listed, 0, sizeof(f->listed));
+	ret = kshim_set_list_start(f->set, 2048);
+	if (ret && ret != -EBUSY)
+		fuzz_fail(f, "list start: %d", ret);
+	ret = kshim_set_list_step(f->set, fuzz_list_elem, f);
+	if (ret < 0 && ret != -ENOMEM)
+		fuzz_fail(f, "list step: %d", ret);
+}
+
+enum {
+	FUZZ_OP_ADD,
+	FUZZ_OP_ADD_EXIST,
+	FUZZ_OP_DEL,
+	FUZZ_OP_TEST,
+	FUZZ_OP_KTEST,
+	FUZZ_OP_RANGE,
+	FUZZ_OP_RESIZE,
+	FUZZ_OP_FLUSH,
+	FUZZ_OP_ADVANCE,
+	FUZZ_OP_FAIL_ALLOC,
+	FUZZ_OP_LIST,
+	FUZZ_OP_LIST_STEP,
+	FUZZ_OP_QUIESCE,
+	FUZZ_OP_FREEZE,
+	FUZZ_OP_PURGE,
+	FUZZ_OP_MAX,
+};
+
+static void
+fuzz_run(struct fuzz *f)
+{
+	uint16_t n, m;
+	uint8_t arg;
+	int ret;
+
+	while (f->size) {
+		switch (fuzz_u8(f) % FUZZ_OP_MAX) {
+		case FUZZ_OP_ADD:
+		case FUZZ_OP_ADD_EXIST:
+			n = fuzz_u16(f);
+			arg = fuzz_u8(f);
+			fuzz_add(f, n, f->timeout ? arg % 8 : 0,
+				 arg & 0x80 ? IPSET_FLAG_EXIST : 0);
+			break;
+		case FUZZ_OP_DEL:
+			fuzz_del(f, fuzz_u16(f));
+			break;
+		case FUZZ_OP_TEST:
+			fuzz_test(f, fuzz_u16(f), false);
+			break;
+		case FUZZ_OP_KTEST:
+			fuzz_test(f, fuzz_u16(f), true);
+			break;
+		case FUZZ_OP_RANGE:
+			/* A run of single adds and tests, to fill buckets */
+			n = fuzz_u16(f);
+			arg = fuzz_u8(f);
+			for (m = 0; m < arg; m++)
+				fuzz_add(f, n + m * 257, 0, IPSET_FLAG_EXIST);
+			for (m = 0; m < arg; m++)
+				fuzz_test(f, n + m * 257, m % 2);
+			break;
+		case FUZZ_OP_RESIZE:
+			ret = kshim_set_resize(f->set);
+			/* The first type specific error is the full hash */
+			if (ret && ret != -EOPNOTSUPP && ret != -ENOMEM &&
+			    ret != -IPSET_ERR_TYPE_SPECIFIC &&
+			    (ret != -IPSET_ERR_FROZEN || !f->frozen))
+				fuzz_fail(f, "resize: %d", ret);
+			break;
+		case FUZZ_OP_FLUSH:
+			/* The flushed set is thawed */
+			kshim_set_flush(f->set);
+			f->frozen = false;
+			memset(f->state, FUZZ_ABSENT, sizeof(f->state));
+			memset(f->expires, 0, sizeof(f->expires));
+			break;
+		case FUZZ_OP_ADVANCE:
+			arg = fuzz_u8(f);
+			kshim_advance(arg * KSHIM_HZ / 16);
+			f->now += arg * KSHIM_HZ / 16;
+			break;
+		case FUZZ_OP_FAIL_ALLOC:
+			kshim_fail_alloc(fuzz_u8(f) % 16);
+			break;
+		case FUZZ_OP_LIST:
+			kshim_set_list_end(f->set);
+			kshim_fail_alloc(-1);
+			/* A bucket must fit into a message as a whole */
+			fuzz_list(f, 2048 + fuzz_u8(f) * 8);
+			break;
+		case FUZZ_OP_LIST_STEP:
+			fuzz_list_step(f);
+			break;
+		case FUZZ_OP_QUIESCE:
+			kshim_quiesce();
+			break;
+		case FUZZ_OP_FREEZE:
+			ret = kshim_set_freeze(f->set, !f->frozen);
+			if (!ret)
+				f->frozen = !f->frozen;
+			/* The sets with timeout and the bitmaps are refused */
+			else if ((ret != -EOPNOTSUPP ||
+				  (!f->timeout && !f->t->bitmap)) &&
+				 ret != -ENOMEM)
+				fuzz_fail(f, "%s: %d",
+					  f->frozen ? "thaw" : "freeze", ret);
+			break;
+		case FUZZ_OP_PURGE:
+			fuzz_purge(f, fuzz_u8(f) % 8);
+			break;
+		}
+	}
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static struct fuzz *f;
+	struct kshim_set_opts opts = { .maxelem = 2 * FUZZ_ELEMS };
+	uint32_t ip = htonl(10U << 24), ip_to = htonl((10U << 24) + 0xffff);
+	uint8_t conf;
+	int ret;
+
+	if (!f) {
+		f = malloc(sizeof(*f));
+		if (!f || kshim_set_init())
+			abort();
+	}
+	memset(f, 0, sizeof(*f));
+	f->data = data;
+	f->size = size;
+	conf = fuzz_u8(f);
+	f->t = &fuzz_types[conf % 4];
+	f->timeout = conf & 0x10;
+	if (f->timeout)
+		opts.timeout = 1;
+	if (conf & 0x20)
+		opts.hashsize = 64;
+	if (f->t->bitmap) {
+		memcpy(opts.ip, &ip, sizeof(ip));
+		memcpy(opts.ip_to, &ip_to, sizeof(ip_to));
+	}
+	kshim_seed(conf);
+	ret = kshim_set_create(&f->set, "fuzz", f->t->name, f->t->family,
+			       &opts);
+	if (ret)
+		fuzz_fail(f, "create: %d", ret);
+	fuzz_run(f);
+	kshim_fail_alloc(-1);
+	kshim_set_destroy(f->set);
+	return 0;
+}
+
+#ifdef KSHIM_FUZZ_MAIN
+#include <getopt.h>
+
+static int
+fuzz_file(const char *name)
+{
+	static uint8_t buf[1 << 20];
+	FILE *fp = fopen(name, "rb");
+	size_t len;
+
+	if (!fp) {
+		perror(name);
+		return 1;
+	}
+	len = fread(buf, 1, sizeof(buf), fp);
+	fclose(fp);
+	LLVMFuzzerTestOneInput(buf, len);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long count = 0, i;
+	unsigned int seed = 1;
+	uint8_t buf[4096];
+	size_t len, j;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "r:s:")) != -1) {
+		switch (opt) {
+		case 'r':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: %s [-r count] [-s seed] [file...]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	for (; optind < argc; optind++)
+		ret |= fuzz_file(argv[optind]);
+
+	srandom(seed);
+	for (i = 0; i < count; i++) {
+		len = 1 + random() % sizeof(buf);
+		for (j = 0; j < len; j++)
+			buf[j] = random();
+		LLVMFuzzerTestOneInput(buf, len);
+	}
+	if (count)
+		printf("%lu random inputs run\n", count);
+	return ret;
+}
+#endif /* KSHIM_FUZZ_MAIN */
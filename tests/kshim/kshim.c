@@ -0,0 +1,744 @@
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* The out of line part of the kernel API emulated by kshim.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <malloc.h>
+
+unsigned long volatile jiffies = 1;
+/* The single task, never NULL as in the kernel */
+struct task_struct { int pid; } kshim_task;
+struct task_struct *current = &kshim_task;
+struct net init_net;
+int nr_node_ids = 1;
+struct workqueue_struct *system_wq, *system_unbound_wq,
+			*system_power_efficient_wq, *system_long_wq;
+int kshim_verbose;
+
+void
+kshim_bug(const char *file, int line)
+{
+	fprintf(stderr, "BUG at %s:%d\n", file, line);
+	abort();
+}
+
+void
+kshim_warn(const char *file, int line)
+{
+	fprintf(stderr, "WARNING at %s:%d\n", file, line);
+	abort();
+}
+
+int
+printk(const char *fmt, ...)
+{
+	va_list args;
+	int ret;
+
+	if (!kshim_verbose)
+		return 0;
+	va_start(args, fmt);
+	ret = vfprintf(stderr, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+int
+scnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list args;
+	int ret;
+
+	if (!size)
+		return 0;
+	va_start(args, fmt);
+	ret = vsnprintf(buf, size, fmt, args);
+	va_end(args);
+	return ret < 0 ? 0 : (size_t)ret >= size ? (int)size - 1 : ret;
+}
+
+size_t
+strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size) {
+		size_t n = len >= size ? size - 1 : len;
+
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+	return len;
+}
+
+ssize_t
+strscpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strnlen(src, size);
+
+	if (!size)
+		return -E2BIG;
+	if (len == size) {
+		memcpy(dst, src, size - 1);
+		dst[size - 1] = '\0';
+		return -E2BIG;
+	}
+	memcpy(dst, src, len + 1);
+	return len;
+}
+
+/* Bitmaps */
+
+static unsigned long
+find_next(const unsigned long *addr, unsigned long size, unsigned long offset,
+	  unsigned long invert)
+{
+	unsigned long word;
+
+	if (offset >= size)
+		return size;
+	word = (addr[BIT_WORD(offset)] ^ invert) &
+	       (~0UL << (offset % BITS_PER_LONG));
+	offset -= offset % BITS_PER_LONG;
+	while (!word) {
+		offset += BITS_PER_LONG;
+		if (offset >= size)
+			return size;
+		word = addr[BIT_WORD(offset)] ^ invert;
+	}
+	return min(offset + __ffs(word), size);
+}
+
+unsigned long
+find_next_bit(const unsigned long *addr, unsigned long size,
+	      unsigned long offset)
+{
+	return find_next(addr, size, offset, 0);
+}
+
+unsigned long
+find_next_zero_bit(const unsigned long *addr, unsigned long size,
+		   unsigned long offset)
+{
+	return find_next(addr, size, offset, ~0UL);
+}
+
+void
+bitmap_set(unsigned long *map, unsigned int start, unsigned int nbits)
+{
+	while (nbits--)
+		__set_bit(start++, map);
+}
+
+void
+bitmap_clear(unsigned long *map, unsigned int start, unsigned int nbits)
+{
+	while (nbits--)
+		__clear_bit(start++, map);
+}
+
+int
+bitmap_weight(const unsigned long *src, unsigned int nbits)
+{
+	unsigned int i;
+	int w = 0;
+
+	for (i = 0; i < nbits / BITS_PER_LONG; i++)
+		w += hweight_long(src[i]);
+	if (nbits % BITS_PER_LONG)
+		w += hweight_long(src[i] &
+				  (~0UL >> (BITS_PER_LONG - nbits % BITS_PER_LONG)));
+	return w;
+}
+
+unsigned long *
+bitmap_zalloc(unsigned int nbits, gfp_t flags)
+{
+	return kcalloc(BITS_TO_LONGS(nbits), sizeof(unsigned long), flags);
+}
+
+void
+bitmap_free(const unsigned long *bitmap)
+{
+	kfree(bitmap);
+}
+
+/* Memory */
+
+static long fail_after = -1;
+
+void
+kshim_fail_alloc(long after)
+{
+	fail_after = after;
+}
+
+void *
+kmalloc(size_t size, gfp_t flags)
+{
+	if (fail_after >= 0 && fail_after-- == 0)
+		return NULL;
+	if (size > KMALLOC_MAX_SIZE * 64)
+		return NULL;
+	/* Zero sized allocations are valid pointers */
+	return flags & __GFP_ZERO ? calloc(1, size ? size : 1)
+				  : malloc(size ? size : 1);
+}
+
+void
+kfree(const void *ptr)
+{
+	free((void *)ptr);
+}
+
+void *
+kmalloc_array(size_t n, size_t size, gfp_t flags)
+{
+	if (size && n > SIZE_MAX / size)
+		return NULL;
+	return kmalloc(n * size, flags);
+}
+
+void *
+kmemdup(const void *src, size_t len, gfp_t flags)
+{
+	void *p = kmalloc(len, flags);
+
+	if (p)
+		memcpy(p, src, len);
+	return p;
+}
+
+char *
+kstrdup(const char *s, gfp_t flags)
+{
+	return s ? kmemdup(s, strlen(s) + 1, flags) : NULL;
+}
+
+size_t
+ksize(const void *ptr)
+{
+	return ptr ? malloc_usable_size((void *)ptr) : 0;
+}
+
+struct kmem_cache {
+	unsigned int size;
+	void (*ctor)(void *);
+};
+
+struct kmem_cache *
+kmem_cache_create(const char *name, unsigned int size, unsigned int align,
+		  unsigned long flags, void (*ctor)(void *))
+{
+	struct kmem_cache *c = kzalloc(sizeof(*c), GFP_KERNEL);
+
+	if (c) {
+		c->size = size;
+		c->ctor = ctor;
+	}
+	return c;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *c)
+{
+	kfree(c);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *c, gfp_t flags)
+{
+	void *p = kmalloc(c->size, flags);
+
+	if (p && c->ctor)
+		c->ctor(p);
+	return p;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *ptr)
+{
+	kfree(ptr);
+}
+
+unsigned int
+kmem_cache_size(struct kmem_cache *c)
+{
+	return c->size;
+}
+
+/* Random numbers: splitmix64, reproducible by the seed */
+
+static u64 random_state = 0x9e3779b97f4a7c15ULL;
+
+void
+kshim_seed(u64 seed)
+{
+	random_state = seed;
+}
+
+static u64
+kshim_random(void)
+{
+	u64 z = (random_state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+void
+get_random_bytes(void *buf, size_t len)
+{
+	u8 *p = buf;
+	u64 r;
+
+	while (len) {
+		size_t n = min(len, sizeof(r));
+
+		r = kshim_random();
+		memcpy(p, &r, n);
+		p += n;
+		len -= n;
+	}
+}
+
+u32
+get_random_u32(void)
+{
+	return (u32)kshim_random();
+}
+
+/* SipHash-2-4 and SipHash-1-3 as the 64 bit kernels */
+
+#define SIPROUND(v0, v1, v2, v3) do {					\
+	v0 += v1; v1 = rol64(v1, 13); v1 ^= v0; v0 = rol64(v0, 32);	\
+	v2 += v3; v3 = rol64(v3, 16); v3 ^= v2;				\
+	v0 += v3; v3 = rol64(v3, 21); v3 ^= v0;				\
+	v2 += v1; v1 = rol64(v1, 17); v1 ^= v2; v2 = rol64(v2, 32);	\
+} while (0)
+
+static u64
+sip(const void *data, size_t len, u64 k0, u64 k1, int crounds, int drounds)
+{
+	u64 v0 = 0x736f6d6570736575ULL ^ k0;
+	u64 v1 = 0x646f72616e646f6dULL ^ k1;
+	u64 v2 = 0x6c7967656e657261ULL ^ k0;
+	u64 v3 = 0x7465646279746573ULL ^ k1;
+	u64 b = (u64)len << 56, m;
+	const u8 *p = data;
+	int i;
+
+	for (; len >= sizeof(m); len -= sizeof(m), p += sizeof(m)) {
+		memcpy(&m, p, sizeof(m));
+		v3 ^= m;
+		for (i = 0; i < crounds; i++)
+			SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	m = 0;
+	memcpy(&m, p, len);
+	b |= m;
+	v3 ^= b;
+	for (i = 0; i < crounds; i++)
+		SIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	for (i = 0; i < drounds; i++)
+		SIPROUND(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+u64
+siphash(const void *data, size_t len, const siphash_key_t *key)
+{
+	return sip(data, len, key->key[0], key->key[1], 2, 4);
+}
+
+u32
+hsiphash(const void *data, size_t len, const hsiphash_key_t *key)
+{
+	return (u32)sip(data, len, key->key[0], key->key[1], 1, 3);
+}
+
+u32
+hsiphash_2u32(u32 first, u32 second, const hsiphash_key_t *key)
+{
+	u64 combined = (u64)second << 32 | first;
+
+	return hsiphash(&combined, sizeof(combined), key);
+}
+
+/* Time */
+
+void
+kshim_advance(unsigned long ticks)
+{
+	jiffies += ticks;
+	kshim_quiesce();
+}
+
+u64
+ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* RCU: there are no readers at the quiescent points */
+
+struct kfree_rcu_node {
+	struct kfree_rcu_node *next;
+	const void *ptr;
+};
+
+static struct rcu_head *rcu_list, **rcu_tail = &rcu_list;
+static struct kfree_rcu_node *kfree_rcu_list;
+
+void
+call_rcu(struct rcu_head *head, rcu_callback_t func)
+{
+	head->next = NULL;
+	head->func = func;
+	*rcu_tail = head;
+	rcu_tail = &head->next;
+}
+
+void
+kshim_kfree_rcu(const void *ptr)
+{
+	struct kfree_rcu_node *n = malloc(sizeof(*n));
+
+	if (!n)
+		abort();
+	n->ptr = ptr;
+	n->next = kfree_rcu_list;
+	kfree_rcu_list = n;
+}
+
+static bool
+rcu_run(void)
+{
+	struct kfree_rcu_node *n = kfree_rcu_list;
+	struct rcu_head *head = rcu_list;
+	bool ran = head || n;
+
+	/* The callbacks may queue new ones */
+	rcu_list = NULL;
+	rcu_tail = &rcu_list;
+	kfree_rcu_list = NULL;
+	while (head) {
+		struct rcu_head *next = head->next;
+
+		head->func(head);
+		head = next;
+	}
+	while (n) {
+		struct kfree_rcu_node *next = n->next;
+
+		kfree(n->ptr);
+		free(n);
+		n = next;
+	}
+	return ran;
+}
+
+void
+synchronize_rcu(void)
+{
+	rcu_run();
+}
+
+void
+rcu_barrier(void)
+{
+	while (rcu_run())
+		;
+}
+
+/* Work items and timers */
+
+static LIST_HEAD(work_list);
+
+static bool
+work_queue(struct work_struct *work, bool delayed, unsigned long expires)
+{
+	bool was_pending = work->pending;
+
+	if (!was_pending) {
+		list_add_tail(&work->entry, &work_list);
+		work->pending = true;
+	}
+	work->delayed = delayed;
+	work->expires = expires;
+	return !was_pending;
+}
+
+bool
+queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	if (work->pending)
+		return false;
+	return work_queue(work, false, 0);
+}
+
+bool
+queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
+		   unsigned long delay)
+{
+	if (dwork->work.pending)
+		return false;
+	return work_queue(&dwork->work, true, jiffies + delay);
+}
+
+bool
+mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
+		 unsigned long delay)
+{
+	return !work_queue(&dwork->work, true, jiffies + delay);
+}
+
+static void
+work_dequeue(struct work_struct *work)
+{
+	list_del(&work->entry);
+	work->pending = false;
+}
+
+bool
+cancel_work_sync(struct work_struct *work)
+{
+	if (!work->pending)
+		return false;
+	work_dequeue(work);
+	return true;
+}
+
+static void
+work_run(struct work_struct *work)
+{
+	work_dequeue(work);
+	work->func(work);
+}
+
+bool
+flush_work(struct work_struct *work)
+{
+	if (!work->pending)
+		return false;
+	work_run(work);
+	return true;
+}
+
+static void
+timer_fn(struct work_struct *work)
+{
+	struct timer_list *timer = container_of(work, struct timer_list, work);
+
+	timer->function(timer);
+}
+
+void
+timer_setup(struct timer_list *timer, void (*function)(struct timer_list *t),
+	    unsigned int flags)
+{
+	INIT_WORK(&timer->work, timer_fn);
+	timer->function = function;
+}
+
+int
+mod_timer(struct timer_list *timer, unsigned long expires)
+{
+	timer->expires = expires;
+	return !work_queue(&timer->work, true, expires);
+}
+
+/* Run the due work items and the RCU callbacks until none is left */
+void
+kshim_quiesce(void)
+{
+	struct work_struct *work;
+	bool ran;
+
+	do {
+		ran = rcu_run();
+		list_for_each_entry(work, &work_list, entry) {
+			if (work->delayed && time_before(jiffies, work->expires))
+				continue;
+			/* The item may requeue itself or others */
+			work_run(work);
+			ran = true;
+			break;
+		}
+	} while (ran);
+}
+
+/* Socket buffers and netlink */
+
+struct sk_buff *
+alloc_skb(unsigned int size, gfp_t flags)
+{
+	struct sk_buff *skb = kzalloc(sizeof(*skb), flags);
+
+	if (!skb)
+		return NULL;
+	skb->head = kmalloc(size, flags);
+	if (!skb->head) {
+		kfree(skb);
+		return NULL;
+	}
+	skb->data = skb->head;
+	skb->end = size;
+	skb->mac_header = (u16)~0U;
+	return skb;
+}
+
+void
+kfree_skb(struct sk_buff *skb)
+{
+	if (!skb)
+		return;
+	kfree(skb->head);
+	kfree(skb);
+}
+
+int
+nla_put(struct sk_buff *skb, int attrtype, int attrlen, const void *data)
+{
+	struct nlattr *nla;
+	int total = nla_total_size(attrlen);
+
+	if (unlikely(skb_tailroom(skb) < total))
+		return -EMSGSIZE;
+	nla = (struct nlattr *)skb_put(skb, total);
+	nla->nla_type = attrtype;
+	nla->nla_len = nla_attr_size(attrlen);
+	if (attrlen)
+		memcpy(nla_data(nla), data, attrlen);
+	memset((char *)nla + nla->nla_len, 0, nla_padlen(attrlen));
+	return 0;
+}
+
+static const u8 nla_type_len[] = {
+	[NLA_U8]	= sizeof(u8),
+	[NLA_U16]	= sizeof(u16),
+	[NLA_U32]	= sizeof(u32),
+	[NLA_U64]	= sizeof(u64),
+	[NLA_MSECS]	= sizeof(u64),
+	[NLA_NESTED]	= NLA_HDRLEN,
+	[NLA_S8]	= sizeof(s8),
+	[NLA_S16]	= sizeof(s16),
+	[NLA_S32]	= sizeof(s32),
+	[NLA_S64]	= sizeof(s64),
+};
+
+/* The validation of the attributes the set types rely on */
+static int
+nla_validate(const struct nlattr *nla, const struct nla_policy *pt)
+{
+	int len = nla_len(nla);
+
+	switch (pt->type) {
+	case NLA_FLAG:
+		return len ? -ERANGE : 0;
+	case NLA_NUL_STRING:
+		if (!len || memchr(nla_data(nla), '\0', len) == NULL)
+			return -EINVAL;
+		if (pt->len && len > pt->len + 1)
+			return -ERANGE;
+		return 0;
+	case NLA_STRING:
+	case NLA_BINARY:
+		if (pt->len && len > pt->len)
+			return -ERANGE;
+		return 0;
+	case NLA_NESTED:
+		if (len == 0)
+			return 0;
+		/* fall through */
+	default:
+		if (pt->type < ARRAY_SIZE(nla_type_len) &&
+		    len < nla_type_len[pt->type])
+			return -ERANGE;
+		return 0;
+	}
+}
+
+int
+nla_parse(struct nlattr **tb, int maxtype, const struct nlattr *head,
+	  int len, const struct nla_policy *policy,
+	  struct netlink_ext_ack *extack)
+{
+	const struct nlattr *nla;
+	int rem, type;
+
+	memset(tb, 0, sizeof(struct nlattr *) * (maxtype + 1));
+	nla_for_each_attr(nla, head, len, rem) {
+		type = nla_type(nla);
+		if (type == 0 || type > maxtype)
+			continue;
+		if (policy && nla_validate(nla, &policy[type]) < 0)
+			return -EINVAL;
+		tb[type] = (struct nlattr *)nla;
+	}
+	return 0;
+}
+
+ssize_t
+nla_strscpy(char *dst, const struct nlattr *nla, size_t dstsize)
+{
+	size_t srclen = nla_len(nla);
+	const char *src = nla_data(nla);
+
+	if (srclen > 0 && src[srclen - 1] == '\0')
+		srclen--;
+	if (!dstsize)
+		return -E2BIG;
+	if (srclen >= dstsize) {
+		memcpy(dst, src, dstsize - 1);
+		dst[dstsize - 1] = '\0';
+		return -E2BIG;
+	}
+	memcpy(dst, src, srclen);
+	dst[srclen] = '\0';
+	return srclen;
+}
+
+int
+netlink_unicast(struct sock *ssk, struct sk_buff *skb, u32 portid,
+		int nonblock)
+{
+	int len = skb->len;
+
+	kfree_skb(skb);
+	return len;
+}
+
+int
+ipv6_skip_exthdr(const struct sk_buff *skb, int start, u8 *nexthdrp,
+		 __be16 *frag_offp)
+{
+	*frag_offp = 0;
+	return start;
+}
+
+struct net_device *
+nf_bridge_get_physindev(const struct sk_buff *skb, struct net *net)
+{
+	return NULL;
+}
+
+struct net_device *
+nf_bridge_get_physoutdev(const struct sk_buff *skb)
+{
+	return NULL;
+}
@@ -0,0 +1,1236 @@
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* The subset of the kernel API used by the set types, implemented in
+ * userspace so that the set type modules can be compiled and run as
+ * ordinary programs. Every <linux/...> header not shipped with ipset
+ * is a forwarder to this file, see the Makefile.
+ *
+ * The programs are single threaded: the locks are no-ops, the RCU
+ * callbacks and the work items are queued and run by kshim_quiesce(),
+ * at the points where the kernel could run them, and time advances
+ * only by kshim_advance(). There is a single CPU and a single node.
+ */
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Types */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+typedef u8 __u8;
+typedef u16 __u16;
+typedef u32 __u32;
+typedef u64 __u64;
+typedef s8 __s8;
+typedef s16 __s16;
+typedef s32 __s32;
+typedef s64 __s64;
+typedef u16 __be16;
+typedef u32 __be32;
+typedef u64 __be64;
+typedef u16 __le16;
+typedef u32 __le32;
+typedef u16 __sum16;
+typedef u32 __wsum;
+typedef unsigned int gfp_t;
+typedef s64 ktime_t;
+
+/* Compiler */
+#define __force
+#define __rcu
+#define __user
+#define __percpu
+#define __read_mostly
+#define __init
+#define __exit
+#define __cold
+#define __must_check
+#undef __always_inline
+#define __always_inline		inline __attribute__((always_inline))
+#define __aligned(x)		__attribute__((aligned(x)))
+#define __packed		__attribute__((packed))
+#define __maybe_unused		__attribute__((unused))
+#define fallthrough		__attribute__((__fallthrough__))
+#define ____cacheline_aligned	__attribute__((aligned(64)))
+#define ____cacheline_aligned_in_smp ____cacheline_aligned
+#define L1_CACHE_BYTES		64
+#define SMP_CACHE_BYTES		64
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+#define barrier()		__asm__ __volatile__("" ::: "memory")
+#define READ_ONCE(x)		(*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v)	do { *(volatile typeof(x) *)&(x) = (v); } while (0)
+#define prefetch(x)		__builtin_prefetch(x)
+#define prefetchw(x)		__builtin_prefetch(x, 1)
+#define __stringify_1(x...)	#x
+#define __stringify(x...)	__stringify_1(x)
+#define IS_ENABLED(x)		0
+#define IS_BUILTIN(x)		0
+
+#define BUILD_BUG_ON(c)		((void)sizeof(char[1 - 2 * !!(c)]))
+#define BUG()			kshim_bug(__FILE__, __LINE__)
+#define BUG_ON(c)		do { if (unlikely(c)) BUG(); } while (0)
+#define WARN_ON(c)		({ int __r = !!(c);			\
+				   if (unlikely(__r))			\
+					kshim_warn(__FILE__, __LINE__);	\
+				   unlikely(__r); })
+#define WARN_ON_ONCE(c)		WARN_ON(c)
+#define WARN_ONCE(c, ...)	WARN_ON(c)
+void kshim_bug(const char *file, int line) __attribute__((noreturn));
+void kshim_warn(const char *file, int line);
+
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)		((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp(v, lo, hi)	min(max(v, lo), hi)
+#define swap(a, b) \
+	do { typeof(a) __t = (a); (a) = (b); (b) = __t; } while (0)
+#define ALIGN(x, a)		(((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+#define IS_ALIGNED(x, a)	(((x) & ((typeof(x))(a) - 1)) == 0)
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define roundup(x, y)		(DIV_ROUND_UP(x, y) * (y))
+#define is_power_of_2(n)	((n) != 0 && (((n) & ((n) - 1)) == 0))
+#define ilog2(n)		((int)(63 - __builtin_clzll(n)))
+#define U8_MAX			0xff
+#define U16_MAX			0xffff
+#define U32_MAX			0xffffffffU
+#define U64_MAX			0xffffffffffffffffULL
+#define S32_MAX			INT_MAX
+
+/* Module */
+struct module;
+#define THIS_MODULE		((struct module *)0)
+#define EXPORT_SYMBOL(x)	extern int __kshim_unused
+#define EXPORT_SYMBOL_GPL(x)	extern int __kshim_unused
+#define MODULE_LICENSE(x)	extern int __kshim_unused
+#define MODULE_AUTHOR(x)	extern int __kshim_unused
+#define MODULE_DESCRIPTION(x)	extern int __kshim_unused
+#define MODULE_ALIAS(x)		extern int __kshim_unused
+#define MODULE_PARM_DESC(a, b)	extern int __kshim_unused
+#define module_param(n, t, p)	extern int __kshim_unused
+/* The init function of the compiled module is kshim_init_<KSHIM_MOD> */
+#define __kshim_cat(a, b)	a##b
+#define kshim_cat(a, b)		__kshim_cat(a, b)
+#define module_init(f) \
+	int kshim_cat(kshim_init_, KSHIM_MOD)(void) { return f(); }
+#define module_exit(f) \
+	void kshim_cat(kshim_exit_, KSHIM_MOD)(void) { f(); }
+static inline bool try_module_get(struct module *m) { return true; }
+static inline void __module_get(struct module *m) {}
+static inline void module_put(struct module *m) {}
+
+/* Errors */
+#include <errno.h>
+#define MAX_ERRNO		4095
+#define IS_ERR_VALUE(x)		((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long e) { return (void *)e; }
+static inline long PTR_ERR(const void *p) { return (long)p; }
+static inline bool IS_ERR(const void *p) { return IS_ERR_VALUE(p); }
+static inline bool IS_ERR_OR_NULL(const void *p) { return !p || IS_ERR(p); }
+
+/* Printing */
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define KERN_ERR		""
+#define KERN_WARNING		""
+#define KERN_INFO		""
+#define pr_debug(fmt, ...)	({ if (0) printk(fmt, ##__VA_ARGS__); 0; })
+#define pr_info(fmt, ...)	printk(fmt, ##__VA_ARGS__)
+#define pr_notice(fmt, ...)	printk(fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...)	printk(fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...)	printk(fmt, ##__VA_ARGS__)
+#define pr_warn_ratelimited(fmt, ...)	printk(fmt, ##__VA_ARGS__)
+#define pr_info_ratelimited(fmt, ...)	printk(fmt, ##__VA_ARGS__)
+static inline bool net_ratelimit(void) { return true; }
+int snprintf(char *buf, size_t size, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+int scnprintf(char *buf, size_t size, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+size_t strlcpy(char *dst, const char *src, size_t size);
+ssize_t strscpy(char *dst, const char *src, size_t size);
+
+/* Bit operations */
+#define BITS_PER_LONG		64
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+#endif
+#define BITS_PER_BYTE		8
+#define BIT(n)			(1UL << (n))
+#define BIT_ULL(n)		(1ULL << (n))
+#define BIT_WORD(n)		((n) / BITS_PER_LONG)
+#define BIT_MASK(n)		(1UL << ((n) % BITS_PER_LONG))
+#define BITS_TO_LONGS(n)	DIV_ROUND_UP(n, BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+
+static inline int
+test_bit(long nr, const volatile unsigned long *addr)
+{
+	return (addr[BIT_WORD(nr)] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+static inline void
+__set_bit(long nr, volatile unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void
+__clear_bit(long nr, volatile unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+#define set_bit(nr, addr)	__set_bit(nr, addr)
+#define clear_bit(nr, addr)	__clear_bit(nr, addr)
+
+static inline int
+test_and_set_bit(long nr, volatile unsigned long *addr)
+{
+	int old = test_bit(nr, addr);
+
+	__set_bit(nr, addr);
+	return old;
+}
+
+static inline int
+test_and_clear_bit(long nr, volatile unsigned long *addr)
+{
+	int old = test_bit(nr, addr);
+
+	__clear_bit(nr, addr);
+	return old;
+}
+
+static inline int fls(unsigned int x) { return x ? 32 - __builtin_clz(x) : 0; }
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+static inline unsigned long __ffs(unsigned long x) { return __builtin_ctzl(x); }
+static inline unsigned long __fls(unsigned long x) { return 63 - __builtin_clzl(x); }
+static inline unsigned long ffz(unsigned long x) { return __builtin_ctzl(~x); }
+static inline unsigned int hweight32(unsigned int w) { return __builtin_popcount(w); }
+static inline unsigned long hweight_long(unsigned long w) { return __builtin_popcountl(w); }
+static inline u32 rol32(u32 w, unsigned int s) { return (w << (s & 31)) | (w >> ((-s) & 31)); }
+static inline u32 ror32(u32 w, unsigned int s) { return (w >> (s & 31)) | (w << ((-s) & 31)); }
+static inline u64 rol64(u64 w, unsigned int s) { return (w << (s & 63)) | (w >> ((-s) & 63)); }
+
+unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
+			    unsigned long offset);
+unsigned long find_next_zero_bit(const unsigned long *addr, unsigned long size,
+				 unsigned long offset);
+#define find_first_bit(addr, size)	find_next_bit(addr, size, 0)
+#define find_first_zero_bit(addr, size)	find_next_zero_bit(addr, size, 0)
+#define for_each_set_bit(bit, addr, size) \
+	for ((bit) = find_first_bit((addr), (size)); (bit) < (size); \
+	     (bit) = find_next_bit((addr), (size), (bit) + 1))
+void bitmap_set(unsigned long *map, unsigned int start, unsigned int nbits);
+void bitmap_clear(unsigned long *map, unsigned int start, unsigned int nbits);
+int bitmap_weight(const unsigned long *src, unsigned int nbits);
+static inline void
+bitmap_zero(unsigned long *dst, unsigned int nbits)
+{
+	memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+unsigned long *bitmap_zalloc(unsigned int nbits, gfp_t flags);
+void bitmap_free(const unsigned long *bitmap);
+
+/* Byte order: little endian hosts only */
+#define htons(x)		((__be16)__builtin_bswap16(x))
+#define ntohs(x)		((u16)__builtin_bswap16(x))
+#define htonl(x)		((__be32)__builtin_bswap32(x))
+#define ntohl(x)		((u32)__builtin_bswap32(x))
+#define cpu_to_be16(x)		htons(x)
+#define be16_to_cpu(x)		ntohs(x)
+#define cpu_to_be32(x)		htonl(x)
+#define be32_to_cpu(x)		ntohl(x)
+#define cpu_to_be64(x)		((__be64)__builtin_bswap64(x))
+#define be64_to_cpu(x)		((u64)__builtin_bswap64(x))
+#define __constant_htonl(x)	htonl(x)
+#define __constant_htons(x)	htons(x)
+
+static inline u32
+__get_unaligned_cpu32(const void *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline u32
+get_unaligned_be32(const void *p)
+{
+	return ntohl(__get_unaligned_cpu32(p));
+}
+
+/* Atomics */
+typedef struct { int counter; } atomic_t;
+typedef struct { long long counter; } atomic64_t;
+typedef struct { long counter; } atomic_long_t;
+#define ATOMIC_INIT(i)		{ (i) }
+#define __kshim_atomic(v)	(&(v)->counter)
+#define atomic_read(v)		__atomic_load_n(__kshim_atomic(v), __ATOMIC_SEQ_CST)
+#define atomic_set(v, i)	__atomic_store_n(__kshim_atomic(v), (i), __ATOMIC_SEQ_CST)
+#define atomic_add_return(i, v)	__atomic_add_fetch(__kshim_atomic(v), (i), __ATOMIC_SEQ_CST)
+#define atomic_sub_return(i, v)	__atomic_sub_fetch(__kshim_atomic(v), (i), __ATOMIC_SEQ_CST)
+#define atomic_add(i, v)	((void)atomic_add_return(i, v))
+#define atomic_sub(i, v)	((void)atomic_sub_return(i, v))
+#define atomic_inc(v)		atomic_add(1, v)
+#define atomic_dec(v)		atomic_sub(1, v)
+#define atomic_inc_return(v)	atomic_add_return(1, v)
+#define atomic_dec_return(v)	atomic_sub_return(1, v)
+#define atomic_dec_and_test(v)	(atomic_sub_return(1, v) == 0)
+#define atomic_xchg(v, n)	__atomic_exchange_n(__kshim_atomic(v), (n), __ATOMIC_SEQ_CST)
+#define atomic_cmpxchg(v, o, n)	__sync_val_compare_and_swap(__kshim_atomic(v), (o), (n))
+#define atomic64_read		atomic_read
+#define atomic64_set		atomic_set
+#define atomic64_add		atomic_add
+#define atomic64_sub		atomic_sub
+#define atomic64_inc		atomic_inc
+#define atomic64_add_return	atomic_add_return
+#define atomic64_xchg		atomic_xchg
+#define atomic_long_read	atomic_read
+#define atomic_long_set		atomic_set
+#define atomic_long_add		atomic_add
+#define atomic_long_sub		atomic_sub
+#define atomic_long_inc		atomic_inc
+#define atomic_long_dec		atomic_dec
+#define atomic_long_add_return	atomic_add_return
+#define atomic_long_sub_return	atomic_sub_return
+#define cmpxchg(p, o, n)	__sync_val_compare_and_swap(p, o, n)
+#define xchg(p, n)		__atomic_exchange_n(p, n, __ATOMIC_SEQ_CST)
+#define smp_mb()		__sync_synchronize()
+#define smp_rmb()		smp_mb()
+#define smp_wmb()		smp_mb()
+#define smp_mb__before_atomic()	smp_mb()
+#define smp_mb__after_atomic()	smp_mb()
+#define smp_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+typedef struct { atomic_t refs; } refcount_t;
+#define refcount_set(r, n)	atomic_set(&(r)->refs, n)
+#define refcount_read(r)	atomic_read(&(r)->refs)
+#define refcount_inc(r)		atomic_inc(&(r)->refs)
+#define refcount_dec_and_test(r) atomic_dec_and_test(&(r)->refs)
+
+/* Locks: the programs are single threaded */
+typedef struct { int locked; } spinlock_t;
+typedef struct { int locked; } rwlock_t;
+struct mutex { int locked; };
+typedef struct { unsigned int sequence; } seqcount_t;
+#define DEFINE_SPINLOCK(x)	spinlock_t x
+#define DEFINE_RWLOCK(x)	rwlock_t x
+#define DEFINE_MUTEX(x)		struct mutex x
+#define __SPIN_LOCK_UNLOCKED(x)	{ 0 }
+#define spin_lock_init(l)	((void)(l))
+#define spin_lock(l)		((void)(l))
+#define spin_unlock(l)		((void)(l))
+#define spin_lock_bh(l)		((void)(l))
+#define spin_unlock_bh(l)	((void)(l))
+#define spin_trylock(l)		((void)(l), 1)
+#define spin_trylock_bh(l)	((void)(l), 1)
+#define spin_lock_irqsave(l, f)	 ((void)(l), (void)(f))
+#define spin_unlock_irqrestore(l, f) ((void)(l), (void)(f))
+#define rwlock_init(l)		((void)(l))
+#define read_lock_bh(l)		((void)(l))
+#define read_unlock_bh(l)	((void)(l))
+#define write_lock_bh(l)	((void)(l))
+#define write_unlock_bh(l)	((void)(l))
+#define mutex_init(m)		((void)(m))
+#define mutex_lock(m)		((void)(m))
+#define mutex_unlock(m)		((void)(m))
+#define mutex_trylock(m)	((void)(m), 1)
+#define mutex_destroy(m)	((void)(m))
+#define seqcount_init(s)	((s)->sequence = 0)
+#define read_seqcount_begin(s)	((s)->sequence)
+#define read_seqcount_retry(s, v) ((s)->sequence != (v))
+#define write_seqcount_begin(s)	((s)->sequence++)
+#define write_seqcount_end(s)	((s)->sequence++)
+#define local_bh_disable()	do {} while (0)
+#define local_bh_enable()	do {} while (0)
+#define preempt_disable()	do {} while (0)
+#define preempt_enable()	do {} while (0)
+#define lockdep_is_held(l)	((void)(l), 1)
+#define lockdep_assert_held(l)	((void)(l))
+#define might_sleep()		do {} while (0)
+#define cond_resched()		do {} while (0)
+#define need_resched()		false
+
+struct task_struct;
+extern struct task_struct *current;
+#define in_serving_softirq()	0
+#define in_softirq()		0
+#define in_interrupt()		0
+#define in_task()		1
+
+/* RCU: the callbacks run at the quiescent points of the program */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+typedef void (*rcu_callback_t)(struct rcu_head *head);
+#define rcu_read_lock()		do {} while (0)
+#define rcu_read_unlock()	do {} while (0)
+#define rcu_read_lock_bh()	do {} while (0)
+#define rcu_read_unlock_bh()	do {} while (0)
+#define rcu_read_lock_held()	1
+#define rcu_read_lock_bh_held()	1
+#define rcu_dereference(p)	READ_ONCE(p)
+#define rcu_dereference_bh(p)	READ_ONCE(p)
+#define rcu_dereference_raw(p)	READ_ONCE(p)
+#define rcu_dereference_check(p, c)	rcu_dereference(p)
+#define rcu_dereference_bh_check(p, c)	rcu_dereference(p)
+#define rcu_dereference_protected(p, c)	(p)
+#define rcu_access_pointer(p)	READ_ONCE(p)
+#define rcu_assign_pointer(p, v) smp_store_release(&(p), (v))
+#define RCU_INIT_POINTER(p, v)	do { (p) = (v); } while (0)
+#define RCU_INITIALIZER(v)	(v)
+#define cond_resched_rcu()	do {} while (0)
+void call_rcu(struct rcu_head *head, rcu_callback_t func);
+void synchronize_rcu(void);
+void rcu_barrier(void);
+#define synchronize_net()	synchronize_rcu()
+/* The rcu_head is not needed, the pointer is remembered separately */
+#define kfree_rcu(ptr, field)	kshim_kfree_rcu(ptr)
+void kshim_kfree_rcu(const void *ptr);
+
+/* Memory: allocations can be made to fail, see kshim_fail_alloc() */
+#define GFP_KERNEL		0x01u
+#define GFP_ATOMIC		0x02u
+#define GFP_NOWAIT		0x04u
+#define __GFP_ACCOUNT		0x08u
+#define GFP_KERNEL_ACCOUNT	(GFP_KERNEL | __GFP_ACCOUNT)
+#define __GFP_ZERO		0x10u
+#define __GFP_NOWARN		0x20u
+#define __GFP_NORETRY		0x40u
+#define __GFP_THISNODE		0x80u
+#define SLAB_HWCACHE_ALIGN	0x1u
+#define SLAB_ACCOUNT		0x2u
+#define KMALLOC_MAX_SIZE	(1UL << 22)
+#define PAGE_SIZE		4096UL
+#define PAGE_SHIFT		12
+#define NUMA_NO_NODE		(-1)
+#define MAX_NUMNODES		1
+extern int nr_node_ids;
+#define node_online(n)		((n) == 0)
+#define numa_node_id()		0
+#define for_each_online_node(n)	for ((n) = 0; (n) < 1; (n)++)
+
+void *kmalloc(size_t size, gfp_t flags);
+void kfree(const void *ptr);
+#define kzalloc(s, f)		kmalloc(s, (f) | __GFP_ZERO)
+#define kmalloc_node(s, f, n)	kmalloc(s, f)
+#define kzalloc_node(s, f, n)	kzalloc(s, f)
+#define kcalloc(n, s, f)	kmalloc_array(n, s, (f) | __GFP_ZERO)
+#define kvmalloc(s, f)		kmalloc(s, f)
+#define kvzalloc(s, f)		kzalloc(s, f)
+#define kvmalloc_node(s, f, n)	kmalloc(s, f)
+#define kvzalloc_node(s, f, n)	kzalloc(s, f)
+#define kvcalloc(n, s, f)	kcalloc(n, s, f)
+#define kvmalloc_array(n, s, f)	kmalloc_array(n, s, f)
+#define kvfree(p)		kfree(p)
+#define vmalloc(s)		kmalloc(s, GFP_KERNEL)
+#define vzalloc(s)		kzalloc(s, GFP_KERNEL)
+#define vfree(p)		kfree(p)
+#define is_vmalloc_addr(p)	((void)(p), false)
+void *kmalloc_array(size_t n, size_t size, gfp_t flags);
+void *kmemdup(const void *src, size_t len, gfp_t flags);
+char *kstrdup(const char *s, gfp_t flags);
+size_t ksize(const void *ptr);
+
+struct kmem_cache;
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+				     unsigned int align, unsigned long flags,
+				     void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *c);
+void *kmem_cache_alloc(struct kmem_cache *c, gfp_t flags);
+#define kmem_cache_alloc_node(c, f, n)	kmem_cache_alloc(c, f)
+#define kmem_cache_zalloc(c, f)		kmem_cache_alloc(c, (f) | __GFP_ZERO)
+void kmem_cache_free(struct kmem_cache *c, void *ptr);
+unsigned int kmem_cache_size(struct kmem_cache *c);
+
+/* Per-CPU data of the single CPU */
+#define NR_CPUS			1
+#define DEFINE_PER_CPU(type, name)	__typeof__(type) name
+#define DECLARE_PER_CPU(type, name)	extern __typeof__(type) name
+#define per_cpu_ptr(ptr, cpu)	((void)(cpu), (ptr))
+#define per_cpu(var, cpu)	(*((void)(cpu), &(var)))
+#define this_cpu_ptr(ptr)	(ptr)
+#define raw_cpu_ptr(ptr)	(ptr)
+#define get_cpu_ptr(ptr)	(ptr)
+#define put_cpu_ptr(ptr)	((void)(ptr))
+#define this_cpu_read(x)	(x)
+#define this_cpu_write(x, v)	((x) = (v))
+#define this_cpu_inc(x)		((x)++)
+#define this_cpu_add(x, v)	((x) += (v))
+#define __this_cpu_inc(x)	((x)++)
+#define __this_cpu_add(x, v)	((x) += (v))
+#define __this_cpu_read(x)	(x)
+#define __this_cpu_write(x, v)	((x) = (v))
+#define alloc_percpu(type) \
+	((type *)__alloc_percpu(sizeof(type), __alignof__(type)))
+#define alloc_percpu_gfp(type, gfp) alloc_percpu(type)
+#define __alloc_percpu(s, a)	kzalloc(s, GFP_KERNEL)
+#define __alloc_percpu_gfp(s, a, f) kzalloc(s, GFP_KERNEL)
+#define free_percpu(p)		kfree(p)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < NR_CPUS; (cpu)++)
+#define for_each_online_cpu(cpu) for_each_possible_cpu(cpu)
+#define smp_processor_id()	0
+#define raw_smp_processor_id()	0
+#define get_cpu()		0
+#define put_cpu()		do {} while (0)
+#define num_possible_cpus()	NR_CPUS
+#define num_online_cpus()	NR_CPUS
+
+struct u64_stats_sync { unsigned int seq; };
+#define u64_stats_init(s)		((void)(s))
+#define u64_stats_update_begin(s)	((void)(s))
+#define u64_stats_update_end(s)		((void)(s))
+#define u64_stats_fetch_begin(s)	((void)(s), 0U)
+#define u64_stats_fetch_retry(s, st)	((void)(s), (void)(st), false)
+
+/* Random numbers are reproducible, see kshim_seed() */
+void get_random_bytes(void *buf, size_t len);
+u32 get_random_u32(void);
+#define prandom_u32()		get_random_u32()
+static inline u32 get_random_u32_below(u32 ceil)
+{
+	return (u32)(((u64)get_random_u32() * ceil) >> 32);
+}
+#define prandom_u32_max(c)	get_random_u32_below(c)
+static inline u32 reciprocal_scale(u32 val, u32 ep_ro)
+{
+	return (u32)(((u64)val * ep_ro) >> 32);
+}
+
+typedef struct { u64 key[2]; } siphash_key_t;
+typedef struct { unsigned long key[2]; } hsiphash_key_t;
+u64 siphash(const void *data, size_t len, const siphash_key_t *key);
+u32 hsiphash(const void *data, size_t len, const hsiphash_key_t *key);
+u32 hsiphash_2u32(u32 first, u32 second, const hsiphash_key_t *key);
+#define GOLDEN_RATIO_32		0x61C88647
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+/* Time: jiffies advance by kshim_advance() only */
+#define HZ			1000
+#define MSEC_PER_SEC		1000L
+#define NSEC_PER_SEC		1000000000L
+#define NSEC_PER_MSEC		1000000L
+#define NSEC_PER_USEC		1000L
+extern unsigned long volatile jiffies;
+#define time_after(a, b)	((long)((b) - (a)) < 0)
+#define time_before(a, b)	time_after(b, a)
+#define time_after_eq(a, b)	((long)((a) - (b)) >= 0)
+#define time_before_eq(a, b)	time_after_eq(b, a)
+#define time_is_before_jiffies(a) time_after(jiffies, a)
+#define time_is_after_jiffies(a) time_before(jiffies, a)
+#define msecs_to_jiffies(m)	((unsigned long)(m) * HZ / MSEC_PER_SEC)
+#define jiffies_to_msecs(j)	((unsigned int)((j) * MSEC_PER_SEC / HZ))
+#define round_jiffies_relative(j) (j)
+u64 ktime_get_ns(void);
+#define ktime_get_mono_fast_ns() ktime_get_ns()
+#define local_clock()		ktime_get_ns()
+#define sched_clock()		ktime_get_ns()
+#define ktime_get()		((ktime_t)ktime_get_ns())
+#define ktime_to_ns(t)		((s64)(t))
+#define ktime_get_seconds()	((u64)(jiffies / HZ))
+#define ktime_get_real_seconds() ((s64)(jiffies / HZ))
+#define ktime_get_boottime_seconds() ktime_get_seconds()
+static inline u64 div_u64(u64 d, u32 v) { return d / v; }
+static inline u64 div64_u64(u64 d, u64 v) { return d / v; }
+static inline s64 div_s64(s64 d, s32 v) { return d / v; }
+
+/* Lists */
+struct list_head { struct list_head *next, *prev; };
+struct hlist_head { struct hlist_node *first; };
+struct hlist_node { struct hlist_node *next, **pprev; };
+#define LIST_HEAD_INIT(name)	{ &(name), &(name) }
+#define LIST_HEAD(name)		struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void
+INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void
+__list_add(struct list_head *n, struct list_head *prev, struct list_head *next)
+{
+	next->prev = n;
+	n->next = next;
+	n->prev = prev;
+	prev->next = n;
+}
+
+static inline void
+list_add(struct list_head *n, struct list_head *head)
+{
+	__list_add(n, head, head->next);
+}
+
+static inline void
+list_add_tail(struct list_head *n, struct list_head *head)
+{
+	__list_add(n, head->prev, head);
+}
+
+static inline void
+list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+static inline void
+list_del_init(struct list_head *entry)
+{
+	list_del(entry);
+	INIT_LIST_HEAD(entry);
+}
+
+static inline int
+list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+static inline int
+list_is_last(const struct list_head *list, const struct list_head *head)
+{
+	return list->next == head;
+}
+
+static inline void
+list_splice_init(struct list_head *list, struct list_head *head)
+{
+	if (list_empty(list))
+		return;
+	list->next->prev = head;
+	list->prev->next = head->next;
+	head->next->prev = list->prev;
+	head->next = list->next;
+	INIT_LIST_HEAD(list);
+}
+
+static inline void
+list_move_tail(struct list_head *list, struct list_head *head)
+{
+	list_del(list);
+	list_add_tail(list, head);
+}
+
+#define list_add_rcu(n, h)	list_add(n, h)
+#define list_add_tail_rcu(n, h)	list_add_tail(n, h)
+#define list_del_rcu(e)		list_del(e)
+#define list_entry(ptr, type, member)	container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) \
+	list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member) \
+	list_entry((ptr)->prev, type, member)
+#define list_first_entry_or_null(ptr, type, member) \
+	(list_empty(ptr) ? NULL : list_first_entry(ptr, type, member))
+#define list_next_entry(pos, member) \
+	list_entry((pos)->member.next, typeof(*(pos)), member)
+#define list_prev_entry(pos, member) \
+	list_entry((pos)->member.prev, typeof(*(pos)), member)
+#define list_entry_is_head(pos, head, member)	(&(pos)->member == (head))
+#define list_for_each(pos, head) \
+	for (pos = (head)->next; pos != (head); pos = pos->next)
+#define list_for_each_safe(pos, n, head) \
+	for (pos = (head)->next, n = pos->next; pos != (head); \
+	     pos = n, n = pos->next)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_first_entry(head, typeof(*pos), member); \
+	     !list_entry_is_head(pos, head, member); \
+	     pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for (pos = list_first_entry(head, typeof(*pos), member), \
+	     n = list_next_entry(pos, member); \
+	     !list_entry_is_head(pos, head, member); \
+	     pos = n, n = list_next_entry(n, member))
+#define list_for_each_entry_rcu(pos, head, member, ...) \
+	list_for_each_entry(pos, head, member)
+
+/* Red-black trees: the node only, the gc scheduler of the core is
+ * emulated without the tree, see kshim_core.c
+ */
+struct rb_node {
+	unsigned long __rb_parent_color;
+	struct rb_node *rb_right, *rb_left;
+};
+
+/* Lock-less lists */
+struct llist_node { struct llist_node *next; };
+struct llist_head { struct llist_node *first; };
+#define init_llist_head(h)	((h)->first = NULL)
+#define llist_entry(ptr, type, member)	container_of(ptr, type, member)
+#define llist_for_each_entry_safe(pos, n, node, member) \
+	for (pos = llist_entry((node), typeof(*pos), member); \
+	     &pos->member != NULL && \
+	     (n = llist_entry(pos->member.next, typeof(*n), member), true); \
+	     pos = n)
+
+static inline bool
+llist_add(struct llist_node *n, struct llist_head *head)
+{
+	n->next = head->first;
+	head->first = n;
+	return !n->next;
+}
+
+static inline struct llist_node *
+llist_del_all(struct llist_head *head)
+{
+	struct llist_node *first = head->first;
+
+	head->first = NULL;
+	return first;
+}
+
+static inline struct llist_node *
+llist_reverse_order(struct llist_node *head)
+{
+	struct llist_node *n = NULL, *tmp;
+
+	while (head) {
+		tmp = head;
+		head = head->next;
+		tmp->next = n;
+		n = tmp;
+	}
+	return n;
+}
+
+/* Work items and timers, run by kshim_quiesce() when they are due */
+struct work_struct {
+	void (*func)(struct work_struct *work);
+	struct list_head entry;
+	bool pending;
+	unsigned long expires;	/* for the delayed ones */
+	bool delayed;
+};
+struct delayed_work { struct work_struct work; };
+struct timer_list {
+	unsigned long expires;
+	void (*function)(struct timer_list *t);
+	struct work_struct work;
+};
+struct workqueue_struct;
+extern struct workqueue_struct *system_wq, *system_unbound_wq,
+			       *system_power_efficient_wq, *system_long_wq;
+#define INIT_WORK(w, f) \
+	do { memset((w), 0, sizeof(*(w))); (w)->func = (f); } while (0)
+#define INIT_DELAYED_WORK(w, f)	INIT_WORK(&(w)->work, f)
+#define INIT_DEFERRABLE_WORK(w, f) INIT_DELAYED_WORK(w, f)
+#define DECLARE_WORK(n, f)	struct work_struct n = { .func = (f) }
+#define to_delayed_work(w)	container_of(w, struct delayed_work, work)
+#define work_pending(w)		((w)->pending)
+#define delayed_work_pending(w)	work_pending(&(w)->work)
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+bool mod_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
+		      unsigned long delay);
+bool queue_delayed_work(struct workqueue_struct *wq,
+			struct delayed_work *dwork, unsigned long delay);
+bool cancel_work_sync(struct work_struct *work);
+bool flush_work(struct work_struct *work);
+#define schedule_work(w)	queue_work(system_wq, w)
+#define schedule_delayed_work(w, d) queue_delayed_work(system_wq, w, d)
+#define cancel_delayed_work_sync(w) cancel_work_sync(&(w)->work)
+#define cancel_delayed_work(w)	cancel_work_sync(&(w)->work)
+#define flush_delayed_work(w)	flush_work(&(w)->work)
+void timer_setup(struct timer_list *timer,
+		 void (*function)(struct timer_list *t), unsigned int flags);
+int mod_timer(struct timer_list *timer, unsigned long expires);
+#define add_timer(t)		mod_timer(t, (t)->expires)
+#define del_timer(t)		cancel_work_sync(&(t)->work)
+#define del_timer_sync(t)	cancel_work_sync(&(t)->work)
+#define timer_pending(t)	work_pending(&(t)->work)
+#define from_timer(var, callback_timer, timer_fieldname) \
+	container_of(callback_timer, typeof(*var), timer_fieldname)
+
+/* Static keys */
+struct static_key { atomic_t enabled; };
+struct static_key_false { struct static_key key; };
+#define DEFINE_STATIC_KEY_FALSE(name)	struct static_key_false name
+#define DECLARE_STATIC_KEY_FALSE(name)	extern struct static_key_false name
+#define static_branch_unlikely(x)	unlikely(atomic_read(&(x)->key.enabled) > 0)
+#define static_branch_likely(x)		likely(atomic_read(&(x)->key.enabled) > 0)
+#define static_branch_inc(x)		atomic_inc(&(x)->key.enabled)
+#define static_branch_dec(x)		atomic_dec(&(x)->key.enabled)
+
+/* Tracepoints compile to nothing */
+#define TP_PROTO(args...)	args
+#define TP_ARGS(args...)	args
+#define TP_STRUCT__entry(args...) args
+#define TP_fast_assign(args...)	args
+#define TP_printk(fmt, args...)	fmt, args
+#define __array(t, n, l)	t n[l];
+#define __field(t, n)		t n;
+#define PARAMS(args...)		args
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+	static inline void trace_##name(proto) {} \
+	static inline bool trace_##name##_enabled(void) { return false; }
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+	DEFINE_EVENT(name, name, PARAMS(proto), PARAMS(args))
+
+/* Networking */
+struct net { int dummy; };
+extern struct net init_net;
+struct sock;
+struct user_namespace;
+struct net_device { int ifindex; char name[16]; };
+#define IFNAMSIZ		16
+#define ETH_ALEN		6
+#define ETH_HLEN		14
+#define ETH_P_IP		0x0800
+#define ETH_P_IPV6		0x86DD
+#define AF_INET			2
+#define AF_INET6		10
+#define PF_INET			AF_INET
+#define PF_INET6		AF_INET6
+#define NFPROTO_UNSPEC		0
+#define NFPROTO_INET		1
+#define NFPROTO_IPV4		2
+#define NFPROTO_ARP		3
+#define NFPROTO_BRIDGE		7
+#define NFPROTO_IPV6		10
+#define NFPROTO_NUMPROTO	12
+enum {
+	IPPROTO_IP = 0, IPPROTO_ICMP = 1, IPPROTO_TCP = 6, IPPROTO_UDP = 17,
+	IPPROTO_IPV6 = 41, IPPROTO_ICMPV6 = 58, IPPROTO_SCTP = 132,
+	IPPROTO_UDPLITE = 136, IPPROTO_RAW = 255,
+};
+#define NEXTHDR_FRAGMENT	44
+#define IP_OFFSET		0x1FFF
+#define IP_MF			0x2000
+struct in_addr { __be32 s_addr; };
+struct in6_addr {
+	union {
+		__u8 u6_addr8[16];
+		__be16 u6_addr16[8];
+		__be32 u6_addr32[4];
+	} in6_u;
+};
+#define s6_addr			in6_u.u6_addr8
+#define s6_addr16		in6_u.u6_addr16
+#define s6_addr32		in6_u.u6_addr32
+union nf_inet_addr {
+	__u32 all[4];
+	__be32 ip;
+	__be32 ip6[4];
+	struct in_addr in;
+	struct in6_addr in6;
+};
+
+static inline bool
+ipv6_addr_equal(const struct in6_addr *a1, const struct in6_addr *a2)
+{
+	return !memcmp(a1, a2, sizeof(*a1));
+}
+
+static inline bool
+ipv6_addr_any(const struct in6_addr *a)
+{
+	return !(a->s6_addr32[0] | a->s6_addr32[1] |
+		 a->s6_addr32[2] | a->s6_addr32[3]);
+}
+
+static inline bool
+ipv6_addr_v4mapped(const struct in6_addr *a)
+{
+	return !(a->s6_addr32[0] | a->s6_addr32[1]) &&
+	       a->s6_addr32[2] == htonl(0x0000ffff);
+}
+
+static inline void
+ipv6_addr_set_v4mapped(const __be32 addr, struct in6_addr *v4mapped)
+{
+	v4mapped->s6_addr32[0] = 0;
+	v4mapped->s6_addr32[1] = 0;
+	v4mapped->s6_addr32[2] = htonl(0x0000ffff);
+	v4mapped->s6_addr32[3] = addr;
+}
+
+struct iphdr {
+	__u8 ihl:4, version:4;
+	__u8 tos;
+	__be16 tot_len;
+	__be16 id;
+	__be16 frag_off;
+	__u8 ttl;
+	__u8 protocol;
+	__sum16 check;
+	__be32 saddr;
+	__be32 daddr;
+};
+struct ipv6hdr {
+	__u8 priority:4, version:4;
+	__u8 flow_lbl[3];
+	__be16 payload_len;
+	__u8 nexthdr;
+	__u8 hop_limit;
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+};
+struct tcphdr {
+	__be16 source;
+	__be16 dest;
+	__be32 seq;
+	__be32 ack_seq;
+	__u16 res1:4, doff:4, flags:8;
+	__be16 window;
+	__sum16 check;
+	__be16 urg_ptr;
+};
+#define before(a, b)		((s32)((a) - (b)) < 0)
+#define after(a, b)		before(b, a)
+struct udphdr { __be16 source; __be16 dest; __be16 len; __sum16 check; };
+struct sctphdr { __be16 source; __be16 dest; __be32 vtag; __le32 checksum; };
+struct icmphdr { __u8 type; __u8 code; __sum16 checksum; __be32 un; };
+struct icmp6hdr { __u8 icmp6_type; __u8 icmp6_code; __sum16 icmp6_cksum; };
+struct ethhdr {
+	unsigned char h_dest[ETH_ALEN];
+	unsigned char h_source[ETH_ALEN];
+	__be16 h_proto;
+};
+
+/* Socket buffers: a linear buffer, enough for the netlink messages and
+ * for the headers of the packets
+ */
+struct sk_buff {
+	unsigned char *head, *data;
+	unsigned int len, tail, end;
+	__u16 mac_header, network_header, transport_header;
+	__be16 protocol;
+	__u32 mark, priority;
+	__u16 queue_mapping;
+	int skb_iif;
+	struct net_device *dev;
+	struct sock *sk;
+	char cb[48];
+};
+struct sk_buff *alloc_skb(unsigned int size, gfp_t flags);
+void kfree_skb(struct sk_buff *skb);
+#define consume_skb(skb)	kfree_skb(skb)
+
+static inline unsigned char *
+skb_tail_pointer(const struct sk_buff *skb)
+{
+	return skb->head + skb->tail;
+}
+
+static inline int
+skb_tailroom(const struct sk_buff *skb)
+{
+	return skb->end - skb->tail;
+}
+
+static inline unsigned char *
+skb_put(struct sk_buff *skb, unsigned int len)
+{
+	unsigned char *tmp = skb_tail_pointer(skb);
+
+	BUG_ON(skb_tailroom(skb) < (int)len);
+	skb->tail += len;
+	skb->len += len;
+	return tmp;
+}
+
+static inline void
+skb_trim(struct sk_buff *skb, unsigned int len)
+{
+	skb->len = len;
+	skb->tail = skb->data - skb->head + len;
+}
+
+#define skb_network_header(skb)	((skb)->head + (skb)->network_header)
+#define skb_mac_header(skb)	((skb)->head + (skb)->mac_header)
+#define skb_network_offset(skb)	\
+	((int)(skb_network_header(skb) - (skb)->data))
+#define skb_mac_header_was_set(skb) ((skb)->mac_header != (u16)~0U)
+#define ip_hdr(skb)		((struct iphdr *)skb_network_header(skb))
+#define ipv6_hdr(skb)		((struct ipv6hdr *)skb_network_header(skb))
+#define eth_hdr(skb)		((struct ethhdr *)skb_mac_header(skb))
+#define ip_hdrlen(skb)		(ip_hdr(skb)->ihl * 4)
+#define skb_protocol(skb, v)	((skb)->protocol)
+#define tc_skb_protocol(skb)	((skb)->protocol)
+#define skb_vlan_tag_present(skb) ((void)(skb), false)
+
+static inline void *
+skb_header_pointer(const struct sk_buff *skb, int offset, int len,
+		   void *buffer)
+{
+	if (offset < 0 || offset + len > (int)skb->len)
+		return NULL;
+	return skb->data + offset;
+}
+
+static inline bool
+ether_addr_equal(const u8 *a, const u8 *b)
+{
+	return !memcmp(a, b, ETH_ALEN);
+}
+
+static inline bool
+is_zero_ether_addr(const u8 *a)
+{
+	static const u8 zero[ETH_ALEN];
+
+	return ether_addr_equal(a, zero);
+}
+
+#define ether_addr_copy(dst, src)	memcpy(dst, src, ETH_ALEN)
+#define eth_zero_addr(a)		memset(a, 0, ETH_ALEN)
+
+/* Netlink */
+struct nlmsghdr {
+	__u32 nlmsg_len;
+	__u16 nlmsg_type;
+	__u16 nlmsg_flags;
+	__u32 nlmsg_seq;
+	__u32 nlmsg_pid;
+};
+struct nlattr { __u16 nla_len; __u16 nla_type; };
+#define NLMSG_ALIGNTO		4U
+#define NLMSG_ALIGN(len)	(((len) + NLMSG_ALIGNTO - 1) & ~(NLMSG_ALIGNTO - 1))
+#define NLMSG_HDRLEN		((int)NLMSG_ALIGN(sizeof(struct nlmsghdr)))
+#define NLMSG_GOODSIZE		3776UL
+#define NLMSG_DEFAULT_SIZE	(NLMSG_GOODSIZE - NLMSG_HDRLEN)
+#define NLM_F_MULTI		0x02
+#define NLM_F_DUMP_INTR		0x10
+#define NLA_F_NESTED		(1 << 15)
+#define NLA_F_NET_BYTEORDER	(1 << 14)
+#define NLA_TYPE_MASK		~(NLA_F_NESTED | NLA_F_NET_BYTEORDER)
+#define NLA_ALIGNTO		4
+#define NLA_ALIGN(len)		(((len) + NLA_ALIGNTO - 1) & ~(NLA_ALIGNTO - 1))
+#define NLA_HDRLEN		((int)NLA_ALIGN(sizeof(struct nlattr)))
+enum {
+	NLA_UNSPEC, NLA_U8, NLA_U16, NLA_U32, NLA_U64, NLA_STRING, NLA_FLAG,
+	NLA_MSECS, NLA_NESTED, NLA_NESTED_ARRAY, NLA_NUL_STRING, NLA_BINARY,
+	NLA_S8, NLA_S16, NLA_S32, NLA_S64, NLA_BITFIELD32,
+};
+struct nla_policy { u8 type; u8 validation_type; u16 len; };
+#define NLA_POLICY_EXACT_LEN(_len)	{ .type = NLA_BINARY, .len = _len }
+struct netlink_ext_ack { const char *_msg; const struct nlattr *bad_attr; };
+#define NL_SET_ERR_MSG(e, m)		do { (void)(e); } while (0)
+#define NL_SET_ERR_MSG_MOD(e, m)	NL_SET_ERR_MSG(e, m)
+struct netlink_skb_parms { __u32 portid; };
+#define NETLINK_CB(skb)		(*(struct netlink_skb_parms *)&((skb)->cb))
+struct netlink_callback {
+	struct sk_buff *skb;
+	const struct nlmsghdr *nlh;
+	void *data;
+	struct netlink_ext_ack *extack;
+	u16 family;
+	u16 answer_flags;
+	unsigned int prev_seq, seq;
+	union {
+		u8 ctx[48];
+		long args[6];
+	};
+};
+
+static inline int nla_attr_size(int payload) { return NLA_HDRLEN + payload; }
+static inline int nla_total_size(int payload)
+{
+	return NLA_ALIGN(nla_attr_size(payload));
+}
+static inline int nla_padlen(int payload)
+{
+	return nla_total_size(payload) - nla_attr_size(payload);
+}
+static inline int nla_type(const struct nlattr *nla)
+{
+	return nla->nla_type & NLA_TYPE_MASK;
+}
+static inline void *nla_data(const struct nlattr *nla)
+{
+	return (char *)nla + NLA_HDRLEN;
+}
+static inline int nla_len(const struct nlattr *nla)
+{
+	return nla->nla_len - NLA_HDRLEN;
+}
+static inline int nla_ok(const struct nlattr *nla, int remaining)
+{
+	return remaining >= (int)sizeof(*nla) &&
+	       nla->nla_len >= sizeof(*nla) &&
+	       nla->nla_len <= remaining;
+}
+static inline struct nlattr *nla_next(const struct nlattr *nla, int *remaining)
+{
+	unsigned int totlen = NLA_ALIGN(nla->nla_len);
+
+	*remaining -= totlen;
+	return (struct nlattr *)((char *)nla + totlen);
+}
+#define nla_for_each_attr(pos, head, len, rem) \
+	for (pos = head, rem = len; nla_ok(pos, rem); \
+	     pos = nla_next(pos, &(rem)))
+#define nla_for_each_nested(pos, nla, rem) \
+	nla_for_each_attr(pos, nla_data(nla), nla_len(nla), rem)
+
+#define __kshim_nla_get(type, nla) \
+	({ type __v = 0; memcpy(&__v, nla_data(nla), \
+	   min_t(int, sizeof(__v), nla_len(nla))); __v; })
+#define nla_get_u8(nla)		__kshim_nla_get(u8, nla)
+#define nla_get_u16(nla)	__kshim_nla_get(u16, nla)
+#define nla_get_u32(nla)	__kshim_nla_get(u32, nla)
+#define nla_get_u64(nla)	__kshim_nla_get(u64, nla)
+#define nla_get_be16(nla)	__kshim_nla_get(__be16, nla)
+#define nla_get_be32(nla)	__kshim_nla_get(__be32, nla)
+#define nla_get_be64(nla)	__kshim_nla_get(__be64, nla)
+#define nla_get_in_addr(nla)	nla_get_be32(nla)
+
+static inline int
+nla_memcpy(void *dest, const struct nlattr *src, int count)
+{
+	int minlen = min_t(int, count, nla_len(src));
+
+	memcpy(dest, nla_data(src), minlen);
+	if (count > minlen)
+		memset((char *)dest + minlen, 0, count - minlen);
+	return minlen;
+}
+
+static inline struct nlattr *
+nla_find_nested(const struct nlattr *nla, int attrtype)
+{
+	const struct nlattr *pos;
+	int rem;
+
+	nla_for_each_nested(pos, nla, rem)
+		if (nla_type(pos) == attrtype)
+			return (struct nlattr *)pos;
+	return NULL;
+}
+
+int nla_parse(struct nlattr **tb, int maxtype, const struct nlattr *head,
+	      int len, const struct nla_policy *policy,
+	      struct netlink_ext_ack *extack);
+#define nla_parse_nested(tb, maxtype, nla, policy, extack) \
+	nla_parse(tb, maxtype, nla_data(nla), nla_len(nla), policy, extack)
+#define nla_parse_nested_deprecated	nla_parse_nested
+#define nla_parse_deprecated		nla_parse
+ssize_t nla_strscpy(char *dst, const struct nlattr *nla, size_t dstsize);
+
+int nla_put(struct sk_buff *skb, int attrtype, int attrlen, const void *data);
+#define __kshim_nla_put(skb, type, t, v) \
+	({ t __v = (v); nla_put(skb, type, sizeof(__v), &__v); })
+#define nla_put_u8(skb, t, v)	__kshim_nla_put(skb, t, u8, v)
+#define nla_put_u16(skb, t, v)	__kshim_nla_put(skb, t, u16, v)
+#define nla_put_u32(skb, t, v)	__kshim_nla_put(skb, t, u32, v)
+#define nla_put_be16(skb, t, v)	__kshim_nla_put(skb, t, __be16, v)
+#define nla_put_be32(skb, t, v)	__kshim_nla_put(skb, t, __be32, v)
+#define nla_put_be64(skb, t, v, p) __kshim_nla_put(skb, t, __be64, v)
+#define nla_put_u64_64bit(skb, t, v, p) __kshim_nla_put(skb, t, u64, v)
+#define nla_put_net16(skb, t, v) \
+	nla_put_be16(skb, (t) | NLA_F_NET_BYTEORDER, v)
+#define nla_put_net32(skb, t, v) \
+	nla_put_be32(skb, (t) | NLA_F_NET_BYTEORDER, v)
+#define nla_put_net64(skb, t, v, p) \
+	nla_put_be64(skb, (t) | NLA_F_NET_BYTEORDER, v, p)
+#define nla_put_in_addr(skb, t, v)	nla_put_be32(skb, t, v)
+#define nla_put_in6_addr(skb, t, a) \
+	nla_put(skb, t, sizeof(struct in6_addr), a)
+#define nla_put_string(skb, t, s)	nla_put(skb, t, strlen(s) + 1, s)
+#define nla_put_flag(skb, t)		nla_put(skb, t, 0, NULL)
+
+static inline struct nlattr *
+nla_nest_start(struct sk_buff *skb, int attrtype)
+{
+	struct nlattr *start = (struct nlattr *)skb_tail_pointer(skb);
+
+	if (nla_put(skb, attrtype | NLA_F_NESTED, 0, NULL) < 0)
+		return NULL;
+	return start;
+}
+#define nla_nest_start_noflag(skb, t)	nla_nest_start(skb, t)
+
+static inline int
+nla_nest_end(struct sk_buff *skb, struct nlattr *start)
+{
+	start->nla_len = skb_tail_pointer(skb) - (unsigned char *)start;
+	return skb->len;
+}
+
+static inline void
+nlmsg_trim(struct sk_buff *skb, const void *mark)
+{
+	if (mark)
+		skb_trim(skb, (const unsigned char *)mark - skb->data);
+}
+
+static inline void
+nla_nest_cancel(struct sk_buff *skb, struct nlattr *start)
+{
+	nlmsg_trim(skb, start);
+}
+
+#define MSG_DONTWAIT		0x40
+int netlink_unicast(struct sock *ssk, struct sk_buff *skb, u32 portid,
+		    int nonblock);
+
+/* nfnetlink and xtables */
+#define NFNL_SUBSYS_IPSET	6
+#define lockdep_nfnl_is_held(x)	1
+struct nf_hook_state {
+	u8 hook;
+	u8 pf;
+	struct net_device *in, *out;
+	struct sock *sk;
+	struct net *net;
+};
+struct xt_action_param {
+	const void *match;
+	const void *matchinfo;
+	const struct nf_hook_state *state;
+	unsigned int thoff;
+	u16 fragoff;
+	bool hotdrop;
+};
+#define xt_net(par)		((par)->state->net)
+#define xt_family(par)		((par)->state->pf)
+#define xt_in(par)		((par)->state->in)
+#define xt_out(par)		((par)->state->out)
+#define xt_hooknum(par)		((par)->state->hook)
+int ipv6_skip_exthdr(const struct sk_buff *skb, int start, u8 *nexthdrp,
+		     __be16 *frag_offp);
+struct net_device *nf_bridge_get_physindev(const struct sk_buff *skb,
+					   struct net *net);
+struct net_device *nf_bridge_get_physoutdev(const struct sk_buff *skb);
+
+/* Hooks of the programs using the shim */
+void kshim_seed(u64 seed);
+void kshim_advance(unsigned long ticks);
+void kshim_quiesce(void);
+void kshim_fail_alloc(long after);
+extern int kshim_verbose;	/* printk to stderr */
+
+#endif /* KSHIM_H */
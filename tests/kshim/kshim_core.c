@@ -0,0 +1,713 @@
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* The part of ip_set_core.c used by the set types. The functions are
+ * kept as close to the original ones as possible, please keep them in
+ * sync. There are no namespaces and notifications, the comments are
+ * not interned and the per-cpu counters are plain ones.
+ */
+
+#include <linux/netfilter/ipset/ip_set.h>
+
+static LIST_HEAD(ip_set_type_list);
+
+#define STRNCMP(a, b)	(strncmp(a, b, IPSET_MAXNAMELEN) == 0)
+
+struct ip_set_type *
+kshim_find_set_type(const char *name, u8 family, u8 revision)
+{
+	struct ip_set_type *type;
+
+	list_for_each_entry(type, &ip_set_type_list, list)
+		if (STRNCMP(type->name, name) &&
+		    (type->family == family ||
+		     type->family == NFPROTO_UNSPEC) &&
+		    revision >= type->revision_min &&
+		    revision <= type->revision_max)
+			return type;
+	return NULL;
+}
+
+int
+ip_set_type_register(struct ip_set_type *type)
+{
+	if (type->protocol != IPSET_PROTOCOL)
+		return -EINVAL;
+	if (kshim_find_set_type(type->name, type->family, type->revision_min))
+		return -EINVAL;
+	list_add(&type->list, &ip_set_type_list);
+	return 0;
+}
+
+void
+ip_set_type_unregister(struct ip_set_type *type)
+{
+	list_del(&type->list);
+	synchronize_rcu();
+}
+
+/* Utility functions */
+void *
+ip_set_alloc(size_t size)
+{
+	return kvzalloc(size, GFP_KERNEL_ACCOUNT);
+}
+
+void *
+ip_set_alloc_node(size_t size, int node)
+{
+	return kvzalloc_node(size, GFP_KERNEL_ACCOUNT, node);
+}
+
+void *
+ip_set_alloc_huge(size_t size, int node, u8 *pages)
+{
+	*pages = IPSET_PAGES_SMALL;
+	return ip_set_alloc_node(size, node);
+}
+
+void
+ip_set_free(void *members)
+{
+	kvfree(members);
+}
+
+/* The memory budget: the namespace is not emulated, so it is unlimited */
+bool
+ip_set_mem_charge(struct ip_set *set, long size, bool force)
+{
+	atomic_long_add(size, &set->mem);
+	return true;
+}
+
+bool
+ip_set_mem_full(const struct ip_set *set)
+{
+	return false;
+}
+
+/* The gc scheduler: every gc run is a delayed work item of its own and
+ * every other yield request is granted, so that the runs which continue
+ * a previous one are exercised as well.
+ */
+static unsigned int kshim_gc_yields;
+
+static void
+kshim_gc_work(struct work_struct *work)
+{
+	struct ip_set_gc *gc = container_of(work, struct ip_set_gc, work);
+	unsigned long due;
+
+	gc->state = IP_SET_GC_RUNNING;
+	gc->kicked = false;
+	gc->start = ktime_get_ns();
+	due = gc->run(gc);
+	gc->runs++;
+	if (gc->state != IP_SET_GC_RUNNING)
+		return;
+	if (gc->kicked && time_before(gc->kick, due))
+		due = gc->kick;
+	gc->state = IP_SET_GC_PENDING;
+	gc->due = due;
+	queue_delayed_work(system_power_efficient_wq, to_delayed_work(work),
+			   time_after(due, jiffies) ? due - jiffies : 0);
+}
+
+void
+ip_set_gc_init(struct ip_set *set, struct ip_set_gc *gc,
+	       unsigned long (*run)(struct ip_set_gc *gc))
+{
+	memset(gc, 0, sizeof(*gc));
+	INIT_WORK(&gc->work, kshim_gc_work);
+	gc->set = set;
+	gc->run = run;
+}
+
+void
+ip_set_gc_schedule(struct ip_set_gc *gc, unsigned long due)
+{
+	switch (gc->state) {
+	case IP_SET_GC_PENDING:
+		if (!time_before(due, gc->due))
+			break;
+		fallthrough;
+	case IP_SET_GC_IDLE:
+		gc->state = IP_SET_GC_PENDING;
+		gc->due = due;
+		mod_delayed_work(system_power_efficient_wq,
+				 to_delayed_work(&gc->work),
+				 time_after(due, jiffies) ? due - jiffies : 0);
+		break;
+	case IP_SET_GC_RUNNING:
+		if (!gc->kicked || time_before(due, gc->kick)) {
+			gc->kick = due;
+			gc->kicked = true;
+		}
+		break;
+	}
+}
+
+void
+ip_set_gc_cancel(struct ip_set_gc *gc)
+{
+	gc->state = IP_SET_GC_STOPPED;
+	cancel_work_sync(&gc->work);
+}
+
+bool
+ip_set_gc_yield(const struct ip_set_gc *gc)
+{
+	return ++kshim_gc_yields % 2;
+}
+
+/* No transactional batches */
+int
+__ip_set_txn_record(struct ip_set *set, const void *added,
+		    const void *removed, size_t len, u32 flags)
+{
+	return 0;
+}
+
+void
+ip_set_txn_forget(struct ip_set *set)
+{
+}
+
+u32
+__ip_set_source_hash(const struct sk_buff *skb, u8 family)
+{
+	return 0;
+}
+
+static bool
+flag_nested(const struct nlattr *nla)
+{
+	return nla->nla_type & NLA_F_NESTED;
+}
+
+static const struct nla_policy ipaddr_policy[IPSET_ATTR_IPADDR_MAX + 1] = {
+	[IPSET_ATTR_IPADDR_IPV4]	= { .type = NLA_U32 },
+	[IPSET_ATTR_IPADDR_IPV6]	= NLA_POLICY_EXACT_LEN(sizeof(struct in6_addr)),
+};
+
+int
+ip_set_get_ipaddr4(struct nlattr *nla,  __be32 *ipaddr)
+{
+	struct nlattr *tb[IPSET_ATTR_IPADDR_MAX + 1];
+
+	if (unlikely(!flag_nested(nla)))
+		return -IPSET_ERR_PROTOCOL;
+	if (NLA_PARSE_NESTED(tb, IPSET_ATTR_IPADDR_MAX, nla,
+			     ipaddr_policy, NULL))
+		return -IPSET_ERR_PROTOCOL;
+	if (unlikely(!ip_set_attr_netorder(tb, IPSET_ATTR_IPADDR_IPV4)))
+		return -IPSET_ERR_PROTOCOL;
+
+	*ipaddr = nla_get_be32(tb[IPSET_ATTR_IPADDR_IPV4]);
+	return 0;
+}
+
+int
+ip_set_get_ipaddr6(struct nlattr *nla, union nf_inet_addr *ipaddr)
+{
+	struct nlattr *tb[IPSET_ATTR_IPADDR_MAX + 1];
+
+	if (unlikely(!flag_nested(nla)))
+		return -IPSET_ERR_PROTOCOL;
+
+	if (NLA_PARSE_NESTED(tb, IPSET_ATTR_IPADDR_MAX, nla,
+			     ipaddr_policy, NULL))
+		return -IPSET_ERR_PROTOCOL;
+	if (unlikely(!ip_set_attr_netorder(tb, IPSET_ATTR_IPADDR_IPV6)))
+		return -IPSET_ERR_PROTOCOL;
+
+	memcpy(ipaddr, nla_data(tb[IPSET_ATTR_IPADDR_IPV6]),
+	       sizeof(struct in6_addr));
+	return 0;
+}
+
+static u32
+ip_set_timeout_get(const u32 *timeout)
+{
+	s32 t;
+
+	if (*timeout == IPSET_ELEM_PERMANENT)
+		return 0;
+
+	t = (s32)(*timeout - ip_set_timeout_now());
+	/* Zero value in userspace means no timeout */
+	return t <= 0 ? 1 : t;
+}
+
+/* Comments: every element has its own copy */
+void
+ip_set_init_comment(struct ip_set *set, struct ip_set_comment *comment,
+		    const struct ip_set_ext *ext)
+{
+	struct ip_set_comment_rcu *old = rcu_dereference_protected(comment->c, 1);
+	struct ip_set_comment_rcu *c = NULL;
+	size_t len = ext->comment ? strlen(ext->comment) : 0;
+
+	if (unlikely(len > IPSET_MAX_COMMENT_SIZE))
+		len = IPSET_MAX_COMMENT_SIZE;
+	if (len) {
+		c = kmalloc(sizeof(*c) + len + 1, GFP_ATOMIC);
+		if (c) {
+			memcpy(c->str, ext->comment, len);
+			c->str[len] = '\0';
+			c->set = set;
+			c->ref = 1;
+			set->ext_size += sizeof(*c) + len + 1;
+		}
+	}
+	rcu_assign_pointer(comment->c, c);
+	if (unlikely(old)) {
+		set->ext_size -= sizeof(*old) + strlen(old->str) + 1;
+		kfree_rcu(old, rcu);
+	}
+}
+
+static int
+ip_set_put_comment(struct sk_buff *skb, const struct ip_set_comment *comment)
+{
+	struct ip_set_comment_rcu *c = rcu_dereference(comment->c);
+
+	if (!c)
+		return 0;
+	return nla_put_string(skb, IPSET_ATTR_COMMENT, c->str);
+}
+
+static void
+ip_set_comment_free(struct ip_set *set, void *ptr)
+{
+	struct ip_set_comment *comment = ptr;
+	struct ip_set_comment_rcu *c;
+
+	c = rcu_dereference_protected(comment->c, 1);
+	if (unlikely(!c))
+		return;
+	rcu_assign_pointer(comment->c, NULL);
+	set->ext_size -= sizeof(*c) + strlen(c->str) + 1;
+	kfree_rcu(c, rcu);
+}
+
+/* The per-cpu counters of the single CPU are the base counters */
+void
+ip_set_init_pcpu_counter(struct ip_set_counter *counter,
+			 const struct ip_set_ext *ext)
+{
+	if (ext->bytes != ULLONG_MAX)
+		atomic64_set(&counter->bytes, (long long)(ext->bytes));
+	if (ext->packets != ULLONG_MAX)
+		atomic64_set(&counter->packets, (long long)(ext->packets));
+}
+
+static void
+ip_set_counter_pcpu_free(struct ip_set *set, void *ptr)
+{
+}
+
+const struct ip_set_ext_type ip_set_extensions[] = {
+	[IPSET_EXT_ID_COUNTER] = {
+		.type	= IPSET_EXT_COUNTER,
+		.flag	= IPSET_FLAG_WITH_COUNTERS,
+		.len	= sizeof(struct ip_set_counter),
+		.align	= __alignof__(struct ip_set_counter),
+		.destroy = ip_set_counter_pcpu_free,
+	},
+	[IPSET_EXT_ID_TIMEOUT] = {
+		.type	= IPSET_EXT_TIMEOUT,
+		.attr	= IPSET_ATTR_TIMEOUT,
+		.len	= sizeof(u32),
+		.align	= __alignof__(u32),
+	},
+	[IPSET_EXT_ID_SKBINFO] = {
+		.type	= IPSET_EXT_SKBINFO,
+		.flag	= IPSET_FLAG_WITH_SKBINFO,
+		.len	= sizeof(struct ip_set_skbinfo),
+		.align	= __alignof__(struct ip_set_skbinfo),
+	},
+	[IPSET_EXT_ID_COMMENT] = {
+		.type	 = IPSET_EXT_COMMENT | IPSET_EXT_DESTROY,
+		.flag	 = IPSET_FLAG_WITH_COMMENT,
+		.len	 = sizeof(struct ip_set_comment),
+		.align	 = __alignof__(struct ip_set_comment),
+		.destroy = ip_set_comment_free,
+	},
+	[IPSET_EXT_ID_DISTINCT] = {
+		.type	= IPSET_EXT_DISTINCT,
+		.flag	= IPSET_FLAG_WITH_DISTINCT,
+		.len	= sizeof(struct ip_set_distinct),
+		.align	= __alignof__(struct ip_set_distinct),
+	},
+	[IPSET_EXT_ID_RATELIMIT] = {
+		.type	= IPSET_EXT_RATELIMIT,
+		.attr	= IPSET_ATTR_RATE,
+		.len	= sizeof(struct ip_set_ratelimit),
+		.align	= __alignof__(struct ip_set_ratelimit),
+	},
+};
+
+static bool
+add_extension(enum ip_set_ext_id id, u32 flags, struct nlattr *tb[])
+{
+	return ip_set_extensions[id].flag ?
+		(flags & ip_set_extensions[id].flag) :
+		!!tb[ip_set_extensions[id].attr];
+}
+
+size_t
+ip_set_elem_len(struct ip_set *set, struct nlattr *tb[], size_t len,
+		size_t align)
+{
+	enum ip_set_ext_id id, next;
+	size_t pad, min_pad;
+	u32 cadt_flags = 0, placed = 0;
+
+	if (tb[IPSET_ATTR_CADT_FLAGS])
+		cadt_flags = ip_set_get_h32(tb[IPSET_ATTR_CADT_FLAGS]);
+	if (cadt_flags & IPSET_FLAG_WITH_FORCEADD)
+		set->flags |= IPSET_CREATE_FLAG_FORCEADD;
+	if (!align)
+		align = 1;
+	for (;;) {
+		next = IPSET_EXT_ID_MAX;
+		min_pad = SIZE_MAX;
+		for (id = 0; id < IPSET_EXT_ID_MAX; id++) {
+			if ((placed & (1 << id)) ||
+			    !add_extension(id, cadt_flags, tb))
+				continue;
+			pad = ALIGN(len, ip_set_extensions[id].align) - len;
+			if (pad < min_pad) {
+				next = id;
+				min_pad = pad;
+			}
+		}
+		if (next == IPSET_EXT_ID_MAX)
+			break;
+		id = next;
+		placed |= 1 << id;
+		if (align < ip_set_extensions[id].align)
+			align = ip_set_extensions[id].align;
+		len = ALIGN(len, ip_set_extensions[id].align);
+		set->offset[id] = len;
+		set->extensions |= ip_set_extensions[id].type;
+		len += ip_set_extensions[id].len;
+	}
+	return ALIGN(len, align);
+}
+
+int
+ip_set_get_extensions(struct ip_set *set, struct nlattr *tb[],
+		      struct ip_set_ext *ext)
+{
+	u64 fullmark;
+
+	if (unlikely(!ip_set_optattr_netorder(tb, IPSET_ATTR_TIMEOUT) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_PACKETS) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_BYTES) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_SKBMARK) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_SKBPRIO) ||
+		     !ip_set_optattr_netorder(tb, IPSET_ATTR_SKBQUEUE)))
+		return -IPSET_ERR_PROTOCOL;
+
+	if (tb[IPSET_ATTR_TIMEOUT]) {
+		if (!SET_WITH_TIMEOUT(set))
+			return -IPSET_ERR_TIMEOUT;
+		ext->timeout = ip_set_timeout_uget(tb[IPSET_ATTR_TIMEOUT]);
+	}
+	if (tb[IPSET_ATTR_BYTES] || tb[IPSET_ATTR_PACKETS]) {
+		if (!SET_WITH_COUNTER(set))
+			return -IPSET_ERR_COUNTER;
+		if (tb[IPSET_ATTR_BYTES])
+			ext->bytes = be64_to_cpu(nla_get_be64(
+						 tb[IPSET_ATTR_BYTES]));
+		if (tb[IPSET_ATTR_PACKETS])
+			ext->packets = be64_to_cpu(nla_get_be64(
+						   tb[IPSET_ATTR_PACKETS]));
+	}
+	if (tb[IPSET_ATTR_COMMENT]) {
+		if (!SET_WITH_COMMENT(set))
+			return -IPSET_ERR_COMMENT;
+		ext->comment = nla_data(tb[IPSET_ATTR_COMMENT]);
+	}
+	if (tb[IPSET_ATTR_SKBMARK]) {
+		if (!SET_WITH_SKBINFO(set))
+			return -IPSET_ERR_SKBINFO;
+		fullmark = be64_to_cpu(nla_get_be64(tb[IPSET_ATTR_SKBMARK]));
+		ext->skbinfo.skbmark = fullmark >> 32;
+		ext->skbinfo.skbmarkmask = fullmark & 0xffffffff;
+	}
+	if (tb[IPSET_ATTR_SKBPRIO]) {
+		if (!SET_WITH_SKBINFO(set))
+			return -IPSET_ERR_SKBINFO;
+		ext->skbinfo.skbprio =
+			be32_to_cpu(nla_get_be32(tb[IPSET_ATTR_SKBPRIO]));
+	}
+	if (tb[IPSET_ATTR_SKBQUEUE]) {
+		if (!SET_WITH_SKBINFO(set))
+			return -IPSET_ERR_SKBINFO;
+		ext->skbinfo.skbqueue =
+			be16_to_cpu(nla_get_be16(tb[IPSET_ATTR_SKBQUEUE]));
+	}
+	return 0;
+}
+
+static void
+ip_set_get_counter(const struct ip_set *set,
+		   const struct ip_set_counter *counter,
+		   u64 *bytes, u64 *packets)
+{
+	*bytes = (u64)atomic64_read(&(counter)->bytes);
+	*packets = (u64)atomic64_read(&(counter)->packets);
+}
+
+void
+ip_set_ext_clone(struct ip_set *set, void *data)
+{
+	struct ip_set_ext ext = {};
+
+	if (SET_WITH_COMMENT(set)) {
+		struct ip_set_comment *comment = ext_comment(data, set);
+		struct ip_set_comment_rcu *c = rcu_dereference_bh(comment->c);
+
+		RCU_INIT_POINTER(comment->c, NULL);
+		if (c) {
+			ext.comment = c->str;
+			ip_set_init_comment(set, comment, &ext);
+		}
+	}
+}
+
+static bool
+ip_set_put_counter(struct sk_buff *skb, const struct ip_set *set,
+		   const struct ip_set_counter *counter)
+{
+	u64 bytes, packets;
+
+	ip_set_get_counter(set, counter, &bytes, &packets);
+	return IPSET_NLA_PUT_NET64(skb, IPSET_ATTR_BYTES,
+				   cpu_to_be64(bytes),
+				   IPSET_ATTR_PAD) ||
+	       IPSET_NLA_PUT_NET64(skb, IPSET_ATTR_PACKETS,
+				   cpu_to_be64(packets),
+				   IPSET_ATTR_PAD);
+}
+
+static bool
+ip_set_put_skbinfo(struct sk_buff *skb, const struct ip_set_skbinfo *skbinfo)
+{
+	/* Send nonzero parameters only */
+	return ((skbinfo->skbmark || skbinfo->skbmarkmask) &&
+		IPSET_NLA_PUT_NET64(skb, IPSET_ATTR_SKBMARK,
+				    cpu_to_be64((u64)skbinfo->skbmark << 32 |
+						skbinfo->skbmarkmask),
+				    IPSET_ATTR_PAD)) ||
+	       (skbinfo->skbprio &&
+		nla_put_net32(skb, IPSET_ATTR_SKBPRIO,
+			      cpu_to_be32(skbinfo->skbprio))) ||
+	       (skbinfo->skbqueue &&
+		nla_put_net16(skb, IPSET_ATTR_SKBQUEUE,
+			      cpu_to_be16(skbinfo->skbqueue)));
+}
+
+int
+ip_set_put_extensions(struct sk_buff *skb, const struct ip_set *set,
+		      const void *e, bool active)
+{
+	if (SET_WITH_TIMEOUT(set)) {
+		u32 *timeout = ext_timeout(e, set);
+
+		if (nla_put_net32(skb, IPSET_ATTR_TIMEOUT,
+			htonl(active ? ip_set_timeout_get(timeout)
+			      : *timeout)))
+			return -EMSGSIZE;
+	}
+	if (SET_WITH_COUNTER(set) &&
+	    ip_set_put_counter(skb, set, ext_counter(e, set)))
+		return -EMSGSIZE;
+	if (SET_WITH_COMMENT(set) &&
+	    ip_set_put_comment(skb, ext_comment(e, set)))
+		return -EMSGSIZE;
+	if (SET_WITH_SKBINFO(set) &&
+	    ip_set_put_skbinfo(skb, ext_skbinfo(e, set)))
+		return -EMSGSIZE;
+	return 0;
+}
+
+void
+ip_set_reset_counter(const struct ip_set *set, void *data,
+		     const struct nlattr *nla)
+{
+	struct ip_set_counter *counter = ext_counter(data, set);
+	const struct nlattr *attr;
+
+	attr = nla_find_nested(nla, IPSET_ATTR_BYTES);
+	if (attr)
+		atomic64_sub((long long)be64_to_cpu(nla_get_be64(attr)),
+			     &counter->bytes);
+	attr = nla_find_nested(nla, IPSET_ATTR_PACKETS);
+	if (attr)
+		atomic64_sub((long long)be64_to_cpu(nla_get_be64(attr)),
+			     &counter->packets);
+}
+
+u64
+ip_set_top_value(const struct ip_set *set, const void *data, u8 top_by)
+{
+	u64 bytes, packets;
+
+	ip_set_get_counter(set, ext_counter(data, set), &bytes, &packets);
+	return top_by == IPSET_TOP_PACKETS ? packets : bytes;
+}
+
+bool
+ip_set_purge_match(const struct ip_set *set, const void *data,
+		   const struct ip_set_purge *p)
+{
+	if (p->comment) {
+		const struct ip_set_comment_rcu *c =
+			rcu_dereference_bh(ext_comment(data, set)->c);
+
+		if (!c || strncmp(c->str, p->comment, p->comment_len))
+			return false;
+	}
+	if (p->bytes != ULLONG_MAX || p->packets != ULLONG_MAX) {
+		u64 bytes, packets;
+
+		ip_set_get_counter(set, ext_counter(data, set),
+				   &bytes, &packets);
+		if (bytes >= p->bytes || packets >= p->packets)
+			return false;
+	}
+	if (p->timeout != IPSET_NO_TIMEOUT) {
+		u32 t = READ_ONCE(*ext_timeout(data, set));
+
+		if (t == IPSET_ELEM_PERMANENT ||
+		    (s32)(t - ip_set_timeout_now()) >= (s32)p->timeout)
+			return false;
+	}
+	return true;
+}
+
+void
+ip_set_top_add(u64 *heap, u32 *size, u32 max, u64 value)
+{
+	u32 i, child;
+
+	if (*size < max) {
+		for (i = (*size)++; i && heap[(i - 1) / 2] > value;
+		     i = (i - 1) / 2)
+			heap[i] = heap[(i - 1) / 2];
+		heap[i] = value;
+		return;
+	}
+	if (!max || value <= heap[0])
+		return;
+	for (i = 0; (child = 2 * i + 1) < max; i = child) {
+		if (child + 1 < max && heap[child + 1] < heap[child])
+			child++;
+		if (heap[child] >= value)
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = value;
+}
+
+static bool
+ip_set_match_counter(u64 counter, u64 match, u8 op)
+{
+	switch (op) {
+	case IPSET_COUNTER_NONE:
+		return true;
+	case IPSET_COUNTER_EQ:
+		return counter == match;
+	case IPSET_COUNTER_NE:
+		return counter != match;
+	case IPSET_COUNTER_LT:
+		return counter < match;
+	case IPSET_COUNTER_GT:
+		return counter > match;
+	}
+	return false;
+}
+
+static void
+ip_set_update_counter(struct ip_set *set, struct ip_set_counter *counter,
+		      const struct ip_set_ext *ext, u32 flags)
+{
+	if (ext->packets != ULLONG_MAX &&
+	    !(flags & IPSET_FLAG_SKIP_COUNTER_UPDATE)) {
+		atomic64_add((long long)ext->bytes, &counter->bytes);
+		atomic64_add((long long)ext->packets, &counter->packets);
+	}
+}
+
+DEFINE_STATIC_KEY_FALSE(ip_set_match_ext_key);
+DEFINE_STATIC_KEY_FALSE(ip_set_stats_key);
+
+bool
+__ip_set_match_extensions(struct ip_set *set, const struct ip_set_ext *ext,
+			  struct ip_set_ext *mext, u32 flags, void *data)
+{
+	if (SET_WITH_TIMEOUT(set) &&
+	    ip_set_timeout_expired(ext_timeout(data, set)))
+		return false;
+	if (SET_WITH_COUNTER(set)) {
+		struct ip_set_counter *counter = ext_counter(data, set);
+		u64 bytes, packets;
+
+		ip_set_update_counter(set, counter, ext, flags);
+
+		if (flags & IPSET_FLAG_MATCH_COUNTERS) {
+			ip_set_get_counter(set, counter, &bytes, &packets);
+			if (!(ip_set_match_counter(packets,
+					mext->packets, mext->packets_op) &&
+			      ip_set_match_counter(bytes,
+					mext->bytes, mext->bytes_op)))
+				return false;
+		}
+	}
+	if (SET_WITH_SKBINFO(set))
+		mext->skbinfo = *ext_skbinfo(data, set);
+	return true;
+}
+
+int
+ip_set_put_flags(struct sk_buff *skb, struct ip_set *set)
+{
+	u32 cadt_flags = 0;
+
+	if (SET_WITH_TIMEOUT(set))
+		if (unlikely(nla_put_net32(skb, IPSET_ATTR_TIMEOUT,
+					   htonl(set->timeout))))
+			return -EMSGSIZE;
+	if (SET_WITH_COUNTER(set))
+		cadt_flags |= IPSET_FLAG_WITH_COUNTERS;
+	if (SET_WITH_COMMENT(set))
+		cadt_flags |= IPSET_FLAG_WITH_COMMENT;
+	if (SET_WITH_SKBINFO(set))
+		cadt_flags |= IPSET_FLAG_WITH_SKBINFO;
+	if (SET_WITH_FORCEADD(set))
+		cadt_flags |= IPSET_FLAG_WITH_FORCEADD;
+
+	if (!cadt_flags)
+		return 0;
+	return nla_put_net32(skb, IPSET_ATTR_CADT_FLAGS, htonl(cadt_flags));
+}
+
+/* No listeners */
+struct sk_buff *
+ip_set_notify_start(const struct ip_set *set, enum ipset_cmd cmd, u32 flags)
+{
+	return NULL;
+}
+
+void
+ip_set_notify_end(const struct ip_set *set, struct sk_buff *skb)
+{
+}
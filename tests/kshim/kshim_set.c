@@ -0,0 +1,574 @@
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* The set commands of ip_set_core.c on top of the compiled set types:
+ * the attributes are built as userspace sends them and the set type
+ * functions are called the same way as the core does.
+ */
+
+#include <linux/netfilter/ipset/ip_set.h>
+
+#include "kshim_set.h"
+
+/* The init and exit functions of the compiled set types */
+#define KSHIM_TYPES(T)	T(ip_set_hash_ip) T(ip_set_hash_net) T(ip_set_bitmap_ip)
+#define KSHIM_DECLARE(t) int kshim_init_##t(void); void kshim_exit_##t(void);
+KSHIM_TYPES(KSHIM_DECLARE)
+
+struct ip_set_type *kshim_find_set_type(const char *name, u8 family,
+					u8 revision);
+
+/* Large enough for the attributes of a command */
+#define KSHIM_ATTR_SIZE	1024
+
+struct kshim_set {
+	struct ip_set *set;
+	struct netlink_callback cb;	/* of the running listing */
+	unsigned int msgsize;
+	bool listing;
+	bool uref;		/* the listing references the set data */
+};
+
+int
+kshim_set_init(void)
+{
+	int ret = 0;
+
+#define KSHIM_INIT(t)	if (!ret) ret = kshim_init_##t();
+	KSHIM_TYPES(KSHIM_INIT)
+	return ret;
+}
+
+void
+kshim_set_fini(void)
+{
+#define KSHIM_EXIT(t)	kshim_exit_##t();
+	KSHIM_TYPES(KSHIM_EXIT)
+	rcu_barrier();
+}
+
+static int
+put_ipaddr(struct sk_buff *skb, int type, u8 family, const u8 *ip)
+{
+	struct nlattr *nested = nla_nest_start(skb, type);
+
+	if (!nested)
+		return -EMSGSIZE;
+	if (family == NFPROTO_IPV4) {
+		if (nla_put(skb, IPSET_ATTR_IPADDR_IPV4 | NLA_F_NET_BYTEORDER,
+			    sizeof(__be32), ip))
+			return -EMSGSIZE;
+	} else if (nla_put(skb, IPSET_ATTR_IPADDR_IPV6 | NLA_F_NET_BYTEORDER,
+			   sizeof(struct in6_addr), ip)) {
+		return -EMSGSIZE;
+	}
+	nla_nest_end(skb, nested);
+	return 0;
+}
+
+static bool
+any_ip(const u8 *ip)
+{
+	static const u8 zero[16];
+
+	return !memcmp(ip, zero, sizeof(zero));
+}
+
+/* The attributes in skb parsed by the policy into tb */
+static int
+parse_attrs(struct nlattr **tb, int maxtype, struct sk_buff *skb,
+	    const struct nla_policy *policy)
+{
+	if (nla_parse(tb, maxtype, (struct nlattr *)skb->data, skb->len,
+		      policy, NULL))
+		return -IPSET_ERR_PROTOCOL;
+	return 0;
+}
+
+int
+kshim_set_create(struct kshim_set **sp, const char *name,
+		 const char *typename, uint8_t family,
+		 const struct kshim_set_opts *opts)
+{
+	struct nlattr *tb[IPSET_ATTR_CREATE_MAX + 1] = {};
+	struct kshim_set *s;
+	struct ip_set *set;
+	struct sk_buff *skb;
+	int revision, ret = -IPSET_ERR_FIND_TYPE;
+
+	skb = alloc_skb(KSHIM_ATTR_SIZE, GFP_KERNEL);
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	set = kzalloc(sizeof(*set), GFP_KERNEL);
+	if (!skb || !s || !set) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	spin_lock_init(&set->lock);
+	strlcpy(set->name, name, IPSET_MAXNAMELEN);
+	set->net = &init_net;
+	set->family = family;
+	/* The newest revision of the type */
+	for (revision = IPSET_REVISION_MAX; revision >= 0; revision--) {
+		set->type = kshim_find_set_type(typename, family, revision);
+		if (set->type)
+			break;
+	}
+	if (!set->type)
+		goto out;
+	set->revision = revision;
+
+	if ((opts->hashsize &&
+	     nla_put_net32(skb, IPSET_ATTR_HASHSIZE, htonl(opts->hashsize))) ||
+	    (opts->maxelem &&
+	     nla_put_net32(skb, IPSET_ATTR_MAXELEM, htonl(opts->maxelem))) ||
+	    (opts->timeout &&
+	     nla_put_net32(skb, IPSET_ATTR_TIMEOUT, htonl(opts->timeout))) ||
+	    (opts->cadt_flags &&
+	     nla_put_net32(skb, IPSET_ATTR_CADT_FLAGS,
+			   htonl(opts->cadt_flags))) ||
+	    (opts->netmask &&
+	     nla_put_u8(skb, IPSET_ATTR_NETMASK, opts->netmask)) ||
+	    (!any_ip(opts->ip) &&
+	     put_ipaddr(skb, IPSET_ATTR_IP, family, opts->ip)) ||
+	    (!any_ip(opts->ip_to) &&
+	     put_ipaddr(skb, IPSET_ATTR_IP_TO, family, opts->ip_to))) {
+		ret = -EMSGSIZE;
+		goto out;
+	}
+	ret = parse_attrs(tb, IPSET_ATTR_CREATE_MAX, skb,
+			  set->type->create_policy);
+	if (ret)
+		goto out;
+	set->flags |= set->type->create_flags[revision];
+	ret = set->type->create(&init_net, set, tb, 0);
+	if (ret)
+		goto out;
+	if (set->extensions & IPSET_EXT_MATCH)
+		static_branch_inc(&ip_set_match_ext_key);
+	s->set = set;
+	*sp = s;
+	set = NULL;
+	s = NULL;
+out:
+	kfree_skb(skb);
+	kfree(set);
+	kfree(s);
+	return ret;
+}
+
+void
+kshim_set_destroy(struct kshim_set *s)
+{
+	struct ip_set *set = s->set;
+
+	if (s->listing)
+		kshim_set_list_end(s);
+	set->variant->destroy(set);
+	if (set->extensions & IPSET_EXT_MATCH)
+		static_branch_dec(&ip_set_match_ext_key);
+	kfree(set);
+	kfree(s);
+	kshim_quiesce();
+}
+
+const char *
+kshim_set_typename(const struct kshim_set *s)
+{
+	return s->set->type->name;
+}
+
+uint8_t
+kshim_set_family(const struct kshim_set *s)
+{
+	return s->set->family;
+}
+
+int
+kshim_set_variant_of(struct kshim_set *s, const struct kshim_set *from)
+{
+	if (s->set->type != from->set->type ||
+	    s->set->family != from->set->family)
+		return -IPSET_ERR_TYPE_MISMATCH;
+	s->set->variant = from->set->variant;
+	return 0;
+}
+
+static void
+ip_set_lock(struct ip_set *set)
+{
+	if (!set->variant->region_lock)
+		spin_lock_bh(&set->lock);
+}
+
+static void
+ip_set_unlock(struct ip_set *set)
+{
+	if (!set->variant->region_lock)
+		spin_unlock_bh(&set->lock);
+}
+
+/* As CALL_AD */
+static int
+call_ad(struct ip_set *set, struct nlattr *tb[], enum ipset_adt adt,
+	u32 flags)
+{
+	int ret;
+	u32 lineno = 0;
+	bool eexist = flags & IPSET_FLAG_EXIST, retried = false;
+
+	do {
+		ip_set_lock(set);
+		ret = set->variant->uadt(set, tb, adt, &lineno, flags, retried);
+		ip_set_unlock(set);
+		retried = true;
+	} while (ret == -EAGAIN &&
+		 set->variant->resize &&
+		 (ret = set->variant->resize(set, retried)) == 0);
+	ip_set_gen_bump(set);
+
+	if (!ret || (ret == -IPSET_ERR_EXIST && eexist))
+		return 0;
+	return ret;
+}
+
+int
+kshim_set_uadt(struct kshim_set *s, int adt, const struct kshim_elem *elem,
+	       uint32_t flags)
+{
+	struct nlattr *tb[IPSET_ATTR_ADT_MAX + 1] = {};
+	struct ip_set *set = s->set;
+	u8 family = set->family;
+	struct sk_buff *skb;
+	u32 lineno = 0;
+	int ret;
+
+	if (family == NFPROTO_UNSPEC)
+		family = NFPROTO_IPV4;
+	skb = alloc_skb(KSHIM_ATTR_SIZE, GFP_KERNEL);
+	if (!skb)
+		return -ENOMEM;
+	if (put_ipaddr(skb, IPSET_ATTR_IP, family, elem->ip) ||
+	    (elem->range &&
+	     put_ipaddr(skb, IPSET_ATTR_IP_TO, family, elem->ip_to)) ||
+	    (elem->cidr && nla_put_u8(skb, IPSET_ATTR_CIDR, elem->cidr)) ||
+	    (elem->with_timeout &&
+	     nla_put_net32(skb, IPSET_ATTR_TIMEOUT, htonl(elem->timeout))) ||
+	    (elem->comment &&
+	     nla_put_string(skb, IPSET_ATTR_COMMENT, elem->comment))) {
+		ret = -EMSGSIZE;
+		goto out;
+	}
+	ret = parse_attrs(tb, IPSET_ATTR_ADT_MAX, skb, set->type->adt_policy);
+	if (ret)
+		goto out;
+	if (adt == IPSET_TEST) {
+		/* As ip_set_utest */
+		rcu_read_lock_bh();
+		ret = set->variant->uadt(set, tb, IPSET_TEST, &lineno, 0, 0);
+		rcu_read_unlock_bh();
+		/* Userspace can't trigger element to be re-added */
+		if (ret == -EAGAIN)
+			ret = 1;
+		ret = ret > 0 ? 0 : -IPSET_ERR_EXIST;
+		goto out;
+	}
+	if (set->variant->batch)
+		set->variant->batch(set, true);
+	ret = call_ad(set, tb, adt, flags);
+	if (set->variant->batch) {
+		set->variant->batch(set, false);
+		ip_set_gen_bump(set);
+	}
+out:
+	kfree_skb(skb);
+	return ret;
+}
+
+/* An IPv4 or IPv6 packet with the address as source and destination */
+static struct sk_buff *
+kadt_skb(u8 family, const u8 *ip)
+{
+	size_t len = family == NFPROTO_IPV4 ? sizeof(struct iphdr)
+					    : sizeof(struct ipv6hdr);
+	struct sk_buff *skb = alloc_skb(len, GFP_ATOMIC);
+
+	if (!skb)
+		return NULL;
+	memset(skb_put(skb, len), 0, len);
+	skb->network_header = 0;
+	if (family == NFPROTO_IPV4) {
+		struct iphdr *iph = ip_hdr(skb);
+
+		iph->version = 4;
+		iph->ihl = sizeof(struct iphdr) / 4;
+		iph->protocol = IPPROTO_RAW;
+		iph->tot_len = htons(len);
+		memcpy(&iph->saddr, ip, sizeof(iph->saddr));
+		memcpy(&iph->daddr, ip, sizeof(iph->daddr));
+		skb->protocol = htons(ETH_P_IP);
+	} else {
+		struct ipv6hdr *ip6h = ipv6_hdr(skb);
+
+		ip6h->version = 6;
+		ip6h->nexthdr = IPPROTO_RAW;
+		memcpy(&ip6h->saddr, ip, sizeof(ip6h->saddr));
+		memcpy(&ip6h->daddr, ip, sizeof(ip6h->daddr));
+		skb->protocol = htons(ETH_P_IPV6);
+	}
+	return skb;
+}
+
+int
+kshim_set_kadt(struct kshim_set *s, int adt, const uint8_t *ip)
+{
+	struct ip_set *set = s->set;
+	u8 family = set->family == NFPROTO_UNSPEC ? NFPROTO_IPV4 : set->family;
+	struct nf_hook_state state = {
+		.pf	= family,
+		.net	= &init_net,
+	};
+	struct xt_action_param par = {
+		.state	= &state,
+	};
+	struct ip_set_adt_opt opt = {
+		.family = family,
+		.dim = IPSET_DIM_MAX,
+		.flags = (1 << IPSET_DIM_MAX) - 1,
+		.ext.timeout = UINT_MAX,
+	};
+	struct sk_buff *skb = kadt_skb(family, ip);
+	int ret;
+
+	if (!skb)
+		return -ENOMEM;
+	if (adt == IPSET_TEST) {
+		/* As ip_set_test */
+		rcu_read_lock_bh();
+		ret = set->variant->kadt(set, skb, &par, IPSET_TEST, &opt);
+		rcu_read_unlock_bh();
+		if (ret == -EAGAIN) {
+			ip_set_lock(set);
+			set->variant->kadt(set, skb, &par, IPSET_ADD, &opt);
+			ip_set_unlock(set);
+			ret = 1;
+		}
+		ret = ret < 0 ? 0 : ret;
+	} else {
+		/* As ip_set_add and ip_set_del */
+		ip_set_lock(set);
+		ret = set->variant->kadt(set, skb, &par, adt, &opt);
+		ip_set_unlock(set);
+		if (ret == -EAGAIN && adt == IPSET_ADD &&
+		    set->variant->resize &&
+		    (ret = set->variant->resize(set, true)) == 0) {
+			ip_set_lock(set);
+			ret = set->variant->kadt(set, skb, &par, adt, &opt);
+			ip_set_unlock(set);
+		}
+		ip_set_gen_bump(set);
+	}
+	kfree_skb(skb);
+	return ret;
+}
+
+int
+kshim_set_resize(struct kshim_set *s)
+{
+	struct ip_set *set = s->set;
+
+	if (!set->variant->resize)
+		return -EOPNOTSUPP;
+	return set->variant->resize(set, false);
+}
+
+int
+kshim_set_freeze(struct kshim_set *s, bool freeze)
+{
+	struct ip_set *set = s->set;
+
+	if (!set->variant->freeze)
+		return -EOPNOTSUPP;
+	return set->variant->freeze(set, freeze);
+}
+
+int
+kshim_set_purge(struct kshim_set *s, uint32_t timeout)
+{
+	struct ip_set *set = s->set;
+	struct ip_set_purge p = {
+		.bytes = ULLONG_MAX,
+		.packets = ULLONG_MAX,
+		.timeout = timeout,
+	};
+	int ret;
+
+	if (!set->variant->purge)
+		return -EOPNOTSUPP;
+	if (!SET_WITH_TIMEOUT(set))
+		return -IPSET_ERR_TIMEOUT;
+	ret = set->variant->purge(set, &p);
+	ip_set_gen_bump(set);
+	return ret;
+}
+
+void
+kshim_set_flush(struct kshim_set *s)
+{
+	struct ip_set *set = s->set;
+
+	ip_set_lock(set);
+	set->variant->flush(set);
+	ip_set_unlock(set);
+	ip_set_gen_bump(set);
+}
+
+int
+kshim_set_header(struct kshim_set *s, uint32_t *elements, uint32_t *memsize)
+{
+	struct nlattr *tb[IPSET_ATTR_CREATE_MAX + 1];
+	struct nlattr *data;
+	struct sk_buff *skb;
+	int ret;
+
+	skb = alloc_skb(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!skb)
+		return -ENOMEM;
+	ret = s->set->variant->head(s->set, skb, NULL);
+	if (ret < 0)
+		goto out;
+	data = (struct nlattr *)skb->data;
+	ret = -IPSET_ERR_PROTOCOL;
+	if (!nla_ok(data, skb->len) || nla_type(data) != IPSET_ATTR_DATA ||
+	    nla_parse_nested(tb, IPSET_ATTR_CREATE_MAX, data, NULL, NULL))
+		goto out;
+	*elements = tb[IPSET_ATTR_ELEMENTS] ?
+		    ip_set_get_h32(tb[IPSET_ATTR_ELEMENTS]) : 0;
+	*memsize = tb[IPSET_ATTR_MEMSIZE] ?
+		   ip_set_get_h32(tb[IPSET_ATTR_MEMSIZE]) : 0;
+	ret = 0;
+out:
+	kfree_skb(skb);
+	return ret;
+}
+
+/* Listing, as ip_set_dump_do for a single set */
+
+int
+kshim_set_list_start(struct kshim_set *s, unsigned int msgsize)
+{
+	if (s->listing)
+		return -EBUSY;
+	memset(&s->cb, 0, sizeof(s->cb));
+	s->cb.args[IPSET_CB_NET] = (unsigned long)&init_net;
+	s->cb.args[IPSET_CB_PROTO] = IPSET_PROTOCOL;
+	s->cb.args[IPSET_CB_DUMP] = 2;	/* DUMP_ONE */
+	s->msgsize = msgsize;
+	s->listing = true;
+	s->set->ref_netlink++;
+	return 0;
+}
+
+/* The dumped addresses lack the network byte order flag, parse them
+ * as the userspace library does
+ */
+static int
+list_ipaddr(const struct nlattr *nla, u8 family, u8 *ip)
+{
+	struct nlattr *tb[IPSET_ATTR_IPADDR_MAX + 1];
+	int type = family == NFPROTO_IPV6 ? IPSET_ATTR_IPADDR_IPV6
+					  : IPSET_ATTR_IPADDR_IPV4;
+	int len = family == NFPROTO_IPV6 ? 16 : 4;
+
+	if (nla_parse_nested(tb, IPSET_ATTR_IPADDR_MAX, nla, NULL, NULL) ||
+	    !tb[type] || nla_len(tb[type]) != len)
+		return -IPSET_ERR_PROTOCOL;
+	memcpy(ip, nla_data(tb[type]), len);
+	return 0;
+}
+
+static int
+list_elem(const struct nlattr *nla, u8 family, kshim_list_fn fn, void *priv)
+{
+	struct nlattr *tb[IPSET_ATTR_ADT_MAX + 1];
+	struct kshim_elem elem = {};
+	int ret;
+
+	if (nla_parse_nested(tb, IPSET_ATTR_ADT_MAX, nla, NULL, NULL) ||
+	    !tb[IPSET_ATTR_IP])
+		return -IPSET_ERR_PROTOCOL;
+	ret = list_ipaddr(tb[IPSET_ATTR_IP], family, elem.ip);
+	if (ret)
+		return ret;
+	if (tb[IPSET_ATTR_IP_TO]) {
+		ret = list_ipaddr(tb[IPSET_ATTR_IP_TO], family, elem.ip_to);
+		if (ret)
+			return ret;
+		elem.range = true;
+	}
+	if (tb[IPSET_ATTR_CIDR])
+		elem.cidr = nla_get_u8(tb[IPSET_ATTR_CIDR]);
+	if (tb[IPSET_ATTR_TIMEOUT]) {
+		elem.with_timeout = true;
+		elem.timeout = ip_set_get_h32(tb[IPSET_ATTR_TIMEOUT]);
+	}
+	if (tb[IPSET_ATTR_COMMENT])
+		elem.comment = nla_data(tb[IPSET_ATTR_COMMENT]);
+	return fn ? fn(priv, &elem) : 0;
+}
+
+int
+kshim_set_list_step(struct kshim_set *s, kshim_list_fn fn, void *priv)
+{
+	struct ip_set *set = s->set;
+	u8 family = set->family == NFPROTO_UNSPEC ? NFPROTO_IPV4 : set->family;
+	const struct nlattr *adt, *nla;
+	struct sk_buff *skb;
+	int rem, ret;
+
+	if (!s->listing)
+		return -EINVAL;
+	skb = alloc_skb(s->msgsize, GFP_KERNEL);
+	if (!skb)
+		return -ENOMEM;
+	if (!s->uref && set->variant->uref) {
+		set->variant->uref(set, &s->cb, true);
+		s->uref = true;
+	}
+	ret = set->variant->list(set, skb, &s->cb);
+	if (ret < 0)
+		goto out;
+	adt = (const struct nlattr *)skb->data;
+	if (skb->len && nla_ok(adt, skb->len) &&
+	    nla_type(adt) == IPSET_ATTR_ADT) {
+		nla_for_each_nested(nla, adt, rem) {
+			ret = list_elem(nla, family, fn, priv);
+			if (ret)
+				goto out;
+		}
+	}
+	ret = s->cb.args[IPSET_CB_ARG0] ? 1 : 0;
+out:
+	kfree_skb(skb);
+	if (ret <= 0)
+		kshim_set_list_end(s);
+	return ret;
+}
+
+void
+kshim_set_list_end(struct kshim_set *s)
+{
+	struct ip_set *set = s->set;
+
+	if (!s->listing)
+		return;
+	if (s->uref)
+		set->variant->uref(set, &s->cb, false);
+	s->uref = false;
+	s->cb.args[IPSET_CB_ARG0] = 0;
+	set->ref_netlink--;
+	s->listing = false;
+}
@@ -0,0 +1,101 @@
+/* Copyright (C) 2003-2013 Jozsef Kadlecsik <kadlec@netfilter.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#ifndef KSHIM_SET_H
+#define KSHIM_SET_H
+
+/* The interface of the set types compiled in userspace. The functions
+ * do what the core module does for the corresponding netlink commands
+ * and packet matches; the return values are the ones of the kernel,
+ * i.e. zero or negative errno and IPSET_ERR_* codes.
+ *
+ * The header is independent from the kernel API emulation, the families
+ * are the NFPROTO_* ones, the adt are the enum ipset_adt values and the
+ * flags are the IPSET_FLAG_* constants of <linux/netfilter/ipset/ip_set.h>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct kshim_set;
+
+/* Create parameters, the zero values are not sent */
+struct kshim_set_opts {
+	uint32_t hashsize;
+	uint32_t maxelem;
+	uint32_t timeout;
+	uint32_t cadt_flags;
+	uint8_t netmask;
+	/* Range of the bitmap types, network order */
+	uint8_t ip[16];
+	uint8_t ip_to[16];
+};
+
+/* An element, the addresses in network order */
+struct kshim_elem {
+	uint8_t ip[16];
+	uint8_t ip_to[16];
+	bool range;		/* ip_to is sent */
+	uint8_t cidr;		/* zero when not sent */
+	bool with_timeout;
+	uint32_t timeout;
+	const char *comment;
+};
+
+typedef int (*kshim_list_fn)(void *priv, const struct kshim_elem *elem);
+
+/* Register the compiled set types and the global state */
+extern int kshim_set_init(void);
+extern void kshim_set_fini(void);
+
+extern int kshim_set_create(struct kshim_set **set, const char *name,
+			    const char *typename, uint8_t family,
+			    const struct kshim_set_opts *opts);
+extern void kshim_set_destroy(struct kshim_set *set);
+extern const char *kshim_set_typename(const struct kshim_set *set);
+extern uint8_t kshim_set_family(const struct kshim_set *set);
+/* Run the set with the functions of another set of the same type and
+ * family, like a set without extensions with the generic ones
+ */
+extern int kshim_set_variant_of(struct kshim_set *set,
+				const struct kshim_set *from);
+
+/* Userspace add/del/test, a batch of one element */
+extern int kshim_set_uadt(struct kshim_set *set, int adt,
+			  const struct kshim_elem *elem, uint32_t flags);
+/* Packet path add/del/test with the address as source, the test
+ * returns positive for a match
+ */
+extern int kshim_set_kadt(struct kshim_set *set, int adt, const uint8_t *ip);
+extern int kshim_set_resize(struct kshim_set *set);
+extern int kshim_set_freeze(struct kshim_set *set, bool freeze);
+/* Delete the elements with less than timeout seconds remaining */
+extern int kshim_set_purge(struct kshim_set *set, uint32_t timeout);
+extern void kshim_set_flush(struct kshim_set *set);
+/* The number of elements and the memory size, from the set header */
+extern int kshim_set_header(struct kshim_set *set, uint32_t *elements,
+			    uint32_t *memsize);
+
+/* Listing: every step fills a message of msgsize bytes and calls fn for
+ * its elements. The step returns positive while the listing goes on, the
+ * set may be modified between the steps.
+ */
+extern int kshim_set_list_start(struct kshim_set *set, unsigned int msgsize);
+extern int kshim_set_list_step(struct kshim_set *set, kshim_list_fn fn,
+			       void *priv);
+extern void kshim_set_list_end(struct kshim_set *set);
+
+/* The kernel clock and the deferred work, see kshim.h */
+extern void kshim_seed(unsigned long long seed);
+extern void kshim_advance(unsigned long ticks);
+extern void kshim_quiesce(void);
+extern void kshim_fail_alloc(long after);
+extern unsigned long long ktime_get_ns(void);
+extern int kshim_verbose;
+
+#define KSHIM_HZ	1000
+
+#endif /* KSHIM_SET_H */
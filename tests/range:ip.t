@@ -0,0 +1,65 @@
+# Range: Create a set
+0 ipset -N test range:ip
+# Range: Add a range
+0 ipset -A test 10.0.0.10-10.0.0.20
+# Range: Add the same range again
+1 ipset -A test 10.0.0.10-10.0.0.20
+# Range: Add a covered range with -exist
+0 ipset -! -A test 10.0.0.12-10.0.0.15
+# Range: Test the first address of the range
+0 ipset -T test 10.0.0.10
+# Range: Test the last address of the range
+0 ipset -T test 10.0.0.20
+# Range: Test an address below the range
+1 ipset -T test 10.0.0.9
+# Range: Test an address above the range
+1 ipset -T test 10.0.0.21
+# Range: Add an adjacent network
+0 ipset -A test 10.0.0.21/32
+# Range: Add an overlapping range
+0 ipset -A test 10.0.0.5-10.0.0.11
+# Range: Check that the ranges are merged
+0 ipset -L test | grep -q '^10.0.0.5-10.0.0.21$'
+# Range: Check the number of elements
+0 ipset -L test | grep -q '^Number of entries: 1$'
+# Range: Test a covered range
+0 ipset -T test 10.0.0.6-10.0.0.20
+# Range: Test a partially covered range
+1 ipset -T test 10.0.0.6-10.0.0.22
+# Range: Delete from the middle of the range
+0 ipset -D test 10.0.0.12-10.0.0.13
+# Range: Test a deleted address
+1 ipset -T test 10.0.0.12
+# Range: Check that the range is split
+0 ipset -L test | grep -q '^10.0.0.14-10.0.0.21$'
+# Range: Delete a range not in the set
+1 ipset -D test 192.168.0.0/24
+# Range: Add a large network
+0 ipset -A test 172.16.0.0/12
+# Range: Test an address of the network
+0 ipset -T test 172.31.255.255
+# Range: Flush the set
+0 ipset -F test
+# Range: Test an address after flush
+1 ipset -T test 10.0.0.14
+# Range: Destroy the set
+0 ipset -X test
+# Range: Create an IPv6 set with maxelem
+0 ipset -N test range:ip family inet6 maxelem 2
+# Range: Add an IPv6 range
+0 ipset -A test 2001:db8::1-2001:db8::ff
+# Range: Add an IPv6 network
+0 ipset -A test 2001:db8:1::/48
+# Range: Add a range over maxelem
+1 ipset -A test 2001:db8:2::1-2001:db8:2::2
+# Range: Add an adjacent range at maxelem
+0 ipset -A test 2001:db8::100-2001:db8::1ff
+# Range: Test an IPv6 address of the merged range
+0 ipset -T test 2001:db8::180
+# Range: Test an IPv6 address of the network
+0 ipset -T test 2001:db8:1:ffff::1
+# Range: Test an IPv6 address not in the set
+1 ipset -T test 2001:db8::200
+# Range: Destroy the set
+0 ipset -X test
+# eof
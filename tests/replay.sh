@@ -0,0 +1,294 @@
+#!/bin/bash
+
+# Per packet cost of the set match of iptables, for sets of every type.
+#
+#	replay.sh [-n packets] [-e elements] [-t "types"] [-m "matches"]
+#		  [-r pcap -f restore-file [-d dims]] [-o file]
+#
+# The packets are sent over a veth pair into a network namespace, where
+# the raw PREROUTING chain matches them against the set "replay" and
+# drops them. The synthetic IPv4 traffic is generated by pktgen, the
+# source addresses and the ports are random, about half of the packets
+# match the generated set. With -r the pcap is replayed by tcpreplay
+# instead, against the sets of the restore file and the dimensions of
+# -d (src by default).
+#
+# The results are printed as CSV lines, one per set type and match:
+#
+#	type,dims,match,packets,pps,ns,base_ns,ipset_ns,tests,hits
+#
+# ns is the time per packet with the match rule, base_ns without it,
+# ipset_ns the difference. tests and hits are counted by the set in
+# /proc/net/ip_set/stats, the statistics of the ip_set module are enabled
+# for the run. iptables selects the newest set match revision
+# of the kernel, the matches cover the flags of the older revisions:
+#
+#	match		plain match (revision 0 and 1)
+#	nomatch		--return-nomatch (revision 2)
+#	noupdate	! --update-counters ! --update-subcounters (3)
+#	packets		--packets-gt 0 --bytes-lt 1000000000 (3 and 4)
+#
+# The sets are created with counters, so the matches update them.
+
+ipset=${IPSET_BIN:-../src/ipset}
+
+packets=1000000
+elements=100000
+types="bitmap:ip bitmap:port hash:ip hash:ip,port hash:ip,port,ip
+hash:ip,port,net hash:net hash:net,net hash:net,port hash:net,port,net
+list:set"
+matches="match nomatch noupdate packets"
+pcap=
+restore=
+dims=src
+out=/dev/stdout
+
+while getopts "n:e:t:m:r:f:d:o:" opt; do
+    case $opt in
+    n) packets="$OPTARG";;
+    e) elements="$OPTARG";;
+    t) types="$OPTARG";;
+    m) matches="$OPTARG";;
+    r) pcap="$OPTARG";;
+    f) restore="$OPTARG";;
+    d) dims="$OPTARG";;
+    o) out="$OPTARG";;
+    *) echo "Usage: $0 [-n packets] [-e elements] [-t types] [-m matches] [-r pcap -f restore-file [-d dims]] [-o file]" >&2
+       exit 1;;
+    esac
+done
+
+if [ -n "$pcap" ] && [ -z "$restore" ]; then
+    echo "The sets of the pcap replay are read from the file of -f" >&2
+    exit 1
+fi
+if [ $(id -u) -ne 0 ] || ! $ipset version >/dev/null 2>&1; then
+    echo "$ipset cannot talk to the kernel, skipping the replay" >&2
+    exit 0
+fi
+for cmd in ip iptables ip6tables; do
+    if ! command -v $cmd >/dev/null; then
+        echo "$cmd is not installed, skipping the replay" >&2
+        exit 0
+    fi
+done
+if [ -n "$pcap" ]; then
+    for cmd in tcpreplay tcprewrite; do
+        if ! command -v $cmd >/dev/null; then
+            echo "$cmd is not installed, skipping the replay" >&2
+            exit 0
+        fi
+    done
+elif ! modprobe pktgen 2>/dev/null || [ ! -d /proc/net/pktgen ]; then
+    echo "pktgen is not available, skipping the replay" >&2
+    exit 0
+fi
+
+# For correct sorting:
+LC_ALL=C
+export LC_ALL
+
+ns=ipset-replay.$$
+tmp=${TMPDIR:-/tmp}/ipset-replay.$$
+param=/sys/module/ip_set/parameters/stats
+stats_was=$(cat $param 2>/dev/null)
+trap 'ip netns del $ns 2>/dev/null; ip link del ipr0 2>/dev/null;
+      [ -z "$pcap" ] && echo "rem_device_all" > /proc/net/pktgen/kpktgend_0;
+      [ "$stats_was" = N ] && echo 0 > $param;
+      rm -f $tmp $tmp.*' EXIT
+echo 1 > $param 2>/dev/null
+
+ip netns add $ns || exit 1
+ip link add ipr0 type veth peer name ipr1 || exit 1
+ip link set ipr1 netns $ns
+ip addr add 10.254.0.1/30 dev ipr0
+ip link set ipr0 up
+ip netns exec $ns ip addr add 10.254.0.2/30 dev ipr1
+ip netns exec $ns ip link set lo up
+ip netns exec $ns ip link set ipr1 up
+mac=$(ip netns exec $ns cat /sys/class/net/ipr1/address)
+
+nsipset() {
+    ip netns exec $ns $ipset "$@"
+}
+
+# The traffic: random sources from 16.0.0.0 in the span of addresses
+# and random UDP ports from 1 to 16, towards 10.254.0.2. The generated
+# sets contain the first half of the span.
+span=
+gen() {
+    local type=$1
+    local n=$2
+
+    case $type in
+    bitmap:ip) [ $n -gt 32768 ] && n=32768
+               echo "create replay $type range 16.0.0.0/16 counters";;
+    bitmap:port) echo "create replay $type range 0-65535 counters"
+                 span=2
+                 echo "add replay 1-8"
+                 return;;
+    list:set) echo "create replay0 hash:ip hashsize $(( n / 8 + 64 )) maxelem $n counters"
+              echo "create replay $type counters"
+              echo "add replay replay0";;
+    *) echo "create replay $type hashsize $(( n / 8 + 64 )) maxelem $n counters";;
+    esac
+    case $type in
+    hash:net,port*) span=$(( 2 * n * 4 / 16 ));;
+    hash:ip,port*) span=$(( 2 * n / 16 ));;
+    hash:net*) span=$(( 2 * n * 4 ));;
+    *) span=$(( 2 * n ));;
+    esac
+    [ $span -lt 2 ] && span=2
+    awk -v n=$n -v type=$type '
+    function ip4(v) {
+        v += 16 * 16777216
+        return sprintf("%d.%d.%d.%d", int(v / 16777216),
+                       int(v / 65536) % 256, int(v / 256) % 256, v % 256)
+    }
+    BEGIN {
+        set = type == "list:set" ? "replay0" : "replay"
+        for (i = 0; i < n; i++) {
+            ip = ip4(i)
+            port = "udp:" 1 + i % 16
+            if (type ~ /,port/)
+                ip = ip4(int(i / 16))
+            net = ip "/30"
+            if (type ~ /^hash:net/)
+                net = ip4(int(type ~ /,port/ ? i / 16 : i) * 4) "/30"
+            if (type == "hash:ip,port")
+                e = ip "," port
+            else if (type == "hash:ip,port,ip")
+                e = ip "," port ",10.254.0.2"
+            else if (type == "hash:ip,port,net")
+                e = ip "," port ",10.254.0.0/30"
+            else if (type == "hash:net")
+                e = net
+            else if (type == "hash:net,net")
+                e = net ",10.254.0.0/30"
+            else if (type == "hash:net,port")
+                e = net "," port
+            else if (type == "hash:net,port,net")
+                e = net "," port ",10.254.0.0/30"
+            else
+                e = ip
+            print "add " set " " e
+        }
+    }'
+}
+
+# The match dimensions of the type
+type_dims() {
+    case $1 in
+    bitmap:port) echo dst;;
+    *:*,port,*) echo src,dst,dst;;
+    *:*,port|hash:net,net) echo src,dst;;
+    *) echo src;;
+    esac
+}
+
+match_flags() {
+    case $1 in
+    match) ;;
+    nomatch) echo "--return-nomatch";;
+    noupdate) echo "! --update-counters ! --update-subcounters";;
+    packets) echo "--packets-gt 0 --bytes-lt 1000000000";;
+    esac
+}
+
+pgset() {
+    echo "$2" > /proc/net/pktgen/$1
+}
+
+# Send the packets, prints the packets sent and per second
+send() {
+    if [ -n "$pcap" ]; then
+        tcpreplay -q -t -i ipr0 $tmp.pcap 2>&1 | awk '
+            /Actual:/ { sent = $2 }
+            /Rated:/ { pps = $(NF - 1) }
+            END { print sent, pps }'
+        return
+    fi
+    pgset kpktgend_0 "rem_device_all"
+    pgset kpktgend_0 "add_device ipr0"
+    pgset ipr0 "count $packets"
+    pgset ipr0 "pkt_size 64"
+    pgset ipr0 "dst 10.254.0.2"
+    pgset ipr0 "dst_mac $mac"
+    pgset ipr0 "src_min 16.0.0.0"
+    pgset ipr0 "src_max $(awk -v v=$((span - 1)) 'BEGIN {
+        v += 16 * 16777216
+        printf("%d.%d.%d.%d", int(v / 16777216), int(v / 65536) % 256,
+               int(v / 256) % 256, v % 256) }')"
+    pgset ipr0 "udp_src_min 1"
+    pgset ipr0 "udp_src_max 16"
+    pgset ipr0 "udp_dst_min 1"
+    pgset ipr0 "udp_dst_max 16"
+    pgset ipr0 "flag IPSRC_RND"
+    pgset ipr0 "flag UDPSRC_RND"
+    pgset ipr0 "flag UDPDST_RND"
+    pgset pgctrl "start"
+    awk '/^Result: OK:/ { sent = $5 }
+         /pps/ { sub("pps", "", $1); pps = $1 }
+         END { print sent, pps }' /proc/net/pktgen/ipr0
+}
+
+# The lookups of the set since the last call: prints tests,hits
+stats() {
+    local t h
+
+    read t h < <(ip netns exec $ns awk '$1 == "replay" { print $2, $3 }' \
+                 /proc/net/ip_set/stats)
+    echo "$(( ${t:-0} - ${last_tests:-0} )),$(( ${h:-0} - ${last_hits:-0} ))"
+    last_tests=${t:-0}
+    last_hits=${h:-0}
+}
+
+# The rule matching the set, in the table of its family
+rule() {
+    local op=$1 cmd=iptables
+
+    shift
+    nsipset -t list replay | grep -q '^Header: family inet6' &&
+        cmd=ip6tables
+    ip netns exec $ns $cmd -t raw $op PREROUTING -i ipr1 \
+        -m set --match-set replay "$@" -j DROP
+}
+
+nsec() {
+    awk -v pps=$1 'BEGIN { printf("%.1f", pps > 0 ? 1e9 / pps : 0) }'
+}
+
+if [ -n "$pcap" ]; then
+    tcprewrite --enet-dmac=$mac -i "$pcap" -o $tmp.pcap || exit 1
+    nsipset restore < "$restore" || exit 1
+    types=$(nsipset -t list replay | sed -n 's/^Type: //p')
+    if [ -z "$types" ]; then
+        echo "The restore file has no set named replay" >&2
+        exit 1
+    fi
+fi
+
+# Every packet is dropped at the end of the chain
+ip netns exec $ns iptables -t raw -A PREROUTING -i ipr1 -j DROP
+ip netns exec $ns ip6tables -t raw -A PREROUTING -i ipr1 -j DROP
+echo "type,dims,match,packets,pps,ns,base_ns,ipset_ns,tests,hits" > $out
+for type in $types; do
+    echo "$type" >&2
+    if [ -z "$pcap" ]; then
+        nsipset x replay 2>/dev/null
+        nsipset x replay0 2>/dev/null
+        gen $type $elements > $tmp
+        nsipset restore < $tmp || exit 1
+        dims=$(type_dims $type)
+    fi
+    read sent base < <(send)
+    base_ns=$(nsec $base)
+    stats > /dev/null
+    for match in $matches; do
+        rule -I $dims $(match_flags $match)
+        read sent pps < <(send)
+        rule -D $dims $(match_flags $match)
+        ns=$(nsec $pps)
+        echo "$type,${dims//,/ },$match,$sent,$pps,$ns,$base_ns,$(awk -v a=$ns -v b=$base_ns 'BEGIN { printf("%.1f", a - b) }'),$(stats)" >> $out
+    done
+done
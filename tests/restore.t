@@ -4,6 +4,24 @@
 0 ipset save > .foo && diff restore.t.multi.saved .foo
 # Delete all sets
 0 ipset x
+# Check that the hash size is given by the number of add lines
+0 (echo "create test hash:ip"; for x in `seq 1 5000`; do echo "add test 10.0.$((x/256)).$((x%256))"; done) > .foo && ipset restore < .foo
+# Check the hash size of the restored set
+0 ipset list -t test | grep -q 'hashsize 8192'
+# Delete the set
+0 ipset x test
 # Check auto-increasing maximal number of sets
 0 ./setlist_resize.sh
+# Compressed files need gzip
+skip which gzip
+# Restore the sets again
+0 ipset x; ipset restore < restore.t.multi
+# Save the sets compressed and compare
+0 ipset save -file .foo.gz && gzip -dc .foo.gz | diff restore.t.multi.saved -
+# Restore from the compressed file and compare
+0 ipset x && ipset restore -file .foo.gz && ipset save > .foo && diff restore.t.multi.saved .foo
+# Restore from a compressed pipe and compare
+0 ipset x && gzip -c restore.t.multi | ipset restore && ipset save > .foo && diff restore.t.multi.saved .foo
+# Delete all sets
+0 ipset x; rm -f .foo.gz
 # eof
@@ -14,7 +14,7 @@ tests="$tests ipportiphash hash:ip,port,ip hash:ip6,port,ip6"
 tests="$tests nethash hash:net hash:net6 hash:net,port hash:net6,port"
 tests="$tests hash:ip,port,net hash:ip6,port,net6 hash:net,net hash:net6,net6"
 tests="$tests hash:net,port,net hash:net6,port,net6"
-tests="$tests hash:net,iface.t hash:mac.t"
+tests="$tests hash:net,iface.t hash:mac.t range:ip.t"
 tests="$tests comment setlist restore"
 # tests="$tests iptree iptreemap"
 
@@ -211,4 +211,18 @@ skip which sendip >/dev/null
 0 ipset f
 # Counters and timeout: destroy sets
 0 ipset x
+# Index: create hash:net set
+0 ipset n a hash:net
+# Index: add network to set
+0 ipset a a 10.255.255.0/24
+# Index: create list set with merged index
+0 ipset n test list:set index
+# Index: check listing header
+0 ipset -L test | grep -q '^Header: .* index'
+# Index: add set to list set
+0 ipset a test a
+# Index: test set in list set
+0 ipset t test a
+# Index: destroy sets
+0 ipset x
 # eof
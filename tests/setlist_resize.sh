@@ -11,7 +11,7 @@ for x in ip_set_list_set ip_set_hash_netiface ip_set_hash_ipportnet \
 	 ip_set_hash_ipport ip_set_hash_ip ip_set_hash_netnet \
 	 ip_set_hash_netportnet ip_set_hash_ipmark ip_set_hash_mac \
 	 ip_set_bitmap_port ip_set_bitmap_ipmac \
-	 ip_set_bitmap_ip xt_set ip_set; do
+	 ip_set_bitmap_ip ip_set_range_ip xt_set ip_set; do
     rmmod $x
 done
 
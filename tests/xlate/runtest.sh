@@ -13,17 +13,31 @@ if [ ! -x "$IPSET_XLATE" ] ; then
 fi
 
 TMP=$(mktemp)
-ipset-translate restore < xlate.t &> $TMP
-if [ $? -ne 0 ]
-then
-	cat $TMP
-	echo -e "[\033[0;31mERROR\033[0m] failed to run ipset-translate"
-	exit 1
-fi
-${DIFF} -u xlate.t.nft $TMP
-if [ $? -eq 0 ]
-then
-	echo -e "[\033[0;32mOK\033[0m] tests are fine!"
-else
-	echo -e "[\033[0;31mERROR\033[0m] unexpected ipset to nftables translation"
-fi
+ret=0
+
+# xlate_test [option] restore file
+xlate_test() {
+	local file=${@: -1}
+
+	ipset-translate "${@:1:$#-1}" < $file &> $TMP
+	if [ $? -ne 0 ]
+	then
+		cat $TMP
+		echo -e "[\033[0;31mERROR\033[0m] failed to run ipset-translate"
+		exit 1
+	fi
+	${DIFF} -u $file.nft $TMP
+	if [ $? -eq 0 ]
+	then
+		echo -e "[\033[0;32mOK\033[0m] $file tests are fine!"
+	else
+		echo -e "[\033[0;31mERROR\033[0m] unexpected ipset to nftables translation of $file"
+		ret=1
+	fi
+}
+
+xlate_test restore xlate.t
+xlate_test -aggregate restore xlate-aggregate.t
+xlate_test -flower "dev eth0 ingress" restore xlate-flower.t
+rm -f $TMP
+exit $ret
@@ -0,0 +1,19 @@
+create hip1 hash:ip
+add hip1 192.168.10.2
+add hip1 192.168.10.3
+create net1 hash:net
+add net1 10.0.0.0/24
+add net1 10.0.1.0/24
+add net1 10.0.2.0/24
+add net1 10.0.3.1
+add net1 10.0.3.2
+add net1 10.1.0.0/16
+add net1 10.2.0.0/24 timeout 0
+create net2 hash:net comment
+add net2 10.0.0.0/25
+add net2 10.0.0.128/25 comment "not merged"
+add net2 10.0.1.0/24
+create hip2 hash:ip netmask 24
+add hip2 192.168.1.0
+add hip2 192.168.2.0
+add hip1 192.168.10.4
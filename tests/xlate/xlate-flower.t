@@ -0,0 +1,18 @@
+create hip1 hash:ip
+add hip1 192.168.10.2
+add hip1 192.168.10.0/30
+add hip1 10.0.0.1-10.0.0.6
+create net1 hash:net
+add net1 10.0.0.0/24
+add net1 0.0.0.0/0
+add net1 10.1.0.0/16 nomatch
+create hip6 hash:ip family inet6
+add hip6 2001:db8::1
+create ipp1 hash:ip,port
+add ipp1 192.168.10.1,tcp:80
+create hip2 hash:ip netmask 24
+add hip2 192.168.20.7
+del hip1 192.168.10.2
+expire net1 10.0.0.0/24
+flush net1
+destroy hip1